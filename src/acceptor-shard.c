@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <main.h>
+#include <main-ban.h>
+#include <common.h>
+#include <system.h>
+#include <cloexec.h>
+#include <acceptor-shard.h>
+#include <ccan/list/list.h>
+
+/* An acceptor shard serves its socket of each SO_REUSEPORT group of
+ * listeners. It runs as root like main, as it forks the workers, and
+ * keeps a copy of the bans of main, without the scores; the
+ * connections of banned clients are closed before a worker is forked.
+ */
+
+/* the interval, in milliseconds, the expired bans are removed at */
+#define SHARD_EXPIRE_INTERVAL (MAIN_EXPIRE_TIME * 1000)
+
+static struct {
+	int fd; /* the sessions are sent to main on it */
+	int ban_fd; /* the bans of main are received on it */
+	volatile sig_atomic_t reload;
+} shard = { -1, -1, 0 };
+
+static void reload_handler(int signo)
+{
+	shard.reload = 1;
+}
+
+/* Reads the bans main sent; the ones main could not send are found by
+ * main when it receives the connections of the banned clients */
+static void handle_bans(main_server_st *s)
+{
+	uint8_t buf[256];
+	ShardBanMsg *msg;
+	ssize_t ret;
+
+	while ((ret = recv(shard.ban_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		msg = shard_ban_msg__unpack(NULL, ret, buf);
+		if (msg == NULL) {
+			mslog(s, NULL, LOG_ERR, "acceptor shard: error unpacking ban message");
+			continue;
+		}
+
+		main_ban_db_mirror(s, msg->ip.data, msg->ip.len, msg->prefix, msg->expires);
+		shard_ban_msg__free_unpacked(msg, NULL);
+	}
+}
+
+/* As listen_watcher_cb() in main, except that main is sent the command
+ * socket of the worker, or the connection when worker pools are used */
+static void handle_tcp(main_server_st *s, struct listener_st *ltmp)
+{
+	struct worker_st *ws = s->ws;
+	ShardConnMsg msg = SHARD_CONN_MSG__INIT;
+	int fd, cmd_fd[2], ret;
+	pid_t pid;
+
+	fd = accept_client(s, ltmp, 1);
+	if (fd < 0)
+		return;
+
+	msg.conn_type = ltmp->sock_type;
+	msg.remote_addr.data = (void*)&ws->remote_addr;
+	msg.remote_addr.len = ws->remote_addr_len;
+	if (ws->our_addr_len > 0) {
+		msg.has_our_addr = 1;
+		msg.our_addr.data = (void*)&ws->our_addr;
+		msg.our_addr.len = ws->our_addr_len;
+	}
+
+	/* the pool worker is chosen by main */
+	if (GETPCONFIG(s)->worker_pool_size > 0) {
+		ret = send_socket_msg(s, shard.fd, CMD_SHARD_CONN, fd, &msg,
+				      (pack_size_func) shard_conn_msg__get_packed_size,
+				      (pack_func) shard_conn_msg__pack);
+		if (ret < 0)
+			mslog(s, NULL, LOG_ERR, "acceptor shard: error sending connection to main");
+		close(fd);
+		goto finish;
+	}
+
+	/* Create a command socket */
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, cmd_fd);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "error creating command socket");
+		close(fd);
+		goto finish;
+	}
+
+	pid = fork();
+	if (pid == 0) {	/* child */
+		close(cmd_fd[0]);
+		close(shard.fd);
+		close(shard.ban_fd);
+		ocsignal(SIGCHLD, SIG_DFL);
+		ocsignal(SIGHUP, SIG_IGN);
+		run_worker(s, fd, cmd_fd[1], ltmp->sock_type, 1);
+	} else if (pid == -1) {
+		mslog(s, NULL, LOG_ERR, "fork failed");
+	} else {
+		msg.has_pid = 1;
+		msg.pid = pid;
+
+		ret = send_socket_msg(s, shard.fd, CMD_SHARD_CONN, cmd_fd[0], &msg,
+				      (pack_size_func) shard_conn_msg__get_packed_size,
+				      (pack_func) shard_conn_msg__pack);
+		if (ret < 0) {
+			mslog(s, NULL, LOG_ERR, "acceptor shard: error sending worker to main");
+			kill(pid, SIGTERM);
+		}
+	}
+	close(cmd_fd[0]);
+	close(cmd_fd[1]);
+	close(fd);
+
+ finish:
+	if (GETCONFIG(s)->rate_limit_ms > 0)
+		ms_sleep(GETCONFIG(s)->rate_limit_ms);
+}
+
+/* Main is sent the datagram with a socket connected to its client;
+ * main finds the worker of the session and passes the socket to it */
+static void handle_udp(main_server_st *s, struct listener_st *ltmp)
+{
+	ShardUdpMsg msg = SHARD_UDP_MSG__INIT;
+	udp_dgram_st d;
+	int sfd, ret;
+
+	if (udp_dgram_recv(s, ltmp->fd, &d) < 0)
+		return;
+
+	sfd = udp_dgram_socket(s, ltmp, &d);
+	if (sfd < 0)
+		return;
+
+	msg.remote_addr.data = (void*)&d.cli_addr;
+	msg.remote_addr.len = d.cli_addr_size;
+	if (d.our_addr_size > 0) {
+		msg.has_our_addr = 1;
+		msg.our_addr.data = (void*)&d.our_addr;
+		msg.our_addr.len = d.our_addr_size;
+	}
+	if (!d.match_ip_only) {
+		msg.has_session_id = 1;
+		msg.session_id.data = d.session_id;
+		msg.session_id.len = d.session_id_size;
+	}
+	msg.data.data = d.data;
+	msg.data.len = d.data_size;
+
+	ret = send_socket_msg(s, shard.fd, CMD_SHARD_UDP, sfd, &msg,
+			      (pack_size_func) shard_udp_msg__get_packed_size,
+			      (pack_func) shard_udp_msg__pack);
+	if (ret < 0)
+		mslog(s, NULL, LOG_ERR, "acceptor shard: error sending UDP socket to main");
+	close(sfd);
+}
+
+/* Serves the listening sockets of shard @id until main exits */
+void acceptor_shard_server(main_server_st *s, int fd, int ban_fd, unsigned id)
+{
+	struct listener_st *ltmp = NULL, *lpos;
+	struct list_head own;
+	struct ban_db_st *db;
+	struct pollfd *pfd;
+	unsigned n, i;
+	int ret;
+
+	shard.fd = fd;
+	shard.ban_fd = ban_fd;
+
+	/* keep our listening sockets and the bans, and release
+	 * the rest of the state of main */
+	list_head_init(&own);
+	list_for_each_safe(&s->listen_list.head, ltmp, lpos, list) {
+		if (ltmp->shard != (int)id)
+			continue;
+		list_del(&ltmp->list);
+		s->listen_list.total--;
+		list_add_tail(&own, &ltmp->list);
+	}
+
+	db = s->ban_db;
+	s->ban_db = NULL;
+
+	clear_lists(s);
+	if (s->top_fd != -1) close(s->top_fd);
+	close(s->sec_mod_fd);
+	close(s->sec_mod_fd_sync);
+	s->top_fd = s->sec_mod_fd = s->sec_mod_fd_sync = -1;
+
+	list_for_each_safe(&own, ltmp, lpos, list) {
+		list_del(&ltmp->list);
+		list_add_tail(&s->listen_list.head, &ltmp->list);
+		s->listen_list.total++;
+	}
+
+	s->ban_db = db;
+	if (db)
+		db->notify = NULL;
+
+	/* the workers are not waited for; they are the sessions of main */
+	ocsignal(SIGCHLD, SIG_IGN);
+	ocsignal(SIGPIPE, SIG_IGN);
+	ocsignal(SIGTERM, SIG_DFL);
+	ocsignal(SIGINT, SIG_DFL);
+	ocsignal(SIGHUP, reload_handler);
+
+	n = s->listen_list.total + 2;
+	pfd = talloc_array(s, struct pollfd, n);
+	if (pfd == NULL)
+		exit(1);
+
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ban_fd;
+	pfd[1].events = POLLIN;
+	i = 2;
+	list_for_each(&s->listen_list.head, ltmp, list) {
+		pfd[i].fd = ltmp->fd;
+		pfd[i].events = POLLIN;
+		i++;
+	}
+
+	for (;;) {
+		ret = poll(pfd, n, SHARD_EXPIRE_INTERVAL);
+		if (ret == -1 && errno != EINTR) {
+			mslog(s, NULL, LOG_ERR, "acceptor shard: poll failed");
+			exit(1);
+		}
+
+		if (shard.reload) {
+			shard.reload = 0;
+			reload_cfg_file(s->config_pool, s->vconfig, 0);
+		}
+
+		cleanup_banned_entries(s);
+
+		if (ret <= 0)
+			continue;
+
+		/* main only writes on the ban socket; it closed its end */
+		if (pfd[0].revents != 0)
+			exit(0);
+
+		if (pfd[1].revents & POLLIN)
+			handle_bans(s);
+
+		i = 2;
+		list_for_each(&s->listen_list.head, ltmp, list) {
+			if (pfd[i].revents & POLLIN) {
+				if (ltmp->sock_type == SOCK_TYPE_UDP)
+					handle_udp(s, ltmp);
+				else
+					handle_tcp(s, ltmp);
+			}
+			i++;
+		}
+	}
+}
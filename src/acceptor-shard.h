@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef ACCEPTOR_SHARD_H
+# define ACCEPTOR_SHARD_H
+
+#include <main.h>
+
+/* With acceptor-shards set, the TCP and UDP listeners are replaced by
+ * a SO_REUSEPORT group per address, and each socket of a group is
+ * served by one of that many processes forked by main. A shard accepts
+ * the connections, checks them against its copy of the banned IPs and
+ * forks their workers; the command socket of each worker is then sent
+ * to main, which keeps the sessions, the leases and the bans. For the
+ * DTLS datagrams a shard sends main the socket connected to the client,
+ * which main passes to the session's worker. */
+
+int acceptor_shards_init(main_server_st *s);
+void acceptor_shards_deinit(void);
+void acceptor_shards_shutdown(void);
+void acceptor_shards_reload(void);
+
+void acceptor_shard_server(main_server_st *s, int fd, int ban_fd, unsigned id);
+
+#endif
@@ -84,11 +84,15 @@ static void pam_acct_close_session(void *vctx, unsigned auth_method, const struc
 	return;
 }
 
+/* PAM modules are not necessarily thread-safe */
+static pthread_mutex_t pam_acct_lock = PTHREAD_MUTEX_INITIALIZER;
+
 const struct acct_mod_st pam_acct_funcs = {
   .type = ACCT_TYPE_PAM,
   .auth_types = ALL_AUTH_TYPES,
   .open_session = pam_acct_open_session,
   .close_session = pam_acct_close_session,
+  .lock = &pam_acct_lock
 };
 
 #endif
@@ -65,10 +65,18 @@ static void acct_radius_vhost_init(void **_vctx, void *pool, void *additional)
 		vctx->nas_identifier[0] = 0;
 	}
 
+	if (gethostname(vctx->hostname, sizeof(vctx->hostname)) != 0)
+		vctx->hostname[0] = 0;
+	vctx->hostname[sizeof(vctx->hostname)-1] = 0;
+
 	if (rc_read_dictionary(vctx->rh, rc_conf_str(vctx->rh, "dictionary")) != 0) {
 		fprintf(stderr, "error reading the radius dictionary\n");
 		exit(1);
 	}
+
+	if (radius_vhost_engine(vctx, "acctserver", PW_ACCT_UDP_PORT) < 0)
+		goto fail;
+
 	*_vctx = vctx;
 
 	return;
@@ -81,134 +89,104 @@ static void acct_radius_vhost_deinit(void *_vctx)
 {
 	struct radius_vhost_ctx *vctx = _vctx;
 
+	rad_engine_free(vctx->engine);
 	if (vctx->rh != NULL)
 		rc_destroy(vctx->rh);
 }
 
-static void append_stats(rc_handle *rh, VALUE_PAIR **send, stats_st *stats)
+static void append_stats(rad_request_st *req, stats_st *stats)
 {
-	uint32_t uin, uout;
-
-	if (stats->uptime) {
-		uin = stats->uptime;
-		rc_avpair_add(rh, send, PW_ACCT_SESSION_TIME, &uin, -1, 0);
-	}
-
-	uin = stats->bytes_in;
-	uout = stats->bytes_out;
-
-	rc_avpair_add(rh, send, PW_ACCT_INPUT_OCTETS, &uin, -1, 0);
-	rc_avpair_add(rh, send, PW_ACCT_OUTPUT_OCTETS, &uout, -1, 0);
-
-	uin = stats->bytes_in / 4294967296;
-	rc_avpair_add(rh, send, PW_ACCT_INPUT_GIGAWORDS, &uin, -1, 0);
+	if (stats->uptime)
+		rad_add_int(req, PW_ACCT_SESSION_TIME, stats->uptime);
 
-	uout = stats->bytes_out / 4294967296;
-	rc_avpair_add(rh, send, PW_ACCT_OUTPUT_GIGAWORDS, &uout, -1, 0);
+	rad_add_int(req, PW_ACCT_INPUT_OCTETS, stats->bytes_in);
+	rad_add_int(req, PW_ACCT_OUTPUT_OCTETS, stats->bytes_out);
+	rad_add_int(req, PW_ACCT_INPUT_GIGAWORDS, stats->bytes_in / 4294967296);
+	rad_add_int(req, PW_ACCT_OUTPUT_GIGAWORDS, stats->bytes_out / 4294967296);
 
 	return;
 }
 
-static void append_acct_standard(struct radius_vhost_ctx *vctx, rc_handle *rh, const common_acct_info_st *ai, VALUE_PAIR **send)
+static void append_acct_standard(struct radius_vhost_ctx *vctx, rad_request_st *req, const common_acct_info_st *ai)
 {
-	uint32_t i;
-
-	if (vctx->nas_identifier[0] != 0) {
-		rc_avpair_add(rh, send, PW_NAS_IDENTIFIER, vctx->nas_identifier, -1, 0);
-	}
+	unsigned nas_ip = 0;
 
 	if (ai->our_ip[0] != 0) {
 		struct in_addr in;
 		struct in6_addr in6;
 
 		if (inet_pton(AF_INET, ai->our_ip, &in) != 0) {
-			in.s_addr = ntohl(in.s_addr);
-			rc_avpair_add(rh, send, PW_NAS_IP_ADDRESS, (char*)&in, sizeof(struct in_addr), 0);
+			nas_ip = rad_add_attr(req, PW_NAS_IP_ADDRESS, &in, sizeof(in)) == 0;
 		} else if (inet_pton(AF_INET6, ai->our_ip, &in6) != 0) {
-			rc_avpair_add(rh, send, PW_NAS_IPV6_ADDRESS, (char*)&in6, sizeof(struct in6_addr), 0);
+			nas_ip = rad_add_attr(req, PW_NAS_IPV6_ADDRESS, &in6, sizeof(in6)) == 0;
 		}
 	}
 
-	rc_avpair_add(rh, send, PW_USER_NAME, ai->username, -1, 0);
+	/* a request must carry either NAS-IP-Address or NAS-Identifier */
+	if (vctx->nas_identifier[0] != 0) {
+		rad_add_str(req, PW_NAS_IDENTIFIER, vctx->nas_identifier);
+	} else if (nas_ip == 0 && vctx->hostname[0] != 0) {
+		rad_add_str(req, PW_NAS_IDENTIFIER, vctx->hostname);
+	}
 
-	i = PW_FRAMED;
-	rc_avpair_add(rh, send, PW_SERVICE_TYPE, &i, -1, 0);
+	if (ai->id != 0)
+		rad_add_int(req, PW_NAS_PORT, ai->id);
 
-	i = PW_PPP;
-	rc_avpair_add(rh, send, PW_FRAMED_PROTOCOL, &i, -1, 0);
+	rad_add_str(req, PW_USER_NAME, ai->username);
+	rad_add_int(req, PW_SERVICE_TYPE, PW_FRAMED);
+	rad_add_int(req, PW_FRAMED_PROTOCOL, PW_PPP);
 
 	if (ai->ipv4[0] != 0) {
 		struct in_addr in;
-		if (inet_pton(AF_INET, ai->ipv4, &in) == 1) {
-			in.s_addr = ntohl(in.s_addr);
-			if (rc_avpair_add(rh, send, PW_FRAMED_IP_ADDRESS, &in, sizeof(in), 0) == NULL) {
-				return;
-			}
-		}
+		if (inet_pton(AF_INET, ai->ipv4, &in) == 1)
+			rad_add_attr(req, PW_FRAMED_IP_ADDRESS, &in, sizeof(in));
 	}
 
-#ifndef LEGACY_RADIUS /* bug in freeradius-client */
 	if (ai->ipv6[0] != 0) {
 		struct in6_addr in;
-		if (inet_pton(AF_INET6, ai->ipv6, &in) == 1) {
-			if (rc_avpair_add(rh, send, PW_FRAMED_IPV6_ADDRESS, &in, sizeof(in), 0) == NULL) {
-				return;
-			}
-		}
+		if (inet_pton(AF_INET6, ai->ipv6, &in) == 1)
+			rad_add_attr(req, PW_FRAMED_IPV6_ADDRESS, &in, sizeof(in));
 	}
-#endif
-
-	rc_avpair_add(rh, send, PW_CALLING_STATION_ID, ai->remote_ip, -1, 0);
-	rc_avpair_add(rh, send, PW_ACCT_SESSION_ID, ai->safe_id, -1, 0);
 
-	i = PW_RADIUS;
-	rc_avpair_add(rh, send, PW_ACCT_AUTHENTIC, &i, -1, 0);
+	rad_add_str(req, PW_CALLING_STATION_ID, ai->remote_ip);
+	rad_add_str(req, PW_ACCT_SESSION_ID, ai->safe_id);
+	rad_add_int(req, PW_ACCT_DELAY_TIME, 0);
+	rad_add_int(req, PW_ACCT_AUTHENTIC, PW_RADIUS);
 
 	return;
 }
 
 static void radius_acct_session_stats(void *_vctx, unsigned auth_method, const common_acct_info_st *ai, stats_st *stats)
 {
-	int ret;
-	uint32_t status_type;
-	VALUE_PAIR *send = NULL, *recvd = NULL;
+	rad_request_st *req;
 	struct radius_vhost_ctx *vctx = _vctx;
 
-	status_type = PW_STATUS_ALIVE;
-
 	syslog(LOG_DEBUG, "radius-auth: sending session interim update");
 
-	if (rc_avpair_add(vctx->rh, &send, PW_ACCT_STATUS_TYPE, &status_type, -1, 0) == NULL) {
-		goto cleanup;
-	}
-
-	append_acct_standard(vctx, vctx->rh, ai, &send);
-	append_stats(vctx->rh, &send, stats);
-
-	ret = rc_aaa(vctx->rh, ai->id, send, &recvd, NULL, 1, PW_ACCOUNTING_REQUEST);
+	req = rad_request_new(RAD_ACCOUNTING_REQUEST);
+	if (req == NULL)
+		return;
 
-	if (recvd != NULL)
-		rc_avpair_free(recvd);
+	rad_add_int(req, PW_ACCT_STATUS_TYPE, PW_STATUS_ALIVE);
+	append_acct_standard(vctx, req, ai);
+	append_stats(req, stats);
 
-	if (ret != OK_RC) {
-		syslog(LOG_AUTH, "radius-auth: radius_open_session: %d", ret);
-		goto cleanup;
-	}
+	/* the update is not waited for; it is sent together with the
+	 * updates of other sessions, and a newer update of the session
+	 * replaces it if it is not yet sent. */
+	rad_set_key(req, ai->safe_id);
+	rad_send(vctx->engine, req, NULL, NULL);
 
- cleanup:
-	rc_avpair_free(send);
 	return;
 }
 
 static int radius_acct_open_session(void *_vctx, unsigned auth_method, const common_acct_info_st *ai, const void *sid, unsigned sid_size)
 {
 	int ret;
-	uint32_t status_type;
-	VALUE_PAIR *send = NULL, *recvd = NULL;
+	rad_request_st *req;
+	rad_reply_st reply;
 	struct radius_vhost_ctx *vctx = _vctx;
 
-	status_type = PW_STATUS_START;
-
 	if (sid_size != SID_SIZE) {
 		syslog(LOG_DEBUG, "radius-auth: incorrect sid size");
 		return -1;
@@ -216,77 +194,69 @@ static int radius_acct_open_session(void *_vctx, unsigned auth_method, const com
 
 	syslog(LOG_DEBUG, "radius-auth: opening session %s", ai->safe_id);
 
-	if (rc_avpair_add(vctx->rh, &send, PW_ACCT_STATUS_TYPE, &status_type, -1, 0) == NULL) {
-		ret = -1;
-		goto cleanup;
-	}
+	req = rad_request_new(RAD_ACCOUNTING_REQUEST);
+	if (req == NULL)
+		return -1;
+
+	rad_add_int(req, PW_ACCT_STATUS_TYPE, PW_STATUS_START);
 
 	if (ai->user_agent[0] != 0) {
-		rc_avpair_add(vctx->rh, &send, PW_CONNECT_INFO, ai->user_agent, -1, 0);
+		rad_add_str(req, PW_CONNECT_INFO, ai->user_agent);
 	}
 
-	append_acct_standard(vctx, vctx->rh, ai, &send);
-
-	ret = rc_aaa(vctx->rh, ai->id, send, &recvd, NULL, 1, PW_ACCOUNTING_REQUEST);
+	append_acct_standard(vctx, req, ai);
 
-	if (recvd != NULL)
-		rc_avpair_free(recvd);
-
-	if (ret != OK_RC) {
+	ret = rad_send_wait(vctx->engine, req, &reply);
+	if (ret != RAD_ACCOUNTING_RESPONSE) {
 		syslog(LOG_AUTH, "radius-auth: radius_open_session: %d", ret);
-		ret = -1;
-		goto cleanup;
+		return -1;
 	}
 
-	ret = 0;
- cleanup:
-	rc_avpair_free(send);
-	return ret;
+	return 0;
 }
 
 static void radius_acct_close_session(void *_vctx, unsigned auth_method, const common_acct_info_st *ai, stats_st *stats, unsigned discon_reason)
 {
 	int ret;
-	uint32_t status_type;
-	VALUE_PAIR *send = NULL, *recvd = NULL;
+	uint32_t cause;
+	rad_request_st *req;
+	rad_reply_st reply;
 	struct radius_vhost_ctx *vctx = _vctx;
 
-	status_type = PW_STATUS_STOP;
-
 	syslog(LOG_DEBUG, "radius-auth: closing session");
-	if (rc_avpair_add(vctx->rh, &send, PW_ACCT_STATUS_TYPE, &status_type, -1, 0) == NULL)
+	req = rad_request_new(RAD_ACCOUNTING_REQUEST);
+	if (req == NULL)
 		return;
 
+	rad_add_int(req, PW_ACCT_STATUS_TYPE, PW_STATUS_STOP);
+
 	if (discon_reason == REASON_USER_DISCONNECT)
-		ret = PW_USER_REQUEST;
+		cause = PW_USER_REQUEST;
 	else if (discon_reason == REASON_SERVER_DISCONNECT)
-		ret = PW_ADMIN_RESET;
+		cause = PW_ADMIN_RESET;
 	else if (discon_reason == REASON_IDLE_TIMEOUT)
-		ret = PW_ACCT_IDLE_TIMEOUT;
+		cause = PW_ACCT_IDLE_TIMEOUT;
 	else if (discon_reason == REASON_SESSION_TIMEOUT)
-		ret = PW_ACCT_SESSION_TIMEOUT;
+		cause = PW_ACCT_SESSION_TIMEOUT;
 	else if (discon_reason == REASON_DPD_TIMEOUT)
-		ret = PW_LOST_CARRIER;
+		cause = PW_LOST_CARRIER;
 	else if (discon_reason == REASON_ERROR)
-		ret = PW_USER_ERROR;
+		cause = PW_USER_ERROR;
 	else
-		ret = PW_LOST_SERVICE;
-	rc_avpair_add(vctx->rh, &send, PW_ACCT_TERMINATE_CAUSE, &ret, -1, 0);
+		cause = PW_LOST_SERVICE;
+	rad_add_int(req, PW_ACCT_TERMINATE_CAUSE, cause);
 
-	append_acct_standard(vctx, vctx->rh, ai, &send);
-	append_stats(vctx->rh, &send, stats);
+	append_acct_standard(vctx, req, ai);
+	append_stats(req, stats);
 
-	ret = rc_aaa(vctx->rh, ai->id, send, &recvd, NULL, 1, PW_ACCOUNTING_REQUEST);
-	if (recvd != NULL)
-		rc_avpair_free(recvd);
+	/* replaces any interim update of the session not yet sent */
+	rad_set_key(req, ai->safe_id);
 
-	if (ret != OK_RC) {
+	ret = rad_send_wait(vctx->engine, req, &reply);
+	if (ret != RAD_ACCOUNTING_RESPONSE) {
 		syslog(LOG_INFO, "radius-auth: radius_close_session: %d", ret);
-		goto cleanup;
 	}
 
- cleanup:
- 	rc_avpair_free(send);
 	return;
 }
 
@@ -330,6 +330,9 @@ static void pam_group_list(void *pool, void *_additional, char ***groupname, uns
 	unix_group_list(pool, min, groupname, groupname_size);
 }
 
+/* the conversation coroutines share a single context */
+static pthread_mutex_t pam_lock = PTHREAD_MUTEX_INITIALIZER;
+
 const struct auth_mod_st pam_auth_funcs = {
   .type = AUTH_TYPE_PAM | AUTH_TYPE_USERNAME_PASS,
   .auth_init = pam_auth_init,
@@ -338,7 +341,8 @@ const struct auth_mod_st pam_auth_funcs = {
   .auth_pass = pam_auth_pass,
   .auth_group = pam_auth_group,
   .auth_user = pam_auth_user,
-  .group_list = pam_group_list
+  .group_list = pam_group_list,
+  .lock = &pam_lock
 };
 
 #endif
@@ -27,6 +27,7 @@
 # define _XOPEN_SOURCE
 #endif
 #include <unistd.h>
+#include <sys/stat.h>
 #include <vpn.h>
 #include <c-ctype.h>
 #include "plain.h"
@@ -58,20 +59,217 @@ struct plain_ctx_st {
 	unsigned failed; /* non-zero if the username is wrong */
 
 	const struct plain_cfg_st *config;
+	struct plain_db_st *db;
 };
 
+/* The password file is kept in memory, indexed by username, and is read
+ * again once it is replaced or modified. The index is only accessed with
+ * plain_lock held; as it is used by all the threads of sec-mod, it is
+ * allocated with malloc().
+ */
+struct plain_user_st {
+	const char *username;
+	const char *groups;
+	const char *cpass;
+};
+
+struct plain_db_st {
+	char *data; /* the contents of the file, split into fields */
+	size_t data_size;
+	struct plain_user_st *users;
+	struct htable ht;
+	unsigned loaded;
+
+	/* the file which was read */
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+};
+
+struct plain_vctx_st {
+	const struct plain_cfg_st *config;
+	struct plain_db_st db;
+};
+
+static size_t username_hash(const char *username)
+{
+	return hash_any(username, strlen(username), 0);
+}
+
+static size_t user_rehash(const void *_e, void *unused)
+{
+	const struct plain_user_st *e = _e;
+	return username_hash(e->username);
+}
+
+static bool user_cmp(const void *_e, void *username)
+{
+	const struct plain_user_st *e = _e;
+
+	return strcmp(e->username, username) == 0;
+}
+
+static void plain_db_clear(struct plain_db_st *db)
+{
+	if (db->loaded == 0)
+		return;
+
+	htable_clear(&db->ht);
+	free(db->users);
+	safe_memset(db->data, 0, db->data_size);
+	free(db->data);
+	db->users = NULL;
+	db->data = NULL;
+	db->loaded = 0;
+}
+
+/* Parses the "username:groups:password" lines of @data in place */
+static int plain_db_parse(struct plain_db_st *db, char *data, size_t size)
+{
+	char *line, *end, *p;
+	struct plain_user_st *user;
+	size_t lines = 1, i, hval;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] == '\n')
+			lines++;
+	}
+
+	db->users = malloc(lines * sizeof(db->users[0]));
+	if (db->users == NULL)
+		return -1;
+
+	htable_init(&db->ht, user_rehash, NULL);
+
+	user = db->users;
+	for (line = data; line < data + size; line = end + 1) {
+		end = memchr(line, '\n', data + size - line);
+		if (end == NULL)
+			end = data + size;
+		*end = 0;
+
+		if (end - line < 4)
+			continue;
+		if (end[-1] == '\r')
+			end[-1] = 0;
+
+		user->username = line;
+		p = strchr(line, ':');
+		if (p == NULL)
+			continue;
+		*p++ = 0;
+
+		user->groups = p;
+		p = strchr(p, ':');
+		if (p == NULL)
+			continue;
+		*p++ = 0;
+
+		user->cpass = p;
+		p = strchr(p, ':');
+		if (p != NULL)
+			*p = 0;
+
+		/* the first entry of a user applies */
+		hval = username_hash(user->username);
+		if (htable_get(&db->ht, hval, user_cmp, user->username) != NULL)
+			continue;
+
+		if (htable_add(&db->ht, hval, user) == 0) {
+			htable_clear(&db->ht);
+			free(db->users);
+			db->users = NULL;
+			return -1;
+		}
+		user++;
+	}
+
+	return 0;
+}
+
+/* Reads the file again if it has changed since it was loaded */
+static int plain_db_update(struct plain_db_st *db, const char *file)
+{
+	struct stat st;
+	struct plain_db_st tmp;
+	FILE *fp;
+	int ret = -1;
+
+	if (stat(file, &st) == -1)
+		return -1;
+
+	if (db->loaded && st.st_dev == db->dev && st.st_ino == db->ino &&
+	    st.st_mtime == db->mtime && st.st_size == db->size)
+		return 0;
+
+	fp = fopen(file, "r");
+	if (fp == NULL)
+		return -1;
+
+	/* the file may have been replaced meanwhile */
+	if (fstat(fileno(fp), &st) == -1)
+		goto cleanup;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.data_size = st.st_size;
+	tmp.data = malloc(tmp.data_size + 1);
+	if (tmp.data == NULL)
+		goto cleanup;
+
+	tmp.data[tmp.data_size] = 0;
+
+	if (fread(tmp.data, 1, tmp.data_size, fp) != tmp.data_size ||
+	    plain_db_parse(&tmp, tmp.data, tmp.data_size) < 0) {
+		safe_memset(tmp.data, 0, tmp.data_size);
+		free(tmp.data);
+		goto cleanup;
+	}
+
+	tmp.loaded = 1;
+	tmp.dev = st.st_dev;
+	tmp.ino = st.st_ino;
+	tmp.mtime = st.st_mtime;
+	tmp.size = st.st_size;
+
+	plain_db_clear(db);
+	memcpy(db, &tmp, sizeof(*db));
+
+	syslog(LOG_DEBUG, "plain: loaded %u users from %s",
+	       (unsigned)db->ht.elems, file);
+	ret = 0;
+
+ cleanup:
+	fclose(fp);
+	return ret;
+}
+
+static int plain_vctx_destructor(struct plain_vctx_st *vctx)
+{
+	plain_db_clear(&vctx->db);
+	return 0;
+}
+
 static void plain_vhost_init(void **vctx, void *pool, void *additional)
 {
 	struct plain_cfg_st *config = additional;
-
-	/* vctx is plain_cfg_st */
+	struct plain_vctx_st *vc;
 
 	if (config == NULL) {
 		fprintf(stderr, "plain: no configuration passed!\n");
 		exit(1);
 	}
 
-	*vctx = (void*)config;
+	vc = talloc_zero(pool, struct plain_vctx_st);
+	if (vc == NULL) {
+		fprintf(stderr, "plain: memory error\n");
+		exit(1);
+	}
+
+	vc->config = config;
+	talloc_set_destructor(vc, plain_vctx_destructor);
+
+	*vctx = (void*)vc;
 
 #ifdef HAVE_LIBOATH
 	oath_init();
@@ -79,6 +277,11 @@ static void plain_vhost_init(void **vctx, void *pool, void *additional)
 	return;
 }
 
+static void plain_vhost_deinit(void *vctx)
+{
+	talloc_free(vctx);
+}
+
 /* Breaks a list of "xxx", "yyy", to a character array, of
  * MAX_COMMA_SEP_ELEMENTS size; Note that the given string is modified.
   */
@@ -138,11 +341,7 @@ break_group_list(void *pool, char *text,
  */
 static int read_auth_pass(struct plain_ctx_st *pctx)
 {
-	FILE *fp;
-	char line[512];
-	ssize_t ll;
-	char *p, *sp;
-	int ret;
+	struct plain_user_st *user;
 
 	if (pctx->config->passwd == NULL) {
 		/* no password file is set */
@@ -151,74 +350,23 @@ static int read_auth_pass(struct plain_ctx_st *pctx)
 
 	pctx->failed = 1;
 
-	fp = fopen(pctx->config->passwd, "r");
-	if (fp == NULL) {
+	if (plain_db_update(pctx->db, pctx->config->passwd) < 0) {
 		syslog(LOG_AUTH,
-		       "error in plain authentication; cannot open: %s",
+		       "error in plain authentication; cannot read: %s",
 		       pctx->config->passwd);
 		return -1;
 	}
 
-	line[sizeof(line)-1] = 0;
-	while ((p=fgets(line, sizeof(line)-1, fp)) != NULL) {
-		ll = strlen(p);
-
-		if (ll <= 4)
-			continue;
-
-		if (line[ll - 1] == '\n') {
-			ll--;
-			line[ll] = 0;
-		}
-		if (line[ll - 1] == '\r') {
-			ll--;
-			line[ll] = 0;
-		}
-#ifdef HAVE_STRSEP
-		sp = line;
-		p = strsep(&sp, ":");
-
-		if (p != NULL && strcmp(pctx->username, p) == 0) {
-			p = strsep(&sp, ":");
-			if (p != NULL) {
-				break_group_list(pctx, p, pctx->groupnames, &pctx->groupnames_size);
-
-				p = strsep(&sp, ":");
-				if (p != NULL) {
-					strlcpy(pctx->cpass, p, sizeof(pctx->cpass));
-					pctx->failed = 0;
-					ret = 0;
-					goto exit;
-				}
-			}
-		}
-
-#else
-		p = strtok_r(line, ":", &sp);
-
-		if (p != NULL && strcmp(pctx->username, p) == 0) {
-			p = strtok_r(NULL, ":", &sp);
-			if (p != NULL) {
-				break_group_list(pctx, p, pctx->groupnames, &pctx->groupnames_size);
-
-				p = strtok_r(NULL, ":", &sp);
-				if (p != NULL) {
-					strlcpy(pctx->cpass, p, sizeof(pctx->cpass));
-					pctx->failed = 0;
-					ret = 0;
-					goto exit;
-				}
-			}
-		}
-#endif
+	user = htable_get(&pctx->db->ht, username_hash(pctx->username),
+			  user_cmp, pctx->username);
+	if (user != NULL) {
+		break_group_list(pctx, (char*)user->groups, pctx->groupnames, &pctx->groupnames_size);
+		strlcpy(pctx->cpass, user->cpass, sizeof(pctx->cpass));
+		pctx->failed = 0;
 	}
 
 	/* always succeed */
-	ret = 0;
- exit:
-	safe_memset(line, 0, sizeof(line));
-	fclose(fp);
-	return ret;
+	return 0;
 }
 
 static int plain_auth_init(void **ctx, void *pool, void *vctx, const common_auth_init_st *info)
@@ -238,7 +386,8 @@ static int plain_auth_init(void **ctx, void *pool, void *vctx, const common_auth
 
 	strlcpy(pctx->username, info->username, sizeof(pctx->username));
 	pctx->pass_msg = NULL; /* use default */
-	pctx->config = vctx;
+	pctx->config = ((struct plain_vctx_st *)vctx)->config;
+	pctx->db = &((struct plain_vctx_st *)vctx)->db;
 
 	/* this doesn't fail on password mismatch but sets p->failed */
 	ret = read_auth_pass(pctx);
@@ -481,15 +630,20 @@ static void plain_group_list(void *pool, void *additional, char ***groupname, un
 	return;
 }
 
+/* crypt() is not thread-safe */
+static pthread_mutex_t plain_lock = PTHREAD_MUTEX_INITIALIZER;
+
 const struct auth_mod_st plain_auth_funcs = {
 	.type = AUTH_TYPE_PLAIN | AUTH_TYPE_USERNAME_PASS,
 	.allows_retries = 1,
 	.vhost_init = plain_vhost_init,
+	.vhost_deinit = plain_vhost_deinit,
 	.auth_init = plain_auth_init,
 	.auth_deinit = plain_auth_deinit,
 	.auth_msg = plain_auth_msg,
 	.auth_pass = plain_auth_pass,
 	.auth_user = plain_auth_user,
 	.auth_group = plain_auth_group,
-	.group_list = plain_group_list
+	.group_list = plain_group_list,
+	.lock = &plain_lock
 };
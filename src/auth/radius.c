@@ -54,9 +54,91 @@
 # endif
 #endif
 
-#if RADCLI_VERSION_NUMBER < 0x010207
-# define CHALLENGE_RC 3
-#endif
+/* Finds the secret of @server in the servers file of radcli */
+static int find_secret(struct radius_vhost_ctx *vctx, const char *server,
+		       char *secret, size_t secret_size)
+{
+	char line[512];
+	char *name, *s, *p, *save;
+	char *file;
+	FILE *fp;
+	int ret = -1;
+
+	file = rc_conf_str(vctx->rh, "servers");
+	if (file == NULL)
+		return -1;
+
+	fp = fopen(file, "r");
+	if (fp == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		name = strtok_r(line, " \t\r\n", &save);
+		if (name == NULL || name[0] == '#')
+			continue;
+
+		s = strtok_r(NULL, " \t\r\n", &save);
+		if (s == NULL)
+			continue;
+
+		/* the name may be followed by /our-name */
+		p = strchr(name, '/');
+		if (p != NULL)
+			*p = 0;
+
+		if (strcmp(name, server) == 0) {
+			strlcpy(secret, s, secret_size);
+			ret = 0;
+			break;
+		}
+	}
+
+	fclose(fp);
+	return ret;
+}
+
+/* Sets up the engine which sends the requests to the servers of @option
+ * (authserver or acctserver) of the radcli configuration.
+ */
+int radius_vhost_engine(struct radius_vhost_ctx *vctx, const char *option, unsigned default_port)
+{
+	SERVER *srv;
+	char secret[128];
+	int i, retries;
+
+	/* radcli counts the first transmission as well */
+	retries = rc_conf_int(vctx->rh, "radius_retries");
+	if (retries > 0)
+		retries--;
+
+	vctx->engine = rad_engine_new(rc_conf_int(vctx->rh, "radius_timeout"), retries,
+				      rc_conf_int(vctx->rh, "radius_deadtime"));
+	if (vctx->engine == NULL)
+		return -1;
+
+	srv = rc_conf_srv(vctx->rh, option);
+	if (srv == NULL || srv->max == 0) {
+		fprintf(stderr, "radius: no %s in configuration\n", option);
+		return -1;
+	}
+
+	for (i = 0; i < srv->max; i++) {
+		if (srv->secret[i] != NULL) {
+			strlcpy(secret, srv->secret[i], sizeof(secret));
+		} else if (find_secret(vctx, srv->name[i], secret, sizeof(secret)) < 0) {
+			fprintf(stderr, "radius: no secret for server %s\n", srv->name[i]);
+			return -1;
+		}
+
+		if (rad_engine_add_server(vctx->engine, srv->name[i],
+					  srv->port[i] ? srv->port[i] : default_port, secret) < 0) {
+			fprintf(stderr, "radius: cannot use server %s\n", srv->name[i]);
+			return -1;
+		}
+	}
+
+	return rad_engine_start(vctx->engine);
+}
 
 static void radius_vhost_init(void **_vctx, void *pool, void *additional)
 {
@@ -81,10 +163,18 @@ static void radius_vhost_init(void **_vctx, void *pool, void *additional)
 		vctx->nas_identifier[0] = 0;
 	}
 
+	if (gethostname(vctx->hostname, sizeof(vctx->hostname)) != 0)
+		vctx->hostname[0] = 0;
+	vctx->hostname[sizeof(vctx->hostname)-1] = 0;
+
 	if (rc_read_dictionary(vctx->rh, rc_conf_str(vctx->rh, "dictionary")) != 0) {
 		fprintf(stderr, "error reading the radius dictionary\n");
 		exit(1);
 	}
+
+	if (radius_vhost_engine(vctx, "authserver", PW_AUTH_UDP_PORT) < 0)
+		goto fail;
+
 	*_vctx = vctx;
 
 	return;
@@ -97,6 +187,7 @@ static void radius_vhost_deinit(void *_vctx)
 {
 	struct radius_vhost_ctx *vctx = _vctx;
 
+	rad_engine_free(vctx->engine);
 	if (vctx->rh != NULL)
 		rc_destroy(vctx->rh);
 }
@@ -246,28 +337,30 @@ static void parse_groupnames(struct radius_ctx_st *pctx, const char *full)
 static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 {
 	struct radius_ctx_st *pctx = ctx;
-	VALUE_PAIR *send = NULL, *recvd = NULL;
-	uint32_t service;
+	rad_request_st *req;
+	rad_reply_st reply;
+	VALUE_PAIR *recvd = NULL;
+	const uint8_t *msg;
+	size_t msg_size;
 	char route[72];
 	char txt[64];
 	VALUE_PAIR *vp;
+	unsigned nas_ip = 0;
 	int ret;
 
 	/* send Access-Request */
 	syslog(LOG_DEBUG, "radius-auth: communicating username (%s) and password", pctx->username);
-	if (rc_avpair_add(pctx->vctx->rh, &send, PW_USER_NAME, pctx->username, -1, 0) == NULL) {
-		syslog(LOG_ERR,
-		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
-		       pctx->username);
+	req = rad_request_new(RAD_ACCESS_REQUEST);
+	if (req == NULL)
 		return ERR_AUTH_FAIL;
-	}
 
-	if (rc_avpair_add(pctx->vctx->rh, &send, PW_USER_PASSWORD, (char*)pass, -1, 0) == NULL) {
+	if (rad_add_str(req, PW_USER_NAME, pctx->username) < 0 ||
+	    rad_set_password(req, pass, pass_len) < 0) {
 		syslog(LOG_ERR,
 		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 		       pctx->username);
-		ret = ERR_AUTH_FAIL;
-		goto cleanup;
+		rad_request_free(req);
+		return ERR_AUTH_FAIL;
 	}
 
 	if (pctx->our_ip[0] != 0) {
@@ -275,68 +368,58 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 		struct in6_addr in6;
 
 		if (inet_pton(AF_INET, pctx->our_ip, &in) != 0) {
-			in.s_addr = ntohl(in.s_addr);
-			rc_avpair_add(pctx->vctx->rh, &send, PW_NAS_IP_ADDRESS, (char*)&in, sizeof(struct in_addr), 0);
+			nas_ip = rad_add_attr(req, PW_NAS_IP_ADDRESS, &in, sizeof(in)) == 0;
 		} else if (inet_pton(AF_INET6, pctx->our_ip, &in6) != 0) {
-			rc_avpair_add(pctx->vctx->rh, &send, PW_NAS_IPV6_ADDRESS, (char*)&in6, sizeof(struct in6_addr), 0);
+			nas_ip = rad_add_attr(req, PW_NAS_IPV6_ADDRESS, &in6, sizeof(in6)) == 0;
 		}
 	}
 
-	if (pctx->vctx->nas_identifier[0] != 0) {
-		if (rc_avpair_add(pctx->vctx->rh, &send, PW_NAS_IDENTIFIER, pctx->vctx->nas_identifier, -1, 0) == NULL) {
-			syslog(LOG_ERR,
-			       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
-			       pctx->username);
-			ret = ERR_AUTH_FAIL;
-			goto cleanup;
-		}
-	}
-
-	if (rc_avpair_add(pctx->vctx->rh, &send, PW_CALLING_STATION_ID, pctx->remote_ip, -1, 0) == NULL) {
+	/* a request must carry either NAS-IP-Address or NAS-Identifier */
+	ret = 0;
+	if (pctx->vctx->nas_identifier[0] != 0)
+		ret |= rad_add_str(req, PW_NAS_IDENTIFIER, pctx->vctx->nas_identifier);
+	else if (nas_ip == 0 && pctx->vctx->hostname[0] != 0)
+		ret |= rad_add_str(req, PW_NAS_IDENTIFIER, pctx->vctx->hostname);
+	if (pctx->id != 0)
+		ret |= rad_add_int(req, PW_NAS_PORT, pctx->id);
+	if (pctx->remote_ip[0] != 0)
+		ret |= rad_add_str(req, PW_CALLING_STATION_ID, pctx->remote_ip);
+	if (pctx->user_agent[0] != 0)
+		ret |= rad_add_str(req, PW_CONNECT_INFO, pctx->user_agent);
+	ret |= rad_add_int(req, PW_SERVICE_TYPE, PW_AUTHENTICATE_ONLY);
+	ret |= rad_add_int(req, PW_NAS_PORT_TYPE, PW_ASYNC);
+
+	if (ret < 0) {
 		syslog(LOG_ERR,
 		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
 		       pctx->username);
-		ret = ERR_AUTH_FAIL;
-		goto cleanup;
-	}
-
-	if (pctx->user_agent[0] != 0) {
-		if (rc_avpair_add(pctx->vctx->rh, &send, PW_CONNECT_INFO, pctx->user_agent, -1, 0) == NULL) {
-			syslog(LOG_ERR,
-			       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
-			       pctx->username);
-			ret = ERR_AUTH_FAIL;
-			goto cleanup;
-		}
-	}
-
-	service = PW_AUTHENTICATE_ONLY;
-	if (rc_avpair_add(pctx->vctx->rh, &send, PW_SERVICE_TYPE, &service, -1, 0) == NULL) {
-		syslog(LOG_ERR,
-		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
-		       pctx->username);
-		ret = ERR_AUTH_FAIL;
-		goto cleanup;
+		rad_request_free(req);
+		return ERR_AUTH_FAIL;
 	}
 
-	service = PW_ASYNC;
-	if (rc_avpair_add(pctx->vctx->rh, &send, PW_NAS_PORT_TYPE, &service, -1, 0) == NULL) {
-		syslog(LOG_ERR,
-		       "%s:%u: error in constructing radius message for user '%s'", __func__, __LINE__,
-		       pctx->username);
-		ret = ERR_AUTH_FAIL;
-		goto cleanup;
-	}
+	/* only this session waits for the reply; the requests of the
+	 * other sessions share the server socket */
+	ret = rad_send_wait(pctx->vctx->engine, req, &reply);
 
 	pctx->pass_msg[0] = 0;
-	ret = rc_aaa(pctx->vctx->rh, pctx->id, send, &recvd, pctx->pass_msg, 1, PW_ACCESS_REQUEST);
+	if (ret > 0) {
+		msg = rad_find_attr(&reply, PW_REPLY_MESSAGE, &msg_size);
+		if (msg != NULL && msg_size < sizeof(pctx->pass_msg)) {
+			memcpy(pctx->pass_msg, msg, msg_size);
+			pctx->pass_msg[msg_size] = 0;
+		}
+	}
 
-	if (ret == OK_RC) {
+	if (ret == RAD_ACCESS_ACCEPT) {
 		uint32_t ipv4;
 		uint8_t ipv6[16];
 
+		if (reply.attrs_size > 0)
+			recvd = rc_avpair_gen(pctx->vctx->rh, NULL, (unsigned char *)reply.attrs,
+					      reply.attrs_size, 0);
 		vp = recvd;
 
+
 		while(vp != NULL) {
 			if (vp->attribute == PW_SERVICE_TYPE && vp->lvalue != PW_FRAMED) {
 				syslog(LOG_ERR,
@@ -436,8 +519,6 @@ static int radius_auth_pass(void *ctx, const char *pass, unsigned pass_len)
 	}
 
  cleanup:
-	if (send != NULL)
-		rc_avpair_free(send);
 	if (recvd != NULL)
 		rc_avpair_free(recvd);
 	return ret;
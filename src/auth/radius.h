@@ -31,9 +31,14 @@
 #   include <radcli/radcli.h>
 #  endif
 
+#  include "radius-engine.h"
+
 struct radius_vhost_ctx {
 	rc_handle *rh;
+	rad_engine_st *engine;
 	char nas_identifier[64];
+	/* sent as NAS-Identifier when neither it nor our address is known */
+	char hostname[64];
 };
 
 struct radius_ctx_st {
@@ -72,5 +77,7 @@ struct radius_ctx_st {
 
 extern const struct auth_mod_st radius_auth_funcs;
 
+int radius_vhost_engine(struct radius_vhost_ctx *vctx, const char *option, unsigned default_port);
+
 # endif
 #endif
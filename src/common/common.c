@@ -35,6 +35,8 @@
 #include "defs.h"
 #include "common/base64-helper.h"
 
+int (*oc_poll)(struct pollfd *fds, nfds_t nfds, int timeout) = poll;
+
 const char *_vhost_prefix(const char *name)
 {
 	static char tmp[128];
@@ -119,6 +121,22 @@ const char *cmd_request_to_str(unsigned _cmd)
 		return "ban IP";
 	case CMD_BAN_IP_REPLY:
 		return "ban IP reply";
+	case CMD_POOL_SESSION:
+		return "pool: new session";
+	case CMD_POOL_TERMINATE:
+		return "pool: terminate session";
+	case CMD_POOL_CONN_FD:
+		return "pool: connection fd";
+	case CMD_SCRIPT_RUN:
+		return "script: run";
+	case CMD_SCRIPT_CANCEL:
+		return "script: cancel";
+	case CMD_SCRIPT_EXIT:
+		return "script: exit";
+	case CMD_SHARD_CONN:
+		return "shard: new connection";
+	case CMD_SHARD_UDP:
+		return "shard: udp fd";
 
 	case CMD_SEC_CLI_STATS:
 		return "sm: worker cli stats";
@@ -197,8 +215,14 @@ ssize_t force_write(int sockfd, const void *buf, size_t len)
 		if (ret == -1) {
 			if (errno != EAGAIN && errno != EINTR)
 				return ret;
-			else
-				ms_sleep(50);
+			else if (errno == EAGAIN) {
+				struct pollfd pfd;
+
+				pfd.fd = sockfd;
+				pfd.events = POLLOUT;
+				pfd.revents = 0;
+				oc_poll(&pfd, 1, 50);
+			}
 		}
 
 		if (ret > 0) {
@@ -221,6 +245,14 @@ ssize_t force_read(int sockfd, void *buf, size_t len)
 		if (ret == -1) {
 			if (errno != EAGAIN && errno != EINTR)
 				return ret;
+			else if (errno == EAGAIN) {
+				struct pollfd pfd;
+
+				pfd.fd = sockfd;
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				oc_poll(&pfd, 1, -1);
+			}
 		} else if (ret == 0 && left != 0) {
 			errno = ENOENT;
 			return -1;
@@ -249,7 +281,7 @@ ssize_t force_read_timeout(int sockfd, void *buf, size_t len, unsigned sec)
 			pfd.revents = 0;
 
 			do {
-				ret = poll(&pfd, 1, sec * 1000);
+				ret = oc_poll(&pfd, 1, sec * 1000);
 			} while (ret == -1 && errno == EINTR);
 
 			if (ret == -1 || ret == 0) {
@@ -302,7 +334,7 @@ ssize_t recv_timeout(int sockfd, void *buf, size_t len, unsigned sec)
 	pfd.revents = 0;
 
 	do {
-		ret = poll(&pfd, 1, sec * 1000);
+		ret = oc_poll(&pfd, 1, sec * 1000);
 	} while (ret == -1 && errno == EINTR);
 
 	if (ret == -1 || ret == 0) {
@@ -326,7 +358,7 @@ ssize_t recvmsg_timeout(int sockfd, struct msghdr * msg, int flags,
 		pfd.revents = 0;
 
 		do {
-			ret = poll(&pfd, 1, sec * 1000);
+			ret = oc_poll(&pfd, 1, sec * 1000);
 		} while (ret == -1 && errno == EINTR);
 
 		if (ret == -1 || ret == 0) {
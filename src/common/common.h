@@ -30,6 +30,7 @@
 #include <string.h>
 #include <nettle/base64.h>
 #include <errno.h>
+#include <poll.h>
 
 void _talloc_free2(void *ctx, void *ptr);
 void *_talloc_size2(void *ctx, size_t size);
@@ -41,6 +42,11 @@ void *_talloc_size2(void *ctx, size_t size);
 
 #define DEFAULT_SOCKET_TIMEOUT 10
 
+/* The poll() used by the blocking helpers below. A worker process
+ * serving multiple sessions replaces it with a function that suspends
+ * the calling session instead of the whole process. */
+extern int (*oc_poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+
 void set_non_block(int fd);
 void set_block(int fd);
 
@@ -112,6 +118,11 @@ void ms_sleep(unsigned ms)
   struct timespec tv;
   int ret;
 
+  if (oc_poll != poll) {
+	oc_poll(NULL, 0, ms);
+	return;
+  }
+
   tv.tv_sec = 0;
   tv.tv_nsec = ms * 1000 * 1000;
 
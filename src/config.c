@@ -491,6 +491,7 @@ static void apply_default_conf(vhost_cfg_st *vhost, unsigned reload)
 	if (!reload) { /* perm config defaults */
 		tls_vhost_init(vhost);
 		vhost->perm_config.stats_reset_time = 24*60*60*7; /* weekly */
+		vhost->perm_config.max_scripts = DEFAULT_MAX_SCRIPTS;
 	}
 
 	vhost->perm_config.config->mobile_idle_timeout = (unsigned)-1;
@@ -503,6 +504,8 @@ static void apply_default_conf(vhost_cfg_st *vhost, unsigned reload)
 	vhost->perm_config.config->ban_points_wrong_password = DEFAULT_PASSWORD_POINTS;
 	vhost->perm_config.config->ban_points_connect = DEFAULT_CONNECT_POINTS;
 	vhost->perm_config.config->ban_points_kkdcp = DEFAULT_KKDCP_POINTS;
+	vhost->perm_config.config->ban_prefix_ipv4 = DEFAULT_BAN_PREFIX_IPV4;
+	vhost->perm_config.config->ban_prefix_ipv6 = DEFAULT_BAN_PREFIX_IPV6;
 	vhost->perm_config.config->dpd = DEFAULT_DPD_TIME;
 	vhost->perm_config.config->network.ipv6_subnet_prefix = 128;
 	vhost->perm_config.config->dtls_legacy = 1;
@@ -778,6 +781,26 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 			 * re-read configuration too */
 			if (!PWARN_ON_VHOST(vhost->name, "server-stats-reset-time", stats_reset_time))
 				READ_NUMERIC(vhost->perm_config.stats_reset_time);
+		} else if (strcmp(name, "worker-pool-size") == 0) {
+			/* the pool is forked once at startup */
+			if (!PWARN_ON_VHOST(vhost->name, "worker-pool-size", worker_pool_size))
+				READ_NUMERIC(vhost->perm_config.worker_pool_size);
+		} else if (strcmp(name, "acceptor-shards") == 0) {
+			/* the listening sockets are created once at startup */
+			if (!PWARN_ON_VHOST(vhost->name, "acceptor-shards", acceptor_shards))
+				READ_NUMERIC(vhost->perm_config.acceptor_shards);
+		} else if (strcmp(name, "udp-steering") == 0) {
+			/* the listening sockets are created once at startup */
+			if (!PWARN_ON_VHOST(vhost->name, "udp-steering", udp_steering))
+				READ_TF(vhost->perm_config.udp_steering);
+		} else if (strcmp(name, "metrics-port") == 0) {
+			/* the metrics socket is created once at startup */
+			if (!PWARN_ON_VHOST(vhost->name, "metrics-port", metrics_port))
+				READ_NUMERIC(vhost->perm_config.metrics_port);
+		} else if (strcmp(name, "max-concurrent-scripts") == 0) {
+			/* the script runner is forked once at startup */
+			if (!PWARN_ON_VHOST(vhost->name, "max-concurrent-scripts", max_scripts))
+				READ_NUMERIC(vhost->perm_config.max_scripts);
 		} else if (strcmp(name, "pid-file") == 0) {
 			if (pid_file[0] == 0) {
 				READ_STATIC_STRING(pid_file);
@@ -894,6 +917,8 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 	} else if (strcmp(name, "use-occtl") == 0) {
 		if (!WARN_ON_VHOST(vhost->name, "use-occtl", use_occtl))
 			READ_TF(config->use_occtl);
+	} else if (strcmp(name, "ktls") == 0) {
+		READ_TF(config->ktls);
 	} else if (strcmp(name, "try-mtu-discovery") == 0) {
 		if (!WARN_ON_VHOST(vhost->name, "try-mtu-discovery", try_mtu))
 			READ_TF(config->try_mtu);
@@ -971,6 +996,18 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 	} else if (strcmp(name, "ban-points-kkdcp") == 0) {
 		if (!WARN_ON_VHOST(vhost->name, "ban-points-kkdcp", ban_points_kkdcp))
 			READ_NUMERIC(config->ban_points_kkdcp);
+	} else if (strcmp(name, "max-ban-prefix-score") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "max-ban-prefix-score", max_ban_prefix_score))
+			READ_NUMERIC(config->max_ban_prefix_score);
+	} else if (strcmp(name, "ban-prefix-ipv4") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "ban-prefix-ipv4", ban_prefix_ipv4))
+			READ_NUMERIC(config->ban_prefix_ipv4);
+	} else if (strcmp(name, "ban-prefix-ipv6") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "ban-prefix-ipv6", ban_prefix_ipv6))
+			READ_NUMERIC(config->ban_prefix_ipv6);
+	} else if (strcmp(name, "kernel-ban-filter") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "kernel-ban-filter", kernel_ban_filter))
+			READ_TF(config->kernel_ban_filter);
 	} else if (strcmp(name, "max-same-clients") == 0) {
 		READ_NUMERIC(config->max_same_clients);
 	} else if (strcmp(name, "device") == 0) {
@@ -1039,6 +1076,17 @@ static int cfg_ini_handler(void *_ctx, const char *section, const char *name, co
 		READ_MULTI_LINE(config->network.nbns, config->network.nbns_size);
 	} else if (strcmp(name, "ipv6-nbns") == 0) {
 		READ_MULTI_LINE(config->network.nbns, config->network.nbns_size);
+	} else if (strcmp(name, "firewall-backend") == 0) {
+		if (!WARN_ON_VHOST(vhost->name, "firewall-backend", fw_backend)) {
+			if (strcmp(value, "nftables") == 0) {
+				config->fw_backend = FW_BACKEND_NFTABLES;
+			} else if (strcmp(value, "script") == 0) {
+				config->fw_backend = FW_BACKEND_SCRIPT;
+			} else {
+				fprintf(stderr, ERRSTR"unknown firewall-backend: %s\n", value);
+				exit(1);
+			}
+		}
 	} else if (strcmp(name, "route-add-cmd") == 0) {
 		if (!WARN_ON_VHOST(vhost->name, "route-add-cmd", route_add_cmd))
 			READ_STRING(config->route_add_cmd);
@@ -1208,6 +1256,13 @@ static void check_cfg(vhost_cfg_st *vhost, vhost_cfg_st *defvhost, unsigned sile
 		exit(1);
 	}
 
+	/* the addresses are banned at /32 and /64 */
+	if (config->ban_prefix_ipv4 == 0 || config->ban_prefix_ipv4 >= 32 ||
+	    config->ban_prefix_ipv6 == 0 || config->ban_prefix_ipv6 >= 64) {
+		fprintf(stderr, ERRSTR"%sban-prefix-ipv4 must be between 1 and 31, and ban-prefix-ipv6 between 1 and 63\n", PREFIX_VHOST(vhost));
+		exit(1);
+	}
+
 	if (config->banner && strlen(config->banner) > MAX_BANNER_SIZE) {
 		fprintf(stderr, ERRSTR"%sbanner size is too long\n", PREFIX_VHOST(vhost));
 		exit(1);
@@ -1335,6 +1390,53 @@ static void check_cfg(vhost_cfg_st *vhost, vhost_cfg_st *defvhost, unsigned sile
 	}
 #endif
 
+#if !defined(__linux__) || !defined(HAVE_LINUX_NETFILTER_NF_TABLES_H)
+	if (config->fw_backend == FW_BACKEND_NFTABLES) {
+		if (!silent)
+			fprintf(stderr, ERRSTR"%s'firewall-backend = nftables' is not supported on this system; using the script\n", PREFIX_VHOST(vhost));
+		config->fw_backend = FW_BACKEND_SCRIPT;
+	}
+#endif
+
+#if !defined(__linux__) || !defined(HAVE_LINUX_BPF_H)
+	if (config->kernel_ban_filter) {
+		if (!silent)
+			fprintf(stderr, ERRSTR"%s'kernel-ban-filter' is not supported on this system; ignoring\n", PREFIX_VHOST(vhost));
+		config->kernel_ban_filter = 0;
+	}
+#endif
+
+#if !defined(__linux__)
+	if (vhost->perm_config.worker_pool_size != 0) {
+		if (!silent)
+			fprintf(stderr, ERRSTR"%s'worker-pool-size' is only supported on Linux; ignoring\n", PREFIX_VHOST(vhost));
+		vhost->perm_config.worker_pool_size = 0;
+	}
+#endif
+
+#if !defined(__linux__) || !defined(SO_ATTACH_REUSEPORT_CBPF)
+	if (vhost->perm_config.acceptor_shards != 0) {
+		if (!silent)
+			fprintf(stderr, ERRSTR"%s'acceptor-shards' is only supported on Linux; ignoring\n", PREFIX_VHOST(vhost));
+		vhost->perm_config.acceptor_shards = 0;
+	}
+#endif
+
+#if !defined(__linux__) || !defined(HAVE_LINUX_BPF_H) || !defined(SO_ATTACH_REUSEPORT_EBPF)
+	if (vhost->perm_config.udp_steering) {
+		if (!silent)
+			fprintf(stderr, ERRSTR"%s'udp-steering' is only supported on Linux; ignoring\n", PREFIX_VHOST(vhost));
+		vhost->perm_config.udp_steering = 0;
+	}
+#endif
+
+	/* the shards receive the datagrams with a cBPF program of their own */
+	if (vhost->perm_config.udp_steering && vhost->perm_config.acceptor_shards != 0) {
+		if (!silent)
+			fprintf(stderr, ERRSTR"%s'udp-steering' cannot be combined with 'acceptor-shards'; ignoring\n", PREFIX_VHOST(vhost));
+		vhost->perm_config.udp_steering = 0;
+	}
+
 	for (j=0;j<config->network.routes_size;j++) {
 		if (ip_route_sanity_check(config->network.routes, &config->network.routes[j]) != 0)
 			exit(1);
@@ -42,6 +42,22 @@
 #define MAIN_SEC_MOD_TIMEOUT 120
 #define MAX_WAIT_SECS 3
 
+/* The stages of the connection lifecycle we keep latency histograms
+ * (lat-hist.h) for; each is recorded by the process performing it, and
+ * the histograms are aggregated by main. */
+enum {
+	LAT_TLS_HANDSHAKE, /* worker: the TLS handshake */
+	LAT_AUTH, /* sec-mod: the authentication requests */
+	LAT_SESSION, /* sec-mod: the session open and close requests */
+	LAT_KEY_OP, /* sec-mod: the private key operations */
+	LAT_LEASE, /* main: the IP lease allocation, and the lease probes */
+	LAT_TUN, /* main: the tun device setup */
+	LAT_SCRIPT, /* main: the connect script */
+	LAT_CONNECT, /* main: from the cookie authentication request to its reply */
+	LAT_DTLS_HANDSHAKE, /* worker: the DTLS handshake */
+	LAT_STAGES
+};
+
 /* Debug definitions for logger */
 #define DEBUG_BASIC 1
 #define DEBUG_INFO  3
@@ -74,6 +90,20 @@ typedef enum {
 	CMD_BAN_IP = 16,
 	CMD_BAN_IP_REPLY = 17,
 
+	/* from main to a worker pool process */
+	CMD_POOL_SESSION = 20,
+	CMD_POOL_TERMINATE = 21,
+	CMD_POOL_CONN_FD = 22,
+
+	/* from main to the script runner and vice versa */
+	CMD_SCRIPT_RUN = 25,
+	CMD_SCRIPT_CANCEL = 26,
+	CMD_SCRIPT_EXIT = 27,
+
+	/* from the acceptor shards to main */
+	CMD_SHARD_CONN = 28,
+	CMD_SHARD_UDP = 29,
+
 	/* from worker to sec-mod */
 	CMD_SEC_AUTH_INIT = 120,
 	CMD_SEC_AUTH_CONT,
@@ -116,6 +146,7 @@ typedef enum {
 #define ERR_PEER_TERMINATED -11
 #define ERR_CTL -12
 #define ERR_NO_CMD_FD -13
+#define ERR_WAIT_FOR_PING -14
 
 #define ERR_WORKER_TERMINATED ERR_PEER_TERMINATED
 
@@ -86,7 +86,10 @@
 #include <errno.h>
 #include <gnutls/crypto.h>
 #include <icmp-ping.h>
-#include <poll.h>
+#include <ip-util.h>
+#include <cloexec.h>
+#include <ccan/hash/hash.h>
+#include <ccan/htable/htable.h>
 
 #ifndef ICMP_DEST_UNREACH
 # ifdef ICMP_UNREACH
@@ -146,203 +149,403 @@ inline static int retry(int e)
 		return 0;
 }
 
+/* The probes share a raw socket per address family, and are matched to
+ * the echo replies received on it by the address of the sender. A probe
+ * which receives no reply within PING_TIMEOUT seconds completes with
+ * the address considered unused.
+ */
 #define PING_TIMEOUT 3
 
-static
-ssize_t recvfrom_timeout(int sockfd, void *buf, size_t len, int flags,
-			 struct sockaddr *src_addr, socklen_t * addrlen)
-{
-	int ret;
-    struct pollfd pfd;
+/* the results are re-used for that long, so that e.g., the clients
+ * reconnecting after a network outage do not probe their addresses
+ * again */
+#define PING_CACHE_TIME 30
 
-    pfd.fd = sockfd;
-    pfd.events = POLLIN;
-    pfd.revents = 0;
+struct icmp_ping_st {
+	struct sockaddr_storage addr;
+	ev_timer timer;
+	icmp_ping_func func;
+	void *priv;
+};
 
-    ret = poll(&pfd, 1, 250);
-	if (ret == -1)
-		return -1;
-	else if (ret > 0)
-		return recvfrom(sockfd, buf, len, 0, src_addr, addrlen);
+struct ping_result_st {
+	struct sockaddr_storage addr;
+	time_t expires;
+	unsigned in_use;
+};
+
+static struct {
+	int fd[2]; /* IPv4 and IPv6 */
+	ev_io io[2];
+	uint16_t id[2];
+	uint16_t seq;
+
+	struct htable pending; /* struct icmp_ping_st */
+	struct htable cache; /* struct ping_result_st */
+	unsigned init;
+} ping = {
+	.fd = {-1, -1}
+};
+
+static size_t addr_hash(const struct sockaddr_storage *addr)
+{
+	if (addr->ss_family == AF_INET)
+		return hash_any(SA_IN_P(addr), sizeof(struct in_addr), 0);
 	else
-		return -1;
+		return hash_any(SA_IN6_P(addr), sizeof(struct in6_addr), 0);
+}
 
+static size_t rehash_probe(const void *e, void *unused)
+{
+	return addr_hash(&((struct icmp_ping_st *)e)->addr);
+}
 
+static size_t rehash_result(const void *e, void *unused)
+{
+	return addr_hash(&((struct ping_result_st *)e)->addr);
 }
 
-int icmp_ping4(main_server_st * s, struct sockaddr_in *addr1)
+/* both entries start with the address */
+static bool addr_cmp(const void *e, void *addr)
 {
-	struct icmp *pkt;
-	int pingsock, c, e;
-	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
-	char buf1[64];
-	time_t now;
-	uint16_t id1;
-	unsigned gotreply = 0, unreachable = 0;
+	const struct sockaddr_storage *a1 = e, *a2 = addr;
 
-	if (GETCONFIG(s)->ping_leases == 0)
-		return 0;
+	return a1->ss_family == a2->ss_family && ip_cmp(a1, a2) == 0;
+}
 
-	gnutls_rnd(GNUTLS_RND_NONCE, &id1, sizeof(id1));
+static void ping_init(void)
+{
+	if (ping.init)
+		return;
 
-	pingsock = socket(AF_INET, SOCK_RAW, 1);
-	if (pingsock == -1) {
-		e = errno;
-		mslog(s, NULL, LOG_INFO,
-		      "could not open raw socket for ping: %s", strerror(e));
-		return 0;
+	htable_init(&ping.pending, rehash_probe, NULL);
+	htable_init(&ping.cache, rehash_result, NULL);
+	ping.init = 1;
+}
+
+static struct ping_result_st *cache_get(const struct sockaddr_storage *addr)
+{
+	struct ping_result_st *r;
+	size_t hash = addr_hash(addr);
+
+	r = htable_get(&ping.cache, hash, addr_cmp, addr);
+	if (r != NULL && r->expires < time(0)) {
+		htable_del(&ping.cache, hash, r);
+		talloc_free(r);
+		return NULL;
 	}
 
-	pkt = (struct icmp *) packet1;
-	memset(pkt, 0, sizeof(packet1));
-	pkt->icmp_type = ICMP_ECHO;
-	pkt->icmp_id = id1;
-	pkt->icmp_cksum =
-	    in_cksum((unsigned short *) pkt, sizeof(packet1));
+	return r;
+}
 
-	while ((c = sendto(pingsock, packet1, DEFDATALEN + ICMP_MINLEN, 0,
-			   (struct sockaddr *) addr1,
-			   sizeof(*addr1)) == -1) && retry(errno));
-	/* listen for replies */
+static void cache_add(main_server_st *s, const struct sockaddr_storage *addr, unsigned in_use)
+{
+	struct ping_result_st *r;
+
+	r = cache_get(addr);
+	if (r == NULL) {
+		r = talloc_zero(s, struct ping_result_st);
+		if (r == NULL)
+			return;
+		memcpy(&r->addr, addr, sizeof(r->addr));
+
+		if (htable_add(&ping.cache, addr_hash(addr), r) == 0) {
+			talloc_free(r);
+			return;
+		}
+	}
 
-	now = time(0);
-	while (time(0) - now < PING_TIMEOUT
-	       && (unreachable + gotreply) < 2) {
-		struct sockaddr_in from;
-		socklen_t fromlen = sizeof(from);
+	r->expires = time(0) + PING_CACHE_TIME;
+	r->in_use = in_use;
+}
 
-		c = recvfrom_timeout(pingsock, packet1, sizeof(packet1), 0,
-				     (struct sockaddr *) &from, &fromlen);
+static int unref_probe(struct icmp_ping_st *probe)
+{
+	htable_del(&ping.pending, addr_hash(&probe->addr), probe);
+	ev_timer_stop(loop, &probe->timer);
 
-		if (c < 0) {
-			continue;
-		} else if (c >= 76 && fromlen == sizeof(struct sockaddr_in)) {	/* icmp6_hdr */
-			if (memcmp
-			    (SA_IN_P(&from), SA_IN_P(addr1),
-			     SA_IN_SIZE(sizeof(*addr1))) == 0) {
+	return 0;
+}
+
+static void probe_done(main_server_st *s, struct icmp_ping_st *probe, unsigned in_use)
+{
+	icmp_ping_func func = probe->func;
+	void *priv = probe->priv;
+	char buf[64];
+
+	mslog(s, NULL, LOG_INFO, "pinged %s and is %s",
+	      human_addr((void *)&probe->addr,
+			 probe->addr.ss_family == AF_INET ? sizeof(struct sockaddr_in) :
+			 sizeof(struct sockaddr_in6), buf, sizeof(buf)),
+	      in_use ? "in use" : "not in use");
+
+	cache_add(s, &probe->addr, in_use);
+
+	/* the callback may release the owner of the probe */
+	talloc_free(probe);
+	func(s, priv, in_use);
+}
+
+static void ping_timeout_cb(EV_P_ ev_timer *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct icmp_ping_st *probe = container_of(w, struct icmp_ping_st, timer);
+
+	probe_done(s, probe, 0);
+}
+
+static void ping_reply(main_server_st *s, struct sockaddr_storage *from)
+{
+	struct icmp_ping_st *probe;
+
+	probe = htable_get(&ping.pending, addr_hash(from), addr_cmp, from);
+	if (probe != NULL)
+		probe_done(s, probe, 1);
+}
+
+static void ping_reply_cb(EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	char packet[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	ssize_t c;
+	unsigned hlen;
+
+	for (;;) {
+		fromlen = sizeof(from);
+		c = recvfrom(w->fd, packet, sizeof(packet), 0,
+			     (struct sockaddr *)&from, &fromlen);
+		if (c < 0)
+			return;
+
+		if (w->fd == ping.fd[0]) {
+			struct icmp *pkt;
+
+			if (c < 20 || fromlen < sizeof(struct sockaddr_in))
+				continue;
 
 #ifdef HAVE_STRUCT_IPHDR_IHL
-				struct iphdr *iphdr =
-				    (struct iphdr *) packet1;
-				pkt = (struct icmp *) (packet1 + (iphdr->ihl << 2));	/* skip ip hdr */
+			hlen = ((struct iphdr *)packet)->ihl << 2;	/* skip ip hdr */
 #else
-				pkt = (struct icmp *) (packet1 + ((packet1[0] & 0x0f) << 2));	/* skip ip hdr */
+			hlen = (packet[0] & 0x0f) << 2;	/* skip ip hdr */
 #endif
-				if (pkt->icmp_id == id1) {
-					if (pkt->icmp_type == ICMP_ECHOREPLY)
-						gotreply++;
-					else if (pkt->icmp_type == ICMP_DEST_UNREACH)
-						unreachable++;
-                                }
-			}
-		}
-	}
+			if (c < hlen + ICMP_MINLEN)
+				continue;
 
-	close(pingsock);
+			pkt = (struct icmp *)(packet + hlen);
+			if (pkt->icmp_type == ICMP_ECHOREPLY && pkt->icmp_id == ping.id[0])
+				ping_reply(s, &from);
+		} else {
+			struct icmp6_hdr *pkt = (struct icmp6_hdr *)packet;
 
-	if (gotreply > 0) {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in), buf1,
-				 sizeof(buf1)));
-		return gotreply;
-	} else {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is not in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in), buf1,
-				 sizeof(buf1)));
-		return 0;
+			if (c < (ssize_t)sizeof(struct icmp6_hdr) ||
+			    fromlen < sizeof(struct sockaddr_in6))
+				continue;
+
+			if (pkt->icmp6_type == ICMP6_ECHO_REPLY && pkt->icmp6_id == ping.id[1])
+				ping_reply(s, &from);
+		}
 	}
 }
 
-int icmp_ping6(main_server_st * s,
-	       struct sockaddr_in6 *addr1)
+static int ping_socket(main_server_st *s, int family)
 {
-	struct icmp6_hdr *pkt;
-	char buf1[64];
-	int pingsock, c, e;
+	unsigned i = family == AF_INET ? 0 : 1;
+	int fd, e;
 #if defined(SOL_RAW) && defined(IPV6_CHECKSUM)
 	int sockopt;
 #endif
-	char packet1[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
-	uint16_t id1;
-	unsigned gotreply = 0, unreachable = 0;
-	time_t now;
 
-	if (GETCONFIG(s)->ping_leases == 0)
-		return 0;
+	if (ping.fd[i] != -1)
+		return ping.fd[i];
 
-	gnutls_rnd(GNUTLS_RND_NONCE, &id1, sizeof(id1));
-
-	pingsock = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
-	if (pingsock == -1) {
+	if (family == AF_INET)
+		fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+	else
+		fd = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+	if (fd == -1) {
 		e = errno;
 		mslog(s, NULL, LOG_INFO,
 		      "could not open raw socket for ping: %s", strerror(e));
-		return 0;
+		return -1;
 	}
 
-	pkt = (struct icmp6_hdr *) packet1;
-	memset(pkt, 0, sizeof(packet1));
-	pkt->icmp6_type = ICMP6_ECHO_REQUEST;
-	pkt->icmp6_id = id1;
+	set_cloexec_flag(fd, 1);
+	set_non_block(fd);
 
+	if (family == AF_INET6) {
 #if defined(SOL_RAW) && defined(IPV6_CHECKSUM)
-	sockopt = offsetof(struct icmp6_hdr, icmp6_cksum);
-	setsockopt(pingsock, SOL_RAW, IPV6_CHECKSUM,
-		   &sockopt, sizeof(sockopt));
+		sockopt = offsetof(struct icmp6_hdr, icmp6_cksum);
+		setsockopt(fd, SOL_RAW, IPV6_CHECKSUM,
+			   &sockopt, sizeof(sockopt));
 #endif
-	while ((c =
-		sendto(pingsock, packet1,
-		       DEFDATALEN + sizeof(struct icmp6_hdr), 0,
-		       (struct sockaddr *) addr1,
-		       sizeof(*addr1)) == -1) && retry(errno));
-
-	/* listen for replies */
-	now = time(0);
-	while (time(0) - now < PING_TIMEOUT
-	       && (unreachable + gotreply) < 2) {
-		struct sockaddr_in6 from;
-		socklen_t fromlen = sizeof(from);
-		c = recvfrom_timeout(pingsock, packet1,
-				     sizeof(packet1), 0,
-				     (struct sockaddr *)
-				     &from, &fromlen);
-		if (c < 0) {
-			continue;
-		} else if (c >= 8 && fromlen == sizeof(struct sockaddr_in6)) {	/* icmp6_hdr */
-			if (memcmp
-			    (SA_IN6_P(&from), SA_IN6_P(addr1),
-			     SA_IN_SIZE(sizeof(*addr1))) == 0) {
-
-				pkt = (struct icmp6_hdr *) packet1;
-				if (pkt->icmp6_id == id1) {
-					if (pkt->icmp6_type == ICMP6_ECHO_REPLY)
-						gotreply++;
-					else if (pkt->icmp6_type == ICMP6_DST_UNREACH)
-						unreachable++;
-				}
-			}
+#ifdef ICMP6_FILTER
+		{
+			struct icmp6_filter filter;
+
+			/* we only care about the echo replies */
+			ICMP6_FILTER_SETBLOCKALL(&filter);
+			ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+			setsockopt(fd, IPPROTO_ICMPV6, ICMP6_FILTER,
+				   &filter, sizeof(filter));
 		}
+#endif
 	}
 
-	close(pingsock);
+	gnutls_rnd(GNUTLS_RND_NONCE, &ping.id[i], sizeof(ping.id[i]));
 
-	if (gotreply > 0) {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in6), buf1,
-				 sizeof(buf1)));
-		return gotreply;
+	ev_io_init(&ping.io[i], ping_reply_cb, fd, EV_READ);
+	ev_io_start(loop, &ping.io[i]);
+
+	ping.fd[i] = fd;
+	return fd;
+}
+
+static int ping_send(int fd, const struct sockaddr_storage *addr)
+{
+	char packet[DEFDATALEN + MAXIPLEN + MAXICMPLEN];
+	int c;
+
+	memset(packet, 0, sizeof(packet));
+	ping.seq++;
+
+	if (addr->ss_family == AF_INET) {
+		struct icmp *pkt = (struct icmp *)packet;
+
+		pkt->icmp_type = ICMP_ECHO;
+		pkt->icmp_id = ping.id[0];
+		pkt->icmp_seq = ping.seq;
+		pkt->icmp_cksum =
+		    in_cksum((unsigned short *)pkt, DEFDATALEN + ICMP_MINLEN);
+
+		while ((c = sendto(fd, packet, DEFDATALEN + ICMP_MINLEN, 0,
+				   (struct sockaddr *)addr,
+				   sizeof(struct sockaddr_in))) == -1 && retry(errno));
 	} else {
-		mslog(s, NULL, LOG_INFO,
-		      "pinged %s and is not in use",
-		      human_addr((void *) addr1,
-				 sizeof(struct sockaddr_in6), buf1,
-				 sizeof(buf1)));
+		struct icmp6_hdr *pkt = (struct icmp6_hdr *)packet;
+
+		pkt->icmp6_type = ICMP6_ECHO_REQUEST;
+		pkt->icmp6_id = ping.id[1];
+		pkt->icmp6_seq = ping.seq;
+
+		while ((c = sendto(fd, packet,
+				   DEFDATALEN + sizeof(struct icmp6_hdr), 0,
+				   (struct sockaddr *)addr,
+				   sizeof(struct sockaddr_in6))) == -1 && retry(errno));
+	}
+
+	return c < 0 ? -1 : 0;
+}
+
+/* Checks whether a host responds at @addr. Returns 0 if it is known not
+ * to, 1 if it is known to, or ERR_WAIT_FOR_PING if an echo request was
+ * sent; then @func is called with the result from the event loop, unless
+ * @ctx, which owns the probe, is released first. */
+int icmp_ping_start(main_server_st *s, void *ctx, const struct sockaddr_storage *addr,
+		    icmp_ping_func func, void *priv)
+{
+	struct icmp_ping_st *probe;
+	struct ping_result_st *r;
+	int fd, e;
+
+	if (GETCONFIG(s)->ping_leases == 0)
+		return 0;
+
+	ping_init();
+
+	r = cache_get(addr);
+	if (r != NULL)
+		return r->in_use;
+
+	fd = ping_socket(s, addr->ss_family);
+	if (fd < 0)
 		return 0;
+
+	probe = talloc_zero(ctx, struct icmp_ping_st);
+	if (probe == NULL)
+		return ERR_MEM;
+
+	memcpy(&probe->addr, addr, sizeof(probe->addr));
+	probe->func = func;
+	probe->priv = priv;
+
+	if (ping_send(fd, addr) < 0) {
+		e = errno;
+		mslog(s, NULL, LOG_INFO, "could not send ping: %s", strerror(e));
+		talloc_free(probe);
+		return 0;
+	}
+
+	if (htable_add(&ping.pending, addr_hash(addr), probe) == 0) {
+		talloc_free(probe);
+		return ERR_MEM;
+	}
+
+	ev_timer_init(&probe->timer, ping_timeout_cb, PING_TIMEOUT, 0);
+	ev_timer_start(loop, &probe->timer);
+	talloc_set_destructor(probe, unref_probe);
+
+	return ERR_WAIT_FOR_PING;
+}
+
+/* Returns non-zero if a host recently responded at @addr */
+unsigned icmp_ping_in_use(const struct sockaddr_storage *addr)
+{
+	struct ping_result_st *r;
+
+	if (ping.init == 0)
+		return 0;
+
+	r = cache_get(addr);
+	return r != NULL && r->in_use;
+}
+
+/* Removes the expired results */
+void icmp_ping_expire(void)
+{
+	struct ping_result_st *r;
+	struct htable_iter iter;
+	time_t now = time(0);
+
+	if (ping.init == 0)
+		return;
+
+	r = htable_first(&ping.cache, &iter);
+	while (r != NULL) {
+		if (r->expires < now) {
+			htable_delval(&ping.cache, &iter);
+			talloc_free(r);
+		}
+		r = htable_next(&ping.cache, &iter);
+	}
+}
+
+/* The probes are released by their owners */
+void icmp_ping_deinit(void)
+{
+	struct ping_result_st *r;
+	struct htable_iter iter;
+	unsigned i;
+
+	for (i = 0; i < 2; i++) {
+		if (ping.fd[i] == -1)
+			continue;
+		if (loop)
+			ev_io_stop(loop, &ping.io[i]);
+		close(ping.fd[i]);
+		ping.fd[i] = -1;
+	}
+
+	if (ping.init == 0)
+		return;
+
+	r = htable_first(&ping.cache, &iter);
+	while (r != NULL) {
+		talloc_free(r);
+		r = htable_next(&ping.cache, &iter);
 	}
+	htable_clear(&ping.cache);
+	htable_clear(&ping.pending);
+	ping.init = 0;
 }
@@ -23,9 +23,13 @@
 
 #include <main.h>
 
-/* returns the number of positive replies received or
- * 0 if no host with this IP exists. */
-int icmp_ping4(main_server_st* s, struct sockaddr_in* addr1);
-int icmp_ping6(main_server_st* s, struct sockaddr_in6* addr1);
+/* called with a non-zero @in_use if a host replied */
+typedef void (*icmp_ping_func)(main_server_st *s, void *priv, unsigned in_use);
+
+int icmp_ping_start(main_server_st *s, void *ctx, const struct sockaddr_storage *addr,
+		    icmp_ping_func func, void *priv);
+unsigned icmp_ping_in_use(const struct sockaddr_storage *addr);
+void icmp_ping_expire(void);
+void icmp_ping_deinit(void);
 
 #endif
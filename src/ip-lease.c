@@ -48,10 +48,266 @@ void ip_from_seed(uint8_t *seed, unsigned seed_size,
 
 }
 
+/* The addresses of a network (IPv4), or its subnets (IPv6), are tracked
+ * as slots of a bitmap, with a set bit for a free slot. Every level above
+ * it has a bit set for each non-zero word of the level below, so that a
+ * free slot is found by examining one word per level. A pool is released
+ * with the last lease in it, so that the pools of the per-user or group
+ * networks do not accumulate as their sessions come and go.
+ */
+#define MAX_POOL_BITS 24
+#define POOL_LEVELS ((MAX_POOL_BITS + 5) / 6)
+
+struct ip_pool_st {
+	struct list_node list;
+	int family;
+	uint8_t network[16];
+	unsigned prefix; /* of the network */
+	unsigned bits; /* of the slot number; the slot prefix is prefix+bits */
+	uint32_t cursor; /* the slot to start searching from */
+	uint32_t free;
+	uint32_t leases; /* the leases in the network */
+
+	unsigned levels;
+	uint64_t *level[POOL_LEVELS];
+	uint32_t words[POOL_LEVELS];
+};
+
+static unsigned ip_size(int family)
+{
+	return family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+}
+
+/* Returns the @bits after @prefix of @ip, i.e., the slot of the address */
+static uint32_t get_slot(const uint8_t *ip, unsigned prefix, unsigned bits)
+{
+	uint32_t v = 0;
+	unsigned i;
+
+	for (i = prefix; i < prefix + bits; i++)
+		v = (v << 1) | ((ip[i / 8] >> (7 - i % 8)) & 1);
+
+	return v;
+}
+
+static void set_slot(uint8_t *ip, unsigned prefix, unsigned bits, uint32_t v)
+{
+	unsigned i;
+
+	for (i = prefix + bits; i-- > prefix; v >>= 1) {
+		if (v & 1)
+			ip[i / 8] |= 1 << (7 - i % 8);
+		else
+			ip[i / 8] &= ~(1 << (7 - i % 8));
+	}
+}
+
+static unsigned in_pool(struct ip_pool_st *pool, int family, const uint8_t *ip)
+{
+	unsigned i;
+
+	if (family != pool->family)
+		return 0;
+
+	for (i = 0; i < pool->prefix; i++) {
+		if (((ip[i / 8] ^ pool->network[i / 8]) >> (7 - i % 8)) & 1)
+			return 0;
+	}
+
+	return 1;
+}
+
+static void pool_set_used(struct ip_pool_st *pool, uint32_t slot)
+{
+	unsigned l;
+	uint64_t *w;
+
+	for (l = 0; l < pool->levels; l++, slot /= 64) {
+		w = &pool->level[l][slot / 64];
+		if (l == 0) {
+			if (!(*w & (1ULL << (slot % 64))))
+				return;
+			pool->free--;
+		}
+		*w &= ~(1ULL << (slot % 64));
+		/* the word above needs updating only if this became empty */
+		if (*w != 0)
+			return;
+	}
+}
+
+static void pool_set_free(struct ip_pool_st *pool, uint32_t slot)
+{
+	unsigned l;
+	uint64_t *w, old;
+
+	for (l = 0; l < pool->levels; l++, slot /= 64) {
+		w = &pool->level[l][slot / 64];
+		old = *w;
+		if (l == 0) {
+			if (old & (1ULL << (slot % 64)))
+				return;
+			pool->free++;
+		}
+		*w |= 1ULL << (slot % 64);
+		/* the word above needs updating only if this was empty */
+		if (old != 0)
+			return;
+	}
+}
+
+/* Returns the first set bit of level @l at or after @pos, or -1 */
+static int64_t pool_find(struct ip_pool_st *pool, unsigned l, uint64_t pos)
+{
+	uint64_t w;
+	int64_t idx;
+
+	if (l >= pool->levels || pos >= (uint64_t)pool->words[l] * 64)
+		return -1;
+
+	idx = pos / 64;
+	w = pool->level[l][idx] & (~0ULL << (pos % 64));
+	if (w == 0) {
+		idx = pool_find(pool, l + 1, idx + 1);
+		if (idx < 0)
+			return -1;
+		w = pool->level[l][idx];
+	}
+
+	return idx * 64 + __builtin_ctzll(w);
+}
+
+/* Sets the slot bits of @ip to the next free slot; the slots are used in
+ * turn, so that a released address is not reused immediately. */
+static int pool_next_free(struct ip_pool_st *pool, uint8_t *ip)
+{
+	int64_t slot;
+
+	slot = pool_find(pool, 0, pool->cursor);
+	if (slot < 0)
+		slot = pool_find(pool, 0, 0);
+	if (slot < 0)
+		return -1;
+
+	pool->cursor = slot + 1;
+	set_slot(ip, pool->prefix, pool->bits, slot);
+
+	return 0;
+}
+
+/* Releases @pool if no lease is in it */
+static void put_pool(struct ip_pool_st *pool)
+{
+	if (pool == NULL || pool->leases > 0)
+		return;
+
+	list_del(&pool->list);
+	talloc_free(pool);
+}
+
+static void pools_update(struct ip_lease_db_st *db, struct ip_lease_st *lease, unsigned used)
+{
+	struct ip_pool_st *pool, *tmp;
+	int family = lease->sig.ss_family;
+	const uint8_t *ip;
+
+	ip = family == AF_INET ? SA_IN_U8_P(&lease->sig) : SA_IN6_U8_P(&lease->sig);
+
+	list_for_each_safe(&db->pools, pool, tmp, list) {
+		if (!in_pool(pool, family, ip))
+			continue;
+
+		if (used) {
+			pool_set_used(pool, get_slot(ip, pool->prefix, pool->bits));
+			pool->leases++;
+		} else {
+			pool_set_free(pool, get_slot(ip, pool->prefix, pool->bits));
+			pool->leases--;
+			put_pool(pool);
+		}
+	}
+}
+
+/* Returns the pool of the network, for leases of @slot_prefix bits, or
+ * NULL if the network is too large to track; such a network is not
+ * expected to fill up, and random addresses are tried in it. A pool
+ * which is given no lease is to be released with put_pool(). */
+static struct ip_pool_st *get_pool(main_server_st *s, int family, const uint8_t *network,
+				   unsigned prefix, unsigned slot_prefix)
+{
+	struct ip_pool_st *pool;
+	struct ip_lease_st *lease;
+	struct htable_iter iter;
+	uint64_t n;
+	unsigned l, i;
+
+	if (slot_prefix <= prefix || slot_prefix - prefix > MAX_POOL_BITS ||
+	    (family == AF_INET && slot_prefix - prefix < 2))
+		return NULL;
+
+	list_for_each(&s->ip_leases.pools, pool, list) {
+		if (pool->family == family && pool->prefix == prefix &&
+		    pool->bits == slot_prefix - prefix &&
+		    memcmp(pool->network, network, ip_size(family)) == 0)
+			return pool;
+	}
+
+	pool = talloc_zero(s, struct ip_pool_st);
+	if (pool == NULL)
+		return NULL;
+
+	pool->family = family;
+	memcpy(pool->network, network, ip_size(family));
+	pool->prefix = prefix;
+	pool->bits = slot_prefix - prefix;
+
+	n = 1ULL << pool->bits;
+	for (l = 0; l < POOL_LEVELS; l++) {
+		pool->words[l] = (n + 63) / 64;
+		pool->level[l] = talloc_zero_array(pool, uint64_t, pool->words[l]);
+		if (pool->level[l] == NULL) {
+			talloc_free(pool);
+			return NULL;
+		}
+		pool->levels++;
+		if (pool->words[l] == 1)
+			break;
+		n = pool->words[l];
+	}
+
+	for (i = 0; i < (1U << pool->bits); i++)
+		pool_set_free(pool, i);
+
+	/* the network address and the subnet of our address (IPv6), or
+	 * the network, our and the broadcast address (IPv4) */
+	pool_set_used(pool, 0);
+	if (family == AF_INET) {
+		pool_set_used(pool, 1);
+		pool_set_used(pool, (1U << pool->bits) - 1);
+	}
+
+	list_add(&s->ip_leases.pools, &pool->list);
+
+	lease = htable_first(&s->ip_leases.ht, &iter);
+	while (lease != NULL) {
+		if (lease->sig.ss_family == family) {
+			const uint8_t *ip = family == AF_INET ? SA_IN_U8_P(&lease->sig) : SA_IN6_U8_P(&lease->sig);
+			if (in_pool(pool, family, ip)) {
+				pool_set_used(pool, get_slot(ip, pool->prefix, pool->bits));
+				pool->leases++;
+			}
+		}
+		lease = htable_next(&s->ip_leases.ht, &iter);
+	}
+
+	return pool;
+}
+
 void ip_lease_deinit(struct ip_lease_db_st* db)
 {
 struct ip_lease_st * cache;
 struct htable_iter iter;
+struct ip_pool_st *pool, *tmp;
 
 	cache = htable_first(&db->ht, &iter);
 	while(cache != NULL) {
@@ -62,7 +318,12 @@ struct htable_iter iter;
 		cache = htable_next(&db->ht, &iter);
 	}
 	htable_clear(&db->ht);
-	
+
+	list_for_each_safe(&db->pools, pool, tmp, list) {
+		list_del(&pool->list);
+		talloc_free(pool);
+	}
+
 	return;
 }
 
@@ -76,6 +337,7 @@ const struct ip_lease_st * e = _e;
 void ip_lease_init(struct ip_lease_db_st* db)
 {
 	htable_init(&db->ht, rehash, NULL);
+	list_head_init(&db->pools);
 }
 
 static bool ip_lease_cmp(const void* _c1, void* _c2)
@@ -113,6 +375,12 @@ void steal_ip_leases(struct proc_st* proc, struct proc_st *thief)
 
 	thief->ipv4 = talloc_move(thief, &proc->ipv4);
 	thief->ipv6 = talloc_move(thief, &proc->ipv6);
+
+	/* a probe in progress completes for the thief */
+	if (thief->ipv4)
+		thief->ipv4->proc = thief;
+	if (thief->ipv6)
+		thief->ipv6->proc = thief;
 }
 
 static int is_ipv6_ok(main_server_st *s, struct sockaddr_storage *ip, struct sockaddr_storage *net, struct sockaddr_storage *subnet)
@@ -128,6 +396,11 @@ static int is_ipv6_ok(main_server_st *s, struct sockaddr_storage *ip, struct soc
 		return 0;
 	}
 
+	/* or a host was seen using it */
+	if (icmp_ping_in_use(ip) != 0) {
+		return 0;
+	}
+
 	return 1;
 }
 
@@ -142,6 +415,7 @@ static int is_ipv4_ok(main_server_st *s, struct sockaddr_storage *ip, struct soc
 	}
 
 	if (ip_lease_exists(s, ip, sizeof(struct sockaddr_in)) != 0 ||
+	    icmp_ping_in_use(ip) != 0 ||
 	    ip_cmp(ip, net) == 0 ||
 	    ip_cmp(ip, &broadcast) == 0) {
 	    return 0;
@@ -152,12 +426,28 @@ static int is_ipv4_ok(main_server_st *s, struct sockaddr_storage *ip, struct soc
 #define MAX_IP_TRIES 16
 #define FIXED_IPS 5
 
+static unsigned ipv4_mask_to_prefix(const uint8_t *mask)
+{
+	uint32_t m = ((uint32_t)mask[0] << 24) | (mask[1] << 16) | (mask[2] << 8) | mask[3];
+	unsigned prefix = 0;
+
+	while (prefix < 32 && (m & (1U << (31 - prefix))))
+		prefix++;
+
+	/* a non-contiguous mask */
+	if (prefix < 32 && (m << prefix) != 0)
+		return 0;
+
+	return prefix;
+}
+
 static
 int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
 {
 
 	struct sockaddr_storage tmp, mask, network, rnd;
-	unsigned i;
+	struct ip_pool_st *pool = NULL;
+	unsigned i, prefix;
 	unsigned max_loops = MAX_IP_TRIES;
 	int ret;
 	const char *c_network, *c_netmask;
@@ -254,6 +544,10 @@ int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
 	((struct sockaddr_in*)&rnd)->sin_family = AF_INET;
 	((struct sockaddr_in*)&rnd)->sin_port = 0;
 
+	prefix = ipv4_mask_to_prefix(SA_IN_U8_P(&mask));
+	if (prefix > 0)
+		pool = get_pool(s, AF_INET, SA_IN_U8_P(&network), prefix, 32);
+
 	do {
 		if (max_loops == 0) {
 			mslog(s, proc, LOG_ERR, "could not figure out a valid IPv4 IP");
@@ -264,7 +558,15 @@ int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
 			memcpy(SA_IN_U8_P(&rnd), proc->ipv4_seed, 4);
 		} else {
 			if (max_loops < MAX_IP_TRIES-FIXED_IPS) {
-				gnutls_rnd(GNUTLS_RND_NONCE, SA_IN_U8_P(&rnd), sizeof(struct in_addr));
+				/* the addresses derived from the seed are taken;
+				 * use the next free one, if known */
+				if (pool == NULL)
+					gnutls_rnd(GNUTLS_RND_NONCE, SA_IN_U8_P(&rnd), sizeof(struct in_addr));
+				else if (pool_next_free(pool, SA_IN_U8_P(&rnd)) < 0) {
+					mslog(s, proc, LOG_ERR, "all IPv4 addresses of %s are in use", c_network);
+					ret = ERR_NO_IP;
+					goto fail;
+				}
 			} else {
 				ip_from_seed(SA_IN_U8_P(&rnd), sizeof(struct in_addr),
 					     SA_IN_U8_P(&rnd), sizeof(struct in_addr));
@@ -304,14 +606,13 @@ int get_ipv4_lease(main_server_st* s, struct proc_st* proc)
 
 		mslog(s, proc, LOG_DEBUG, "selected IP: %s",
 		      human_addr((void*)&proc->ipv4->rip, proc->ipv4->rip_len, buf, sizeof(buf)));
-
-       		if (icmp_ping4(s, (void*)&proc->ipv4->rip) == 0)
-       			break;
+		break;
 	} while(1);
 
 	return 0;
 
 fail:
+	put_pool(pool);
 	talloc_free(proc->ipv4);
 	proc->ipv4 = NULL;
 
@@ -323,6 +624,7 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
 {
 
 	struct sockaddr_storage tmp, mask, network, rnd, subnet_mask;
+	struct ip_pool_st *pool = NULL;
 	unsigned i, max_loops = MAX_IP_TRIES;
 	const char* c_network = NULL;
 	unsigned prefix, subnet_prefix ;
@@ -411,6 +713,8 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
        	((struct sockaddr_in6*)&tmp)->sin6_family = AF_INET6;
        	((struct sockaddr_in6*)&tmp)->sin6_port = 0;
 
+	pool = get_pool(s, AF_INET6, SA_IN6_U8_P(&network), prefix, subnet_prefix);
+
 	do {
 		if (max_loops == 0) {
 			mslog(s, NULL, LOG_ERR, "could not figure out a valid IPv6 IP");
@@ -427,6 +731,13 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
 		} else {
 			if (max_loops < MAX_IP_TRIES-FIXED_IPS) {
 				gnutls_rnd(GNUTLS_RND_NONCE, SA_IN_U8_P(&rnd), sizeof(struct in6_addr));
+				/* keep the random interface identifier, but
+				 * use the next free subnet, if known */
+				if (pool != NULL && pool_next_free(pool, SA_IN6_U8_P(&rnd)) < 0) {
+					mslog(s, proc, LOG_ERR, "all IPv6 subnets of %s/%u are in use", c_network, prefix);
+					ret = ERR_NO_IP;
+					goto fail;
+				}
 			} else {
 				ip_from_seed(SA_IN6_U8_P(&rnd), sizeof(struct in6_addr),
 					     SA_IN6_U8_P(&rnd), sizeof(struct in6_addr));
@@ -461,9 +772,7 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
 
 		mslog(s, proc, LOG_DEBUG, "selected IP: %s",
 		      human_addr((void*)&proc->ipv6->rip, proc->ipv6->rip_len, buf, sizeof(buf)));
-
-        	if (proc->ipv6->prefix != 128 || icmp_ping6(s, (void*)&proc->ipv6->rip) == 0)
-        		break;
+		break;
         } while(1);
 
  finish:
@@ -477,6 +786,7 @@ int get_ipv6_lease(main_server_st* s, struct proc_st* proc)
 
 	return 0;
 fail:
+	put_pool(pool);
 	talloc_free(proc->ipv6);
 	proc->ipv6 = NULL;
 
@@ -489,6 +799,7 @@ int unref_ip_lease(struct ip_lease_st *lease)
 {
 	if (lease->db) {
 		htable_del(&lease->db->ht, rehash(lease, NULL), lease);
+		pools_update(lease->db, lease, 0);
 	}
 
 	return 0;
@@ -509,6 +820,7 @@ char buf[128];
 				mslog(s, proc, LOG_ERR, "could not add IPv4 lease to hash table");
 				return -1;
 			}
+			pools_update(&s->ip_leases, proc->ipv4, 1);
 			talloc_set_destructor(proc->ipv4, unref_ip_lease);
 		}
 	}
@@ -523,6 +835,7 @@ char buf[128];
 				mslog(s, proc, LOG_ERR, "could not add IPv6 lease to hash table");
 				return -1;
 			}
+			pools_update(&s->ip_leases, proc->ipv6, 1);
 			talloc_set_destructor(proc->ipv6, unref_ip_lease);
 		}
 	}
@@ -544,6 +857,114 @@ char buf[128];
 	return 0;
 }
 
+/* Replaces a lease whose address was found in use */
+static int replace_ip_lease(main_server_st *s, struct proc_st *proc, struct ip_lease_st *lease)
+{
+	char buf[128];
+
+	mslog(s, proc, LOG_INFO, "address %s is used by another host",
+	      human_addr((void*)&lease->rip, lease->rip_len, buf, sizeof(buf)));
+
+	if (proc->ipv4 == lease)
+		proc->ipv4 = NULL;
+	else
+		proc->ipv6 = NULL;
+	talloc_free(lease);
+
+	if (++proc->leases_replaced >= MAX_IP_TRIES) {
+		mslog(s, proc, LOG_ERR, "could not find an address not used by another host");
+		return ERR_NO_IP;
+	}
+
+	return get_ip_leases(s, proc);
+}
+
+static void lease_probe_cb(main_server_st *s, void *priv, unsigned in_use)
+{
+	struct ip_lease_st *lease = priv;
+	struct proc_st *proc = lease->proc;
+	int ret = 0;
+
+	if (in_use) {
+		ret = replace_ip_lease(s, proc, lease);
+	} else {
+		lease->probe = LEASE_PROBE_DONE;
+	}
+
+	if (ret < 0) {
+		/* cancels the other probe */
+		remove_ip_leases(s, proc);
+	} else {
+		/* wait for the other probe */
+		if ((proc->ipv4 && proc->ipv4->probe == LEASE_PROBE_PENDING) ||
+		    (proc->ipv6 && proc->ipv6->probe == LEASE_PROBE_PENDING))
+			return;
+
+		ret = probe_ip_leases(s, proc);
+		if (ret == ERR_WAIT_FOR_PING)
+			return;
+	}
+
+	handle_lease_probe_res(s, proc, ret);
+}
+
+/* Checks that no host uses the leased addresses (when ping-leases is
+ * set), replacing the addresses found in use. Returns 0 when the leases
+ * can be used, or ERR_WAIT_FOR_PING if the check is in progress; then
+ * handle_lease_probe_res() is called once it completes.
+ */
+int probe_ip_leases(main_server_st *s, struct proc_st *proc)
+{
+	struct ip_lease_st *lease;
+	unsigned i, pending;
+	int ret;
+
+ again:
+	pending = 0;
+	for (i = 0; i < 2; i++) {
+		lease = i == 0 ? proc->ipv4 : proc->ipv6;
+
+		/* the explicit addresses are not probed */
+		if (lease == NULL || lease->db == NULL ||
+		    lease->probe == LEASE_PROBE_DONE)
+			continue;
+
+		if (lease->probe == LEASE_PROBE_PENDING) {
+			pending++;
+			continue;
+		}
+
+		/* an IPv6 subnet may be used by the client in any way */
+		if (lease->rip.ss_family == AF_INET6 && lease->prefix != 128) {
+			lease->probe = LEASE_PROBE_DONE;
+			continue;
+		}
+
+		ret = icmp_ping_start(s, lease, &lease->rip, lease_probe_cb, lease);
+		if (ret == ERR_WAIT_FOR_PING) {
+			lease->probe = LEASE_PROBE_PENDING;
+			lease->proc = proc;
+			pending++;
+		} else if (ret == 0) {
+			lease->probe = LEASE_PROBE_DONE;
+		} else if (ret < 0) {
+			goto fail;
+		} else {
+			ret = replace_ip_lease(s, proc, lease);
+			if (ret < 0)
+				goto fail;
+			goto again;
+		}
+	}
+
+	return pending > 0 ? ERR_WAIT_FOR_PING : 0;
+
+ fail:
+	/* cancels any probe in progress */
+	remove_ip_leases(s, proc);
+	return ret;
+}
+
 void remove_ip_leases(main_server_st* s, struct proc_st* proc)
 {
 	if (proc->ipv4) {
@@ -41,6 +41,16 @@ struct ip_lease_st {
         unsigned prefix; /* in ipv6 */
 
         struct ip_lease_db_st* db;
+
+        /* whether we checked that no host uses the address */
+        unsigned probe; /* LEASE_PROBE_ */
+        struct proc_st *proc; /* the owner while probing */
+};
+
+enum {
+	LEASE_PROBE_NONE,
+	LEASE_PROBE_PENDING,
+	LEASE_PROBE_DONE,
 };
 
 void ip_lease_deinit(struct ip_lease_db_st* db);
@@ -49,6 +59,7 @@ void ip_lease_init(struct ip_lease_db_st* db);
 void steal_ip_leases(struct proc_st* proc, struct proc_st *thief);
 
 int get_ip_leases(struct main_server_st* s, struct proc_st* proc);
+int probe_ip_leases(struct main_server_st* s, struct proc_st* proc);
 void remove_ip_leases(struct main_server_st* s, struct proc_st* proc);
 void remove_ip_lease(main_server_st* s, struct ip_lease_st * lease);
 
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <lat-hist.h>
+
+static unsigned log2_floor(uint64_t v)
+{
+#ifdef __GNUC__
+	return 63 - __builtin_clzll(v);
+#else
+	unsigned e = 0;
+
+	while (v >>= 1)
+		e++;
+	return e;
+#endif
+}
+
+/* The durations below LAT_HIST_SUB have a bucket each; the rest are
+ * counted by their power of two and the LAT_HIST_SUB_BITS bits below
+ * their most significant one. */
+unsigned lat_hist_bucket(uint64_t us)
+{
+	unsigned e;
+
+	if (us < LAT_HIST_SUB)
+		return us;
+
+	e = log2_floor(us);
+	if (e >= LAT_HIST_MAX_BITS)
+		return LAT_HIST_BUCKETS - 1;
+
+	return (e - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB +
+	    (us >> (e - LAT_HIST_SUB_BITS)) - LAT_HIST_SUB;
+}
+
+/* Returns the durations @bucket counts are less than; the last bucket
+ * has no limit, and its lower one is returned. */
+uint64_t lat_hist_bucket_limit(unsigned bucket)
+{
+	unsigned e, m;
+
+	if (bucket < LAT_HIST_SUB)
+		return bucket + 1;
+
+	if (bucket >= LAT_HIST_BUCKETS - 1)
+		return (uint64_t)1 << LAT_HIST_MAX_BITS;
+
+	e = bucket / LAT_HIST_SUB + LAT_HIST_SUB_BITS - 1;
+	m = bucket % LAT_HIST_SUB + LAT_HIST_SUB;
+
+	return (uint64_t)(m + 1) << (e - LAT_HIST_SUB_BITS);
+}
+
+void lat_hist_add(lat_hist_st *h, uint64_t us)
+{
+	h->count[lat_hist_bucket(us)]++;
+	h->sum += us;
+}
+
+/* Adds the @n bucket counts of another histogram, e.g., as received
+ * from another process; missing buckets are empty. */
+void lat_hist_merge(lat_hist_st *h, const uint64_t *count, unsigned n, uint64_t sum)
+{
+	unsigned i;
+
+	for (i = 0; i < n && i < LAT_HIST_BUCKETS; i++)
+		h->count[i] += count[i];
+	h->sum += sum;
+}
+
+uint64_t lat_hist_total(const lat_hist_st *h)
+{
+	uint64_t total = 0;
+	unsigned i;
+
+	for (i = 0; i < LAT_HIST_BUCKETS; i++)
+		total += h->count[i];
+
+	return total;
+}
+
+/* Returns the limit of the bucket holding the @permille quantile of
+ * the durations, or zero when the histogram is empty. */
+uint64_t lat_hist_quantile(const lat_hist_st *h, unsigned permille)
+{
+	uint64_t total, rank, seen = 0;
+	unsigned i;
+
+	total = lat_hist_total(h);
+	if (total == 0)
+		return 0;
+
+	rank = (total * permille + 999) / 1000;
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen >= rank)
+			break;
+	}
+
+	return lat_hist_bucket_limit(i);
+}
+
+uint64_t lat_hist_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+	int64_t us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+	    (now.tv_nsec - start->tv_nsec) / 1000;
+
+	return us > 0 ? us : 0;
+}
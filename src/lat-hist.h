@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LAT_HIST_H
+# define LAT_HIST_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Latency histograms in the style of HdrHistogram: the durations, in
+ * microseconds, are counted in LAT_HIST_SUB buckets per power of two,
+ * so that a bucket is at most 25% wider than its lower limit, whatever
+ * the magnitude of the duration. Durations of 2^LAT_HIST_MAX_BITS us
+ * (about 67 seconds) or longer are counted in the last bucket.
+ *
+ * A sample is counted with a few shifts, and the histograms of several
+ * processes are aggregated by adding their buckets.
+ */
+
+#define LAT_HIST_SUB_BITS 2
+#define LAT_HIST_SUB (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_MAX_BITS 26
+#define LAT_HIST_BUCKETS ((LAT_HIST_MAX_BITS - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB + 1)
+
+typedef struct lat_hist_st {
+	uint64_t count[LAT_HIST_BUCKETS];
+	uint64_t sum; /* of the durations, in microseconds */
+} lat_hist_st;
+
+unsigned lat_hist_bucket(uint64_t us);
+uint64_t lat_hist_bucket_limit(unsigned bucket);
+
+void lat_hist_add(lat_hist_st *h, uint64_t us);
+void lat_hist_merge(lat_hist_st *h, const uint64_t *count, unsigned n, uint64_t sum);
+uint64_t lat_hist_total(const lat_hist_st *h);
+uint64_t lat_hist_quantile(const lat_hist_st *h, unsigned permille);
+
+/* The microseconds elapsed since @start, as given by CLOCK_MONOTONIC */
+uint64_t lat_hist_elapsed(const struct timespec *start);
+
+#endif
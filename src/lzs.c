@@ -163,38 +163,74 @@ struct oc_packed_uint16_t {
 	uint16_t d;
 } __attribute__((packed));
 
+/*
+ * This is theoretically a hash. But RAM is cheap and just loading the
+ * 16-bit value and using it as a hash is *much* faster.
+ */
+#define HASH(p) (((struct oc_packed_uint16_t *)(p))->d)
+
+/*
+ * We use INVALID_OFS (0xffff) for no offset since we know IP packets are
+ * limited to 64KiB and we can never be *starting* a match at the
+ * penultimate byte of the packet.
+ */
+#define INVALID_OFS 0xffff
+
+/* Returns the number of leading bytes that @a and @b have in common, up
+ * to @max. The bytes are compared a word at a time. */
+static inline unsigned match_len(const unsigned char *a, const unsigned char *b, unsigned max)
+{
+	unsigned len = 0;
+	uint64_t wa, wb, diff;
+
+	while (len + sizeof(uint64_t) <= max) {
+		memcpy(&wa, a + len, sizeof(wa));
+		memcpy(&wb, b + len, sizeof(wb));
+		diff = wa ^ wb;
+		if (diff) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			return len + (__builtin_clzll(diff) >> 3);
+#else
+			return len + (__builtin_ctzll(diff) >> 3);
+#endif
+		}
+		len += sizeof(uint64_t);
+	}
+
+	while (len < max && a[len] == b[len])
+		len++;
+
+	return len;
+}
+
 /*
  * Much of the compression algorithm used here is based very loosely on ideas
  * from isdn_lzscomp.c by Andre Beck: http://micky.ibh.de/~beck/stuff/lzs4i4l/
+ *
+ * Each packet is compressed on its own; @state only saves us from
+ * clearing the hash table for every packet (see struct lzs_state_st).
  */
-int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen)
+int lzs_compress(struct lzs_state_st *state, unsigned char *dst, int dstlen,
+		 const unsigned char *src, int srclen)
 {
 	int length, offset;
 	int inpos = 0, outpos = 0;
 	uint16_t longest_match_len;
 	uint16_t hofs, longest_match_ofs;
 	uint16_t hash;
-	uint32_t outbits = 0;
+	uint32_t outbits = 0, base;
 	int nr_outbits = 0;
-
-	/*
-	 * This is theoretically a hash. But RAM is cheap and just loading the
-	 * 16-bit value and using it as a hash is *much* faster.
-	 */
-#define HASH_BITS 16
-#define HASH_TABLE_SIZE (1ULL << HASH_BITS)
-#define HASH(p) (((struct oc_packed_uint16_t *)(p))->d)
+	unsigned len;
 
 	/*
 	 * There are two data structures for tracking the history. The first
 	 * is the true hash table, an array indexed by the hash value described
-	 * above. It yields the offset in the input buffer at which the given
-	 * hash was most recently seen. We use INVALID_OFS (0xffff) for none
-	 * since we know IP packets are limited to 64KiB and we can never be
-	 * *starting* a match at the penultimate byte of the packet.
+	 * above. It yields the position (state->base plus the offset in the
+	 * input buffer) at which the given hash was most recently seen; the
+	 * positions below state->base belong to previous packets.
 	 */
-#define INVALID_OFS 0xffff
-	uint16_t hash_table[HASH_TABLE_SIZE]; /* Buffer offset for first match */
+	uint32_t *hash_table = state->hash_table;
+#define HASH_OFS(hash) (hash_table[hash] >= base ? hash_table[hash] - base : INVALID_OFS)
 
 	/*
 	 * The second data structure allows us to find the previous occurrences
@@ -203,24 +239,32 @@ int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int s
 	 * offset will yield the previous offset at which the same data hash
 	 * value was found.
 	 */
-#define MAX_HISTORY (1<<11) /* Highest offset LZS can represent is 11 bits */
-	uint16_t hash_chain[MAX_HISTORY];
+	uint16_t *hash_chain = state->hash_chain;
 
 	/* Just in case anyone tries to use this in a more general-purpose
 	 * scenario... */
 	if (srclen > INVALID_OFS + 1)
 		return -EFBIG;
 
+	/* Invalidate the positions of the previous packet. When the positions
+	 * wrap, fall back to clearing the hash table; that is once every
+	 * few hundred thousand packets. */
+	if (state->base == 0 || state->base > UINT32_MAX - (uint32_t)srclen) {
+		memset(hash_table, 0, sizeof(state->hash_table));
+		state->base = 1;
+	}
+	base = state->base;
+	state->base += srclen;
+
 	/* No need to initialise hash_chain since we can only ever follow
 	 * links to it that have already been initialised. */
-	memset(hash_table, 0xff, sizeof(hash_table));
 
 	while (inpos < srclen - 2) {
 		hash = HASH(src + inpos);
-		hofs = hash_table[hash];
+		hofs = HASH_OFS(hash);
 
 		hash_chain[inpos & (MAX_HISTORY - 1)] = hofs;
-		hash_table[hash] = inpos;
+		hash_table[hash] = base + inpos;
 
 		if (hofs == INVALID_OFS || hofs + MAX_HISTORY <= inpos) {
 			PUT_BITS(9, src[inpos]);
@@ -235,20 +279,20 @@ int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int s
 		for (; hofs != INVALID_OFS && hofs + MAX_HISTORY > inpos;
 		     hofs = hash_chain[hofs & (MAX_HISTORY - 1)]) {
 
-			/* We only get here if longest_match_len is >= 2. We need to find
-			   a match of longest_match_len + 1 for it to be interesting. */
-			if (!memcmp(src + hofs + 2, src + inpos + 2, longest_match_len - 1)) {
-				longest_match_ofs = hofs;
-
-				do {
-					longest_match_len++;
+			/* We need a match of longest_match_len + 1 for it to be
+			   interesting; check its last byte first. */
+			if (src[hofs + longest_match_len] != src[inpos + longest_match_len])
+				continue;
 
-					/* If we cannot *have* a longer match because we're at the
-					 * end of the input, stop looking */
-					if (longest_match_len + inpos == srclen)
-						goto got_match;
+			len = match_len(src + hofs + 2, src + inpos + 2, srclen - inpos - 2) + 2;
+			if (len > longest_match_len) {
+				longest_match_ofs = hofs;
+				longest_match_len = len;
 
-				} while (src[longest_match_len + inpos] == src[longest_match_len + hofs]);
+				/* If we cannot *have* a longer match because we're at the
+				 * end of the input, stop looking */
+				if (longest_match_len + inpos == srclen)
+					break;
 			}
 
 			/* Typical compressor tuning would have a break out of the loop
@@ -261,7 +305,7 @@ int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int s
 			   something. Anyway, we currently don't give up until we run out
 			   of reachable history — maximal compression. */
 		}
-	got_match:
+
 		/* Output offset, as 7-bit or 11-bit as appropriate */
 		offset = inpos - longest_match_ofs;
 		length = longest_match_len;
@@ -298,15 +342,15 @@ int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int s
 		inpos++;
 		while (--longest_match_len) {
 			hash = HASH(src + inpos);
-			hash_chain[inpos & (MAX_HISTORY - 1)] = hash_table[hash];
-			hash_table[hash] = inpos++;
+			hash_chain[inpos & (MAX_HISTORY - 1)] = HASH_OFS(hash);
+			hash_table[hash] = base + inpos++;
 		}
 	}
 
 	/* Special cases at the end */
 	if (inpos == srclen - 2) {
 		hash = HASH(src + inpos);
-		hofs = hash_table[hash];
+		hofs = HASH_OFS(hash);
 
 		if (hofs != INVALID_OFS && hofs + MAX_HISTORY > inpos) {
 			offset = inpos - hofs;
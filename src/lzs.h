@@ -15,5 +15,30 @@
  * Lesser General Public License for more details.
  */
 
+#ifndef LZS_H
+# define LZS_H
+
+#include <stdint.h>
+
+#define HASH_BITS 16
+#define HASH_TABLE_SIZE (1ULL << HASH_BITS)
+#define MAX_HISTORY (1<<11) /* Highest offset LZS can represent is 11 bits */
+
+/* The match-finder tables of the compressor. They are kept across packets
+ * so that they are not cleared for each one: the entries of the hash
+ * table are positions relative to @base, which advances past every
+ * packet compressed, invalidating the entries of the previous ones.
+ * As no history is kept, the packets of any session may be compressed
+ * with the same tables. A zeroed structure is ready for use.
+ */
+struct lzs_state_st {
+	uint32_t base;
+	uint32_t hash_table[HASH_TABLE_SIZE];
+	uint16_t hash_chain[MAX_HISTORY];
+};
+
 int lzs_decompress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen);
-int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int srclen);
+int lzs_compress(struct lzs_state_st *state, unsigned char *dst, int dstlen,
+		 const unsigned char *src, int srclen);
+
+#endif
@@ -139,6 +139,13 @@ int send_cookie_auth_reply(main_server_st* s, struct proc_st* proc,
 					ipv6_local, sizeof(ipv6_local), 0);
 		}
 
+		if (proc->stats_gen != 0) {
+			msg.stats_slot = proc->stats_slot;
+			msg.has_stats_slot = 1;
+			msg.stats_gen = proc->stats_gen;
+			msg.has_stats_gen = 1;
+		}
+
 		msg.config = proc->config;
 
 		ret = send_socket_msg_to_worker(s, proc, AUTH_COOKIE_REP, proc->tun_lease.fd,
@@ -172,6 +179,8 @@ struct proc_st *old_proc;
 	if (req->cookie.data == NULL || req->cookie.len != sizeof(proc->sid))
 		return -1;
 
+	clock_gettime(CLOCK_MONOTONIC, &proc->auth_start);
+
 	/* generate a new DTLS session ID for each connection, to allow
 	 * openconnect of distinguishing when the DTLS key has switched. */
 	ret = gnutls_rnd(GNUTLS_RND_NONCE, proc->dtls_session_id, sizeof(proc->dtls_session_id));
@@ -179,6 +188,11 @@ struct proc_st *old_proc;
 		return -1;
 	proc->dtls_session_id_size = sizeof(proc->dtls_session_id);
 
+	/* without a slot the worker sends its counters to sec-mod */
+	if (proc->stats_gen == 0 &&
+	    session_stats_alloc(&proc->stats_slot, &proc->stats_gen) < 0)
+		mslog(s, proc, LOG_DEBUG, "no slot is available for the session counters");
+
 	/* loads sup config and basic proc info (e.g., username) */
 	ret = session_open(s, proc, req->cookie.data, req->cookie.len);
 	if (ret < 0) {
@@ -186,8 +200,8 @@ struct proc_st *old_proc;
 		return -1;
 	}
 
-	/* Put into right cgroup */
-        if (proc->config->cgroup != NULL) {
+	/* Put into right cgroup; a pool worker is shared by many users */
+        if (proc->config->cgroup != NULL && proc->pool == NULL) {
         	put_into_cgroup(s, proc->config->cgroup, proc->pid);
 	}
 
@@ -203,10 +217,11 @@ struct proc_st *old_proc;
 		}
 
 		/* steal its leases */
+		proc_table_del_vpn_ip(s, old_proc);
 		steal_ip_leases(old_proc, proc);
 
 		if (old_proc->pid > 0)
-			kill(old_proc->pid, SIGTERM);
+			kill_proc(s, old_proc);
 		mslog(s, proc, LOG_DEBUG, "re-using session");
 	} else {
 		mslog(s, proc, LOG_INFO, "new user session");
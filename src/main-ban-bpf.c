@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(__linux__) && defined(HAVE_LINUX_BPF_H)
+# include <sys/syscall.h>
+# include <linux/bpf.h>
+# include <linux/filter.h>
+# include <linux/if_ether.h>
+#endif
+
+#include <main.h>
+#include <main-ban.h>
+#include <vpn.h>
+
+/* The kernel ban filter drops the packets of banned clients on the TCP
+ * and UDP listeners, before they are accepted or read by main.
+ *
+ * The banned entries of the ban database are mirrored into two longest
+ * prefix match maps, one per address family, with the monotonic time
+ * their ban ends at as value. A socket filter program attached to the
+ * listeners looks up the source address of each packet and drops it
+ * while that time is in the future, so the entries need not be deleted
+ * when their ban ends. A dropped SYN never creates a connection.
+ *
+ * The filter is inherited by the accepted sockets, and is detached from
+ * them, so that an established session is never cut by a later ban.
+ */
+
+#if defined(__linux__) && defined(HAVE_LINUX_BPF_H) && defined(SO_ATTACH_BPF) && defined(__NR_bpf)
+
+/* The banned entries the maps can hold; the rest are only checked
+ * after accept() */
+#define BAN_FILTER_MAX_ENTRIES 262144
+
+#define MAX_INSNS 48
+
+typedef struct ban_key_st {
+	uint32_t prefixlen;
+	uint8_t ip[16];
+} ban_key_st;
+
+static struct {
+	int map_fd[2]; /* IPv4 and IPv6 */
+	int prog_fd;
+} filter = { { -1, -1 }, -1 };
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define INSN(c, d, s, o, i) \
+	((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+/* Loads the 32-bit word at off of the IP header in the key at
+ * stack_off, in network order */
+static unsigned load_ip_word(struct bpf_insn *prog, int off, int stack_off)
+{
+	prog[0] = INSN(BPF_LD | BPF_W | BPF_ABS, 0, 0, 0, SKF_NET_OFF + off);
+	prog[1] = INSN(BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_0, 0, 0, 32);
+	prog[2] = INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_0, stack_off, 0);
+	return 3;
+}
+
+/* Sets R1 to the map and R2 to the key at stack_off */
+static unsigned load_lookup_args(struct bpf_insn *prog, int map_fd, int stack_off)
+{
+	prog[0] = INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+	prog[1] = INSN(0, 0, 0, 0, 0);
+	prog[2] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+	prog[3] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, stack_off);
+	return 4;
+}
+
+/* Fills in prog the filter program and returns its length. The key is
+ * built on the stack: the prefix length, followed by the address. */
+static unsigned build_prog(struct bpf_insn *prog)
+{
+	unsigned n = 0, to_v6, to_pass, v4_to_lookup, miss, expired, i;
+
+	/* R6 is the context of the packet loads */
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+	prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_6,
+			 offsetof(struct __sk_buff, protocol), 0);
+	to_v6 = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, htons(ETH_P_IPV6));
+	to_pass = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, htons(ETH_P_IP));
+
+	/* IPv4: the source address at offset 12 */
+	n += load_ip_word(&prog[n], 12, -4);
+	prog[n++] = INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -8, 32);
+	n += load_lookup_args(&prog[n], filter.map_fd[0], -8);
+	v4_to_lookup = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+
+	/* IPv6: the source address at offset 8 */
+	prog[to_v6].off = n - to_v6 - 1;
+	for (i = 0; i < 4; i++)
+		n += load_ip_word(&prog[n], 8 + i * 4, -16 + i * 4);
+	prog[n++] = INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -20, 128);
+	n += load_lookup_args(&prog[n], filter.map_fd[1], -20);
+
+	prog[v4_to_lookup].off = n - v4_to_lookup - 1;
+	prog[n++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+	miss = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0);
+	prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_7, BPF_REG_0, 0, 0);
+	prog[n++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns);
+	expired = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JGE | BPF_X, BPF_REG_0, BPF_REG_7, 0, 0);
+
+	/* drop */
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, 0);
+	prog[n++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	/* accept the whole packet */
+	prog[to_pass].off = n - to_pass - 1;
+	prog[miss].off = n - miss - 1;
+	prog[expired].off = n - expired - 1;
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, -1);
+	prog[n++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	return n;
+}
+
+static int create_map(unsigned ip_size)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_LPM_TRIE;
+	attr.key_size = sizeof(uint32_t) + ip_size;
+	attr.value_size = sizeof(uint64_t);
+	attr.max_entries = BAN_FILTER_MAX_ENTRIES;
+	attr.map_flags = BPF_F_NO_PREALLOC;
+
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int load_prog(main_server_st *s)
+{
+	struct bpf_insn prog[MAX_INSNS];
+	union bpf_attr attr;
+	static char log[4096];
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = build_prog(prog);
+	attr.license = (uintptr_t)"GPL";
+	attr.log_buf = (uintptr_t)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+
+	log[0] = 0;
+	fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd < 0 && log[0] != 0)
+		mslog(s, NULL, LOG_DEBUG, "ban filter verifier: %s", log);
+
+	return fd;
+}
+
+int ban_filter_init(main_server_st *s)
+{
+	struct listener_st *ltmp = NULL;
+	int e;
+
+	if (filter.prog_fd >= 0)
+		return 0;
+
+	filter.map_fd[0] = create_map(4);
+	filter.map_fd[1] = create_map(16);
+	if (filter.map_fd[0] < 0 || filter.map_fd[1] < 0) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not create the ban filter maps: %s", strerror(e));
+		goto fail;
+	}
+
+	filter.prog_fd = load_prog(s);
+	if (filter.prog_fd < 0) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not load the ban filter: %s", strerror(e));
+		goto fail;
+	}
+
+	list_for_each(&s->listen_list.head, ltmp, list) {
+		if (ltmp->fd == -1 || ltmp->sock_type == SOCK_TYPE_UNIX)
+			continue;
+
+		/* the clients connect through the proxy */
+		if (ltmp->sock_type == SOCK_TYPE_TCP && GETCONFIG(s)->listen_proxy_proto)
+			continue;
+
+		if (setsockopt(ltmp->fd, SOL_SOCKET, SO_ATTACH_BPF,
+			       &filter.prog_fd, sizeof(filter.prog_fd)) < 0) {
+			e = errno;
+			mslog(s, NULL, LOG_ERR, "could not attach the ban filter: %s", strerror(e));
+			goto fail;
+		}
+	}
+
+	return 0;
+
+ fail:
+	list_for_each(&s->listen_list.head, ltmp, list) {
+		if (ltmp->fd != -1 && ltmp->sock_type != SOCK_TYPE_UNIX)
+			ban_filter_detach(ltmp->fd);
+	}
+	ban_filter_deinit();
+	return -1;
+}
+
+void ban_filter_detach(int fd)
+{
+	if (filter.prog_fd >= 0)
+		setsockopt(fd, SOL_SOCKET, SO_DETACH_BPF, NULL, 0);
+}
+
+static void set_key(ban_key_st *key, const ban_entry_st *e)
+{
+	key->prefixlen = e->bits;
+	memcpy(key->ip, e->ip.ip, e->ip.size);
+}
+
+void ban_filter_add(main_server_st *s, const ban_entry_st *e, time_t now)
+{
+	union bpf_attr attr;
+	ban_key_st key;
+	struct timespec ts;
+	uint64_t until;
+	int e2;
+
+	if (filter.prog_fd < 0)
+		return;
+
+	/* the entry is banned up to and including its expiration second */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	until = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if (e->expires >= now)
+		until += (uint64_t)(e->expires - now + 1) * 1000000000;
+
+	set_key(&key, e);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = filter.map_fd[e->ip.size == 16];
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)&until;
+	attr.flags = BPF_ANY;
+
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+		e2 = errno;
+		mslog(s, NULL, LOG_DEBUG, "could not add ban entry to the filter: %s", strerror(e2));
+	}
+}
+
+void ban_filter_del(const ban_entry_st *e)
+{
+	union bpf_attr attr;
+	ban_key_st key;
+
+	if (filter.prog_fd < 0)
+		return;
+
+	set_key(&key, e);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = filter.map_fd[e->ip.size == 16];
+	attr.key = (uintptr_t)&key;
+
+	/* not present unless banned */
+	sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+void ban_filter_deinit(void)
+{
+	unsigned i;
+
+	if (filter.prog_fd >= 0) {
+		close(filter.prog_fd);
+		filter.prog_fd = -1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (filter.map_fd[i] >= 0) {
+			close(filter.map_fd[i]);
+			filter.map_fd[i] = -1;
+		}
+	}
+}
+#else
+int ban_filter_init(main_server_st *s)
+{
+	mslog(s, NULL, LOG_ERR, "the kernel ban filter is not supported on this system");
+	return -1;
+}
+
+void ban_filter_detach(int fd)
+{
+}
+
+void ban_filter_add(main_server_st *s, const ban_entry_st *e, time_t now)
+{
+}
+
+void ban_filter_del(const ban_entry_st *e)
+{
+}
+
+void ban_filter_deinit(void)
+{
+}
+#endif
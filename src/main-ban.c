@@ -41,38 +41,187 @@
 #include <main.h>
 #include <main-ban.h>
 #include <arpa/inet.h>
-#include <ccan/hash/hash.h>
-#include <ccan/htable/htable.h>
+#include <ccan/container_of/container_of.h>
 
-static size_t rehash(const void *_e, void *unused)
+static unsigned get_bit(const uint8_t *ip, unsigned bit)
 {
-	ban_entry_st *e = (void*)_e;
-	return hash_any(e->ip.ip, e->ip.size, 0);
+	return (ip[bit / 8] >> (7 - bit % 8)) & 1;
 }
 
-/* The first argument is the entry from the hash, and
- * the second is the entry from check_if_banned().
- */
-static bool ban_entry_cmp(const void *_c1, void *_c2)
+/* The number of leading bits of a and b which are equal, up to max */
+static unsigned common_bits(const uint8_t *a, const uint8_t *b, unsigned max)
 {
-	const struct ban_entry_st *c1 = _c1;
-	struct ban_entry_st *c2 = _c2;
+	unsigned i;
 
-	if (c1->ip.size == c2->ip.size && memcmp(c1->ip.ip, c2->ip.ip, c1->ip.size) == 0)
-		return 1;
-	return 0;
+	for (i = 0; i * 8 < max; i++) {
+		if (a[i] != b[i])
+			return MIN(i * 8 + __builtin_clz(a[i] ^ b[i]) - 24, max);
+	}
+	return max;
+}
+
+/* Zeroes the bits of ip after the prefix */
+static void mask_ip(uint8_t *ip, unsigned size, unsigned bits)
+{
+	unsigned i = bits / 8;
+
+	if (bits % 8) {
+		ip[i] &= 0xff << (8 - bits % 8);
+		i++;
+	}
+	if (i < size)
+		memset(&ip[i], 0, size - i);
+}
+
+/* Returns the entry of the prefix, creating it if needed; new entries
+ * are not yet in the expiry wheel. The ip must be masked. */
+static ban_entry_st *ban_db_get(ban_db_st *db, const uint8_t *ip, unsigned size, unsigned bits)
+{
+	ban_entry_st **pp = &db->root[size == 16], *n, *e, *glue;
+	unsigned common = 0;
+
+	while ((n = *pp) != NULL) {
+		common = common_bits(n->ip.ip, ip, MIN(n->bits, bits));
+		if (common < n->bits)
+			break;
+
+		if (n->bits == bits) {
+			if (n->glue) {
+				n->glue = 0;
+				db->elems++;
+			}
+			return n;
+		}
+		pp = &n->child[get_bit(ip, n->bits)];
+	}
+
+	e = talloc_zero(db, ban_entry_st);
+	if (e == NULL)
+		return NULL;
+
+	memcpy(e->ip.ip, ip, size);
+	e->ip.size = size;
+	e->bits = bits;
+
+	if (n != NULL) {
+		if (common == bits) {
+			/* the new entry is a prefix of n */
+			e->child[get_bit(n->ip.ip, bits)] = n;
+		} else {
+			/* they differ after their common prefix */
+			glue = talloc_zero(db, ban_entry_st);
+			if (glue == NULL) {
+				talloc_free(e);
+				return NULL;
+			}
+
+			memcpy(glue->ip.ip, ip, size);
+			mask_ip(glue->ip.ip, size, common);
+			glue->ip.size = size;
+			glue->bits = common;
+			glue->glue = 1;
+			glue->child[get_bit(ip, common)] = e;
+			glue->child[get_bit(n->ip.ip, common)] = n;
+			e = glue;
+		}
+	}
+	*pp = e;
+	db->elems++;
+
+	return e->glue ? e->child[get_bit(ip, e->bits)] : e;
+}
+
+static void ban_db_remove(ban_db_st *db, ban_entry_st *e)
+{
+	ban_entry_st **pp = &db->root[e->ip.size == 16], **parent = NULL, *n;
+
+	while (*pp != e) {
+		parent = pp;
+		pp = &(*pp)->child[get_bit(e->ip.ip, (*pp)->bits)];
+	}
+
+	timer_wheel_del(&db->expiry, &e->expiry);
+	ban_filter_del(e);
+	db->elems--;
+
+	if (e->child[0] != NULL && e->child[1] != NULL) {
+		e->glue = 1;
+		e->score = 0;
+		return;
+	}
+
+	*pp = e->child[e->child[0] == NULL];
+	talloc_free(e);
+
+	/* a glue node left with a single child is not needed */
+	if (*pp == NULL && parent != NULL && (*parent)->glue) {
+		n = *parent;
+		*parent = n->child[n->child[0] == NULL];
+		talloc_free(n);
+	}
 }
 
+/* Returns the longest prefix of ip which is banned, or NULL, in a
+ * single walk from the root. */
+static ban_entry_st *ban_db_lookup(main_server_st *s, const uint8_t *ip, unsigned size, time_t now)
+{
+	ban_entry_st *n = s->ban_db->root[size == 16], *banned = NULL;
+	unsigned host_bits = BAN_HOST_BITS(size);
+
+	while (n != NULL && common_bits(n->ip.ip, ip, n->bits) == n->bits) {
+		if (!n->glue && now <= n->expires && n->score >= BAN_ENTRY_MAX_SCORE(s, n))
+			banned = n;
+
+		if (n->bits >= host_bits)
+			break;
+		n = n->child[get_bit(ip, n->bits)];
+	}
+
+	return banned;
+}
+
+static int iterate(ban_entry_st *n, ban_iter_func func, void *priv)
+{
+	int ret;
+
+	if (n == NULL)
+		return 0;
+
+	if (!n->glue) {
+		ret = func(priv, n);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = iterate(n->child[0], func, priv);
+	if (ret < 0)
+		return ret;
+	return iterate(n->child[1], func, priv);
+}
+
+int main_ban_db_iterate(main_server_st *s, ban_iter_func func, void *priv)
+{
+	ban_db_st *db = s->ban_db;
+	int ret;
+
+	if (db == NULL)
+		return 0;
+
+	ret = iterate(db->root[0], func, priv);
+	if (ret < 0)
+		return ret;
+	return iterate(db->root[1], func, priv);
+}
 
 void *main_ban_db_init(main_server_st *s)
 {
-	struct htable *db = talloc(s, struct htable);
+	ban_db_st *db = talloc_zero(s, ban_db_st);
 	if (db == NULL) {
 		fprintf(stderr, "error initializing ban DB\n");
 		exit(1);
 	}
 
-	htable_init(db, rehash, NULL);
+	timer_wheel_init(&db->expiry, time(0));
 	s->ban_db = db;
 
 	return db;
@@ -80,17 +229,17 @@ void *main_ban_db_init(main_server_st *s)
 
 void main_ban_db_deinit(main_server_st *s)
 {
-struct htable *db = s->ban_db;
+	ban_db_st *db = s->ban_db;
 
 	if (db != NULL) {
-		htable_clear(db);
 		talloc_free(db);
+		s->ban_db = NULL;
 	}
 }
 
 unsigned main_ban_db_elems(main_server_st *s)
 {
-struct htable *db = s->ban_db;
+	ban_db_st *db = s->ban_db;
 
 	if (db)
 		return db->elems;
@@ -98,51 +247,35 @@ struct htable *db = s->ban_db;
 		return 0;
 }
 
-static void massage_ipv6_address(ban_entry_st *t)
-{
-	if (t->ip.size == 16) {
-		memset(&t->ip.ip[8], 0, 8);
-	}
-}
+/* The time an entry can be removed at */
+#define BAN_ENTRY_EXPIRES(s, t) MAX((t)->expires, (t)->last_reset + GETCONFIG(s)->ban_reset_time + 1)
 
-/* returns -1 if the user is already banned, and zero otherwise */
-static
-int add_ip_to_ban_list(main_server_st *s, const unsigned char *ip, unsigned ip_size, unsigned score)
+/* Adds the score to the entry of the prefix; returns -1 if the prefix
+ * is banned, and zero otherwise */
+static int add_score(main_server_st *s, const uint8_t *ip, unsigned ip_size,
+		     unsigned bits, unsigned score, time_t now)
 {
-	struct htable *db = s->ban_db;
-	struct ban_entry_st *e;
-	ban_entry_st t;
-	time_t now = time(0);
+	ban_db_st *db = s->ban_db;
+	ban_entry_st *e;
 	time_t expiration = now + GETCONFIG(s)->min_reauth_time;
-	int ret = 0;
+	unsigned max_score;
 	char str_ip[MAX_IP_STR];
 	const char *p_str_ip = NULL;
 	unsigned print_msg;
 
-	if (db == NULL || GETCONFIG(s)->max_ban_score == 0 || ip == NULL || (ip_size != 4 && ip_size != 16))
+	e = ban_db_get(db, ip, ip_size, bits);
+	if (e == NULL)
 		return 0;
+	max_score = BAN_ENTRY_MAX_SCORE(s, e);
 
-	memcpy(t.ip.ip, ip, ip_size);
-	t.ip.size = ip_size;
-
-	/* In IPv6 treat a /64 as a single address */
-	massage_ipv6_address(&t);
-
-	e = htable_get(db, rehash(&t, NULL), ban_entry_cmp, &t);
-	if (e == NULL) { /* new entry */
-		e = talloc_zero(db, ban_entry_st);
-		if (e == NULL) {
-			return 0;
-		}
-
-		memcpy(&e->ip, &t.ip, sizeof(e->ip));
+	if (!timer_wheel_pending(&e->expiry)) { /* new entry */
+		e->score = 0;
 		e->last_reset = now;
 
-		if (htable_add(db, rehash(e, NULL), e) == 0) {
-			mslog(s, NULL, LOG_INFO,
-			       "could not add ban entry to hash table");
-			goto fail;
-		}
+		/* checked again when it expires, as the score and the
+		 * expiration time are updated on further attempts */
+		e->expires = expiration;
+		timer_wheel_add(&db->expiry, &e->expiry, BAN_ENTRY_EXPIRES(s, e));
 	} else {
 		if (now > e->last_reset + GETCONFIG(s)->ban_reset_time) {
 			e->score = 0;
@@ -153,7 +286,7 @@ int add_ip_to_ban_list(main_server_st *s, const unsigned char *ip, unsigned ip_s
 	/* if the user is already banned, don't increase the expiration time
 	 * on further attempts, or the user will never be unbanned if he
 	 * periodically polls the server */
-	if (e->score < GETCONFIG(s)->max_ban_score) {
+	if (e->score < max_score) {
 		e->expires = expiration;
 		print_msg = 0;
 	} else
@@ -165,39 +298,75 @@ int add_ip_to_ban_list(main_server_st *s, const unsigned char *ip, unsigned ip_s
 	else
 		p_str_ip = inet_ntop(AF_INET6, ip, str_ip, sizeof(str_ip));
 
-	if (GETCONFIG(s)->max_ban_score > 0 && e->score >= GETCONFIG(s)->max_ban_score) {
+	if (e->score >= max_score && now <= e->expires) {
+		/* newly banned */
+		if (!print_msg) {
+			ban_filter_add(s, e, now);
+			if (db->notify)
+				db->notify(s, e);
+		}
+
 		if (print_msg && p_str_ip) {
-			mslog(s, NULL, LOG_INFO, "added IP '%s' (with score %d) to ban list, will be reset at: %s", str_ip, e->score, ctime(&e->expires));
+			if (bits < BAN_HOST_BITS(ip_size))
+				mslog(s, NULL, LOG_INFO, "added prefix '%s/%u' (with score %d) to ban list, will be reset at: %s", str_ip, bits, e->score, ctime(&e->expires));
+			else
+				mslog(s, NULL, LOG_INFO, "added IP '%s' (with score %d) to ban list, will be reset at: %s", str_ip, e->score, ctime(&e->expires));
 		}
-		ret = -1;
+		return -1;
 	} else {
 		if (p_str_ip) {
-			mslog(s, NULL, LOG_DEBUG, "added %d points (total %d) for IP '%s' to ban list", score, e->score, str_ip);
+			mslog(s, NULL, LOG_DEBUG, "added %d points (total %d) for %s '%s' to ban list", score, e->score,
+			      bits < BAN_HOST_BITS(ip_size) ? "prefix" : "IP", str_ip);
 		}
-		ret = 0;
+		return 0;
+	}
+}
+
+/* returns -1 if the user is already banned, and zero otherwise */
+static
+int add_ip_to_ban_list(main_server_st *s, const unsigned char *ip, unsigned ip_size, unsigned score)
+{
+	ban_db_st *db = s->ban_db;
+	inaddr_st t;
+	time_t now = time(0);
+	unsigned prefix;
+	int ret;
+
+	if (db == NULL || GETCONFIG(s)->max_ban_score == 0 || ip == NULL || (ip_size != 4 && ip_size != 16))
+		return 0;
+
+	memcpy(t.ip, ip, ip_size);
+	t.size = ip_size;
+	mask_ip(t.ip, ip_size, BAN_HOST_BITS(ip_size));
+
+	ret = add_score(s, t.ip, ip_size, BAN_HOST_BITS(ip_size), score, now);
+
+	/* the scores of the addresses are summed at their prefix */
+	if (GETCONFIG(s)->max_ban_prefix_score > 0) {
+		prefix = ip_size == 16 ? GETCONFIG(s)->ban_prefix_ipv6 : GETCONFIG(s)->ban_prefix_ipv4;
+		mask_ip(t.ip, ip_size, prefix);
+		if (add_score(s, t.ip, ip_size, prefix, score, now) < 0)
+			ret = -1;
 	}
 
-	return ret;
- fail:
-	talloc_free(e);
 	return ret;
 }
 
 int add_str_ip_to_ban_list(main_server_st *s, const char *ip, unsigned score)
 {
-	struct htable *db = s->ban_db;
-	ban_entry_st t;
+	ban_db_st *db = s->ban_db;
+	inaddr_st t;
 	int ret = 0;
 
 	if (db == NULL || GETCONFIG(s)->max_ban_score == 0 || ip == NULL || ip[0] == 0)
 		return 0;
 
 	if (strchr(ip, ':') != 0) {
-		ret = inet_pton(AF_INET6, ip, t.ip.ip);
-		t.ip.size = 16;
+		ret = inet_pton(AF_INET6, ip, t.ip);
+		t.size = 16;
 	} else {
-		ret = inet_pton(AF_INET, ip, t.ip.ip);
-		t.ip.size = 4;
+		ret = inet_pton(AF_INET, ip, t.ip);
+		t.size = 4;
 	}
 	if (ret != 1) {
 		mslog(s, NULL, LOG_INFO,
@@ -205,16 +374,18 @@ int add_str_ip_to_ban_list(main_server_st *s, const char *ip, unsigned score)
 		return 0;
 	}
 
-	return add_ip_to_ban_list(s, t.ip.ip, t.ip.size, score);
+	return add_ip_to_ban_list(s, t.ip, t.size, score);
 }
 
-/* returns non-zero if there is an IP removed */
+/* Resets the entries of the address and of its prefix; returns
+ * non-zero if there is an IP removed */
 int remove_ip_from_ban_list(main_server_st *s, const uint8_t *ip, unsigned size)
 {
-	struct htable *db = s->ban_db;
-	struct ban_entry_st *e;
-	ban_entry_st t;
+	ban_db_st *db = s->ban_db;
+	ban_entry_st *n;
+	inaddr_st t;
 	char txt_ip[MAX_IP_STR];
+	int ret = 0;
 
 	if (db == NULL || ip == NULL || size == 0)
 		return 0;
@@ -225,28 +396,32 @@ int remove_ip_from_ban_list(main_server_st *s, const uint8_t *ip, unsigned size)
 				      "unbanning IP '%s'", txt_ip);
 		}
 
-		t.ip.size = size;
-		memcpy(&t.ip.ip, ip, size);
-
-		/* In IPv6 treat a /64 as a single address */
-		massage_ipv6_address(&t);
-
-		e = htable_get(db, rehash(&t, NULL), ban_entry_cmp, &t);
-		if (e != NULL) { /* new entry */
-			e->score = 0;
-			e->expires = 0;
-			return 1;
+		memcpy(t.ip, ip, size);
+		t.size = size;
+		mask_ip(t.ip, size, BAN_HOST_BITS(size));
+
+		for (n = db->root[size == 16]; n != NULL && common_bits(n->ip.ip, t.ip, n->bits) == n->bits;
+		     n = n->child[get_bit(t.ip, n->bits)]) {
+			if (!n->glue) {
+				n->score = 0;
+				n->expires = 0;
+				ban_filter_del(n);
+				if (db->notify)
+					db->notify(s, n);
+				ret = 1;
+			}
+			if (n->bits >= BAN_HOST_BITS(size))
+				break;
 		}
 	}
 
-	return 0;
+	return ret;
 }
 
 unsigned check_if_banned(main_server_st *s, struct sockaddr_storage *addr, socklen_t addr_size)
 {
-	struct htable *db = s->ban_db;
-	time_t now;
-	ban_entry_st t, *e;
+	ban_db_st *db = s->ban_db;
+	inaddr_st t;
 	unsigned in_size;
 	char txt[MAX_IP_STR];
 
@@ -259,47 +434,90 @@ unsigned check_if_banned(main_server_st *s, struct sockaddr_storage *addr, sockl
 		return 0;
 	}
 
-	memcpy(t.ip.ip, SA_IN_P_GENERIC(addr, addr_size), SA_IN_SIZE(addr_size));
-	t.ip.size = SA_IN_SIZE(addr_size);
+	memcpy(t.ip, SA_IN_P_GENERIC(addr, addr_size), in_size);
+	t.size = in_size;
+
+	/* the address, or a prefix it is in, is banned; the points of
+	 * banned clients are not counted, as they don't extend the ban */
+	if (ban_db_lookup(s, t.ip, t.size, time(0)) != NULL ||
+	    /* add its current connection points */
+	    add_ip_to_ban_list(s, t.ip, t.size, GETCONFIG(s)->ban_points_connect) < 0) {
+	    	mslog(s, NULL, LOG_INFO, "rejected connection from banned IP: %s", human_addr2((struct sockaddr*)addr, addr_size, txt, sizeof(txt), 0));
+		return 1;
+	}
+
+	return 0;
+}
 
-	/* In IPv6 treat a /64 as a single address */
-	massage_ipv6_address(&t);
+/* Returns non-zero if the address, or a prefix it is in, is banned;
+ * unlike check_if_banned() no points are added */
+unsigned is_ip_banned(main_server_st *s, struct sockaddr_storage *addr, socklen_t addr_size)
+{
+	ban_db_st *db = s->ban_db;
+	unsigned in_size;
 
-	/* add its current connection points */
-	add_ip_to_ban_list(s, t.ip.ip, t.ip.size, GETCONFIG(s)->ban_points_connect);
+	if (db == NULL || GETCONFIG(s)->max_ban_score == 0)
+		return 0;
 
-	now = time(0);
-	e = htable_get(db, rehash(&t, NULL), ban_entry_cmp, &t);
-	if (e != NULL) {
-		if (now > e->expires)
-			return 0;
+	in_size = SA_IN_SIZE(addr_size);
+	if (in_size != 4 && in_size != 16)
+		return 0;
 
-		if (e->score >= GETCONFIG(s)->max_ban_score) {
-		    	mslog(s, NULL, LOG_INFO, "rejected connection from banned IP: %s", human_addr2((struct sockaddr*)addr, addr_size, txt, sizeof(txt), 0));
-			return 1;
-		}
-	}
-	return 0;
+	return ban_db_lookup(s, SA_IN_P_GENERIC(addr, addr_size), in_size, time(0)) != NULL;
 }
 
-void cleanup_banned_entries(main_server_st *s)
+/* Bans the prefix until expires, or unbans it if zero, without
+ * counting points; that copies the bans of main into the acceptor
+ * shards. */
+void main_ban_db_mirror(main_server_st *s, const uint8_t *ip, unsigned size, unsigned bits, time_t expires)
 {
-	struct htable *db = s->ban_db;
+	ban_db_st *db = s->ban_db;
+	ban_entry_st *e;
+	inaddr_st t;
+	time_t now = time(0);
+
+	if (db == NULL || (size != 4 && size != 16) || bits == 0 || bits > BAN_HOST_BITS(size))
+		return;
+
+	memcpy(t.ip, ip, size);
+	mask_ip(t.ip, size, bits);
+
+	e = ban_db_get(db, t.ip, size, bits);
+	if (e == NULL)
+		return;
+
+	e->last_reset = now;
+	e->expires = expires;
+	e->score = expires ? BAN_ENTRY_MAX_SCORE(s, e) : 0;
+
+	if (timer_wheel_pending(&e->expiry))
+		timer_wheel_del(&db->expiry, &e->expiry);
+	timer_wheel_add(&db->expiry, &e->expiry, BAN_ENTRY_EXPIRES(s, e));
+}
+
+/* Removes up to MAX_EXPIRED_PER_TICK expired entries. Returns non-zero
+ * if there may be more. */
+unsigned cleanup_banned_entries(main_server_st *s)
+{
+	ban_db_st *db = s->ban_db;
 	ban_entry_st *t;
-	struct htable_iter iter;
+	timer_wheel_entry_st *we;
 	time_t now = time(0);
+	unsigned n = 0;
 
 	if (db == NULL)
-		return;
+		return 0;
+
+	while (n < MAX_EXPIRED_PER_TICK && (we = timer_wheel_expired(&db->expiry, now)) != NULL) {
+		t = container_of(we, ban_entry_st, expiry);
+		n++;
 
-	t = htable_first(db, &iter);
-	while (t != NULL) {
 		if (now >= t->expires && now > t->last_reset + GETCONFIG(s)->ban_reset_time) {
-			htable_delval(db, &iter);
-			talloc_free(t);
+			ban_db_remove(db, t);
+		} else {
+			timer_wheel_add(&db->expiry, &t->expiry, BAN_ENTRY_EXPIRES(s, t));
 		}
-		t = htable_next(db, &iter);
-
 	}
-}
 
+	return n == MAX_EXPIRED_PER_TICK;
+}
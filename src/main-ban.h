@@ -22,26 +22,67 @@
 # define MAIN_BAN_H
 
 # include "main.h"
+# include "timer-wheel.h"
 
 typedef struct inaddr_st {
 	uint8_t ip[16];
 	unsigned size; /* 4 or 16 */
 } inaddr_st;
 
+/* An entry of an address (a /32 or an IPv6 /64), or of the prefix its
+ * score is aggregated at. The entries are the nodes of a path
+ * compressed binary trie, where a glue node joins two subtrees which
+ * differ after its prefix and is not an entry itself. */
 typedef struct ban_entry_st {
-	inaddr_st ip;
+	inaddr_st ip; /* the bits after the prefix are zero */
+	uint8_t bits; /* the prefix length */
+	uint8_t glue;
 	unsigned score;
 
 	time_t last_reset; /* the time its score counting started */
 	time_t expires; /* the time after the client is allowed to login */
+
+	timer_wheel_entry_st expiry;
+	struct ban_entry_st *child[2];
 } ban_entry_st;
 
-void cleanup_banned_entries(main_server_st *s);
+/* Called when an entry is banned, and when it is unbanned before its
+ * ban expires; its expiration time is then zero */
+typedef void (*ban_notify_func)(main_server_st *s, const struct ban_entry_st *e);
+
+typedef struct ban_db_st {
+	ban_entry_st *root[2]; /* IPv4 and IPv6 */
+	unsigned elems; /* the entries, without the glue nodes */
+	/* the entries by the time they can be removed */
+	timer_wheel_st expiry;
+	ban_notify_func notify;
+} ban_db_st;
+
+/* In IPv6 treat a /64 as a single address */
+#define BAN_HOST_BITS(size) ((size) == 16 ? 64 : 32)
+
+/* The score an entry is banned at */
+#define BAN_ENTRY_MAX_SCORE(s, e) ((e)->bits < BAN_HOST_BITS((e)->ip.size) ? \
+	GETCONFIG(s)->max_ban_prefix_score : (unsigned)GETCONFIG(s)->max_ban_score)
+
+typedef int (*ban_iter_func)(void *priv, ban_entry_st *e);
+
+unsigned cleanup_banned_entries(main_server_st *s);
 unsigned check_if_banned(main_server_st *s, struct sockaddr_storage *addr, socklen_t addr_size);
+unsigned is_ip_banned(main_server_st *s, struct sockaddr_storage *addr, socklen_t addr_size);
+void main_ban_db_mirror(main_server_st *s, const uint8_t *ip, unsigned size, unsigned bits, time_t expires);
 int add_str_ip_to_ban_list(main_server_st *s, const char *ip, unsigned score);
 int remove_ip_from_ban_list(main_server_st *s, const uint8_t *ip, unsigned size);
 unsigned main_ban_db_elems(main_server_st *s);
 void main_ban_db_deinit(main_server_st *s);
 void *main_ban_db_init(main_server_st *s);
+int main_ban_db_iterate(main_server_st *s, ban_iter_func func, void *priv);
+
+/* The banned entries mirrored in the kernel, see main-ban-bpf.c */
+int ban_filter_init(main_server_st *s);
+void ban_filter_detach(int fd);
+void ban_filter_add(main_server_st *s, const ban_entry_st *e, time_t now);
+void ban_filter_del(const ban_entry_st *e);
+void ban_filter_deinit(void);
 
 #endif
@@ -30,6 +30,10 @@
 #include <vpn.h>
 #include <cloexec.h>
 #include <ip-lease.h>
+#include <ip-util.h>
+#include <proc-search.h>
+#include <main-metrics.h>
+#include <worker.h>
 
 #include <errno.h>
 #include <system.h>
@@ -43,6 +47,7 @@
 typedef struct method_ctx {
 	main_server_st *s;
 	void *pool;
+	struct ctl_watcher_st *wst; /* the connection, if any */
 } method_ctx;
 
 static void method_top(method_ctx *ctx, int cfd, uint8_t * msg,
@@ -51,10 +56,14 @@ static void method_status(method_ctx *ctx, int cfd, uint8_t * msg,
 			  unsigned msg_size);
 static void method_list_users(method_ctx *ctx, int cfd, uint8_t * msg,
 			      unsigned msg_size);
+static void method_list_page(method_ctx *ctx, int cfd, uint8_t * msg,
+			     unsigned msg_size);
 static void method_disconnect_user_name(method_ctx *ctx, int cfd,
 					uint8_t * msg, unsigned msg_size);
 static void method_disconnect_user_id(method_ctx *ctx, int cfd,
 				      uint8_t * msg, unsigned msg_size);
+static void method_disconnect_batch(method_ctx *ctx, int cfd,
+				    uint8_t * msg, unsigned msg_size);
 static void method_unban_ip(method_ctx *ctx, int cfd,
 				      uint8_t * msg, unsigned msg_size);
 static void method_stop(method_ctx *ctx, int cfd, uint8_t * msg,
@@ -92,6 +101,7 @@ static const ctl_method_st methods[] = {
 	ENTRY(CTL_CMD_RELOAD, method_reload),
 	ENTRY(CTL_CMD_STOP, method_stop),
 	ENTRY(CTL_CMD_LIST, method_list_users),
+	ENTRY(CTL_CMD_LIST_PAGE, method_list_page),
 	ENTRY(CTL_CMD_LIST_BANNED, method_list_banned),
 	ENTRY(CTL_CMD_LIST_COOKIES, method_list_cookies),
 	ENTRY(CTL_CMD_USER_INFO, method_user_info),
@@ -99,6 +109,7 @@ static const ctl_method_st methods[] = {
 	ENTRY(CTL_CMD_UNBAN_IP, method_unban_ip),
 	ENTRY(CTL_CMD_DISCONNECT_NAME, method_disconnect_user_name),
 	ENTRY(CTL_CMD_DISCONNECT_ID, method_disconnect_user_id),
+	ENTRY(CTL_CMD_DISCONNECT_BATCH, method_disconnect_batch),
 	{NULL, 0, NULL}
 };
 
@@ -110,6 +121,7 @@ void ctl_handler_deinit(main_server_st * s)
 	if (s->ctl_fd >= 0) {
 		/*mslog(s, NULL, LOG_DEBUG, "closing unix socket connection");*/
 		close(s->ctl_fd);
+		s->ctl_fd = -1;
 		/*remove(OCSERV_UNIX_NAME); */
 	}
 }
@@ -173,6 +185,9 @@ static void method_status(method_ctx *ctx, int cfd, uint8_t * msg,
 			  unsigned msg_size)
 {
 	StatusRep rep = STATUS_REP__INIT;
+	LatencyRep latency[LAT_STAGES];
+	LatencyRep *latency_p[LAT_STAGES];
+	unsigned i;
 	int ret;
 
 	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: status");
@@ -192,6 +207,12 @@ static void method_status(method_ctx *ctx, int cfd, uint8_t * msg,
 	rep.sessions_closed = ctx->s->stats.sessions_closed;
 	rep.kbytes_in = ctx->s->stats.kbytes_in;
 	rep.kbytes_out = ctx->s->stats.kbytes_out;
+	rep.comp_hits = ctx->s->stats.comp_hits;
+	rep.has_comp_hits = 1;
+	rep.comp_misses = ctx->s->stats.comp_misses;
+	rep.has_comp_misses = 1;
+	rep.comp_skipped = ctx->s->stats.comp_skipped;
+	rep.has_comp_skipped = 1;
 	rep.min_mtu = ctx->s->stats.min_mtu;
 	rep.max_mtu = ctx->s->stats.max_mtu;
 	rep.last_reset = ctx->s->stats.last_reset;
@@ -204,6 +225,23 @@ static void method_status(method_ctx *ctx, int cfd, uint8_t * msg,
 	rep.total_auth_failures = ctx->s->stats.total_auth_failures;
 	rep.total_sessions_closed = ctx->s->stats.total_sessions_closed;
 
+	/* the stages with samples */
+	rep.latency = latency_p;
+	for (i = 0; i < LAT_STAGES; i++) {
+		const lat_hist_st *h = &ctx->s->stats.latency[i];
+
+		latency_rep__init(&latency[i]);
+		latency[i].count = lat_hist_total(h);
+		if (latency[i].count == 0)
+			continue;
+
+		latency[i].stage = (char *)lat_stage_name(i);
+		latency[i].p50 = lat_hist_quantile(h, 500);
+		latency[i].p90 = lat_hist_quantile(h, 900);
+		latency[i].p99 = lat_hist_quantile(h, 990);
+		latency_p[rep.n_latency++] = &latency[i];
+	}
+
 	ret = send_msg(ctx->pool, cfd, CTL_CMD_STATUS_REP, &rep,
 		       (pack_size_func) status_rep__get_packed_size,
 		       (pack_func) status_rep__pack);
@@ -259,9 +297,71 @@ static void method_stop(method_ctx *ctx, int cfd, uint8_t * msg,
 }
 
 #define IPBUF_SIZE 64
+/* Adds the information of ctmp to list. When brief is set, the
+ * lists of DNS servers, domains, routes and firewall ports are omitted.
+ */
+static const char *udp_state_str(unsigned state)
+{
+	switch (state) {
+	case UP_WAIT_FD:
+	case UP_SETUP:
+		return "setup";
+	case UP_HANDSHAKE:
+		return "handshake";
+	case UP_INACTIVE:
+		return "inactive";
+	case UP_ACTIVE:
+		return "active";
+	default:
+		return "disabled";
+	}
+}
+
+/* The live counters the worker publishes in the slot of the session */
+static void append_session_stats(UserInfoRep *rep, struct proc_st *ctmp)
+{
+	session_stats_st st;
+
+	if (session_stats_read(ctmp->stats_slot, ctmp->stats_gen, &st) < 0)
+		return;
+
+	rep->bytes_in = st.bytes_in;
+	rep->has_bytes_in = 1;
+	rep->bytes_out = st.bytes_out;
+	rep->has_bytes_out = 1;
+	rep->packets_in = st.packets_in;
+	rep->has_packets_in = 1;
+	rep->packets_out = st.packets_out;
+	rep->has_packets_out = 1;
+	rep->drops = st.drops;
+	rep->has_drops = 1;
+
+	if (st.comp_ratio > 0) {
+		rep->comp_ratio = st.comp_ratio;
+		rep->has_comp_ratio = 1;
+	}
+
+	if (st.mtu > 0) {
+		rep->mtu = st.mtu;
+		rep->has_mtu = 1;
+	}
+
+	rep->udp_state = (char *)udp_state_str(st.udp_state);
+
+	if (st.tcp_rtt_us > 0) {
+		rep->tcp_rtt_us = st.tcp_rtt_us;
+		rep->has_tcp_rtt_us = 1;
+	}
+	if (st.dtls_rtt_us > 0) {
+		rep->dtls_rtt_us = st.dtls_rtt_us;
+		rep->has_dtls_rtt_us = 1;
+	}
+}
+
 static int append_user_info(method_ctx *ctx,
 			    UserListRep * list,
-			    struct proc_st *ctmp)
+			    struct proc_st *ctmp,
+			    unsigned brief)
 {
 	uint32_t tmp;
 	char *ipbuf;
@@ -287,8 +387,8 @@ static int append_user_info(method_ctx *ctx,
 
 	user_info_rep__init(rep);
 
-	/* ID: pid */
-	rep->id = ctmp->pid;
+	/* ID: pid, or the session ID on pool workers */
+	rep->id = PROC_ID(ctmp);
 	rep->username = ctmp->username;
 	rep->groupname = ctmp->groupname;
 	rep->vhost = VHOSTNAME(ctmp->vhost);
@@ -391,6 +491,8 @@ static int append_user_info(method_ctx *ctx,
 		rep->has_mtu = 1;
 	}
 
+	append_session_stats(rep, ctmp);
+
 	if (ctmp->config) {
 		rep->restrict_to_routes = ctmp->config->restrict_user_to_routes;
 
@@ -405,6 +507,9 @@ static int append_user_info(method_ctx *ctx,
 		rep->dpd = ctmp->config->dpd;
 
 		rep->keepalive = ctmp->config->keepalive;
+	}
+
+	if (ctmp->config && !brief) {
 		if (ctmp->vhost) {
 			rep->domains = ctmp->vhost->perm_config.config->split_dns;
 			rep->n_domains = ctmp->vhost->perm_config.config->split_dns_size;
@@ -442,7 +547,7 @@ static void method_list_users(method_ctx *ctx, int cfd, uint8_t * msg,
 	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: list-users");
 
 	list_for_each(&ctx->s->proc_list.head, ctmp, list) {
-		ret = append_user_info(ctx, &rep, ctmp);
+		ret = append_user_info(ctx, &rep, ctmp, 0);
 		if (ret < 0) {
 			mslog(ctx->s, NULL, LOG_ERR,
 			      "error appending user info to reply");
@@ -461,6 +566,229 @@ static void method_list_users(method_ctx *ctx, int cfd, uint8_t * msg,
 	return;
 }
 
+/* The default and the maximum number of entries of a page of
+ * CTL_CMD_LIST_PAGE, and the size after which no more entries are
+ * added to it. They bound the time main spends on each page. */
+#define LIST_PAGE_ENTRIES 64
+#define LIST_PAGE_MAX_ENTRIES 256
+#define LIST_PAGE_MAX_SIZE (64*1024)
+
+/* The sessions examined for a page, when the filters match few */
+#define LIST_PAGE_MAX_SCAN 4096
+
+/* A listing of CTL_CMD_LIST_PAGE in progress. Each page resumes at the
+ * session the previous one stopped at; when that session is removed
+ * the listing is moved to the one following it. */
+typedef struct list_stream_st {
+	UserListReq *req;
+	struct list_node list; /* in list_streams */
+	struct proc_st *next; /* the next session to examine, or NULL */
+} list_stream_st;
+
+static struct list_head list_streams = LIST_HEAD_INIT(list_streams);
+
+static int list_stream_destructor(list_stream_st *st)
+{
+	list_del(&st->list);
+	if (st->req)
+		user_list_req__free_unpacked(st->req, NULL);
+	return 0;
+}
+
+/* Returns the session after ctmp, which is older, or NULL */
+static struct proc_st *next_proc(main_server_st *s, struct proc_st *ctmp)
+{
+	if (ctmp->list.next == &s->proc_list.head.n)
+		return NULL;
+	return list_entry(ctmp->list.next, struct proc_st, list);
+}
+
+/* Called by remove_proc() before the session is removed from the list */
+void ctl_handler_proc_removed(main_server_st *s, struct proc_st *proc)
+{
+	list_stream_st *st;
+
+	list_for_each(&list_streams, st, list) {
+		if (st->next == proc)
+			st->next = next_proc(s, proc);
+	}
+}
+
+static unsigned match_ip_prefix(struct sockaddr_storage *addr, socklen_t addr_len,
+				const uint8_t *ip, unsigned size, unsigned prefix)
+{
+	const uint8_t *p;
+	unsigned bytes;
+	uint8_t mask;
+
+	if (addr_len == sizeof(struct sockaddr_in) && addr->ss_family == AF_INET && size == 4)
+		p = SA_IN_U8_P(addr);
+	else if (addr_len == sizeof(struct sockaddr_in6) && addr->ss_family == AF_INET6 && size == 16)
+		p = SA_IN6_U8_P(addr);
+	else
+		return 0;
+
+	bytes = prefix / 8;
+	if (memcmp(p, ip, bytes) != 0)
+		return 0;
+
+	if (prefix % 8 == 0)
+		return 1;
+
+	mask = 0xff << (8 - prefix % 8);
+	return ((p[bytes] ^ ip[bytes]) & mask) == 0;
+}
+
+/* Returns whether ctmp matches the filters of req; the address filter
+ * matches either the remote address of the client or its VPN address */
+static unsigned match_list_req(struct proc_st *ctmp, UserListReq *req)
+{
+	if (req->username && strcmp(ctmp->username, req->username) != 0)
+		return 0;
+
+	if (req->groupname && strcmp(ctmp->groupname, req->groupname) != 0)
+		return 0;
+
+	if (req->vhost && strcmp(VHOSTNAME(ctmp->vhost), req->vhost) != 0)
+		return 0;
+
+	if (req->has_ip) {
+		if (match_ip_prefix(&ctmp->remote_addr, ctmp->remote_addr_len,
+				    req->ip.data, req->ip.len, req->ip_prefix))
+			return 1;
+		if (ctmp->ipv4 && match_ip_prefix(&ctmp->ipv4->rip, ctmp->ipv4->rip_len,
+						  req->ip.data, req->ip.len, req->ip_prefix))
+			return 1;
+		if (ctmp->ipv6 && match_ip_prefix(&ctmp->ipv6->rip, ctmp->ipv6->rip_len,
+						  req->ip.data, req->ip.len, req->ip_prefix))
+			return 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Sends the next page of the listing st. Returns a negative number on
+ * error, zero when the listing is complete and one otherwise.
+ *
+ * The list of sessions is ordered from the newest, and the cursor is the
+ * sequence number of the last session examined; the sessions which
+ * connected after the listing started are not listed, and the ones which
+ * disconnected are not sent.
+ */
+static int send_list_page(method_ctx *ctx, int cfd, list_stream_st *st)
+{
+	UserListRep rep = USER_LIST_REP__INIT;
+	UserListReq *req = st->req;
+	struct proc_st *ctmp;
+	unsigned max = LIST_PAGE_ENTRIES, scanned = 0;
+	size_t size = 0;
+	uint64_t last = 0;
+	int ret;
+
+	if (req->has_max_entries && req->max_entries > 0)
+		max = req->max_entries;
+	if (max > LIST_PAGE_MAX_ENTRIES)
+		max = LIST_PAGE_MAX_ENTRIES;
+
+	for (ctmp = st->next; ctmp != NULL; ctmp = next_proc(ctx->s, ctmp)) {
+		if (rep.n_user >= max || size >= LIST_PAGE_MAX_SIZE ||
+		    scanned >= LIST_PAGE_MAX_SCAN)
+			break;
+		scanned++;
+		last = ctmp->seq;
+
+		if (match_list_req(ctmp, req) == 0)
+			continue;
+
+		ret = append_user_info(ctx, &rep, ctmp, req->brief);
+		if (ret < 0) {
+			mslog(ctx->s, NULL, LOG_ERR,
+			      "error appending user info to reply");
+			return -1;
+		}
+
+		size += user_info_rep__get_packed_size(rep.user[rep.n_user-1]);
+	}
+	st->next = ctmp;
+
+	if (ctmp != NULL) {
+		rep.has_cursor = 1;
+		rep.cursor = last;
+	}
+
+	ret = send_msg(ctx->pool, cfd, CTL_CMD_LIST_PAGE_REP, &rep,
+		       (pack_size_func) user_list_rep__get_packed_size,
+		       (pack_func) user_list_rep__pack);
+	if (ret < 0) {
+		mslog(ctx->s, NULL, LOG_ERR, "error sending ctl reply");
+		return -1;
+	}
+
+	return ctmp != NULL;
+}
+
+static void ctl_list_watcher_cb(EV_P_ ev_io *w, int revents);
+
+static void method_list_page(method_ctx *ctx, int cfd, uint8_t * msg,
+			     unsigned msg_size)
+{
+	list_stream_st *st;
+	UserListReq *req;
+	int ret;
+
+	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: list-users (paginated)");
+
+	st = talloc_zero(ctx->wst, list_stream_st);
+	if (st == NULL)
+		return;
+
+	list_add(&list_streams, &st->list);
+	talloc_set_destructor(st, list_stream_destructor);
+
+	st->req = req = user_list_req__unpack(NULL, msg_size, msg);
+	if (req == NULL) {
+		mslog(ctx->s, NULL, LOG_ERR, "error parsing list-users request");
+		goto fail;
+	}
+
+	if (req->has_ip) {
+		if (req->ip.len != 4 && req->ip.len != 16) {
+			mslog(ctx->s, NULL, LOG_ERR, "list-users: invalid address filter");
+			goto fail;
+		}
+
+		if (!req->has_ip_prefix)
+			req->ip_prefix = req->ip.len * 8;
+		else if (req->ip_prefix > req->ip.len * 8) {
+			mslog(ctx->s, NULL, LOG_ERR, "list-users: invalid prefix filter");
+			goto fail;
+		}
+	}
+
+	/* a listing resumed by the client is located once */
+	st->next = list_top(&ctx->s->proc_list.head, struct proc_st, list);
+	if (req->has_cursor && req->cursor != 0) {
+		while (st->next != NULL && st->next->seq >= req->cursor)
+			st->next = next_proc(ctx->s, st->next);
+	}
+
+	ret = send_list_page(ctx, cfd, st);
+	if (ret <= 0 || req->one_page)
+		goto fail;
+
+	/* the next pages are sent once the client reads this one */
+	ctx->wst->stream = st;
+	ev_io_stop(loop, &ctx->wst->ctl_cmd_io);
+	ev_set_cb(&ctx->wst->ctl_cmd_io, ctl_list_watcher_cb);
+	ev_io_set(&ctx->wst->ctl_cmd_io, cfd, EV_WRITE);
+	ev_io_start(loop, &ctx->wst->ctl_cmd_io);
+	return;
+
+ fail:
+	talloc_free(st);
+}
+
 static void method_top(method_ctx *ctx, int cfd, uint8_t * msg,
 			      unsigned msg_size)
 {
@@ -499,7 +827,12 @@ static int append_ban_info(method_ctx *ctx,
 	rep->ip.len = e->ip.size;
 	rep->score = e->score;
 
-	if (GETCONFIG(s)->max_ban_score > 0 && e->score >= GETCONFIG(s)->max_ban_score) {
+	if (e->bits < BAN_HOST_BITS(e->ip.size)) {
+		rep->prefix = e->bits;
+		rep->has_prefix = 1;
+	}
+
+	if (BAN_ENTRY_MAX_SCORE(s, e) > 0 && e->score >= BAN_ENTRY_MAX_SCORE(s, e)) {
 		rep->expires = e->expires;
 		rep->has_expires = 1;
 	}
@@ -507,26 +840,32 @@ static int append_ban_info(method_ctx *ctx,
 	return 0;
 }
 
+typedef struct ban_list_ctx {
+	method_ctx *ctx;
+	BanListRep *rep;
+} ban_list_ctx;
+
+static int append_ban_info_cb(void *priv, struct ban_entry_st *e)
+{
+	ban_list_ctx *l = priv;
+
+	return append_ban_info(l->ctx, l->rep, e);
+}
+
 static void method_list_banned(method_ctx *ctx, int cfd, uint8_t * msg,
 			      unsigned msg_size)
 {
 	BanListRep rep = BAN_LIST_REP__INIT;
-	struct ban_entry_st *e = NULL;
-	struct htable *db = ctx->s->ban_db;
+	ban_list_ctx l = { ctx, &rep };
 	int ret;
-	struct htable_iter iter;
 
 	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: list-banned-ips");
 
-	e = htable_first(db, &iter);
-	while (e != NULL) {
-		ret = append_ban_info(ctx, &rep, e);
-		if (ret < 0) {
-			mslog(ctx->s, NULL, LOG_ERR,
-			      "error appending ban info to reply");
-			goto error;
-		}
-		e = htable_next(db, &iter);
+	ret = main_ban_db_iterate(ctx->s, append_ban_info_cb, &l);
+	if (ret < 0) {
+		mslog(ctx->s, NULL, LOG_ERR,
+		      "error appending ban info to reply");
+		goto error;
 	}
 
 	ret = send_msg(ctx->pool, cfd, CTL_CMD_LIST_BANNED_REP, &rep,
@@ -565,6 +904,7 @@ static void single_info_common(method_ctx *ctx, int cfd, uint8_t * msg,
 			       unsigned msg_size, const char *user, unsigned id)
 {
 	UserListRep rep = USER_LIST_REP__INIT;
+	struct list_head *head;
 	int ret;
 	unsigned found_user = 0;
 	struct proc_st *ctmp = NULL;
@@ -574,28 +914,37 @@ static void single_info_common(method_ctx *ctx, int cfd, uint8_t * msg,
 	else
 		mslog(ctx->s, NULL, LOG_INFO, "providing info for ID '%u'", id);
 
-	list_for_each(&ctx->s->proc_list.head, ctmp, list) {
-		if (user == NULL) {	/* id */
-			if (id == 0 || id == -1 || id != ctmp->pid) {
-				continue;
+	if (user != NULL) {
+		/* the sessions of the user are found through its index */
+		head = proc_search_username(ctx->s, user);
+		if (head != NULL) {
+			list_for_each(head, ctmp, user_list) {
+				ret = append_user_info(ctx, &rep, ctmp, 0);
+				if (ret < 0) {
+					mslog(ctx->s, NULL, LOG_ERR,
+					      "error appending user info to reply");
+					goto error;
+				}
+
+				found_user = 1;
 			}
-		} else {	/* username */
-			if (strcmp(ctmp->username, user) != 0) {
+		}
+	} else {
+		list_for_each(&ctx->s->proc_list.head, ctmp, list) {
+			if (id == 0 || id == -1 || id != PROC_ID(ctmp)) {
 				continue;
 			}
-		}
-
-		ret = append_user_info(ctx, &rep, ctmp);
-		if (ret < 0) {
-			mslog(ctx->s, NULL, LOG_ERR,
-			      "error appending user info to reply");
-			goto error;
-		}
 
-		found_user = 1;
+			ret = append_user_info(ctx, &rep, ctmp, 0);
+			if (ret < 0) {
+				mslog(ctx->s, NULL, LOG_ERR,
+				      "error appending user info to reply");
+				goto error;
+			}
 
-		if (id != 0)	/* id -> one a single element */
-			break;
+			found_user = 1;
+			break;	/* id -> one a single element */
+		}
 	}
 
 	if (found_user == 0) {
@@ -688,14 +1037,106 @@ static void method_unban_ip(method_ctx *ctx,
 	return;
 }
 
+/* The sessions to be terminated by a disconnect request. They are
+ * collected first, as terminating a session may remove it from the
+ * indexes they are found in. */
+typedef struct disconnect_list_st {
+	struct proc_st **procs;
+	unsigned n_procs;
+	unsigned max_procs;
+} disconnect_list_st;
+
+static int disconnect_list_append(method_ctx *ctx, disconnect_list_st *list,
+				  struct proc_st *proc)
+{
+	struct proc_st **procs;
+	unsigned max;
+
+	if (list->n_procs == list->max_procs) {
+		/* grown geometrically, as a group may have many sessions */
+		max = list->max_procs ? list->max_procs * 2 : 16;
+		procs = talloc_realloc(ctx->pool, list->procs, struct proc_st *, max);
+		if (procs == NULL)
+			return -1;
+
+		list->procs = procs;
+		list->max_procs = max;
+	}
+
+	list->procs[list->n_procs++] = proc;
+	return 0;
+}
+
+static int disconnect_list_add_user(method_ctx *ctx, disconnect_list_st *list,
+				    const char *username)
+{
+	struct list_head *head;
+	struct proc_st *ctmp;
+
+	head = proc_search_username(ctx->s, username);
+	if (head == NULL)
+		return 0;
+
+	list_for_each(head, ctmp, user_list) {
+		if (disconnect_list_append(ctx, list, ctmp) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int disconnect_list_add_group(method_ctx *ctx, disconnect_list_st *list,
+				     const char *groupname)
+{
+	struct list_head *head;
+	struct proc_st *ctmp;
+
+	head = proc_search_groupname(ctx->s, groupname);
+	if (head == NULL)
+		return 0;
+
+	list_for_each(head, ctmp, group_list) {
+		if (disconnect_list_append(ctx, list, ctmp) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int proc_ptr_cmp(const void *_a, const void *_b)
+{
+	uintptr_t a = (uintptr_t)*(struct proc_st * const *)_a;
+	uintptr_t b = (uintptr_t)*(struct proc_st * const *)_b;
+
+	return a < b ? -1 : (a > b);
+}
+
+/* Terminates the sessions of list, each once, and returns their number */
+static unsigned disconnect_list_terminate(method_ctx *ctx, disconnect_list_st *list)
+{
+	unsigned i, n = 0;
+
+	if (list->n_procs > 1)
+		qsort(list->procs, list->n_procs, sizeof(list->procs[0]), proc_ptr_cmp);
+
+	for (i = 0; i < list->n_procs; i++) {
+		if (i > 0 && list->procs[i] == list->procs[i-1])
+			continue;
+
+		terminate_proc(ctx->s, list->procs[i]);
+		n++;
+	}
+
+	return n;
+}
+
 static void method_disconnect_user_name(method_ctx *ctx,
 					int cfd, uint8_t * msg,
 					unsigned msg_size)
 {
 	UsernameReq *req;
 	BoolMsg rep = BOOL_MSG__INIT;
-	struct proc_st *cpos;
-	struct proc_st *ctmp = NULL;
+	disconnect_list_st list;
 	int ret;
 
 	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: disconnect_name");
@@ -708,13 +1149,16 @@ static void method_disconnect_user_name(method_ctx *ctx,
 	}
 
 	/* got the name. Try to disconnect */
-	list_for_each_safe(&ctx->s->proc_list.head, ctmp, cpos, list) {
-		if (strcmp(ctmp->username, req->username) == 0) {
-			terminate_proc(ctx->s, ctmp);
-			rep.status = 1;
-		}
+	memset(&list, 0, sizeof(list));
+	if (disconnect_list_add_user(ctx, &list, req->username) < 0) {
+		mslog(ctx->s, NULL, LOG_ERR, "error finding the sessions of '%s'", req->username);
+		username_req__free_unpacked(req, NULL);
+		return;
 	}
 
+	if (disconnect_list_terminate(ctx, &list) > 0)
+		rep.status = 1;
+
 	username_req__free_unpacked(req, NULL);
 
 	ret = send_msg(ctx->pool, cfd, CTL_CMD_DISCONNECT_NAME_REP, &rep,
@@ -746,7 +1190,7 @@ static void method_disconnect_user_id(method_ctx *ctx, int cfd,
 
 	/* got the ID. Try to disconnect */
 	list_for_each_safe(&ctx->s->proc_list.head, ctmp, cpos, list) {
-		if (ctmp->pid == req->id) {
+		if (PROC_ID(ctmp) == req->id) {
 			terminate_proc(ctx->s, ctmp);
 			rep.status = 1;
 			if (req->id != -1)
@@ -767,30 +1211,129 @@ static void method_disconnect_user_id(method_ctx *ctx, int cfd,
 	return;
 }
 
+static void method_disconnect_batch(method_ctx *ctx, int cfd,
+				    uint8_t * msg, unsigned msg_size)
+{
+	DisconnectBatchReq *req;
+	DisconnectBatchRep rep = DISCONNECT_BATCH_REP__INIT;
+	disconnect_list_st list;
+	struct proc_st *ctmp;
+	unsigned i;
+	int ret;
+
+	mslog(ctx->s, NULL, LOG_DEBUG, "ctl: disconnect_batch");
+
+	req = disconnect_batch_req__unpack(NULL, msg_size, msg);
+	if (req == NULL) {
+		mslog(ctx->s, NULL, LOG_ERR, "error parsing disconnect_batch request");
+		return;
+	}
+
+	memset(&list, 0, sizeof(list));
+
+	for (i = 0; i < req->n_username; i++) {
+		if (disconnect_list_add_user(ctx, &list, req->username[i]) < 0)
+			goto fail;
+	}
+
+	for (i = 0; i < req->n_groupname; i++) {
+		if (disconnect_list_add_group(ctx, &list, req->groupname[i]) < 0)
+			goto fail;
+	}
+
+	for (i = 0; i < req->n_ip; i++) {
+		ctmp = proc_search_vpn_ip(ctx->s, req->ip[i].data, req->ip[i].len);
+		if (ctmp != NULL && disconnect_list_append(ctx, &list, ctmp) < 0)
+			goto fail;
+	}
+
+	rep.disconnected = disconnect_list_terminate(ctx, &list);
+
+	mslog(ctx->s, NULL, LOG_INFO, "ctl: disconnected %u sessions (batch of %u users, %u groups and %u addresses)",
+	      (unsigned)rep.disconnected, (unsigned)req->n_username,
+	      (unsigned)req->n_groupname, (unsigned)req->n_ip);
+
+	ret = send_msg(ctx->pool, cfd, CTL_CMD_DISCONNECT_BATCH_REP, &rep,
+		       (pack_size_func) disconnect_batch_rep__get_packed_size,
+		       (pack_func) disconnect_batch_rep__pack);
+	if (ret < 0) {
+		mslog(ctx->s, NULL, LOG_ERR, "error sending ctl reply");
+	}
+
+	disconnect_batch_req__free_unpacked(req, NULL);
+	return;
+
+ fail:
+	mslog(ctx->s, NULL, LOG_ERR, "error finding the sessions of disconnect_batch request");
+	disconnect_batch_req__free_unpacked(req, NULL);
+}
+
+/* the maximum size of a request; the batch disconnect requests
+ * carry lists of users */
+#define CTL_MAX_REQ_SIZE (64*1024)
+
 struct ctl_watcher_st {
 	int fd;
 	struct ev_io ctl_cmd_io;
+	struct list_stream_st *stream; /* a paginated listing in progress */
 };
 
+static void ctl_watcher_close(EV_P_ struct ctl_watcher_st *wst)
+{
+	main_server_st *s = ev_userdata(loop);
+
+	if (s->top_fd == wst->fd)
+		s->top_fd = -1;
+	close(wst->fd);
+	ev_io_stop(EV_A_ &wst->ctl_cmd_io);
+	talloc_free(wst);
+}
+
+static void ctl_list_watcher_cb(EV_P_ ev_io *w, int revents)
+{
+	struct ctl_watcher_st *wst = container_of(w, struct ctl_watcher_st, ctl_cmd_io);
+	method_ctx ctx;
+	int ret;
+
+	ctx.s = ev_userdata(loop);
+	ctx.wst = wst;
+	ctx.pool = talloc_new(wst);
+	if (ctx.pool == NULL)
+		goto fail;
+
+	ret = send_list_page(&ctx, wst->fd, wst->stream);
+	talloc_free(ctx.pool);
+	if (ret > 0)
+		return;
+
+ fail:
+	ctl_watcher_close(EV_A_ wst);
+}
+
 static void ctl_cmd_wacher_cb(EV_P_ ev_io *w, int revents)
 {
 	main_server_st *s = ev_userdata(loop);
 	int ret;
 	size_t length;
 	uint8_t cmd;
-	uint8_t buffer[256];
+	uint8_t *buffer;
 	method_ctx ctx;
 	struct ctl_watcher_st *wst = container_of(w, struct ctl_watcher_st, ctl_cmd_io);
 	unsigned i, indef = 0;
 
 	ctx.s = s;
 	ctx.pool = talloc_new(wst);
+	ctx.wst = wst;
 
 	if (ctx.pool == NULL)
 		goto fail;
 
+	buffer = talloc_size(ctx.pool, CTL_MAX_REQ_SIZE);
+	if (buffer == NULL)
+		goto fail;
+
 	/* read request */
-	ret = recv_msg_data(wst->fd, &cmd, buffer, sizeof(buffer), NULL);
+	ret = recv_msg_data(wst->fd, &cmd, buffer, CTL_MAX_REQ_SIZE, NULL);
 	if (ret < 0) {
 		mslog(s, NULL, LOG_ERR, "error receiving ctl data");
 		goto fail;
@@ -811,17 +1354,12 @@ static void ctl_cmd_wacher_cb(EV_P_ ev_io *w, int revents)
 		}
 	}
 
-	if (indef) {
+	if (indef || wst->stream) {
 		talloc_free(ctx.pool);
 		return;
 	}
  fail:
- 	if (s->top_fd == wst->fd)
- 		s->top_fd = -1;
- 	close(wst->fd);
- 	ev_io_stop(EV_A_ w);
- 	talloc_free(wst);
- 	return;
+	ctl_watcher_close(EV_A_ wst);
 }
 
 static void ctl_handle_commands(main_server_st * s)
@@ -853,6 +1391,7 @@ static void ctl_handle_commands(main_server_st * s)
 		goto fail;
 
 	wst->fd = cfd;
+	wst->stream = NULL;
 
 	ev_io_init(&wst->ctl_cmd_io, ctl_cmd_wacher_cb, wst->fd, EV_READ);
 	ev_io_start(loop, &wst->ctl_cmd_io);
@@ -896,6 +1435,7 @@ void ctl_handler_notify (main_server_st* s, struct proc_st *proc, unsigned conne
 
 	ctx.s = s;
 	ctx.pool = pool;
+	ctx.wst = NULL;
 
 	mslog(s, NULL, LOG_DEBUG, "ctl: top update");
 
@@ -906,7 +1446,7 @@ void ctl_handler_notify (main_server_st* s, struct proc_st *proc, unsigned conne
 		rep.discon_reason_txt = (char*)discon_reason_to_str(proc->discon_reason);
 	}
 
-	ret = append_user_info(&ctx, &list, proc);
+	ret = append_user_info(&ctx, &list, proc, 0);
 	if (ret < 0) {
 		mslog(s, NULL, LOG_ERR,
 		      "error appending user info to reply");
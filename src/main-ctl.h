@@ -10,5 +10,6 @@ void ctl_handler_deinit(main_server_st* s);
 void ctl_handler_set_fds(main_server_st* s, ev_io *watcher);
 void ctl_handler_run_pending(main_server_st* s, ev_io *watcher);
 void ctl_handler_notify (main_server_st* s, struct proc_st *proc, unsigned connect);
+void ctl_handler_proc_removed(main_server_st *s, struct proc_st *proc);
 
 #endif
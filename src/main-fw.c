@@ -0,0 +1,1212 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#if defined(__linux__) && defined(HAVE_LINUX_NETFILTER_NF_TABLES_H)
+# include <linux/netlink.h>
+# include <linux/netfilter.h>
+# include <linux/netfilter/nfnetlink.h>
+# include <linux/netfilter/nf_tables.h>
+#endif
+
+#include <main.h>
+#include <main-fw.h>
+#include <ip-util.h>
+#include <vpn.h>
+
+/* The nftables firewall backend applies the restrict-user-to-routes
+ * and restrict-user-to-ports options without the ocserv-fw script.
+ *
+ * A single table holds the rules of all sessions. Its rules are fixed
+ * and look up the VPN device of the packet, combined with its other
+ * fields, in hash sets shared by all sessions. A session only adds its
+ * elements to these sets on connect and deletes them on disconnect,
+ * with a single netlink transaction each time, so the cost of either
+ * does not depend on the number of connected sessions.
+ *
+ * The routes are looked up with the destination masked to each of the
+ * prefix lengths in use, so that exact-match sets can be used. The rule
+ * for a length is added with the first session that uses it.
+ *
+ * The rules only reject packets; the traffic they let through is
+ * subject to the rest of the system's firewall.
+ */
+
+unsigned fw_native(main_server_st *s, struct proc_st *proc)
+{
+	if (GETCONFIG(s)->fw_backend != FW_BACKEND_NFTABLES || proc->config == NULL)
+		return 0;
+
+	return (proc->config->restrict_user_to_routes || proc->config->n_fw_ports > 0);
+}
+
+#if defined(__linux__) && defined(HAVE_LINUX_NETFILTER_NF_TABLES_H)
+
+#define FW_TABLE "ocserv"
+
+/* The largest set key; keys are loaded into the 32-bit registers */
+#define FW_MAX_KEY 64
+
+/* The data types of the set keys, as known by the nft tool */
+#define TYPE_INTEGER 4
+#define TYPE_IPADDR 7
+#define TYPE_IP6ADDR 8
+#define TYPE_INET_PROTOCOL 12
+#define TYPE_INET_SERVICE 13
+#define TYPE_IFNAME 41
+#define TYPE_BITS 6
+
+#define ALIGN4(x) (((x) + 3) & ~3)
+
+/* The fields of the set keys: the input device, the destination
+ * address, a constant loaded by the rule, and the layer 4 protocol
+ * and destination port. */
+enum {
+	F_DEV,
+	F_ADDR,
+	F_VALUE,
+	F_PROTO,
+	F_PORT,
+};
+
+/* The properties of a session which are not tied to a destination */
+enum {
+	FW_RESTRICT = 1,
+	FW_ALLOW_PORTS,
+	FW_HAS_ROUTES4,
+	FW_HAS_ROUTES6,
+};
+
+enum {
+	SET_FLAGS,
+	SET_PORTS,
+	SET_PROTOS,
+	SET_DNS4,
+	SET_DNS6,
+	SET_ROUTES4,
+	SET_ROUTES6,
+	SET_NO_ROUTES4,
+	SET_NO_ROUTES6,
+	SET_MAX
+};
+
+static const struct {
+	const char *name;
+	unsigned family; /* of the address field */
+	unsigned fields[4];
+	unsigned n_fields;
+} sets[SET_MAX] = {
+	[SET_FLAGS] = {"flags", 0, {F_DEV, F_VALUE}, 2},
+	[SET_PORTS] = {"ports", 0, {F_DEV, F_PROTO, F_PORT}, 3},
+	[SET_PROTOS] = {"protos", 0, {F_DEV, F_PROTO}, 2},
+	[SET_DNS4] = {"dns4", AF_INET, {F_DEV, F_ADDR, F_PROTO, F_PORT}, 4},
+	[SET_DNS6] = {"dns6", AF_INET6, {F_DEV, F_ADDR, F_PROTO, F_PORT}, 4},
+	/* the value is the prefix length of the network */
+	[SET_ROUTES4] = {"routes4", AF_INET, {F_DEV, F_ADDR, F_VALUE}, 3},
+	[SET_ROUTES6] = {"routes6", AF_INET6, {F_DEV, F_ADDR, F_VALUE}, 3},
+	[SET_NO_ROUTES4] = {"no-routes4", AF_INET, {F_DEV, F_ADDR, F_VALUE}, 3},
+	[SET_NO_ROUTES6] = {"no-routes6", AF_INET6, {F_DEV, F_ADDR, F_VALUE}, 3},
+};
+
+#define IS_ROUTE_SET(set) ((set) >= SET_ROUTES4)
+
+enum {
+	V_ACCEPT,
+	V_REJECT,
+	V_JUMP,
+	V_GOTO,
+};
+
+/* The chains with the rules of the route sets are named after them */
+static const char *chains[] = { "client", "allow", "allowed", "routes",
+				"routes4", "routes6", "no-routes4", "no-routes6" };
+
+/* The rules, in the order of the ocserv-fw script. The packets of the
+ * VPN devices go to the client chain. */
+static const struct {
+	const char *chain;
+	unsigned family; /* of the packets the rule applies to, or zero */
+	int set; /* the set to look up, or -1 */
+	uint8_t value; /* the flag to look up in SET_FLAGS */
+	unsigned verdict;
+	const char *target;
+} rules[] = {
+	/* the DNS servers are always reachable */
+	{"client", AF_INET, SET_DNS4, 0, V_ACCEPT, NULL},
+	{"client", AF_INET6, SET_DNS6, 0, V_ACCEPT, NULL},
+	{"client", 0, SET_FLAGS, FW_ALLOW_PORTS, V_GOTO, "allow"},
+	/* otherwise the ports are the ones denied */
+	{"client", 0, SET_PORTS, 0, V_REJECT, NULL},
+	{"client", 0, SET_PROTOS, 0, V_REJECT, NULL},
+	{"client", 0, SET_FLAGS, FW_RESTRICT, V_GOTO, "routes"},
+
+	{"allow", 0, SET_PORTS, 0, V_GOTO, "allowed"},
+	{"allow", 0, SET_PROTOS, 0, V_GOTO, "allowed"},
+	{"allow", 0, -1, 0, V_REJECT, NULL},
+
+	{"allowed", 0, SET_FLAGS, FW_RESTRICT, V_GOTO, "routes"},
+	{"allowed", 0, -1, 0, V_ACCEPT, NULL},
+
+	/* without routes any destination but the no-routes is allowed */
+	{"routes", AF_INET, -1, 0, V_JUMP, "no-routes4"},
+	{"routes", AF_INET6, -1, 0, V_JUMP, "no-routes6"},
+	{"routes", AF_INET, -1, 0, V_JUMP, "routes4"},
+	{"routes", AF_INET6, -1, 0, V_JUMP, "routes6"},
+	{"routes", AF_INET, SET_FLAGS, FW_HAS_ROUTES4, V_REJECT, NULL},
+	{"routes", AF_INET6, SET_FLAGS, FW_HAS_ROUTES6, V_REJECT, NULL},
+	{"routes", 0, -1, 0, V_ACCEPT, NULL},
+};
+
+static struct {
+	int fd;
+	uint32_t seq;
+	unsigned ready; /* whether the table was created */
+	/* whether the rule of a prefix length exists in the chain of a
+	 * route set */
+	uint8_t len_rule[SET_MAX][129];
+} fw = { .fd = -1 };
+
+/* A batch of netlink messages, which the kernel applies as a single
+ * transaction */
+typedef struct nl_buf_st {
+	void *pool;
+	char *data;
+	unsigned size;
+	unsigned max;
+	unsigned msg; /* offset of the message being built */
+	unsigned msgs; /* messages in the transaction */
+	uint32_t first_seq;
+	unsigned failed;
+} nl_buf_st;
+
+typedef struct fw_net_st {
+	unsigned family;
+	uint8_t addr[16]; /* masked to the prefix */
+	unsigned prefix;
+} fw_net_st;
+
+typedef struct fw_svc_st {
+	uint8_t proto;
+	uint16_t port; /* zero for all the packets of the protocol */
+} fw_svc_st;
+
+typedef struct fw_session_st {
+	char dev[IFNAMSIZ];
+
+	fw_net_st *routes;
+	unsigned n_routes;
+	fw_net_st *no_routes;
+	unsigned n_no_routes;
+	fw_net_st *dns;
+	unsigned n_dns;
+	fw_svc_st *svcs;
+	unsigned n_svcs;
+
+	unsigned restrict_routes;
+	unsigned allow_ports; /* whether svcs are allowed rather than denied */
+} fw_session_st;
+
+static void *nl_put(nl_buf_st *b, unsigned size)
+{
+	void *p;
+	unsigned max;
+
+	if (b->failed)
+		return NULL;
+
+	size = NLMSG_ALIGN(size);
+	if (b->size + size > b->max) {
+		max = b->max * 2 > b->size + size ? b->max * 2 : b->size + size + 4096;
+		p = talloc_realloc_size(b->pool, b->data, max);
+		if (p == NULL) {
+			b->failed = 1;
+			return NULL;
+		}
+		b->data = p;
+		b->max = max;
+	}
+
+	p = b->data + b->size;
+	memset(p, 0, size);
+	b->size += size;
+	return p;
+}
+
+static void nl_attr(nl_buf_st *b, unsigned type, const void *data, unsigned size)
+{
+	struct nlattr *a = nl_put(b, NLA_HDRLEN + size);
+
+	if (a == NULL)
+		return;
+	a->nla_type = type;
+	a->nla_len = NLA_HDRLEN + size;
+	memcpy(((char *)a) + NLA_HDRLEN, data, size);
+}
+
+static void nl_attr_u32(nl_buf_st *b, unsigned type, uint32_t v)
+{
+	v = htonl(v);
+	nl_attr(b, type, &v, sizeof(v));
+}
+
+static void nl_attr_str(nl_buf_st *b, unsigned type, const char *str)
+{
+	nl_attr(b, type, str, strlen(str) + 1);
+}
+
+static unsigned nl_nest_start(nl_buf_st *b, unsigned type)
+{
+	unsigned off = b->size;
+	struct nlattr *a = nl_put(b, NLA_HDRLEN);
+
+	if (a != NULL)
+		a->nla_type = type | NLA_F_NESTED;
+	return off;
+}
+
+static void nl_nest_end(nl_buf_st *b, unsigned off)
+{
+	if (!b->failed)
+		((struct nlattr *)(b->data + off))->nla_len = b->size - off;
+}
+
+/* Nested data of a register or a set key */
+static void nl_data(nl_buf_st *b, unsigned type, const void *data, unsigned size)
+{
+	unsigned off = nl_nest_start(b, type);
+
+	nl_attr(b, NFTA_DATA_VALUE, data, size);
+	nl_nest_end(b, off);
+}
+
+static void nl_msg_start(nl_buf_st *b, unsigned type, unsigned flags)
+{
+	struct nlmsghdr *h;
+	struct nfgenmsg *g;
+
+	b->msg = b->size;
+	h = nl_put(b, NLMSG_HDRLEN + sizeof(struct nfgenmsg));
+	if (h == NULL)
+		return;
+
+	h->nlmsg_seq = ++fw.seq;
+	g = NLMSG_DATA(h);
+	g->version = NFNETLINK_V0;
+
+	if (type == NFNL_MSG_BATCH_BEGIN || type == NFNL_MSG_BATCH_END) {
+		h->nlmsg_type = type;
+		h->nlmsg_flags = NLM_F_REQUEST;
+		g->nfgen_family = AF_UNSPEC;
+		g->res_id = htons(NFNL_SUBSYS_NFTABLES);
+		if (type == NFNL_MSG_BATCH_BEGIN)
+			b->first_seq = h->nlmsg_seq;
+	} else {
+		h->nlmsg_type = (NFNL_SUBSYS_NFTABLES << 8) | type;
+		h->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+		g->nfgen_family = NFPROTO_INET;
+		b->msgs++;
+	}
+}
+
+static void nl_msg_end(nl_buf_st *b)
+{
+	if (!b->failed)
+		((struct nlmsghdr *)(b->data + b->msg))->nlmsg_len = b->size - b->msg;
+}
+
+/* Drops the message being built */
+static void nl_msg_cancel(nl_buf_st *b)
+{
+	b->size = b->msg;
+	b->msgs--;
+	fw.seq--;
+}
+
+static void nl_batch_start(nl_buf_st *b, void *pool)
+{
+	memset(b, 0, sizeof(*b));
+	b->pool = pool;
+
+	nl_msg_start(b, NFNL_MSG_BATCH_BEGIN, 0);
+	nl_msg_end(b);
+}
+
+static void nl_batch_end(nl_buf_st *b)
+{
+	nl_msg_start(b, NFNL_MSG_BATCH_END, 0);
+	nl_msg_end(b);
+}
+
+static unsigned nl_expr_start(nl_buf_st *b, const char *name, unsigned *data)
+{
+	unsigned elem = nl_nest_start(b, NFTA_LIST_ELEM);
+
+	nl_attr_str(b, NFTA_EXPR_NAME, name);
+	*data = nl_nest_start(b, NFTA_EXPR_DATA);
+	return elem;
+}
+
+static void nl_expr_end(nl_buf_st *b, unsigned elem, unsigned data)
+{
+	nl_nest_end(b, data);
+	nl_nest_end(b, elem);
+}
+
+static void expr_meta(nl_buf_st *b, unsigned key, unsigned dreg)
+{
+	unsigned e, d;
+
+	e = nl_expr_start(b, "meta", &d);
+	nl_attr_u32(b, NFTA_META_KEY, key);
+	nl_attr_u32(b, NFTA_META_DREG, dreg);
+	nl_expr_end(b, e, d);
+}
+
+static void expr_payload(nl_buf_st *b, unsigned base, unsigned offset,
+			 unsigned len, unsigned dreg)
+{
+	unsigned e, d;
+
+	e = nl_expr_start(b, "payload", &d);
+	nl_attr_u32(b, NFTA_PAYLOAD_DREG, dreg);
+	nl_attr_u32(b, NFTA_PAYLOAD_BASE, base);
+	nl_attr_u32(b, NFTA_PAYLOAD_OFFSET, offset);
+	nl_attr_u32(b, NFTA_PAYLOAD_LEN, len);
+	nl_expr_end(b, e, d);
+}
+
+/* Masks the @prefix leading bits of the @len bytes in @reg */
+static void expr_mask(nl_buf_st *b, unsigned reg, unsigned prefix, unsigned len)
+{
+	static const uint8_t zero[16];
+	uint8_t mask[16];
+	unsigned e, d;
+
+	memset(mask, 0, sizeof(mask));
+	memset(mask, 0xff, prefix / 8);
+	if (prefix % 8)
+		mask[prefix / 8] = 0xff << (8 - prefix % 8);
+
+	e = nl_expr_start(b, "bitwise", &d);
+	nl_attr_u32(b, NFTA_BITWISE_SREG, reg);
+	nl_attr_u32(b, NFTA_BITWISE_DREG, reg);
+	nl_attr_u32(b, NFTA_BITWISE_LEN, len);
+	nl_data(b, NFTA_BITWISE_MASK, mask, len);
+	nl_data(b, NFTA_BITWISE_XOR, zero, len);
+	nl_expr_end(b, e, d);
+}
+
+static void expr_cmp(nl_buf_st *b, unsigned sreg, const void *data, unsigned len)
+{
+	unsigned e, d;
+
+	e = nl_expr_start(b, "cmp", &d);
+	nl_attr_u32(b, NFTA_CMP_SREG, sreg);
+	nl_attr_u32(b, NFTA_CMP_OP, NFT_CMP_EQ);
+	nl_data(b, NFTA_CMP_DATA, data, len);
+	nl_expr_end(b, e, d);
+}
+
+static void expr_value(nl_buf_st *b, unsigned dreg, const void *data, unsigned len)
+{
+	unsigned e, d;
+
+	e = nl_expr_start(b, "immediate", &d);
+	nl_attr_u32(b, NFTA_IMMEDIATE_DREG, dreg);
+	nl_data(b, NFTA_IMMEDIATE_DATA, data, len);
+	nl_expr_end(b, e, d);
+}
+
+static void expr_lookup(nl_buf_st *b, const char *set, unsigned sreg)
+{
+	unsigned e, d;
+
+	e = nl_expr_start(b, "lookup", &d);
+	nl_attr_str(b, NFTA_LOOKUP_SET, set);
+	nl_attr_u32(b, NFTA_LOOKUP_SREG, sreg);
+	nl_expr_end(b, e, d);
+}
+
+static void expr_verdict(nl_buf_st *b, unsigned verdict, const char *chain)
+{
+	unsigned e, d, v, vd;
+	uint8_t code = NFT_REJECT_ICMPX_PORT_UNREACH;
+
+	if (verdict == V_REJECT) {
+		/* as the REJECT target of iptables */
+		e = nl_expr_start(b, "reject", &d);
+		nl_attr_u32(b, NFTA_REJECT_TYPE, NFT_REJECT_ICMPX_UNREACH);
+		nl_attr(b, NFTA_REJECT_ICMP_CODE, &code, 1);
+		nl_expr_end(b, e, d);
+		return;
+	}
+
+	e = nl_expr_start(b, "immediate", &d);
+	nl_attr_u32(b, NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+	v = nl_nest_start(b, NFTA_IMMEDIATE_DATA);
+	vd = nl_nest_start(b, NFTA_DATA_VERDICT);
+	if (verdict == V_ACCEPT) {
+		nl_attr_u32(b, NFTA_VERDICT_CODE, NF_ACCEPT);
+	} else {
+		nl_attr_u32(b, NFTA_VERDICT_CODE, (uint32_t)(verdict == V_JUMP ? NFT_JUMP : NFT_GOTO));
+		nl_attr_str(b, NFTA_VERDICT_CHAIN, chain);
+	}
+	nl_nest_end(b, vd);
+	nl_nest_end(b, v);
+	nl_expr_end(b, e, d);
+}
+
+static unsigned field_len(unsigned set, unsigned field)
+{
+	switch (field) {
+	case F_DEV:
+		return IFNAMSIZ;
+	case F_ADDR:
+		return sets[set].family == AF_INET6 ? 16 : 4;
+	case F_PROTO:
+		return 1;
+	case F_PORT:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+static unsigned field_type(unsigned set, unsigned field)
+{
+	switch (field) {
+	case F_DEV:
+		return TYPE_IFNAME;
+	case F_ADDR:
+		return sets[set].family == AF_INET6 ? TYPE_IP6ADDR : TYPE_IPADDR;
+	case F_PROTO:
+		return TYPE_INET_PROTOCOL;
+	case F_PORT:
+		return TYPE_INET_SERVICE;
+	default:
+		return TYPE_INTEGER;
+	}
+}
+
+static unsigned key_len(unsigned set)
+{
+	unsigned i, len = 0;
+
+	for (i = 0; i < sets[set].n_fields; i++)
+		len += ALIGN4(field_len(set, sets[set].fields[i]));
+	return len;
+}
+
+static void table_msg(nl_buf_st *b, unsigned type)
+{
+	nl_msg_start(b, type, type == NFT_MSG_NEWTABLE ? NLM_F_CREATE : 0);
+	nl_attr_str(b, NFTA_TABLE_NAME, FW_TABLE);
+	nl_msg_end(b);
+}
+
+static void set_msg(nl_buf_st *b, unsigned set)
+{
+	unsigned i, type = 0;
+
+	for (i = 0; i < sets[set].n_fields; i++)
+		type = (type << TYPE_BITS) | field_type(set, sets[set].fields[i]);
+
+	nl_msg_start(b, NFT_MSG_NEWSET, NLM_F_CREATE);
+	nl_attr_str(b, NFTA_SET_TABLE, FW_TABLE);
+	nl_attr_str(b, NFTA_SET_NAME, sets[set].name);
+	nl_attr_u32(b, NFTA_SET_FLAGS, 0);
+	nl_attr_u32(b, NFTA_SET_KEY_TYPE, type);
+	nl_attr_u32(b, NFTA_SET_KEY_LEN, key_len(set));
+	nl_attr_u32(b, NFTA_SET_ID, set + 1);
+	nl_msg_end(b);
+}
+
+static void chain_msg(nl_buf_st *b, const char *name, unsigned base)
+{
+	unsigned hook;
+
+	nl_msg_start(b, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+	nl_attr_str(b, NFTA_CHAIN_TABLE, FW_TABLE);
+	nl_attr_str(b, NFTA_CHAIN_NAME, name);
+	if (base) {
+		hook = nl_nest_start(b, NFTA_CHAIN_HOOK);
+		nl_attr_u32(b, NFTA_HOOK_HOOKNUM, NF_INET_FORWARD);
+		nl_attr_u32(b, NFTA_HOOK_PRIORITY, 0);
+		nl_nest_end(b, hook);
+		nl_attr_u32(b, NFTA_CHAIN_POLICY, NF_ACCEPT);
+		nl_attr_str(b, NFTA_CHAIN_TYPE, "filter");
+	}
+	nl_msg_end(b);
+}
+
+static unsigned rule_start(nl_buf_st *b, const char *chain)
+{
+	nl_msg_start(b, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+	nl_attr_str(b, NFTA_RULE_TABLE, FW_TABLE);
+	nl_attr_str(b, NFTA_RULE_CHAIN, chain);
+	return nl_nest_start(b, NFTA_RULE_EXPRESSIONS);
+}
+
+static void rule_end(nl_buf_st *b, unsigned exprs)
+{
+	nl_nest_end(b, exprs);
+	nl_msg_end(b);
+}
+
+/* Loads the key of @set from the packet into the registers, with
+ * @value as its constant field. In the route sets the destination is
+ * masked to the prefix length @value. */
+static void load_key(nl_buf_st *b, unsigned set, uint8_t value)
+{
+	unsigned i, field, len, reg = NFT_REG32_00;
+	uint8_t v[4] = { 0, 0, 0, value };
+
+	for (i = 0; i < sets[set].n_fields; i++) {
+		field = sets[set].fields[i];
+		len = field_len(set, field);
+
+		switch (field) {
+		case F_DEV:
+			expr_meta(b, NFT_META_IIFNAME, reg);
+			break;
+		case F_ADDR:
+			expr_payload(b, NFT_PAYLOAD_NETWORK_HEADER,
+				     len == 16 ? 24 : 16, len, reg);
+			if (IS_ROUTE_SET(set) && value < len * 8)
+				expr_mask(b, reg, value, len);
+			break;
+		case F_VALUE:
+			expr_value(b, reg, v, sizeof(v));
+			break;
+		case F_PROTO:
+			expr_meta(b, NFT_META_L4PROTO, reg);
+			break;
+		case F_PORT:
+			expr_payload(b, NFT_PAYLOAD_TRANSPORT_HEADER, 2, 2, reg);
+			break;
+		}
+		reg += ALIGN4(len) / 4;
+	}
+}
+
+static void family_cmp(nl_buf_st *b, unsigned family)
+{
+	uint8_t nfproto = family == AF_INET6 ? NFPROTO_IPV6 : NFPROTO_IPV4;
+
+	expr_meta(b, NFT_META_NFPROTO, NFT_REG_1);
+	expr_cmp(b, NFT_REG_1, &nfproto, 1);
+}
+
+/* Appends the rule which looks up the networks of length @prefix in
+ * a route set, to the chain named after it */
+static void route_rule_msg(nl_buf_st *b, unsigned set, unsigned prefix)
+{
+	unsigned exprs;
+
+	exprs = rule_start(b, sets[set].name);
+	load_key(b, set, prefix);
+	expr_lookup(b, sets[set].name, NFT_REG32_00);
+	expr_verdict(b, set == SET_ROUTES4 || set == SET_ROUTES6 ? V_ACCEPT : V_REJECT, NULL);
+	rule_end(b, exprs);
+}
+
+/* Replaces the table of ocserv with an empty one, i.e., without the
+ * elements of the sessions of an earlier run */
+static void setup_batch(nl_buf_st *b, const char *dev)
+{
+	unsigned i, exprs;
+
+	table_msg(b, NFT_MSG_NEWTABLE);
+	table_msg(b, NFT_MSG_DELTABLE);
+	table_msg(b, NFT_MSG_NEWTABLE);
+
+	for (i = 0; i < SET_MAX; i++)
+		set_msg(b, i);
+
+	chain_msg(b, "forward", 1);
+	for (i = 0; i < sizeof(chains)/sizeof(chains[0]); i++)
+		chain_msg(b, chains[i], 0);
+
+	/* the packets from the VPN devices */
+	exprs = rule_start(b, "forward");
+	expr_meta(b, NFT_META_IIFNAME, NFT_REG_1);
+	expr_cmp(b, NFT_REG_1, dev, strlen(dev));
+	expr_verdict(b, V_GOTO, "client");
+	rule_end(b, exprs);
+
+	for (i = 0; i < sizeof(rules)/sizeof(rules[0]); i++) {
+		exprs = rule_start(b, rules[i].chain);
+
+		if (rules[i].family)
+			family_cmp(b, rules[i].family);
+
+		if (rules[i].set >= 0) {
+			load_key(b, rules[i].set, rules[i].value);
+			expr_lookup(b, sets[rules[i].set].name, NFT_REG32_00);
+		}
+
+		expr_verdict(b, rules[i].verdict, rules[i].target);
+		rule_end(b, exprs);
+	}
+}
+
+static int fw_socket(main_server_st *s)
+{
+	struct sockaddr_nl sa;
+	int e, val;
+
+	if (fw.fd >= 0)
+		return fw.fd;
+
+	fw.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_NETFILTER);
+	if (fw.fd == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not open netfilter socket: %s", strerror(e));
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	if (bind(fw.fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not bind netfilter socket: %s", strerror(e));
+		close(fw.fd);
+		fw.fd = -1;
+		return -1;
+	}
+
+	/* a transaction is sent as a single message; allow for sessions
+	 * with many routes, and do not copy failed messages in replies */
+	val = 4 * 1024 * 1024;
+	setsockopt(fw.fd, SOL_SOCKET, SO_SNDBUFFORCE, &val, sizeof(val));
+	val = 1;
+	setsockopt(fw.fd, SOL_NETLINK, NETLINK_CAP_ACK, &val, sizeof(val));
+
+	return fw.fd;
+}
+
+/* Sends the transaction in @b, and returns zero if it was committed
+ * or a negative errno value */
+static int fw_commit(main_server_st *s, nl_buf_st *b)
+{
+	struct sockaddr_nl sa;
+	char rbuf[8192];
+	struct nlmsghdr *h;
+	struct nlmsgerr *err;
+	unsigned acks = 0;
+	int error = 0, e;
+	ssize_t ret;
+
+	if (b->failed)
+		return -ENOMEM;
+
+	if (fw_socket(s) < 0)
+		return -EIO;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+
+	ret = sendto(fw.fd, b->data, b->size, 0, (struct sockaddr *)&sa, sizeof(sa));
+	if (ret != (ssize_t)b->size) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not send netfilter message: %s", strerror(e));
+		return -e;
+	}
+
+	/* the kernel processes the batch while it is sent, so its replies
+	 * are already queued when send() returns */
+	while (acks < b->msgs) {
+		ret = recv(fw.fd, rbuf, sizeof(rbuf), MSG_DONTWAIT);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+
+		for (h = (struct nlmsghdr *)rbuf; NLMSG_OK(h, ret); h = NLMSG_NEXT(h, ret)) {
+			/* replies to earlier transactions are ignored */
+			if (h->nlmsg_type != NLMSG_ERROR || h->nlmsg_seq - b->first_seq > b->msgs + 1)
+				continue;
+
+			err = NLMSG_DATA(h);
+			if (err->error != 0 && error == 0)
+				error = err->error;
+			acks++;
+		}
+	}
+
+	if (error == 0 && acks < b->msgs)
+		error = -ETIMEDOUT;
+
+	return error;
+}
+
+/* Parses the networks in the address/prefix or address/netmask format,
+ * or single addresses, leaving out duplicates */
+static int parse_nets(void *pool, char **nets, unsigned n,
+		      fw_net_st **out, unsigned *n_out)
+{
+	fw_net_st *r;
+	unsigned i, j, k = 0, max;
+	char *cidr, *p;
+
+	*out = NULL;
+	*n_out = 0;
+	if (n == 0)
+		return 0;
+
+	r = talloc_zero_array(pool, fw_net_st, n);
+	if (r == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++) {
+		if (strchr(nets[i], '/') == NULL)
+			cidr = talloc_strdup(r, nets[i]);
+		else
+			cidr = ipv4_route_to_cidr(r, nets[i]);
+		if (cidr == NULL)
+			return -EINVAL;
+
+		r[k].family = strchr(cidr, ':') != NULL ? AF_INET6 : AF_INET;
+		max = r[k].family == AF_INET6 ? 128 : 32;
+
+		p = strchr(cidr, '/');
+		if (p != NULL) {
+			*p = 0;
+			r[k].prefix = atoi(p + 1);
+		} else {
+			r[k].prefix = max;
+		}
+
+		if (r[k].prefix > max || inet_pton(r[k].family, cidr, r[k].addr) != 1)
+			return -EINVAL;
+		talloc_free(cidr);
+
+		for (j = 0; j < max / 8; j++) {
+			if (j * 8 >= r[k].prefix)
+				r[k].addr[j] = 0;
+			else if (j * 8 + 8 > r[k].prefix)
+				r[k].addr[j] &= 0xff << (8 - r[k].prefix % 8);
+		}
+
+		/* an element cannot be deleted twice */
+		for (j = 0; j < k; j++) {
+			if (r[j].family == r[k].family && r[j].prefix == r[k].prefix &&
+			    memcmp(r[j].addr, r[k].addr, sizeof(r[j].addr)) == 0)
+				break;
+		}
+		if (j == k)
+			k++;
+	}
+
+	*out = r;
+	*n_out = k;
+	return 0;
+}
+
+static int proto_number(unsigned proto)
+{
+	switch (proto) {
+	case PROTO_UDP:
+		return IPPROTO_UDP;
+	case PROTO_TCP:
+		return IPPROTO_TCP;
+	case PROTO_SCTP:
+		return IPPROTO_SCTP;
+	case PROTO_ESP:
+		return IPPROTO_ESP;
+	case PROTO_ICMP:
+		return IPPROTO_ICMP;
+	case PROTO_ICMPv6:
+		return IPPROTO_ICMPV6;
+	default:
+		return -1;
+	}
+}
+
+static int session_init(void *pool, struct proc_st *proc, fw_session_st *fs)
+{
+	GroupCfgSt *config = proc->config;
+	unsigned i, j, n = 0;
+	int proto, ret;
+
+	memset(fs, 0, sizeof(*fs));
+	/* the key is compared with the name padded with zeros */
+	strncpy(fs->dev, proc->tun_lease.name, sizeof(fs->dev) - 1);
+
+	fs->restrict_routes = config->restrict_user_to_routes;
+	if (fs->restrict_routes) {
+		ret = parse_nets(pool, config->routes, config->n_routes,
+				 &fs->routes, &fs->n_routes);
+		if (ret < 0)
+			return ret;
+
+		ret = parse_nets(pool, config->no_routes, config->n_no_routes,
+				 &fs->no_routes, &fs->n_no_routes);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = parse_nets(pool, config->dns, config->n_dns, &fs->dns, &fs->n_dns);
+	if (ret < 0)
+		return ret;
+
+	if (config->n_fw_ports == 0)
+		return 0;
+
+	fs->svcs = talloc_array(pool, fw_svc_st, config->n_fw_ports);
+	if (fs->svcs == NULL)
+		return -ENOMEM;
+
+	/* a single negated port makes all of them denied */
+	fs->allow_ports = 1;
+	for (i = 0; i < config->n_fw_ports; i++) {
+		if (config->fw_ports[i]->negate)
+			fs->allow_ports = 0;
+
+		proto = proto_number(config->fw_ports[i]->proto);
+		if (proto < 0)
+			return -EINVAL;
+
+		fs->svcs[n].proto = proto;
+		if (proto == IPPROTO_UDP || proto == IPPROTO_TCP || proto == IPPROTO_SCTP)
+			fs->svcs[n].port = config->fw_ports[i]->port;
+		else
+			fs->svcs[n].port = 0;
+
+		for (j = 0; j < n; j++) {
+			if (fs->svcs[j].proto == fs->svcs[n].proto &&
+			    fs->svcs[j].port == fs->svcs[n].port)
+				break;
+		}
+		if (j == n)
+			n++;
+	}
+	fs->n_svcs = n;
+
+	return 0;
+}
+
+/* Appends the element of @set with the values in @fields */
+static void elem_put(nl_buf_st *b, unsigned set, const void **fields, unsigned *n)
+{
+	uint8_t key[FW_MAX_KEY];
+	unsigned i, len, pos = 0, elem;
+
+	memset(key, 0, sizeof(key));
+	for (i = 0; i < sets[set].n_fields; i++) {
+		len = field_len(set, sets[set].fields[i]);
+		memcpy(key + pos, fields[i], len);
+		pos += ALIGN4(len);
+	}
+
+	elem = nl_nest_start(b, NFTA_LIST_ELEM);
+	nl_data(b, NFTA_SET_ELEM_KEY, key, pos);
+	nl_nest_end(b, elem);
+
+	(*n)++;
+}
+
+static void elem_put_nets(nl_buf_st *b, unsigned set, const void **fields,
+			  const fw_net_st *nets, unsigned n_nets, unsigned *n)
+{
+	uint8_t prefix[4] = { 0, 0, 0, 0 };
+	unsigned i;
+
+	for (i = 0; i < n_nets; i++) {
+		if (nets[i].family != sets[set].family)
+			continue;
+		prefix[3] = nets[i].prefix;
+		fields[1] = nets[i].addr;
+		fields[2] = prefix;
+		elem_put(b, set, fields, n);
+	}
+}
+
+static unsigned has_family(const fw_net_st *nets, unsigned n, unsigned family)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		if (nets[i].family == family)
+			return 1;
+	}
+	return 0;
+}
+
+/* Appends a message with the elements of @set of the session, if it
+ * has any */
+static void session_set_msg(nl_buf_st *b, const fw_session_st *fs, unsigned type,
+			    unsigned set)
+{
+	static const uint8_t dns_protos[] = { IPPROTO_UDP, IPPROTO_TCP };
+	static const uint8_t dns_port[] = { 0, 53 };
+	const void *fields[4];
+	unsigned i, j, elems, n = 0;
+	uint8_t flag[4] = { 0, 0, 0, 0 }, port[2];
+
+	nl_msg_start(b, type, type == NFT_MSG_NEWSETELEM ? NLM_F_CREATE : 0);
+	nl_attr_str(b, NFTA_SET_ELEM_LIST_TABLE, FW_TABLE);
+	nl_attr_str(b, NFTA_SET_ELEM_LIST_SET, sets[set].name);
+	elems = nl_nest_start(b, NFTA_SET_ELEM_LIST_ELEMENTS);
+
+	fields[0] = fs->dev;
+
+	switch (set) {
+	case SET_FLAGS:
+		fields[1] = flag;
+		flag[3] = FW_RESTRICT;
+		if (fs->restrict_routes)
+			elem_put(b, set, fields, &n);
+
+		flag[3] = FW_ALLOW_PORTS;
+		if (fs->n_svcs > 0 && fs->allow_ports)
+			elem_put(b, set, fields, &n);
+
+		flag[3] = FW_HAS_ROUTES4;
+		if (has_family(fs->routes, fs->n_routes, AF_INET))
+			elem_put(b, set, fields, &n);
+
+		flag[3] = FW_HAS_ROUTES6;
+		if (has_family(fs->routes, fs->n_routes, AF_INET6))
+			elem_put(b, set, fields, &n);
+		break;
+	case SET_PORTS:
+	case SET_PROTOS:
+		for (j = 0; j < fs->n_svcs; j++) {
+			if ((fs->svcs[j].port != 0) != (set == SET_PORTS))
+				continue;
+			port[0] = fs->svcs[j].port >> 8;
+			port[1] = fs->svcs[j].port & 0xff;
+			fields[1] = &fs->svcs[j].proto;
+			fields[2] = port;
+			elem_put(b, set, fields, &n);
+		}
+		break;
+	case SET_DNS4:
+	case SET_DNS6:
+		for (j = 0; j < fs->n_dns; j++) {
+			if (fs->dns[j].family != sets[set].family)
+				continue;
+			fields[1] = fs->dns[j].addr;
+			fields[3] = dns_port;
+			for (i = 0; i < sizeof(dns_protos); i++) {
+				fields[2] = &dns_protos[i];
+				elem_put(b, set, fields, &n);
+			}
+		}
+		break;
+	case SET_ROUTES4:
+	case SET_ROUTES6:
+		elem_put_nets(b, set, fields, fs->routes, fs->n_routes, &n);
+		break;
+	case SET_NO_ROUTES4:
+	case SET_NO_ROUTES6:
+		elem_put_nets(b, set, fields, fs->no_routes, fs->n_no_routes, &n);
+		break;
+	}
+
+	if (n == 0) {
+		nl_msg_cancel(b);
+		return;
+	}
+
+	nl_nest_end(b, elems);
+	nl_msg_end(b);
+}
+
+/* Appends the rules for the prefix lengths of @nets which have none in
+ * the chain of @set, and marks them in @added */
+static void session_rules_msg(nl_buf_st *b, unsigned set, const fw_net_st *nets,
+			      unsigned n, uint8_t *added)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		if (nets[i].family != sets[set].family ||
+		    fw.len_rule[set][nets[i].prefix] || added[nets[i].prefix])
+			continue;
+		route_rule_msg(b, set, nets[i].prefix);
+		added[nets[i].prefix] = 1;
+	}
+}
+
+/* Adds or deletes the set elements of the session, in a single
+ * transaction */
+static int fw_update(main_server_st *s, struct proc_st *proc, unsigned type)
+{
+	fw_session_st fs;
+	nl_buf_st b;
+	void *pool;
+	uint8_t (*added)[129];
+	unsigned i, j;
+	int ret;
+
+	pool = talloc_new(proc);
+	if (pool == NULL)
+		return -ENOMEM;
+
+	ret = session_init(pool, proc, &fs);
+	if (ret < 0) {
+		mslog(s, proc, LOG_ERR, "could not parse the firewall rules of the session");
+		goto cleanup;
+	}
+
+	added = talloc_zero_size(pool, sizeof(uint8_t[SET_MAX][129]));
+	if (added == NULL) {
+		ret = -ENOMEM;
+		goto cleanup;
+	}
+
+	nl_batch_start(&b, pool);
+
+	if (type == NFT_MSG_NEWSETELEM) {
+		session_rules_msg(&b, SET_ROUTES4, fs.routes, fs.n_routes, added[SET_ROUTES4]);
+		session_rules_msg(&b, SET_ROUTES6, fs.routes, fs.n_routes, added[SET_ROUTES6]);
+		session_rules_msg(&b, SET_NO_ROUTES4, fs.no_routes, fs.n_no_routes, added[SET_NO_ROUTES4]);
+		session_rules_msg(&b, SET_NO_ROUTES6, fs.no_routes, fs.n_no_routes, added[SET_NO_ROUTES6]);
+	}
+
+	for (i = 0; i < SET_MAX; i++)
+		session_set_msg(&b, &fs, type, i);
+
+	nl_batch_end(&b);
+
+	if (b.msgs == 0) {
+		ret = 0;
+		goto cleanup;
+	}
+
+	ret = fw_commit(s, &b);
+	if (ret == 0) {
+		for (i = 0; i < SET_MAX; i++) {
+			for (j = 0; j < 129; j++)
+				fw.len_rule[i][j] |= added[i][j];
+		}
+	}
+
+ cleanup:
+	talloc_free(pool);
+	return ret;
+}
+
+static int fw_setup(main_server_st *s, const char *dev)
+{
+	nl_buf_st b;
+	int ret;
+
+	nl_batch_start(&b, s);
+	setup_batch(&b, dev);
+	nl_batch_end(&b);
+
+	ret = fw_commit(s, &b);
+	talloc_free(b.data);
+
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "could not create the nftables table %s: %s",
+		      FW_TABLE, strerror(-ret));
+		return ERR_EXEC;
+	}
+
+	memset(fw.len_rule, 0, sizeof(fw.len_rule));
+	fw.ready = 1;
+	return 0;
+}
+
+/* Creates the table with the rules shared by all sessions, replacing
+ * the one of an earlier run. */
+int fw_init(main_server_st *s)
+{
+	return fw_setup(s, GETCONFIG(s)->network.name);
+}
+
+int fw_apply(main_server_st *s, struct proc_st *proc)
+{
+	int ret;
+
+	if (!fw_native(s, proc))
+		return 0;
+
+	/* when enabled by a reload */
+	if (!fw.ready && fw_init(s) < 0)
+		return ERR_EXEC;
+
+	ret = fw_update(s, proc, NFT_MSG_NEWSETELEM);
+	if (ret < 0) {
+		mslog(s, proc, LOG_ERR, "could not apply the firewall rules of the session: %s",
+		      strerror(-ret));
+		return ERR_EXEC;
+	}
+
+	proc->applied_fw = 1;
+	return 0;
+}
+
+void fw_remove(main_server_st *s, struct proc_st *proc)
+{
+	int ret;
+
+	if (proc->applied_fw == 0)
+		return;
+
+	proc->applied_fw = 0;
+	ret = fw_update(s, proc, NFT_MSG_DELSETELEM);
+	if (ret < 0)
+		mslog(s, proc, LOG_ERR, "could not remove the firewall rules of the session: %s",
+		      strerror(-ret));
+}
+
+void fw_deinit(void)
+{
+	if (fw.fd >= 0) {
+		close(fw.fd);
+		fw.fd = -1;
+	}
+	fw.ready = 0;
+}
+#else
+int fw_init(main_server_st *s)
+{
+	mslog(s, NULL, LOG_ERR, "the nftables firewall is not supported on this system");
+	return ERR_EXEC;
+}
+
+int fw_apply(main_server_st *s, struct proc_st *proc)
+{
+	return 0;
+}
+
+void fw_remove(main_server_st *s, struct proc_st *proc)
+{
+}
+
+void fw_deinit(void)
+{
+}
+#endif
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MAIN_FW_H
+# define MAIN_FW_H
+
+#include <main.h>
+
+/* Returns non-zero if the firewall rules of the session are applied
+ * by ocserv rather than by the ocserv-fw script */
+unsigned fw_native(main_server_st *s, struct proc_st *proc);
+
+int fw_init(main_server_st *s);
+int fw_apply(main_server_st *s, struct proc_st *proc);
+void fw_remove(main_server_st *s, struct proc_st *proc);
+void fw_deinit(void);
+
+#endif
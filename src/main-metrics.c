@@ -0,0 +1,386 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <main.h>
+#include <main-ban.h>
+#include <main-metrics.h>
+#include <common.h>
+#include <cloexec.h>
+#include <str.h>
+#include <lat-hist.h>
+#include <ccan/list/list.h>
+
+/* The clients served at once; more are closed once accepted */
+#define METRICS_MAX_CONNS 8
+/* The size of a request, with its headers */
+#define METRICS_MAX_REQ_SIZE 2048
+/* The seconds a client is given to send its request and read the reply */
+#define METRICS_TIMEOUT 10.
+
+typedef struct metrics_conn_st {
+	struct list_node list;
+	struct ev_io io;
+	struct ev_timer timer;
+	int fd;
+
+	char req[METRICS_MAX_REQ_SIZE];
+	size_t req_size;
+
+	str_st rep; /* empty while the request is read */
+	size_t rep_sent;
+} metrics_conn_st;
+
+static struct {
+	int fd;
+	struct ev_io io;
+	struct list_head conns;
+	unsigned n_conns;
+} metrics = { .fd = -1 };
+
+static const char *stage_names[LAT_STAGES] = {
+	[LAT_TLS_HANDSHAKE] = "tls_handshake",
+	[LAT_AUTH] = "auth",
+	[LAT_SESSION] = "session",
+	[LAT_KEY_OP] = "key_op",
+	[LAT_LEASE] = "lease",
+	[LAT_TUN] = "tun",
+	[LAT_SCRIPT] = "connect_script",
+	[LAT_CONNECT] = "connect",
+	[LAT_DTLS_HANDSHAKE] = "dtls_handshake",
+};
+
+const char *lat_stage_name(unsigned stage)
+{
+	if (stage >= LAT_STAGES)
+		return "unknown";
+	return stage_names[stage];
+}
+
+#define APPEND(...) \
+	if (str_append_printf(out, __VA_ARGS__) < 0) \
+		return -1
+
+static int append_metric(str_st *out, const char *name, const char *type,
+			 const char *help, uint64_t value)
+{
+	APPEND("# HELP ocserv_%s %s\n# TYPE ocserv_%s %s\nocserv_%s %"PRIu64"\n",
+	       name, help, name, type, name, value);
+	return 0;
+}
+
+/* The histogram buckets are given at the powers of two; the ones
+ * between them are summed into the next. */
+static int append_histogram(str_st *out, const char *stage, const lat_hist_st *h)
+{
+	uint64_t cumulative = 0;
+	unsigned i;
+
+	for (i = 0; i < LAT_HIST_BUCKETS - 1; i++) {
+		cumulative += h->count[i];
+		if ((i + 1) % LAT_HIST_SUB != 0)
+			continue;
+
+		APPEND("ocserv_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.6f\"} %"PRIu64"\n",
+		       stage, lat_hist_bucket_limit(i) / 1000000.0, cumulative);
+	}
+	cumulative += h->count[LAT_HIST_BUCKETS - 1];
+
+	APPEND("ocserv_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %"PRIu64"\n",
+	       stage, cumulative);
+	APPEND("ocserv_stage_duration_seconds_sum{stage=\"%s\"} %.6f\n",
+	       stage, h->sum / 1000000.0);
+	APPEND("ocserv_stage_duration_seconds_count{stage=\"%s\"} %"PRIu64"\n",
+	       stage, cumulative);
+	return 0;
+}
+
+static int append_metrics(main_server_st *s, str_st *out)
+{
+	unsigned i;
+
+	if (append_metric(out, "active_sessions", "gauge",
+			  "The number of connected sessions.",
+			  s->stats.active_clients) < 0 ||
+	    append_metric(out, "sessions_closed_total", "counter",
+			  "The sessions closed since start.",
+			  s->stats.total_sessions_closed) < 0 ||
+	    append_metric(out, "auth_failures_total", "counter",
+			  "The authentication failures since start.",
+			  s->stats.total_auth_failures) < 0 ||
+	    append_metric(out, "banned_ips", "gauge",
+			  "The entries of the ban list.",
+			  main_ban_db_elems(s)) < 0 ||
+	    append_metric(out, "start_time_seconds", "gauge",
+			  "The time the server started, in seconds since the epoch.",
+			  s->stats.start_time) < 0)
+		return -1;
+
+	APPEND("# HELP ocserv_stage_duration_seconds The durations of the stages of the connection lifecycle.\n"
+	       "# TYPE ocserv_stage_duration_seconds histogram\n");
+
+	for (i = 0; i < LAT_STAGES; i++) {
+		if (append_histogram(out, stage_names[i], &s->stats.latency[i]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+#undef APPEND
+
+static void conn_close(metrics_conn_st *conn)
+{
+	ev_io_stop(loop, &conn->io);
+	ev_timer_stop(loop, &conn->timer);
+	close(conn->fd);
+	list_del(&conn->list);
+	metrics.n_conns--;
+	talloc_free(conn);
+}
+
+/* Sets the reply to the request in conn->req; only GET /metrics is
+ * served. */
+static int conn_reply(main_server_st *s, metrics_conn_st *conn)
+{
+	str_st body;
+	const char *status = "200 OK";
+	char *path, *p;
+	unsigned head = 0;
+	int ret = -1;
+
+	str_init(&body, conn);
+
+	path = NULL;
+	if (strncmp(conn->req, "GET ", 4) == 0) {
+		path = conn->req + 4;
+	} else if (strncmp(conn->req, "HEAD ", 5) == 0) {
+		path = conn->req + 5;
+		head = 1;
+	}
+
+	if (path == NULL) {
+		status = "405 Method Not Allowed";
+	} else {
+		p = strpbrk(path, " ?\r\n");
+		if (p == NULL || (p - path != sizeof("/metrics") - 1) ||
+		    strncmp(path, "/metrics", p - path) != 0)
+			status = "404 Not Found";
+	}
+
+	if (status[0] == '2' && append_metrics(s, &body) < 0)
+		goto cleanup;
+
+	if (str_append_printf(&conn->rep,
+			      "HTTP/1.0 %s\r\n"
+			      "Content-Type: text/plain; version=0.0.4\r\n"
+			      "Content-Length: %u\r\n"
+			      "Connection: close\r\n\r\n",
+			      status, (unsigned)body.length) < 0)
+		goto cleanup;
+
+	if (!head &&
+	    str_append_data(&conn->rep, body.data, body.length) < 0)
+		goto cleanup;
+
+	ret = 0;
+ cleanup:
+	str_clear(&body);
+	return ret;
+}
+
+static void conn_write(metrics_conn_st *conn)
+{
+	ssize_t ret;
+
+	while (conn->rep_sent < conn->rep.length) {
+		ret = send(conn->fd, conn->rep.data + conn->rep_sent,
+			   conn->rep.length - conn->rep_sent, MSG_NOSIGNAL);
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		if (ret <= 0)
+			break;
+		conn->rep_sent += ret;
+	}
+
+	conn_close(conn);
+}
+
+static void conn_read(main_server_st *s, metrics_conn_st *conn)
+{
+	ssize_t ret;
+
+	ret = recv(conn->fd, conn->req + conn->req_size,
+		   sizeof(conn->req) - 1 - conn->req_size, 0);
+	if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (ret <= 0) {
+		conn_close(conn);
+		return;
+	}
+
+	conn->req_size += ret;
+	conn->req[conn->req_size] = 0;
+
+	/* the request is answered once its headers are read */
+	if (strstr(conn->req, "\r\n\r\n") == NULL && strstr(conn->req, "\n\n") == NULL) {
+		if (conn->req_size >= sizeof(conn->req) - 1)
+			conn_close(conn);
+		return;
+	}
+
+	if (conn_reply(s, conn) < 0) {
+		mslog(s, NULL, LOG_ERR, "metrics: could not format the reply");
+		conn_close(conn);
+		return;
+	}
+
+	ev_io_stop(loop, &conn->io);
+	ev_io_set(&conn->io, conn->fd, EV_WRITE);
+	ev_io_start(loop, &conn->io);
+
+	conn_write(conn);
+}
+
+static void conn_watcher_cb(EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	metrics_conn_st *conn = container_of(w, metrics_conn_st, io);
+
+	if (conn->rep.length == 0)
+		conn_read(s, conn);
+	else
+		conn_write(conn);
+}
+
+static void conn_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	metrics_conn_st *conn = container_of(w, metrics_conn_st, timer);
+
+	conn_close(conn);
+}
+
+static void metrics_watcher_cb(EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	metrics_conn_st *conn;
+	int fd;
+
+	fd = accept(metrics.fd, NULL, NULL);
+	if (fd == -1)
+		return;
+
+	if (metrics.n_conns >= METRICS_MAX_CONNS) {
+		mslog(s, NULL, LOG_DEBUG, "metrics: too many clients; closing connection");
+		close(fd);
+		return;
+	}
+
+	conn = talloc_zero(s, metrics_conn_st);
+	if (conn == NULL) {
+		close(fd);
+		return;
+	}
+
+	set_non_block(fd);
+	set_cloexec_flag(fd, 1);
+	conn->fd = fd;
+	str_init(&conn->rep, conn);
+
+	list_add_tail(&metrics.conns, &conn->list);
+	metrics.n_conns++;
+
+	ev_io_init(&conn->io, conn_watcher_cb, fd, EV_READ);
+	ev_io_start(loop, &conn->io);
+	ev_timer_init(&conn->timer, conn_timer_cb, METRICS_TIMEOUT, 0.);
+	ev_timer_start(loop, &conn->timer);
+}
+
+/* Listens on the loopback address at metrics-port; that is done once
+ * at startup. */
+int metrics_init(main_server_st *s)
+{
+	struct sockaddr_in sa;
+	int fd, y = 1, e;
+
+	list_head_init(&metrics.conns);
+
+	if (GETPCONFIG(s)->metrics_port == 0)
+		return 0;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "metrics: could not create socket: %s", strerror(e));
+		return -1;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &y, sizeof(y));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(GETPCONFIG(s)->metrics_port);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+	    listen(fd, METRICS_MAX_CONNS) == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "metrics: could not listen on port %u: %s",
+		      GETPCONFIG(s)->metrics_port, strerror(e));
+		close(fd);
+		return -1;
+	}
+
+	set_non_block(fd);
+	set_cloexec_flag(fd, 1);
+	metrics.fd = fd;
+
+	ev_io_init(&metrics.io, metrics_watcher_cb, fd, EV_READ);
+	ev_io_start(loop, &metrics.io);
+
+	mslog(s, NULL, LOG_INFO, "serving metrics on 127.0.0.1:%u", GETPCONFIG(s)->metrics_port);
+	return 0;
+}
+
+void metrics_deinit(void)
+{
+	metrics_conn_st *conn, *pos;
+
+	if (metrics.fd == -1)
+		return;
+
+	list_for_each_safe(&metrics.conns, conn, pos, list)
+		conn_close(conn);
+
+	ev_io_stop(loop, &metrics.io);
+	close(metrics.fd);
+	metrics.fd = -1;
+}
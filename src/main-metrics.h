@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MAIN_METRICS_H
+# define MAIN_METRICS_H
+
+#include <main.h>
+
+/* With metrics-port set, main serves its statistics and the latency
+ * histograms of the connection stages over HTTP on the loopback
+ * address, in the Prometheus text format. The clients are served by
+ * the event loop of main, without blocking it. */
+
+int metrics_init(main_server_st *s);
+void metrics_deinit(void);
+
+/* The name of the LAT_ stage @stage */
+const char *lat_stage_name(unsigned stage);
+
+#endif
@@ -43,6 +43,7 @@
 #include "setproctitle.h"
 #include <sec-mod.h>
 #include <route-add.h>
+#include <main-fw.h>
 #include <ip-lease.h>
 #include <proc-search.h>
 #include <ipc.pb-c.h>
@@ -58,6 +59,7 @@
 #include <tun.h>
 #include <main.h>
 #include <main-ban.h>
+#include <main-ctl.h>
 #include <ccan/list/list.h>
 
 struct proc_st *new_proc(main_server_st * s, pid_t pid, int cmd_fd,
@@ -73,6 +75,7 @@ struct proc_st *new_proc(main_server_st * s, pid_t pid, int cmd_fd,
 
 	ctmp->pid = pid;
 	ctmp->tun_lease.fd = -1;
+	ctmp->udp_steer_fd = -1;
 	ctmp->fd = cmd_fd;
 	set_cloexec_flag (cmd_fd, 1);
 	ctmp->conn_time = time(0);
@@ -83,6 +86,7 @@ struct proc_st *new_proc(main_server_st * s, pid_t pid, int cmd_fd,
 	memcpy(&ctmp->our_addr, our_addr, our_addr_len);
 	ctmp->our_addr_len = our_addr_len;
 
+	ctmp->seq = ++s->proc_list.seq;
 	list_add(&s->proc_list.head, &(ctmp->list));
 
 	/* initially we put into the "default" vhost cgroup. We
@@ -94,20 +98,169 @@ struct proc_st *new_proc(main_server_st * s, pid_t pid, int cmd_fd,
 	return ctmp;
 }
 
+/* Asks the worker serving proc to terminate the session. Sessions
+ * of a pool worker are terminated by a message to the pool, as the
+ * process serves other sessions too.
+ */
+void kill_proc(main_server_st * s, struct proc_st *proc)
+{
+	PoolTerminateMsg msg = POOL_TERMINATE_MSG__INIT;
+	int ret;
+
+	if (proc->pool == NULL) {
+		kill(proc->pid, SIGTERM);
+		return;
+	}
+
+	if (proc->pool->ctl_fd == -1)
+		return;
+
+	msg.id = proc->pool_id;
+	ret = send_msg(proc, proc->pool->ctl_fd, CMD_POOL_TERMINATE, &msg,
+		       (pack_size_func) pool_terminate_msg__get_packed_size,
+		       (pack_func) pool_terminate_msg__pack);
+	if (ret < 0)
+		mslog(s, proc, LOG_ERR, "error sending terminate message to worker pool %u",
+		      (unsigned)proc->pool->pid);
+}
+
+/* Releases a session of a pool worker. A pool which will not
+ * be given any more sessions is let to exit with its last one.
+ */
+void worker_pool_put(main_server_st * s, struct worker_pool_st *pool)
+{
+	pool->sessions--;
+	if (pool->sessions > 0)
+		return;
+
+	if (pool->exited) {
+		if (pool->ctl_fd >= 0)
+			close(pool->ctl_fd);
+		list_del(&pool->list);
+		talloc_free(pool);
+	} else if (pool->draining && pool->ctl_fd >= 0) {
+		close(pool->ctl_fd);
+		pool->ctl_fd = -1;
+	}
+}
+
+/* The slot of a session whose worker was asked to terminate. The worker
+ * publishes its final counters as it exits, so the slot is freed once it
+ * closes its end of the command socket, or after a timeout; a worker
+ * still running then is refused the slot by its generation.
+ */
+#define STATS_RELEASE_TIMEOUT 30
+
+typedef struct stats_release_st {
+	ev_io io;
+	ev_timer timer;
+	unsigned slot;
+	uint32_t gen;
+	/* the counters accounted when the session was closed */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+} stats_release_st;
+
+static void stats_release(main_server_st *s, stats_release_st *rel)
+{
+	session_stats_st st;
+
+	ev_io_stop(loop, &rel->io);
+	ev_timer_stop(loop, &rel->timer);
+	close(rel->io.fd);
+
+	/* account what was transferred after the session was closed */
+	if (session_stats_read(rel->slot, rel->gen, &st) == 0) {
+		if (st.bytes_in > rel->bytes_in)
+			s->stats.kbytes_in += (st.bytes_in - rel->bytes_in)/1000;
+		if (st.bytes_out > rel->bytes_out)
+			s->stats.kbytes_out += (st.bytes_out - rel->bytes_out)/1000;
+	}
+
+	session_stats_free(rel->slot, rel->gen);
+	talloc_free(rel);
+}
+
+static void stats_release_io_cb(EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	stats_release_st *rel = container_of(w, stats_release_st, io);
+	uint8_t buf[256];
+	ssize_t ret;
+
+	/* the messages of the exiting worker are discarded */
+	do {
+		ret = recv(w->fd, buf, sizeof(buf), MSG_DONTWAIT);
+	} while (ret > 0);
+
+	if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		stats_release(s, rel);
+}
+
+static void stats_release_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	stats_release_st *rel = container_of(w, stats_release_st, timer);
+
+	stats_release(s, rel);
+}
+
+/* Takes over the command socket of proc and its slot until its worker
+ * exits. Returns -1 if the slot is to be freed now.
+ */
+static int stats_release_defer(main_server_st *s, struct proc_st *proc)
+{
+	stats_release_st *rel;
+
+	rel = talloc_zero(s, stats_release_st);
+	if (rel == NULL)
+		return -1;
+
+	rel->slot = proc->stats_slot;
+	rel->gen = proc->stats_gen;
+	rel->bytes_in = proc->bytes_in;
+	rel->bytes_out = proc->bytes_out;
+
+	ev_io_init(&rel->io, stats_release_io_cb, proc->fd, EV_READ);
+	ev_io_start(loop, &rel->io);
+	ev_timer_init(&rel->timer, stats_release_timer_cb, STATS_RELEASE_TIMEOUT, 0.);
+	ev_timer_start(loop, &rel->timer);
+
+	proc->fd = -1;
+	proc->stats_gen = 0;
+	return 0;
+}
+
 /* k: whether to kill the process
  */
 void remove_proc(main_server_st * s, struct proc_st *proc, unsigned flags)
 {
-	pid_t pid;
+	struct script_wait_st *stmp;
+	unsigned killed = 0;
 
 	ev_io_stop(EV_A_ &proc->io);
 	ev_child_stop(EV_A_ &proc->ev_child);
 
+	ctl_handler_proc_removed(s, proc);
 	list_del(&proc->list);
 	s->stats.active_clients--;
 
-	if ((flags&RPROC_KILL) && proc->pid != -1 && proc->pid != 0)
-		kill(proc->pid, SIGTERM);
+	if ((flags&RPROC_KILL) && proc->pid != -1 && proc->pid != 0) {
+		kill_proc(s, proc);
+		killed = 1;
+	}
+
+	/* the final counters of the worker, if it has exited; those of a
+	 * worker which was just asked to terminate are completed when its
+	 * slot is released */
+	if (proc->stats_gen != 0) {
+		session_stats_st st;
+
+		if (session_stats_read(proc->stats_slot, proc->stats_gen, &st) == 0) {
+			proc->bytes_in = st.bytes_in;
+			proc->bytes_out = st.bytes_out;
+		}
+	}
 
 	/* close any pending sessions */
 	if (proc->active_sid && !(flags & RPROC_QUIT)) {
@@ -120,23 +273,18 @@ void remove_proc(main_server_st * s, struct proc_st *proc, unsigned flags)
 	mslog(s, proc, LOG_INFO, "user disconnected (reason: %s, rx: %"PRIu64", tx: %"PRIu64")",
 		discon_reason_to_str(proc->discon_reason), proc->bytes_in, proc->bytes_out);
 
-	pid = remove_from_script_list(s, proc);
-	if (proc->status == PS_AUTH_COMPLETED || pid > 0) {
-		if (pid > 0) {
-			int wstatus;
-			/* we were called during the connect script being run.
-			 * wait for it to finish and if it returns zero run the
-			 * disconnect script */
-			 if (waitpid(pid, &wstatus, 0) > 0) {
-			 	if (WEXITSTATUS(wstatus) == 0)
-					user_disconnected(s, proc);
-			 }
-		} else { /* pid > 0 or status == PS_AUTH_COMPLETED are mutually exclusive
-		          * since PS_AUTH_COMPLETED is set only after a successful script run.
-		          */
-			user_disconnected(s, proc);
-		}
-	}
+	/* if we are called while the connect script is being run, the
+	 * disconnect script is queued to run after it, if it succeeds */
+	stmp = find_script_wait(s, proc);
+	if (proc->status == PS_AUTH_COMPLETED || stmp != NULL)
+		user_disconnected(s, proc);
+	if (stmp != NULL)
+		cancel_script_wait(s, stmp);
+
+	/* the slot outlives a worker which is still running, and with it
+	 * the intercomm fd through which its exit is noticed */
+	if (killed && !(flags & RPROC_QUIT) && proc->stats_gen != 0 && proc->fd >= 0)
+		stats_release_defer(s, proc);
 
 	/* close the intercomm fd */
 	if (proc->fd >= 0)
@@ -144,13 +292,24 @@ void remove_proc(main_server_st * s, struct proc_st *proc, unsigned flags)
 	proc->fd = -1;
 	proc->pid = -1;
 
+	if (proc->pool) {
+		worker_pool_put(s, proc->pool);
+		proc->pool = NULL;
+	}
+
 	remove_iroutes(s, proc);
+	fw_remove(s, proc);
+
+	/* the VPN addresses are indexed through the leases */
+	proc_table_del(s, proc);
 
 	if (proc->ipv4 || proc->ipv6)
 		remove_ip_leases(s, proc);
 
 	close_tun(s, proc);
-	proc_table_del(s, proc);
+	udp_steer_remove(s, proc);
+	session_stats_free(proc->stats_slot, proc->stats_gen);
+	proc->stats_gen = 0;
 	if (proc->config_usage_count && *proc->config_usage_count > 0) {
 		(*proc->config_usage_count)--;
 	}
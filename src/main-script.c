@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <main.h>
+#include <common.h>
+#include <cloexec.h>
+#include <setproctitle.h>
+#include <script-list.h>
+#include <script-runner.h>
+#include <ccan/list/list.h>
+
+static struct {
+	int fd;
+	pid_t pid;
+	uint32_t next_id;
+	unsigned shutdown; /* whether main is exiting */
+	ev_io io;
+	ev_child child;
+} runner = { .fd = -1 };
+
+/* Called when the script with @id exits with @status */
+static void script_exited(main_server_st *s, uint32_t id, unsigned status)
+{
+	struct script_wait_st *stmp = NULL, *spos;
+	struct proc_st *proc;
+	int ret;
+
+	list_for_each(&s->script_list.head, spos, list) {
+		if (spos->id == id) {
+			stmp = spos;
+			break;
+		}
+	}
+
+	/* only the connect scripts are waited for */
+	if (stmp == NULL)
+		return;
+
+	list_del(&stmp->list);
+	proc = stmp->proc;
+	lat_hist_add(&s->stats.latency[LAT_SCRIPT], lat_hist_elapsed(&stmp->start));
+
+	if (proc == NULL) {
+		/* the session was removed while the script was running */
+		if (status == 0 && stmp->next != NULL)
+			script_runner_run(s, stmp->next);
+		talloc_free(stmp);
+		return;
+	}
+	talloc_free(stmp);
+
+	mslog(s, proc, LOG_DEBUG, "connect-script exit status: %u", status);
+
+	ret = handle_script_exit(s, proc, status);
+	if (ret < 0) {
+		/* takes care of free */
+		remove_proc(s, proc, RPROC_KILL);
+	}
+}
+
+static void script_runner_watcher_cb(EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	ScriptExitMsg *msg = NULL;
+	PROTOBUF_ALLOCATOR(pa, s);
+	int ret;
+
+	ret = recv_msg(s, runner.fd, CMD_SCRIPT_EXIT, (void *)&msg,
+		       (unpack_func) script_exit_msg__unpack, MAIN_SEC_MOD_TIMEOUT);
+	if (ret < 0) {
+		if (ret != ERR_PEER_TERMINATED)
+			mslog(s, NULL, LOG_ERR, "error receiving message from the script runner");
+		/* the runner is restarted once it exits */
+		ev_io_stop(loop, &runner.io);
+		return;
+	}
+
+	script_exited(s, msg->id, msg->status);
+	script_exit_msg__free_unpacked(msg, &pa);
+}
+
+static void script_runner_child_cb(EV_P_ ev_child *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct script_wait_st *stmp = NULL, *spos;
+	struct list_head waiting;
+
+	ev_child_stop(loop, w);
+	ev_io_stop(loop, &runner.io);
+	if (runner.fd >= 0)
+		close(runner.fd);
+	runner.fd = -1;
+
+	if (runner.shutdown)
+		return;
+
+	mslog(s, NULL, LOG_ERR, "script runner process %u exited unexpectedly", (unsigned)w->pid);
+
+	/* the scripts we are waiting for will not be reported */
+	list_head_init(&waiting);
+	list_for_each_safe(&s->script_list.head, stmp, spos, list) {
+		list_del(&stmp->list);
+		list_add_tail(&waiting, &stmp->list);
+	}
+
+	script_runner_init(s);
+
+	list_for_each_safe(&waiting, stmp, spos, list) {
+		list_del(&stmp->list);
+		list_add_tail(&s->script_list.head, &stmp->list);
+		script_exited(s, stmp->id, 1);
+	}
+}
+
+/* Forks the script runner; that is done once at startup, and when it
+ * exits unexpectedly. */
+int script_runner_init(main_server_st *s)
+{
+	int fd[2], ret;
+	pid_t pid;
+
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "error creating script runner socket");
+		return -1;
+	}
+
+	pid = fork();
+	if (pid == 0) {	/* child */
+		/* as in spawn_worker_pool() */
+		sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
+		close(fd[0]);
+		clear_lists(s);
+		if (s->top_fd != -1) close(s->top_fd);
+		close(s->sec_mod_fd);
+		close(s->sec_mod_fd_sync);
+
+		setproctitle(PACKAGE_NAME"-script-runner");
+
+		set_cloexec_flag(fd[1], 1);
+		script_runner_server(s, fd[1], GETPCONFIG(s)->max_scripts);
+		exit(0);
+	} else if (pid == -1) {
+		mslog(s, NULL, LOG_ERR, "fork failed");
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
+	}
+
+	close(fd[1]);
+	set_cloexec_flag(fd[0], 1);
+
+	runner.fd = fd[0];
+	runner.pid = pid;
+
+	ev_io_init(&runner.io, script_runner_watcher_cb, runner.fd, EV_READ);
+	ev_io_start(loop, &runner.io);
+
+	ev_child_init(&runner.child, script_runner_child_cb, pid, 0);
+	ev_child_start(loop, &runner.child);
+
+	mslog(s, NULL, LOG_DEBUG, "started script runner process %u", (unsigned)pid);
+	return 0;
+}
+
+void script_runner_deinit(void)
+{
+	if (runner.fd >= 0) {
+		ev_io_stop(loop, &runner.io);
+		ev_child_stop(loop, &runner.child);
+		close(runner.fd);
+		runner.fd = -1;
+	}
+}
+
+/* Lets the runner exit once it has run the scripts it was sent */
+void script_runner_shutdown(void)
+{
+	runner.shutdown = 1;
+	if (runner.fd >= 0) {
+		ev_io_stop(loop, &runner.io);
+		shutdown(runner.fd, SHUT_WR);
+	}
+}
+
+int script_runner_run(main_server_st *s, ScriptRunMsg *msg)
+{
+	int ret;
+
+	if (runner.fd == -1)
+		return ERR_EXEC;
+
+	if (++runner.next_id == 0)
+		runner.next_id++;
+	msg->id = runner.next_id;
+
+	ret = send_msg(s, runner.fd, CMD_SCRIPT_RUN, msg,
+		       (pack_size_func) script_run_msg__get_packed_size,
+		       (pack_func) script_run_msg__pack);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "error sending message to the script runner");
+		return ERR_EXEC;
+	}
+
+	return 0;
+}
+
+void script_runner_cancel(main_server_st *s, uint32_t id)
+{
+	ScriptCancelMsg msg = SCRIPT_CANCEL_MSG__INIT;
+
+	if (runner.fd == -1)
+		return;
+
+	msg.id = id;
+	if (send_msg(s, runner.fd, CMD_SCRIPT_CANCEL, &msg,
+		     (pack_size_func) script_cancel_msg__get_packed_size,
+		     (pack_func) script_cancel_msg__pack) < 0)
+		mslog(s, NULL, LOG_ERR, "error sending message to the script runner");
+}
@@ -55,6 +55,18 @@
 # include <malloc.h>
 #endif
 
+static void update_latency(main_server_st *s, LatencyMsg **msgs, unsigned n)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		if (msgs[i]->stage >= LAT_STAGES)
+			continue;
+		lat_hist_merge(&s->stats.latency[msgs[i]->stage], msgs[i]->count,
+			       msgs[i]->n_count, msgs[i]->sum);
+	}
+}
+
 static void update_auth_failures(main_server_st * s, uint64_t auth_failures)
 {
 	if (s->stats.auth_failures + auth_failures < s->stats.auth_failures) {
@@ -189,6 +201,7 @@ int handle_sec_mod_commands(main_server_st * s)
 			s->stats.max_auth_time = smsg->secmod_max_auth_time;
 			s->stats.avg_auth_time = smsg->secmod_avg_auth_time;
 			update_auth_failures(s, smsg->secmod_auth_failures);
+			update_latency(s, smsg->secmod_latency, smsg->n_secmod_latency);
 
 		}
 
@@ -466,6 +479,13 @@ int session_open(main_server_st *s, struct proc_st *proc, const uint8_t *cookie,
 		ireq.ipv6 = str_ipv6;
 	}
 
+	if (proc->stats_gen != 0) {
+		ireq.stats_slot = proc->stats_slot;
+		ireq.has_stats_slot = 1;
+		ireq.stats_gen = proc->stats_gen;
+		ireq.has_stats_gen = 1;
+	}
+
 	mslog(s, proc, LOG_DEBUG, "sending msg %s to sec-mod", cmd_request_to_str(CMD_SECM_SESSION_OPEN));
 
 	ret = send_msg(proc, s->sec_mod_fd_sync, CMD_SECM_SESSION_OPEN,
@@ -550,6 +570,7 @@ static void reset_stats(main_server_st *s, time_t now)
 	mslog(s, NULL, LOG_INFO, "Maximum authentication time: %lu sec", (unsigned long)s->stats.max_auth_time);
 	mslog(s, NULL, LOG_INFO, "Average authentication time: %lu sec", (unsigned long)s->stats.avg_auth_time);
 	mslog(s, NULL, LOG_INFO, "Data in: %lu, out: %lu kbytes", (unsigned long)s->stats.kbytes_in, (unsigned long)s->stats.kbytes_out);
+	mslog(s, NULL, LOG_INFO, "Compressed packets: %lu, uncompressible: %lu, not compressed: %lu", (unsigned long)s->stats.comp_hits, (unsigned long)s->stats.comp_misses, (unsigned long)s->stats.comp_skipped);
 	mslog(s, NULL, LOG_INFO, "End of statistics block; resetting non-total stats");
 
 	s->stats.session_idle_timeouts = 0;
@@ -560,6 +581,9 @@ static void reset_stats(main_server_st *s, time_t now)
 	s->stats.last_reset = now;
 	s->stats.kbytes_in = 0;
 	s->stats.kbytes_out = 0;
+	s->stats.comp_hits = 0;
+	s->stats.comp_misses = 0;
+	s->stats.comp_skipped = 0;
 	s->stats.max_session_mins = 0;
 	s->stats.max_auth_time = 0;
 }
@@ -663,6 +687,10 @@ int session_close(main_server_st * s, struct proc_st *proc)
 
 	update_main_stats(s, proc);
 
+	s->stats.comp_hits += msg->comp_hits;
+	s->stats.comp_misses += msg->comp_misses;
+	s->stats.comp_skipped += msg->comp_skipped;
+
 	cli_stats_msg__free_unpacked(msg, &pa);
 
 	return 0;
@@ -0,0 +1,389 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <main.h>
+#include <main-ban.h>
+#include <common.h>
+#include <system.h>
+#include <cloexec.h>
+#include <setproctitle.h>
+#include <acceptor-shard.h>
+#include <ccan/container_of/container_of.h>
+
+/* The main side of the acceptor shards. The shards send main the new
+ * sessions and the UDP sockets of the DTLS clients over a stream socket,
+ * and main sends them its bans as datagrams, which are dropped rather
+ * than block main when a shard is busy; the connections of a banned
+ * client which a shard accepts are rejected by main then.
+ */
+
+typedef struct acceptor_shard_st {
+	/* This is first so this structure can behave as an ev_child */
+	ev_child child;
+	ev_io io;
+
+	unsigned id; /* the index of its sockets in the SO_REUSEPORT groups */
+	pid_t pid;
+	int fd; /* the sessions are received on it */
+	int ban_fd; /* the bans are sent on it */
+} acceptor_shard_st;
+
+static struct {
+	acceptor_shard_st *shard;
+	unsigned total;
+	unsigned shutdown; /* whether main is exiting */
+} shards;
+
+/* the largest message of a shard has a DTLS client hello */
+static uint8_t msg_buf[MAX_MSG_SIZE + 1024];
+
+static int spawn_shard(main_server_st *s, acceptor_shard_st *sh);
+
+/* A connection accepted by a shard. It is either the command socket
+ * of the worker the shard forked for it, or the connection itself
+ * when the sessions are served by worker pools. */
+static void shard_conn(main_server_st *s, acceptor_shard_st *sh,
+		       uint8_t *data, unsigned size, int fd)
+{
+	struct worker_st *ws = s->ws;
+	ShardConnMsg *msg;
+
+	msg = shard_conn_msg__unpack(NULL, size, data);
+	if (msg == NULL || fd == -1 ||
+	    msg->remote_addr.len > sizeof(ws->remote_addr) ||
+	    (msg->has_our_addr && msg->our_addr.len > sizeof(ws->our_addr))) {
+		mslog(s, NULL, LOG_ERR, "error unpacking message of acceptor shard %u", sh->id);
+		goto cleanup;
+	}
+
+	memcpy(&ws->remote_addr, msg->remote_addr.data, msg->remote_addr.len);
+	ws->remote_addr_len = msg->remote_addr.len;
+	if (msg->has_our_addr) {
+		memcpy(&ws->our_addr, msg->our_addr.data, msg->our_addr.len);
+		ws->our_addr_len = msg->our_addr.len;
+	} else {
+		ws->our_addr_len = 0;
+	}
+
+	/* as in accept_client(); the shard only checked for a ban */
+	if (GETCONFIG(s)->max_clients > 0 && s->stats.active_clients >= GETCONFIG(s)->max_clients) {
+		mslog(s, NULL, LOG_INFO, "reached maximum client limit (active: %u)", s->stats.active_clients);
+		goto reject;
+	}
+
+	if (msg->conn_type == SOCK_TYPE_TCP && !GETCONFIG(s)->listen_proxy_proto &&
+	    check_if_banned(s, &ws->remote_addr, ws->remote_addr_len) != 0)
+		goto reject;
+
+	if (!msg->has_pid) {
+		serve_connection(s, fd, msg->conn_type);
+		fd = -1;
+		goto cleanup;
+	}
+
+	/* the worker is not a child of main; it exits when its
+	 * command socket is closed */
+	if (add_worker_proc(s, msg->pid, fd) == NULL)
+		goto reject;
+	fd = -1;
+	goto cleanup;
+
+ reject:
+	if (msg->has_pid)
+		kill(msg->pid, SIGTERM);
+ cleanup:
+	if (fd != -1)
+		close(fd);
+	if (msg)
+		shard_conn_msg__free_unpacked(msg, NULL);
+}
+
+/* A DTLS datagram received by a shard, with a socket connected
+ * to its client */
+static void shard_udp(main_server_st *s, acceptor_shard_st *sh,
+		      uint8_t *data, unsigned size, int fd)
+{
+	ShardUdpMsg *msg;
+	udp_dgram_st d;
+
+	msg = shard_udp_msg__unpack(NULL, size, data);
+	if (msg == NULL || fd == -1 ||
+	    msg->remote_addr.len > sizeof(d.cli_addr) ||
+	    (msg->has_our_addr && msg->our_addr.len > sizeof(d.our_addr))) {
+		mslog(s, NULL, LOG_ERR, "error unpacking message of acceptor shard %u", sh->id);
+		if (fd != -1)
+			close(fd);
+		goto cleanup;
+	}
+
+	memset(&d, 0, sizeof(d));
+	memcpy(&d.cli_addr, msg->remote_addr.data, msg->remote_addr.len);
+	d.cli_addr_size = msg->remote_addr.len;
+	if (msg->has_our_addr) {
+		memcpy(&d.our_addr, msg->our_addr.data, msg->our_addr.len);
+		d.our_addr_size = msg->our_addr.len;
+	}
+
+	if (msg->has_session_id) {
+		d.session_id = msg->session_id.data;
+		d.session_id_size = msg->session_id.len;
+	} else {
+		d.match_ip_only = 1;
+	}
+
+	d.data = msg->data.data;
+	d.data_size = msg->data.len;
+
+	udp_dgram_forward(s, &d, NULL, fd);
+
+ cleanup:
+	if (msg)
+		shard_udp_msg__free_unpacked(msg, NULL);
+}
+
+static void shard_watcher_cb(EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	acceptor_shard_st *sh = container_of(w, acceptor_shard_st, io);
+	uint8_t cmd;
+	int ret, fd = -1;
+
+	ret = recv_msg_data(sh->fd, &cmd, msg_buf, sizeof(msg_buf), &fd);
+	if (ret < 0) {
+		/* the shard is restarted once it exits */
+		ev_io_stop(loop, &sh->io);
+		if (ret != ERR_PEER_TERMINATED) {
+			mslog(s, NULL, LOG_ERR, "error receiving command from acceptor shard %u", sh->id);
+			kill(sh->pid, SIGTERM);
+		}
+		return;
+	}
+
+	switch (cmd) {
+	case CMD_SHARD_CONN:
+		shard_conn(s, sh, msg_buf, ret, fd);
+		break;
+	case CMD_SHARD_UDP:
+		shard_udp(s, sh, msg_buf, ret, fd);
+		break;
+	default:
+		mslog(s, NULL, LOG_ERR, "unknown command %u from acceptor shard %u", (unsigned)cmd, sh->id);
+		if (fd != -1)
+			close(fd);
+		break;
+	}
+}
+
+static void shard_child_cb(EV_P_ ev_child *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	acceptor_shard_st *sh = (acceptor_shard_st*)w;
+
+	ev_child_stop(loop, w);
+	ev_io_stop(loop, &sh->io);
+	if (sh->fd >= 0)
+		close(sh->fd);
+	if (sh->ban_fd >= 0)
+		close(sh->ban_fd);
+	sh->fd = sh->ban_fd = -1;
+	sh->pid = -1;
+
+	if (shards.shutdown)
+		return;
+
+	mslog(s, NULL, LOG_ERR, "acceptor shard %u (process %u) exited unexpectedly", sh->id, (unsigned)w->pid);
+
+	/* its listening sockets were kept open by main */
+	spawn_shard(s, sh);
+}
+
+/* Sends a ban, or the removal of a ban, to the shards */
+static void notify_ban(main_server_st *s, const struct ban_entry_st *e)
+{
+	ShardBanMsg msg = SHARD_BAN_MSG__INIT;
+	uint8_t buf[64];
+	size_t size;
+	unsigned i;
+
+	msg.ip.data = (void*)e->ip.ip;
+	msg.ip.len = e->ip.size;
+	msg.prefix = e->bits;
+	msg.expires = e->expires;
+
+	size = shard_ban_msg__get_packed_size(&msg);
+	if (size > sizeof(buf))
+		return;
+	shard_ban_msg__pack(&msg, buf);
+
+	for (i = 0; i < shards.total; i++) {
+		if (shards.shard[i].ban_fd >= 0)
+			send(shards.shard[i].ban_fd, buf, size, MSG_DONTWAIT);
+	}
+}
+
+static int spawn_shard(main_server_st *s, acceptor_shard_st *sh)
+{
+	int fd[2], ban_fd[2], ret;
+	unsigned id = sh->id;
+	pid_t pid;
+
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, fd);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "error creating acceptor shard socket");
+		return -1;
+	}
+
+	ret = socketpair(AF_UNIX, SOCK_DGRAM, 0, ban_fd);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "error creating acceptor shard socket");
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
+	}
+
+	pid = fork();
+	if (pid == 0) {	/* child */
+		/* as in spawn_worker_pool(); the listening sockets
+		 * of the shard are kept by acceptor_shard_server() */
+		sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
+		close(fd[0]);
+		close(ban_fd[0]);
+
+		setproctitle(PACKAGE_NAME"-acceptor");
+		kill_on_parent_kill(SIGTERM);
+
+		set_cloexec_flag(fd[1], 1);
+		set_cloexec_flag(ban_fd[1], 1);
+		acceptor_shard_server(s, fd[1], ban_fd[1], id);
+		exit(0);
+	} else if (pid == -1) {
+		mslog(s, NULL, LOG_ERR, "fork failed");
+		close(fd[0]);
+		close(fd[1]);
+		close(ban_fd[0]);
+		close(ban_fd[1]);
+		return -1;
+	}
+
+	close(fd[1]);
+	close(ban_fd[1]);
+	set_cloexec_flag(fd[0], 1);
+	set_cloexec_flag(ban_fd[0], 1);
+
+	sh->pid = pid;
+	sh->fd = fd[0];
+	sh->ban_fd = ban_fd[0];
+
+	ev_io_init(&sh->io, shard_watcher_cb, sh->fd, EV_READ);
+	ev_io_start(loop, &sh->io);
+
+	ev_child_init(&sh->child, shard_child_cb, pid, 0);
+	ev_child_start(loop, &sh->child);
+
+	mslog(s, NULL, LOG_DEBUG, "started acceptor shard %u (process %u)", id, (unsigned)pid);
+	return 0;
+}
+
+/* Forks the shards; they inherit the bans of main, and are sent
+ * the bans which follow. */
+int acceptor_shards_init(main_server_st *s)
+{
+	unsigned i, total = GETPCONFIG(s)->acceptor_shards;
+
+	shards.shard = talloc_zero_array(s, acceptor_shard_st, total);
+	if (shards.shard == NULL) {
+		mslog(s, NULL, LOG_ERR, "memory error");
+		return -1;
+	}
+	shards.total = total;
+
+	for (i = 0; i < total; i++) {
+		shards.shard[i].id = i;
+		shards.shard[i].pid = -1;
+		shards.shard[i].fd = -1;
+		shards.shard[i].ban_fd = -1;
+	}
+
+	for (i = 0; i < total; i++) {
+		if (spawn_shard(s, &shards.shard[i]) < 0)
+			return -1;
+	}
+
+	if (s->ban_db)
+		s->ban_db->notify = notify_ban;
+
+	return 0;
+}
+
+void acceptor_shards_deinit(void)
+{
+	acceptor_shard_st *sh;
+	unsigned i;
+
+	for (i = 0; i < shards.total; i++) {
+		sh = &shards.shard[i];
+		if (loop) {
+			ev_io_stop(loop, &sh->io);
+			ev_child_stop(loop, &sh->child);
+		}
+		if (sh->fd >= 0)
+			close(sh->fd);
+		if (sh->ban_fd >= 0)
+			close(sh->ban_fd);
+	}
+
+	talloc_free(shards.shard);
+	shards.shard = NULL;
+	shards.total = 0;
+}
+
+void acceptor_shards_shutdown(void)
+{
+	unsigned i;
+
+	shards.shutdown = 1;
+	for (i = 0; i < shards.total; i++) {
+		if (shards.shard[i].pid > 0)
+			kill(shards.shard[i].pid, SIGTERM);
+	}
+}
+
+/* The shards read the configuration again; it is used by the
+ * workers they fork afterwards */
+void acceptor_shards_reload(void)
+{
+	unsigned i;
+
+	for (i = 0; i < shards.total; i++) {
+		if (shards.shard[i].pid > 0)
+			kill(shards.shard[i].pid, SIGHUP);
+	}
+}
@@ -0,0 +1,612 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#if defined(__linux__) && defined(HAVE_LINUX_BPF_H)
+# include <sys/syscall.h>
+# include <linux/bpf.h>
+#endif
+
+#include <main.h>
+#include <ip-util.h>
+#include <proc-search.h>
+#include <vpn.h>
+
+/* With udp-steering, the DTLS datagrams of a session are delivered by
+ * the kernel to its worker, and main only sees the datagrams of the
+ * sessions it does not know a worker socket for.
+ *
+ * The UDP listeners are made SO_REUSEPORT groups, and the socket main
+ * passes to a worker is not connected to its client, but joins the
+ * group of the listener the session was received at. A program attached
+ * to the group selects the socket of each datagram in a socket array,
+ * where the listener is at slot 0 and each session has a slot of its
+ * own. The slot of a session is found in three hash maps, shared by
+ * the groups:
+ *  - a client hello, by its (legacy) DTLS session ID;
+ *  - any other record, by the address and port of the client, or
+ *  - by its address alone, if a single session is from that address;
+ *    that is what main would do on a NAT rebinding.
+ * Any other datagram is received by the listener.
+ *
+ * The worker sends to the client with sendto(), and updates its peer
+ * once a record from a new address is decrypted.
+ */
+
+#if defined(__linux__) && defined(HAVE_LINUX_BPF_H) && defined(SO_ATTACH_REUSEPORT_EBPF) && defined(__NR_bpf)
+
+/* The sessions that can be steered; slot 0 is the listener's */
+#define UDP_STEER_MAX_SLOTS 65536
+
+#define MAX_INSNS 80
+
+/* the DTLS record header and the handshake type */
+#define DTLS_HDR_SIZE 14
+/* the legacy session ID of a client hello, and its length byte */
+#define HELLO_SESSION_ID_POS 59
+#define HELLO_SESSION_ID_SIZE 32
+
+#define SK_PASS 1
+
+typedef struct steer_peer_key_st {
+	uint8_t ip[16]; /* IPv4 addresses are mapped */
+	uint16_t port;
+	uint16_t pad;
+} steer_peer_key_st;
+
+static struct {
+	int session_map;
+	int peer_map;
+	int ip_map;
+	uint32_t *free_slots;
+	unsigned free_count;
+} steer = { -1, -1, -1, NULL, 0 };
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define INSN(c, d, s, o, i) \
+	((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+/* Sets R1 to the map */
+static unsigned load_map(struct bpf_insn *prog, unsigned reg, int map_fd)
+{
+	prog[0] = INSN(BPF_LD | BPF_DW | BPF_IMM, reg, BPF_PSEUDO_MAP_FD, 0, map_fd);
+	prog[1] = INSN(0, 0, 0, 0, 0);
+	return 2;
+}
+
+/* Copies size bytes at off, of the UDP header or, if rel, of the IP
+ * header, to the stack at stack_off */
+static unsigned load_bytes(struct bpf_insn *prog, int off, int stack_off,
+			   unsigned size, unsigned rel)
+{
+	unsigned n = 0;
+
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0);
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, off);
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0);
+	prog[n++] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, stack_off);
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, size);
+	if (rel) {
+		prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_5, 0, 0, BPF_HDR_START_NET);
+		prog[n++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes_relative);
+	} else {
+		prog[n++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_skb_load_bytes);
+	}
+	return n;
+}
+
+/* Looks up the key at stack_off in the map; R0 is the slot found */
+static unsigned lookup(struct bpf_insn *prog, int map_fd, int stack_off)
+{
+	unsigned n = 0;
+
+	n += load_map(&prog[n], BPF_REG_1, map_fd);
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+	prog[n++] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, stack_off);
+	prog[n++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+	return n;
+}
+
+/* Fills in prog the program of the group of a listener of family, with
+ * the socket array in array_fd, and returns its length. The DTLS header
+ * is copied to the stack at -16, the session ID at -57, and the key of
+ * the address at -80. */
+static unsigned build_prog(struct bpf_insn *prog, int family, int array_fd)
+{
+	unsigned n = 0, i, short_hdr, not_hello[4], short_id, bad_id, id_miss;
+	unsigned no_ip, no_port, peer_found, ip_miss, selected;
+	unsigned to_listener[16], nl = 0;
+
+	/* R6 is the context of the loads */
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+
+	n += load_bytes(&prog[n], sizeof(struct udphdr), -16, DTLS_HDR_SIZE, 0);
+	short_hdr = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 0);
+	to_listener[nl++] = short_hdr;
+
+	/* a client hello: a handshake record of epoch 0 of type 1 */
+	prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_0, BPF_REG_10, -16, 0);
+	not_hello[0] = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 22);
+	prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_0, BPF_REG_10, -13, 0);
+	not_hello[1] = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 0);
+	prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_0, BPF_REG_10, -12, 0);
+	not_hello[2] = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 0);
+	prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_0, BPF_REG_10, -3, 0);
+	not_hello[3] = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 1);
+
+	n += load_bytes(&prog[n], sizeof(struct udphdr) + HELLO_SESSION_ID_POS, -57,
+			HELLO_SESSION_ID_SIZE + 1, 0);
+	short_id = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 0);
+	to_listener[nl++] = short_id;
+	prog[n++] = INSN(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_0, BPF_REG_10, -57, 0);
+	bad_id = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, HELLO_SESSION_ID_SIZE);
+	to_listener[nl++] = bad_id;
+
+	n += lookup(&prog[n], steer.session_map, -56);
+	id_miss = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0);
+	to_listener[nl++] = id_miss;
+	selected = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JA, 0, 0, 0, 0);
+
+	/* any other record: the key of the address and port of the client */
+	for (i = 0; i < 4; i++)
+		prog[not_hello[i]].off = n - not_hello[i] - 1;
+
+	if (family == AF_INET) {
+		prog[n++] = INSN(BPF_ST | BPF_MEM | BPF_DW, BPF_REG_10, 0, -80, 0);
+		prog[n++] = INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -72, htonl(0xffff));
+		n += load_bytes(&prog[n], 12, -68, 4, 1);
+	} else {
+		n += load_bytes(&prog[n], 8, -80, 16, 1);
+	}
+	no_ip = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 0);
+	to_listener[nl++] = no_ip;
+
+	prog[n++] = INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -64, 0);
+	n += load_bytes(&prog[n], 0, -64, 2, 0);
+	no_port = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 0);
+	to_listener[nl++] = no_port;
+
+	n += lookup(&prog[n], steer.peer_map, -80);
+	peer_found = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0, 0);
+
+	n += lookup(&prog[n], steer.ip_map, -80);
+	ip_miss = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0);
+	to_listener[nl++] = ip_miss;
+
+	/* R0 points to the slot */
+	prog[selected].off = n - selected - 1;
+	prog[peer_found].off = n - peer_found - 1;
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_0, 0, 0);
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0);
+	n += load_map(&prog[n], BPF_REG_2, array_fd);
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0);
+	prog[n++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_select_reuseport);
+	selected = n;
+	prog[n++] = INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, 0);
+
+	/* the listener; a closed socket leaves its slot empty */
+	for (i = 0; i < nl; i++)
+		prog[to_listener[i]].off = n - to_listener[i] - 1;
+	prog[n++] = INSN(BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, -84, 0);
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0);
+	n += load_map(&prog[n], BPF_REG_2, array_fd);
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0);
+	prog[n++] = INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -84);
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0);
+	prog[n++] = INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_select_reuseport);
+
+	prog[selected].off = n - selected - 1;
+	prog[n++] = INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS);
+	prog[n++] = INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+	return n;
+}
+
+static int create_map(unsigned type, unsigned key_size, unsigned value_size, unsigned flags)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = key_size;
+	attr.value_size = value_size;
+	attr.max_entries = UDP_STEER_MAX_SLOTS;
+	attr.map_flags = flags;
+
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int load_prog(main_server_st *s, int family, int array_fd)
+{
+	struct bpf_insn prog[MAX_INSNS];
+	union bpf_attr attr;
+	static char log[4096];
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_REUSEPORT;
+	attr.insns = (uintptr_t)prog;
+	attr.insn_cnt = build_prog(prog, family, array_fd);
+	attr.license = (uintptr_t)"GPL";
+	attr.log_buf = (uintptr_t)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+
+	log[0] = 0;
+	fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd < 0 && log[0] != 0)
+		mslog(s, NULL, LOG_DEBUG, "UDP steering verifier: %s", log);
+
+	return fd;
+}
+
+static int map_update(int map_fd, const void *key, const void *value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)key;
+	attr.value = (uintptr_t)value;
+	attr.flags = BPF_ANY;
+
+	return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int map_lookup(int map_fd, const void *key, void *value)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)key;
+	attr.value = (uintptr_t)value;
+
+	return sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+static void map_delete(int map_fd, const void *key)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)key;
+
+	sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/* Makes the listener's SO_REUSEPORT group steered; the listener is
+ * put at slot 0 of its socket array */
+static int steer_listener(main_server_st *s, struct listener_st *l)
+{
+	int prog_fd, e, y = 0;
+	socklen_t y_len = sizeof(y);
+	uint32_t slot = 0;
+	uint64_t fd = l->fd;
+
+	/* e.g., a socket passed by systemd without ReusePort= */
+	if (getsockopt(l->fd, SOL_SOCKET, SO_REUSEPORT, &y, &y_len) < 0 || y == 0) {
+		mslog(s, NULL, LOG_INFO, "UDP listener is not SO_REUSEPORT; its datagrams are not steered");
+		return 0;
+	}
+
+	l->steer_fd = create_map(BPF_MAP_TYPE_REUSEPORT_SOCKARRAY, sizeof(uint32_t),
+				 sizeof(uint64_t), 0);
+	if (l->steer_fd < 0)
+		return -1;
+
+	if (map_update(l->steer_fd, &slot, &fd) < 0)
+		return -1;
+
+	prog_fd = load_prog(s, l->family, l->steer_fd);
+	if (prog_fd < 0)
+		return -1;
+
+	if (setsockopt(l->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF,
+		       &prog_fd, sizeof(prog_fd)) < 0) {
+		e = errno;
+		close(prog_fd);
+		errno = e;
+		return -1;
+	}
+
+	/* the group keeps the program */
+	close(prog_fd);
+	return 0;
+}
+
+int udp_steer_init(main_server_st *s)
+{
+	struct listener_st *ltmp = NULL;
+	unsigned i;
+	int e;
+
+	steer.session_map = create_map(BPF_MAP_TYPE_HASH, HELLO_SESSION_ID_SIZE,
+				       sizeof(uint32_t), BPF_F_NO_PREALLOC);
+	steer.peer_map = create_map(BPF_MAP_TYPE_HASH, sizeof(steer_peer_key_st),
+				    sizeof(uint32_t), BPF_F_NO_PREALLOC);
+	steer.ip_map = create_map(BPF_MAP_TYPE_HASH, 16,
+				  sizeof(uint32_t), BPF_F_NO_PREALLOC);
+	if (steer.session_map < 0 || steer.peer_map < 0 || steer.ip_map < 0) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not create the UDP steering maps: %s", strerror(e));
+		goto fail;
+	}
+
+	steer.free_slots = talloc_array(s->main_pool, uint32_t, UDP_STEER_MAX_SLOTS - 1);
+	if (steer.free_slots == NULL)
+		goto fail;
+
+	/* the lower slots are used first */
+	for (i = 0; i < UDP_STEER_MAX_SLOTS - 1; i++)
+		steer.free_slots[i] = UDP_STEER_MAX_SLOTS - 1 - i;
+	steer.free_count = UDP_STEER_MAX_SLOTS - 1;
+
+	list_for_each(&s->listen_list.head, ltmp, list) {
+		if (ltmp->sock_type != SOCK_TYPE_UDP || ltmp->fd == -1)
+			continue;
+
+		if (steer_listener(s, ltmp) < 0) {
+			e = errno;
+			mslog(s, NULL, LOG_ERR, "could not steer the UDP listener: %s", strerror(e));
+			goto fail;
+		}
+	}
+
+	return 0;
+
+ fail:
+	list_for_each(&s->listen_list.head, ltmp, list) {
+		if (ltmp->steer_fd >= 0)
+			setsockopt(ltmp->fd, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, NULL, 0);
+	}
+	udp_steer_deinit(s);
+	return -1;
+}
+
+/* The program stays attached to the groups, which are shared with the
+ * forked processes */
+void udp_steer_deinit(main_server_st *s)
+{
+	struct listener_st *ltmp = NULL;
+
+	list_for_each(&s->listen_list.head, ltmp, list) {
+		if (ltmp->steer_fd >= 0) {
+			close(ltmp->steer_fd);
+			ltmp->steer_fd = -1;
+		}
+	}
+
+	if (steer.session_map >= 0)
+		close(steer.session_map);
+	if (steer.peer_map >= 0)
+		close(steer.peer_map);
+	if (steer.ip_map >= 0)
+		close(steer.ip_map);
+	steer.session_map = steer.peer_map = steer.ip_map = -1;
+
+	talloc_free(steer.free_slots);
+	steer.free_slots = NULL;
+	steer.free_count = 0;
+}
+
+static void set_ip_key(uint8_t ip[16], const struct sockaddr_storage *addr)
+{
+	memset(ip, 0, 16);
+	if (addr->ss_family == AF_INET) {
+		ip[10] = ip[11] = 0xff;
+		memcpy(&ip[12], SA_IN_P(addr), 4);
+	} else {
+		memcpy(ip, SA_IN6_P(addr), 16);
+	}
+}
+
+static void set_peer_key(steer_peer_key_st *key, const struct sockaddr_storage *addr)
+{
+	memset(key, 0, sizeof(*key));
+	set_ip_key(key->ip, addr);
+	if (addr->ss_family == AF_INET)
+		key->port = SA_IN_PORT(addr);
+	else
+		key->port = SA_IN6_PORT(addr);
+}
+
+/* The datagrams from the address are steered to the session with a
+ * slot, if it is the single one from that address */
+static void update_ip(main_server_st *s, struct sockaddr_storage *addr, socklen_t addr_len)
+{
+	struct proc_st *proc;
+	uint8_t ip[16];
+
+	set_ip_key(ip, addr);
+
+	/* as in udp_dgram_recv() */
+	if (GETPCONFIG(s)->unix_conn_file)
+		proc = NULL;
+	else
+		proc = proc_search_single_ip(s, addr, addr_len);
+	if (proc != NULL && proc->udp_slot != 0)
+		map_update(steer.ip_map, ip, &proc->udp_slot);
+	else
+		map_delete(steer.ip_map, ip);
+}
+
+/* The address may have been taken over by a newer session, e.g., when
+ * a NAT reuses the port; its entry is left in place. */
+static void remove_peer(struct proc_st *proc)
+{
+	steer_peer_key_st key;
+	uint32_t slot;
+
+	if (proc->udp_peer_len == 0)
+		return;
+
+	set_peer_key(&key, &proc->udp_peer);
+	if (map_lookup(steer.peer_map, &key, &slot) == 0 &&
+	    slot == proc->udp_slot)
+		map_delete(steer.peer_map, &key);
+	proc->udp_peer_len = 0;
+}
+
+int udp_steer_socket(main_server_st *s, struct proc_st *proc,
+		     struct listener_st *listener, udp_dgram_st *d)
+{
+	steer_peer_key_st key;
+	uint64_t fd;
+	int sfd, y, e;
+	char tbuf[64];
+
+	if (listener == NULL || listener->steer_fd < 0)
+		return -1;
+
+	if (proc->udp_slot == 0) {
+		if (steer.free_count == 0)
+			return -1;
+		proc->udp_slot = steer.free_slots[--steer.free_count];
+	}
+
+	sfd = socket(listener->family, SOCK_DGRAM, listener->protocol);
+	if (sfd < 0) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "new UDP socket failed: %s",
+		      strerror(e));
+		return -1;
+	}
+
+	set_worker_udp_opts(s, sfd, listener->family);
+
+	/* join the listener's group */
+	y = 1;
+	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (const void *) &y, sizeof(y)) < 0 ||
+	    bind(sfd, (struct sockaddr *)&listener->addr, listener->addr_len) < 0) {
+		e = errno;
+		mslog(s, proc, LOG_INFO, "bind UDP to %s: %s",
+		      human_addr((struct sockaddr*)&listener->addr, listener->addr_len, tbuf, sizeof(tbuf)),
+		      strerror(e));
+		goto fail;
+	}
+
+	fd = sfd;
+	if (map_update(listener->steer_fd, &proc->udp_slot, &fd) < 0) {
+		e = errno;
+		mslog(s, proc, LOG_INFO, "could not add the UDP socket to the steering map: %s",
+		      strerror(e));
+		goto fail;
+	}
+
+	/* a session restarted on another group leaves its old slot */
+	if (proc->udp_steer_fd != -1 && proc->udp_steer_fd != listener->steer_fd)
+		map_delete(proc->udp_steer_fd, &proc->udp_slot);
+	proc->udp_steer_fd = listener->steer_fd;
+
+	if (d->hello_session_id && d->session_id_size == HELLO_SESSION_ID_SIZE)
+		map_update(steer.session_map, d->session_id, &proc->udp_slot);
+
+	remove_peer(proc);
+	set_peer_key(&key, &d->cli_addr);
+	if (map_update(steer.peer_map, &key, &proc->udp_slot) == 0) {
+		memcpy(&proc->udp_peer, &d->cli_addr, d->cli_addr_size);
+		proc->udp_peer_len = d->cli_addr_size;
+	}
+
+	update_ip(s, &d->cli_addr, d->cli_addr_size);
+
+	return sfd;
+
+ fail:
+	close(sfd);
+	return -1;
+}
+
+void udp_steer_remove(main_server_st *s, struct proc_st *proc)
+{
+	uint32_t slot;
+
+	if (proc->udp_slot == 0)
+		return;
+
+	if (proc->dtls_session_id_size == HELLO_SESSION_ID_SIZE &&
+	    map_lookup(steer.session_map, proc->dtls_session_id, &slot) == 0 &&
+	    slot == proc->udp_slot)
+		map_delete(steer.session_map, proc->dtls_session_id);
+
+	if (proc->udp_peer_len > 0) {
+		/* the address may now be of a single session */
+		update_ip(s, &proc->udp_peer, proc->udp_peer_len);
+
+		remove_peer(proc);
+	}
+
+	if (proc->udp_steer_fd != -1)
+		map_delete(proc->udp_steer_fd, &proc->udp_slot);
+	proc->udp_steer_fd = -1;
+
+	steer.free_slots[steer.free_count++] = proc->udp_slot;
+	proc->udp_slot = 0;
+}
+#else
+int udp_steer_init(main_server_st *s)
+{
+	mslog(s, NULL, LOG_ERR, "UDP steering is not supported on this system");
+	return -1;
+}
+
+void udp_steer_deinit(main_server_st *s)
+{
+}
+
+int udp_steer_socket(main_server_st *s, struct proc_st *proc,
+		     struct listener_st *listener, udp_dgram_st *d)
+{
+	return -1;
+}
+
+void udp_steer_remove(main_server_st *s, struct proc_st *proc)
+{
+}
+#endif
@@ -42,9 +42,11 @@
 #include <str.h>
 #include <tun.h>
 #include <main.h>
+#include <main-fw.h>
 #include <main-ctl.h>
 #include <ip-lease.h>
 #include <script-list.h>
+#include <script-runner.h>
 #include <ccan/list/list.h>
 
 #define OCSERV_FW_SCRIPT "/usr/bin/ocserv-fw"
@@ -53,7 +55,7 @@
 			ret = str_append_str(str, val); \
 			if (ret < 0) { \
 				mslog(s, proc, LOG_ERR, "could not append value to environment\n"); \
-				exit(1); \
+				return -1; \
 			}
 
 typedef enum script_type_t {
@@ -64,7 +66,25 @@ typedef enum script_type_t {
 
 static const char *type_name[] = {"up", "host-update", "down"};
 
-static void export_fw_info(main_server_st *s, struct proc_st* proc)
+/* Adds NAME=value to the environment of the script in @msg */
+static int env_set(ScriptRunMsg *msg, const char *name, const char *value)
+{
+	char **env;
+
+	env = talloc_realloc(msg, msg->env, char *, msg->n_env + 1);
+	if (env == NULL)
+		return -1;
+	msg->env = env;
+
+	env[msg->n_env] = talloc_asprintf(msg, "%s=%s", name, value);
+	if (env[msg->n_env] == NULL)
+		return -1;
+	msg->n_env++;
+
+	return 0;
+}
+
+static int export_fw_info(main_server_st *s, struct proc_st* proc, ScriptRunMsg *msg)
 {
 	str_st str4;
 	str_st str6;
@@ -72,9 +92,9 @@ static void export_fw_info(main_server_st *s, struct proc_st* proc)
 	unsigned i, negate = 0;
 	int ret;
 
-	str_init(&str4, proc);
-	str_init(&str6, proc);
-	str_init(&str_common, proc);
+	str_init(&str4, msg);
+	str_init(&str6, msg);
+	str_init(&str_common, msg);
 
 	/* We use different export strings for IPv4 and IPv6 to ease handling
 	 * with legacy software such as iptables and ip6tables. */
@@ -93,19 +113,19 @@ static void export_fw_info(main_server_st *s, struct proc_st* proc)
 		}
 	}
 
-	if (str4.length > 0 && setenv("OCSERV_ROUTES4", (char*)str4.data, 1) == -1) {
+	if (str4.length > 0 && env_set(msg, "OCSERV_ROUTES4", (char*)str4.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export routes\n");
-		exit(1);
+		return -1;
 	}
 
-	if (str6.length > 0 && setenv("OCSERV_ROUTES6", (char*)str6.data, 1) == -1) {
+	if (str6.length > 0 && env_set(msg, "OCSERV_ROUTES6", (char*)str6.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export routes\n");
-		exit(1);
+		return -1;
 	}
 
-	if (str_common.length > 0 && setenv("OCSERV_ROUTES", (char*)str_common.data, 1) == -1) {
+	if (str_common.length > 0 && env_set(msg, "OCSERV_ROUTES", (char*)str_common.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export routes\n");
-		exit(1);
+		return -1;
 	}
 
 	/* export the No-routes */
@@ -128,25 +148,25 @@ static void export_fw_info(main_server_st *s, struct proc_st* proc)
 		}
 	}
 
-	if (str4.length > 0 && setenv("OCSERV_NO_ROUTES4", (char*)str4.data, 1) == -1) {
+	if (str4.length > 0 && env_set(msg, "OCSERV_NO_ROUTES4", (char*)str4.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export no-routes\n");
-		exit(1);
+		return -1;
 	}
 
-	if (str6.length > 0 && setenv("OCSERV_NO_ROUTES6", (char*)str6.data, 1) == -1) {
+	if (str6.length > 0 && env_set(msg, "OCSERV_NO_ROUTES6", (char*)str6.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export no-routes\n");
-		exit(1);
+		return -1;
 	}
 
-	if (str_common.length > 0 && setenv("OCSERV_NO_ROUTES", (char*)str_common.data, 1) == -1) {
+	if (str_common.length > 0 && env_set(msg, "OCSERV_NO_ROUTES", (char*)str_common.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export no-routes\n");
-		exit(1);
+		return -1;
 	}
 
 	if (proc->config->restrict_user_to_routes) {
-		if (setenv("OCSERV_RESTRICT_TO_ROUTES", "1", 1) == -1) {
+		if (env_set(msg, "OCSERV_RESTRICT_TO_ROUTES", "1") < 0) {
 			mslog(s, proc, LOG_ERR, "could not export OCSERV_RESTRICT_TO_ROUTES\n");
-			exit(1);
+			return -1;
 		}
 	}
 	/* export the DNS servers */
@@ -170,19 +190,19 @@ static void export_fw_info(main_server_st *s, struct proc_st* proc)
 		}
 	}
 
-	if (str4.length > 0 && setenv("OCSERV_DNS4", (char*)str4.data, 1) == -1) {
+	if (str4.length > 0 && env_set(msg, "OCSERV_DNS4", (char*)str4.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export DNS servers\n");
-		exit(1);
+		return -1;
 	}
 
-	if (str6.length > 0 && setenv("OCSERV_DNS6", (char*)str6.data, 1) == -1) {
+	if (str6.length > 0 && env_set(msg, "OCSERV_DNS6", (char*)str6.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export DNS servers\n");
-		exit(1);
+		return -1;
 	}
 
-	if (str_common.length > 0 && setenv("OCSERV_DNS", (char*)str_common.data, 1) == -1) {
+	if (str_common.length > 0 && env_set(msg, "OCSERV_DNS", (char*)str_common.data) < 0) {
 		mslog(s, proc, LOG_ERR, "could not export DNS servers\n");
-		exit(1);
+		return -1;
 	}
 
 	str_clear(&str4);
@@ -223,34 +243,46 @@ static void export_fw_info(main_server_st *s, struct proc_st* proc)
 
 			if (ret < 0) {
 				mslog(s, proc, LOG_ERR, "could not append value to environment\n");
-				exit(1);
+				return -1;
 			}
 		}
 	}
 
 	if (str_common.length > 0) {
 		if (negate) {
-			if (setenv("OCSERV_DENY_PORTS", (char*)str_common.data, 1) == -1) {
+			if (env_set(msg, "OCSERV_DENY_PORTS", (char*)str_common.data) < 0) {
 				mslog(s, proc, LOG_ERR, "could not export DENY_PORTS\n");
-				exit(1);
+				return -1;
 			}
 		} else {
-			if (setenv("OCSERV_ALLOW_PORTS", (char*)str_common.data, 1) == -1) {
+			if (env_set(msg, "OCSERV_ALLOW_PORTS", (char*)str_common.data) < 0) {
 				mslog(s, proc, LOG_ERR, "could not export ALLOW_PORTS\n");
-				exit(1);
+				return -1;
 			}
 		}
 	}
 
 	str_clear(&str_common);
+	return 0;
 }
 
+#define SET_ENV(name, val) \
+			if (env_set(msg, name, val) < 0) { \
+				mslog(s, proc, LOG_ERR, "could not append value to environment\n"); \
+				goto fail; \
+			}
+
 static
 int call_script(main_server_st *s, struct proc_st* proc, script_type_t type)
 {
-pid_t pid;
 int ret;
 const char* script, *next_script = NULL;
+char real[64] = "";
+char local[64] = "";
+char remote[64] = "";
+struct script_wait_st *stmp;
+ScriptRunMsg *msg;
+void *pool;
 
 	if (type == SCRIPT_CONNECT)
 		script = GETCONFIG(s)->connect_script;
@@ -259,7 +291,8 @@ const char* script, *next_script = NULL;
 	else
 		script = GETCONFIG(s)->disconnect_script;
 
-	if (type != SCRIPT_HOST_UPDATE) {
+	/* unless the rules are applied by ocserv */
+	if (type != SCRIPT_HOST_UPDATE && proc->applied_fw == 0) {
 		if (proc->config->restrict_user_to_routes || proc->config->n_fw_ports > 0) {
 			next_script = script;
 			script = OCSERV_FW_SCRIPT;
@@ -269,132 +302,142 @@ const char* script, *next_script = NULL;
 	if (script == NULL)
 		return 0;
 
-	pid = fork();
-	if (pid == 0) {
-		char real[64] = "";
-		char local[64] = "";
-		char remote[64] = "";
+	/* the script is run by the script runner; we only prepare its environment */
+	pool = talloc_new(s);
+	if (pool == NULL)
+		return -1;
 
-		sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
+	msg = talloc(pool, ScriptRunMsg);
+	if (msg == NULL)
+		goto fail;
+	script_run_msg__init(msg);
 
-		snprintf(real, sizeof(real), "%u", (unsigned)proc->pid);
-		setenv("ID", real, 1);
+	msg->script = talloc_strdup(msg, script);
+	if (msg->script == NULL)
+		goto fail;
 
-		if (proc->remote_addr_len > 0) {
-			if ((ret=getnameinfo((void*)&proc->remote_addr, proc->remote_addr_len, real, sizeof(real), NULL, 0, NI_NUMERICHOST)) != 0) {
-				mslog(s, proc, LOG_DEBUG, "cannot determine peer address: %s; script failed", gai_strerror(ret));
-				exit(1);
-			}
-			setenv("IP_REAL", real, 1);
-		}
+	snprintf(real, sizeof(real), "%u", (unsigned)PROC_ID(proc));
+	SET_ENV("ID", real);
 
-		if (proc->our_addr_len > 0) {
-			if ((ret=getnameinfo((void*)&proc->our_addr, proc->our_addr_len, real, sizeof(real), NULL, 0, NI_NUMERICHOST)) != 0) {
-				mslog(s, proc, LOG_DEBUG, "cannot determine our address: %s", gai_strerror(ret));
-			} else {
-				setenv("IP_REAL_LOCAL", real, 1);
-			}
+	if (proc->remote_addr_len > 0) {
+		if ((ret=getnameinfo((void*)&proc->remote_addr, proc->remote_addr_len, real, sizeof(real), NULL, 0, NI_NUMERICHOST)) != 0) {
+			mslog(s, proc, LOG_DEBUG, "cannot determine peer address: %s; script failed", gai_strerror(ret));
+			goto fail;
 		}
+		SET_ENV("IP_REAL", real);
+	}
 
-		if (proc->ipv4 != NULL || proc->ipv6 != NULL) {
-			if (proc->ipv4 && proc->ipv4->lip_len > 0) {
-				if (getnameinfo((void*)&proc->ipv4->lip, proc->ipv4->lip_len, local, sizeof(local), NULL, 0, NI_NUMERICHOST) != 0) {
-					mslog(s, proc, LOG_DEBUG, "cannot determine local VPN address; script failed");
-					exit(1);
-				}
-				setenv("IP_LOCAL", local, 1);
-			}
+	if (proc->our_addr_len > 0) {
+		if ((ret=getnameinfo((void*)&proc->our_addr, proc->our_addr_len, real, sizeof(real), NULL, 0, NI_NUMERICHOST)) != 0) {
+			mslog(s, proc, LOG_DEBUG, "cannot determine our address: %s", gai_strerror(ret));
+		} else {
+			SET_ENV("IP_REAL_LOCAL", real);
+		}
+	}
 
-			if (proc->ipv6 && proc->ipv6->lip_len > 0) {
-				if (getnameinfo((void*)&proc->ipv6->lip, proc->ipv6->lip_len, local, sizeof(local), NULL, 0, NI_NUMERICHOST) != 0) {
-					mslog(s, proc, LOG_DEBUG, "cannot determine local VPN PtP address; script failed");
-					exit(1);
-				}
-				if (local[0] == 0)
-					setenv("IP_LOCAL", local, 1);
-				setenv("IPV6_LOCAL", local, 1);
+	if (proc->ipv4 != NULL || proc->ipv6 != NULL) {
+		if (proc->ipv4 && proc->ipv4->lip_len > 0) {
+			if (getnameinfo((void*)&proc->ipv4->lip, proc->ipv4->lip_len, local, sizeof(local), NULL, 0, NI_NUMERICHOST) != 0) {
+				mslog(s, proc, LOG_DEBUG, "cannot determine local VPN address; script failed");
+				goto fail;
 			}
+			SET_ENV("IP_LOCAL", local);
+		}
 
-			if (proc->ipv4 && proc->ipv4->rip_len > 0) {
-				if (getnameinfo((void*)&proc->ipv4->rip, proc->ipv4->rip_len, remote, sizeof(remote), NULL, 0, NI_NUMERICHOST) != 0) {
-					mslog(s, proc, LOG_DEBUG, "cannot determine local VPN address; script failed");
-					exit(1);
-				}
-				setenv("IP_REMOTE", remote, 1);
-			}
-			if (proc->ipv6 && proc->ipv6->rip_len > 0) {
-				if (getnameinfo((void*)&proc->ipv6->rip, proc->ipv6->rip_len, remote, sizeof(remote), NULL, 0, NI_NUMERICHOST) != 0) {
-					mslog(s, proc, LOG_DEBUG, "cannot determine local VPN PtP address; script failed");
-					exit(1);
-				}
-				if (remote[0] == 0)
-					setenv("IP_REMOTE", remote, 1);
-				setenv("IPV6_REMOTE", remote, 1);
-
-				snprintf(remote, sizeof(remote), "%u", proc->ipv6->prefix);
-				setenv("IPV6_PREFIX", remote, 1);
+		if (proc->ipv6 && proc->ipv6->lip_len > 0) {
+			if (getnameinfo((void*)&proc->ipv6->lip, proc->ipv6->lip_len, local, sizeof(local), NULL, 0, NI_NUMERICHOST) != 0) {
+				mslog(s, proc, LOG_DEBUG, "cannot determine local VPN PtP address; script failed");
+				goto fail;
 			}
+			if (local[0] == 0)
+				SET_ENV("IP_LOCAL", local);
+			SET_ENV("IPV6_LOCAL", local);
 		}
 
-		if (proc->vhost)
-			setenv("VHOST", VHOSTNAME(proc->vhost), 1);
-		setenv("USERNAME", proc->username, 1);
-		setenv("GROUPNAME", proc->groupname, 1);
-		setenv("HOSTNAME", proc->hostname, 1);
-		setenv("DEVICE", proc->tun_lease.name, 1);
-		if (type == SCRIPT_CONNECT) {
-			setenv("REASON", "connect", 1);
-		} else if (type == SCRIPT_HOST_UPDATE) {
-			setenv("REASON", "host-update", 1);
-		} else if (type == SCRIPT_DISCONNECT) {
-			/* use remote as temp buffer */
-			snprintf(remote, sizeof(remote), "%lu", (unsigned long)proc->bytes_in);
-			setenv("STATS_BYTES_IN", remote, 1);
-			snprintf(remote, sizeof(remote), "%lu", (unsigned long)proc->bytes_out);
-			setenv("STATS_BYTES_OUT", remote, 1);
-			if (proc->conn_time > 0) {
-				snprintf(remote, sizeof(remote), "%lu", (unsigned long)(time(0)-proc->conn_time));
-				setenv("STATS_DURATION", remote, 1);
+		if (proc->ipv4 && proc->ipv4->rip_len > 0) {
+			if (getnameinfo((void*)&proc->ipv4->rip, proc->ipv4->rip_len, remote, sizeof(remote), NULL, 0, NI_NUMERICHOST) != 0) {
+				mslog(s, proc, LOG_DEBUG, "cannot determine local VPN address; script failed");
+				goto fail;
 			}
-			setenv("REASON", "disconnect", 1);
+			SET_ENV("IP_REMOTE", remote);
 		}
+		if (proc->ipv6 && proc->ipv6->rip_len > 0) {
+			if (getnameinfo((void*)&proc->ipv6->rip, proc->ipv6->rip_len, remote, sizeof(remote), NULL, 0, NI_NUMERICHOST) != 0) {
+				mslog(s, proc, LOG_DEBUG, "cannot determine local VPN PtP address; script failed");
+				goto fail;
+			}
+			if (remote[0] == 0)
+				SET_ENV("IP_REMOTE", remote);
+			SET_ENV("IPV6_REMOTE", remote);
 
-		/* export DNS and route info */
-		export_fw_info(s, proc);
-
-		/* set stdout to be stderr to avoid confusing scripts - note we have stdout closed */
-		if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
-			int e = errno;
-			mslog(s, proc, LOG_INFO, "cannot dup2(STDERR_FILENO, STDOUT_FILENO): %s", strerror(e));
+			snprintf(remote, sizeof(remote), "%u", proc->ipv6->prefix);
+			SET_ENV("IPV6_PREFIX", remote);
 		}
+	}
 
-		if (next_script) {
-			setenv("OCSERV_NEXT_SCRIPT", next_script, 1);
-			mslog(s, proc, LOG_DEBUG, "executing script %s %s (next: %s)", type_name[type], script, next_script);
-		} else
-			mslog(s, proc, LOG_DEBUG, "executing script %s %s", type_name[type], script);
+	if (proc->vhost)
+		SET_ENV("VHOST", VHOSTNAME(proc->vhost));
+	SET_ENV("USERNAME", proc->username);
+	SET_ENV("GROUPNAME", proc->groupname);
+	SET_ENV("HOSTNAME", proc->hostname);
+	SET_ENV("DEVICE", proc->tun_lease.name);
+	if (type == SCRIPT_CONNECT) {
+		SET_ENV("REASON", "connect");
+	} else if (type == SCRIPT_HOST_UPDATE) {
+		SET_ENV("REASON", "host-update");
+	} else if (type == SCRIPT_DISCONNECT) {
+		/* use remote as temp buffer */
+		snprintf(remote, sizeof(remote), "%lu", (unsigned long)proc->bytes_in);
+		SET_ENV("STATS_BYTES_IN", remote);
+		snprintf(remote, sizeof(remote), "%lu", (unsigned long)proc->bytes_out);
+		SET_ENV("STATS_BYTES_OUT", remote);
+		if (proc->conn_time > 0) {
+			snprintf(remote, sizeof(remote), "%lu", (unsigned long)(time(0)-proc->conn_time));
+			SET_ENV("STATS_DURATION", remote);
+		}
+		SET_ENV("REASON", "disconnect");
+	}
 
-		ret = execl(script, script, NULL);
-		if (ret == -1) {
-			mslog(s, proc, LOG_ERR, "Could not execute script %s", script);
-			exit(1);
+	/* export DNS and route info */
+	if (export_fw_info(s, proc, msg) < 0)
+		goto fail;
+
+	if (next_script) {
+		SET_ENV("OCSERV_NEXT_SCRIPT", next_script);
+		mslog(s, proc, LOG_DEBUG, "executing script %s %s (next: %s)", type_name[type], script, next_script);
+	} else
+		mslog(s, proc, LOG_DEBUG, "executing script %s %s", type_name[type], script);
+
+	if (type == SCRIPT_DISCONNECT) {
+		/* we were called during the connect script being run;
+		 * the disconnect script is run once it exits successfully */
+		stmp = find_script_wait(s, proc);
+		if (stmp != NULL) {
+			talloc_steal(stmp, pool);
+			stmp->next = msg;
+			return 0;
 		}
-			
-		exit(77);
-	} else if (pid == -1) {
-		mslog(s, proc, LOG_ERR, "Could not fork()");
-		return -1;
 	}
-	
+
+	ret = script_runner_run(s, msg);
+	if (ret < 0) {
+		mslog(s, proc, LOG_ERR, "could not execute script %s", script);
+		goto fail;
+	}
+
 	if (type == SCRIPT_CONNECT) {
-		add_to_script_list(s, pid, proc);
-		return ERR_WAIT_FOR_SCRIPT;
+		add_to_script_list(s, msg->id, proc);
+		ret = ERR_WAIT_FOR_SCRIPT;
 	} else {
-		/* we don't add a specific handler for SCRIPT_CONNECT and SCRIPT_HOST_UPDATE
-		 * childs. We rely on libev's child reaping of unwatched children.
-		 */
-		return 0;
+		ret = 0;
 	}
+
+	talloc_free(pool);
+	return ret;
+
+ fail:
+	talloc_free(pool);
+	return -1;
 }
 
 static void
@@ -471,6 +514,10 @@ int user_connected(main_server_st *s, struct proc_st* proc)
 {
 int ret;
 
+	ret = fw_apply(s, proc);
+	if (ret < 0)
+		return ret;
+
 	ctl_handler_notify(s,proc, 1);
 	add_utmp_entry(s, proc);
 
@@ -119,6 +119,7 @@ int handle_script_exit(main_server_st *s, struct proc_st *proc, int code)
 
 		proc->status = PS_AUTH_COMPLETED;
 		mslog(s, proc, LOG_INFO, "user logged in");
+		lat_hist_add(&s->stats.latency[LAT_CONNECT], lat_hist_elapsed(&proc->auth_start));
 	} else {
 		mslog(s, proc, LOG_INFO,
 		      "failed authentication attempt for user '%s'",
@@ -146,11 +147,57 @@ int handle_script_exit(main_server_st *s, struct proc_st *proc, int code)
 	return ret;
 }
 
+/* Sets up the user's connection once its addresses are known to be
+ * available */
+static int connect_user(main_server_st * s, struct proc_st *proc)
+{
+	int ret;
+	const char *group;
+	struct timespec start;
+
+	lat_hist_add(&s->stats.latency[LAT_LEASE], lat_hist_elapsed(&proc->lease_start));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = open_tun(s, proc);
+	if (ret < 0) {
+		return -1;
+	}
+	lat_hist_add(&s->stats.latency[LAT_TUN], lat_hist_elapsed(&start));
+
+	/* the leases are final once the device is set up */
+	if (proc_table_add_vpn_ip(s, proc) < 0) {
+		mslog(s, proc, LOG_ERR, "failed to add the VPN addresses to proc hash");
+		return -1;
+	}
+
+	if (proc->groupname[0] == 0)
+		group = "[unknown]";
+	else
+		group = proc->groupname;
+
+	mslog(s, proc, LOG_DEBUG,
+	      "user of group '%s' authenticated (using cookie)",
+	      group);
+
+	/* do scripts and utmp */
+	ret = user_connected(s, proc);
+	if (ret < 0 && ret != ERR_WAIT_FOR_SCRIPT) {
+		mslog(s, proc, LOG_INFO, "user disconnected due to script");
+	}
+
+	return ret;
+}
+
 /* This is the function after which proc is populated */
 static int accept_user(main_server_st * s, struct proc_st *proc, unsigned cmd)
 {
 	int ret;
-	const char *group;
+
+	if (cmd != AUTH_COOKIE_REQ) {
+		mslog(s, proc, LOG_INFO,
+		      "user authenticated but from unknown state! rejecting.");
+		return ERR_BAD_COMMAND;
+	}
 
 	/* check for multiple connections */
 	ret = check_multiple_users(s, proc);
@@ -161,31 +208,63 @@ static int accept_user(main_server_st * s, struct proc_st *proc, unsigned cmd)
 		return ret;
 	}
 
-	ret = open_tun(s, proc);
+	clock_gettime(CLOCK_MONOTONIC, &proc->lease_start);
+	ret = get_ip_leases(s, proc);
 	if (ret < 0) {
 		return -1;
 	}
 
-	if (proc->groupname[0] == 0)
-		group = "[unknown]";
+	/* the user is connected by handle_lease_probe_res() if the
+	 * addresses need to be checked */
+	ret = probe_ip_leases(s, proc);
+	if (ret == ERR_WAIT_FOR_PING)
+		return ret;
+	else if (ret < 0)
+		return -1;
+
+	return connect_user(s, proc);
+}
+
+/* Completes the authentication with the result of accept_user() or
+ * connect_user(). */
+static int finish_user_auth(main_server_st *s, struct proc_st *proc, int ret)
+{
+	if (ret < 0)
+		proc->status = PS_AUTH_FAILED;
 	else
-		group = proc->groupname;
+		proc->status = PS_AUTH_COMPLETED;
 
-	if (cmd == AUTH_COOKIE_REQ) {
-		mslog(s, proc, LOG_DEBUG,
-		      "user of group '%s' authenticated (using cookie)",
-		      group);
+	if (ret == ERR_WAIT_FOR_SCRIPT) {
+		/* we will wait for script termination to send our reply.
+		 * The notification of peer will be done in handle_script_exit().
+		 */
+		ret = 0;
 	} else {
-		mslog(s, proc, LOG_INFO,
-		      "user of group '%s' authenticated but from unknown state! rejecting.",
-		      group);
-		return ERR_BAD_COMMAND;
+		/* no script was called. Handle it as a successful script call. */
+		ret = handle_script_exit(s, proc, ret);
+		if (ret < 0)
+			proc->status = PS_AUTH_FAILED;
 	}
 
-	/* do scripts and utmp */
-	ret = user_connected(s, proc);
-	if (ret < 0 && ret != ERR_WAIT_FOR_SCRIPT) {
-		mslog(s, proc, LOG_INFO, "user disconnected due to script");
+	return ret;
+}
+
+/* Called once the addresses leased to a user were checked; @result
+ * is the return value of probe_ip_leases(). On failure to notify the
+ * worker the user is removed. */
+int handle_lease_probe_res(main_server_st *s, struct proc_st *proc, int result)
+{
+	int ret;
+
+	if (result == 0)
+		ret = connect_user(s, proc);
+	else
+		ret = result;
+
+	ret = finish_user_auth(s, proc, ret);
+	if (ret < 0) {
+		/* takes care of free */
+		remove_proc(s, proc, RPROC_KILL);
 	}
 
 	return ret;
@@ -204,34 +283,20 @@ static int handle_cookie_auth_res(main_server_st *s, struct proc_st *proc,
 
 	if (result == 0) {
 		ret = accept_user(s, proc, cmd);
-		if (ret < 0) {
-			proc->status = PS_AUTH_FAILED;
-			goto finished;
+		if (ret == ERR_WAIT_FOR_PING) {
+			/* continued in handle_lease_probe_res(); the
+			 * worker's commands are not accepted meanwhile */
+			proc->status = PS_AUTH_INIT;
+			return 0;
 		}
-		proc->status = PS_AUTH_COMPLETED;
 	} else if (result < 0) {
-		proc->status = PS_AUTH_FAILED;
 		ret = result;
 	} else {
-		proc->status = PS_AUTH_FAILED;
 		mslog(s, proc, LOG_ERR, "unexpected auth result: %d\n", result);
 		ret = ERR_BAD_COMMAND;
 	}
 
- finished:
-	if (ret == ERR_WAIT_FOR_SCRIPT) {
-		/* we will wait for script termination to send our reply.
-		 * The notification of peer will be done in handle_script_exit().
-		 */
-		ret = 0;
-	} else {
-		/* no script was called. Handle it as a successful script call. */
-		ret = handle_script_exit(s, proc, ret);
-		if (ret < 0)
-			proc->status = PS_AUTH_FAILED;
-	}
-
-	return ret;
+	return finish_user_auth(s, proc, ret);
 }
 
 int handle_worker_commands(main_server_st * s, struct proc_st *proc)
@@ -368,6 +433,11 @@ int handle_worker_commands(main_server_st * s, struct proc_st *proc)
 				snprintf(proc->user_agent, sizeof(proc->user_agent), "%s / %s",
 					 tmsg->user_agent, tmsg->device_type);
 
+			if (tmsg->has_tls_handshake_us)
+				lat_hist_add(&s->stats.latency[LAT_TLS_HANDSHAKE], tmsg->tls_handshake_us);
+			if (tmsg->has_dtls_handshake_us)
+				lat_hist_add(&s->stats.latency[LAT_DTLS_HANDSHAKE], tmsg->dtls_handshake_us);
+
 			if (tmsg->hostname) {
 				strlcpy(proc->hostname, tmsg->hostname,
 					 sizeof(proc->hostname));
@@ -382,7 +452,7 @@ int handle_worker_commands(main_server_st * s, struct proc_st *proc)
 					/* If the address is in the BAN list, terminate it */
 					if (check_if_banned(s, &proc->remote_addr, proc->remote_addr_len) != 0) {
 						if (proc->pid != -1 && proc->pid != 0)
-							kill(proc->pid, SIGTERM);
+							kill_proc(s, proc);
 					}
 				}
 
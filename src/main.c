@@ -39,6 +39,11 @@
 # include <malloc.h> /* for malloc_trim() */
 #endif
 #include <script-list.h>
+#include <script-runner.h>
+#include <acceptor-shard.h>
+#ifdef __linux__
+# include <linux/filter.h>
+#endif
 
 #include <gnutls/x509.h>
 #include <gnutls/crypto.h>
@@ -56,11 +61,14 @@
 #include <main-ctl.h>
 #include <main-ban.h>
 #include <route-add.h>
+#include <main-fw.h>
+#include <main-metrics.h>
 #include <worker.h>
 #include <proc-search.h>
 #include <tun.h>
 #include <grp.h>
 #include <ip-lease.h>
+#include <icmp-ping.h>
 #include <ccan/list/list.h>
 
 #ifdef HAVE_GSSAPI
@@ -83,6 +91,7 @@ struct ev_loop *loop = NULL;
 ev_io ctl_watcher;
 ev_io sec_mod_watcher;
 ev_timer maintenance_watcher;
+ev_timer expire_watcher;
 ev_signal maintenance_sig_watcher;
 ev_signal term_sig_watcher;
 ev_signal int_sig_watcher;
@@ -91,12 +100,14 @@ ev_child child_watcher;
 
 static void add_listener(void *pool, struct listen_list_st *list,
 	int fd, int family, int socktype, int protocol,
-	struct sockaddr* addr, socklen_t addr_len)
+	struct sockaddr* addr, socklen_t addr_len, int shard)
 {
 	struct listener_st *tmp;
 
 	tmp = talloc_zero(pool, struct listener_st);
 	tmp->fd = fd;
+	tmp->shard = shard;
+	tmp->steer_fd = -1;
 	tmp->family = family;
 	tmp->sock_type = socktype;
 	tmp->protocol = protocol;
@@ -146,15 +157,61 @@ static void set_common_socket_options(int fd)
 	set_cloexec_flag (fd, 1);
 }
 
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+/* Steers the connections and the datagrams of a client to the same
+ * socket of each SO_REUSEPORT group, i.e., to the same acceptor shard,
+ * by a hash of its IPv4 address or of its IPv6 /64. The sockets of
+ * a group are numbered in the order they were bound.
+ */
+static int attach_shard_steering(int fd, int family, unsigned shards)
+{
+	struct sock_filter ipv4[] = {
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + 12),
+		BPF_STMT(BPF_ALU|BPF_MUL|BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 16),
+		BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, shards),
+		BPF_STMT(BPF_RET|BPF_A, 0)
+	};
+	struct sock_filter ipv6[] = {
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + 8),
+		BPF_STMT(BPF_MISC|BPF_TAX, 0),
+		BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + 12),
+		BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0),
+		BPF_STMT(BPF_ALU|BPF_MUL|BPF_K, 0x9e3779b1),
+		BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 16),
+		BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, shards),
+		BPF_STMT(BPF_RET|BPF_A, 0)
+	};
+	struct sock_fprog prog;
+
+	if (family == AF_INET) {
+		prog.len = sizeof(ipv4)/sizeof(ipv4[0]);
+		prog.filter = ipv4;
+	} else {
+		prog.len = sizeof(ipv6)/sizeof(ipv6[0]);
+		prog.filter = ipv6;
+	}
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+#else
+# define attach_shard_steering(fd, family, shards) -1
+#endif
+
+/* Listens on the addresses in res; with acceptor-shards set, a socket
+ * is created for each shard on each address. */
 static 
 int _listen_ports(void *pool, struct perm_cfg_st* config, 
 		struct addrinfo *res, struct listen_list_st *list)
 {
 	struct addrinfo *ptr;
 	int s, y;
+	unsigned i, n;
 	const char* type = NULL;
 	char buf[512];
 
+	n = config->acceptor_shards > 0 ? config->acceptor_shards : 1;
+
 	for (ptr = res; ptr != NULL; ptr = ptr->ai_next) {
 		if (ptr->ai_family != AF_INET && ptr->ai_family != AF_INET6)
 			continue;
@@ -171,53 +228,75 @@ int _listen_ports(void *pool, struct perm_cfg_st* config,
 				type, human_addr(ptr->ai_addr, ptr->ai_addrlen,
 					   buf, sizeof(buf)));
 
-		s = socket(ptr->ai_family, ptr->ai_socktype,
-			   ptr->ai_protocol);
-		if (s < 0) {
-			perror("socket() failed");
-			continue;
-		}
+		for (i = 0; i < n; i++) {
+			s = socket(ptr->ai_family, ptr->ai_socktype,
+				   ptr->ai_protocol);
+			if (s < 0) {
+				perror("socket() failed");
+				break;
+			}
 
 #if defined(IPV6_V6ONLY)
-		if (ptr->ai_family == AF_INET6) {
+			if (ptr->ai_family == AF_INET6) {
+				y = 1;
+				/* avoid listen on ipv6 addresses failing
+				 * because already listening on ipv4 addresses: */
+				setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY,
+					   (const void *) &y, sizeof(y));
+			}
+#endif
+
 			y = 1;
-			/* avoid listen on ipv6 addresses failing
-			 * because already listening on ipv4 addresses: */
-			setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY,
-				   (const void *) &y, sizeof(y));
-		}
+			if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR,
+				       (const void *) &y, sizeof(y)) < 0) {
+				perror("setsockopt(SO_REUSEADDR) failed");
+			}
+
+#if defined(SO_REUSEPORT)
+			if (config->acceptor_shards > 0 ||
+			    (ptr->ai_socktype == SOCK_DGRAM && config->udp_steering)) {
+				y = 1;
+				if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
+					       (const void *) &y, sizeof(y)) < 0) {
+					perror("setsockopt(SO_REUSEPORT) failed");
+					close(s);
+					return -1;
+				}
+			}
 #endif
 
-		y = 1;
-		if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR,
-			       (const void *) &y, sizeof(y)) < 0) {
-			perror("setsockopt(SO_REUSEADDR) failed");
-		}
+			if (ptr->ai_socktype == SOCK_DGRAM) {
+				set_udp_socket_options(config, s, ptr->ai_family);
+			}
 
-		if (ptr->ai_socktype == SOCK_DGRAM) {
-			set_udp_socket_options(config, s, ptr->ai_family);
-		}
 
+			if (bind(s, ptr->ai_addr, ptr->ai_addrlen) < 0) {
+				perror("bind() failed");
+				close(s);
+				break;
+			}
 
-		if (bind(s, ptr->ai_addr, ptr->ai_addrlen) < 0) {
-			perror("bind() failed");
-			close(s);
-			continue;
-		}
+			if (ptr->ai_socktype == SOCK_STREAM) {
+				if (listen(s, 1024) < 0) {
+					perror("listen() failed");
+					close(s);
+					return -1;
+				}
+			}
 
-		if (ptr->ai_socktype == SOCK_STREAM) {
-			if (listen(s, 1024) < 0) {
-				perror("listen() failed");
+			if (config->acceptor_shards > 0 &&
+			    attach_shard_steering(s, ptr->ai_family, config->acceptor_shards) < 0) {
+				perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed");
 				close(s);
 				return -1;
 			}
-		}
 
-		set_common_socket_options(s);
-
-		add_listener(pool, list, s, ptr->ai_family, ptr->ai_socktype==SOCK_STREAM?SOCK_TYPE_TCP:SOCK_TYPE_UDP,
-			ptr->ai_protocol, ptr->ai_addr, ptr->ai_addrlen);
+			set_common_socket_options(s);
 
+			add_listener(pool, list, s, ptr->ai_family, ptr->ai_socktype==SOCK_STREAM?SOCK_TYPE_TCP:SOCK_TYPE_UDP,
+				ptr->ai_protocol, ptr->ai_addr, ptr->ai_addrlen,
+				config->acceptor_shards > 0 ? (int)i : -1);
+		}
 	}
 
 	fflush(stderr);
@@ -274,7 +353,7 @@ int _listen_unix_ports(void *pool, struct perm_cfg_st* config,
 			       sa.sun_path, strerror(e));
 			exit(1);
 		}
-		add_listener(pool, list, s, AF_UNIX, SOCK_TYPE_UNIX, 0, (struct sockaddr *)&sa, sizeof(sa));
+		add_listener(pool, list, s, AF_UNIX, SOCK_TYPE_UNIX, 0, (struct sockaddr *)&sa, sizeof(sa), -1);
 	}
 	fflush(stderr);
 
@@ -352,7 +431,7 @@ listen_ports(void *pool, struct perm_cfg_st* config,
 					config->udp_port = ntohs(((struct sockaddr_in6*)&tmp_sock)->sin6_port);
 			}
 
-			add_listener(pool, list, fd, family, type==SOCK_STREAM?SOCK_TYPE_TCP:SOCK_TYPE_UDP, 0, (struct sockaddr*)&tmp_sock, tmp_sock_len);
+			add_listener(pool, list, fd, family, type==SOCK_STREAM?SOCK_TYPE_TCP:SOCK_TYPE_UDP, 0, (struct sockaddr*)&tmp_sock, tmp_sock_len, -1);
 		}
 
 		if (list->total == 0) {
@@ -363,6 +442,11 @@ listen_ports(void *pool, struct perm_cfg_st* config,
 		if (config->foreground != 0)
 			fprintf(stderr, "listening on %d systemd sockets...\n", list->total);
 
+		if (config->acceptor_shards > 0) {
+			fprintf(stderr, "acceptor-shards is not supported with socket activation; ignoring\n");
+			config->acceptor_shards = 0;
+		}
+
 		return 0;
 	}
 #endif
@@ -599,6 +683,9 @@ void clear_lists(main_server_st *s)
 	struct listener_st *ltmp = NULL, *lpos;
 	struct proc_st *ctmp = NULL, *cpos;
 	struct script_wait_st *script_tmp = NULL, *script_pos;
+	struct worker_pool_st *pool_tmp = NULL, *pool_pos;
+
+	udp_steer_deinit(s);
 
 	list_for_each_safe(&s->listen_list.head, ltmp, lpos, list) {
 		close(ltmp->fd);
@@ -622,10 +709,24 @@ void clear_lists(main_server_st *s)
 
 	list_for_each_safe(&s->script_list.head, script_tmp, script_pos, list) {
 		list_del(&script_tmp->list);
-		ev_child_stop(loop, &script_tmp->ev_child);
 		talloc_free(script_tmp);
 	}
 
+	list_for_each_safe(&s->worker_pools, pool_tmp, pool_pos, list) {
+		if (pool_tmp->ctl_fd >= 0)
+			close(pool_tmp->ctl_fd);
+		list_del(&pool_tmp->list);
+		ev_child_stop(loop, &pool_tmp->ev_child);
+		talloc_free(pool_tmp);
+	}
+
+	icmp_ping_deinit();
+	route_nl_deinit();
+	fw_deinit();
+	ban_filter_deinit();
+	script_runner_deinit();
+	metrics_deinit();
+	acceptor_shards_deinit();
 	ip_lease_deinit(&s->ip_leases);
 	proc_table_deinit(s);
 	ctl_handler_deinit(s);
@@ -637,8 +738,11 @@ void clear_lists(main_server_st *s)
 		ev_io_stop (loop, &sec_mod_watcher);
 		ev_child_stop (loop, &child_watcher);
 		ev_timer_stop(loop, &maintenance_watcher);
+		ev_timer_stop(loop, &expire_watcher);
 		/* free memory and descriptors by the event loop */
 		ev_loop_destroy (loop);
+		/* the acceptor shards call it again in the workers they fork */
+		loop = NULL;
 	}
 }
 
@@ -760,44 +864,41 @@ unsigned get_session_id(main_server_st* s, uint8_t *buffer, size_t buffer_size,
  */
 #define UDP_FD_RESEND_TIME 3
 
-static int forward_udp_to_owner(main_server_st* s, struct listener_st *listener)
+/* Receives a datagram on a UDP listener into s->msg_buffer, and reads
+ * the DTLS session ID of a client hello. Returns zero if it is to be
+ * forwarded to the worker owning the session or the client's IP, and
+ * -1 if it is to be ignored. */
+int udp_dgram_recv(main_server_st *s, int fd, udp_dgram_st *d)
 {
-int ret, e;
-struct sockaddr_storage cli_addr;
-struct sockaddr_storage our_addr;
-struct proc_st *proc_to_send = NULL;
-socklen_t cli_addr_size, our_addr_size;
-char tbuf[64];
-uint8_t  *session_id = NULL;
-int session_id_size = 0;
-ssize_t buffer_size;
-int match_ip_only = 0;
-time_t now;
-int sfd = -1;
+	int ret;
+	char tbuf[64];
+
+	memset(d, 0, sizeof(*d));
 
 	/* first receive from the correct client and connect socket */
-	cli_addr_size = sizeof(cli_addr);
-	our_addr_size = sizeof(our_addr);
-	ret = oc_recvfrom_at(listener->fd, s->msg_buffer, sizeof(s->msg_buffer), 0,
-			  (struct sockaddr*)&cli_addr, &cli_addr_size,
-			  (struct sockaddr*)&our_addr, &our_addr_size,
+	d->cli_addr_size = sizeof(d->cli_addr);
+	d->our_addr_size = sizeof(d->our_addr);
+	ret = oc_recvfrom_at(fd, s->msg_buffer, sizeof(s->msg_buffer), 0,
+			  (struct sockaddr*)&d->cli_addr, &d->cli_addr_size,
+			  (struct sockaddr*)&d->our_addr, &d->our_addr_size,
 			  GETPCONFIG(s)->udp_port);
 	if (ret < 0) {
 		mslog(s, NULL, LOG_INFO, "error receiving in UDP socket");
 		return -1;
 	}
-	buffer_size = ret;
+	d->data = s->msg_buffer;
+	d->data_size = ret;
 
-	if (buffer_size < RECORD_PAYLOAD_POS) {
+	if (d->data_size < RECORD_PAYLOAD_POS) {
 		mslog(s, NULL, LOG_INFO, "%s: too short UDP packet",
-		      human_addr((struct sockaddr*)&cli_addr, cli_addr_size, tbuf, sizeof(tbuf)));
-		goto fail;
+		      human_addr((struct sockaddr*)&d->cli_addr, d->cli_addr_size, tbuf, sizeof(tbuf)));
+		return -1;
 	}
 
 	/* check version */
 	if (s->msg_buffer[0] == 22) {
 		mslog(s, NULL, LOG_DEBUG, "new DTLS session from %s (record v%u.%u, hello v%u.%u)", 
-			human_addr((struct sockaddr*)&cli_addr, cli_addr_size, tbuf, sizeof(tbuf)),
+			human_addr((struct sockaddr*)&d->cli_addr, d->cli_addr_size, tbuf, sizeof(tbuf)),
 			(unsigned int)s->msg_buffer[1], (unsigned int)s->msg_buffer[2],
 			(unsigned int)s->msg_buffer[RECORD_PAYLOAD_POS], (unsigned int)s->msg_buffer[RECORD_PAYLOAD_POS+1]);
 	}
@@ -805,40 +906,95 @@ int sfd = -1;
 	if (s->msg_buffer[1] != 254 && (s->msg_buffer[1] != 1 && s->msg_buffer[2] != 0) &&
 		s->msg_buffer[RECORD_PAYLOAD_POS] != 254 && (s->msg_buffer[RECORD_PAYLOAD_POS] != 0 && s->msg_buffer[RECORD_PAYLOAD_POS+1] != 0)) {
 		mslog(s, NULL, LOG_INFO, "%s: unknown DTLS record version: %u.%u", 
-		      human_addr((struct sockaddr*)&cli_addr, cli_addr_size, tbuf, sizeof(tbuf)),
+		      human_addr((struct sockaddr*)&d->cli_addr, d->cli_addr_size, tbuf, sizeof(tbuf)),
 		      (unsigned)s->msg_buffer[1], (unsigned)s->msg_buffer[2]);
-		goto fail;
+		return -1;
 	}
 
 	if (s->msg_buffer[0] != 22) {
 		mslog(s, NULL, LOG_DEBUG, "%s: unexpected DTLS content type: %u; possibly a firewall disassociated a UDP session",
-		      human_addr((struct sockaddr*)&cli_addr, cli_addr_size, tbuf, sizeof(tbuf)),
+		      human_addr((struct sockaddr*)&d->cli_addr, d->cli_addr_size, tbuf, sizeof(tbuf)),
 		      (unsigned int)s->msg_buffer[0]);
 		/* Here we received a non-client-hello packet. It may be that
 		 * the client's NAT changed its UDP source port and the previous
 		 * connection is invalidated. Try to see if we can simply match
 		 * the IP address and forward the socket.
 		 */
-		match_ip_only = 1;
+		d->match_ip_only = 1;
 
 		/* don't bother IP matching when the listen-clear-file is in use */
 		if (GETPCONFIG(s)->unix_conn_file)
-			goto fail;
+			return -1;
 	} else {
-		if (!get_session_id(s, s->msg_buffer, buffer_size, &session_id, &session_id_size)) {
+		if (!get_session_id(s, s->msg_buffer, d->data_size, &d->session_id, &d->session_id_size)) {
 			mslog(s, NULL, LOG_INFO, "%s: too short handshake packet",
-			      human_addr((struct sockaddr*)&cli_addr, cli_addr_size, tbuf, sizeof(tbuf)));
-			goto fail;
+			      human_addr((struct sockaddr*)&d->cli_addr, d->cli_addr_size, tbuf, sizeof(tbuf)));
+			return -1;
+		}
+		d->hello_session_id = (d->session_id == &s->msg_buffer[RECORD_PAYLOAD_POS+HANDSHAKE_SESSION_ID_POS+1]);
+	}
+
+	return 0;
+}
+
+/* Returns a UDP socket bound to the address the datagram was received
+ * at, and connected to the client, or -1 on error. */
+int udp_dgram_socket(main_server_st *s, struct listener_st *listener, udp_dgram_st *d)
+{
+	int ret, e, sfd;
+	char tbuf[64];
+
+	sfd = socket(listener->family, SOCK_DGRAM, listener->protocol);
+	if (sfd < 0) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "new UDP socket failed: %s",
+		      strerror(e));
+		return -1;
+	}
+
+	set_worker_udp_opts(s, sfd, listener->family);
+
+	if (d->our_addr_size > 0) {
+		ret = bind(sfd, (struct sockaddr *)&d->our_addr, d->our_addr_size);
+		if (ret == -1) {
+			e = errno;
+			mslog(s, NULL, LOG_INFO, "bind UDP to %s: %s",
+			      human_addr((struct sockaddr*)&listener->addr, listener->addr_len, tbuf, sizeof(tbuf)),
+			      strerror(e));
 		}
 	}
 
+	ret = connect(sfd, (void*)&d->cli_addr, d->cli_addr_size);
+	if (ret == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "connect UDP socket from %s: %s",
+		      human_addr((struct sockaddr*)&d->cli_addr, d->cli_addr_size, tbuf, sizeof(tbuf)),
+		      strerror(e));
+		close(sfd);
+		return -1;
+	}
+
+	return sfd;
+}
+
+/* Passes a socket connected to the client of the datagram to the worker
+ * owning its session, together with the datagram. The socket is
+ * created on the listener if sfd is -1; it is closed in any case. */
+void udp_dgram_forward(main_server_st *s, udp_dgram_st *d,
+		       struct listener_st *listener, int sfd)
+{
+	int ret;
+	struct proc_st *proc_to_send = NULL;
+	char tbuf[64];
+	time_t now;
+
 	/* search for the IP and the session ID in all procs */
 	now = time(0);
 
-	if (match_ip_only == 0) {
-		proc_to_send = proc_search_dtls_id(s, session_id, session_id_size);
+	if (d->match_ip_only == 0) {
+		proc_to_send = proc_search_dtls_id(s, d->session_id, d->session_id_size);
 	} else {
-		proc_to_send = proc_search_single_ip(s, &cli_addr, cli_addr_size);
+		proc_to_send = proc_search_single_ip(s, &d->cli_addr, d->cli_addr_size);
 	}
 
 	if (proc_to_send != 0) {
@@ -846,48 +1002,41 @@ int sfd = -1;
 
 		if (now - proc_to_send->udp_fd_receive_time <= UDP_FD_RESEND_TIME) {
 			mslog(s, proc_to_send, LOG_DEBUG, "received UDP connection too soon from %s",
-			      human_addr((struct sockaddr*)&cli_addr, cli_addr_size, tbuf, sizeof(tbuf)));
+			      human_addr((struct sockaddr*)&d->cli_addr, d->cli_addr_size, tbuf, sizeof(tbuf)));
 			goto fail;
 		}
 
-		sfd = socket(listener->family, SOCK_DGRAM, listener->protocol);
-		if (sfd < 0) {
-			e = errno;
-			mslog(s, proc_to_send, LOG_ERR, "new UDP socket failed: %s",
-			      strerror(e));
-			goto fail;
+		if (d->match_ip_only != 0) {
+			msg.hello = 0; /* by default this is one */
+		} else {
+			/* a new DTLS session, store the DTLS IPs into proc and add it into hash table */
+			proc_table_update_dtls_ip(s, proc_to_send, &d->cli_addr, d->cli_addr_size);
 		}
 
-		set_worker_udp_opts(s, sfd, listener->family);
-
-		if (our_addr_size > 0) {
-			ret = bind(sfd, (struct sockaddr *)&our_addr, our_addr_size);
-			if (ret == -1) {
-				e = errno;
-				mslog(s, proc_to_send, LOG_INFO, "bind UDP to %s: %s",
-				      human_addr((struct sockaddr*)&listener->addr, listener->addr_len, tbuf, sizeof(tbuf)),
-				      strerror(e));
+		/* with udp-steering the kernel delivers the next datagrams
+		 * of the client to the worker's socket */
+		if (sfd == -1) {
+			sfd = udp_steer_socket(s, proc_to_send, listener, d);
+			if (sfd != -1) {
+				msg.has_peer_addr = 1;
+				msg.peer_addr.data = (void*)&d->cli_addr;
+				msg.peer_addr.len = d->cli_addr_size;
+				if (d->our_addr_size > 0) {
+					msg.has_our_addr = 1;
+					msg.our_addr.data = (void*)&d->our_addr;
+					msg.our_addr.len = d->our_addr_size;
+				}
 			}
 		}
 
-		ret = connect(sfd, (void*)&cli_addr, cli_addr_size);
-		if (ret == -1) {
-			e = errno;
-			mslog(s, proc_to_send, LOG_ERR, "connect UDP socket from %s: %s",
-			      human_addr((struct sockaddr*)&cli_addr, cli_addr_size, tbuf, sizeof(tbuf)),
-			      strerror(e));
-			goto fail;
-		}
-
-		if (match_ip_only != 0) {
-			msg.hello = 0; /* by default this is one */
-		} else {
-			/* a new DTLS session, store the DTLS IPs into proc and add it into hash table */
-			proc_table_update_dtls_ip(s, proc_to_send, &cli_addr, cli_addr_size);
+		if (sfd == -1) {
+			sfd = udp_dgram_socket(s, listener, d);
+			if (sfd == -1)
+				goto fail;
 		}
 
-		msg.data.data = s->msg_buffer;
-		msg.data.len = buffer_size;
+		msg.data.data = d->data;
+		msg.data.len = d->data_size;
 
 		ret = send_socket_msg_to_worker(s, proc_to_send, CMD_UDP_FD,
 			sfd,
@@ -896,20 +1045,28 @@ int sfd = -1;
 			(pack_func)udp_fd_msg__pack);
 		if (ret < 0) {
 			mslog(s, proc_to_send, LOG_ERR, "error passing UDP socket from %s",
-			      human_addr((struct sockaddr*)&cli_addr, cli_addr_size, tbuf, sizeof(tbuf)));
+			      human_addr((struct sockaddr*)&d->cli_addr, d->cli_addr_size, tbuf, sizeof(tbuf)));
 			goto fail;
 		}
 		mslog(s, proc_to_send, LOG_DEBUG, "passed UDP socket from %s",
-		      human_addr((struct sockaddr*)&cli_addr, cli_addr_size, tbuf, sizeof(tbuf)));
+		      human_addr((struct sockaddr*)&d->cli_addr, d->cli_addr_size, tbuf, sizeof(tbuf)));
 		proc_to_send->udp_fd_receive_time = now;
 	}
 
 fail:
 	if (sfd != -1)
 		close(sfd);
+}
 
-	return 0;
+static int forward_udp_to_owner(main_server_st* s, struct listener_st *listener)
+{
+	udp_dgram_st d;
 
+	if (udp_dgram_recv(s, listener->fd, &d) < 0)
+		return 0;
+
+	udp_dgram_forward(s, &d, listener, -1);
+	return 0;
 }
 
 #ifdef HAVE_LIBWRAP
@@ -949,31 +1106,6 @@ static void sec_mod_child_watcher_cb(struct ev_loop *loop, ev_child *w, int reve
 
 }
 
-void script_child_watcher_cb(struct ev_loop *loop, ev_child *w, int revents)
-{
-	main_server_st *s = ev_userdata(loop);
-	int ret;
-	struct script_wait_st *stmp = (struct script_wait_st*)w;
-	unsigned estatus;
-
-	estatus = WEXITSTATUS(w->rstatus);
-	if (WIFSIGNALED(w->rstatus))
-		estatus = 1;
-
-	/* check if someone was waiting for that pid */
-	mslog(s, stmp->proc, LOG_DEBUG, "connect-script exit status: %u", estatus);
-	list_del(&stmp->list);
-	ev_child_stop(loop, &stmp->ev_child);
-
-	ret = handle_script_exit(s, stmp->proc, estatus);
-	if (ret < 0) {
-		/* takes care of free */
-		remove_proc(s, stmp->proc, RPROC_KILL);
-	} else {
-		talloc_free(stmp);
-	}
-}
-
 static void worker_child_watcher_cb(struct ev_loop *loop, ev_child *w, int revents)
 {
 	main_server_st *s = ev_userdata(loop);
@@ -990,9 +1122,183 @@ static void worker_child_watcher_cb(struct ev_loop *loop, ev_child *w, int reven
 	ev_child_stop(loop, w);
 }
 
+static int spawn_worker_pool(main_server_st *s);
+
+static void worker_pool_child_watcher_cb(struct ev_loop *loop, ev_child *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct worker_pool_st *pool = (struct worker_pool_st*)w;
+	unsigned respawn = !pool->draining;
+
+	worker_child_watcher_cb(loop, w, revents);
+
+	if (respawn)
+		mslog(s, NULL, LOG_ERR, "worker pool process %u exited unexpectedly", (unsigned)pool->pid);
+
+	pool->exited = 1;
+	pool->draining = 1;
+	if (pool->ctl_fd >= 0) {
+		close(pool->ctl_fd);
+		pool->ctl_fd = -1;
+	}
+
+	/* the pool is freed with its last session otherwise */
+	if (pool->sessions == 0) {
+		list_del(&pool->list);
+		talloc_free(pool);
+	}
+
+	if (respawn)
+		spawn_worker_pool(s);
+}
+
+/* Forks a worker process which serves multiple sessions, and
+ * adds it to the list of pools new connections are sent to.
+ */
+static int spawn_worker_pool(main_server_st *s)
+{
+	struct worker_st *ws = s->ws;
+	struct worker_pool_st *pool;
+	int ctl_fd[2], ret;
+	pid_t pid;
+
+	pool = talloc_zero(s, struct worker_pool_st);
+	if (pool == NULL) {
+		mslog(s, NULL, LOG_ERR, "memory error");
+		return -1;
+	}
+
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, ctl_fd);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "error creating worker pool socket");
+		talloc_free(pool);
+		return -1;
+	}
+
+	pid = fork();
+	if (pid == 0) {	/* child */
+		/* as in run_worker() */
+		sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
+		close(ctl_fd[0]);
+		clear_lists(s);
+		if (s->top_fd != -1) close(s->top_fd);
+		close(s->sec_mod_fd);
+		close(s->sec_mod_fd_sync);
+
+		setproctitle(PACKAGE_NAME"-worker-pool");
+		kill_on_parent_kill(SIGTERM);
+
+		/* write sec-mod's address */
+		memcpy(&ws->secmod_addr, &s->secmod_addr, s->secmod_addr_len);
+		ws->secmod_addr_len = s->secmod_addr_len;
+
+		ws->main_pool = s->main_pool;
+
+		ws->vconfig = s->vconfig;
+
+		/* Drop privileges after this point */
+		drop_privileges(s);
+
+		talloc_free(s);
+#ifdef HAVE_MALLOC_TRIM
+		malloc_trim(0);
+#endif
+		worker_pool_server(ws, ctl_fd[1]);
+		exit(0);
+	} else if (pid == -1) {
+		mslog(s, NULL, LOG_ERR, "fork failed");
+		close(ctl_fd[0]);
+		close(ctl_fd[1]);
+		talloc_free(pool);
+		return -1;
+	}
+
+	close(ctl_fd[1]);
+	set_cloexec_flag(ctl_fd[0], 1);
+
+	pool->pid = pid;
+	pool->ctl_fd = ctl_fd[0];
+	list_add_tail(&s->worker_pools, &pool->list);
+
+	ev_child_init(&pool->ev_child, worker_pool_child_watcher_cb, pid, 0);
+	ev_child_start(loop, &pool->ev_child);
+
+	mslog(s, NULL, LOG_DEBUG, "started worker pool process %u", (unsigned)pid);
+	return 0;
+}
+
+static void cmd_watcher_cb(EV_P_ ev_io *w, int revents);
+
+/* Sends an accepted connection to the least loaded pool worker.
+ * Returns -1 if there is no pool worker to serve it; the caller
+ * is expected to fork a worker for it in that case.
+ */
+static int send_to_worker_pool(main_server_st *s, struct worker_st *ws,
+			       int fd, int cmd_fd[2], sock_type_t stype)
+{
+	struct worker_pool_st *pool = NULL, *ptmp;
+	struct proc_st *ctmp;
+	PoolSessionMsg msg = POOL_SESSION_MSG__INIT;
+	int ret;
+
+	list_for_each(&s->worker_pools, ptmp, list) {
+		if (ptmp->draining || ptmp->ctl_fd == -1)
+			continue;
+		if (pool == NULL || ptmp->sessions < pool->sessions)
+			pool = ptmp;
+	}
+
+	if (pool == NULL)
+		return -1;
+
+	if (s->next_pool_id < POOL_ID_BASE || s->next_pool_id >= INT32_MAX)
+		s->next_pool_id = POOL_ID_BASE;
+
+	msg.id = s->next_pool_id++;
+	msg.conn_type = stype;
+	msg.remote_addr.data = (void*)&ws->remote_addr;
+	msg.remote_addr.len = ws->remote_addr_len;
+	if (ws->our_addr_len > 0) {
+		msg.has_our_addr = 1;
+		msg.our_addr.data = (void*)&ws->our_addr;
+		msg.our_addr.len = ws->our_addr_len;
+	}
+
+	ret = send_socket_msg(s, pool->ctl_fd, CMD_POOL_SESSION, cmd_fd[1], &msg,
+			      (pack_size_func) pool_session_msg__get_packed_size,
+			      (pack_func) pool_session_msg__pack);
+	if (ret >= 0)
+		ret = send_socket_msg(s, cmd_fd[0], CMD_POOL_CONN_FD, fd, NULL, NULL, NULL);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "error sending connection to worker pool %u", (unsigned)pool->pid);
+		close(cmd_fd[0]);
+		return 0;
+	}
+
+	ctmp = new_proc(s, pool->pid, cmd_fd[0],
+			&ws->remote_addr, ws->remote_addr_len,
+			&ws->our_addr, ws->our_addr_len,
+			ws->sid, sizeof(ws->sid));
+	if (ctmp == NULL) {
+		/* the session terminates on the closed socket */
+		close(cmd_fd[0]);
+		return 0;
+	}
+
+	ctmp->pool = pool;
+	ctmp->pool_id = msg.id;
+	pool->sessions++;
+
+	ev_io_init(&ctmp->io, cmd_watcher_cb, cmd_fd[0], EV_READ);
+	ev_io_start(loop, &ctmp->io);
+
+	return 0;
+}
+
 static void kill_children(main_server_st* s)
 {
 	struct proc_st *ctmp = NULL, *cpos;
+	struct worker_pool_st *pool;
 
 	/* kill the security module server */
 	list_for_each_safe(&s->proc_list.head, ctmp, cpos, list) {
@@ -1000,6 +1306,14 @@ static void kill_children(main_server_st* s)
 			remove_proc(s, ctmp, RPROC_KILL|RPROC_QUIT);
 		}
 	}
+
+	list_for_each(&s->worker_pools, pool, list) {
+		pool->draining = 1;
+		if (!pool->exited)
+			kill(pool->pid, SIGTERM);
+	}
+	acceptor_shards_shutdown();
+	script_runner_shutdown();
 	kill(s->sec_mod_pid, SIGTERM);
 }
 
@@ -1041,6 +1355,27 @@ static void reload_sig_watcher_cb(struct ev_loop *loop, ev_signal *w, int revent
 	}
 
 	reload_cfg_file(s->config_pool, s->vconfig, 0);
+	acceptor_shards_reload();
+
+	/* the pool workers hold the previous configuration; new connections
+	 * go to new ones and the old exit once their sessions are closed */
+	if (GETPCONFIG(s)->worker_pool_size > 0) {
+		struct worker_pool_st *pool;
+		unsigned i;
+
+		list_for_each(&s->worker_pools, pool, list) {
+			if (pool->draining)
+				continue;
+			pool->draining = 1;
+			if (pool->sessions == 0) {
+				close(pool->ctl_fd);
+				pool->ctl_fd = -1;
+			}
+		}
+
+		for (i = 0; i < GETPCONFIG(s)->worker_pool_size; i++)
+			spawn_worker_pool(s);
+	}
 }
 
 static void cmd_watcher_cb (EV_P_ ev_io *w, int revents)
@@ -1056,133 +1391,200 @@ static void cmd_watcher_cb (EV_P_ ev_io *w, int revents)
 	}
 }
 
-static void listen_watcher_cb (EV_P_ ev_io *w, int revents)
+/* Accepts a connection on a TCP or UNIX listener, and sets the
+ * client's and our address in s->ws. Returns the connection, or -1
+ * if it is rejected by the client limit, the TCP wrappers or the
+ * banned IPs. The acceptor shards (is_shard) leave the client limit
+ * and the points of the connection to main.
+ */
+int accept_client(main_server_st *s, struct listener_st *ltmp, unsigned is_shard)
 {
-	main_server_st *s = ev_userdata(loop);
-	struct listener_st *ltmp = (struct listener_st *)w;
-	struct proc_st *ctmp = NULL;
 	struct worker_st *ws = s->ws;
-	int fd, ret;
-	int cmd_fd[2];
-	pid_t pid;
+	unsigned banned;
+	int fd;
 
-	if (ltmp->sock_type == SOCK_TYPE_TCP || ltmp->sock_type == SOCK_TYPE_UNIX) {
-		/* connection on TCP port */
-		int stype = ltmp->sock_type;
-
-		ws->remote_addr_len = sizeof(ws->remote_addr);
-		fd = accept(ltmp->fd, (void*)&ws->remote_addr, &ws->remote_addr_len);
-		if (fd < 0) {
-			mslog(s, NULL, LOG_ERR,
-			       "error in accept(): %s", strerror(errno));
-			return;
-		}
-		set_cloexec_flag (fd, 1);
+	ws->remote_addr_len = sizeof(ws->remote_addr);
+	fd = accept(ltmp->fd, (void*)&ws->remote_addr, &ws->remote_addr_len);
+	if (fd < 0) {
+		mslog(s, NULL, LOG_ERR,
+		       "error in accept(): %s", strerror(errno));
+		return -1;
+	}
+	set_cloexec_flag (fd, 1);
 #ifndef __linux__
-		/* OpenBSD sets the non-blocking flag if accept's fd is non-blocking */
-		set_block(fd);
+	/* OpenBSD sets the non-blocking flag if accept's fd is non-blocking */
+	set_block(fd);
 #endif
+	/* the session is not cut if its IP is banned later */
+	if (ltmp->sock_type == SOCK_TYPE_TCP)
+		ban_filter_detach(fd);
 
-		if (GETCONFIG(s)->max_clients > 0 && s->stats.active_clients >= GETCONFIG(s)->max_clients) {
-			close(fd);
-			mslog(s, NULL, LOG_INFO, "reached maximum client limit (active: %u)", s->stats.active_clients);
-			return;
-		}
+	if (!is_shard && GETCONFIG(s)->max_clients > 0 && s->stats.active_clients >= GETCONFIG(s)->max_clients) {
+		close(fd);
+		mslog(s, NULL, LOG_INFO, "reached maximum client limit (active: %u)", s->stats.active_clients);
+		return -1;
+	}
+
+	if (check_tcp_wrapper(fd) < 0) {
+		close(fd);
+		mslog(s, NULL, LOG_INFO, "TCP wrappers rejected the connection (see /etc/hosts->[allow|deny])");
+		return -1;
+	}
+
+	if (ws->conn_type != SOCK_TYPE_UNIX && !GETCONFIG(s)->listen_proxy_proto) {
+		memset(&ws->our_addr, 0, sizeof(ws->our_addr));
+		ws->our_addr_len = sizeof(ws->our_addr);
+		if (getsockname(fd, (struct sockaddr*)&ws->our_addr, &ws->our_addr_len) < 0)
+			ws->our_addr_len = 0;
 
-		if (check_tcp_wrapper(fd) < 0) {
+		if (is_shard)
+			banned = is_ip_banned(s, &ws->remote_addr, ws->remote_addr_len);
+		else
+			banned = check_if_banned(s, &ws->remote_addr, ws->remote_addr_len);
+		if (banned != 0) {
 			close(fd);
-			mslog(s, NULL, LOG_INFO, "TCP wrappers rejected the connection (see /etc/hosts->[allow|deny])");
-			return;
+			return -1;
 		}
+	}
 
-		if (ws->conn_type != SOCK_TYPE_UNIX && !GETCONFIG(s)->listen_proxy_proto) {
-			memset(&ws->our_addr, 0, sizeof(ws->our_addr));
-			ws->our_addr_len = sizeof(ws->our_addr);
-			if (getsockname(fd, (struct sockaddr*)&ws->our_addr, &ws->our_addr_len) < 0)
-				ws->our_addr_len = 0;
+	return fd;
+}
 
-			if (check_if_banned(s, &ws->remote_addr, ws->remote_addr_len) != 0) {
-				close(fd);
-				return;
-			}
-		}
+/* Runs the worker of the connection fd in a forked process; the
+ * descriptors and the sensitive data of the parent are cleared first.
+ * The workers forked by an acceptor shard (is_shard) are not killed
+ * with it, as it is respawned by main without affecting the sessions;
+ * they notice main's exit by their command socket.
+ */
+void run_worker(main_server_st *s, int fd, int cmd_fd, sock_type_t stype, unsigned is_shard)
+{
+	struct worker_st *ws = s->ws;
 
-		/* Create a command socket */
-		ret = socketpair(AF_UNIX, SOCK_STREAM, 0, cmd_fd);
-		if (ret < 0) {
-			mslog(s, NULL, LOG_ERR, "error creating command socket");
-			close(fd);
-			return;
-		}
+	/* close any open descriptors, and erase
+	 * sensitive data before running the worker
+	 */
+	sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
+	clear_lists(s);
+	if (s->top_fd != -1) close(s->top_fd);
+	if (s->sec_mod_fd != -1) close(s->sec_mod_fd);
+	if (s->sec_mod_fd_sync != -1) close(s->sec_mod_fd_sync);
+
+	setproctitle(PACKAGE_NAME"-worker");
+	if (!is_shard)
+		kill_on_parent_kill(SIGTERM);
 
-		pid = fork();
-		if (pid == 0) {	/* child */
-			/* close any open descriptors, and erase
-			 * sensitive data before running the worker
-			 */
-			sigprocmask(SIG_SETMASK, &sig_default_set, NULL);
-			close(cmd_fd[0]);
-			clear_lists(s);
-			if (s->top_fd != -1) close(s->top_fd);
-			close(s->sec_mod_fd);
-			close(s->sec_mod_fd_sync);
-
-			setproctitle(PACKAGE_NAME"-worker");
-			kill_on_parent_kill(SIGTERM);
-
-			/* write sec-mod's address */
-			memcpy(&ws->secmod_addr, &s->secmod_addr, s->secmod_addr_len);
-			ws->secmod_addr_len = s->secmod_addr_len;
-
-			ws->main_pool = s->main_pool;
-
-			ws->vconfig = s->vconfig;
-
-			ws->cmd_fd = cmd_fd[1];
-			ws->tun_fd = -1;
-			ws->dtls_tptr.fd = -1;
-			ws->conn_fd = fd;
-			ws->conn_type = stype;
-
-			/* Drop privileges after this point */
-			drop_privileges(s);
-
-			/* creds and config are not allocated
-			 * under s.
-			 */
-			talloc_free(s);
+	/* write sec-mod's address */
+	memcpy(&ws->secmod_addr, &s->secmod_addr, s->secmod_addr_len);
+	ws->secmod_addr_len = s->secmod_addr_len;
+
+	ws->main_pool = s->main_pool;
+
+	ws->vconfig = s->vconfig;
+
+	ws->cmd_fd = cmd_fd;
+	ws->tun_fd = -1;
+	ws->dtls_tptr.fd = -1;
+	ws->conn_fd = fd;
+	ws->conn_type = stype;
+
+	/* Drop privileges after this point */
+	drop_privileges(s);
+
+	/* creds and config are not allocated
+	 * under s.
+	 */
+	talloc_free(s);
 #ifdef HAVE_MALLOC_TRIM
-			/* try to return all the pages we've freed to
-			 * the operating system, to prevent the child from
-			 * accessing them. That's totally unreliable, so
-			 * sensitive data have to be overwritten anyway. */
-			malloc_trim(0);
+	/* try to return all the pages we've freed to
+	 * the operating system, to prevent the child from
+	 * accessing them. That's totally unreliable, so
+	 * sensitive data have to be overwritten anyway. */
+	malloc_trim(0);
 #endif
-			vpn_server(ws);
-			exit(0);
-		} else if (pid == -1) {
-fork_failed:
-			mslog(s, NULL, LOG_ERR, "fork failed");
-			close(cmd_fd[0]);
-		} else { /* parent */
-			/* add_proc */
-			ctmp = new_proc(s, pid, cmd_fd[0], 
-					&ws->remote_addr, ws->remote_addr_len,
-					&ws->our_addr, ws->our_addr_len,
-					ws->sid, sizeof(ws->sid));
-			if (ctmp == NULL) {
-				kill(pid, SIGTERM);
-				goto fork_failed;
-			}
+	vpn_server(ws);
+	exit(0);
+}
 
-			ev_io_init(&ctmp->io, cmd_watcher_cb, cmd_fd[0], EV_READ);
-			ev_io_start(loop, &ctmp->io);
+/* Adds the session of a worker, whose commands are read from cmd_fd,
+ * with the addresses in s->ws. */
+struct proc_st *add_worker_proc(main_server_st *s, pid_t pid, int cmd_fd)
+{
+	struct worker_st *ws = s->ws;
+	struct proc_st *ctmp;
 
-			ev_child_init(&ctmp->ev_child, worker_child_watcher_cb, pid, 0);
-			ev_child_start(loop, &ctmp->ev_child);
-		}
+	ctmp = new_proc(s, pid, cmd_fd,
+			&ws->remote_addr, ws->remote_addr_len,
+			&ws->our_addr, ws->our_addr_len,
+			ws->sid, sizeof(ws->sid));
+	if (ctmp == NULL)
+		return NULL;
+
+	ev_io_init(&ctmp->io, cmd_watcher_cb, cmd_fd, EV_READ);
+	ev_io_start(loop, &ctmp->io);
+
+	return ctmp;
+}
+
+/* Serves an accepted connection by a pool worker, or by a worker
+ * forked for it. The connection is closed in any case.
+ */
+void serve_connection(main_server_st *s, int fd, sock_type_t stype)
+{
+	struct worker_st *ws = s->ws;
+	struct proc_st *ctmp = NULL;
+	int cmd_fd[2], ret;
+	pid_t pid;
+
+	/* Create a command socket */
+	ret = socketpair(AF_UNIX, SOCK_STREAM, 0, cmd_fd);
+	if (ret < 0) {
+		mslog(s, NULL, LOG_ERR, "error creating command socket");
+		close(fd);
+		return;
+	}
+
+	if (send_to_worker_pool(s, ws, fd, cmd_fd, stype) >= 0) {
 		close(cmd_fd[1]);
 		close(fd);
+		return;
+	}
+
+	pid = fork();
+	if (pid == 0) {	/* child */
+		close(cmd_fd[0]);
+		run_worker(s, fd, cmd_fd[1], stype, 0);
+	} else if (pid == -1) {
+fork_failed:
+		mslog(s, NULL, LOG_ERR, "fork failed");
+		close(cmd_fd[0]);
+	} else { /* parent */
+		/* add_proc */
+		ctmp = add_worker_proc(s, pid, cmd_fd[0]);
+		if (ctmp == NULL) {
+			kill(pid, SIGTERM);
+			goto fork_failed;
+		}
+
+		ev_child_init(&ctmp->ev_child, worker_child_watcher_cb, pid, 0);
+		ev_child_start(loop, &ctmp->ev_child);
+	}
+	close(cmd_fd[1]);
+	close(fd);
+}
+
+static void listen_watcher_cb (EV_P_ ev_io *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+	struct listener_st *ltmp = (struct listener_st *)w;
+	int fd;
+
+	if (ltmp->sock_type == SOCK_TYPE_TCP || ltmp->sock_type == SOCK_TYPE_UNIX) {
+		/* connection on TCP port */
+		fd = accept_client(s, ltmp, 0);
+		if (fd < 0)
+			return;
+
+		serve_connection(s, fd, ltmp->sock_type);
 	} else if (ltmp->sock_type == SOCK_TYPE_UDP) {
 		/* connection on UDP port */
 		forward_udp_to_owner(s, ltmp);
@@ -1218,7 +1620,7 @@ static void perform_maintenance(main_server_st *s)
 
 	/* Check if we need to expire any data */
 	mslog(s, NULL, LOG_DEBUG, "performing maintenance (banned IPs: %d)", main_ban_db_elems(s));
-	cleanup_banned_entries(s);
+	icmp_ping_expire();
 	clear_old_configs(s->vconfig);
 
 	list_for_each_rev(s->vconfig, vhost, list) {
@@ -1233,6 +1635,15 @@ static void maintenance_watcher_cb(EV_P_ ev_timer *w, int revents)
 	perform_maintenance(s);
 }
 
+static void expire_watcher_cb(EV_P_ ev_timer *w, int revents)
+{
+	main_server_st *s = ev_userdata(loop);
+
+	/* continue on the next loop iteration if entries remain */
+	if (cleanup_banned_entries(s) != 0)
+		ev_feed_event(loop, w, EV_TIMER);
+}
+
 static void maintenance_sig_watcher_cb(struct ev_loop *loop, ev_signal *w, int revents)
 {
 	main_server_st *s = ev_userdata(loop);
@@ -1255,6 +1666,7 @@ int main(int argc, char** argv)
 	int e;
 	struct listener_st *ltmp = NULL;
 	int ret, flags;
+	unsigned i;
 	char *p;
 	void *worker_pool;
 	void *main_pool, *config_pool;
@@ -1293,6 +1705,7 @@ int main(int argc, char** argv)
 
 	list_head_init(&s->proc_list.head);
 	list_head_init(&s->script_list.head);
+	list_head_init(&s->worker_pools);
 	ip_lease_init(&s->ip_leases);
 	proc_table_init(s);
 	main_ban_db_init(s);
@@ -1356,8 +1769,26 @@ int main(int argc, char** argv)
 	close(STDIN_FILENO);
 	close(STDOUT_FILENO);
 
+	if (GETCONFIG(s)->fw_backend == FW_BACKEND_NFTABLES && fw_init(s) < 0) {
+		mslog(s, NULL, LOG_ERR, "Cannot initialize the nftables firewall");
+		exit(1);
+	}
+
+	if (GETCONFIG(s)->kernel_ban_filter && GETCONFIG(s)->max_ban_score > 0 && ban_filter_init(s) < 0)
+		mslog(s, NULL, LOG_WARNING, "Cannot attach the ban filter to the listening sockets; banned clients are rejected after accept()");
+
+	if (GETPCONFIG(s)->udp_steering && udp_steer_init(s) < 0)
+		mslog(s, NULL, LOG_WARNING, "Cannot steer the DTLS datagrams to the workers; they are received by main");
+
 	write_pid_file();
 
+	/* before forking sec-mod and the workers, which share it; the
+	 * spare slots cover the sessions being closed */
+	if (session_stats_init(GETCONFIG(s)->max_clients > 0 ?
+			       GETCONFIG(s)->max_clients + GETCONFIG(s)->max_clients/8 + 64 :
+			       SESSION_STATS_DEFAULT_SLOTS) < 0)
+		mslog(s, NULL, LOG_WARNING, "Cannot allocate the session counters; the workers send them to sec-mod periodically");
+
 	s->sec_mod_fd = run_sec_mod(s, &s->sec_mod_fd_sync);
 	ret = ctl_handler_init(s);
 	if (ret < 0) {
@@ -1434,9 +1865,10 @@ int main(int argc, char** argv)
 	ev_signal_set (&reload_sig_watcher, SIGHUP);
 	ev_signal_start (loop, &reload_sig_watcher);
 
-	/* set the standard fds we watch */
+	/* set the standard fds we watch; the sockets of the acceptor
+	 * shards are kept open for the shards restarted */
 	list_for_each(&s->listen_list.head, ltmp, list) {
-		if (ltmp->fd == -1) continue;
+		if (ltmp->fd == -1 || ltmp->shard != -1) continue;
 
 		ev_io_start (loop, &ltmp->io);
 	}
@@ -1454,11 +1886,29 @@ int main(int argc, char** argv)
 	ev_timer_set(&maintenance_watcher, MAIN_MAINTENANCE_TIME, MAIN_MAINTENANCE_TIME);
 	ev_timer_start(loop, &maintenance_watcher);
 
+	ev_init(&expire_watcher, expire_watcher_cb);
+	ev_timer_set(&expire_watcher, MAIN_EXPIRE_TIME, MAIN_EXPIRE_TIME);
+	ev_timer_start(loop, &expire_watcher);
+
 	/* allow forcing maintenance with SIGUSR2 */
 	ev_init (&maintenance_sig_watcher, maintenance_sig_watcher_cb);
 	ev_signal_set (&maintenance_sig_watcher, SIGUSR2);
 	ev_signal_start (loop, &maintenance_sig_watcher);
 
+	if (script_runner_init(s) < 0)
+		exit(1);
+
+	if (metrics_init(s) < 0)
+		mslog(s, NULL, LOG_WARNING, "Cannot serve the metrics; they remain available through occtl");
+
+	for (i = 0; i < GETPCONFIG(s)->worker_pool_size; i++) {
+		if (spawn_worker_pool(s) < 0)
+			exit(1);
+	}
+
+	if (GETPCONFIG(s)->acceptor_shards > 0 && acceptor_shards_init(s) < 0)
+		exit(1);
+
 	/* Main server loop */
 	ev_run (loop, 0);
 
@@ -1470,6 +1920,7 @@ int main(int argc, char** argv)
 	remove_pid_file();
 
 	clear_lists(s);
+	session_stats_deinit();
 	clear_vhosts(s->vconfig);
 	talloc_free(s->config_pool);
 	talloc_free(s->main_pool);
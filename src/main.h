@@ -33,6 +33,8 @@
 #include <sys/un.h>
 #include <sys/uio.h>
 #include <ev.h>
+#include <lat-hist.h>
+#include <session-stats.h>
 
 #include "vhost.h"
 
@@ -50,6 +52,8 @@ extern struct ev_loop *loop;
 extern ev_timer maintainance_watcher;
 
 #define MAIN_MAINTENANCE_TIME (900)
+/* the interval the expired ban entries are removed at */
+#define MAIN_EXPIRE_TIME (1)
 
 int cmd_parser (void *pool, int argc, char **argv, struct list_head *head);
 
@@ -63,6 +67,8 @@ struct listener_st {
 	socklen_t addr_len;
 	int family;
 	int protocol;
+	int shard; /* the acceptor shard serving it; -1 for main */
+	int steer_fd; /* the socket array of its group (udp-steering), or -1 */
 };
 
 struct listen_list_st {
@@ -71,13 +77,12 @@ struct listen_list_st {
 };
 
 struct script_wait_st {
-	/* must be first so that this structure can behave as ev_child */
-	struct ev_child ev_child;
-
 	struct list_node list;
 
-	pid_t pid;
-	struct proc_st* proc;
+	uint32_t id; /* as assigned by the script runner */
+	struct timespec start; /* CLOCK_MONOTONIC */
+	struct proc_st* proc; /* NULL once the session is removed */
+	ScriptRunMsg *next; /* disconnect script to run if the connect script succeeds */
 };
 
 /* Each worker process maps to a unique proc_st structure.
@@ -88,17 +93,39 @@ typedef struct proc_st {
 	struct ev_child ev_child;
 
 	struct list_node list;
+	uint64_t seq; /* the order of the session in the list; the
+		       * cursor of the paginated listings of occtl */
 	int fd; /* the command file descriptor */
 	pid_t pid;
 	time_t udp_fd_receive_time; /* when the corresponding process has received a UDP fd */
+
+	/* With udp-steering: the slot of the worker's UDP socket in the
+	 * socket array of its listener, or zero, and the client address
+	 * its datagrams are steered by */
+	uint32_t udp_slot;
+	int udp_steer_fd; /* the socket array */
+	struct sockaddr_storage udp_peer;
+	socklen_t udp_peer_len;
 	
 	time_t conn_time; /* the time the user connected */
+	/* when the cookie authentication request was received, and
+	 * when the lease allocation started (CLOCK_MONOTONIC) */
+	struct timespec auth_start;
+	struct timespec lease_start;
 
 	/* the tun lease this process has */
 	struct tun_lease_st tun_lease;
 	struct ip_lease_st *ipv4;
 	struct ip_lease_st *ipv6;
+	unsigned vpn_ip_indexed; /* PROC_VPN_ */
+
+	/* the other sessions of the user and of the group, in proc_table */
+	struct list_node user_list;
+	struct list_node group_list;
+	struct proc_name_st *user_entry;
+	struct proc_name_st *group_entry;
 	unsigned leases_in_use; /* someone else got our IP leases */
+	unsigned leases_replaced; /* the leased addresses found in use by a host */
 
 	struct sockaddr_storage remote_addr; /* peer address (CSTP) */
 	socklen_t remote_addr_len;
@@ -149,8 +176,13 @@ typedef struct proc_st {
 	uint64_t bytes_in;
 	uint64_t bytes_out;
 	uint32_t discon_reason; /* filled on session close */
+
+	/* the slot of the worker's live counters; gen is zero without one */
+	unsigned stats_slot;
+	uint32_t stats_gen;
 	
 	unsigned applied_iroutes; /* whether the iroutes in the config have been successfully applied */
+	unsigned applied_fw; /* whether the firewall rules of the session are in the nftables table */
 
 	/* The following we rely on talloc for deallocation */
 	GroupCfgSt *config; /* custom user/group config */
@@ -158,15 +190,42 @@ typedef struct proc_st {
 	/* pointer to perm_cfg - set after we know the virtual host. As
 	 * vhosts never get deleted, this pointer is always valid */
 	vhost_cfg_st *vhost;
+
+	/* set if the session is served by a pool worker; pid is then
+	 * the pool's, and pool_id identifies the session */
+	struct worker_pool_st *pool;
+	uint32_t pool_id;
 } proc_st;
 
+/* The identifier of the session shown to the administrator */
+#define PROC_ID(proc) ((proc)->pool ? (proc)->pool_id : (uint32_t)(proc)->pid)
+
+/* Pool session identifiers start above the largest Linux PID so that
+ * they can be used interchangeably with the PIDs of other workers */
+#define POOL_ID_BASE (1U<<22)
+
+/* A worker process serving multiple sessions (worker-pool-size) */
+typedef struct worker_pool_st {
+	/* This is first so this structure can behave as an ev_child */
+	struct ev_child ev_child;
+
+	struct list_node list;
+	pid_t pid;
+	int ctl_fd; /* new sessions are sent over it */
+	unsigned sessions; /* the number of sessions it serves */
+	unsigned draining; /* set on reload; no new sessions are sent to it */
+	unsigned exited;
+} worker_pool_st;
+
 struct ip_lease_db_st {
 	struct htable ht;
+	struct list_head pools; /* the free addresses of each network */
 };
 
 struct proc_list_st {
-	struct list_head head;
+	struct list_head head; /* newest first */
 	unsigned int total;
+	uint64_t seq; /* the sequence number of the last entry added */
 };
 
 struct script_list_st {
@@ -178,9 +237,18 @@ struct proc_hash_db_st {
 	struct htable *db_dtls_ip;
 	struct htable *db_dtls_id;
 	struct htable *db_sid;
+	struct htable *db_username;
+	struct htable *db_groupname;
+	/* the VPN addresses of the connected sessions */
+	struct htable *db_vpn_ipv4;
+	struct htable *db_vpn_ipv6;
 	unsigned total;
 };
 
+/* the VPN addresses of a session in the proc_hash_db_st tables */
+#define PROC_VPN_IPV4 1
+#define PROC_VPN_IPV6 (1<<1)
+
 struct main_stats_st {
 	uint64_t session_timeouts; /* sessions with timeout */
 	uint64_t session_idle_timeouts; /* sessions with idle timeout */
@@ -188,6 +256,11 @@ struct main_stats_st {
 	uint64_t sessions_closed; /* sessions closed since last reset */
 	uint64_t kbytes_in;
 	uint64_t kbytes_out;
+	/* packets of closed sessions sent compressed, not compressed
+	 * and not tried */
+	uint64_t comp_hits;
+	uint64_t comp_misses;
+	uint64_t comp_skipped;
 	unsigned min_mtu;
 	unsigned max_mtu;
 
@@ -204,8 +277,8 @@ struct main_stats_st {
 	uint32_t avg_session_mins; /* in minutes */
 	uint32_t max_session_mins;
 	uint64_t auth_failures; /* authentication failures */
-
 	/* These are counted since start time */
+	lat_hist_st latency[LAT_STAGES]; /* the durations of the connection stages */
 	uint64_t total_auth_failures; /* authentication failures since start_time */
 	uint64_t total_sessions_closed; /* sessions closed since start_time */
 };
@@ -216,11 +289,14 @@ typedef struct main_server_st {
 
 	struct ip_lease_db_st ip_leases;
 
-	struct htable *ban_db;
+	struct ban_db_st *ban_db;
 
 	struct listen_list_st listen_list;
 	struct proc_list_st proc_list;
 	struct script_list_st script_list;
+	/* the worker processes serving multiple sessions */
+	struct list_head worker_pools;
+	uint32_t next_pool_id;
 	/* maps DTLS session IDs to proc entries */
 	struct proc_hash_db_st proc_table;
 	
@@ -246,12 +322,43 @@ typedef struct main_server_st {
 	void *main_pool; /* talloc main pool */
 	void *config_pool; /* talloc config pool */
 
-	/* used as temporary buffer (currently by forward_udp_to_owner) */
+	/* used as temporary buffer (currently by udp_dgram_recv) */
 	uint8_t msg_buffer[MAX_MSG_SIZE];
 } main_server_st;
 
 void clear_lists(main_server_st *s);
 
+int accept_client(main_server_st *s, struct listener_st *ltmp, unsigned is_shard);
+void run_worker(main_server_st *s, int fd, int cmd_fd, sock_type_t stype, unsigned is_shard) __attribute__((noreturn));
+struct proc_st *add_worker_proc(main_server_st *s, pid_t pid, int cmd_fd);
+void serve_connection(main_server_st *s, int fd, sock_type_t stype);
+
+/* A datagram received on a UDP listener */
+typedef struct udp_dgram_st {
+	struct sockaddr_storage cli_addr;
+	socklen_t cli_addr_size;
+	struct sockaddr_storage our_addr;
+	socklen_t our_addr_size;
+	uint8_t *data;
+	size_t data_size;
+	uint8_t *session_id; /* the DTLS session ID, in data */
+	int session_id_size;
+	unsigned match_ip_only; /* not a client hello; the owner is found by IP */
+	unsigned hello_session_id; /* the session ID is the hello's, not an extension's */
+} udp_dgram_st;
+
+int udp_dgram_recv(main_server_st *s, int fd, udp_dgram_st *d);
+int udp_dgram_socket(main_server_st *s, struct listener_st *listener, udp_dgram_st *d);
+void udp_dgram_forward(main_server_st *s, udp_dgram_st *d,
+		       struct listener_st *listener, int sfd);
+
+/* main-udp-steer.c */
+int udp_steer_init(main_server_st *s);
+void udp_steer_deinit(main_server_st *s);
+int udp_steer_socket(main_server_st *s, struct proc_st *proc,
+		     struct listener_st *listener, udp_dgram_st *d);
+void udp_steer_remove(main_server_st *s, struct proc_st *proc);
+
 int handle_worker_commands(main_server_st *s, struct proc_st* cur);
 int handle_sec_mod_commands(main_server_st *s);
 
@@ -302,6 +409,7 @@ int handle_auth_cookie_req(main_server_st* s, struct proc_st* proc,
 
 int check_multiple_users(main_server_st *s, struct proc_st* proc);
 int handle_script_exit(main_server_st *s, struct proc_st* proc, int code);
+int handle_lease_probe_res(main_server_st *s, struct proc_st *proc, int result);
 
 int run_sec_mod(main_server_st * s, int *sync_fd);
 
@@ -317,13 +425,15 @@ struct proc_st *new_proc(main_server_st * s, pid_t pid, int cmd_fd,
 
 void remove_proc(main_server_st* s, struct proc_st *proc, unsigned flags);
 void proc_to_zombie(main_server_st* s, struct proc_st *proc);
+void kill_proc(main_server_st* s, struct proc_st *proc);
+void worker_pool_put(main_server_st* s, struct worker_pool_st *pool);
 
 inline static void terminate_proc(main_server_st *s, proc_st *proc)
 {
 	/* if it has an IP, send a signal so that we cleanup
 	 * and get stats properly */
 	if (proc->pid != -1 && proc->pid != 0)
-                kill(proc->pid, SIGTERM);
+                kill_proc(s, proc);
 	else
 		remove_proc(s, proc, RPROC_KILL);
 }
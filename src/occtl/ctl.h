@@ -16,6 +16,8 @@ enum {
 	CTL_CMD_UNBAN_IP,
 	CTL_CMD_TOP,
 	CTL_CMD_LIST_COOKIES,
+	CTL_CMD_LIST_PAGE,
+	CTL_CMD_DISCONNECT_BATCH,
 
 	CTL_CMD_STATUS_REP = 101,
 	CTL_CMD_RELOAD_REP,
@@ -26,7 +28,9 @@ enum {
 	CTL_CMD_UNBAN_IP_REP,
 	CTL_CMD_LIST_BANNED_REP,
 	CTL_CMD_TOP_UPDATE_REP,
-	CTL_CMD_LIST_COOKIES_REP
+	CTL_CMD_LIST_COOKIES_REP,
+	CTL_CMD_LIST_PAGE_REP,
+	CTL_CMD_DISCONNECT_BATCH_REP
 };
 
 #endif
@@ -47,8 +47,14 @@ typedef struct {
 	{name, sizeof(name)-1, arg, func, doc, show, npc}
 
 static const commands_st commands[] = {
+	ENTRY("disconnect users", "[NAMES]", handle_disconnect_users_cmd,
+	      "Disconnect the specified users", 1, 1),
 	ENTRY("disconnect user", "[NAME]", handle_disconnect_user_cmd,
 	      "Disconnect the specified user", 1, 1),
+	ENTRY("disconnect group", "[NAMES]", handle_disconnect_group_cmd,
+	      "Disconnect the users of the specified groups", 1, 1),
+	ENTRY("disconnect vpn-ip", "[IP]", handle_disconnect_vpn_ip_cmd,
+	      "Disconnect the users assigned the specified VPN IPs", 1, 1),
 	ENTRY("disconnect id", "[ID]", handle_disconnect_id_cmd,
 	      "Disconnect the specified ID", 1, 1),
 	ENTRY("unban ip", "[IP]", handle_unban_ip_cmd,
@@ -57,13 +63,13 @@ static const commands_st commands[] = {
 	      "Reloads the server configuration", 1, 1),
 	ENTRY("show status", NULL, handle_status_cmd,
 	      "Prints the status and statistics of the server", 1, 1),
-	ENTRY("show users", NULL, handle_list_users_cmd,
-	      "Prints the connected users", 1, 1),
+	ENTRY("show users", "[FILTERS]", handle_list_users_cmd,
+	      "Prints the connected users, filtered by user, group, vhost or ip", 1, 1),
 	ENTRY("show ip bans", NULL, handle_list_banned_ips_cmd,
 	      "Prints the banned IP addresses", 1, 1),
 	ENTRY("show ip ban points", NULL, handle_list_banned_points_cmd,
 	      "Prints all the known IP addresses which have points", 1, 1),
-	ENTRY("show iroutes", NULL, handle_list_iroutes_cmd,
+	ENTRY("show iroutes", "[FILTERS]", handle_list_iroutes_cmd,
 	      "Prints the routes provided by users of the server", 1, 1),
 	ENTRY("show sessions all", NULL, handle_list_all_sessions_cmd,
 	      "Prints all the session IDs", 1, 1),
@@ -93,6 +93,9 @@ int handle_list_banned_points_cmd(CONN_TYPE * conn, const char *arg, cmd_params_
 int handle_show_user_cmd(CONN_TYPE * conn, const char *arg, cmd_params_st *params);
 int handle_show_id_cmd(CONN_TYPE * conn, const char *arg, cmd_params_st *params);
 int handle_disconnect_user_cmd(CONN_TYPE * conn, const char *arg, cmd_params_st *params);
+int handle_disconnect_users_cmd(CONN_TYPE * conn, const char *arg, cmd_params_st *params);
+int handle_disconnect_group_cmd(CONN_TYPE * conn, const char *arg, cmd_params_st *params);
+int handle_disconnect_vpn_ip_cmd(CONN_TYPE * conn, const char *arg, cmd_params_st *params);
 int handle_unban_ip_cmd(CONN_TYPE * conn, const char *arg, cmd_params_st *params);
 int handle_disconnect_id_cmd(CONN_TYPE * conn, const char *arg, cmd_params_st *params);
 int handle_reload_cmd(CONN_TYPE * conn, const char *arg, cmd_params_st *params);
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <signal.h>
 #include <c-ctype.h>
@@ -72,6 +73,8 @@ static uint8_t msg_map[] = {
         [CTL_CMD_RELOAD] = CTL_CMD_RELOAD_REP,
         [CTL_CMD_STOP] = CTL_CMD_STOP_REP,
         [CTL_CMD_LIST] = CTL_CMD_LIST_REP,
+        [CTL_CMD_LIST_PAGE] = CTL_CMD_LIST_PAGE_REP,
+        [CTL_CMD_DISCONNECT_BATCH] = CTL_CMD_DISCONNECT_BATCH_REP,
         [CTL_CMD_LIST_COOKIES] = CTL_CMD_LIST_COOKIES_REP,
         [CTL_CMD_LIST_BANNED] = CTL_CMD_LIST_BANNED_REP,
         [CTL_CMD_USER_INFO] = CTL_CMD_LIST_REP,
@@ -99,66 +102,68 @@ static void init_reply(struct cmd_reply_st *rep)
 		rep->data = NULL;
 }
 
-/* sends a message and returns the reply */
+/* receives a reply to cmd; the replies after the first of the
+ * commands answered in multiple messages are received with it too */
 static
-int send_cmd(struct unix_ctx *ctx, unsigned cmd, const void *data,
-		 pack_size_func get_size, pack_func pack,
-		 struct cmd_reply_st *rep)
+int recv_reply(struct unix_ctx *ctx, unsigned cmd, struct cmd_reply_st *rep)
 {
 	int e, ret;
 	uint32_t length32 = 0;
-	void *packed = NULL;
 	uint8_t rcmd;
 
-	ret = send_msg(ctx, ctx->fd, cmd, data, get_size, pack);
+	ret = recv_msg_headers(ctx->fd, &rcmd, DEFAULT_TIMEOUT);
 	if (ret < 0) {
-		e = errno;
-		fprintf(stderr, "writev: %s\n", strerror(e));
-		ret = -1;
-		goto fail;
+		/*e = errno;
+		fprintf(stderr, "read: %s\n", strerror(e));*/
+		return -1;
 	}
 
-	if (rep != NULL) {
-		ret = recv_msg_headers(ctx->fd, &rcmd, DEFAULT_TIMEOUT);
-		if (ret < 0) {
-			/*e = errno;
-			fprintf(stderr, "read: %s\n", strerror(e));*/
-			ret = -1;
-			goto fail;
-		}
+	rep->cmd = rcmd;
+	length32 = ret;
 
-		rep->cmd = rcmd;
-		length32 = ret;
+	if (msg_map[cmd] != rep->cmd) {
+		fprintf(stderr, "Unexpected message '%d', expected '%d'\n", (int)rep->cmd, (int)msg_map[cmd]);
+		return -1;
+	}
 
-		if (msg_map[cmd] != rep->cmd) {
-			fprintf(stderr, "Unexpected message '%d', expected '%d'\n", (int)rep->cmd, (int)msg_map[cmd]);
-			ret = -1;
-			goto fail;
-		}
+	rep->data_size = length32;
+	rep->data = talloc_size(ctx, length32);
+	if (rep->data == NULL) {
+		fprintf(stderr, "memory error\n");
+		return -1;
+	}
 
-		rep->data_size = length32;
-		rep->data = talloc_size(ctx, length32);
-		if (rep->data == NULL) {
-			fprintf(stderr, "memory error\n");
-			ret = -1;
-			goto fail;
-		}
+	ret = force_read_timeout(ctx->fd, rep->data, length32, DEFAULT_TIMEOUT);
+	if (ret == -1) {
+		e = errno;
+		talloc_free(rep->data);
+		rep->data = NULL;
+		fprintf(stderr, "read: %s\n", strerror(e));
+		return -1;
+	}
 
-		ret = force_read_timeout(ctx->fd, rep->data, length32, DEFAULT_TIMEOUT);
-		if (ret == -1) {
-			e = errno;
-			talloc_free(rep->data);
-			rep->data = NULL;
-			fprintf(stderr, "read: %s\n", strerror(e));
-			ret = -1;
-			goto fail;
-		}
+	return 0;
+}
+
+/* sends a message and returns the reply */
+static
+int send_cmd(struct unix_ctx *ctx, unsigned cmd, const void *data,
+		 pack_size_func get_size, pack_func pack,
+		 struct cmd_reply_st *rep)
+{
+	int e, ret;
+
+	ret = send_msg(ctx, ctx->fd, cmd, data, get_size, pack);
+	if (ret < 0) {
+		e = errno;
+		fprintf(stderr, "writev: %s\n", strerror(e));
+		return -1;
 	}
 
-	ret = 0;
- fail:
-	talloc_free(packed);
-	return ret;
+	if (rep != NULL)
+		return recv_reply(ctx, cmd, rep);
+
+	return 0;
 }
 
 static
@@ -197,6 +202,66 @@ error:
 
 }
 
+static void print_usecs(char *buf, size_t size, uint64_t us)
+{
+	if (us < 1000)
+		snprintf(buf, size, "%uus", (unsigned)us);
+	else if (us < 1000000)
+		snprintf(buf, size, "%.1fms", us / 1000.0);
+	else
+		snprintf(buf, size, "%.1fs", us / 1000000.0);
+}
+
+static void print_latency(FILE *out, cmd_params_st *params, const LatencyRep *l)
+{
+	char name[64];
+	char buf[MAX_TMPSTR_SIZE];
+	char p50[16], p90[16], p99[16];
+
+	print_usecs(p50, sizeof(p50), l->p50);
+	print_usecs(p90, sizeof(p90), l->p90);
+	print_usecs(p99, sizeof(p99), l->p99);
+
+	snprintf(name, sizeof(name), "Latency of %s", l->stage);
+	snprintf(buf, sizeof(buf), "%"PRIu64", p50: %s, p90: %s, p99: %s",
+		 l->count, p50, p90, p99);
+
+	print_single_value(out, params, name, buf, 1);
+}
+
+/* The live counters of a session, as published by its worker */
+static void print_session_stats(FILE *out, cmd_params_st *params, const UserInfoRep *u)
+{
+	char buf1[32], buf2[32];
+
+	bytes2human(u->bytes_in, buf1, sizeof(buf1), "");
+	bytes2human(u->bytes_out, buf2, sizeof(buf2), "");
+	print_pair_value(out, params, "Session RX", buf1, "TX", buf2, 1);
+
+	snprintf(buf1, sizeof(buf1), "%"PRIu64, u->packets_in);
+	snprintf(buf2, sizeof(buf2), "%"PRIu64, u->packets_out);
+	print_pair_value(out, params, "Packets RX", buf1, "TX", buf2, 1);
+
+	print_single_value_int(out, params, "Dropped packets", u->drops, 1);
+
+	if (u->has_comp_ratio) {
+		snprintf(buf1, sizeof(buf1), "%u%%", u->comp_ratio * 100 / 1024);
+		print_single_value(out, params, "Compressed size", buf1, 1);
+	}
+
+	print_single_value(out, params, "UDP channel", u->udp_state, 1);
+
+	if (u->has_tcp_rtt_us || u->has_dtls_rtt_us) {
+		strlcpy(buf1, "-", sizeof(buf1));
+		strlcpy(buf2, "-", sizeof(buf2));
+		if (u->has_tcp_rtt_us)
+			print_usecs(buf1, sizeof(buf1), u->tcp_rtt_us);
+		if (u->has_dtls_rtt_us)
+			print_usecs(buf2, sizeof(buf2), u->dtls_rtt_us);
+		print_pair_value(out, params, "TCP RTT", buf1, "DTLS RTT", buf2, 1);
+	}
+}
+
 int handle_status_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *params)
 {
 	int ret;
@@ -206,6 +271,7 @@ int handle_status_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *para
 	char buf[MAX_TMPSTR_SIZE];
 	time_t t;
 	struct tm *tm;
+	unsigned i;
 	PROTOBUF_ALLOCATOR(pa, ctx);
 
 	init_reply(&raw);
@@ -251,6 +317,11 @@ int handle_status_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *para
 			print_single_value_int(stdout, params, "TLS DB entries", rep->stored_tls_sessions, 1);
 		}
 
+		/* the number of samples and the quantiles of the durations
+		 * of the connection stages */
+		for (i = 0; i < rep->n_latency; i++)
+			print_latency(stdout, params, rep->latency[i]);
+
 		print_separator(stdout, params);
 		if (NO_JSON(params))
 			printf("Current stats period:\n");
@@ -287,6 +358,12 @@ int handle_status_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *para
 		bytes2human(rep->kbytes_out*1000, buf, sizeof(buf), "");
 		print_single_value(stdout, params, "TX", buf, 1);
 
+		if (rep->comp_hits + rep->comp_misses + rep->comp_skipped > 0) {
+			print_single_value_int(stdout, params, "Compressed packets", rep->comp_hits, 1);
+			print_single_value_int(stdout, params, "Uncompressible packets", rep->comp_misses, 1);
+			print_single_value_int(stdout, params, "Not compressed packets", rep->comp_skipped, 1);
+		}
+
 		if (rep->min_mtu > 0)
 			print_single_value_int(stdout, params, "Min MTU", rep->min_mtu, 1);
 		if (rep->max_mtu > 0)
@@ -509,6 +586,128 @@ int handle_disconnect_user_cmd(struct unix_ctx *ctx, const char *arg, cmd_params
 	return ret;
 }
 
+enum {
+	DISCONNECT_USERS,
+	DISCONNECT_GROUPS,
+	DISCONNECT_VPN_IPS,
+};
+
+/* Disconnects, with a single request, the users, the groups or the
+ * VPN addresses listed in arg */
+static
+int handle_disconnect_batch_cmd(struct unix_ctx *ctx, const char *arg, unsigned type)
+{
+	int ret;
+	struct cmd_reply_st raw;
+	DisconnectBatchRep *rep;
+	DisconnectBatchReq req = DISCONNECT_BATCH_REQ__INIT;
+	char *str, *name, **names, *save = NULL;
+	ProtobufCBinaryData *ips;
+	unsigned n = 0, disconnected;
+	void *pool;
+	PROTOBUF_ALLOCATOR(pa, ctx);
+
+	if (arg == NULL || need_help(arg)) {
+		check_cmd_help(rl_line_buffer);
+		return 1;
+	}
+
+	pool = talloc_new(ctx);
+	if (pool == NULL)
+		return 1;
+
+	str = talloc_strdup(pool, arg);
+	names = talloc_array(pool, char *, strlen(arg));
+	ips = talloc_array(pool, ProtobufCBinaryData, strlen(arg));
+	if (str == NULL || names == NULL || ips == NULL) {
+		talloc_free(pool);
+		return 1;
+	}
+
+	for (name = strtok_r(str, " \t", &save); name != NULL;
+	     name = strtok_r(NULL, " \t", &save)) {
+		if (type == DISCONNECT_VPN_IPS) {
+			ips[n].data = talloc_size(pool, sizeof(struct in6_addr));
+			if (ips[n].data == NULL) {
+				talloc_free(pool);
+				return 1;
+			}
+
+			if (inet_pton(AF_INET, name, ips[n].data) == 1)
+				ips[n].len = 4;
+			else if (inet_pton(AF_INET6, name, ips[n].data) == 1)
+				ips[n].len = 16;
+			else {
+				fprintf(stderr, "cannot parse IP: %s\n", name);
+				talloc_free(pool);
+				return 1;
+			}
+		}
+		names[n++] = name;
+	}
+
+	if (type == DISCONNECT_USERS) {
+		req.username = names;
+		req.n_username = n;
+	} else if (type == DISCONNECT_GROUPS) {
+		req.groupname = names;
+		req.n_groupname = n;
+	} else {
+		req.ip = ips;
+		req.n_ip = n;
+	}
+
+	init_reply(&raw);
+
+	ret = send_cmd(ctx, CTL_CMD_DISCONNECT_BATCH, &req,
+		(pack_size_func)disconnect_batch_req__get_packed_size,
+		(pack_func)disconnect_batch_req__pack, &raw);
+	if (ret < 0) {
+		goto error;
+	}
+
+	rep = disconnect_batch_rep__unpack(&pa, raw.data_size, raw.data);
+	if (rep == NULL)
+		goto error;
+
+	disconnected = rep->disconnected;
+	disconnect_batch_rep__free_unpacked(rep, &pa);
+
+	if (disconnected != 0) {
+		printf("%u sessions were disconnected\n", disconnected);
+		ret = 0;
+	} else {
+		printf("could not find any sessions of '%s'\n", arg);
+		ret = 1;
+	}
+
+	goto cleanup;
+
+ error:
+	fprintf(stderr, ERR_SERVER_UNREACHABLE);
+	ret = 1;
+ cleanup:
+	free_reply(&raw);
+	talloc_free(pool);
+
+	return ret;
+}
+
+int handle_disconnect_users_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *params)
+{
+	return handle_disconnect_batch_cmd(ctx, arg, DISCONNECT_USERS);
+}
+
+int handle_disconnect_group_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *params)
+{
+	return handle_disconnect_batch_cmd(ctx, arg, DISCONNECT_GROUPS);
+}
+
+int handle_disconnect_vpn_ip_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *params)
+{
+	return handle_disconnect_batch_cmd(ctx, arg, DISCONNECT_VPN_IPS);
+}
+
 int handle_disconnect_id_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *params)
 {
 	int ret;
@@ -627,26 +826,143 @@ void common_user_list(struct unix_ctx *ctx, UserListRep *rep, FILE *out, cmd_par
 	}
 }
 
+/* Parses the filters of the user listings, i.e., any of
+ * "user NAME", "group NAME", "vhost NAME" and "ip ADDR[/PREFIX]",
+ * into req. */
+static int parse_list_filters(void *pool, const char *arg, UserListReq *req)
+{
+	char *str, *name, *val, *p, *save = NULL;
+	uint8_t *ip;
+
+	if (arg == NULL || arg[0] == 0)
+		return 0;
+
+	str = talloc_strdup(pool, arg);
+	if (str == NULL)
+		return -1;
+
+	for (name = strtok_r(str, " \t", &save); name != NULL;
+	     name = strtok_r(NULL, " \t", &save)) {
+		val = strtok_r(NULL, " \t", &save);
+		if (val == NULL)
+			return -1;
+
+		if (c_strcasecmp(name, "user") == 0) {
+			req->username = val;
+		} else if (c_strcasecmp(name, "group") == 0) {
+			req->groupname = val;
+		} else if (c_strcasecmp(name, "vhost") == 0) {
+			req->vhost = val;
+		} else if (c_strcasecmp(name, "ip") == 0) {
+			p = strchr(val, '/');
+			if (p != NULL) {
+				*p = 0;
+				req->has_ip_prefix = 1;
+				req->ip_prefix = atoi(p+1);
+			}
+
+			ip = talloc_size(pool, sizeof(struct in6_addr));
+			if (ip == NULL)
+				return -1;
+
+			if (inet_pton(AF_INET, val, ip) == 1)
+				req->ip.len = 4;
+			else if (inet_pton(AF_INET6, val, ip) == 1)
+				req->ip.len = 16;
+			else
+				return -1;
+
+			req->ip.data = ip;
+			req->has_ip = 1;
+		} else {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Receives the users matching req, which main sends in pages,
+ * as a single list allocated in pool. */
+static UserListRep *list_users(struct unix_ctx *ctx, void *pool, UserListReq *req)
+{
+	struct cmd_reply_st raw;
+	UserListRep *rep, *page;
+	PROTOBUF_ALLOCATOR(pa, pool);
+	int ret;
+
+	rep = talloc(pool, UserListRep);
+	if (rep == NULL)
+		return NULL;
+	user_list_rep__init(rep);
+
+	init_reply(&raw);
+
+	ret = send_cmd(ctx, CTL_CMD_LIST_PAGE, req,
+		(pack_size_func)user_list_req__get_packed_size,
+		(pack_func)user_list_req__pack, &raw);
+
+	for (;;) {
+		if (ret < 0)
+			return NULL;
+
+		page = user_list_rep__unpack(&pa, raw.data_size, raw.data);
+		free_reply(&raw);
+		if (page == NULL)
+			return NULL;
+
+		if (page->n_user > 0) {
+			rep->user = talloc_realloc(pool, rep->user, UserInfoRep *,
+						   rep->n_user + page->n_user);
+			if (rep->user == NULL)
+				return NULL;
+
+			memcpy(&rep->user[rep->n_user], page->user,
+			       page->n_user * sizeof(UserInfoRep *));
+			rep->n_user += page->n_user;
+		}
+
+		if (!page->has_cursor)
+			break;
+
+		ret = recv_reply(ctx, CTL_CMD_LIST_PAGE, &raw);
+	}
+
+	return rep;
+}
+
 int handle_list_users_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *params)
 {
 	int ret;
-	struct cmd_reply_st raw;
-	UserListRep *rep = NULL;
+	UserListReq req = USER_LIST_REQ__INIT;
+	UserListRep *rep;
 	FILE *out;
-	PROTOBUF_ALLOCATOR(pa, ctx);
+	void *pool;
 
-	init_reply(&raw);
+	if (arg != NULL && arg[0] != 0 && need_help(arg)) {
+		check_cmd_help(rl_line_buffer);
+		return 1;
+	}
+
+	pool = talloc_new(ctx);
+	if (pool == NULL)
+		return 1;
+
+	if (parse_list_filters(pool, arg, &req) < 0) {
+		fprintf(stderr, "could not parse the filters '%s'\n", arg);
+		talloc_free(pool);
+		return 1;
+	}
 
 	entries_clear();
 
 	out = pager_start(params);
 
-	ret = send_cmd(ctx, CTL_CMD_LIST, NULL, NULL, NULL, &raw);
-	if (ret < 0) {
-		goto error;
-	}
+	/* the JSON output includes the routes and DNS servers */
+	req.has_brief = 1;
+	req.brief = NO_JSON(params);
 
-	rep = user_list_rep__unpack(&pa, raw.data_size, raw.data);
+	rep = list_users(ctx, pool, &req);
 	if (rep == NULL)
 		goto error;
 
@@ -660,10 +976,7 @@ int handle_list_users_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *
 	fprintf(stderr, ERR_SERVER_UNREACHABLE);
 
  cleanup:
-	if (rep != NULL)
-		user_list_rep__free_unpacked(rep, &pa);
-
-	free_reply(&raw);
+	talloc_free(pool);
 	pager_stop(out);
 
 	return ret;
@@ -834,25 +1147,33 @@ int handle_list_all_sessions_cmd(struct unix_ctx *ctx, const char *arg, cmd_para
 int handle_list_iroutes_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st *params)
 {
 	int ret;
-	struct cmd_reply_st raw;
-	UserListRep *rep = NULL;
+	UserListReq req = USER_LIST_REQ__INIT;
+	UserListRep *rep;
 	FILE *out;
 	unsigned i, j;
-	PROTOBUF_ALLOCATOR(pa, ctx);
+	void *pool;
 
-	init_reply(&raw);
+	if (arg != NULL && arg[0] != 0 && need_help(arg)) {
+		check_cmd_help(rl_line_buffer);
+		return 1;
+	}
+
+	pool = talloc_new(ctx);
+	if (pool == NULL)
+		return 1;
+
+	if (parse_list_filters(pool, arg, &req) < 0) {
+		fprintf(stderr, "could not parse the filters '%s'\n", arg);
+		talloc_free(pool);
+		return 1;
+	}
 
 	entries_clear();
 
 	out = pager_start(params);
 
 	/* get all user info */
-	ret = send_cmd(ctx, CTL_CMD_LIST, NULL, NULL, NULL, &raw);
-	if (ret < 0) {
-		goto error;
-	}
-
-	rep = user_list_rep__unpack(&pa, raw.data_size, raw.data);
+	rep = list_users(ctx, pool, &req);
 	if (rep == NULL)
 		goto error;
 
@@ -908,10 +1229,7 @@ int handle_list_iroutes_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st
 	fprintf(stderr, ERR_SERVER_UNREACHABLE);
 
  cleanup:
-	if (rep != NULL)
-		user_list_rep__free_unpacked(rep, &pa);
-
-	free_reply(&raw);
+	talloc_free(pool);
 	pager_stop(out);
 
 	return ret;
@@ -960,6 +1278,9 @@ int handle_list_banned_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st
 			tmp_str = inet_ntop(AF_INET, rep->info[i]->ip.data, txt_ip, sizeof(txt_ip));
 		if (tmp_str == NULL)
 			strlcpy(txt_ip, "(unknown)", sizeof(txt_ip));
+		else if (rep->info[i]->has_prefix)
+			snprintf(txt_ip + strlen(txt_ip), sizeof(txt_ip) - strlen(txt_ip),
+				 "/%u", (unsigned)rep->info[i]->prefix);
 
 		/* add header */
 		if (points == 0) {
@@ -1005,7 +1326,9 @@ int handle_list_banned_cmd(struct unix_ctx *ctx, const char *arg, cmd_params_st
 
 		print_end_block(out, params, i<(rep->n_info-1)?1:0);
 
-		ip_entries_add(ctx, txt_ip, strlen(txt_ip));
+		/* the prefixes are unbanned by the addresses in them */
+		if (!rep->info[i]->has_prefix)
+			ip_entries_add(ctx, txt_ip, strlen(txt_ip));
 	}
 
 	print_end_array_block(out, params);
@@ -1132,6 +1455,9 @@ int common_info_cmd(UserListRep * args, FILE *out, cmd_params_st *params)
 
 		print_iface_stats(args->user[i]->tun, args->user[i]->conn_time, out, params, 1);
 
+		if (args->user[i]->has_bytes_in)
+			print_session_stats(out, params, args->user[i]);
+
 		print_pair_value(out, params, "DPD", int2str(tmpbuf, args->user[i]->dpd), "KeepAlive", int2str(tmpbuf2, args->user[i]->keepalive), 1);
 
 		print_single_value(out, params, "Hostname", args->user[i]->hostname, 1);
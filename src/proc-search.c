@@ -20,6 +20,7 @@
 #include <stdio.h>
 
 #include <proc-search.h>
+#include <ip-lease.h>
 #include <main.h>
 #include <common.h>
 
@@ -38,6 +39,11 @@ struct find_sid_st {
 	const uint8_t *sid;
 };
 
+struct find_vpn_ip_st {
+	const uint8_t *ip;
+	unsigned ip_size;
+};
+
 
 static size_t rehash_ip(const void* _p, void* unused)
 {
@@ -71,38 +77,145 @@ static size_t rehash_sid(const void* _p, void* unused)
 	return hash_any(proc->sid, sizeof(proc->sid), 0);
 }
 
+/* The username and group tables hold an entry per name with the list
+ * of its sessions, so that the many sessions of a group do not share
+ * a hash value in the table. */
+struct proc_name_st {
+	char *name;
+	struct list_head procs;
+};
+
+static size_t rehash_name(const void* _e, void* unused)
+{
+	const struct proc_name_st * e = _e;
+
+	return hash_any(e->name, strlen(e->name), 0);
+}
+
+static bool name_cmp(const void* _c1, void* _c2)
+{
+	const struct proc_name_st* c1 = _c1;
+	const char* c2 = _c2;
+
+	return strcmp(c1->name, c2) == 0;
+}
+
+static struct proc_name_st *name_get(struct htable *db, const char *name)
+{
+	return htable_get(db, hash_any(name, strlen(name), 0), name_cmp, (void*)name);
+}
+
+/* Adds node to the list of name, and returns the entry of name. The
+ * entries are allocated under the table, and freed with it. */
+static struct proc_name_st *name_add(struct htable *db, const char *name,
+				     struct list_node *node)
+{
+	struct proc_name_st *e;
+
+	e = name_get(db, name);
+	if (e == NULL) {
+		e = talloc(db, struct proc_name_st);
+		if (e == NULL)
+			return NULL;
+
+		e->name = talloc_strdup(e, name);
+		if (e->name == NULL) {
+			talloc_free(e);
+			return NULL;
+		}
+		list_head_init(&e->procs);
+
+		if (htable_add(db, rehash_name(e, NULL), e) == 0) {
+			talloc_free(e);
+			return NULL;
+		}
+	}
+
+	list_add_tail(&e->procs, node);
+	return e;
+}
+
+static void name_del(struct htable *db, struct proc_name_st *e,
+		     struct list_node *node)
+{
+	list_del(node);
+
+	if (list_empty(&e->procs)) {
+		htable_del(db, rehash_name(e, NULL), e);
+		talloc_free(e);
+	}
+}
+
+/* the VPN address tables only contain sessions with the
+ * corresponding lease; see proc_table_add_vpn_ip() */
+static size_t rehash_vpn_ipv4(const void* _p, void* unused)
+{
+	const struct proc_st * proc = _p;
+
+	return hash_any(SA_IN_U8_P(&proc->ipv4->rip), sizeof(struct in_addr), 0);
+}
+
+static size_t rehash_vpn_ipv6(const void* _p, void* unused)
+{
+	const struct proc_st * proc = _p;
+
+	return hash_any(SA_IN6_U8_P(&proc->ipv6->rip), sizeof(struct in6_addr), 0);
+}
+
 void proc_table_init(main_server_st *s)
 {
 	s->proc_table.db_ip = talloc(s, struct htable);
 	s->proc_table.db_dtls_ip = talloc(s, struct htable);
 	s->proc_table.db_dtls_id = talloc(s, struct htable);
 	s->proc_table.db_sid = talloc(s, struct htable);
+	s->proc_table.db_username = talloc(s, struct htable);
+	s->proc_table.db_groupname = talloc(s, struct htable);
+	s->proc_table.db_vpn_ipv4 = talloc(s, struct htable);
+	s->proc_table.db_vpn_ipv6 = talloc(s, struct htable);
 	htable_init(s->proc_table.db_ip, rehash_ip, NULL);
 	htable_init(s->proc_table.db_dtls_ip, rehash_dtls_ip, NULL);
 	htable_init(s->proc_table.db_dtls_id, rehash_dtls_id, NULL);
 	htable_init(s->proc_table.db_sid, rehash_sid, NULL);
+	htable_init(s->proc_table.db_username, rehash_name, NULL);
+	htable_init(s->proc_table.db_groupname, rehash_name, NULL);
+	htable_init(s->proc_table.db_vpn_ipv4, rehash_vpn_ipv4, NULL);
+	htable_init(s->proc_table.db_vpn_ipv6, rehash_vpn_ipv6, NULL);
 	s->proc_table.total = 0;
 }
 
 void proc_table_deinit(main_server_st *s)
 {
+	if (s->proc_table.db_ip == NULL)
+		return;
+
 	htable_clear(s->proc_table.db_ip);
 	htable_clear(s->proc_table.db_dtls_ip);
 	htable_clear(s->proc_table.db_dtls_id);
 	htable_clear(s->proc_table.db_sid);
+	htable_clear(s->proc_table.db_username);
+	htable_clear(s->proc_table.db_groupname);
+	htable_clear(s->proc_table.db_vpn_ipv4);
+	htable_clear(s->proc_table.db_vpn_ipv6);
 	talloc_free(s->proc_table.db_ip);
 	talloc_free(s->proc_table.db_dtls_ip);
 	talloc_free(s->proc_table.db_dtls_id);
 	talloc_free(s->proc_table.db_sid);
+	talloc_free(s->proc_table.db_username);
+	talloc_free(s->proc_table.db_groupname);
+	talloc_free(s->proc_table.db_vpn_ipv4);
+	talloc_free(s->proc_table.db_vpn_ipv6);
+	s->proc_table.db_ip = NULL;
 }
 
-/* Adds the IP of the CSTP channel into the IPs hash table and
- * the session ID into the IDs hash table.
+/* Adds the IP of the CSTP channel into the IPs hash table,
+ * the session ID into the IDs hash table, and the username and
+ * group into theirs.
  */
 int proc_table_add(main_server_st *s, struct proc_st *proc)
 {
 	size_t ip_hash = rehash_ip(proc, NULL);
 	size_t dtls_id_hash = rehash_dtls_id(proc, NULL);
+	size_t sid_hash = rehash_sid(proc, NULL);
 
 	if (htable_add(s->proc_table.db_ip, ip_hash, proc) == 0) {
 		return -1;
@@ -113,9 +226,27 @@ int proc_table_add(main_server_st *s, struct proc_st *proc)
 		return -1;
 	}
 
-	if (htable_add(s->proc_table.db_sid, rehash_sid(proc, NULL), proc) == 0) {
+	if (htable_add(s->proc_table.db_sid, sid_hash, proc) == 0) {
+		htable_del(s->proc_table.db_ip, ip_hash, proc);
+		htable_del(s->proc_table.db_dtls_id, dtls_id_hash, proc);
+		return -1;
+	}
+
+	proc->user_entry = name_add(s->proc_table.db_username, proc->username, &proc->user_list);
+	if (proc->user_entry == NULL) {
+		htable_del(s->proc_table.db_ip, ip_hash, proc);
+		htable_del(s->proc_table.db_dtls_id, dtls_id_hash, proc);
+		htable_del(s->proc_table.db_sid, sid_hash, proc);
+		return -1;
+	}
+
+	proc->group_entry = name_add(s->proc_table.db_groupname, proc->groupname, &proc->group_list);
+	if (proc->group_entry == NULL) {
 		htable_del(s->proc_table.db_ip, ip_hash, proc);
 		htable_del(s->proc_table.db_dtls_id, dtls_id_hash, proc);
+		htable_del(s->proc_table.db_sid, sid_hash, proc);
+		name_del(s->proc_table.db_username, proc->user_entry, &proc->user_list);
+		proc->user_entry = NULL;
 		return -1;
 	}
 
@@ -124,6 +255,43 @@ int proc_table_add(main_server_st *s, struct proc_st *proc)
 	return 0;
 }
 
+/* Adds the VPN addresses of the session into their hash tables. It is
+ * called once the session is connected, as the leases may be replaced
+ * until then; proc_table_del_vpn_ip() must be called before the leases
+ * are removed or handed to another session.
+ */
+int proc_table_add_vpn_ip(main_server_st *s, struct proc_st *proc)
+{
+	proc_table_del_vpn_ip(s, proc);
+
+	if (proc->ipv4 && proc->ipv4->rip_len == sizeof(struct sockaddr_in)) {
+		if (htable_add(s->proc_table.db_vpn_ipv4, rehash_vpn_ipv4(proc, NULL), proc) == 0)
+			return -1;
+		proc->vpn_ip_indexed |= PROC_VPN_IPV4;
+	}
+
+	if (proc->ipv6 && proc->ipv6->rip_len == sizeof(struct sockaddr_in6)) {
+		if (htable_add(s->proc_table.db_vpn_ipv6, rehash_vpn_ipv6(proc, NULL), proc) == 0) {
+			proc_table_del_vpn_ip(s, proc);
+			return -1;
+		}
+		proc->vpn_ip_indexed |= PROC_VPN_IPV6;
+	}
+
+	return 0;
+}
+
+void proc_table_del_vpn_ip(main_server_st *s, struct proc_st *proc)
+{
+	if (proc->vpn_ip_indexed & PROC_VPN_IPV4)
+		htable_del(s->proc_table.db_vpn_ipv4, rehash_vpn_ipv4(proc, NULL), proc);
+
+	if (proc->vpn_ip_indexed & PROC_VPN_IPV6)
+		htable_del(s->proc_table.db_vpn_ipv6, rehash_vpn_ipv6(proc, NULL), proc);
+
+	proc->vpn_ip_indexed = 0;
+}
+
 int proc_table_update_ip(main_server_st *s, struct proc_st *proc, struct sockaddr_storage *addr,
 			 unsigned addr_size)
 {
@@ -207,6 +375,15 @@ void proc_table_del(main_server_st *s, struct proc_st *proc)
 	htable_del(s->proc_table.db_ip, rehash_ip(proc, NULL), proc);
 	htable_del(s->proc_table.db_dtls_id, rehash_dtls_id(proc, NULL), proc);
 	htable_del(s->proc_table.db_sid, rehash_sid(proc, NULL), proc);
+	if (proc->user_entry) {
+		name_del(s->proc_table.db_username, proc->user_entry, &proc->user_list);
+		proc->user_entry = NULL;
+	}
+	if (proc->group_entry) {
+		name_del(s->proc_table.db_groupname, proc->group_entry, &proc->group_list);
+		proc->group_entry = NULL;
+	}
+	proc_table_del_vpn_ip(s, proc);
 }
 
 static bool local_ip_cmp(const void* _c1, void* _c2)
@@ -318,3 +495,66 @@ struct proc_st *proc_search_sid(struct main_server_st *s,
 	return htable_get(s->proc_table.db_sid, hash_any(sid, SID_SIZE, 0), sid_cmp, &fsid);
 }
 
+
+/* Returns the sessions of a user, linked by their user_list member,
+ * or NULL if the user has none */
+struct list_head *proc_search_username(struct main_server_st *s,
+				       const char *username)
+{
+	struct proc_name_st *e;
+
+	e = name_get(s->proc_table.db_username, username);
+	if (e == NULL)
+		return NULL;
+
+	return &e->procs;
+}
+
+/* Returns the sessions of a group, linked by their group_list member,
+ * or NULL if the group has none */
+struct list_head *proc_search_groupname(struct main_server_st *s,
+					const char *groupname)
+{
+	struct proc_name_st *e;
+
+	e = name_get(s->proc_table.db_groupname, groupname);
+	if (e == NULL)
+		return NULL;
+
+	return &e->procs;
+}
+
+static bool vpn_ipv4_cmp(const void* _c1, void* _c2)
+{
+	const struct proc_st* c1 = _c1;
+	struct find_vpn_ip_st* c2 = _c2;
+
+	return memcmp(SA_IN_U8_P(&c1->ipv4->rip), c2->ip, c2->ip_size) == 0;
+}
+
+static bool vpn_ipv6_cmp(const void* _c1, void* _c2)
+{
+	const struct proc_st* c1 = _c1;
+	struct find_vpn_ip_st* c2 = _c2;
+
+	return memcmp(SA_IN6_U8_P(&c1->ipv6->rip), c2->ip, c2->ip_size) == 0;
+}
+
+/* Returns the connected session which was assigned the VPN address
+ * ip, of 4 or 16 bytes */
+struct proc_st *proc_search_vpn_ip(struct main_server_st *s,
+				   const uint8_t *ip, unsigned ip_size)
+{
+	struct find_vpn_ip_st fip;
+	size_t h = hash_any(ip, ip_size, 0);
+
+	fip.ip = ip;
+	fip.ip_size = ip_size;
+
+	if (ip_size == sizeof(struct in_addr))
+		return htable_get(s->proc_table.db_vpn_ipv4, h, vpn_ipv4_cmp, &fip);
+	else if (ip_size == sizeof(struct in6_addr))
+		return htable_get(s->proc_table.db_vpn_ipv6, h, vpn_ipv6_cmp, &fip);
+
+	return NULL;
+}
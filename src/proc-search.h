@@ -34,10 +34,19 @@ struct proc_st *proc_search_dtls_id(struct main_server_st *s, const uint8_t *id,
 struct proc_st *proc_search_sid(struct main_server_st *s,
 			        const uint8_t id[SID_SIZE]);
 
+struct list_head *proc_search_username(struct main_server_st *s,
+				       const char *username);
+struct list_head *proc_search_groupname(struct main_server_st *s,
+					const char *groupname);
+struct proc_st *proc_search_vpn_ip(struct main_server_st *s,
+				   const uint8_t *ip, unsigned ip_size);
+
 void proc_table_init(main_server_st *s);
 void proc_table_deinit(main_server_st *s);
 int proc_table_add(main_server_st *s, struct proc_st *proc);
 void proc_table_del(main_server_st *s, struct proc_st *proc);
+int proc_table_add_vpn_ip(main_server_st *s, struct proc_st *proc);
+void proc_table_del_vpn_ip(main_server_st *s, struct proc_st *proc);
 int proc_table_update_ip(main_server_st *s, struct proc_st *proc, struct sockaddr_storage *addr, unsigned addr_size);
 int proc_table_update_dtls_ip(main_server_st *s, struct proc_st *proc, struct sockaddr_storage *addr, unsigned addr_size);
 
@@ -0,0 +1,901 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* An asynchronous RADIUS client. Every server is reached over a single
+ * UDP socket, on which up to 256 requests (one per identifier) may be
+ * outstanding; the requests beyond that are queued. The sockets and the
+ * retransmission timers are served by an event loop in a thread of the
+ * engine, so that requests can be issued from any thread; the caller
+ * either waits for the reply, or is notified by a callback.
+ *
+ * A request which is not answered after the configured retries is sent
+ * to the next server, and the server is considered dead for the
+ * configured deadtime. A request with a key (e.g., the session ID in
+ * accounting) replaces any queued request with the same key; if it is
+ * not waited for, such as an interim update, it is delayed for
+ * RAD_BATCH_TIME so that it can be replaced in turn, and then it is
+ * transmitted together with the others delayed.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <ev.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <ccan/list/list.h>
+#include <ccan/htable/htable.h>
+#include <ccan/hash/hash.h>
+#include <common.h>
+#include <cloexec.h>
+#include "radius-engine.h"
+
+/* the time keyed requests are delayed to be coalesced */
+#define RAD_BATCH_TIME 0.05
+/* the maximum number of packets sent with a single sendmmsg() */
+#define RAD_SEND_BATCH 64
+
+#define RAD_HDR_SIZE 20
+#define RAD_AUTH_SIZE 16
+#define RAD_MA_SIZE (2 + 16)
+/* room for the User-Password and the Message-Authenticator, which
+ * are added on transmission, as they depend on the server */
+#define RAD_RESERVED (2 + RAD_MAX_PASSWORD + RAD_MA_SIZE)
+#define RAD_MAX_SECRET 128
+#define RAD_IDS 256
+
+struct rad_request_st {
+	struct list_node list;
+	rad_engine_st *eng;
+	ev_timer timer;
+
+	uint8_t code;
+	uint8_t id;
+	unsigned server; /* the server it is sent to */
+	unsigned tries; /* transmissions to that server */
+	unsigned inflight;
+
+	char key[RAD_MAX_KEY];
+
+	rad_done_func func;
+	void *priv;
+	rad_reply_st *reply; /* set by rad_send_wait() */
+	unsigned done;
+	int status;
+
+	uint8_t password[RAD_MAX_PASSWORD];
+	size_t password_size;
+
+	size_t attrs_size; /* the attributes follow the header in pkt */
+	size_t pkt_size;
+	uint8_t pkt[RAD_MAX_PACKET];
+};
+
+struct rad_server_st {
+	rad_engine_st *eng;
+	int fd;
+	ev_io io;
+	char secret[RAD_MAX_SECRET];
+	size_t secret_size;
+	ev_tstamp dead_until;
+
+	rad_request_st *inflight[RAD_IDS];
+	unsigned outstanding;
+	uint8_t next_id;
+};
+
+struct rad_engine_st {
+	pthread_mutex_t lock;
+	pthread_cond_t done; /* signalled when a waited request completes */
+	pthread_t thread;
+	unsigned started;
+	unsigned stop;
+	unsigned waiters; /* threads in rad_send_wait() */
+
+	struct ev_loop *loop;
+	ev_async async;
+	ev_timer batch_timer;
+
+	struct list_head queue; /* requests to be transmitted */
+	struct list_head batch; /* keyed requests, moved to queue on batch_timer */
+	struct htable keys; /* the requests in batch */
+
+	struct rad_server_st servers[RAD_MAX_SERVERS];
+	unsigned nservers;
+
+	double timeout;
+	unsigned retries;
+	unsigned deadtime;
+};
+
+static size_t rehash(const void *_r, void *unused)
+{
+	const rad_request_st *r = _r;
+	return hash_string(r->key);
+}
+
+static bool key_cmp(const void *_r, void *_key)
+{
+	const rad_request_st *r = _r;
+	return strcmp(r->key, _key) == 0;
+}
+
+rad_request_st *rad_request_new(uint8_t code)
+{
+	rad_request_st *req;
+
+	/* allocated with malloc() as they are passed among threads */
+	req = calloc(1, sizeof(*req));
+	if (req == NULL)
+		return NULL;
+
+	req->code = code;
+	return req;
+}
+
+void rad_request_free(rad_request_st *req)
+{
+	if (req == NULL)
+		return;
+
+	safe_memset(req->password, 0, sizeof(req->password));
+	free(req);
+}
+
+int rad_add_attr(rad_request_st *req, uint8_t type, const void *data, size_t size)
+{
+	uint8_t *p;
+
+	if (size > 253 || RAD_HDR_SIZE + req->attrs_size + 2 + size > RAD_MAX_PACKET - RAD_RESERVED)
+		return -1;
+
+	p = req->pkt + RAD_HDR_SIZE + req->attrs_size;
+	p[0] = type;
+	p[1] = 2 + size;
+	memcpy(p + 2, data, size);
+	req->attrs_size += 2 + size;
+
+	return 0;
+}
+
+int rad_add_str(rad_request_st *req, uint8_t type, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (len == 0)
+		return -1;
+
+	return rad_add_attr(req, type, str, len);
+}
+
+int rad_add_int(rad_request_st *req, uint8_t type, uint32_t val)
+{
+	val = htonl(val);
+	return rad_add_attr(req, type, &val, sizeof(val));
+}
+
+int rad_add_vendor_attr(rad_request_st *req, uint32_t vendor, uint8_t type,
+			const void *data, size_t size)
+{
+	uint8_t buf[253];
+
+	if (size > sizeof(buf) - 6)
+		return -1;
+
+	vendor = htonl(vendor);
+	memcpy(buf, &vendor, 4);
+	buf[4] = type;
+	buf[5] = 2 + size;
+	memcpy(buf + 6, data, size);
+
+	return rad_add_attr(req, RAD_ATTR_VENDOR_SPECIFIC, buf, 6 + size);
+}
+
+int rad_set_password(rad_request_st *req, const void *pass, size_t size)
+{
+	if (size > RAD_MAX_PASSWORD)
+		return -1;
+
+	memcpy(req->password, pass, size);
+	req->password_size = size;
+	return 0;
+}
+
+/* A request with a key replaces a queued one with the same key and
+ * code; if sent with rad_send() it is delayed to be replaced in turn. */
+int rad_set_key(rad_request_st *req, const char *key)
+{
+	if (strlen(key) >= sizeof(req->key))
+		return -1;
+
+	strcpy(req->key, key);
+	return 0;
+}
+
+const uint8_t *rad_find_attr(const rad_reply_st *reply, uint8_t type, size_t *size)
+{
+	const uint8_t *p = reply->attrs;
+	const uint8_t *end = reply->attrs + reply->attrs_size;
+
+	while (p + 2 <= end) {
+		if (p[1] < 2 || p + p[1] > end)
+			break;
+		if (p[0] == type) {
+			*size = p[1] - 2;
+			return p + 2;
+		}
+		p += p[1];
+	}
+
+	return NULL;
+}
+
+/* RFC2865, section 5.2 */
+static int hide_password(struct rad_server_st *srv, rad_request_st *req, uint8_t *out, size_t *out_size)
+{
+	gnutls_hash_hd_t h;
+	uint8_t b[16];
+	const uint8_t *prev = req->pkt + 4;
+	size_t size, i, j;
+
+	size = (req->password_size + 15) & ~15;
+	if (size == 0)
+		size = 16;
+
+	memset(out, 0, size);
+	memcpy(out, req->password, req->password_size);
+
+	for (i = 0; i < size; i += 16) {
+		if (gnutls_hash_init(&h, GNUTLS_DIG_MD5) < 0)
+			return -1;
+		gnutls_hash(h, srv->secret, srv->secret_size);
+		gnutls_hash(h, prev, 16);
+		gnutls_hash_deinit(h, b);
+
+		for (j = 0; j < 16; j++)
+			out[i + j] ^= b[j];
+		prev = out + i;
+	}
+
+	safe_memset(b, 0, sizeof(b));
+	*out_size = size;
+	return 0;
+}
+
+/* Encodes the packet of @req with its identifier, for its server */
+static int encode_request(rad_engine_st *eng, rad_request_st *req)
+{
+	struct rad_server_st *srv = &eng->servers[req->server];
+	uint8_t *p;
+	size_t size, hsize;
+	gnutls_hash_hd_t h;
+
+	size = RAD_HDR_SIZE + req->attrs_size;
+	p = req->pkt;
+	p[0] = req->code;
+	p[1] = req->id;
+
+	if (req->code == RAD_ACCESS_REQUEST) {
+		if (gnutls_rnd(GNUTLS_RND_NONCE, p + 4, RAD_AUTH_SIZE) < 0)
+			return -1;
+
+		if (req->password_size > 0) {
+			if (hide_password(srv, req, p + size + 2, &hsize) < 0)
+				return -1;
+			p[size] = RAD_ATTR_USER_PASSWORD;
+			p[size + 1] = 2 + hsize;
+			size += 2 + hsize;
+		}
+
+		/* RFC3579; computed over the packet with the value zeroed */
+		p[size] = RAD_ATTR_MESSAGE_AUTHENTICATOR;
+		p[size + 1] = RAD_MA_SIZE;
+		memset(p + size + 2, 0, 16);
+		size += RAD_MA_SIZE;
+
+		p[2] = size >> 8;
+		p[3] = size & 0xff;
+
+		if (gnutls_hmac_fast(GNUTLS_MAC_MD5, srv->secret, srv->secret_size,
+				     p, size, p + size - 16) < 0)
+			return -1;
+	} else {
+		/* RFC2866, section 3 */
+		p[2] = size >> 8;
+		p[3] = size & 0xff;
+		memset(p + 4, 0, RAD_AUTH_SIZE);
+
+		if (gnutls_hash_init(&h, GNUTLS_DIG_MD5) < 0)
+			return -1;
+		gnutls_hash(h, p, size);
+		gnutls_hash(h, srv->secret, srv->secret_size);
+		gnutls_hash_deinit(h, p + 4);
+	}
+
+	req->pkt_size = size;
+	return 0;
+}
+
+/* Verifies the authenticators of a reply to @req */
+static int verify_reply(struct rad_server_st *srv, rad_request_st *req,
+			uint8_t *p, size_t size)
+{
+	gnutls_hash_hd_t h;
+	uint8_t auth[RAD_AUTH_SIZE];
+	uint8_t ma[16], mac[16];
+	uint8_t *a;
+
+	switch (p[0]) {
+	case RAD_ACCESS_ACCEPT:
+	case RAD_ACCESS_REJECT:
+	case RAD_ACCESS_CHALLENGE:
+		if (req->code != RAD_ACCESS_REQUEST)
+			return -1;
+		break;
+	case RAD_ACCOUNTING_RESPONSE:
+		if (req->code != RAD_ACCOUNTING_REQUEST)
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+
+	if (gnutls_hash_init(&h, GNUTLS_DIG_MD5) < 0)
+		return -1;
+	gnutls_hash(h, p, 4);
+	gnutls_hash(h, req->pkt + 4, RAD_AUTH_SIZE);
+	gnutls_hash(h, p + RAD_HDR_SIZE, size - RAD_HDR_SIZE);
+	gnutls_hash(h, srv->secret, srv->secret_size);
+	gnutls_hash_deinit(h, auth);
+
+	if (memcmp(auth, p + 4, RAD_AUTH_SIZE) != 0)
+		return -1;
+
+	/* a Message-Authenticator, if present, is computed with the
+	 * request authenticator in place */
+	for (a = p + RAD_HDR_SIZE; a + 2 <= p + size && a[1] >= 2 && a + a[1] <= p + size; a += a[1]) {
+		if (a[0] != RAD_ATTR_MESSAGE_AUTHENTICATOR)
+			continue;
+		if (a[1] != RAD_MA_SIZE)
+			return -1;
+
+		memcpy(ma, a + 2, 16);
+		memset(a + 2, 0, 16);
+		memcpy(p + 4, req->pkt + 4, RAD_AUTH_SIZE);
+		if (gnutls_hmac_fast(GNUTLS_MAC_MD5, srv->secret, srv->secret_size,
+				     p, size, mac) < 0)
+			return -1;
+		if (memcmp(ma, mac, 16) != 0)
+			return -1;
+		break;
+	}
+
+	return 0;
+}
+
+/* Called with the lock held; frees @req unless it is waited for */
+static void complete_request(rad_engine_st *eng, rad_request_st *req, int status)
+{
+	req->status = status;
+
+	if (req->reply != NULL) {
+		req->done = 1;
+		pthread_cond_broadcast(&eng->done);
+		return;
+	}
+
+	if (status < 0)
+		syslog(LOG_INFO, "radius: no reply received to request of type %u", (unsigned)req->code);
+
+	if (req->func)
+		req->func(req->priv, status);
+	rad_request_free(req);
+}
+
+static void release_id(rad_engine_st *eng, rad_request_st *req)
+{
+	struct rad_server_st *srv = &eng->servers[req->server];
+
+	ev_timer_stop(eng->loop, &req->timer);
+	srv->inflight[req->id] = NULL;
+	srv->outstanding--;
+	req->inflight = 0;
+}
+
+static void send_packets(struct rad_server_st *srv, rad_request_st **reqs, unsigned n)
+{
+	unsigned i;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[RAD_SEND_BATCH];
+	struct iovec iov[RAD_SEND_BATCH];
+	int ret;
+
+	memset(msgs, 0, sizeof(msgs[0]) * n);
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = reqs[i]->pkt;
+		iov[i].iov_len = reqs[i]->pkt_size;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (i = 0; i < n; i += ret) {
+		ret = sendmmsg(srv->fd, msgs + i, n - i, 0);
+		if (ret <= 0)
+			break;
+	}
+#else
+	for (i = 0; i < n; i++) {
+		if (send(srv->fd, reqs[i]->pkt, reqs[i]->pkt_size, 0) < 0)
+			break;
+	}
+#endif
+	/* the packets not sent are retransmitted on timeout */
+}
+
+/* Returns the first server, starting from the request's, which is not
+ * considered dead; if all are, the request's server. */
+static unsigned pick_server(rad_engine_st *eng, rad_request_st *req)
+{
+	ev_tstamp now = ev_now(eng->loop);
+	unsigned i;
+
+	for (i = req->server; i < eng->nservers; i++) {
+		if (eng->servers[i].dead_until <= now)
+			return i;
+	}
+
+	return req->server;
+}
+
+static void timeout_cb(struct ev_loop *loop, ev_timer *w, int revents);
+
+/* Assigns identifiers to the queued requests and transmits them, as
+ * long as the identifiers of their servers are not exhausted. Called
+ * with the lock held. */
+static void flush_queue(rad_engine_st *eng)
+{
+	rad_request_st *batch[RAD_MAX_SERVERS][RAD_SEND_BATCH];
+	unsigned nbatch[RAD_MAX_SERVERS];
+	struct rad_server_st *srv;
+	rad_request_st *req, *tmp;
+	unsigned i, s;
+
+	memset(nbatch, 0, sizeof(nbatch));
+
+	list_for_each_safe(&eng->queue, req, tmp, list) {
+		s = pick_server(eng, req);
+		srv = &eng->servers[s];
+
+		/* keep the order; the rest are sent as identifiers free up */
+		if (srv->outstanding >= RAD_IDS)
+			break;
+
+		while (srv->inflight[srv->next_id] != NULL)
+			srv->next_id++;
+
+		list_del(&req->list);
+
+		req->server = s;
+		req->id = srv->next_id++;
+		if (encode_request(eng, req) < 0) {
+			complete_request(eng, req, -1);
+			continue;
+		}
+
+		srv->inflight[req->id] = req;
+		srv->outstanding++;
+		req->inflight = 1;
+		req->tries = 1;
+
+		ev_timer_init(&req->timer, timeout_cb, eng->timeout, 0.);
+		req->timer.data = req;
+		ev_timer_start(eng->loop, &req->timer);
+
+		batch[s][nbatch[s]++] = req;
+		if (nbatch[s] == RAD_SEND_BATCH) {
+			send_packets(srv, batch[s], nbatch[s]);
+			nbatch[s] = 0;
+		}
+	}
+
+	for (i = 0; i < eng->nservers; i++) {
+		if (nbatch[i] > 0)
+			send_packets(&eng->servers[i], batch[i], nbatch[i]);
+	}
+}
+
+static void timeout_cb(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	rad_request_st *req = w->data;
+	rad_engine_st *eng = req->eng;
+	struct rad_server_st *srv;
+
+	pthread_mutex_lock(&eng->lock);
+	srv = &eng->servers[req->server];
+
+	if (req->tries <= eng->retries) {
+		req->tries++;
+		if (send(srv->fd, req->pkt, req->pkt_size, 0) < 0 && errno != EAGAIN)
+			syslog(LOG_DEBUG, "radius: error in sending request: %s", strerror(errno));
+		ev_timer_set(&req->timer, eng->timeout, 0.);
+		ev_timer_start(loop, &req->timer);
+		goto finish;
+	}
+
+	release_id(eng, req);
+
+	if (eng->deadtime > 0)
+		srv->dead_until = ev_now(loop) + eng->deadtime;
+
+	if (req->server + 1 >= eng->nservers) {
+		complete_request(eng, req, -1);
+	} else {
+		syslog(LOG_INFO, "radius: no reply from server %u; trying the next one", req->server);
+		req->server++;
+		list_add(&eng->queue, &req->list);
+	}
+
+	flush_queue(eng);
+ finish:
+	pthread_mutex_unlock(&eng->lock);
+}
+
+static void server_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	struct rad_server_st *srv = w->data;
+	rad_engine_st *eng = srv->eng;
+	rad_request_st *req;
+	uint8_t buf[RAD_MAX_PACKET];
+	ssize_t ret;
+	size_t size;
+	unsigned freed = 0;
+
+	pthread_mutex_lock(&eng->lock);
+	for (;;) {
+		ret = recv(srv->fd, buf, sizeof(buf), 0);
+		if (ret < 0) {
+			/* ECONNREFUSED reports a previous send */
+			if (errno == EINTR || errno == ECONNREFUSED)
+				continue;
+			break;
+		}
+
+		if (ret < RAD_HDR_SIZE)
+			continue;
+
+		size = (buf[2] << 8) | buf[3];
+		if (size < RAD_HDR_SIZE || size > (size_t)ret)
+			continue;
+
+		req = srv->inflight[buf[1]];
+		if (req == NULL || verify_reply(srv, req, buf, size) < 0) {
+			syslog(LOG_DEBUG, "radius: ignoring unexpected reply with id %u", (unsigned)buf[1]);
+			continue;
+		}
+
+		release_id(eng, req);
+		freed++;
+
+		if (req->reply != NULL) {
+			req->reply->code = buf[0];
+			req->reply->attrs_size = size - RAD_HDR_SIZE;
+			memcpy(req->reply->attrs, buf + RAD_HDR_SIZE, size - RAD_HDR_SIZE);
+		}
+		complete_request(eng, req, buf[0]);
+	}
+
+	if (freed > 0)
+		flush_queue(eng);
+	pthread_mutex_unlock(&eng->lock);
+}
+
+/* Moves the keyed requests to the queue; they can no longer be replaced */
+static void move_batch(rad_engine_st *eng)
+{
+	rad_request_st *req;
+
+	while ((req = list_top(&eng->batch, rad_request_st, list)) != NULL) {
+		list_del(&req->list);
+		htable_del(&eng->keys, rehash(req, NULL), req);
+		list_add_tail(&eng->queue, &req->list);
+	}
+}
+
+static void batch_cb(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	rad_engine_st *eng = w->data;
+	pthread_mutex_lock(&eng->lock);
+	move_batch(eng);
+	flush_queue(eng);
+	pthread_mutex_unlock(&eng->lock);
+}
+
+static void async_cb(struct ev_loop *loop, ev_async *w, int revents)
+{
+	rad_engine_st *eng = w->data;
+
+	pthread_mutex_lock(&eng->lock);
+	if (eng->stop) {
+		ev_break(loop, EVBREAK_ALL);
+		goto finish;
+	}
+
+	if (!list_empty(&eng->batch) && !ev_is_active(&eng->batch_timer)) {
+		ev_timer_set(&eng->batch_timer, RAD_BATCH_TIME, 0.);
+		ev_timer_start(loop, &eng->batch_timer);
+	}
+
+	flush_queue(eng);
+ finish:
+	pthread_mutex_unlock(&eng->lock);
+}
+
+static void *engine_thread(void *arg)
+{
+	rad_engine_st *eng = arg;
+
+	ev_run(eng->loop, 0);
+	return NULL;
+}
+
+rad_engine_st *rad_engine_new(double timeout, unsigned retries, unsigned deadtime)
+{
+	rad_engine_st *eng;
+
+	eng = calloc(1, sizeof(*eng));
+	if (eng == NULL)
+		return NULL;
+
+	pthread_mutex_init(&eng->lock, NULL);
+	pthread_cond_init(&eng->done, NULL);
+	list_head_init(&eng->queue);
+	list_head_init(&eng->batch);
+	htable_init(&eng->keys, rehash, NULL);
+
+	eng->timeout = timeout > 0 ? timeout : 1;
+	eng->retries = retries;
+	eng->deadtime = deadtime;
+
+	return eng;
+}
+
+int rad_engine_add_server(rad_engine_st *eng, const char *host, unsigned port,
+			  const char *secret)
+{
+	struct rad_server_st *srv;
+	struct addrinfo hints, *res;
+	char service[8];
+	int ret, fd;
+
+	if (eng->nservers >= RAD_MAX_SERVERS || eng->started)
+		return -1;
+
+	if (strlen(secret) >= RAD_MAX_SECRET)
+		return -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	snprintf(service, sizeof(service), "%u", port);
+
+	ret = getaddrinfo(host, service, &hints, &res);
+	if (ret != 0) {
+		syslog(LOG_ERR, "radius: cannot resolve %s: %s", host, gai_strerror(ret));
+		return -1;
+	}
+
+	fd = socket(res->ai_family, SOCK_DGRAM, 0);
+	if (fd == -1 || connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+		ret = errno;
+		syslog(LOG_ERR, "radius: cannot connect to %s: %s", host, strerror(ret));
+		if (fd != -1)
+			close(fd);
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+
+	set_cloexec_flag(fd, 1);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	srv = &eng->servers[eng->nservers++];
+	srv->eng = eng;
+	srv->fd = fd;
+	strcpy(srv->secret, secret);
+	srv->secret_size = strlen(secret);
+
+	return 0;
+}
+
+/* Starts the thread serving the engine; the signals are blocked in it */
+int rad_engine_start(rad_engine_st *eng)
+{
+	sigset_t set, old;
+	unsigned i;
+	int ret;
+
+	if (eng->nservers == 0)
+		return -1;
+
+	eng->loop = ev_loop_new(EVFLAG_AUTO);
+	if (eng->loop == NULL)
+		return -1;
+
+	ev_async_init(&eng->async, async_cb);
+	eng->async.data = eng;
+	ev_async_start(eng->loop, &eng->async);
+
+	ev_timer_init(&eng->batch_timer, batch_cb, RAD_BATCH_TIME, 0.);
+	eng->batch_timer.data = eng;
+
+	for (i = 0; i < eng->nservers; i++) {
+		ev_io_init(&eng->servers[i].io, server_cb, eng->servers[i].fd, EV_READ);
+		eng->servers[i].io.data = &eng->servers[i];
+		ev_io_start(eng->loop, &eng->servers[i].io);
+	}
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(&eng->thread, NULL, engine_thread, eng);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret != 0) {
+		ev_loop_destroy(eng->loop);
+		eng->loop = NULL;
+		return -1;
+	}
+
+	eng->started = 1;
+	return 0;
+}
+
+/* Stops the engine; the pending requests fail */
+void rad_engine_free(rad_engine_st *eng)
+{
+	rad_request_st *req, *tmp;
+	unsigned i, j;
+
+	if (eng == NULL)
+		return;
+
+	if (eng->started) {
+		pthread_mutex_lock(&eng->lock);
+		eng->stop = 1;
+		ev_async_send(eng->loop, &eng->async);
+		pthread_mutex_unlock(&eng->lock);
+		pthread_join(eng->thread, NULL);
+	}
+
+	pthread_mutex_lock(&eng->lock);
+	move_batch(eng);
+	list_for_each_safe(&eng->queue, req, tmp, list) {
+		list_del(&req->list);
+		complete_request(eng, req, -1);
+	}
+
+	for (i = 0; i < eng->nservers; i++) {
+		for (j = 0; j < RAD_IDS; j++) {
+			req = eng->servers[i].inflight[j];
+			if (req != NULL) {
+				eng->servers[i].inflight[j] = NULL;
+				complete_request(eng, req, -1);
+			}
+		}
+		close(eng->servers[i].fd);
+		safe_memset(eng->servers[i].secret, 0, sizeof(eng->servers[i].secret));
+	}
+
+	/* the waiters must return before the engine is released */
+	while (eng->waiters > 0)
+		pthread_cond_wait(&eng->done, &eng->lock);
+	pthread_mutex_unlock(&eng->lock);
+
+	htable_clear(&eng->keys);
+	if (eng->loop)
+		ev_loop_destroy(eng->loop);
+	pthread_cond_destroy(&eng->done);
+	pthread_mutex_destroy(&eng->lock);
+	free(eng);
+}
+
+static int queue_request(rad_engine_st *eng, rad_request_st *req)
+{
+	rad_request_st *old;
+
+	if (eng->stop || !eng->started)
+		return -1;
+
+	req->eng = eng;
+
+	if (req->key[0] != 0) {
+		old = htable_get(&eng->keys, rehash(req, NULL), key_cmp, req->key);
+		if (old != NULL && old->code == req->code) {
+			/* the newer request replaces the queued one */
+			list_del(&old->list);
+			htable_del(&eng->keys, rehash(old, NULL), old);
+			complete_request(eng, old, 0);
+		}
+	}
+
+	if (req->key[0] != 0 && req->reply == NULL) {
+		htable_add(&eng->keys, rehash(req, NULL), req);
+		list_add_tail(&eng->batch, &req->list);
+	} else {
+		list_add_tail(&eng->queue, &req->list);
+	}
+
+	ev_async_send(eng->loop, &eng->async);
+	return 0;
+}
+
+/* Sends @req and waits for the reply; the request is freed. Returns the
+ * code of the reply, or -1 if none was received. */
+int rad_send_wait(rad_engine_st *eng, rad_request_st *req, rad_reply_st *reply)
+{
+	int ret;
+
+	req->reply = reply;
+
+	pthread_mutex_lock(&eng->lock);
+	if (queue_request(eng, req) < 0) {
+		pthread_mutex_unlock(&eng->lock);
+		rad_request_free(req);
+		return -1;
+	}
+
+	eng->waiters++;
+	while (!req->done)
+		pthread_cond_wait(&eng->done, &eng->lock);
+	if (--eng->waiters == 0 && eng->stop)
+		pthread_cond_broadcast(&eng->done);
+	pthread_mutex_unlock(&eng->lock);
+
+	ret = req->status;
+	rad_request_free(req);
+	return ret;
+}
+
+/* Sends @req without waiting; @func, if set, is called on completion.
+ * The request is owned by the engine. */
+int rad_send(rad_engine_st *eng, rad_request_st *req, rad_done_func func, void *priv)
+{
+	req->func = func;
+	req->priv = priv;
+
+	pthread_mutex_lock(&eng->lock);
+	if (queue_request(eng, req) < 0) {
+		pthread_mutex_unlock(&eng->lock);
+		rad_request_free(req);
+		return -1;
+	}
+	pthread_mutex_unlock(&eng->lock);
+
+	return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RADIUS_ENGINE_H
+# define RADIUS_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* RFC2865 and RFC2866 packet codes */
+#define RAD_ACCESS_REQUEST 1
+#define RAD_ACCESS_ACCEPT 2
+#define RAD_ACCESS_REJECT 3
+#define RAD_ACCOUNTING_REQUEST 4
+#define RAD_ACCOUNTING_RESPONSE 5
+#define RAD_ACCESS_CHALLENGE 11
+
+#define RAD_ATTR_USER_NAME 1
+#define RAD_ATTR_USER_PASSWORD 2
+#define RAD_ATTR_REPLY_MESSAGE 18
+#define RAD_ATTR_VENDOR_SPECIFIC 26
+#define RAD_ATTR_MESSAGE_AUTHENTICATOR 80
+
+#define RAD_MAX_PACKET 4096
+#define RAD_MAX_PASSWORD 128
+#define RAD_MAX_SERVERS 8
+#define RAD_MAX_KEY 64
+
+typedef struct rad_engine_st rad_engine_st;
+typedef struct rad_request_st rad_request_st;
+
+typedef struct rad_reply_st {
+	uint8_t code;
+	size_t attrs_size;
+	uint8_t attrs[RAD_MAX_PACKET];
+} rad_reply_st;
+
+/* Called from the engine thread with the code of the reply, 0 if the
+ * request was superseded by a newer one with the same key, or -1 if no
+ * server replied. It must not call into the engine. */
+typedef void (*rad_done_func)(void *priv, int code);
+
+rad_engine_st *rad_engine_new(double timeout, unsigned retries, unsigned deadtime);
+int rad_engine_add_server(rad_engine_st *eng, const char *host, unsigned port,
+			  const char *secret);
+int rad_engine_start(rad_engine_st *eng);
+void rad_engine_free(rad_engine_st *eng);
+
+rad_request_st *rad_request_new(uint8_t code);
+void rad_request_free(rad_request_st *req);
+int rad_add_attr(rad_request_st *req, uint8_t type, const void *data, size_t size);
+int rad_add_str(rad_request_st *req, uint8_t type, const char *str);
+int rad_add_int(rad_request_st *req, uint8_t type, uint32_t val);
+int rad_add_vendor_attr(rad_request_st *req, uint32_t vendor, uint8_t type,
+			const void *data, size_t size);
+int rad_set_password(rad_request_st *req, const void *pass, size_t size);
+int rad_set_key(rad_request_st *req, const char *key);
+
+int rad_send_wait(rad_engine_st *eng, rad_request_st *req, rad_reply_st *reply);
+int rad_send(rad_engine_st *eng, rad_request_st *req, rad_done_func func, void *priv);
+
+const uint8_t *rad_find_attr(const rad_reply_st *reply, uint8_t type, size_t *size);
+
+#endif
@@ -28,11 +28,19 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#ifdef __linux__
+# include <linux/netlink.h>
+# include <linux/rtnetlink.h>
+#endif
 
 #include <route-add.h>
 #include <main.h>
 #include <str.h>
 #include <common.h>
+#include <ip-util.h>
 
 static
 int call_script(main_server_st *s, proc_st *proc, const char *cmd)
@@ -155,8 +163,308 @@ int route_del(struct main_server_st* s, proc_st *proc, const char* route, const
 	return route_adddel(s, proc, GETCONFIG(s)->route_del_cmd, route, dev);
 }
 
-/* Executes the commands required to apply all the configured routes 
- * for this client locally.
+#ifdef __linux__
+/* The commands are used only when they are set; otherwise the routes
+ * are added with netlink. */
+static unsigned use_route_cmds(struct main_server_st* s)
+{
+	return (GETCONFIG(s)->route_add_cmd != NULL || GETCONFIG(s)->route_del_cmd != NULL);
+}
+
+/* The number of routes sent in a single message to the kernel; their
+ * replies must fit in the receive buffer of the socket. */
+#define NL_BATCH 64
+#define NL_MSG_SIZE NLMSG_SPACE(sizeof(struct rtmsg) + 2*RTA_SPACE(sizeof(struct in6_addr)))
+
+static struct {
+	int fd;
+	uint32_t seq;
+} nl = { .fd = -1 };
+
+static int nl_socket(main_server_st *s)
+{
+	struct sockaddr_nl sa;
+	int e;
+
+	if (nl.fd >= 0)
+		return nl.fd;
+
+	nl.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+	if (nl.fd == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not open netlink socket: %s", strerror(e));
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	if (bind(nl.fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not bind netlink socket: %s", strerror(e));
+		close(nl.fd);
+		nl.fd = -1;
+		return -1;
+	}
+
+	return nl.fd;
+}
+
+static void nl_add_attr(struct nlmsghdr *h, unsigned type, const void *data, unsigned size)
+{
+	struct rtattr *rta = (struct rtattr *)(((char *)h) + NLMSG_ALIGN(h->nlmsg_len));
+
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(size);
+	memcpy(RTA_DATA(rta), data, size);
+	h->nlmsg_len = NLMSG_ALIGN(h->nlmsg_len) + RTA_SPACE(size);
+}
+
+/* Appends to @buf a message that adds or deletes @route (in the
+ * address/prefix or address/netmask format) via the device @ifindex. */
+static int nl_route_msg(void *pool, char *buf, unsigned type, uint32_t seq,
+			const char *route, int ifindex)
+{
+	struct nlmsghdr *h = (struct nlmsghdr *)buf;
+	struct rtmsg *rtm;
+	unsigned char addr[sizeof(struct in6_addr)];
+	char *cidr, *p;
+	int family;
+	unsigned prefix, max;
+
+	cidr = ipv4_route_to_cidr(pool, route);
+	if (cidr == NULL)
+		return -EINVAL;
+
+	family = strchr(cidr, ':') != NULL ? AF_INET6 : AF_INET;
+	max = family == AF_INET6 ? 128 : 32;
+
+	p = strchr(cidr, '/');
+	if (p != NULL) {
+		*p = 0;
+		prefix = atoi(p + 1);
+	} else {
+		prefix = max;
+	}
+
+	if (prefix > max || inet_pton(family, cidr, addr) != 1) {
+		talloc_free(cidr);
+		return -EINVAL;
+	}
+	talloc_free(cidr);
+
+	memset(buf, 0, NL_MSG_SIZE);
+	h->nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	h->nlmsg_type = type;
+	h->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (type == RTM_NEWROUTE)
+		h->nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+	h->nlmsg_seq = seq;
+
+	/* as 'ip route add/del <route> dev <dev>' */
+	rtm = NLMSG_DATA(h);
+	rtm->rtm_family = family;
+	rtm->rtm_dst_len = prefix;
+	rtm->rtm_table = RT_TABLE_MAIN;
+	rtm->rtm_type = RTN_UNICAST;
+	if (type == RTM_NEWROUTE) {
+		rtm->rtm_protocol = RTPROT_BOOT;
+		rtm->rtm_scope = family == AF_INET6 ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+	} else {
+		rtm->rtm_scope = family == AF_INET6 ? RT_SCOPE_UNIVERSE : RT_SCOPE_NOWHERE;
+	}
+
+	nl_add_attr(h, RTA_DST, addr, family == AF_INET6 ? 16 : 4);
+	nl_add_attr(h, RTA_OIF, &ifindex, sizeof(ifindex));
+
+	return NLMSG_ALIGN(h->nlmsg_len);
+}
+
+/* Sends the @sent messages in @buf, which have sequence numbers from
+ * @first_seq on, and stores the result of each in @res. The kernel
+ * handles route messages while they are sent, so their replies are
+ * already queued when send() returns. */
+static int nl_send_batch(main_server_st *s, char *buf, unsigned size,
+			 uint32_t first_seq, unsigned n, unsigned sent, int *res)
+{
+	struct sockaddr_nl sa;
+	char rbuf[8192];
+	struct nlmsghdr *h;
+	struct nlmsgerr *err;
+	unsigned acks = 0;
+	ssize_t ret;
+	int e;
+
+	if (sent == 0)
+		return 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+
+	ret = sendto(nl.fd, buf, size, 0, (struct sockaddr *)&sa, sizeof(sa));
+	if (ret != (ssize_t)size) {
+		e = errno;
+		mslog(s, NULL, LOG_ERR, "could not send netlink message: %s", strerror(e));
+		return ERR_EXEC;
+	}
+
+	while (acks < sent) {
+		ret = recv(nl.fd, rbuf, sizeof(rbuf), MSG_DONTWAIT);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+
+		for (h = (struct nlmsghdr *)rbuf; NLMSG_OK(h, ret); h = NLMSG_NEXT(h, ret)) {
+			/* replies to earlier batches are ignored */
+			if (h->nlmsg_type != NLMSG_ERROR || h->nlmsg_seq - first_seq >= n)
+				continue;
+
+			err = NLMSG_DATA(h);
+			res[h->nlmsg_seq - first_seq] = err->error;
+			acks++;
+		}
+	}
+
+	if (acks < sent)
+		mslog(s, NULL, LOG_ERR, "received %u out of %u netlink replies", acks, sent);
+
+	return 0;
+}
+
+/* Adds or deletes the @n @routes via the device @dev, and stores the
+ * result of each in @res. */
+static int nl_routes(main_server_st *s, proc_st *proc, unsigned type,
+		     char **routes, unsigned n, const char *dev, int *res)
+{
+	char *buf;
+	unsigned i, j, size, sent;
+	uint32_t first_seq;
+	int ifindex, ret = 0;
+
+	if (nl_socket(s) < 0)
+		return ERR_EXEC;
+
+	ifindex = if_nametoindex(dev);
+	if (ifindex == 0) {
+		mslog(s, proc, LOG_ERR, "could not find device %s", dev);
+		return ERR_EXEC;
+	}
+
+	buf = talloc_size(proc, NL_BATCH * NL_MSG_SIZE);
+	if (buf == NULL)
+		return ERR_MEM;
+
+	for (i = 0; i < n; i += NL_BATCH) {
+		size = 0;
+		sent = 0;
+		first_seq = nl.seq + 1;
+
+		for (j = i; j < n && j < i + NL_BATCH; j++) {
+			ret = nl_route_msg(buf, buf + size, type, ++nl.seq, routes[j], ifindex);
+			if (ret < 0) {
+				mslog(s, proc, LOG_ERR, "cannot parse route %s", routes[j]);
+				res[j] = ret;
+				continue;
+			}
+			/* until a reply is received */
+			res[j] = -ETIMEDOUT;
+			size += ret;
+			sent++;
+		}
+
+		ret = nl_send_batch(s, buf, size, first_seq, j - i, sent, res + i);
+		if (ret < 0)
+			break;
+	}
+
+	talloc_free(buf);
+	return ret;
+}
+
+static int nl_apply_iroutes(struct main_server_st* s, struct proc_st *proc)
+{
+	unsigned i, n = proc->config->n_iroutes, added = 0;
+	char **routes = proc->config->iroutes;
+	char **undo;
+	int *res;
+	int ret;
+
+	res = talloc_array(proc, int, n);
+	if (res == NULL)
+		return ERR_MEM;
+
+	ret = nl_routes(s, proc, RTM_NEWROUTE, routes, n, proc->tun_lease.name, res);
+	if (ret < 0) {
+		talloc_free(res);
+		return ret;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (res[i] == 0)
+			added++;
+		else
+			mslog(s, proc, LOG_ERR, "could not add route %s: %s", routes[i], strerror(-res[i]));
+	}
+
+	if (added == n) {
+		mslog(s, proc, LOG_DEBUG, "added %u routes to %s", n, proc->tun_lease.name);
+		talloc_free(res);
+		return 0;
+	}
+
+	/* remove the routes we added, and only these */
+	undo = talloc_array(res, char *, added);
+	if (undo != NULL) {
+		for (i = 0, added = 0; i < n; i++) {
+			if (res[i] == 0)
+				undo[added++] = routes[i];
+		}
+		nl_routes(s, proc, RTM_DELROUTE, undo, added, proc->tun_lease.name, res);
+	}
+
+	talloc_free(res);
+	return ERR_EXEC;
+}
+
+static void nl_remove_iroutes(struct main_server_st* s, struct proc_st *proc)
+{
+	unsigned i, n = proc->config->n_iroutes;
+	int *res;
+
+	/* the routes are gone with the device */
+	if (if_nametoindex(proc->tun_lease.name) == 0)
+		return;
+
+	res = talloc_array(proc, int, n);
+	if (res == NULL)
+		return;
+
+	if (nl_routes(s, proc, RTM_DELROUTE, proc->config->iroutes, n, proc->tun_lease.name, res) == 0) {
+		for (i = 0; i < n; i++) {
+			if (res[i] != 0 && res[i] != -ESRCH)
+				mslog(s, proc, LOG_INFO, "could not remove route %s: %s",
+				      proc->config->iroutes[i], strerror(-res[i]));
+		}
+	}
+
+	talloc_free(res);
+}
+
+void route_nl_deinit(void)
+{
+	if (nl.fd >= 0) {
+		close(nl.fd);
+		nl.fd = -1;
+	}
+}
+#else
+void route_nl_deinit(void)
+{
+}
+#endif
+
+/* Applies all the configured routes for this client locally, either
+ * by executing the configured commands, or via netlink.
  */
 int apply_iroutes(struct main_server_st* s, struct proc_st *proc)
 {
@@ -166,6 +474,16 @@ int ret;
 	if (proc->config->n_iroutes == 0)
 		return 0;
 
+#ifdef __linux__
+	if (!use_route_cmds(s)) {
+		ret = nl_apply_iroutes(s, proc);
+		if (ret < 0)
+			return -1;
+		proc->applied_iroutes = 1;
+		return 0;
+	}
+#endif
+
 	for (i=0;i<proc->config->n_iroutes;i++) {
 		ret = route_add(s, proc, proc->config->iroutes[i], proc->tun_lease.name);
 		if (ret < 0)
@@ -181,8 +499,7 @@ fail:
 	return -1;
 }
 
-/* Executes the commands required to removed all the configured routes 
- * for this client.
+/* Removes all the configured routes for this client.
  */
 void remove_iroutes(struct main_server_st* s, struct proc_st *proc)
 {
@@ -191,6 +508,14 @@ unsigned i;
 	if (proc->config == NULL || proc->config->n_iroutes == 0 || proc->applied_iroutes == 0)
 		return;
 
+#ifdef __linux__
+	if (!use_route_cmds(s)) {
+		nl_remove_iroutes(s, proc);
+		proc->applied_iroutes = 0;
+		return;
+	}
+#endif
+
 	for (i=0;i<proc->config->n_iroutes;i++) {
 		route_del(s, proc, proc->config->iroutes[i], proc->tun_lease.name);
 	}
@@ -198,4 +523,3 @@ unsigned i;
 
 	return;
 }
-
@@ -26,5 +26,6 @@
 
 int apply_iroutes(struct main_server_st* s, struct proc_st *proc);
 void remove_iroutes(struct main_server_st* s, struct proc_st *proc);
+void route_nl_deinit(void);
 
 #endif
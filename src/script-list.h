@@ -25,48 +25,49 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <ev.h>
-
-void script_child_watcher_cb(struct ev_loop *loop, ev_child *w, int revents);
+#include <script-runner.h>
 
 inline static
-void add_to_script_list(main_server_st* s, pid_t pid, struct proc_st* proc)
+void add_to_script_list(main_server_st* s, uint32_t id, struct proc_st* proc)
 {
 struct script_wait_st *stmp;
 
-	stmp = talloc(s, struct script_wait_st);
+	stmp = talloc_zero(s, struct script_wait_st);
 	if (stmp == NULL)
 		return;
-	
-	stmp->proc = proc;
-	stmp->pid = pid;
 
-	ev_child_init(&stmp->ev_child, script_child_watcher_cb, pid, 0);
-	ev_child_start(loop, &stmp->ev_child);
+	stmp->proc = proc;
+	stmp->id = id;
+	clock_gettime(CLOCK_MONOTONIC, &stmp->start);
 
-	list_add(&s->script_list.head, &(stmp->list));
+	list_add_tail(&s->script_list.head, &(stmp->list));
 }
 
-/* Removes the tracked connect script, and kills it. It returns the pid
- * of the removed script or -1.
+/* Returns the connect script tracked for the session or NULL.
  */
-inline static pid_t remove_from_script_list(main_server_st* s, struct proc_st* proc)
+inline static
+struct script_wait_st *find_script_wait(main_server_st* s, struct proc_st* proc)
 {
-	struct script_wait_st *stmp = NULL, *spos;
-	pid_t ret = -1;
+	struct script_wait_st *stmp;
 
-	list_for_each_safe(&s->script_list.head, stmp, spos, list) {
-		if (stmp->proc == proc) {
-			list_del(&stmp->list);
-			if (stmp->pid > 0) {
-				kill(stmp->pid, SIGTERM);
-				ret = stmp->pid;
-			}
-			talloc_free(stmp);
-			break;
-		}
+	list_for_each(&s->script_list.head, stmp, list) {
+		if (stmp->proc == proc)
+			return stmp;
 	}
 
-	return ret;
+	return NULL;
+}
+
+/* Detaches the tracked connect script from its session, and asks
+ * the script runner to drop it if it was not started yet. The entry
+ * is freed once the script's exit status is reported, and the
+ * disconnect script queued on it runs if the script succeeded.
+ */
+inline static
+void cancel_script_wait(main_server_st* s, struct script_wait_st *stmp)
+{
+	stmp->proc = NULL;
+	script_runner_cancel(s, stmp->id);
 }
 
 #endif
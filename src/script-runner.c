@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <main.h>
+#include <common.h>
+#include <system.h>
+#include <cloexec.h>
+#include <script-runner.h>
+#include <ccan/list/list.h>
+
+/* The script runner is forked by main while it is small, and spawns
+ * the scripts main asks for, so that main is not forked on every
+ * connection. The scripts are started in the order they were
+ * requested, with up to max-concurrent-scripts running at a time.
+ *
+ * The replies to main are queued and sent without blocking, so that
+ * the runner always reads the requests of main, which are sent with
+ * blocking writes.
+ */
+
+extern char **environ;
+
+struct script_job_st {
+	struct list_node list;
+	pid_t pid; /* zero while queued */
+	ScriptRunMsg *msg;
+};
+
+typedef struct script_runner_st {
+	main_server_st *s;
+	int fd;
+	unsigned max; /* zero for no limit */
+	unsigned running;
+	unsigned eof; /* main closed its socket */
+
+	struct list_head queue;
+	struct list_head jobs; /* the running scripts */
+
+	/* the replies not sent to main yet */
+	uint8_t *out;
+	size_t out_size;
+} script_runner_st;
+
+static int sigchld_fd[2] = { -1, -1 };
+
+static void sigchld_handler(int signo)
+{
+	int e = errno;
+	ssize_t ret;
+
+	ret = write(sigchld_fd[1], "", 1);
+	(void)ret;
+	errno = e;
+}
+
+static void report_exit(script_runner_st *r, uint32_t id, unsigned status)
+{
+	ScriptExitMsg msg = SCRIPT_EXIT_MSG__INIT;
+	uint32_t length;
+	uint8_t *p;
+
+	msg.id = id;
+	msg.status = status;
+	length = script_exit_msg__get_packed_size(&msg);
+
+	/* as sent by send_msg() */
+	p = talloc_realloc_size(r, r->out, r->out_size + 5 + length);
+	if (p == NULL) {
+		mslog(r->s, NULL, LOG_ERR, "script runner: memory error");
+		return;
+	}
+	r->out = p;
+
+	p += r->out_size;
+	p[0] = CMD_SCRIPT_EXIT;
+	memcpy(p + 1, &length, 4);
+	script_exit_msg__pack(&msg, p + 5);
+	r->out_size += 5 + length;
+}
+
+static int flush_replies(script_runner_st *r)
+{
+	ssize_t ret;
+
+	while (r->out_size > 0) {
+		ret = send(r->fd, r->out, r->out_size, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		memmove(r->out, r->out + ret, r->out_size - ret);
+		r->out_size -= ret;
+	}
+	return 0;
+}
+
+/* The environment of the runner, with the variables of the job added
+ * or replaced */
+static char **job_env(void *pool, ScriptRunMsg *msg)
+{
+	char **env;
+	const char *p;
+	unsigned i, j, n = 0, len;
+
+	for (i = 0; environ[i] != NULL; i++)
+		;
+
+	env = talloc_array(pool, char *, i + msg->n_env + 1);
+	if (env == NULL)
+		return NULL;
+
+	for (j = 0; j < msg->n_env; j++)
+		env[n++] = msg->env[j];
+
+	for (i = 0; environ[i] != NULL; i++) {
+		p = strchr(environ[i], '=');
+		len = p != NULL ? p - environ[i] + 1 : strlen(environ[i]);
+
+		for (j = 0; j < msg->n_env; j++) {
+			if (strncmp(msg->env[j], environ[i], len) == 0)
+				break;
+		}
+		if (j == msg->n_env)
+			env[n++] = environ[i];
+	}
+	env[n] = NULL;
+
+	return env;
+}
+
+static void start_job(script_runner_st *r, struct script_job_st *job)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigdef;
+	char *argv[2];
+	char **env;
+	int ret;
+
+	env = job_env(job, job->msg);
+	if (env == NULL) {
+		ret = ENOMEM;
+		goto fail;
+	}
+
+	posix_spawn_file_actions_init(&actions);
+	/* set stdout to be stderr to avoid confusing scripts - note we have stdout closed */
+	posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+
+	sigemptyset(&sigdef);
+	sigaddset(&sigdef, SIGCHLD);
+	sigaddset(&sigdef, SIGPIPE);
+	sigaddset(&sigdef, SIGHUP);
+
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &sig_default_set);
+	posix_spawnattr_setsigdefault(&attr, &sigdef);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	argv[0] = job->msg->script;
+	argv[1] = NULL;
+
+	ret = posix_spawn(&job->pid, job->msg->script, &actions, &attr, argv, env);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	talloc_free(env);
+
+	if (ret != 0)
+		goto fail;
+
+	list_add_tail(&r->jobs, &job->list);
+	r->running++;
+	return;
+
+ fail:
+	mslog(r->s, NULL, LOG_ERR, "could not execute script %s: %s",
+	      job->msg->script, strerror(ret));
+	report_exit(r, job->msg->id, 1);
+	talloc_free(job);
+}
+
+static void start_jobs(script_runner_st *r)
+{
+	struct script_job_st *job;
+
+	while (r->max == 0 || r->running < r->max) {
+		job = list_top(&r->queue, struct script_job_st, list);
+		if (job == NULL)
+			break;
+
+		list_del(&job->list);
+		start_job(r, job);
+	}
+}
+
+static void reap_jobs(script_runner_st *r)
+{
+	struct script_job_st *job, *pos;
+	unsigned estatus;
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		estatus = WEXITSTATUS(status);
+		if (WIFSIGNALED(status))
+			estatus = 1;
+
+		list_for_each_safe(&r->jobs, job, pos, list) {
+			if (job->pid != pid)
+				continue;
+
+			list_del(&job->list);
+			r->running--;
+			report_exit(r, job->msg->id, estatus);
+			talloc_free(job);
+			break;
+		}
+	}
+}
+
+/* Drops the script with @id if it was not started yet, reporting it as
+ * failed. One that is running is let to finish, as a connect script
+ * may have made changes that its disconnect script undoes. */
+static void cancel_job(script_runner_st *r, uint32_t id)
+{
+	struct script_job_st *job, *pos;
+
+	list_for_each_safe(&r->queue, job, pos, list) {
+		if (job->msg->id == id) {
+			list_del(&job->list);
+			report_exit(r, id, 1);
+			talloc_free(job);
+			return;
+		}
+	}
+}
+
+/* Reads a command from main. Returns a negative error code when main
+ * closed its socket or sent an invalid command. */
+static int handle_command(script_runner_st *r)
+{
+	struct script_job_st *job;
+	ScriptCancelMsg *cmsg;
+	uint8_t cmd, *raw;
+	int length, ret;
+	void *pool;
+
+	length = recv_msg_headers(r->fd, &cmd, MAIN_SEC_MOD_TIMEOUT);
+	if (length < 0)
+		return length;
+
+	pool = talloc_new(r);
+	if (pool == NULL)
+		return ERR_MEM;
+
+	raw = talloc_size(pool, length);
+	if (raw == NULL) {
+		ret = ERR_MEM;
+		goto cleanup;
+	}
+
+	if (force_read_timeout(r->fd, raw, length, MAIN_SEC_MOD_TIMEOUT) != length) {
+		ret = ERR_BAD_COMMAND;
+		goto cleanup;
+	}
+
+	switch (cmd) {
+	case CMD_SCRIPT_RUN: {
+		PROTOBUF_ALLOCATOR(pa, pool);
+
+		job = talloc_zero(r, struct script_job_st);
+		if (job == NULL) {
+			ret = ERR_MEM;
+			goto cleanup;
+		}
+
+		job->msg = script_run_msg__unpack(&pa, length, raw);
+		if (job->msg == NULL) {
+			talloc_free(job);
+			ret = ERR_BAD_COMMAND;
+			goto cleanup;
+		}
+		talloc_steal(job, pool);
+		pool = NULL;
+
+		list_add_tail(&r->queue, &job->list);
+		break;
+	}
+	case CMD_SCRIPT_CANCEL: {
+		PROTOBUF_ALLOCATOR(pa, pool);
+
+		cmsg = script_cancel_msg__unpack(&pa, length, raw);
+		if (cmsg == NULL) {
+			ret = ERR_BAD_COMMAND;
+			goto cleanup;
+		}
+		cancel_job(r, cmsg->id);
+		break;
+	}
+	default:
+		mslog(r->s, NULL, LOG_ERR, "script runner received unknown command %u", (unsigned)cmd);
+		ret = ERR_BAD_COMMAND;
+		goto cleanup;
+	}
+
+	ret = 0;
+ cleanup:
+	talloc_free(pool);
+	return ret;
+}
+
+/* Serves the requests of main on @fd until main closes it, and then
+ * waits for the started and queued scripts to finish. */
+void script_runner_server(main_server_st *s, int fd, unsigned max)
+{
+	script_runner_st *r;
+	struct pollfd pfd[2];
+	struct sigaction sa;
+	sigset_t set;
+	char buf[64];
+	int ret;
+
+	r = talloc_zero(s, script_runner_st);
+	if (r == NULL)
+		exit(1);
+
+	r->s = s;
+	r->fd = fd;
+	r->max = max;
+	list_head_init(&r->queue);
+	list_head_init(&r->jobs);
+
+	if (pipe(sigchld_fd) == -1) {
+		mslog(s, NULL, LOG_ERR, "script runner: could not create pipe");
+		exit(1);
+	}
+	set_non_block(sigchld_fd[0]);
+	set_non_block(sigchld_fd[1]);
+	set_cloexec_flag(sigchld_fd[0], 1);
+	set_cloexec_flag(sigchld_fd[1], 1);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigchld_handler;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	/* the configuration of the runner is not reloaded */
+	ocsignal(SIGHUP, SIG_IGN);
+	ocsignal(SIGPIPE, SIG_IGN);
+	ocsignal(SIGTERM, SIG_DFL);
+	ocsignal(SIGINT, SIG_DFL);
+
+	set = sig_default_set;
+	sigdelset(&set, SIGCHLD);
+	sigprocmask(SIG_SETMASK, &set, NULL);
+
+	for (;;) {
+		if (r->eof && r->running == 0 && list_empty(&r->queue))
+			break;
+
+		pfd[0].fd = r->eof ? -1 : fd;
+		pfd[0].events = POLLIN | (r->out_size > 0 ? POLLOUT : 0);
+		pfd[0].revents = 0;
+		pfd[1].fd = sigchld_fd[0];
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+
+		ret = poll(pfd, 2, -1);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			mslog(s, NULL, LOG_ERR, "script runner: poll failed");
+			exit(1);
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			while (read(sigchld_fd[0], buf, sizeof(buf)) > 0)
+				;
+			reap_jobs(r);
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			if (handle_command(r) < 0)
+				r->eof = 1;
+		} else if (pfd[0].revents & (POLLHUP | POLLERR)) {
+			r->eof = 1;
+		}
+
+		start_jobs(r);
+
+		if (!r->eof && flush_replies(r) < 0)
+			r->eof = 1;
+	}
+
+	exit(0);
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SCRIPT_RUNNER_H
+# define SCRIPT_RUNNER_H
+
+#include <main.h>
+#include <ipc.pb-c.h>
+
+/* The connect, host-update and disconnect scripts are run by a helper
+ * process forked at startup, which runs up to max-concurrent-scripts
+ * of them at a time and reports their exit status to main. */
+
+int script_runner_init(main_server_st *s);
+void script_runner_deinit(void);
+void script_runner_shutdown(void);
+
+/* Queues the script in @msg, and sets msg->id. Returns zero or
+ * a negative error code. */
+int script_runner_run(main_server_st *s, ScriptRunMsg *msg);
+void script_runner_cancel(main_server_st *s, uint32_t id);
+
+void script_runner_server(main_server_st *s, int fd, unsigned max);
+
+#endif
@@ -34,6 +34,9 @@ typedef struct acct_mod_st {
 	int (*open_session)(void *vctx, unsigned auth_method, const common_acct_info_st *ai, const void *sid, unsigned sid_size); /* optional, may be null */
 	void (*session_stats)(void *vctx, unsigned auth_method, const common_acct_info_st *ai, struct stats_st *stats); /* optional, may be null */
 	void (*close_session)(void *vctx, unsigned auth_method, const common_acct_info_st *ai, struct stats_st *stats, unsigned discon_reason/*REASON_*/); /* optional may be null */
+
+	/* if set, sec-mod serializes the calls into the module with it */
+	pthread_mutex_t *lock;
 } acct_mod_st;
 
 /* The accounting messages exchanged with the worker thread are shown in ipc.proto.
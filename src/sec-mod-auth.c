@@ -30,6 +30,7 @@
 #include <netdb.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
@@ -78,6 +79,21 @@ void sec_auth_init(struct vhost_cfg_st *vhost)
 		vhost->perm_config.acct.amod->vhost_init(&vhost->perm_config.acct.acct_ctx, pool, vhost->perm_config.acct.additional);
 }
 
+/* The modules which are not thread-safe provide a lock, which serializes
+ * all calls into them; other modules are called concurrently.
+ */
+static void lock_module(pthread_mutex_t *lock)
+{
+	if (lock != NULL)
+		pthread_mutex_lock(lock);
+}
+
+static void unlock_module(pthread_mutex_t *lock)
+{
+	if (lock != NULL)
+		pthread_mutex_unlock(lock);
+}
+
 /* returns a negative number if we have reached the score for this client.
  */
 static
@@ -101,9 +117,11 @@ void sec_mod_add_score_to_ip(sec_mod_st *sec, client_entry_st *e, const char *ip
 		return;
 	}
 
+	pthread_mutex_lock(&sec->cmd_fd_lock);
 	ret = send_msg(lpool, sec->cmd_fd, CMD_SECM_BAN_IP, &msg,
 				(pack_size_func) ban_ip_msg__get_packed_size,
 				(pack_func) ban_ip_msg__pack);
+	pthread_mutex_unlock(&sec->cmd_fd_lock);
 	if (ret < 0) {
 		err = errno;
 		seclog(sec, LOG_WARNING, "error in sending BAN IP message: %s", strerror(err));
@@ -121,16 +139,19 @@ static void update_auth_time_stats(sec_mod_st * sec, time_t secs)
 	if (secs < 0)
 		return;
 
+	pthread_mutex_lock(&sec->stats_lock);
 	sec->total_authentications++;
 	if (sec->total_authentications == 0) { /* reset stats */
 		sec->avg_auth_time = 0;
 		sec->max_auth_time = 0;
-		return;
+		goto finish;
 	}
 
 	if (secs > sec->max_auth_time)
 		sec->max_auth_time = secs;
 	sec->avg_auth_time = (sec->avg_auth_time*(sec->total_authentications-1)+secs) / sec->total_authentications;
+ finish:
+	pthread_mutex_unlock(&sec->stats_lock);
 }
 
 static
@@ -166,7 +187,9 @@ int send_sec_auth_reply(int cfd, sec_mod_st * sec, client_entry_st * entry, AUTH
 			       sec_auth_reply_msg__get_packed_size,
 			       (pack_func) sec_auth_reply_msg__pack);
 	} else {
+		pthread_mutex_lock(&sec->stats_lock);
 		sec->auth_failures++;
+		pthread_mutex_unlock(&sec->stats_lock);
 
 		msg.reply = AUTH__REP__FAILED;
 
@@ -278,9 +301,11 @@ int check_group(sec_mod_st * sec, client_entry_st * e)
 		req_group = e->req_group_name;
 
 	if (e->module && e->module->auth_group) {
+		lock_module(e->module->lock);
 		ret =
 		    e->module->auth_group(e->auth_ctx, req_group, e->acct_info.groupname,
 				          sizeof(e->acct_info.groupname));
+		unlock_module(e->module->lock);
 		if (ret != 0) {
 			return -1;
 		}
@@ -331,7 +356,9 @@ int handle_sec_auth_res(int cfd, sec_mod_st * sec, client_entry_st * e, int resu
 
 	if ((result == ERR_AUTH_CONTINUE || result == 0) && e->module) {
 		memset(&pst, 0, sizeof(pst));
+		lock_module(e->module->lock);
 		ret = e->module->auth_msg(e->auth_ctx, e, &pst);
+		unlock_module(e->module->lock);
 		if (ret < 0) {
 			e->status = PS_AUTH_FAILED;
 			seclog(sec, LOG_ERR, "error getting auth msg");
@@ -369,8 +396,10 @@ int handle_sec_auth_res(int cfd, sec_mod_st * sec, client_entry_st * e, int resu
 		e->status = PS_AUTH_COMPLETED;
 
 		if (e->module) {
+			lock_module(e->module->lock);
 			e->module->auth_user(e->auth_ctx, e->acct_info.username,
 					     sizeof(e->acct_info.username));
+			unlock_module(e->module->lock);
 		}
 
 		ret = send_sec_auth_reply(cfd, sec, e, AUTH__REP__OK);
@@ -408,6 +437,9 @@ static void stats_add_to(stats_st *dst, stats_st *src1, stats_st *src2)
 	dst->bytes_out = src1->bytes_out + src2->bytes_out;
 	dst->bytes_in = src1->bytes_in + src2->bytes_in;
 	dst->uptime = src1->uptime + src2->uptime;
+	dst->comp_hits = src1->comp_hits + src2->comp_hits;
+	dst->comp_misses = src1->comp_misses + src2->comp_misses;
+	dst->comp_skipped = src1->comp_skipped + src2->comp_skipped;
 }
 
 static
@@ -436,28 +468,17 @@ int send_failed_session_open_reply(sec_mod_st *sec, int fd)
 	return ret;
 }
 
-int handle_secm_session_open_cmd(sec_mod_st *sec, int fd, const SecmSessionOpenMsg *req)
+static
+int open_client_session(sec_mod_st *sec, int fd, const SecmSessionOpenMsg *req, client_entry_st *e)
 {
-	client_entry_st *e;
 	void *lpool;
 	int ret;
 	SecmSessionReplyMsg rep = SECM_SESSION_REPLY_MSG__INIT;
 	GroupCfgSt _cfg = GROUP_CFG_ST__INIT;
+	const struct acct_mod_st *amod = e->vhost->perm_config.acct.amod;
 
 	rep.config = &_cfg;
 
-	if (req->sid.len != SID_SIZE) {
-		seclog(sec, LOG_ERR, "auth session open but with illegal sid size (%d)!",
-		       (int)req->sid.len);
-		return send_failed_session_open_reply(sec, fd);
-	}
-
-	e = find_client_entry(sec, req->sid.data);
-	if (e == NULL) {
-		seclog(sec, LOG_INFO, "session open but with non-existing SID!");
-		return send_failed_session_open_reply(sec, fd);
-	}
-
 	if (e->status != PS_AUTH_COMPLETED) {
 		seclog(sec, LOG_ERR, "session open received in unauthenticated client %s "SESSION_STR"!", e->acct_info.username, e->acct_info.safe_id);
 		return send_failed_session_open_reply(sec, fd);
@@ -474,8 +495,10 @@ int handle_secm_session_open_cmd(sec_mod_st *sec, int fd, const SecmSessionOpenM
 	if (req->ipv6)
 		strlcpy(e->acct_info.ipv6, req->ipv6, sizeof(e->acct_info.ipv6));
 
-	if (e->vhost->perm_config.acct.amod != NULL && e->vhost->perm_config.acct.amod->open_session != NULL && e->session_is_open == 0) {
-		ret = e->vhost->perm_config.acct.amod->open_session(e->vhost_acct_ctx, e->auth_type, &e->acct_info, req->sid.data, req->sid.len);
+	if (amod != NULL && amod->open_session != NULL && e->session_is_open == 0) {
+		lock_module(amod->lock);
+		ret = amod->open_session(e->vhost_acct_ctx, e->auth_type, &e->acct_info, req->sid.data, req->sid.len);
+		unlock_module(amod->lock);
 		if (ret < 0) {
 			e->status = PS_AUTH_FAILED;
 			seclog(sec, LOG_INFO, "denied session for user '%s' "SESSION_STR, e->acct_info.username, e->acct_info.safe_id);
@@ -532,29 +555,54 @@ int handle_secm_session_open_cmd(sec_mod_st *sec, int fd, const SecmSessionOpenM
 	e->exptime = time(0) + e->vhost->perm_config.config->cookie_timeout + AUTH_SLACK_TIME;
 	e->in_use++;
 
+	/* the interim updates of the session are read from its slot;
+	 * without one the worker sends them */
+	if (req->has_stats_slot && req->has_stats_gen && req->stats_gen != 0) {
+		e->stats_slot = req->stats_slot;
+		e->stats_gen = req->stats_gen;
+		e->interim_secs = _cfg.has_interim_update_secs ? _cfg.interim_update_secs :
+				  e->vhost->perm_config.config->stats_report_time;
+	} else {
+		e->stats_gen = 0;
+	}
+
+	if (e->stats_gen != 0 && e->interim_secs > 0 && amod != NULL && amod->session_stats != NULL)
+		schedule_client_interim(sec, e, time(0) + e->interim_secs);
+	else
+		schedule_client_interim(sec, e, 0);
+
 	return 0;
 }
 
-int handle_secm_session_close_cmd(sec_mod_st *sec, int fd, const SecmSessionCloseMsg *req)
+int handle_secm_session_open_cmd(sec_mod_st *sec, int fd, const SecmSessionOpenMsg *req)
 {
 	client_entry_st *e;
 	int ret;
-	CliStatsMsg rep = CLI_STATS_MSG__INIT;
 
 	if (req->sid.len != SID_SIZE) {
-		seclog(sec, LOG_ERR, "auth session close but with illegal sid size (%d)!",
+		seclog(sec, LOG_ERR, "auth session open but with illegal sid size (%d)!",
 		       (int)req->sid.len);
-		return ERR_BAD_COMMAND;
+		return send_failed_session_open_reply(sec, fd);
 	}
 
 	e = find_client_entry(sec, req->sid.data);
 	if (e == NULL) {
-		seclog(sec, LOG_INFO, "session close but with non-existing SID");
-		return send_msg(e, fd, CMD_SECM_CLI_STATS, &rep,
-		                (pack_size_func) cli_stats_msg__get_packed_size,
-		                (pack_func) cli_stats_msg__pack);
+		seclog(sec, LOG_INFO, "session open but with non-existing SID!");
+		return send_failed_session_open_reply(sec, fd);
 	}
 
+	ret = open_client_session(sec, fd, req, e);
+	put_client_entry(sec, e);
+
+	return ret;
+}
+
+static
+int close_client_session(sec_mod_st *sec, int fd, const SecmSessionCloseMsg *req, client_entry_st *e)
+{
+	int ret;
+	CliStatsMsg rep = CLI_STATS_MSG__INIT;
+
 	if (e->status < PS_AUTH_COMPLETED) {
 		seclog(sec, LOG_DEBUG, "session close received in unauthenticated client %s "SESSION_STR"!", e->acct_info.username, e->acct_info.safe_id);
 		return send_msg(e, fd, CMD_SECM_CLI_STATS, &rep,
@@ -576,6 +624,12 @@ int handle_secm_session_close_cmd(sec_mod_st *sec, int fd, const SecmSessionClos
 	/* send reply */
 	rep.bytes_in = e->stats.bytes_in;
 	rep.bytes_out = e->stats.bytes_out;
+	rep.comp_hits = e->stats.comp_hits;
+	rep.has_comp_hits = 1;
+	rep.comp_misses = e->stats.comp_misses;
+	rep.has_comp_misses = 1;
+	rep.comp_skipped = e->stats.comp_skipped;
+	rep.has_comp_skipped = 1;
 	rep.has_discon_reason = 1;
 	rep.discon_reason = e->discon_reason;
 
@@ -592,9 +646,41 @@ int handle_secm_session_close_cmd(sec_mod_st *sec, int fd, const SecmSessionClos
 	memset(&e->stats, 0, sizeof(e->stats));
 	expire_client_entry(sec, e);
 
+	/* no session remains to be updated */
+	if (e->in_use == 0) {
+		e->stats_gen = 0;
+		schedule_client_interim(sec, e, 0);
+	}
+
 	return 0;
 }
 
+int handle_secm_session_close_cmd(sec_mod_st *sec, int fd, const SecmSessionCloseMsg *req)
+{
+	client_entry_st *e;
+	int ret;
+	CliStatsMsg rep = CLI_STATS_MSG__INIT;
+
+	if (req->sid.len != SID_SIZE) {
+		seclog(sec, LOG_ERR, "auth session close but with illegal sid size (%d)!",
+		       (int)req->sid.len);
+		return ERR_BAD_COMMAND;
+	}
+
+	e = find_client_entry(sec, req->sid.data);
+	if (e == NULL) {
+		seclog(sec, LOG_INFO, "session close but with non-existing SID");
+		return send_msg(e, fd, CMD_SECM_CLI_STATS, &rep,
+		                (pack_size_func) cli_stats_msg__get_packed_size,
+		                (pack_func) cli_stats_msg__pack);
+	}
+
+	ret = close_client_session(sec, fd, req, e);
+	put_client_entry(sec, e);
+
+	return ret;
+}
+
 
 void handle_sec_auth_ban_ip_reply(sec_mod_st *sec, const BanIpReplyMsg *msg)
 {
@@ -615,25 +701,15 @@ void handle_sec_auth_ban_ip_reply(sec_mod_st *sec, const BanIpReplyMsg *msg)
 		e->status = PS_AUTH_FAILED;
 	}
 
+	put_client_entry(sec, e);
 	return;
 }
 
-int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req, pid_t pid)
+static
+int update_client_stats(sec_mod_st * sec, const CliStatsMsg * req, pid_t pid, client_entry_st *e)
 {
-	client_entry_st *e;
 	stats_st totals;
-
-	if (req->sid.len != SID_SIZE) {
-		seclog(sec, LOG_ERR, "auth session stats but with illegal sid size (%d)!",
-		       (int)req->sid.len);
-		return -1;
-	}
-
-	e = find_client_entry(sec, req->sid.data);
-	if (e == NULL) {
-		seclog(sec, LOG_INFO, "session stats but with non-existing SID");
-		return -1;
-	}
+	const struct acct_mod_st *amod = e->vhost->perm_config.acct.amod;
 
 	if (e->status != PS_AUTH_COMPLETED) {
 		seclog(sec, LOG_ERR, "session stats received in unauthenticated client %s "SESSION_STR"!", e->acct_info.username, e->acct_info.safe_id);
@@ -647,6 +723,12 @@ int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req, pid_t p
 		e->stats.bytes_out = req->bytes_out;
 	if (req->uptime > e->stats.uptime)
 		e->stats.uptime = req->uptime;
+	if (req->comp_hits > e->stats.comp_hits)
+		e->stats.comp_hits = req->comp_hits;
+	if (req->comp_misses > e->stats.comp_misses)
+		e->stats.comp_misses = req->comp_misses;
+	if (req->comp_skipped > e->stats.comp_skipped)
+		e->stats.comp_skipped = req->comp_skipped;
 
 	if (req->has_discon_reason && req->discon_reason != 0) {
 		e->discon_reason = req->discon_reason;
@@ -655,7 +737,7 @@ int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req, pid_t p
 	/* update PID */
 	e->acct_info.id = pid;
 
-	if (e->vhost->perm_config.acct.amod == NULL || e->vhost->perm_config.acct.amod->session_stats == NULL)
+	if (amod == NULL || amod->session_stats == NULL)
 		return 0;
 
 	stats_add_to(&totals, &e->stats, &e->saved_stats);
@@ -666,11 +748,81 @@ int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req, pid_t p
 	if (req->ipv6)
 		strlcpy(e->acct_info.ipv6, req->ipv6, sizeof(e->acct_info.ipv6));
 
-	e->vhost->perm_config.acct.amod->session_stats(e->vhost_acct_ctx, e->auth_type, &e->acct_info, &totals);
+	lock_module(amod->lock);
+	amod->session_stats(e->vhost_acct_ctx, e->auth_type, &e->acct_info, &totals);
+	unlock_module(amod->lock);
 
 	return 0;
 }
 
+/* Sends the accounting interim update of the open session of @e, held
+ * by the caller, with the counters its worker published. */
+void update_client_interim(sec_mod_st *sec, client_entry_st *e)
+{
+	const struct acct_mod_st *amod = e->vhost->perm_config.acct.amod;
+	session_stats_st st;
+	stats_st totals;
+
+	if (e->status != PS_AUTH_COMPLETED || e->stats_gen == 0)
+		return;
+
+	/* the session ended; its worker sends the final counters */
+	if (session_stats_read(e->stats_slot, e->stats_gen, &st) < 0) {
+		seclog(sec, LOG_DEBUG, "no counters for the interim update of user '%s' "SESSION_STR,
+		       e->acct_info.username, e->acct_info.safe_id);
+		e->stats_gen = 0;
+		return;
+	}
+
+	/* stats only increase */
+	if (st.bytes_in > e->stats.bytes_in)
+		e->stats.bytes_in = st.bytes_in;
+	if (st.bytes_out > e->stats.bytes_out)
+		e->stats.bytes_out = st.bytes_out;
+	if (st.uptime > e->stats.uptime)
+		e->stats.uptime = st.uptime;
+	if (st.comp_hits > e->stats.comp_hits)
+		e->stats.comp_hits = st.comp_hits;
+	if (st.comp_misses > e->stats.comp_misses)
+		e->stats.comp_misses = st.comp_misses;
+	if (st.comp_skipped > e->stats.comp_skipped)
+		e->stats.comp_skipped = st.comp_skipped;
+
+	if (amod == NULL || amod->session_stats == NULL)
+		return;
+
+	stats_add_to(&totals, &e->stats, &e->saved_stats);
+
+	lock_module(amod->lock);
+	amod->session_stats(e->vhost_acct_ctx, e->auth_type, &e->acct_info, &totals);
+	unlock_module(amod->lock);
+
+	schedule_client_interim(sec, e, time(0) + e->interim_secs);
+}
+
+int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req, pid_t pid)
+{
+	client_entry_st *e;
+	int ret;
+
+	if (req->sid.len != SID_SIZE) {
+		seclog(sec, LOG_ERR, "auth session stats but with illegal sid size (%d)!",
+		       (int)req->sid.len);
+		return -1;
+	}
+
+	e = find_client_entry(sec, req->sid.data);
+	if (e == NULL) {
+		seclog(sec, LOG_INFO, "session stats but with non-existing SID");
+		return -1;
+	}
+
+	ret = update_client_stats(sec, req, pid, e);
+	put_client_entry(sec, e);
+
+	return ret;
+}
+
 int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
 {
 	client_entry_st *e;
@@ -712,9 +864,11 @@ int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
 
 	e->status = PS_AUTH_CONT;
 
+	lock_module(e->module->lock);
 	ret =
 	    e->module->auth_pass(e->auth_ctx, req->password,
 			      strlen(req->password));
+	unlock_module(e->module->lock);
 	if (ret < 0) {
 		if (ret != ERR_AUTH_CONTINUE) {
 			seclog(sec, LOG_DEBUG,
@@ -725,7 +879,10 @@ int handle_sec_auth_cont(int cfd, sec_mod_st * sec, const SecAuthContMsg * req)
 	}
 
  cleanup:
-	return handle_sec_auth_res(cfd, sec, e, ret);
+	ret = handle_sec_auth_res(cfd, sec, e, ret);
+	put_client_entry(sec, e);
+
+	return ret;
 }
 
 static
@@ -784,8 +941,10 @@ int handle_sec_auth_init(int cfd, sec_mod_st *sec, const SecAuthInitMsg *req, pi
 		st.user_agent = req->user_agent;
 		st.id = pid;
 
+		lock_module(e->module->lock);
 		ret =
 		    e->module->auth_init(&e->auth_ctx, e, e->vhost_auth_ctx, &st);
+		unlock_module(e->module->lock);
 		if (ret == ERR_AUTH_CONTINUE) {
 			need_continue = 1;
 		} else if (ret < 0) {
@@ -835,7 +994,10 @@ int handle_sec_auth_init(int cfd, sec_mod_st *sec, const SecAuthInitMsg *req, pi
 
 	ret = 0;
  cleanup:
-	return handle_sec_auth_res(cfd, sec, e, ret);
+	ret = handle_sec_auth_res(cfd, sec, e, ret);
+	put_client_entry(sec, e);
+
+	return ret;
 }
 
 void sec_auth_user_deinit(sec_mod_st *sec, client_entry_st *e)
@@ -846,12 +1008,17 @@ void sec_auth_user_deinit(sec_mod_st *sec, client_entry_st *e)
 
 	seclog(sec, LOG_DEBUG, "permamently closing session of user '%s' "SESSION_STR, e->acct_info.username, e->acct_info.safe_id);
 	if (vhost->perm_config.acct.amod != NULL && vhost->perm_config.acct.amod->close_session != NULL && e->session_is_open != 0) {
+		lock_module(vhost->perm_config.acct.amod->lock);
 		vhost->perm_config.acct.amod->close_session(e->vhost_acct_ctx, e->auth_type, &e->acct_info, &e->saved_stats, e->discon_reason);
+		unlock_module(vhost->perm_config.acct.amod->lock);
 	}
 
 	if (e->auth_ctx != NULL) {
-		if (e->module)
+		if (e->module) {
+			lock_module(e->module->lock);
 			e->module->auth_deinit(e->auth_ctx);
+			unlock_module(e->module->lock);
+		}
 		e->auth_ctx = NULL;
 	}
 }
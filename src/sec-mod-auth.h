@@ -23,6 +23,7 @@
 
 #include <main.h>
 #include <sec-mod.h>
+#include <pthread.h>
 
 #define MAX_AUTH_REQS 8
 
@@ -44,6 +45,9 @@ typedef struct auth_mod_st {
 
 	void (*auth_deinit)(void* ctx);
 	void (*group_list)(void *pool, void *additional, char ***groupname, unsigned *groupname_size);
+
+	/* if set, sec-mod serializes the calls into the module with it */
+	pthread_mutex_t *lock;
 } auth_mod_st;
 
 void main_auth_init(main_server_st *s);
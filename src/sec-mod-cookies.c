@@ -40,74 +40,92 @@ static void send_empty_reply(void *pool, int fd, sec_mod_st *sec)
 	}
 }
 
-void handle_secm_list_cookies_reply(void *pool, int fd, sec_mod_st *sec)
+struct list_cookies_st {
+	void *pool;
+	SecmListCookiesReplyMsg *msg;
+	unsigned size;
+	time_t now;
+};
+
+/* The entries may change or be freed after this returns, so
+ * everything is copied. */
+static void append_cookie(sec_mod_st *sec, client_entry_st *t, void *priv)
 {
-	SecmListCookiesReplyMsg msg = SECM_LIST_COOKIES_REPLY_MSG__INIT;
-	struct htable *db = sec->client_db;
-	client_entry_st *t;
-	struct htable_iter iter;
-	CookieIntMsg *cookies;
-	int ret;
-	time_t now = time(0);
+	struct list_cookies_st *ctx = priv;
+	SecmListCookiesReplyMsg *msg = ctx->msg;
+	CookieIntMsg *cookie;
 
-	if (db == NULL) {
-		send_empty_reply(pool, fd, sec);
+	if IS_CLIENT_ENTRY_EXPIRED(sec, t, ctx->now)
 		return;
+
+	if (msg->n_cookies >= ctx->size) {
+		ctx->size = ctx->size * 2 + 16;
+		msg->cookies = talloc_realloc(ctx->pool, msg->cookies, CookieIntMsg*, ctx->size);
+		if (msg->cookies == NULL) {
+			ctx->size = msg->n_cookies = 0;
+			return;
+		}
 	}
 
-	seclog(sec, LOG_DEBUG, "sending list cookies reply to main");
+	cookie = talloc(msg->cookies, CookieIntMsg);
+	if (cookie == NULL)
+		return;
 
-	msg.cookies = talloc_size(pool, sizeof(CookieIntMsg*)*db->elems);
-	if (msg.cookies == NULL) {
-		send_empty_reply(pool, fd, sec);
+	cookie_int_msg__init(cookie);
+	cookie->safe_id.data = talloc_memdup(cookie, t->acct_info.safe_id, sizeof(t->acct_info.safe_id));
+	cookie->safe_id.len = sizeof(t->acct_info.safe_id);
+
+	cookie->session_is_open = t->session_is_open;
+	cookie->tls_auth_ok = t->tls_auth_ok;
+
+	if (t->created > 0)
+		cookie->created = t->created;
+	else
+		cookie->created = 0;
+
+	/* a session which is in use, does not expire */
+	if (t->exptime > 0 && t->in_use == 0)
+		cookie->expires = t->exptime;
+	else
+		cookie->expires = 0;
+	cookie->username = talloc_strdup(cookie, t->acct_info.username);
+	cookie->groupname = talloc_strdup(cookie, t->acct_info.groupname);
+	cookie->user_agent = talloc_strdup(cookie, t->acct_info.user_agent);
+	cookie->remote_ip = talloc_strdup(cookie, t->acct_info.remote_ip);
+	cookie->status = t->status;
+	cookie->in_use = t->in_use;
+	cookie->vhost = VHOSTNAME(t->vhost);
+
+	if (cookie->safe_id.data == NULL || cookie->username == NULL ||
+	    cookie->groupname == NULL || cookie->user_agent == NULL ||
+	    cookie->remote_ip == NULL) {
+		talloc_free(cookie);
 		return;
 	}
 
-	cookies = talloc_size(pool, sizeof(CookieIntMsg)*db->elems);
-	if (cookies == NULL) {
+	msg->cookies[msg->n_cookies] = cookie;
+	msg->n_cookies++;
+}
+
+void handle_secm_list_cookies_reply(void *pool, int fd, sec_mod_st *sec)
+{
+	SecmListCookiesReplyMsg msg = SECM_LIST_COOKIES_REPLY_MSG__INIT;
+	struct list_cookies_st ctx;
+	int ret;
+
+	if (sec->client_db == NULL) {
 		send_empty_reply(pool, fd, sec);
 		return;
 	}
 
-	t = htable_first(db, &iter);
-	while (t != NULL) {
-		if IS_CLIENT_ENTRY_EXPIRED(sec, t, now)
-			goto cont;
-
-		if (msg.n_cookies >= db->elems)
-			break;
-
-		cookie_int_msg__init(&cookies[msg.n_cookies]);
-		cookies[msg.n_cookies].safe_id.data = (void*)t->acct_info.safe_id;
-		cookies[msg.n_cookies].safe_id.len = sizeof(t->acct_info.safe_id);
-
-		cookies[msg.n_cookies].session_is_open = t->session_is_open;
-		cookies[msg.n_cookies].tls_auth_ok = t->tls_auth_ok;
-
-		if (t->created > 0)
-			cookies[msg.n_cookies].created = t->created;
-		else
-			cookies[msg.n_cookies].created = 0;
-
-		/* a session which is in use, does not expire */
-		if (t->exptime > 0 && t->in_use == 0)
-			cookies[msg.n_cookies].expires = t->exptime;
-		else
-			cookies[msg.n_cookies].expires = 0;
-		cookies[msg.n_cookies].username = t->acct_info.username;
-		cookies[msg.n_cookies].groupname = t->acct_info.groupname;
-		cookies[msg.n_cookies].user_agent = t->acct_info.user_agent;
-		cookies[msg.n_cookies].remote_ip = t->acct_info.remote_ip;
-		cookies[msg.n_cookies].status = t->status;
-		cookies[msg.n_cookies].in_use = t->in_use;
-		cookies[msg.n_cookies].vhost = VHOSTNAME(t->vhost);
-
-		msg.cookies[msg.n_cookies] = &cookies[msg.n_cookies];
-		msg.n_cookies++;
-
- cont:
-		t = htable_next(db, &iter);
-	}
+	seclog(sec, LOG_DEBUG, "sending list cookies reply to main");
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.pool = pool;
+	ctx.msg = &msg;
+	ctx.now = time(0);
+
+	foreach_client_entry(sec, append_cookie, &ctx);
 
 	ret = send_msg(pool, fd, CMD_SECM_LIST_COOKIES_REPLY, &msg,
 		(pack_size_func) secm_list_cookies_reply_msg__get_packed_size,
@@ -117,6 +135,4 @@ void handle_secm_list_cookies_reply(void *pool, int fd, sec_mod_st *sec)
 	}
 
 	talloc_free(msg.cookies);
-	talloc_free(cookies);
 }
-
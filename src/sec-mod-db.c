@@ -35,6 +35,7 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/un.h>
+#include <pthread.h>
 #include <common.h>
 #include <syslog.h>
 #include <vpn.h>
@@ -43,10 +44,35 @@
 #include <sec-mod.h>
 #include <ccan/hash/hash.h>
 #include <ccan/htable/htable.h>
+#include <ccan/container_of/container_of.h>
 
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 
+/* The client database is split in shards, selected by the (random) SID,
+ * so that the job threads rarely contend for the same lock. Each shard
+ * lock protects the hash table, the reference counters of its entries
+ * and the talloc context the entries are allocated from. The entries
+ * themselves are protected by their own lock, which is never acquired
+ * while holding the lock of a shard.
+ */
+#define CLIENT_DB_SHARDS 16
+
+typedef struct client_db_shard_st {
+	pthread_mutex_t lock;
+	struct htable ht;
+	/* the entries by their expiration time; an entry is re-added
+	 * when it is put, and checked again when its time comes */
+	timer_wheel_st expiry;
+	/* the open sessions by the time of their next interim update */
+	timer_wheel_st interim;
+	void *pool;
+} client_db_shard_st;
+
+struct client_db_st {
+	client_db_shard_st shard[CLIENT_DB_SHARDS];
+};
+
 static size_t rehash(const void *_e, void *unused)
 {
 	const client_entry_st *e = _e;
@@ -54,13 +80,31 @@ static size_t rehash(const void *_e, void *unused)
 	return hash_any(e->sid, sizeof(e->sid), 0);
 }
 
+static client_db_shard_st *get_shard(sec_mod_st *sec, const uint8_t sid[SID_SIZE])
+{
+	return &sec->client_db->shard[sid[0] % CLIENT_DB_SHARDS];
+}
+
 void *sec_mod_client_db_init(sec_mod_st *sec)
 {
-	struct htable *db = talloc(sec, struct htable);
+	struct client_db_st *db = talloc_zero(sec, struct client_db_st);
+	unsigned i;
+
 	if (db == NULL)
 		return NULL;
 
-	htable_init(db, rehash, NULL);
+	for (i = 0; i < CLIENT_DB_SHARDS; i++) {
+		db->shard[i].pool = talloc_new(db);
+		if (db->shard[i].pool == NULL) {
+			talloc_free(db);
+			return NULL;
+		}
+
+		pthread_mutex_init(&db->shard[i].lock, NULL);
+		htable_init(&db->shard[i].ht, rehash, NULL);
+		timer_wheel_init(&db->shard[i].expiry, time(0));
+		timer_wheel_init(&db->shard[i].interim, time(0));
+	}
 	sec->client_db = db;
 
 	return db;
@@ -68,125 +112,343 @@ void *sec_mod_client_db_init(sec_mod_st *sec)
 
 void sec_mod_client_db_deinit(sec_mod_st *sec)
 {
-struct htable *db = sec->client_db;
+	struct client_db_st *db = sec->client_db;
+	unsigned i;
 
-	htable_clear(db);
+	for (i = 0; i < CLIENT_DB_SHARDS; i++)
+		htable_clear(&db->shard[i].ht);
 	talloc_free(db);
+	sec->client_db = NULL;
 }
 
 /* The number of elements */
 unsigned sec_mod_client_db_elems(sec_mod_st *sec)
 {
-struct htable *db = sec->client_db;
+	struct client_db_st *db = sec->client_db;
+	unsigned i, elems = 0;
 
-	if (db)
-		return db->elems;
-	else
+	if (db == NULL)
 		return 0;
+
+	for (i = 0; i < CLIENT_DB_SHARDS; i++) {
+		pthread_mutex_lock(&db->shard[i].lock);
+		elems += db->shard[i].ht.elems;
+		pthread_mutex_unlock(&db->shard[i].lock);
+	}
+
+	return elems;
+}
+
+static bool client_entry_cmp(const void *_c1, void *_c2)
+{
+	const struct client_entry_st *c1 = _c1;
+	struct client_entry_st *c2 = _c2;
+
+	if (memcmp(c1->sid, c2->sid, SID_SIZE) == 0)
+		return 1;
+	return 0;
 }
 
+/* must be called with the shard locked */
+static client_entry_st *shard_get(client_db_shard_st *shard, const uint8_t sid[SID_SIZE])
+{
+	client_entry_st t;
+
+	memcpy(t.sid, sid, SID_SIZE);
+
+	return htable_get(&shard->ht, rehash(&t, NULL), client_entry_cmp, &t);
+}
+
+/* must be called with the shard locked */
+static void free_entry(client_entry_st *e)
+{
+	pthread_mutex_destroy(&e->lock);
+	talloc_free(e);
+}
+
+/* Returns the new entry, held by the caller as if returned by
+ * find_client_entry(). */
 client_entry_st *new_client_entry(sec_mod_st *sec, struct vhost_cfg_st *vhost, const char *ip, unsigned pid)
 {
-	struct htable *db = sec->client_db;
-	client_entry_st *e, *te;
+	client_db_shard_st *shard;
+	client_entry_st *e;
 	int ret;
 	int retries = 3;
+	unsigned unique = 0;
 	time_t now;
-
-	e = talloc_zero(db, client_entry_st);
-	if (e == NULL) {
-		return NULL;
-	}
-
-	strlcpy(e->acct_info.remote_ip, ip, sizeof(e->acct_info.remote_ip));
-	e->acct_info.id = pid;
-	e->vhost = vhost;
+	uint8_t sid[SID_SIZE];
 
 	do {
-		ret = gnutls_rnd(GNUTLS_RND_RANDOM, e->sid, sizeof(e->sid));
+		ret = gnutls_rnd(GNUTLS_RND_RANDOM, sid, sizeof(sid));
 		if (ret < 0) {
 			seclog(sec, LOG_ERR, "error generating SID");
-			goto fail;
+			return NULL;
 		}
 
+		shard = get_shard(sec, sid);
+		pthread_mutex_lock(&shard->lock);
+
 		/* check if in use */
-		te = find_client_entry(sec, e->sid);
-	} while(te != NULL && retries-- >= 0);
+		if (shard_get(shard, sid) == NULL) {
+			unique = 1;
+			break;
+		}
 
-	if (te != NULL) {
+		pthread_mutex_unlock(&shard->lock);
+	} while(retries-- >= 0);
+
+	if (unique == 0) {
 		seclog(sec, LOG_ERR,
 		       "could not generate a unique SID!");
-		goto fail;
+		return NULL;
 	}
 
+	e = talloc_zero(shard->pool, client_entry_st);
+	if (e == NULL) {
+		pthread_mutex_unlock(&shard->lock);
+		return NULL;
+	}
+
+	memcpy(e->sid, sid, sizeof(e->sid));
+	strlcpy(e->acct_info.remote_ip, ip, sizeof(e->acct_info.remote_ip));
+	e->acct_info.id = pid;
+	e->vhost = vhost;
+
 	calc_safe_id(e->sid, SID_SIZE, (char *)e->acct_info.safe_id, sizeof(e->acct_info.safe_id));
 	now = time(0);
 	e->exptime = now + vhost->perm_config.config->cookie_timeout + AUTH_SLACK_TIME;
 	e->created = now;
 
-	if (htable_add(db, rehash(e, NULL), e) == 0) {
+	/* the entry is not reachable yet, so this cannot block */
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_mutex_lock(&e->lock);
+	e->refs = 1;
+
+	if (htable_add(&shard->ht, rehash(e, NULL), e) == 0) {
 		seclog(sec, LOG_ERR,
 		       "could not add client entry to hash table");
-		goto fail;
+		pthread_mutex_unlock(&e->lock);
+		free_entry(e);
+		pthread_mutex_unlock(&shard->lock);
+		return NULL;
 	}
+	timer_wheel_add(&shard->expiry, &e->expiry, e->exptime);
+	pthread_mutex_unlock(&shard->lock);
 
 	return e;
-
- fail:
-	talloc_free(e);
-	return NULL;
 }
 
-static bool client_entry_cmp(const void *_c1, void *_c2)
+/* Returns the entry with the given SID, with its lock held; the
+ * caller must release it with put_client_entry(). */
+client_entry_st *find_client_entry(sec_mod_st *sec, uint8_t sid[SID_SIZE])
 {
-	const struct client_entry_st *c1 = _c1;
-	struct client_entry_st *c2 = _c2;
+	client_db_shard_st *shard = get_shard(sec, sid);
+	client_entry_st *e;
 
-	if (memcmp(c1->sid, c2->sid, SID_SIZE) == 0)
-		return 1;
-	return 0;
-}
+	pthread_mutex_lock(&shard->lock);
+	e = shard_get(shard, sid);
+	if (e != NULL)
+		e->refs++;
+	pthread_mutex_unlock(&shard->lock);
 
-client_entry_st *find_client_entry(sec_mod_st *sec, uint8_t sid[SID_SIZE])
-{
-	struct htable *db = sec->client_db;
-	client_entry_st t;
+	if (e == NULL)
+		return NULL;
 
-	memcpy(t.sid, sid, SID_SIZE);
+	pthread_mutex_lock(&e->lock);
+
+	/* deleted while we were waiting for it */
+	if (e->deleted) {
+		put_client_entry(sec, e);
+		return NULL;
+	}
+
+	return e;
+}
 
-	return htable_get(db, rehash(&t, NULL), client_entry_cmp, &t);
+void put_client_entry(sec_mod_st *sec, client_entry_st * e)
+{
+	client_db_shard_st *shard = get_shard(sec, e->sid);
+	time_t exptime = e->exptime;
+
+	pthread_mutex_unlock(&e->lock);
+
+	pthread_mutex_lock(&shard->lock);
+	if (--e->refs == 0 && e->deleted) {
+		free_entry(e);
+	} else if (!e->deleted && exptime != -1) {
+		/* a later time set by another holder is kept, as the
+		 * entry is checked again when it expires */
+		if (!timer_wheel_pending(&e->expiry) || exptime < e->expiry.expires)
+			timer_wheel_add(&shard->expiry, &e->expiry, exptime);
+	}
+	pthread_mutex_unlock(&shard->lock);
 }
 
 static void clean_entry(sec_mod_st *sec, client_entry_st * e)
 {
 	sec_auth_user_deinit(sec, e);
 	talloc_free(e->msg_str);
-	talloc_free(e);
+	e->msg_str = NULL;
 }
 
-void cleanup_client_entries(sec_mod_st *sec)
+/* Removes up to @max expired entries from the database, and returns
+ * them in @expired; they must be passed to cleanup_client_entries().
+ * The entries with references are not checked; they are scheduled
+ * again when put. */
+unsigned expire_client_entries(sec_mod_st *sec, client_entry_st **expired, unsigned max)
 {
-	struct htable *db = sec->client_db;
+	struct client_db_st *db = sec->client_db;
+	static unsigned next_shard = 0;
+	client_db_shard_st *shard;
+	timer_wheel_entry_st *we;
 	client_entry_st *t;
-	struct htable_iter iter;
 	time_t now = time(0);
+	unsigned i, n = 0;
+
+	/* start from a different shard each time, so that a shard
+	 * with many expired entries does not delay the others */
+	for (i = 0; i < CLIENT_DB_SHARDS && n < max; i++) {
+		shard = &db->shard[(next_shard + i) % CLIENT_DB_SHARDS];
+
+		pthread_mutex_lock(&shard->lock);
+		while (n < max && (we = timer_wheel_expired(&shard->expiry, now)) != NULL) {
+			t = container_of(we, client_entry_st, expiry);
+
+			/* an entry without references cannot be acquired without
+			 * the shard lock, so it can be inspected here */
+			if (t->refs > 0)
+				continue;
+
+			if (IS_CLIENT_ENTRY_EXPIRED_FULL(sec, t, now, 1)) {
+				htable_del(&shard->ht, rehash(t, NULL), t);
+				timer_wheel_del(&shard->interim, &t->interim);
+				t->deleted = 1;
+				expired[n++] = t;
+			} else if (t->exptime != -1 && t->in_use == 0) {
+				timer_wheel_add(&shard->expiry, &t->expiry, t->exptime);
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	next_shard++;
+
+	return n;
+}
+
+/* Schedules the interim update of an entry held by the caller at
+ * @when, or cancels it if @when is zero. */
+void schedule_client_interim(sec_mod_st *sec, client_entry_st *e, time_t when)
+{
+	client_db_shard_st *shard = get_shard(sec, e->sid);
 
-	t = htable_first(db, &iter);
-	while (t != NULL) {
-		if IS_CLIENT_ENTRY_EXPIRED_FULL(sec, t, now, 1) {
-			htable_delval(db, &iter);
-			clean_entry(sec, t);
+	pthread_mutex_lock(&shard->lock);
+	if (e->deleted || when == 0)
+		timer_wheel_del(&shard->interim, &e->interim);
+	else
+		timer_wheel_add(&shard->interim, &e->interim, when);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* Returns in @due up to @max entries whose interim update is due,
+ * referenced as by foreach_client_entry(); each must be locked and
+ * passed to put_client_entry(). */
+unsigned interim_client_entries(sec_mod_st *sec, client_entry_st **due, unsigned max)
+{
+	struct client_db_st *db = sec->client_db;
+	client_db_shard_st *shard;
+	timer_wheel_entry_st *we;
+	client_entry_st *t;
+	time_t now = time(0);
+	unsigned i, n = 0;
+
+	for (i = 0; i < CLIENT_DB_SHARDS && n < max; i++) {
+		shard = &db->shard[i];
+
+		pthread_mutex_lock(&shard->lock);
+		while (n < max && (we = timer_wheel_expired(&shard->interim, now)) != NULL) {
+			t = container_of(we, client_entry_st, interim);
+			t->refs++;
+			due[n++] = t;
 		}
-		t = htable_next(db, &iter);
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	return n;
+}
+
+/* Releases the entries returned by expire_client_entries(). */
+void cleanup_client_entries(sec_mod_st *sec, client_entry_st **expired, unsigned n)
+{
+	client_db_shard_st *shard;
+	unsigned j;
+
+	/* the modules may block; they are called without the shard lock */
+	for (j = 0; j < n; j++)
+		clean_entry(sec, expired[j]);
+
+	for (j = 0; j < n; j++) {
+		shard = get_shard(sec, expired[j]->sid);
 
+		pthread_mutex_lock(&shard->lock);
+		free_entry(expired[j]);
+		pthread_mutex_unlock(&shard->lock);
 	}
 }
 
+/* Calls @func for every entry of the database, with the entry held. The
+ * entries are collected first, so that @func is called without holding
+ * the shard lock. */
+void foreach_client_entry(sec_mod_st *sec, client_entry_func func, void *priv)
+{
+	struct client_db_st *db = sec->client_db;
+	client_db_shard_st *shard;
+	client_entry_st *t, **entries;
+	struct htable_iter iter;
+	unsigned i, j, n;
+
+	for (i = 0; i < CLIENT_DB_SHARDS; i++) {
+		shard = &db->shard[i];
+
+		pthread_mutex_lock(&shard->lock);
+		entries = malloc(sizeof(*entries) * (shard->ht.elems + 1));
+		if (entries == NULL) {
+			pthread_mutex_unlock(&shard->lock);
+			continue;
+		}
+
+		n = 0;
+		t = htable_first(&shard->ht, &iter);
+		while (t != NULL) {
+			t->refs++;
+			entries[n++] = t;
+			t = htable_next(&shard->ht, &iter);
+		}
+		pthread_mutex_unlock(&shard->lock);
+
+		for (j = 0; j < n; j++) {
+			pthread_mutex_lock(&entries[j]->lock);
+			if (entries[j]->deleted == 0)
+				func(sec, entries[j], priv);
+			put_client_entry(sec, entries[j]);
+		}
+
+		free(entries);
+	}
+}
+
+/* Removes an entry held by the caller from the database; it is freed
+ * when it is put by all its holders. */
 void del_client_entry(sec_mod_st *sec, client_entry_st * e)
 {
-	struct htable *db = sec->client_db;
+	client_db_shard_st *shard = get_shard(sec, e->sid);
+
+	pthread_mutex_lock(&shard->lock);
+	htable_del(&shard->ht, rehash(e, NULL), e);
+	timer_wheel_del(&shard->expiry, &e->expiry);
+	timer_wheel_del(&shard->interim, &e->interim);
+	e->deleted = 1;
+	pthread_mutex_unlock(&shard->lock);
 
-	htable_del(db, rehash(e, NULL), e);
 	clean_entry(sec, e);
 }
 
@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The requests which may block on an authentication or accounting
+ * backend (e.g., a radius server) are served by a bounded pool of
+ * threads, so that the event loop of sec-mod keeps serving the other
+ * workers and main in the meantime. The loop reads the requests and
+ * queues them as jobs; a job replies on its connection by itself.
+ *
+ * The requests of main are queued separately and served by a thread of
+ * their own, so that main, which waits for their replies, is never
+ * delayed by the worker requests queued or blocked before them.
+ *
+ * The jobs use the configuration, so reload_server() pauses them
+ * while it replaces it.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <common.h>
+#include <syslog.h>
+#include <vpn.h>
+#include <sec-mod.h>
+#include <ccan/list/list.h>
+
+#define JOB_THREADS 8
+/* beyond that the worker requests are refused */
+#define MAX_PENDING_JOBS 1024
+
+static struct {
+	sec_mod_st *sec;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* signalled on new jobs and on resume */
+	pthread_cond_t main_cond; /* likewise, for main_head */
+	pthread_cond_t idle; /* signalled when no job is running */
+	struct list_head head;
+	struct list_head main_head; /* the requests of main */
+	unsigned pending; /* on head */
+	unsigned running;
+	unsigned paused;
+	unsigned threads;
+	unsigned main_thread; /* whether the thread of main_head runs */
+} jobs = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.main_cond = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+
+static unsigned latency_type(uint8_t cmd)
+{
+	switch (cmd) {
+	case CMD_SEC_AUTH_INIT:
+	case CMD_SEC_AUTH_CONT:
+		return LAT_AUTH;
+	case CMD_SECM_SESSION_OPEN:
+	case CMD_SECM_SESSION_CLOSE:
+		return LAT_SESSION;
+	default:
+		if (is_key_op(cmd))
+			return LAT_KEY_OP;
+		return LAT_STAGES;
+	}
+}
+
+/* Accounts the time since @start (CLOCK_MONOTONIC) to the histogram of
+ * @type (LAT_); may be called by any thread. */
+void sec_mod_record_latency(sec_mod_st *sec, unsigned type, const struct timespec *start)
+{
+	uint64_t us;
+
+	if (type >= LAT_STAGES)
+		return;
+
+	us = lat_hist_elapsed(start);
+
+	pthread_mutex_lock(&sec->stats_lock);
+	lat_hist_add(&sec->latency[type], us);
+	pthread_mutex_unlock(&sec->stats_lock);
+}
+
+static void serve_jobs(void *pool, struct list_head *head, pthread_cond_t *cond)
+{
+	sec_mod_st *sec = jobs.sec;
+	sec_mod_job_st *job;
+	void *lpool;
+
+	for (;;) {
+		pthread_mutex_lock(&jobs.lock);
+		while (jobs.paused || list_empty(head))
+			pthread_cond_wait(cond, &jobs.lock);
+
+		job = list_top(head, sec_mod_job_st, list);
+		list_del(&job->list);
+		if (head == &jobs.head)
+			jobs.pending--;
+		jobs.running++;
+		pthread_mutex_unlock(&jobs.lock);
+
+		lpool = talloc_new(pool);
+		if (lpool != NULL) {
+			job->func(lpool, sec, job);
+			talloc_free(lpool);
+		}
+
+		sec_mod_record_latency(sec, latency_type(job->cmd), &job->start);
+
+		if (job->close_fd)
+			close(job->fd);
+		safe_memset(job->data, 0, job->size);
+		free(job);
+
+		pthread_mutex_lock(&jobs.lock);
+		if (--jobs.running == 0)
+			pthread_cond_broadcast(&jobs.idle);
+		pthread_mutex_unlock(&jobs.lock);
+	}
+}
+
+static void *job_thread(void *pool)
+{
+	serve_jobs(pool, &jobs.head, &jobs.cond);
+	return NULL;
+}
+
+static void *main_job_thread(void *pool)
+{
+	serve_jobs(pool, &jobs.main_head, &jobs.main_cond);
+	return NULL;
+}
+
+/* Starts the job threads; like sec_mod_sign_init() it must be called
+ * with the signals blocked. */
+int sec_mod_jobs_init(sec_mod_st *sec)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	void *pool;
+	unsigned i;
+
+	jobs.sec = sec;
+	list_head_init(&jobs.head);
+	list_head_init(&jobs.main_head);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (i = 0; i < JOB_THREADS; i++) {
+		/* each thread allocates from its own context only */
+		pool = talloc_new(sec);
+		if (pool == NULL)
+			break;
+
+		if (pthread_create(&thread, &attr, job_thread, pool) != 0) {
+			talloc_free(pool);
+			break;
+		}
+	}
+
+	jobs.threads = i;
+	if (i == 0) {
+		pthread_attr_destroy(&attr);
+		return -1;
+	}
+
+	pool = talloc_new(sec);
+	if (pool != NULL && pthread_create(&thread, &attr, main_job_thread, pool) == 0)
+		jobs.main_thread = 1;
+	else
+		talloc_free(pool);
+	pthread_attr_destroy(&attr);
+
+	seclog(sec, LOG_DEBUG, "started %u threads for authentication requests", i);
+	return 0;
+}
+
+static int job_add(sec_mod_st *sec, unsigned from_main, sec_mod_job_func func, int fd, unsigned close_fd,
+		   pid_t pid, uint8_t cmd, const uint8_t *data, size_t size,
+		   const struct timespec *start)
+{
+	sec_mod_job_st *job;
+	void *lpool;
+	int ret;
+
+	/* the jobs are allocated with malloc() as talloc contexts
+	 * cannot be shared among threads */
+	job = malloc(sizeof(*job) + size);
+	if (job == NULL)
+		goto serve;
+
+	job->func = func;
+	job->fd = fd;
+	job->close_fd = close_fd;
+	job->pid = pid;
+	job->cmd = cmd;
+	job->start = *start;
+	job->size = size;
+	if (size > 0)
+		memcpy(job->data, data, size);
+
+	pthread_mutex_lock(&jobs.lock);
+	if (from_main) {
+		if (jobs.main_thread == 0) {
+			pthread_mutex_unlock(&jobs.lock);
+			goto serve;
+		}
+
+		list_add_tail(&jobs.main_head, &job->list);
+		pthread_cond_signal(&jobs.main_cond);
+		pthread_mutex_unlock(&jobs.lock);
+		return 0;
+	}
+
+	if (jobs.threads == 0) {
+		pthread_mutex_unlock(&jobs.lock);
+		goto serve;
+	}
+
+	/* a worker request is refused rather than served here, as it
+	 * may block the loop, and with it the requests of main; the
+	 * internal jobs (with no connection) are always queued */
+	if (jobs.pending >= MAX_PENDING_JOBS && close_fd) {
+		pthread_mutex_unlock(&jobs.lock);
+		seclog(sec, LOG_INFO, "too many pending requests; refusing %s",
+		       cmd_request_to_str(cmd));
+		close(fd);
+		safe_memset(job->data, 0, job->size);
+		free(job);
+		return -1;
+	}
+
+	list_add_tail(&jobs.head, &job->list);
+	jobs.pending++;
+	pthread_cond_signal(&jobs.cond);
+	pthread_mutex_unlock(&jobs.lock);
+
+	return 0;
+
+ serve:
+	if (job == NULL) {
+		seclog(sec, LOG_ERR, "error in memory allocation");
+		if (close_fd)
+			close(fd);
+		return -1;
+	}
+
+	lpool = talloc_new(sec);
+	if (lpool == NULL)
+		ret = -1;
+	else
+		ret = func(lpool, sec, job);
+	talloc_free(lpool);
+
+	sec_mod_record_latency(sec, latency_type(cmd), start);
+
+	if (close_fd)
+		close(fd);
+	safe_memset(job->data, 0, job->size);
+	free(job);
+
+	return ret;
+}
+
+/* Queues a request to be served by @func in a job thread. The data
+ * are copied. When the threads are not available the request is served
+ * by the caller, and when too many requests are pending a request with
+ * a connection is refused. On return the connection is owned by the job
+ * if @close_fd is set.
+ */
+int sec_mod_job_add(sec_mod_st *sec, sec_mod_job_func func, int fd, unsigned close_fd,
+		    pid_t pid, uint8_t cmd, const uint8_t *data, size_t size,
+		    const struct timespec *start)
+{
+	return job_add(sec, 0, func, fd, close_fd, pid, cmd, data, size, start);
+}
+
+/* Queues a request of main, to be served in order by the thread of
+ * main's requests, ahead of any worker request. */
+int sec_mod_main_job_add(sec_mod_st *sec, sec_mod_job_func func, int fd, uint8_t cmd,
+			 const uint8_t *data, size_t size, const struct timespec *start)
+{
+	return job_add(sec, 1, func, fd, 0, 0, cmd, data, size, start);
+}
+
+/* Waits for the running jobs to complete, and prevents new ones from
+ * starting until sec_mod_jobs_resume() */
+void sec_mod_jobs_pause(void)
+{
+	pthread_mutex_lock(&jobs.lock);
+	jobs.paused++;
+	while (jobs.running > 0)
+		pthread_cond_wait(&jobs.idle, &jobs.lock);
+	pthread_mutex_unlock(&jobs.lock);
+}
+
+void sec_mod_jobs_resume(void)
+{
+	pthread_mutex_lock(&jobs.lock);
+	if (jobs.paused > 0)
+		jobs.paused--;
+	pthread_cond_broadcast(&jobs.cond);
+	pthread_cond_broadcast(&jobs.main_cond);
+	pthread_mutex_unlock(&jobs.lock);
+}
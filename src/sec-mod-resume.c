@@ -32,6 +32,7 @@
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 #include <ccan/hash/hash.h>
+#include <ccan/container_of/container_of.h>
 
 #include <main.h>
 #include <sec-mod-resume.h>
@@ -58,6 +59,7 @@ int handle_resume_delete_req(sec_mod_st *sec,
 			cache->session_id_size = 0;
 
 			htable_delval(sec->tls_db.ht, &iter);
+			timer_wheel_del(&sec->tls_db.expiry, &cache->expiry);
 			talloc_free(cache);
 			sec->tls_db.entries--;
 			return 0;
@@ -168,6 +170,10 @@ int handle_resume_store_req(sec_mod_st *sec,
 	htable_add(sec->tls_db.ht, key, cache);
 	sec->tls_db.entries++;
 
+	cache->expiry.list.next = NULL;
+	timer_wheel_add(&sec->tls_db.expiry, &cache->expiry,
+			time(0) + TLS_SESSION_EXPIRATION_TIME(GETCONFIG(sec)) + 1);
+
 	seclog_hex(sec, LOG_DEBUG, "TLS session DB storing",
 				req->session_id.data,
 				req->session_id.len, 0);
@@ -175,34 +181,42 @@ int handle_resume_store_req(sec_mod_st *sec,
 	return 0;
 }
 
-void expire_tls_sessions(sec_mod_st *sec)
+/* Removes up to MAX_EXPIRED_PER_TICK expired sessions. Returns non-zero
+ * if there may be more. */
+unsigned expire_tls_sessions(sec_mod_st *sec)
 {
 	tls_cache_st *cache;
-	struct htable_iter iter;
+	timer_wheel_entry_st *we;
 	time_t now, exp;
+	unsigned n = 0;
 
 	now = time(0);
 
-	cache = htable_first(sec->tls_db.ht, &iter);
-	while (cache != NULL) {
+	while (n < MAX_EXPIRED_PER_TICK && (we = timer_wheel_expired(&sec->tls_db.expiry, now)) != NULL) {
 		gnutls_datum_t d;
 
+		cache = container_of(we, tls_cache_st, expiry);
+		n++;
+
 		d.data = (void *)cache->session_data;
 		d.size = cache->session_data_size;
 
 		exp = gnutls_db_check_entry_time(&d);
 
 		if (now - exp > TLS_SESSION_EXPIRATION_TIME(GETCONFIG(sec))) {
+			htable_del(sec->tls_db.ht,
+				   hash_any(cache->session_id, cache->session_id_size, 0),
+				   cache);
 			cache->session_id_size = 0;
 
-			htable_delval(sec->tls_db.ht, &iter);
-
 			safe_memset(cache->session_data, 0, cache->session_data_size);
 			talloc_free(cache);
 			sec->tls_db.entries--;
+		} else {
+			timer_wheel_add(&sec->tls_db.expiry, &cache->expiry,
+					exp + TLS_SESSION_EXPIRATION_TIME(GETCONFIG(sec)) + 1);
 		}
-		cache = htable_next(sec->tls_db.ht, &iter);
 	}
 
-	return;
+	return n == MAX_EXPIRED_PER_TICK;
 }
@@ -33,6 +33,6 @@ int handle_resume_fetch_req(sec_mod_st* sec,
 int handle_resume_store_req(sec_mod_st* sec,
   			   const SessionResumeStoreReqMsg *);
 
-void expire_tls_sessions(sec_mod_st *sec);
+unsigned expire_tls_sessions(sec_mod_st *sec);
 
 #endif
@@ -0,0 +1,484 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The private key operations requested by the workers are served by
+ * a pool of threads, so that they neither wait for, nor delay, the
+ * authentication requests served by the main loop of sec-mod.
+ *
+ * A worker keeps its connection for key operations open, and may
+ * send several requests on it without waiting for the replies; the
+ * replies carry the id of the request. Each connection is registered
+ * with EPOLLONESHOT, and it is re-armed as soon as a request is read
+ * from it, so that the requests of a connection can be served in
+ * parallel.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <common.h>
+#include <syslog.h>
+#include <vpn.h>
+#include <sec-mod.h>
+#include <ipc.pb-c.h>
+#include <assert.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+
+#ifdef __linux__
+# include <sys/epoll.h>
+#endif
+
+#define MAX_SIGN_THREADS 16
+
+/* Protects the keys and the configuration the threads use from
+ * reload_server() */
+static pthread_rwlock_t keys_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void sec_mod_keys_wrlock(void)
+{
+	pthread_rwlock_wrlock(&keys_lock);
+}
+
+void sec_mod_keys_unlock(void)
+{
+	pthread_rwlock_unlock(&keys_lock);
+}
+
+static
+int handle_key_op(void *pool, sec_mod_st *sec, cmd_request_t cmd,
+		  uint8_t *buffer, size_t buffer_size, void **reply,
+		  pack_size_func *get_size, pack_func *pack)
+{
+	unsigned i;
+	gnutls_datum_t data, out;
+	int ret;
+	SecOpMsg *op, *rep;
+	vhost_cfg_st *vhost;
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+	unsigned bits;
+	SecGetPkMsg *pkm;
+#endif
+	PROTOBUF_ALLOCATOR(pa, pool);
+
+	seclog(sec, LOG_DEBUG, "cmd [size=%d] %s\n", (int)buffer_size,
+	       cmd_request_to_str(cmd));
+	data.data = buffer;
+	data.size = buffer_size;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+	if (cmd == CMD_SEC_GET_PK) {
+		pkm = sec_get_pk_msg__unpack(&pa, data.size, data.data);
+		if (pkm == NULL) {
+			seclog(sec, LOG_INFO, "error unpacking sec get pk\n");
+			return -1;
+		}
+
+		vhost = find_vhost(sec->vconfig, pkm->vhost);
+		/* check for static analyzer - find_vhost is always non-NULL */
+		assert(vhost != NULL);
+
+		i = pkm->key_idx;
+		if (i >= vhost->key_size) {
+			seclog(sec, LOG_INFO,
+			       "%sreceived out-of-bounds key index (%d); have %d keys", PREFIX_VHOST(vhost), i, vhost->key_size);
+			return -1;
+		}
+
+		pkm->pk = gnutls_privkey_get_pk_algorithm(vhost->key[i], &bits);
+		pkm->bits = bits;
+
+		*reply = pkm;
+		*get_size = (pack_size_func) sec_get_pk_msg__get_packed_size;
+		*pack = (pack_func) sec_get_pk_msg__pack;
+		return 0;
+	}
+#endif
+
+	op = sec_op_msg__unpack(&pa, data.size, data.data);
+	if (op == NULL) {
+		seclog(sec, LOG_INFO, "error unpacking sec op\n");
+		return -1;
+	}
+
+	vhost = find_vhost(sec->vconfig, op->vhost);
+	assert(vhost != NULL);
+
+	i = op->key_idx;
+	if (op->has_key_idx == 0 || i >= vhost->key_size) {
+		seclog(sec, LOG_INFO,
+		       "%sreceived out-of-bounds key index (%d); have %d keys", PREFIX_VHOST(vhost), i, vhost->key_size);
+		return -1;
+	}
+
+	data.data = op->data.data;
+	data.size = op->data.len;
+
+	switch (cmd) {
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+	case CMD_SEC_SIGN_DATA:
+		ret = gnutls_privkey_sign_data2(vhost->key[i], op->sig, 0, &data, &out);
+		break;
+	case CMD_SEC_SIGN_HASH:
+		ret = gnutls_privkey_sign_hash2(vhost->key[i], op->sig, 0, &data, &out);
+		break;
+#endif
+	case CMD_SEC_DECRYPT:
+		ret =
+		    gnutls_privkey_decrypt_data(vhost->key[i], 0, &data,
+						&out);
+		break;
+	case CMD_SEC_SIGN:
+		ret =
+		    gnutls_privkey_sign_hash(vhost->key[i], 0,
+					     GNUTLS_PRIVKEY_SIGN_FLAG_TLS1_RSA,
+					     &data, &out);
+		break;
+	default:
+		seclog(sec, LOG_WARNING, "unknown type 0x%.2x", cmd);
+		return -1;
+	}
+
+	if (ret < 0) {
+		seclog(sec, LOG_INFO, "error in crypto operation: %s",
+		       gnutls_strerror(ret));
+		return -1;
+	}
+
+	rep = talloc(pool, SecOpMsg);
+	if (rep == NULL) {
+		gnutls_free(out.data);
+		return -1;
+	}
+	sec_op_msg__init(rep);
+
+	rep->data.data = talloc_memdup(rep, out.data, out.size);
+	rep->data.len = out.size;
+	rep->has_id = op->has_id;
+	rep->id = op->id;
+	gnutls_free(out.data);
+
+	if (rep->data.data == NULL)
+		return -1;
+
+	*reply = rep;
+	*get_size = (pack_size_func) sec_op_msg__get_packed_size;
+	*pack = (pack_func) sec_op_msg__pack;
+	return 0;
+}
+
+unsigned is_key_op(uint8_t cmd)
+{
+	switch (cmd) {
+	case CMD_SEC_DECRYPT:
+	case CMD_SEC_SIGN:
+	case CMD_SEC_SIGN_DATA:
+	case CMD_SEC_SIGN_HASH:
+	case CMD_SEC_GET_PK:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+#ifdef __linux__
+typedef struct key_chan_st {
+	int fd;
+	/* the armed read plus the requests being served */
+	unsigned refs;
+	/* protects refs and serializes the replies */
+	pthread_mutex_t lock;
+} key_chan_st;
+
+static struct {
+	sec_mod_st *sec;
+	int epfd;
+} signer = { .epfd = -1 };
+
+/* The connections are allocated with calloc() as talloc contexts
+ * cannot be shared among threads. */
+static void key_chan_unref(key_chan_st *chan)
+{
+	unsigned refs;
+
+	pthread_mutex_lock(&chan->lock);
+	refs = --chan->refs;
+	pthread_mutex_unlock(&chan->lock);
+
+	if (refs == 0) {
+		close(chan->fd);
+		pthread_mutex_destroy(&chan->lock);
+		free(chan);
+	}
+}
+
+static int key_chan_arm(key_chan_st *chan, int op)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = chan;
+
+	return epoll_ctl(signer.epfd, op, chan->fd, &ev);
+}
+
+/* Tells the worker that the request in @buffer failed; the other
+ * requests on the connection are not affected. Returns -1 if the
+ * request cannot be identified. */
+static int send_key_op_error(void *pool, key_chan_st *chan, uint8_t cmd,
+			     uint8_t *buffer, size_t length)
+{
+	SecOpMsg *op, rep = SEC_OP_MSG__INIT;
+	PROTOBUF_ALLOCATOR(pa, pool);
+	int ret;
+
+	if (cmd == CMD_SEC_GET_PK)
+		return -1;
+
+	op = sec_op_msg__unpack(&pa, length, buffer);
+	if (op == NULL || op->has_id == 0)
+		return -1;
+
+	rep.has_id = 1;
+	rep.id = op->id;
+	rep.has_failed = 1;
+	rep.failed = 1;
+
+	pthread_mutex_lock(&chan->lock);
+	ret = send_msg(pool, chan->fd, cmd, &rep,
+		       (pack_size_func) sec_op_msg__get_packed_size,
+		       (pack_func) sec_op_msg__pack);
+	pthread_mutex_unlock(&chan->lock);
+
+	return ret;
+}
+
+static void serve_key_op(void *pool, key_chan_st *chan)
+{
+	sec_mod_st *sec = signer.sec;
+	void *reply = NULL;
+	pack_size_func get_size;
+	pack_func pack;
+	uint8_t cmd, *buffer;
+	size_t length;
+	struct timespec start;
+	int ret, e;
+
+	ret = recv_msg_headers(chan->fd, &cmd, MAX_WAIT_SECS);
+	if (ret < 0) {
+		/* the worker closed the connection */
+		key_chan_unref(chan);
+		return;
+	}
+	length = ret;
+
+	if (length > MAX_MSG_SIZE || !is_key_op(cmd)) {
+		seclog(sec, LOG_INFO, "received invalid key operation (cmd: %u, size: %u)",
+		       (unsigned)cmd, (unsigned)length);
+		key_chan_unref(chan);
+		return;
+	}
+
+	buffer = talloc_size(pool, length);
+	if (buffer == NULL) {
+		seclog(sec, LOG_ERR, "error in memory allocation");
+		key_chan_unref(chan);
+		return;
+	}
+
+	ret = force_read_timeout(chan->fd, buffer, length, MAX_WAIT_SECS);
+	if (ret < 0) {
+		e = errno;
+		seclog(sec, LOG_INFO, "error receiving msg body: %s",
+		       strerror(e));
+		key_chan_unref(chan);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* let another thread read the next request while
+	 * this one is served */
+	pthread_mutex_lock(&chan->lock);
+	chan->refs++;
+	pthread_mutex_unlock(&chan->lock);
+
+	if (key_chan_arm(chan, EPOLL_CTL_MOD) < 0)
+		key_chan_unref(chan);
+
+	pthread_rwlock_rdlock(&keys_lock);
+	ret = handle_key_op(pool, sec, cmd, buffer, length, &reply, &get_size, &pack);
+	pthread_rwlock_unlock(&keys_lock);
+
+	if (ret < 0) {
+		/* without an id the worker cannot tell which request failed */
+		if (send_key_op_error(pool, chan, cmd, buffer, length) < 0)
+			shutdown(chan->fd, SHUT_RDWR);
+	} else {
+		pthread_mutex_lock(&chan->lock);
+		ret = send_msg(pool, chan->fd, cmd, reply, get_size, pack);
+		pthread_mutex_unlock(&chan->lock);
+		if (ret < 0)
+			seclog(sec, LOG_WARNING, "sec-mod error in sending reply");
+		sec_mod_record_latency(sec, LAT_KEY_OP, &start);
+	}
+
+	key_chan_unref(chan);
+}
+
+static void *sign_thread(void *pool)
+{
+	struct epoll_event ev;
+	void *req;
+	int ret;
+
+	for (;;) {
+		ret = epoll_wait(signer.epfd, &ev, 1, -1);
+		if (ret <= 0)
+			continue;
+
+		req = talloc_new(pool);
+		serve_key_op(req, ev.data.ptr);
+		talloc_free(req);
+	}
+
+	return NULL;
+}
+
+/* Starts the threads serving the key operations; must be called after
+ * the keys are loaded and the signals are blocked, as the threads
+ * inherit the signal mask.
+ */
+int sec_mod_sign_init(sec_mod_st *sec)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	long n, i;
+	void *pool;
+	int ret;
+
+	signer.sec = sec;
+	signer.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (signer.epfd == -1)
+		return -1;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		n = 1;
+	else if (n > MAX_SIGN_THREADS)
+		n = MAX_SIGN_THREADS;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (i = 0; i < n; i++) {
+		/* each thread allocates from its own context only */
+		pool = talloc_new(sec);
+		if (pool == NULL)
+			break;
+
+		ret = pthread_create(&thread, &attr, sign_thread, pool);
+		if (ret != 0) {
+			talloc_free(pool);
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	if (i == 0) {
+		close(signer.epfd);
+		signer.epfd = -1;
+		return -1;
+	}
+
+	seclog(sec, LOG_DEBUG, "started %ld threads for key operations", i);
+	return 0;
+}
+
+/* Passes a connection, whose first request is a key operation, to the
+ * signing threads. Returns -1 if the caller has to serve it. */
+int sec_mod_sign_add(sec_mod_st *sec, int cfd)
+{
+	key_chan_st *chan;
+
+	if (signer.epfd == -1)
+		return -1;
+
+	chan = calloc(1, sizeof(*chan));
+	if (chan == NULL)
+		return -1;
+
+	chan->fd = cfd;
+	chan->refs = 1;
+	pthread_mutex_init(&chan->lock, NULL);
+
+	if (key_chan_arm(chan, EPOLL_CTL_ADD) < 0) {
+		pthread_mutex_destroy(&chan->lock);
+		free(chan);
+		return -1;
+	}
+
+	return 0;
+}
+#else
+int sec_mod_sign_init(sec_mod_st *sec)
+{
+	return -1;
+}
+
+int sec_mod_sign_add(sec_mod_st *sec, int cfd)
+{
+	return -1;
+}
+#endif
+
+/* Serves a key operation in the caller's thread, when the signing
+ * threads are not available. */
+int sec_mod_sign_serve(void *pool, sec_mod_st *sec, int cfd, cmd_request_t cmd,
+		       uint8_t *buffer, size_t buffer_size)
+{
+	void *reply = NULL;
+	pack_size_func get_size;
+	pack_func pack;
+	struct timespec start;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = handle_key_op(pool, sec, cmd, buffer, buffer_size, &reply, &get_size, &pack);
+	if (ret < 0)
+		return ret;
+
+	ret = send_msg(pool, cfd, cmd, reply, get_size, pack);
+	if (ret < 0) {
+		seclog(sec, LOG_WARNING, "sec-mod error in sending reply");
+	}
+	sec_mod_record_latency(sec, LAT_KEY_OP, &start);
+
+	return 0;
+}
@@ -45,5 +45,20 @@ void sup_config_init(sec_mod_st *sec)
 #endif
 		}
 	}
+
+	/* the cached settings of the files are read again */
+	file_sup_config_reset(sec);
+}
+
+/* Returns a descriptor which is readable when the supplemental
+ * configuration changed, or -1 */
+int sup_config_watch_fd(void)
+{
+	return file_sup_config_fd();
+}
+
+void sup_config_changed(sec_mod_st *sec)
+{
+	file_sup_config_changed();
 }
 
@@ -48,5 +48,7 @@ struct config_mod_st {
 };
 
 void sup_config_init(sec_mod_st *sec);
+int sup_config_watch_fd(void);
+void sup_config_changed(sec_mod_st *sec);
 
 #endif
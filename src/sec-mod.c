@@ -44,16 +44,24 @@
 #include <sec-mod-resume.h>
 #include <cloexec.h>
 #include <assert.h>
+#include <pthread.h>
+#include <ev.h>
+#include <ccan/container_of/container_of.h>
 
 #include <gnutls/gnutls.h>
 #include <gnutls/crypto.h>
 #include <gnutls/abstract.h>
 
 #define MAINTAINANCE_TIME 310
+/* the interval expired entries are removed at */
+#define EXPIRE_TIME 1
 
-static int need_maintainance = 0;
-static int need_reload = 0;
-static int need_exit = 0;
+/* a worker connection waiting for its request */
+typedef struct worker_conn_st {
+	ev_io io;
+	ev_timer timer;
+	pid_t pid;
+} worker_conn_st;
 
 static void reload_server(sec_mod_st *sec);
 
@@ -176,38 +184,12 @@ int load_pins(struct perm_cfg_st *config, struct pin_st *s)
 	return 0;
 }
 
-static int handle_op(void *pool, int cfd, sec_mod_st * sec, uint8_t type, uint8_t * rep,
-		     size_t rep_size)
-{
-	SecOpMsg msg = SEC_OP_MSG__INIT;
-	int ret;
-
-	msg.data.data = rep;
-	msg.data.len = rep_size;
-
-	ret = send_msg(pool, cfd, type, &msg,
-		       (pack_size_func) sec_op_msg__get_packed_size,
-		       (pack_func) sec_op_msg__pack);
-	if (ret < 0) {
-		seclog(sec, LOG_WARNING, "sec-mod error in sending reply");
-	}
-
-	return 0;
-}
-
 static
 int process_worker_packet(void *pool, int cfd, pid_t pid, sec_mod_st *sec, cmd_request_t cmd,
 		   uint8_t * buffer, size_t buffer_size)
 {
-	unsigned i;
-	gnutls_datum_t data, out;
+	gnutls_datum_t data;
 	int ret;
-	SecOpMsg *op;
-	vhost_cfg_st *vhost;
-#if GNUTLS_VERSION_NUMBER >= 0x030600
-	unsigned bits;
-	SecGetPkMsg *pkm;
-#endif
 	PROTOBUF_ALLOCATOR(pa, pool);
 
 	seclog(sec, LOG_DEBUG, "cmd [size=%d] %s\n", (int)buffer_size,
@@ -216,124 +198,12 @@ int process_worker_packet(void *pool, int cfd, pid_t pid, sec_mod_st *sec, cmd_r
 	data.size = buffer_size;
 
 	switch (cmd) {
-#if GNUTLS_VERSION_NUMBER >= 0x030600
 	case CMD_SEC_GET_PK:
-		pkm = sec_get_pk_msg__unpack(&pa, data.size, data.data);
-		if (pkm == NULL) {
-			seclog(sec, LOG_INFO, "error unpacking sec get pk\n");
-			return -1;
-		}
-
-		vhost = find_vhost(sec->vconfig, pkm->vhost);
-		/* check for static analyzer - find_vhost is always non-NULL */
-		assert(vhost != NULL);
-
-		i = pkm->key_idx;
-		if (i >= vhost->key_size) {
-			seclog(sec, LOG_INFO,
-			       "%sreceived out-of-bounds key index (%d); have %d keys", PREFIX_VHOST(vhost), i, vhost->key_size);
-			return -1;
-		}
-
-		pkm->pk = gnutls_privkey_get_pk_algorithm(vhost->key[i], &bits);
-		pkm->bits = bits;
-
-		ret = send_msg(pool, cfd, CMD_SEC_GET_PK, pkm,
-			       (pack_size_func) sec_get_pk_msg__get_packed_size,
-			       (pack_func) sec_get_pk_msg__pack);
-
-		sec_get_pk_msg__free_unpacked(pkm, &pa);
-
-		if (ret < 0) {
-			seclog(sec, LOG_INFO, "error sending reply: %s",
-			       gnutls_strerror(ret));
-			return -1;
-		}
-
-		return ret;
-
 	case CMD_SEC_SIGN_DATA:
 	case CMD_SEC_SIGN_HASH:
-		op = sec_op_msg__unpack(&pa, data.size, data.data);
-		if (op == NULL) {
-			seclog(sec, LOG_INFO, "error unpacking sec op\n");
-			return -1;
-		}
-
-		vhost = find_vhost(sec->vconfig, op->vhost);
-		assert(vhost != NULL);
-
-		i = op->key_idx;
-		if (op->has_key_idx == 0 || i >= vhost->key_size) {
-			seclog(sec, LOG_INFO,
-			       "%sreceived out-of-bounds key index (%d); have %d keys", PREFIX_VHOST(vhost), i, vhost->key_size);
-			return -1;
-		}
-
-		data.data = op->data.data;
-		data.size = op->data.len;
-
-		if (cmd == CMD_SEC_SIGN_DATA) {
-			ret = gnutls_privkey_sign_data2(vhost->key[i], op->sig, 0, &data, &out);
-		} else {
-			ret = gnutls_privkey_sign_hash2(vhost->key[i], op->sig, 0, &data, &out);
-		}
-		sec_op_msg__free_unpacked(op, &pa);
-
-		if (ret < 0) {
-			seclog(sec, LOG_INFO, "error in crypto operation: %s",
-			       gnutls_strerror(ret));
-			return -1;
-		}
-
-		ret = handle_op(pool, cfd, sec, cmd, out.data, out.size);
-		gnutls_free(out.data);
-
-		return ret;
-#endif
 	case CMD_SEC_SIGN:
 	case CMD_SEC_DECRYPT:
-		op = sec_op_msg__unpack(&pa, data.size, data.data);
-		if (op == NULL) {
-			seclog(sec, LOG_INFO, "error unpacking sec op\n");
-			return -1;
-		}
-
-		vhost = find_vhost(sec->vconfig, op->vhost);
-		assert(vhost != NULL);
-
-		i = op->key_idx;
-		if (op->has_key_idx == 0 || i >= vhost->key_size) {
-			seclog(sec, LOG_INFO,
-			       "%sreceived out-of-bounds key index (%d); have %d keys", PREFIX_VHOST(vhost), i, vhost->key_size);
-			return -1;
-		}
-
-		data.data = op->data.data;
-		data.size = op->data.len;
-
-		if (cmd == CMD_SEC_DECRYPT) {
-			ret =
-			    gnutls_privkey_decrypt_data(vhost->key[i], 0, &data,
-							&out);
-		} else {
-			ret =
-			    gnutls_privkey_sign_hash(vhost->key[i], 0,
-						     GNUTLS_PRIVKEY_SIGN_FLAG_TLS1_RSA,
-						     &data, &out);
-		}
-		sec_op_msg__free_unpacked(op, &pa);
-
-		if (ret < 0) {
-			seclog(sec, LOG_INFO, "error in crypto operation: %s",
-			       gnutls_strerror(ret));
-			return -1;
-		}
-
-		ret = handle_op(pool, cfd, sec, cmd, out.data, out.size);
-		gnutls_free(out.data);
-
-		return ret;
+		return sec_mod_sign_serve(pool, sec, cfd, cmd, buffer, buffer_size);
 
 	case CMD_SEC_CLI_STATS:{
 			CliStatsMsg *tmsg;
@@ -568,22 +438,17 @@ int process_packet_from_main(void *pool, int fd, sec_mod_st * sec, cmd_request_t
 	return 0;
 }
 
-static void handle_alarm(int signo)
-{
-	need_maintainance = 1;
-}
-
-static void handle_sigterm(int signo)
-{
-	need_exit = 1;
-}
-
 static void send_stats_to_main(sec_mod_st *sec)
 {
 	int ret;
 	time_t now = time(0);
 	SecmStatsMsg msg = SECM_STATS_MSG__INIT;
+	lat_hist_st latency[LAT_STAGES];
+	LatencyMsg lmsg[LAT_STAGES];
+	LatencyMsg *lmsg_p[LAT_STAGES];
+	unsigned i, n;
 
+	pthread_mutex_lock(&sec->stats_lock);
 	if (GETPCONFIG(sec)->stats_reset_time != 0 &&
 	    now - sec->last_stats_reset > GETPCONFIG(sec)->stats_reset_time) {
 		sec->auth_failures = 0;
@@ -592,21 +457,41 @@ static void send_stats_to_main(sec_mod_st *sec)
 		sec->last_stats_reset = now;
 	}
 
-	msg.secmod_client_entries = sec_mod_client_db_elems(sec);
-	msg.secmod_tlsdb_entries = sec->tls_db.entries;
 	msg.secmod_auth_failures = sec->auth_failures;
 	msg.secmod_avg_auth_time = sec->avg_auth_time;
 	msg.secmod_max_auth_time = sec->max_auth_time;
 	/* we only report the number of failures since last call */
 	sec->auth_failures = 0;
 
+	/* as well as the requests served since last call */
+	memcpy(latency, sec->latency, sizeof(latency));
+	memset(sec->latency, 0, sizeof(sec->latency));
+	pthread_mutex_unlock(&sec->stats_lock);
+
+	msg.secmod_latency = lmsg_p;
+	for (i = 0; i < LAT_STAGES; i++) {
+		for (n = LAT_HIST_BUCKETS; n > 0 && latency[i].count[n-1] == 0; n--)
+			;
+		if (n == 0)
+			continue;
+
+		latency_msg__init(&lmsg[i]);
+		lmsg[i].stage = i;
+		lmsg[i].count = latency[i].count;
+		lmsg[i].n_count = n;
+		lmsg[i].sum = latency[i].sum;
+		lmsg_p[msg.n_secmod_latency++] = &lmsg[i];
+	}
+
 	/* the following two are not resettable */
 	msg.secmod_client_entries = sec_mod_client_db_elems(sec);
 	msg.secmod_tlsdb_entries = sec->tls_db.entries;
 
+	pthread_mutex_lock(&sec->cmd_fd_lock);
 	ret = send_msg(sec, sec->cmd_fd, CMD_SECM_STATS, &msg,
 			(pack_size_func) secm_stats_msg__get_packed_size,
 			(pack_func) secm_stats_msg__pack);
+	pthread_mutex_unlock(&sec->cmd_fd_lock);
 	if (ret < 0) {
 		seclog(sec, LOG_ERR, "error in sending statistics to main");
 		return;
@@ -620,53 +505,133 @@ static void reload_server(sec_mod_st *sec)
 	vhost_cfg_st *vhost = NULL;
 
 	seclog(sec, LOG_DEBUG, "reloading configuration");
+	/* neither the jobs nor the signing threads may use the
+	 * configuration while it is replaced */
+	sec_mod_jobs_pause();
+	sec_mod_keys_wrlock();
 	reload_cfg_file(sec, sec->vconfig, 1);
 	load_keys(sec, 0);
+	sec_mod_keys_unlock();
 
 	list_for_each(sec->vconfig, vhost, list) {
 		sec_auth_init(vhost);
 	}
 	sup_config_init(sec);
-
-	need_reload = 0;
+	sec_mod_jobs_resume();
 }
 
-static void check_other_work(sec_mod_st *sec)
+static void term_sig_watcher_cb(struct ev_loop *loop, ev_signal *w, int revents)
 {
+	sec_mod_st *sec = ev_userdata(loop);
 	vhost_cfg_st *vhost = NULL;
+	unsigned i;
 
-	if (need_exit) {
-		unsigned i;
+	/* the job and signing threads must not use the configuration
+	 * and the keys from now on */
+	sec_mod_jobs_pause();
+	sec_mod_keys_wrlock();
 
-		list_for_each(sec->vconfig, vhost, list) {
-			for (i = 0; i < vhost->key_size; i++) {
-				gnutls_privkey_deinit(vhost->key[i]);
-				vhost->key[i] = NULL;
-			}
-			vhost->key_size = 0;
+	list_for_each(sec->vconfig, vhost, list) {
+		for (i = 0; i < vhost->key_size; i++) {
+			gnutls_privkey_deinit(vhost->key[i]);
+			vhost->key[i] = NULL;
 		}
+		vhost->key_size = 0;
+	}
 
-		sec_mod_client_db_deinit(sec);
-		tls_cache_deinit(&sec->tls_db);
-		talloc_free(sec->config_pool);
-		talloc_free(sec->sec_mod_pool);
-		exit(0);
+	sec_mod_client_db_deinit(sec);
+	tls_cache_deinit(&sec->tls_db);
+	talloc_free(sec->config_pool);
+	talloc_free(sec->sec_mod_pool);
+	exit(0);
+}
+
+static int cleanup_job(void *pool, sec_mod_st *sec, sec_mod_job_st *job)
+{
+	cleanup_client_entries(sec, (client_entry_st **)job->data,
+			       job->size / sizeof(client_entry_st *));
+	return 0;
+}
+
+static int interim_job(void *pool, sec_mod_st *sec, sec_mod_job_st *job)
+{
+	client_entry_st **due = (client_entry_st **)job->data;
+	unsigned i, n = job->size / sizeof(client_entry_st *);
+
+	for (i = 0; i < n; i++) {
+		pthread_mutex_lock(&due[i]->lock);
+		if (due[i]->deleted == 0)
+			update_client_interim(sec, due[i]);
+		put_client_entry(sec, due[i]);
 	}
+	return 0;
+}
 
-	if (need_reload) {
-		reload_server(sec);
+static void expire_watcher_cb(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	sec_mod_st *sec = ev_userdata(loop);
+	client_entry_st *expired[MAX_EXPIRED_PER_TICK];
+	struct timespec now;
+	unsigned n, more;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	n = expire_client_entries(sec, expired, MAX_EXPIRED_PER_TICK);
+	if (n > 0) {
+		/* removing the expired entries may call the modules */
+		sec_mod_job_add(sec, cleanup_job, -1, 0, 0, 0, (uint8_t *)expired,
+				n * sizeof(expired[0]), &now);
 	}
+	more = (n == MAX_EXPIRED_PER_TICK);
+
+	/* the interim updates read the counters of the sessions from
+	 * their slots, and may block on the accounting module */
+	n = interim_client_entries(sec, expired, MAX_EXPIRED_PER_TICK);
+	if (n > 0) {
+		sec_mod_job_add(sec, interim_job, -1, 0, 0, 0, (uint8_t *)expired,
+				n * sizeof(expired[0]), &now);
+	}
+	more |= (n == MAX_EXPIRED_PER_TICK);
+
+	more |= expire_tls_sessions(sec);
+
+	/* continue on the next loop iteration if entries remain */
+	if (more)
+		ev_feed_event(loop, w, EV_TIMER);
+}
+
+static void sup_config_watcher_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	sec_mod_st *sec = ev_userdata(loop);
+
+	sup_config_changed(sec);
+}
+
+static void maintenance_watcher_cb(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	sec_mod_st *sec = ev_userdata(loop);
+
+	seclog(sec, LOG_DEBUG, "performing maintenance");
+
+	send_stats_to_main(sec);
+	seclog(sec, LOG_DEBUG, "active sessions %d", 
+		sec_mod_client_db_elems(sec));
+}
+
+static int serve_main_job(void *pool, sec_mod_st *sec, sec_mod_job_st *job)
+{
+	int ret;
 
-	if (need_maintainance) {
-		seclog(sec, LOG_DEBUG, "performing maintenance");
-		cleanup_client_entries(sec);
-		expire_tls_sessions(sec);
-		send_stats_to_main(sec);
-		seclog(sec, LOG_DEBUG, "active sessions %d", 
-			sec_mod_client_db_elems(sec));
-		alarm(MAINTAINANCE_TIME);
-		need_maintainance = 0;
+	ret = process_packet_from_main(pool, job->fd, sec, job->cmd, job->data, job->size);
+	if (ret < 0) {
+		seclog(sec, LOG_ERR, "error processing data for '%s' command (%d)", cmd_request_to_str(job->cmd), ret);
+		if (ret == ERR_BAD_COMMAND) {
+			/* we are out of sync with main */
+			exit(1);
+		}
 	}
+
+	return ret;
 }
 
 static
@@ -676,6 +641,7 @@ int serve_request_main(sec_mod_st *sec, int fd, uint8_t *buffer, unsigned buffer
 	uint8_t cmd;
 	size_t length;
 	void *pool = buffer;
+	struct timespec start;
 
 	/* read request */
 	ret = recv_msg_headers(fd, &cmd, MAIN_SEC_MOD_TIMEOUT);
@@ -709,6 +675,14 @@ int serve_request_main(sec_mod_st *sec, int fd, uint8_t *buffer, unsigned buffer
 		ret = ERR_BAD_COMMAND;
 		goto leave;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* the reload replaces the configuration the jobs use, and is
+	 * served here; everything else may block on a module, and is
+	 * served by the thread of main's requests, which does not wait
+	 * for the worker requests. */
+	if (cmd != CMD_SECM_RELOAD)
+		return sec_mod_main_job_add(sec, serve_main_job, fd, cmd, buffer, ret, &start);
 
 	ret = process_packet_from_main(pool, fd, sec, cmd, buffer, ret);
 	if (ret < 0) {
@@ -719,6 +693,19 @@ int serve_request_main(sec_mod_st *sec, int fd, uint8_t *buffer, unsigned buffer
 	return ret;
 }
 
+static int serve_worker_job(void *pool, sec_mod_st *sec, sec_mod_job_st *job)
+{
+	int ret;
+
+	ret = process_worker_packet(pool, job->fd, job->pid, sec, job->cmd, job->data, job->size);
+	if (ret < 0) {
+		seclog(sec, LOG_DEBUG, "error processing '%s' command (%d)", cmd_request_to_str(job->cmd), ret);
+	}
+
+	return ret;
+}
+
+/* Serves the request available on @cfd, and closes it */
 static
 int serve_request_worker(sec_mod_st *sec, int cfd, pid_t pid, uint8_t *buffer, unsigned buffer_size)
 {
@@ -726,6 +713,7 @@ int serve_request_worker(sec_mod_st *sec, int cfd, pid_t pid, uint8_t *buffer, u
 	uint8_t cmd;
 	size_t length;
 	void *pool = buffer;
+	struct timespec start;
 
 	/* read request */
 	ret = recv_msg_headers(cfd, &cmd, MAX_WAIT_SECS);
@@ -751,6 +739,17 @@ int serve_request_worker(sec_mod_st *sec, int cfd, pid_t pid, uint8_t *buffer, u
 		ret = -1;
 		goto leave;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	switch (cmd) {
+	case CMD_SEC_AUTH_INIT:
+	case CMD_SEC_AUTH_CONT:
+	case CMD_SEC_CLI_STATS:
+		/* these call the modules */
+		return sec_mod_job_add(sec, serve_worker_job, cfd, 1, pid, cmd, buffer, ret, &start);
+	default:
+		break;
+	}
 
 	ret = process_worker_packet(pool, cfd, pid, sec, cmd, buffer, ret);
 	if (ret < 0) {
@@ -758,9 +757,134 @@ int serve_request_worker(sec_mod_st *sec, int cfd, pid_t pid, uint8_t *buffer, u
 	}
 	
  leave:
+	close(cfd);
 	return ret;
 }
 
+static void *alloc_buffer(sec_mod_st *sec, unsigned *buffer_size)
+{
+	void *buffer;
+
+	/* we do a new allocation, to also use it as pool for the
+	 * parsers to use */
+	*buffer_size = MAX_MSG_SIZE;
+	buffer = talloc_size(sec, *buffer_size);
+	if (buffer == NULL) {
+		seclog(sec, LOG_ERR, "error in memory allocation");
+		exit(1);
+	}
+
+	return buffer;
+}
+
+/* we use two fds for communication with main. The synchronous is for
+ * ping-pong communication which each request is answered immediated. The
+ * async is for messages sent back and forth in no particular order */
+static void main_watcher_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	sec_mod_st *sec = ev_userdata(loop);
+	unsigned buffer_size;
+	uint8_t *buffer;
+	int ret;
+
+	buffer = alloc_buffer(sec, &buffer_size);
+
+	ret = serve_request_main(sec, w->fd, buffer, buffer_size);
+	if (ret < 0 && ret == ERR_BAD_COMMAND) {
+		seclog(sec, LOG_ERR, "error processing %s command from main",
+		       w->fd == sec->cmd_fd_sync ? "sync" : "async");
+		exit(1);
+	}
+
+	talloc_free(buffer);
+}
+
+static void free_worker_conn(struct ev_loop *loop, worker_conn_st *conn)
+{
+	ev_io_stop(loop, &conn->io);
+	ev_timer_stop(loop, &conn->timer);
+	talloc_free(conn);
+}
+
+static void worker_conn_timeout_cb(struct ev_loop *loop, ev_timer *w, int revents)
+{
+	worker_conn_st *conn = container_of(w, worker_conn_st, timer);
+
+	close(conn->io.fd);
+	free_worker_conn(loop, conn);
+}
+
+static void worker_conn_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	sec_mod_st *sec = ev_userdata(loop);
+	worker_conn_st *conn = (worker_conn_st*)w;
+	unsigned buffer_size;
+	uint8_t *buffer, cmd;
+	int cfd = w->fd, ret;
+	pid_t pid = conn->pid;
+
+	free_worker_conn(loop, conn);
+
+	ret = recv(cfd, &cmd, 1, MSG_PEEK);
+	if (ret == 1 && is_key_op(cmd) && sec_mod_sign_add(sec, cfd) == 0) {
+		/* served by the signing threads from now on */
+		return;
+	}
+
+	buffer = alloc_buffer(sec, &buffer_size);
+	memset(buffer, 0, buffer_size);
+	serve_request_worker(sec, cfd, pid, buffer, buffer_size);
+	talloc_free(buffer);
+}
+
+static void accept_watcher_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+	sec_mod_st *sec = ev_userdata(loop);
+	struct sockaddr_un sa;
+	socklen_t sa_len;
+	worker_conn_st *conn;
+	uid_t uid;
+	pid_t pid;
+	int cfd, ret, e;
+
+	sa_len = sizeof(sa);
+	cfd = accept(w->fd, (struct sockaddr *)&sa, &sa_len);
+	if (cfd == -1) {
+		e = errno;
+		if (e != EINTR && e != EAGAIN) {
+			seclog(sec, LOG_DEBUG,
+			       "sec-mod error accepting connection: %s",
+			       strerror(e));
+		}
+		return;
+	}
+	set_cloexec_flag (cfd, 1);
+
+	/* do not allow unauthorized processes to issue commands
+	 */
+	ret = check_upeer_id("sec-mod", GETPCONFIG(sec)->debug, cfd,
+			     GETPCONFIG(sec)->uid, GETPCONFIG(sec)->gid,
+			     &uid, &pid);
+	if (ret < 0) {
+		seclog(sec, LOG_INFO, "rejected unauthorized connection");
+		close(cfd);
+		return;
+	}
+
+	/* wait for the request without blocking the others */
+	conn = talloc(sec, worker_conn_st);
+	if (conn == NULL) {
+		close(cfd);
+		return;
+	}
+	conn->pid = pid;
+
+	ev_io_init(&conn->io, worker_conn_cb, cfd, EV_READ);
+	ev_io_start(loop, &conn->io);
+	ev_timer_init(&conn->timer, worker_conn_timeout_cb, MAX_WAIT_SECS, 0);
+	ev_timer_start(loop, &conn->timer);
+}
+
 #define CHECK_LOOP_ERR(x) \
 	if (force != 0) { GNUTLS_FATAL_ERR(x); } \
 	else { if (ret < 0) { \
@@ -890,30 +1014,21 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 		    const char *socket_file, int cmd_fd, int cmd_fd_sync)
 {
 	struct sockaddr_un sa;
-	socklen_t sa_len;
-	int cfd, ret, e, n;
-	unsigned buffer_size;
-	uid_t uid;
-	uint8_t *buffer;
+	int ret, e;
 	int sd;
 	sec_mod_st *sec;
 	void *sec_mod_pool;
 	vhost_cfg_st *vhost = NULL;
-	fd_set rd_set;
-	pid_t pid;
-#ifdef HAVE_PSELECT
-	struct timespec ts;
-#else
-	struct timeval ts;
-#endif
-	sigset_t emptyset, blockset;
+	sigset_t blockset;
+	struct ev_loop *sec_loop;
+	ev_io accept_watcher, cmd_watcher, cmd_sync_watcher, sup_config_watcher;
+	ev_timer maintenance_watcher, expire_watcher;
+	ev_signal term_sig_watcher, int_sig_watcher;
 
 #ifdef DEBUG_LEAKS
 	talloc_enable_leak_report_full();
 #endif
 	sigemptyset(&blockset);
-	sigemptyset(&emptyset);
-	sigaddset(&blockset, SIGALRM);
 	sigaddset(&blockset, SIGTERM);
 	sigaddset(&blockset, SIGINT);
 	sigaddset(&blockset, SIGHUP);
@@ -933,6 +1048,8 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 	sec->vconfig = vconfig;
 	sec->config_pool = config_pool;
 	sec->sec_mod_pool = sec_mod_pool;
+	pthread_mutex_init(&sec->cmd_fd_lock, NULL);
+	pthread_mutex_init(&sec->stats_lock, NULL);
 
 	tls_cache_init(sec, &sec->tls_db);
 	sup_config_init(sec);
@@ -948,9 +1065,6 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 	talloc_free(main_pool);
 
 	ocsignal(SIGHUP, SIG_IGN);
-	ocsignal(SIGINT, handle_sigterm);
-	ocsignal(SIGTERM, handle_sigterm);
-	ocsignal(SIGALRM, handle_alarm);
 
 	list_for_each(sec->vconfig, vhost, list) {
 		sec_auth_init(vhost);
@@ -1003,106 +1117,57 @@ void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfi
 		exit(1);
 	}
 
+	/* the threads inherit the signal mask; the signals are only
+	 * handled by the event loop */
 	sigprocmask(SIG_BLOCK, &blockset, &sig_default_set);
-	alarm(MAINTAINANCE_TIME);
-	seclog(sec, LOG_INFO, "sec-mod initialized (socket: %s)", SOCKET_FILE);
-
-
-	for (;;) {
-		check_other_work(sec);
-
-		FD_ZERO(&rd_set);
-		n = 0;
 
-		FD_SET(cmd_fd, &rd_set);
-		n = MAX(n, cmd_fd);
+	ret = sec_mod_sign_init(sec);
+	if (ret < 0) {
+		seclog(sec, LOG_INFO, "could not start the key operation threads; serving them in the main loop");
+	}
 
-		FD_SET(cmd_fd_sync, &rd_set);
-		n = MAX(n, cmd_fd_sync);
+	ret = sec_mod_jobs_init(sec);
+	if (ret < 0) {
+		seclog(sec, LOG_INFO, "could not start the authentication threads; serving them in the main loop");
+	}
 
-		FD_SET(sd, &rd_set);
-		n = MAX(n, sd);
+	/* not the default loop, which would reap the children of the modules */
+	sec_loop = ev_loop_new(EVFLAG_AUTO);
+	if (sec_loop == NULL) {
+		seclog(sec, LOG_ERR, "could not initialise libev");
+		exit(1);
+	}
+	ev_set_userdata(sec_loop, sec);
+
+	ev_signal_init(&term_sig_watcher, term_sig_watcher_cb, SIGTERM);
+	ev_signal_start(sec_loop, &term_sig_watcher);
+	ev_signal_init(&int_sig_watcher, term_sig_watcher_cb, SIGINT);
+	ev_signal_start(sec_loop, &int_sig_watcher);
+
+	ev_io_init(&cmd_sync_watcher, main_watcher_cb, cmd_fd_sync, EV_READ);
+	ev_io_start(sec_loop, &cmd_sync_watcher);
+	ev_io_init(&cmd_watcher, main_watcher_cb, cmd_fd, EV_READ);
+	ev_io_start(sec_loop, &cmd_watcher);
+	ev_io_init(&accept_watcher, accept_watcher_cb, sd, EV_READ);
+	ev_io_start(sec_loop, &accept_watcher);
+
+	if (sup_config_watch_fd() != -1) {
+		ev_io_init(&sup_config_watcher, sup_config_watcher_cb, sup_config_watch_fd(), EV_READ);
+		ev_io_start(sec_loop, &sup_config_watcher);
+	}
 
-#ifdef HAVE_PSELECT
-		ts.tv_nsec = 0;
-		ts.tv_sec = 120;
-		ret = pselect(n + 1, &rd_set, NULL, NULL, &ts, &emptyset);
-#else
-		ts.tv_usec = 0;
-		ts.tv_sec = 120;
-		sigprocmask(SIG_UNBLOCK, &blockset, NULL);
-		ret = select(n + 1, &rd_set, NULL, NULL, &ts);
-		sigprocmask(SIG_BLOCK, &blockset, NULL);
-#endif
-		if (ret == 0 || (ret == -1 && errno == EINTR))
-			continue;
+	ev_timer_init(&maintenance_watcher, maintenance_watcher_cb, MAINTAINANCE_TIME, MAINTAINANCE_TIME);
+	ev_timer_start(sec_loop, &maintenance_watcher);
 
-		if (ret < 0) {
-			e = errno;
-			seclog(sec, LOG_ERR, "Error in pselect(): %s",
-			       strerror(e));
-			exit(1);
-		}
+	ev_timer_init(&expire_watcher, expire_watcher_cb, EXPIRE_TIME, EXPIRE_TIME);
+	ev_timer_start(sec_loop, &expire_watcher);
 
-		/* we do a new allocation, to also use it as pool for the
-		 * parsers to use */
-		buffer_size = MAX_MSG_SIZE;
-		buffer = talloc_size(sec, buffer_size);
-		if (buffer == NULL) {
-			seclog(sec, LOG_ERR, "error in memory allocation");
-			exit(1);
-		}
+	pthread_sigmask(SIG_UNBLOCK, &blockset, NULL);
 
-		/* we use two fds for communication with main. The synchronous is for
-		 * ping-pong communication which each request is answered immediated. The
-		 * async is for messages sent back and forth in no particular order */
-		if (FD_ISSET(cmd_fd_sync, &rd_set)) {
-			ret = serve_request_main(sec, cmd_fd_sync, buffer, buffer_size);
-			if (ret < 0 && ret == ERR_BAD_COMMAND) {
-				seclog(sec, LOG_ERR, "error processing sync command from main");
-				exit(1);
-			}
-		}
+	seclog(sec, LOG_INFO, "sec-mod initialized (socket: %s)", SOCKET_FILE);
 
-		if (FD_ISSET(cmd_fd, &rd_set)) {
-			ret = serve_request_main(sec, cmd_fd, buffer, buffer_size);
-			if (ret < 0 && ret == ERR_BAD_COMMAND) {
-				seclog(sec, LOG_ERR, "error processing async command from main");
-				exit(1);
-			}
-		}
-		
-		if (FD_ISSET(sd, &rd_set)) {
-			sa_len = sizeof(sa);
-			cfd = accept(sd, (struct sockaddr *)&sa, &sa_len);
-			if (cfd == -1) {
-				e = errno;
-				if (e != EINTR) {
-					seclog(sec, LOG_DEBUG,
-					       "sec-mod error accepting connection: %s",
-					       strerror(e));
-					goto cont;
-				}
-			}
-			set_cloexec_flag (cfd, 1);
+	ev_run(sec_loop, 0);
 
-			/* do not allow unauthorized processes to issue commands
-			 */
-			ret = check_upeer_id("sec-mod", GETPCONFIG(sec)->debug, cfd,
-					     GETPCONFIG(sec)->uid, GETPCONFIG(sec)->gid,
-					     &uid, &pid);
-			if (ret < 0) {
-				seclog(sec, LOG_INFO, "rejected unauthorized connection");
-			} else {
-				memset(buffer, 0, buffer_size);
-				serve_request_worker(sec, cfd, pid, buffer, buffer_size);
-			}
-			close(cfd);
-		}
- cont:
-		talloc_free(buffer);
-#ifdef DEBUG_LEAKS
-		talloc_report_full(sec, stderr);
-#endif
-	}
+	seclog(sec, LOG_ERR, "sec-mod event loop terminated");
+	exit(1);
 }
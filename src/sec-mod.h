@@ -22,9 +22,14 @@
 # define SEC_MOD_H
 
 #include <gnutls/abstract.h>
+#include <pthread.h>
 #include <ccan/htable/htable.h>
+#include <ccan/list/list.h>
 #include <nettle/base64.h>
 #include <tlslib.h>
+#include <timer-wheel.h>
+#include <lat-hist.h>
+#include <session-stats.h>
 #include "common/common.h"
 
 #include "vhost.h"
@@ -37,15 +42,22 @@ typedef struct sec_mod_st {
 	void *config_pool;
 	void *sec_mod_pool;
 
-	struct htable *client_db;
+	struct client_db_st *client_db;
 	int cmd_fd;
 	int cmd_fd_sync;
+	/* serializes the messages sent to main on cmd_fd */
+	pthread_mutex_t cmd_fd_lock;
 
 	tls_sess_db_st tls_db;
+
+	/* protects the statistics below, which are updated by the job
+	 * and signing threads */
+	pthread_mutex_t stats_lock;
 	uint64_t auth_failures; /* auth failures since the last update (SECM_CLI_STATS) we sent to main */
 	uint32_t max_auth_time; /* the maximum time spent in (sucessful) authentication */
 	uint32_t avg_auth_time; /* the average time spent in (sucessful) authentication */
 	uint32_t total_authentications; /* successful authentications: to calculate the average above */
+	lat_hist_st latency[LAT_STAGES]; /* since the last update we sent to main */
 	time_t last_stats_reset;
 } sec_mod_st;
 
@@ -53,6 +65,9 @@ typedef struct stats_st {
 	uint64_t bytes_in;
 	uint64_t bytes_out;
 	time_t uptime;
+	uint64_t comp_hits;
+	uint64_t comp_misses;
+	uint64_t comp_skipped;
 } stats_st;
 
 typedef struct common_auth_init_st {
@@ -125,6 +140,21 @@ typedef struct client_entry_st {
 
 	/* the vhost this user is associated with */
 	vhost_cfg_st *vhost;
+
+	/* serializes the requests on this entry; held between
+	 * find_client_entry() and put_client_entry() */
+	pthread_mutex_t lock;
+	/* the following are protected by the lock of the shard */
+	unsigned refs; /* threads holding or waiting for this entry */
+	unsigned deleted; /* no longer in the database; freed on its last put */
+	timer_wheel_entry_st expiry; /* scheduled at exptime when put */
+	timer_wheel_entry_st interim; /* scheduled while a session is open */
+
+	/* the slot of the counters of the last opened session, which
+	 * the interim updates are read from; gen is zero without one */
+	unsigned stats_slot;
+	uint32_t stats_gen;
+	unsigned interim_secs;
 } client_entry_st;
 
 void *sec_mod_client_db_init(sec_mod_st *sec);
@@ -132,9 +162,15 @@ void sec_mod_client_db_deinit(sec_mod_st *sec);
 unsigned sec_mod_client_db_elems(sec_mod_st *sec);
 client_entry_st * new_client_entry(sec_mod_st *sec, struct vhost_cfg_st *, const char *ip, unsigned pid);
 client_entry_st * find_client_entry(sec_mod_st *sec, uint8_t sid[SID_SIZE]);
+void put_client_entry(sec_mod_st *sec, client_entry_st * e);
 void del_client_entry(sec_mod_st *sec, client_entry_st * e);
 void expire_client_entry(sec_mod_st *sec, client_entry_st * e);
-void cleanup_client_entries(sec_mod_st *sec);
+unsigned expire_client_entries(sec_mod_st *sec, client_entry_st **expired, unsigned max);
+void cleanup_client_entries(sec_mod_st *sec, client_entry_st **expired, unsigned n);
+void schedule_client_interim(sec_mod_st *sec, client_entry_st *e, time_t when);
+unsigned interim_client_entries(sec_mod_st *sec, client_entry_st **due, unsigned max);
+typedef void (*client_entry_func)(sec_mod_st *sec, client_entry_st *e, void *priv);
+void foreach_client_entry(sec_mod_st *sec, client_entry_func func, void *priv);
 
 #ifdef __GNUC__
 # define seclog(sec, prio, fmt, ...) \
@@ -160,8 +196,43 @@ int handle_sec_auth_cont(int cfd, sec_mod_st *sec, const SecAuthContMsg * req);
 int handle_secm_session_open_cmd(sec_mod_st *sec, int fd, const SecmSessionOpenMsg *req);
 int handle_secm_session_close_cmd(sec_mod_st *sec, int fd, const SecmSessionCloseMsg *req);
 int handle_sec_auth_stats_cmd(sec_mod_st * sec, const CliStatsMsg * req, pid_t pid);
+void update_client_interim(sec_mod_st *sec, client_entry_st *e);
 void sec_auth_user_deinit(sec_mod_st *sec, client_entry_st *e);
 
+int sec_mod_sign_init(sec_mod_st *sec);
+int sec_mod_sign_add(sec_mod_st *sec, int cfd);
+int sec_mod_sign_serve(void *pool, sec_mod_st *sec, int cfd, cmd_request_t cmd,
+		       uint8_t *buffer, size_t buffer_size);
+unsigned is_key_op(uint8_t cmd);
+void sec_mod_keys_wrlock(void);
+void sec_mod_keys_unlock(void);
+
+/* A request served by the job threads */
+typedef struct sec_mod_job_st sec_mod_job_st;
+typedef int (*sec_mod_job_func)(void *pool, sec_mod_st *sec, sec_mod_job_st *job);
+
+struct sec_mod_job_st {
+	struct list_node list;
+	sec_mod_job_func func;
+	int fd; /* the connection to reply to */
+	unsigned close_fd; /* whether the job owns the connection */
+	pid_t pid;
+	uint8_t cmd;
+	struct timespec start; /* when the request was received */
+	size_t size;
+	uint8_t data[];
+};
+
+int sec_mod_jobs_init(sec_mod_st *sec);
+int sec_mod_job_add(sec_mod_st *sec, sec_mod_job_func func, int fd, unsigned close_fd,
+		    pid_t pid, uint8_t cmd, const uint8_t *data, size_t size,
+		    const struct timespec *start);
+int sec_mod_main_job_add(sec_mod_st *sec, sec_mod_job_func func, int fd, uint8_t cmd,
+			 const uint8_t *data, size_t size, const struct timespec *start);
+void sec_mod_jobs_pause(void);
+void sec_mod_jobs_resume(void);
+void sec_mod_record_latency(sec_mod_st *sec, unsigned type, const struct timespec *start);
+
 void sec_mod_server(void *main_pool, void *config_pool, struct list_head *vconfig,
 		    const char *socket_file,
 		    int cmd_fd, int cmd_fd_sync);
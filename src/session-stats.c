@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <session-stats.h>
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+static struct {
+	session_stats_slot_st *slot; /* shared with the children */
+	unsigned total;
+
+	/* the free slots, used by main only; they are reused in the
+	 * order they were freed, so that a slot is reassigned as late
+	 * as possible */
+	unsigned *free;
+	unsigned free_head;
+	unsigned free_count;
+} seg;
+
+#define VER(gen, seq) (((uint64_t)(gen) << 32) | (uint32_t)(seq))
+#define VER_GEN(ver) ((uint32_t)((ver) >> 32))
+#define VER_SEQ(ver) ((uint32_t)(ver))
+
+static uint32_t next_gen(uint32_t gen)
+{
+	gen++;
+	if (gen == 0) /* zero is no slot */
+		gen = 1;
+	return gen;
+}
+
+int session_stats_init(unsigned slots)
+{
+	void *p;
+	unsigned i;
+
+	if (slots == 0)
+		return -1;
+
+	p = mmap(NULL, slots * sizeof(session_stats_slot_st), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	seg.free = malloc(slots * sizeof(seg.free[0]));
+	if (seg.free == NULL) {
+		munmap(p, slots * sizeof(session_stats_slot_st));
+		return -1;
+	}
+
+	for (i = 0; i < slots; i++)
+		seg.free[i] = i;
+	seg.free_head = 0;
+	seg.free_count = slots;
+
+	/* the mapping is zeroed */
+	seg.slot = p;
+	seg.total = slots;
+
+	return 0;
+}
+
+void session_stats_deinit(void)
+{
+	if (seg.slot == NULL)
+		return;
+
+	munmap(seg.slot, seg.total * sizeof(session_stats_slot_st));
+	free(seg.free);
+	memset(&seg, 0, sizeof(seg));
+}
+
+session_stats_slot_st *session_stats_get(unsigned slot)
+{
+	if (seg.slot == NULL || slot >= seg.total)
+		return NULL;
+
+	return &seg.slot[slot];
+}
+
+/* Makes the sequence of the slot odd, if it is assigned with @gen, or
+ * with zero, reassigns it with the next generation. An odd sequence is
+ * left by a writer which was killed, and is advanced to another odd
+ * value. Returns the new version, or zero if the slot is not ours. */
+static uint64_t slot_claim(session_stats_slot_st *s, uint32_t gen)
+{
+	uint64_t ver, claimed;
+
+	ver = __atomic_load_n(&s->ver, __ATOMIC_RELAXED);
+	do {
+		if (gen != 0 && VER_GEN(ver) != gen)
+			return 0;
+
+		claimed = VER(gen != 0 ? gen : next_gen(VER_GEN(ver)),
+			      (VER_SEQ(ver) + 1) | 1);
+	} while (!__atomic_compare_exchange_n(&s->ver, &ver, claimed, 0,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return claimed;
+}
+
+/* Returns zero, or -1 if the slot is no longer assigned with @gen, in
+ * which case the session's slot must be no longer used. */
+int session_stats_write(session_stats_slot_st *slot, uint32_t gen, const session_stats_st *st)
+{
+	uint64_t ver;
+
+	if (gen == 0)
+		return -1;
+
+	ver = slot_claim(slot, gen);
+	if (ver == 0)
+		return -1;
+
+	memcpy(&slot->st, st, sizeof(*st));
+
+	/* fails if main freed the slot meanwhile */
+	if (!__atomic_compare_exchange_n(&slot->ver, &ver, ver + 1, 0,
+					 __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return -1;
+
+	return 0;
+}
+
+/* Returns zero and the counters of the slot, or -1 if the slot was not
+ * assigned with @gen or is continuously written. */
+int session_stats_read(unsigned slot, uint32_t gen, session_stats_st *st)
+{
+	session_stats_slot_st *s = session_stats_get(slot);
+	uint64_t ver1, ver2;
+	unsigned i;
+
+	if (s == NULL || gen == 0)
+		return -1;
+
+	for (i = 0; i < SESSION_STATS_READ_TRIES; i++) {
+		ver1 = __atomic_load_n(&s->ver, __ATOMIC_ACQUIRE);
+		if (VER_GEN(ver1) != gen)
+			return -1;
+		if (VER_SEQ(ver1) & 1)
+			continue;
+
+		memcpy(st, &s->st, sizeof(*st));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		ver2 = __atomic_load_n(&s->ver, __ATOMIC_RELAXED);
+		if (ver1 == ver2)
+			return 0;
+	}
+
+	return -1;
+}
+
+int session_stats_alloc(unsigned *slot, uint32_t *gen)
+{
+	session_stats_slot_st *s;
+	uint64_t ver;
+
+	if (seg.free_count == 0)
+		return -1;
+
+	*slot = seg.free[seg.free_head];
+	seg.free_head = (seg.free_head + 1) % seg.total;
+	seg.free_count--;
+
+	s = &seg.slot[*slot];
+	ver = slot_claim(s, 0);
+	memset(&s->st, 0, sizeof(s->st));
+	__atomic_store_n(&s->ver, ver + 1, __ATOMIC_RELEASE);
+
+	*gen = VER_GEN(ver);
+	return 0;
+}
+
+void session_stats_free(unsigned slot, uint32_t gen)
+{
+	session_stats_slot_st *s = session_stats_get(slot);
+	uint64_t ver;
+
+	if (s == NULL || gen == 0)
+		return;
+
+	/* the readers and the writer of the session fail from now on; the
+	 * counters are cleared when the slot is reassigned, which is late
+	 * enough for any write in progress to have completed */
+	ver = __atomic_load_n(&s->ver, __ATOMIC_RELAXED);
+	do {
+		if (VER_GEN(ver) != gen)
+			return;
+	} while (!__atomic_compare_exchange_n(&s->ver, &ver, VER(next_gen(gen), VER_SEQ(ver)), 0,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	seg.free[(seg.free_head + seg.free_count) % seg.total] = slot;
+	seg.free_count++;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SESSION_STATS_H
+# define SESSION_STATS_H
+
+#include <stdint.h>
+
+/* The live counters of the sessions. Main maps a shared memory segment
+ * before forking sec-mod and the workers, and assigns a slot of it to
+ * each session it opens. The worker of the session publishes its
+ * counters into the slot as it serves it, and main (for occtl) and
+ * sec-mod (for the accounting interim updates) read them without
+ * messaging the worker.
+ *
+ * Each slot is protected by a sequence counter, which is odd while the
+ * slot is written; a reader copies the slot and retries if the counter
+ * was odd or changed meanwhile. The counter shares a word with the
+ * generation the slot was assigned with, which changes when it is freed
+ * and reassigned. A writer claims the slot by a compare and swap of the
+ * word which requires its generation, so that the worker of an ended
+ * session, which may still be running when main frees its slot, can
+ * neither write into the slot of another session nor restore its own.
+ */
+
+typedef struct session_stats_st {
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t packets_in;
+	uint64_t packets_out;
+	uint64_t drops; /* packets not sent due to the bandwidth limits */
+	uint64_t comp_hits;
+	uint64_t comp_misses;
+	uint64_t comp_skipped;
+	uint32_t comp_ratio; /* of the compressed to the plain size, per 1024 */
+	uint32_t mtu; /* of the tun device */
+	uint32_t udp_state; /* UP_ */
+	uint32_t tcp_rtt_us;
+	uint32_t dtls_rtt_us; /* of the last DTLS DPD */
+	uint32_t uptime; /* seconds */
+} session_stats_st;
+
+/* a slot takes two cache lines, and is never shared with another */
+typedef struct session_stats_slot_st {
+	uint64_t ver; /* the generation in the high 32 bits, the sequence in the low */
+	session_stats_st st;
+} __attribute__ ((aligned(64))) session_stats_slot_st;
+
+/* The slots when max-clients is unset */
+#define SESSION_STATS_DEFAULT_SLOTS 4096
+
+/* The attempts of a reader to find a slot not being written */
+#define SESSION_STATS_READ_TRIES 64
+
+/* main */
+int session_stats_init(unsigned slots);
+void session_stats_deinit(void);
+int session_stats_alloc(unsigned *slot, uint32_t *gen);
+void session_stats_free(unsigned slot, uint32_t gen);
+
+/* workers */
+session_stats_slot_st *session_stats_get(unsigned slot);
+int session_stats_write(session_stats_slot_st *slot, uint32_t gen, const session_stats_st *st);
+
+/* any process */
+int session_stats_read(unsigned slot, uint32_t gen, session_stats_st *st);
+
+#endif
@@ -27,10 +27,18 @@
 #include <grp.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+#endif
 #include <common.h>
 #include <ip-util.h>
 #include <c-strcase.h>
 #include <c-ctype.h>
+#include <ccan/hash/hash.h>
+#include <ccan/htable/htable.h>
 
 #include "inih/ini.h"
 
@@ -38,6 +46,7 @@
 #include <main.h>
 #include <common-config.h>
 #include <sec-mod-sup-config.h>
+#include <sup-config/file.h>
 
 #define READ_RAW_MULTI_LINE(varname, num) \
 	_add_multi_line_val(pool, &varname, &num, value)
@@ -77,7 +86,7 @@
 	}
 
 struct ini_ctx_st {
-	SecmSessionReplyMsg *msg;
+	GroupCfgSt *config;
 	const char *file;
 	void *pool;
 };
@@ -85,7 +94,7 @@ struct ini_ctx_st {
 static int group_cfg_ini_handler(void *_ctx, const char *section, const char *name, const char* _value)
 {
 	struct ini_ctx_st *ctx = _ctx;
-	SecmSessionReplyMsg *msg = ctx->msg;
+	GroupCfgSt *config = ctx->config;
 	const char *file = ctx->file;
 	void *pool = ctx->pool;
 	unsigned prefix = 0, prefix4 = 0;
@@ -102,91 +111,91 @@ static int group_cfg_ini_handler(void *_ctx, const char *section, const char *na
 		return 0;
 
 	if (strcmp(name, "no-udp") == 0) {
-		READ_TF(msg->config->no_udp, msg->config->has_no_udp);
+		READ_TF(config->no_udp, config->has_no_udp);
 	} else if (strcmp(name, "restrict-user-to-routes")==0) {
-		READ_TF(msg->config->restrict_user_to_routes, msg->config->has_restrict_user_to_routes);
+		READ_TF(config->restrict_user_to_routes, config->has_restrict_user_to_routes);
 	} else if (strcmp(name, "tunnel_all_dns") == 0) {
-		READ_TF(msg->config->tunnel_all_dns, msg->config->has_tunnel_all_dns);
+		READ_TF(config->tunnel_all_dns, config->has_tunnel_all_dns);
 	} else if (strcmp(name, "deny-roaming") == 0) {
-		READ_TF(msg->config->deny_roaming, msg->config->has_deny_roaming);
+		READ_TF(config->deny_roaming, config->has_deny_roaming);
 	} else if (strcmp(name, "route") == 0) {
-		READ_RAW_MULTI_LINE(msg->config->routes, msg->config->n_routes);
+		READ_RAW_MULTI_LINE(config->routes, config->n_routes);
 	} else if (strcmp(name, "no-route") == 0) {
-		READ_RAW_MULTI_LINE(msg->config->no_routes, msg->config->n_no_routes);
+		READ_RAW_MULTI_LINE(config->no_routes, config->n_no_routes);
 	} else if (strcmp(name, "iroute") == 0) {
-		READ_RAW_MULTI_LINE(msg->config->iroutes, msg->config->n_iroutes);
+		READ_RAW_MULTI_LINE(config->iroutes, config->n_iroutes);
 	} else if (strcmp(name, "dns") == 0) {
-		READ_RAW_MULTI_LINE(msg->config->dns, msg->config->n_dns);
+		READ_RAW_MULTI_LINE(config->dns, config->n_dns);
 	} else if (strcmp(name, "ipv6-dns") == 0) {
-		READ_RAW_MULTI_LINE(msg->config->dns, msg->config->n_dns);
+		READ_RAW_MULTI_LINE(config->dns, config->n_dns);
 	} else if (strcmp(name, "ipv4-dns") == 0) {
-		READ_RAW_MULTI_LINE(msg->config->dns, msg->config->n_dns);
+		READ_RAW_MULTI_LINE(config->dns, config->n_dns);
 	} else if (strcmp(name, "nbns") == 0) {
-		READ_RAW_MULTI_LINE(msg->config->nbns, msg->config->n_nbns);
+		READ_RAW_MULTI_LINE(config->nbns, config->n_nbns);
 	} else if (strcmp(name, "ipv4-nbns") == 0) {
-		READ_RAW_MULTI_LINE(msg->config->nbns, msg->config->n_nbns);
+		READ_RAW_MULTI_LINE(config->nbns, config->n_nbns);
 	} else if (strcmp(name, "ipv6-nbns") == 0) {
-		READ_RAW_MULTI_LINE(msg->config->nbns, msg->config->n_nbns);
+		READ_RAW_MULTI_LINE(config->nbns, config->n_nbns);
 	} else if (strcmp(name, "cgroup") == 0) {
-		READ_RAW_STRING(msg->config->cgroup);
+		READ_RAW_STRING(config->cgroup);
 	} else if (strcmp(name, "ipv4-network") == 0) {
-		READ_RAW_STRING(msg->config->ipv4_net);
-		prefix4 = extract_prefix(msg->config->ipv4_net);
+		READ_RAW_STRING(config->ipv4_net);
+		prefix4 = extract_prefix(config->ipv4_net);
 		if (prefix4 != 0)
-			msg->config->ipv4_netmask = ipv4_prefix_to_strmask(pool, prefix4);
+			config->ipv4_netmask = ipv4_prefix_to_strmask(pool, prefix4);
 	} else if (strcmp(name, "ipv4-netmask") == 0) {
-		READ_RAW_STRING(msg->config->ipv4_netmask);
+		READ_RAW_STRING(config->ipv4_netmask);
 	} else if (strcmp(name, "explicit-ipv4") == 0) {
-		READ_RAW_STRING(msg->config->explicit_ipv4);
+		READ_RAW_STRING(config->explicit_ipv4);
 	} else if (strcmp(name, "ipv6-network") == 0) {
-		READ_RAW_STRING(msg->config->ipv6_net);
+		READ_RAW_STRING(config->ipv6_net);
 
-		prefix = extract_prefix(msg->config->ipv6_net);
+		prefix = extract_prefix(config->ipv6_net);
 		if (prefix != 0) {
 			if (valid_ipv6_prefix(prefix) == 0) {
-				syslog(LOG_ERR, "unknown ipv6-prefix '%u' in %s", msg->config->ipv6_prefix, file);
+				syslog(LOG_ERR, "unknown ipv6-prefix '%u' in %s", config->ipv6_prefix, file);
 			}
-			msg->config->ipv6_prefix = prefix;
-			msg->config->has_ipv6_prefix = 1;
+			config->ipv6_prefix = prefix;
+			config->has_ipv6_prefix = 1;
 		}
 	} else if (strcmp(name, "explicit-ipv6") == 0) {
-		READ_RAW_STRING(msg->config->explicit_ipv6);
+		READ_RAW_STRING(config->explicit_ipv6);
 	} else if (strcmp(name, "ipv6-subnet-prefix") == 0) {
-		READ_RAW_NUMERIC(msg->config->ipv6_subnet_prefix, msg->config->has_ipv6_subnet_prefix);
+		READ_RAW_NUMERIC(config->ipv6_subnet_prefix, config->has_ipv6_subnet_prefix);
 	} else if (strcmp(name, "hostname") == 0) {
-		READ_RAW_STRING(msg->config->hostname);
+		READ_RAW_STRING(config->hostname);
 	} else if (strcmp(name, "rx-data-per-sec") == 0) {
-		READ_RAW_NUMERIC(msg->config->rx_per_sec, msg->config->has_rx_per_sec);
-		msg->config->rx_per_sec /= 1000; /* in kb */
+		READ_RAW_NUMERIC(config->rx_per_sec, config->has_rx_per_sec);
+		config->rx_per_sec /= 1000; /* in kb */
 	} else if (strcmp(name, "tx-data-per-sec") == 0) {
-		READ_RAW_NUMERIC(msg->config->tx_per_sec, msg->config->has_tx_per_sec);
-		msg->config->tx_per_sec /= 1000; /* in kb */
+		READ_RAW_NUMERIC(config->tx_per_sec, config->has_tx_per_sec);
+		config->tx_per_sec /= 1000; /* in kb */
 	} else if (strcmp(name, "stats-report-time") == 0) {
-		READ_RAW_NUMERIC(msg->config->interim_update_secs, msg->config->has_interim_update_secs);
+		READ_RAW_NUMERIC(config->interim_update_secs, config->has_interim_update_secs);
 	} else if (strcmp(name, "session-timeout") == 0) {
-		READ_RAW_NUMERIC(msg->config->session_timeout_secs, msg->config->has_session_timeout_secs);
+		READ_RAW_NUMERIC(config->session_timeout_secs, config->has_session_timeout_secs);
 	} else if (strcmp(name, "mtu") == 0) {
-		READ_RAW_NUMERIC(msg->config->mtu, msg->config->has_mtu);
+		READ_RAW_NUMERIC(config->mtu, config->has_mtu);
 	} else if (strcmp(name, "dpd") == 0) {
-		READ_RAW_NUMERIC(msg->config->dpd, msg->config->has_dpd);
+		READ_RAW_NUMERIC(config->dpd, config->has_dpd);
 	} else if (strcmp(name, "mobile-dpd") == 0) {
-		READ_RAW_NUMERIC(msg->config->mobile_dpd, msg->config->has_mobile_dpd);
+		READ_RAW_NUMERIC(config->mobile_dpd, config->has_mobile_dpd);
 	} else if (strcmp(name, "idle-timeout") == 0) {
-		READ_RAW_NUMERIC(msg->config->idle_timeout, msg->config->has_idle_timeout);
+		READ_RAW_NUMERIC(config->idle_timeout, config->has_idle_timeout);
 	} else if (strcmp(name, "mobile-idle-timeout") == 0) {
-		READ_RAW_NUMERIC(msg->config->mobile_idle_timeout, msg->config->has_mobile_idle_timeout);
+		READ_RAW_NUMERIC(config->mobile_idle_timeout, config->has_mobile_idle_timeout);
 	} else if (strcmp(name, "keepalive") == 0) {
-		READ_RAW_NUMERIC(msg->config->keepalive, msg->config->has_keepalive);
+		READ_RAW_NUMERIC(config->keepalive, config->has_keepalive);
 	} else if (strcmp(name, "max-same-clients") == 0) {
-		READ_RAW_NUMERIC(msg->config->max_same_clients, msg->config->has_max_same_clients);
+		READ_RAW_NUMERIC(config->max_same_clients, config->has_max_same_clients);
 	} else if (strcmp(name, "net-priority") == 0) {
 		/* net-priority will contain the actual priority + 1,
 		 * to allow having zero as uninitialized. */
-		 READ_RAW_PRIO_TOS(msg->config->net_priority, msg->config->has_net_priority);
+		 READ_RAW_PRIO_TOS(config->net_priority, config->has_net_priority);
 	} else if (strcmp(name, "user-profile") == 0) {
-		READ_RAW_STRING(msg->config->xml_config_file);
+		READ_RAW_STRING(config->xml_config_file);
 	} else if (strcmp(name, "restrict-user-to-ports") == 0) {
-		ret = cfg_parse_ports(pool, &msg->config->fw_ports, &msg->config->n_fw_ports, value);
+		ret = cfg_parse_ports(pool, &config->fw_ports, &config->n_fw_ports, value);
 		if (ret < 0) {
 			talloc_free(value);
 			return -1;
@@ -204,16 +213,14 @@ static int group_cfg_ini_handler(void *_ctx, const char *section, const char *na
  * already allocated using this function.
  */
 static
-int parse_group_cfg_file(struct cfg_st *global_config,
-			 SecmSessionReplyMsg *msg, void *pool,
-			 const char* file)
+int parse_group_cfg_file(GroupCfgSt *config, void *pool, const char* file)
 {
 	int ret;
 	unsigned j;
 	struct ini_ctx_st ctx;
 
 	ctx.pool = pool;
-	ctx.msg = msg;
+	ctx.config = config;
 	ctx.file = file;
 
 	ret = ini_parse(file, group_cfg_ini_handler, &ctx);
@@ -222,22 +229,22 @@ int parse_group_cfg_file(struct cfg_st *global_config,
 		return 0;
 	}
 
-	for (j=0;j<msg->config->n_routes;j++) {
-		if (ip_route_sanity_check(msg->config->routes, &msg->config->routes[j]) != 0) {
+	for (j=0;j<config->n_routes;j++) {
+		if (ip_route_sanity_check(config->routes, &config->routes[j]) != 0) {
 			ret = ERR_READ_CONFIG;
 			goto fail;
 		}
 	}
 
-	for (j=0;j<msg->config->n_iroutes;j++) {
-		if (ip_route_sanity_check(msg->config->iroutes, &msg->config->iroutes[j]) != 0) {
+	for (j=0;j<config->n_iroutes;j++) {
+		if (ip_route_sanity_check(config->iroutes, &config->iroutes[j]) != 0) {
 			ret = ERR_READ_CONFIG;
 			goto fail;
 		}
 	}
 
-	for (j=0;j<msg->config->n_no_routes;j++) {
-		if (ip_route_sanity_check(msg->config->no_routes, &msg->config->no_routes[j]) != 0) {
+	for (j=0;j<config->n_no_routes;j++) {
+		if (ip_route_sanity_check(config->no_routes, &config->no_routes[j]) != 0) {
 			ret = ERR_READ_CONFIG;
 			goto fail;
 		}
@@ -249,29 +256,345 @@ int parse_group_cfg_file(struct cfg_st *global_config,
 	return ret;
 }
 
-static int read_sup_config_file(struct cfg_st *global_config,
-				SecmSessionReplyMsg *msg, void *pool,
-				const char *file, const char *fallback, const char *type)
+/* The settings of each file are parsed once and kept in a cache, keyed
+ * by the path, together with the inode, size and times of the file.
+ * A cached file is used again while these are unchanged, and the
+ * settings of the group and user files are merged into the session's
+ * reply without copying the values. The cache is cleared on reload.
+ *
+ * When inotify is available the directories of the files are watched,
+ * and the regular files in them are used without checking the file
+ * system; their entries are removed when a change is reported.
+ */
+typedef struct cfg_file_st {
+	char *path;
+	size_t hash;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	GroupCfgSt config; /* the settings of this file alone */
+
+	/* the following are protected by the lock of the cache */
+	unsigned refs; /* the sessions using the settings */
+	unsigned stale; /* no longer in the cache; freed on its last put */
+	unsigned watched; /* changes are reported by inotify */
+} cfg_file_st;
+
+/* held by the pool of a session reply */
+typedef struct cfg_file_ref_st {
+	cfg_file_st *file;
+} cfg_file_ref_st;
+
+typedef struct cfg_watch_st {
+	int wd;
+	char *dir;
+} cfg_watch_st;
+
+static struct {
+	pthread_mutex_t lock;
+	struct htable files; /* cfg_file_st */
+	unsigned init;
+
+	/* incremented on every reported change */
+	unsigned gen;
+	int fd; /* inotify */
+	cfg_watch_st *watches;
+	unsigned n_watches;
+} cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1
+};
+
+#ifdef HAVE_SYS_INOTIFY_H
+# define CFG_WATCH_EVENTS (IN_MODIFY|IN_CLOSE_WRITE|IN_ATTRIB|IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE|IN_DELETE_SELF|IN_MOVE_SELF)
+#endif
+
+static size_t rehash_cfg_file(const void *e, void *unused)
+{
+	return ((const cfg_file_st *)e)->hash;
+}
+
+static bool cfg_file_cmp(const void *e, void *path)
+{
+	return strcmp(((const cfg_file_st *)e)->path, path) == 0;
+}
+
+static unsigned same_file(const cfg_file_st *f, const struct stat *st)
+{
+	return f->dev == st->st_dev && f->ino == st->st_ino &&
+	       f->size == st->st_size &&
+	       f->mtime.tv_sec == st->st_mtim.tv_sec &&
+	       f->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+	       f->ctime.tv_sec == st->st_ctim.tv_sec &&
+	       f->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/* Must be called with the cache locked */
+static void init_cache(void)
+{
+	if (cache.init)
+		return;
+
+	htable_init(&cache.files, rehash_cfg_file, NULL);
+	cache.init = 1;
+}
+
+/* Must be called with the cache locked; returns whether the entry is
+ * to be freed by the caller, after unlocking */
+static unsigned remove_cfg_file(cfg_file_st *f)
+{
+	htable_del(&cache.files, f->hash, f);
+	f->stale = 1;
+	return f->refs == 0;
+}
+
+static void put_cfg_file(cfg_file_st *f)
+{
+	unsigned release;
+
+	pthread_mutex_lock(&cache.lock);
+	f->refs--;
+	release = (f->stale && f->refs == 0);
+	pthread_mutex_unlock(&cache.lock);
+
+	if (release)
+		talloc_free(f);
+}
+
+static int unref_cfg_file(cfg_file_ref_st *ref)
+{
+	put_cfg_file(ref->file);
+	return 0;
+}
+
+/* Must be called with the cache locked */
+static void flush_cfg_files(void)
+{
+	struct htable_iter iter;
+	cfg_file_st *f;
+
+	f = htable_first(&cache.files, &iter);
+	while (f != NULL) {
+		htable_delval(&cache.files, &iter);
+		f->stale = 1;
+		if (f->refs == 0)
+			talloc_free(f);
+		f = htable_next(&cache.files, &iter);
+	}
+}
+
+/* Must be called with the cache locked */
+static unsigned in_watched_dir(const char *file)
 {
+	const char *p = strrchr(file, '/');
+	unsigned i;
+
+	if (p == NULL)
+		return 0;
+
+	for (i = 0; i < cache.n_watches; i++) {
+		if (strlen(cache.watches[i].dir) == (size_t)(p - file) &&
+		    strncmp(cache.watches[i].dir, file, p - file) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Returns the cached settings of the file, after parsing it if they are
+ * not cached, or -1 if the file cannot be read. */
+static int get_cfg_file(const char *file, const char *type, cfg_file_st **_f)
+{
+	GroupCfgSt init = GROUP_CFG_ST__INIT;
+	cfg_file_st *f, *old;
+	size_t hash = hash_any(file, strlen(file), 0);
+	struct stat st;
+	unsigned gen, is_reg, release = 0;
 	int ret;
 
-	if (access(file, R_OK) == 0) {
-		syslog(LOG_DEBUG, "Loading %s configuration '%s'", type,
-		      file);
+	pthread_mutex_lock(&cache.lock);
+	init_cache();
+	f = htable_get(&cache.files, hash, cfg_file_cmp, file);
+	if (f != NULL && f->watched) {
+		f->refs++;
+		pthread_mutex_unlock(&cache.lock);
+		*_f = f;
+		return 0;
+	}
+	gen = cache.gen;
+	pthread_mutex_unlock(&cache.lock);
+
+	/* the changes of the targets of symbolic links are not reported */
+	if (lstat(file, &st) < 0)
+		return -1;
+	is_reg = S_ISREG(st.st_mode);
+	if (S_ISLNK(st.st_mode) && stat(file, &st) < 0)
+		return -1;
+
+	pthread_mutex_lock(&cache.lock);
+	f = htable_get(&cache.files, hash, cfg_file_cmp, file);
+	if (f != NULL && same_file(f, &st)) {
+		f->refs++;
+		pthread_mutex_unlock(&cache.lock);
+		*_f = f;
+		return 0;
+	}
+	pthread_mutex_unlock(&cache.lock);
 
-		ret = parse_group_cfg_file(global_config, msg, pool, file);
-		if (ret < 0)
-			return ERR_READ_CONFIG;
-	} else {
-		if (fallback != NULL) {
-			syslog(LOG_DEBUG, "Loading default %s configuration '%s'", type, fallback);
+	if (access(file, R_OK) != 0)
+		return -1;
 
-			ret = parse_group_cfg_file(global_config, msg, pool, fallback);
-			if (ret < 0)
-				return ERR_READ_CONFIG;
-		}
+	syslog(LOG_DEBUG, "Loading %s configuration '%s'", type, file);
+
+	f = talloc_zero(NULL, cfg_file_st);
+	if (f == NULL)
+		return ERR_MEM;
+
+	f->path = talloc_strdup(f, file);
+	if (f->path == NULL) {
+		talloc_free(f);
+		return ERR_MEM;
+	}
+	f->hash = hash;
+	f->dev = st.st_dev;
+	f->ino = st.st_ino;
+	f->size = st.st_size;
+	f->mtime = st.st_mtim;
+	f->ctime = st.st_ctim;
+	f->config = init;
+
+	ret = parse_group_cfg_file(&f->config, f, file);
+	if (ret < 0) {
+		talloc_free(f);
+		return ERR_READ_CONFIG;
 	}
 
+	f->refs = 1;
+
+	pthread_mutex_lock(&cache.lock);
+	/* a change reported while the file was parsed may not be
+	 * included in the settings */
+	f->watched = (gen == cache.gen && is_reg && in_watched_dir(file));
+
+	old = htable_get(&cache.files, hash, cfg_file_cmp, file);
+	if (old != NULL)
+		release = remove_cfg_file(old);
+
+	if (htable_add(&cache.files, hash, f) == 0)
+		f->stale = 1;
+	pthread_mutex_unlock(&cache.lock);
+
+	if (release)
+		talloc_free(old);
+
+	*_f = f;
+	return 0;
+}
+
+/* The values of the cached settings are not modified; the arrays of
+ * the reply are replaced rather than extended. */
+#define APPLY_NUMERIC(x) \
+	if (src->has_##x) { \
+		dst->x = src->x; \
+		dst->has_##x = 1; \
+	}
+
+#define APPLY_STRING(x) \
+	if (src->x != NULL) \
+		dst->x = src->x
+
+#define APPLY_ARRAY(type, x) \
+	if (src->n_##x > 0) { \
+		if (dst->n_##x == 0) { \
+			dst->x = src->x; \
+		} else { \
+			type *tmp = talloc_array(pool, type, dst->n_##x + src->n_##x + 1); \
+			if (tmp == NULL) \
+				return ERR_MEM; \
+			memcpy(tmp, dst->x, dst->n_##x * sizeof(type)); \
+			memcpy(&tmp[dst->n_##x], src->x, src->n_##x * sizeof(type)); \
+			tmp[dst->n_##x + src->n_##x] = NULL; \
+			dst->x = tmp; \
+		} \
+		dst->n_##x += src->n_##x; \
+	}
+
+/* Applies the settings of a file to the reply; the later files replace
+ * the values and append to the lists of the previous ones, as if they
+ * were parsed into the reply in turn. The settings are kept until the
+ * pool is freed. */
+static int apply_cfg_file(GroupCfgSt *dst, cfg_file_st *f, void *pool)
+{
+	const GroupCfgSt *src = &f->config;
+	cfg_file_ref_st *ref;
+
+	ref = talloc(pool, cfg_file_ref_st);
+	if (ref == NULL) {
+		put_cfg_file(f);
+		return ERR_MEM;
+	}
+	ref->file = f;
+	talloc_set_destructor(ref, unref_cfg_file);
+
+	APPLY_NUMERIC(interim_update_secs);
+	APPLY_NUMERIC(session_timeout_secs);
+	APPLY_NUMERIC(no_udp);
+	APPLY_NUMERIC(deny_roaming);
+	APPLY_ARRAY(char *, routes);
+	APPLY_ARRAY(char *, iroutes);
+	APPLY_ARRAY(char *, dns);
+	APPLY_ARRAY(char *, nbns);
+	APPLY_STRING(ipv4_net);
+	APPLY_STRING(ipv4_netmask);
+	APPLY_STRING(ipv6_net);
+	APPLY_NUMERIC(ipv6_prefix);
+	APPLY_STRING(cgroup);
+	APPLY_STRING(xml_config_file);
+	APPLY_NUMERIC(rx_per_sec);
+	APPLY_NUMERIC(tx_per_sec);
+	APPLY_NUMERIC(net_priority);
+	APPLY_STRING(explicit_ipv4);
+	APPLY_STRING(explicit_ipv6);
+	APPLY_ARRAY(char *, no_routes);
+	APPLY_NUMERIC(ipv6_subnet_prefix);
+	APPLY_NUMERIC(dpd);
+	APPLY_NUMERIC(mobile_dpd);
+	APPLY_NUMERIC(keepalive);
+	APPLY_NUMERIC(max_same_clients);
+	APPLY_NUMERIC(tunnel_all_dns);
+	APPLY_NUMERIC(restrict_user_to_routes);
+	APPLY_NUMERIC(mtu);
+	APPLY_NUMERIC(idle_timeout);
+	APPLY_NUMERIC(mobile_idle_timeout);
+	APPLY_ARRAY(FwPortSt *, fw_ports);
+	APPLY_STRING(hostname);
+
+	return 0;
+}
+
+static int read_sup_config_file(SecmSessionReplyMsg *msg, void *pool,
+				const char *file, const char *fallback, const char *type)
+{
+	char desc[32];
+	cfg_file_st *f;
+	int ret;
+
+	ret = get_cfg_file(file, type, &f);
+	if (ret == -1 && fallback != NULL) {
+		snprintf(desc, sizeof(desc), "default %s", type);
+		ret = get_cfg_file(fallback, desc, &f);
+	}
+
+	if (ret == -1)
+		return 0;
+	if (ret < 0)
+		return ERR_READ_CONFIG;
+
+	ret = apply_cfg_file(msg->config, f, pool);
+	if (ret < 0)
+		return ERR_READ_CONFIG;
+
 	return 0;
 }
 
@@ -285,7 +608,7 @@ static int get_sup_config(struct cfg_st *cfg, client_entry_st *entry,
 		snprintf(file, sizeof(file), "%s/%s", cfg->per_group_dir,
 			 entry->acct_info.groupname);
 
-		ret = read_sup_config_file(cfg, msg, pool, file, cfg->default_group_conf, "group");
+		ret = read_sup_config_file(msg, pool, file, cfg->default_group_conf, "group");
 		if (ret < 0)
 			return ret;
 	}
@@ -293,7 +616,7 @@ static int get_sup_config(struct cfg_st *cfg, client_entry_st *entry,
 	if (cfg->per_user_dir != NULL) {
 		snprintf(file, sizeof(file), "%s/%s", cfg->per_user_dir,
 			 entry->acct_info.username);
-		ret = read_sup_config_file(cfg, msg, pool, file, cfg->default_user_conf, "user");
+		ret = read_sup_config_file(msg, pool, file, cfg->default_user_conf, "user");
 		if (ret < 0)
 			return ret;
 	}
@@ -301,6 +624,148 @@ static int get_sup_config(struct cfg_st *cfg, client_entry_st *entry,
 	return 0;
 }
 
+#ifdef HAVE_SYS_INOTIFY_H
+/* Must be called with the cache locked */
+static void watch_dir(void *pool, const char *path, unsigned is_dir)
+{
+	const char *p;
+	char *dir;
+	int wd;
+
+	if (path == NULL)
+		return;
+
+	if (is_dir) {
+		dir = talloc_strdup(pool, path);
+	} else {
+		p = strrchr(path, '/');
+		if (p == NULL || p == path)
+			return;
+		dir = talloc_strndup(pool, path, p - path);
+	}
+	if (dir == NULL)
+		return;
+
+	wd = inotify_add_watch(cache.fd, dir, CFG_WATCH_EVENTS);
+	if (wd < 0) {
+		syslog(LOG_DEBUG, "cannot watch '%s' for changes: %s", dir, strerror(errno));
+		talloc_free(dir);
+		return;
+	}
+
+	cache.watches[cache.n_watches].wd = wd;
+	cache.watches[cache.n_watches].dir = dir;
+	cache.n_watches++;
+}
+#endif
+
+/* Clears the cache, and watches the directories of the files of
+ * the virtual hosts which use this module. */
+void file_sup_config_reset(sec_mod_st *sec)
+{
+	pthread_mutex_lock(&cache.lock);
+	init_cache();
+	flush_cfg_files();
+	cache.gen++;
+
+#ifdef HAVE_SYS_INOTIFY_H
+	{
+		vhost_cfg_st *vhost = NULL;
+		struct cfg_st *cfg;
+		unsigned i, n = 0;
+
+		if (cache.fd == -1) {
+			cache.fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+			if (cache.fd == -1)
+				syslog(LOG_INFO, "cannot initialize inotify; the configuration files are checked on use");
+		}
+
+		/* a descriptor is returned once per directory */
+		for (i = 0; i < cache.n_watches; i++) {
+			if (i == 0 || cache.watches[i].wd != cache.watches[i-1].wd)
+				inotify_rm_watch(cache.fd, cache.watches[i].wd);
+		}
+		talloc_free(cache.watches);
+		cache.watches = NULL;
+		cache.n_watches = 0;
+
+		list_for_each(sec->vconfig, vhost, list) {
+			if (vhost->config_module == &file_sup_config)
+				n += 4;
+		}
+
+		if (cache.fd != -1 && n > 0) {
+			cache.watches = talloc_array(NULL, cfg_watch_st, n);
+			if (cache.watches != NULL) {
+				list_for_each(sec->vconfig, vhost, list) {
+					if (vhost->config_module != &file_sup_config)
+						continue;
+					cfg = vhost->perm_config.config;
+					watch_dir(cache.watches, cfg->per_group_dir, 1);
+					watch_dir(cache.watches, cfg->per_user_dir, 1);
+					watch_dir(cache.watches, cfg->default_group_conf, 0);
+					watch_dir(cache.watches, cfg->default_user_conf, 0);
+				}
+			}
+		}
+	}
+#endif
+	pthread_mutex_unlock(&cache.lock);
+}
+
+int file_sup_config_fd(void)
+{
+	return cache.fd;
+}
+
+/* Removes the entries of the files reported as changed */
+void file_sup_config_changed(void)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char path[_POSIX_PATH_MAX];
+	const struct inotify_event *ev;
+	cfg_file_st *f;
+	ssize_t ret;
+	unsigned i, j;
+	char *p;
+
+	while ((ret = read(cache.fd, buf, sizeof(buf))) > 0) {
+		pthread_mutex_lock(&cache.lock);
+		cache.gen++;
+
+		for (p = buf; p < buf + ret; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+
+			/* events were lost, or a directory is no longer watched */
+			if ((ev->mask & (IN_Q_OVERFLOW|IN_IGNORED|IN_DELETE_SELF|IN_MOVE_SELF)) || ev->len == 0) {
+				flush_cfg_files();
+				if (!(ev->mask & IN_IGNORED))
+					continue;
+
+				for (i = j = 0; i < cache.n_watches; i++) {
+					if (cache.watches[i].wd != ev->wd)
+						cache.watches[j++] = cache.watches[i];
+				}
+				cache.n_watches = j;
+				continue;
+			}
+
+			for (i = 0; i < cache.n_watches; i++) {
+				if (cache.watches[i].wd != ev->wd)
+					continue;
+
+				snprintf(path, sizeof(path), "%s/%s", cache.watches[i].dir, ev->name);
+				f = htable_get(&cache.files, hash_any(path, strlen(path), 0), cfg_file_cmp, path);
+				if (f != NULL && remove_cfg_file(f))
+					talloc_free(f);
+			}
+		}
+		pthread_mutex_unlock(&cache.lock);
+	}
+#endif
+}
+
 struct config_mod_st file_sup_config = {
 	.get_sup_config = get_sup_config,
 };
@@ -25,4 +25,8 @@
 
 extern struct config_mod_st file_sup_config;
 
+void file_sup_config_reset(sec_mod_st *sec);
+int file_sup_config_fd(void);
+void file_sup_config_changed(void);
+
 #endif
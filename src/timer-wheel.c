@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <timer-wheel.h>
+
+/* the time after w->next covered by the wheel */
+#define TW_SPAN ((time_t)1 << (TW_BITS * TW_LEVELS))
+
+void timer_wheel_init(timer_wheel_st *w, time_t now)
+{
+	unsigned i, j;
+
+	for (i = 0; i < TW_LEVELS; i++)
+		for (j = 0; j < TW_SIZE; j++)
+			list_head_init(&w->slot[i][j]);
+
+	w->next = now;
+	w->entries = 0;
+}
+
+static void place(timer_wheel_st *w, timer_wheel_entry_st *e)
+{
+	time_t expires = e->expires;
+	time_t delta;
+	unsigned level;
+
+	if (expires < w->next)
+		expires = w->next;
+	delta = expires - w->next;
+	if (delta >= TW_SPAN)
+		expires = w->next + TW_SPAN - 1;
+
+	/* the level whose slots are the smallest that contain delta */
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < ((time_t)1 << (TW_BITS * (level + 1))))
+			break;
+	}
+
+	list_add_tail(&w->slot[level][(expires >> (TW_BITS * level)) & TW_MASK], &e->list);
+}
+
+/* (Re)schedules @e to expire at @expires */
+void timer_wheel_add(timer_wheel_st *w, timer_wheel_entry_st *e, time_t expires)
+{
+	if (timer_wheel_pending(e))
+		timer_wheel_del(w, e);
+
+	e->expires = expires;
+	place(w, e);
+	w->entries++;
+}
+
+void timer_wheel_del(timer_wheel_st *w, timer_wheel_entry_st *e)
+{
+	if (!timer_wheel_pending(e))
+		return;
+
+	list_del(&e->list);
+	e->list.next = NULL;
+	w->entries--;
+}
+
+/* Moves the entries of a slot to the level below, as w->next reached
+ * the time it covers. Returns the index of the slot. */
+static unsigned cascade(timer_wheel_st *w, unsigned level)
+{
+	timer_wheel_entry_st *e, *pos;
+	unsigned idx = (w->next >> (TW_BITS * level)) & TW_MASK;
+	struct list_head head;
+
+	if (list_empty(&w->slot[level][idx]))
+		return idx;
+
+	list_head_init(&head);
+	list_for_each_safe(&w->slot[level][idx], e, pos, list) {
+		list_del(&e->list);
+		list_add_tail(&head, &e->list);
+	}
+
+	list_for_each_safe(&head, e, pos, list) {
+		list_del(&e->list);
+		place(w, e);
+	}
+
+	return idx;
+}
+
+/* Removes and returns an entry whose time is not after @now, or NULL
+ * when there are no more. The entries are returned in the order of
+ * their expiration second. */
+timer_wheel_entry_st *timer_wheel_expired(timer_wheel_st *w, time_t now)
+{
+	timer_wheel_entry_st *e;
+	struct list_head *head;
+	unsigned level;
+
+	while (w->next <= now) {
+		if (w->entries == 0) {
+			w->next = now + 1;
+			break;
+		}
+
+		if ((w->next & TW_MASK) == 0) {
+			for (level = 1; level < TW_LEVELS; level++) {
+				if (cascade(w, level) != 0)
+					break;
+			}
+		}
+
+		head = &w->slot[0][w->next & TW_MASK];
+		e = list_top(head, timer_wheel_entry_st, list);
+		if (e != NULL) {
+			list_del(&e->list);
+			e->list.next = NULL;
+			w->entries--;
+			return e;
+		}
+
+		w->next++;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TIMER_WHEEL_H
+# define TIMER_WHEEL_H
+
+#include <time.h>
+#include <ccan/list/list.h>
+
+/* A hierarchical timer wheel with a resolution of one second, used to
+ * expire the entries of the ban, TLS session and client databases
+ * without walking them. Each of the TW_LEVELS levels has TW_SIZE
+ * slots, each covering TW_SIZE times the time of a slot of the level
+ * below; entries are moved to the lower levels as their time
+ * approaches. Times further than the wheel covers (about 194 days)
+ * are expired early, and should be checked and re-added by the
+ * caller, as should entries whose time was extended since they were
+ * added.
+ */
+
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 4
+
+typedef struct timer_wheel_entry_st {
+	struct list_node list; /* next is NULL when not in a wheel */
+	time_t expires;
+} timer_wheel_entry_st;
+
+typedef struct timer_wheel_st {
+	time_t next; /* the next second to be processed */
+	unsigned entries;
+	struct list_head slot[TW_LEVELS][TW_SIZE];
+} timer_wheel_st;
+
+void timer_wheel_init(timer_wheel_st *w, time_t now);
+void timer_wheel_add(timer_wheel_st *w, timer_wheel_entry_st *e, time_t expires);
+void timer_wheel_del(timer_wheel_st *w, timer_wheel_entry_st *e);
+timer_wheel_entry_st *timer_wheel_expired(timer_wheel_st *w, time_t now);
+
+inline static unsigned timer_wheel_pending(const timer_wheel_entry_st *e)
+{
+	return e->list.next != NULL;
+}
+
+/* The number of entries expired per call of the cleanup functions;
+ * the callers continue on their next event loop iteration while
+ * entries remain. */
+#define MAX_EXPIRED_PER_TICK 1024
+
+#endif
@@ -43,6 +43,8 @@
 #include <main.h>
 #include <worker.h>
 #include <common.h>
+#include <cloexec.h>
+#include <ccan/list/list.h>
 #include <sys/un.h>
 #include <sys/uio.h>
 #include <sys/types.h>
@@ -51,11 +53,27 @@
 #include <netinet/tcp.h>
 #include <c-ctype.h>
 
+#ifdef HAVE_LINUX_TLS_H
+# include <linux/tls.h>
+# if defined(TLS_RX) && defined(TLS_GET_RECORD_TYPE)
+#  define ENABLE_KTLS
+#  ifndef TCP_ULP
+#   define TCP_ULP 31
+#  endif
+#  ifndef SOL_TLS
+#   define SOL_TLS 282
+#  endif
+# endif
+#endif
+
 static void tls_reload_ocsp(main_server_st* s, struct vhost_cfg_st *vhost);
 
+#define TLS_CONTENT_ALERT 21
+#define TLS_CONTENT_APPLICATION_DATA 23
+
 void cstp_cork(worker_st *ws)
 {
-	if (ws->session) {
+	if (ws->session && !(ws->ktls & KTLS_TX)) {
 		gnutls_record_cork(ws->session);
 	} else {
 		int state = 1;
@@ -69,7 +87,7 @@ void cstp_cork(worker_st *ws)
 
 int cstp_uncork(worker_st *ws)
 {
-	if (ws->session) {
+	if (ws->session && !(ws->ktls & KTLS_TX)) {
 		return gnutls_record_uncork(ws->session, GNUTLS_RECORD_WAIT);
 	} else {
 		int state = 0;
@@ -90,7 +108,13 @@ ssize_t cstp_send(worker_st *ws, const void *data,
 	int left = data_size;
 	const uint8_t* p = data;
 
-	if (ws->session != NULL) {
+	if (ws->ktls & KTLS_TX) {
+		/* the kernel encrypts */
+		ret = force_write(ws->conn_fd, data, data_size);
+		if (ret < 0)
+			return GNUTLS_E_PUSH_ERROR;
+		return ret;
+	} else if (ws->session != NULL) {
 		while(left > 0) {
 			ret = gnutls_record_send(ws->session, p, data_size);
 			if (ret < 0) {
@@ -164,6 +188,293 @@ int recv_remaining(int fd, uint8_t *p, int left)
 	return total;
 }
 
+#ifdef ENABLE_KTLS
+/* Receives from a socket with kernel TLS enabled, and maps the
+ * errors and the non-data records to GnuTLS error codes. */
+static ssize_t ktls_recv(worker_st *ws, void *data, size_t data_size)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(unsigned char))];
+		struct cmsghdr align;
+	} u;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	uint8_t *p = data;
+	unsigned char type;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = data_size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+
+	ret = recvmsg(ws->conn_fd, &msg, 0);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return GNUTLS_E_AGAIN;
+		if (errno == EINTR)
+			return GNUTLS_E_INTERRUPTED;
+		return GNUTLS_E_PULL_ERROR;
+	}
+
+	if (ret == 0)
+		return GNUTLS_E_PREMATURE_TERMINATION;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_TLS &&
+	    cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+		type = *((unsigned char *)CMSG_DATA(cmsg));
+
+		if (type == TLS_CONTENT_ALERT) {
+			if (ret >= 2 && p[1] == GNUTLS_A_CLOSE_NOTIFY)
+				return 0;
+			return GNUTLS_E_FATAL_ALERT_RECEIVED;
+		}
+
+		/* a rehandshake cannot be handled once the keys are in
+		 * the kernel */
+		if (type != TLS_CONTENT_APPLICATION_DATA)
+			return GNUTLS_E_UNEXPECTED_PACKET;
+	}
+
+	return ret;
+}
+
+/* Like recv_remaining(), but it returns GNUTLS_E_AGAIN if no data are
+ * available, and waits for the rest of a partially received packet. */
+static ssize_t ktls_recv_remaining(worker_st *ws, uint8_t *p, size_t left, unsigned partial)
+{
+	int counter = 100; /* allow 10 seconds for a full packet */
+	ssize_t total = 0;
+	struct pollfd pfd;
+	ssize_t ret;
+
+	while (left > 0) {
+		ret = ktls_recv(ws, p, left);
+		if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+			if (total == 0 && partial == 0)
+				return ret;
+
+			if (counter-- <= 0)
+				return GNUTLS_E_TIMEDOUT;
+
+			pfd.fd = ws->conn_fd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			oc_poll(&pfd, 1, 100);
+			continue;
+		}
+		if (ret <= 0)
+			return ret;
+
+		left -= ret;
+		p += ret;
+		total += ret;
+	}
+
+	return total;
+}
+
+/* The kernel does not preserve the record boundaries, so this reads
+ * a full CSTP packet based on its header. */
+static ssize_t ktls_recv_packet(worker_st *ws, void *data, size_t data_size)
+{
+	uint8_t *p = data;
+	unsigned pktlen;
+	ssize_t ret;
+
+	ret = ktls_recv_remaining(ws, p, 8, 0);
+	if (ret <= 0)
+		return ret;
+
+	pktlen = (p[4] << 8) + p[5];
+	if (pktlen+8 > data_size) {
+		oclog(ws, LOG_ERR, "error in CSTP packet length");
+		return GNUTLS_E_UNEXPECTED_PACKET_LENGTH;
+	}
+
+	if (pktlen > 0) {
+		ret = ktls_recv_remaining(ws, p+8, pktlen, 1);
+		if (ret <= 0)
+			return ret;
+	}
+
+	return 8+pktlen;
+}
+
+static void ktls_send_alert(worker_st *ws, unsigned char level, unsigned char desc)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(unsigned char))];
+		struct cmsghdr align;
+	} u;
+	unsigned char alert[2] = { level, desc };
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&u, 0, sizeof(u));
+	iov.iov_base = alert;
+	iov.iov_len = sizeof(alert);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+	*((unsigned char *)CMSG_DATA(cmsg)) = TLS_CONTENT_ALERT;
+
+	sendmsg(ws->conn_fd, &msg, MSG_DONTWAIT);
+}
+
+/* Hands the current key of the given direction to the kernel */
+static int ktls_set_key(worker_st *ws, unsigned read, int optname)
+{
+	gnutls_datum_t mac_key, iv, cipher_key;
+	unsigned char seq[8];
+	union {
+		struct tls12_crypto_info_aes_gcm_128 aes128;
+		struct tls12_crypto_info_aes_gcm_256 aes256;
+# ifdef TLS_CIPHER_CHACHA20_POLY1305
+		struct tls12_crypto_info_chacha20_poly1305 chacha;
+# endif
+	} info;
+	size_t size;
+	int ret;
+
+	ret = gnutls_record_get_state(ws->session, read, &mac_key, &iv, &cipher_key, seq);
+	if (ret < 0)
+		return -1;
+
+	memset(&info, 0, sizeof(info));
+
+	/* in TLS 1.2 the explicit nonce of AES-GCM is the sequence number */
+	switch (gnutls_cipher_get(ws->session)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		if (iv.size < TLS_CIPHER_AES_GCM_128_SALT_SIZE ||
+		    cipher_key.size != TLS_CIPHER_AES_GCM_128_KEY_SIZE)
+			return -1;
+		info.aes128.info.version = TLS_1_2_VERSION;
+		info.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(info.aes128.iv, seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+		memcpy(info.aes128.salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+		memcpy(info.aes128.key, cipher_key.data, TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+		memcpy(info.aes128.rec_seq, seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+		size = sizeof(info.aes128);
+		break;
+	case GNUTLS_CIPHER_AES_256_GCM:
+		if (iv.size < TLS_CIPHER_AES_GCM_256_SALT_SIZE ||
+		    cipher_key.size != TLS_CIPHER_AES_GCM_256_KEY_SIZE)
+			return -1;
+		info.aes256.info.version = TLS_1_2_VERSION;
+		info.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(info.aes256.iv, seq, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+		memcpy(info.aes256.salt, iv.data, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+		memcpy(info.aes256.key, cipher_key.data, TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+		memcpy(info.aes256.rec_seq, seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+		size = sizeof(info.aes256);
+		break;
+# if defined(TLS_CIPHER_CHACHA20_POLY1305) && GNUTLS_VERSION_NUMBER >= 0x030400
+	case GNUTLS_CIPHER_CHACHA20_POLY1305:
+		if (iv.size != TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE ||
+		    cipher_key.size != TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE)
+			return -1;
+		info.chacha.info.version = TLS_1_2_VERSION;
+		info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		memcpy(info.chacha.iv, iv.data, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+		memcpy(info.chacha.key, cipher_key.data, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+		memcpy(info.chacha.rec_seq, seq, TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+		size = sizeof(info.chacha);
+		break;
+# endif
+	default:
+		return -1;
+	}
+
+	ret = setsockopt(ws->conn_fd, SOL_TLS, optname, &info, size);
+	safe_memset(&info, 0, sizeof(info));
+	return ret;
+}
+
+/* Returns true if the CSTP session can be handed to the kernel; that
+ * is only the TLS 1.2 AEAD ciphers, as TLS 1.3 requires handling
+ * post-handshake messages. */
+unsigned cstp_ktls_eligible(worker_st *ws)
+{
+	if (WSCONFIG(ws)->ktls == 0 || ws->session == NULL)
+		return 0;
+
+	if (gnutls_protocol_get_version(ws->session) != GNUTLS_TLS1_2)
+		return 0;
+
+	switch (gnutls_cipher_get(ws->session)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+	case GNUTLS_CIPHER_AES_256_GCM:
+# if defined(TLS_CIPHER_CHACHA20_POLY1305) && GNUTLS_VERSION_NUMBER >= 0x030400
+	case GNUTLS_CIPHER_CHACHA20_POLY1305:
+# endif
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Moves the CSTP record layer to the kernel. It is called before the
+ * CONNECT reply is sent, as the rekey method it announces depends on
+ * the outcome; on failure the session stays in GnuTLS. The TLS ULP
+ * remains transparent for a direction without a key, and the sending
+ * one is offloaded only once the receiving one is, which is the one
+ * older kernels lack. */
+void cstp_ktls_enable(worker_st *ws)
+{
+	if (!cstp_ktls_eligible(ws))
+		return;
+
+	if (gnutls_record_check_pending(ws->session) > 0) {
+		oclog(ws, LOG_DEBUG, "not using kernel TLS; data are pending");
+		return;
+	}
+
+	if (setsockopt(ws->conn_fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+		int e = errno;
+		oclog(ws, LOG_DEBUG, "kernel TLS is not available: %s", strerror(e));
+		return;
+	}
+
+	if (ktls_set_key(ws, 1, TLS_RX) < 0) {
+		oclog(ws, LOG_DEBUG, "not using kernel TLS; receiving is not supported");
+		return;
+	}
+	ws->ktls |= KTLS_RX;
+
+	if (ktls_set_key(ws, 0, TLS_TX) == 0)
+		ws->ktls |= KTLS_TX;
+
+	if (ws->ktls != 0)
+		oclog(ws, LOG_INFO, "using kernel TLS for%s%s",
+		      (ws->ktls & KTLS_TX)?" sending":"",
+		      (ws->ktls & KTLS_RX)?" receiving":"");
+}
+#else
+unsigned cstp_ktls_eligible(worker_st *ws)
+{
+	return 0;
+}
+
+void cstp_ktls_enable(worker_st *ws)
+{
+	return;
+}
+#endif
+
 /* Receives CSTP packet, after the channel is established.
  * It makes sure that CSTP packet boundaries are respected in
  * case we do not read over TLS - e.g., when TLS is done by
@@ -174,6 +485,12 @@ static ssize_t _cstp_recv_packet(worker_st *ws, void *data, size_t data_size)
 
 	/* socket is in non-blocking mode already */
 
+#ifdef ENABLE_KTLS
+	if (ws->ktls & KTLS_RX) {
+		return ktls_recv_packet(ws, data, data_size);
+	}
+#endif
+
 	if (ws->session != NULL) {
 		return gnutls_record_recv(ws->session, data, data_size);
 	} else {
@@ -212,7 +529,7 @@ ssize_t cstp_recv_packet(worker_st *ws, gnutls_datum_t *data, void **p)
 #ifdef ZERO_COPY
 	gnutls_packet_t packet = NULL;
 
-	if (ws->session != NULL) {
+	if (ws->session != NULL && !(ws->ktls & KTLS_RX)) {
 		ret = gnutls_record_recv_packet(ws->session, &packet);
 		if (ret > 0) {
 			*p = packet;
@@ -238,6 +555,19 @@ ssize_t cstp_recv(worker_st *ws, void *data, size_t data_size)
 	int ret;
 	int counter = 5;
 
+#ifdef ENABLE_KTLS
+	if (ws->ktls & KTLS_RX) {
+		do {
+			ret = ktls_recv(ws, data, data_size);
+			if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+				counter--;
+				ms_sleep(20);
+			}
+		} while ((ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) && counter > 0);
+		return ret;
+	}
+#endif
+
 	if (ws->session != NULL) {
 		do {
 			ret = gnutls_record_recv(ws->session, data, data_size);
@@ -246,6 +576,8 @@ ssize_t cstp_recv(worker_st *ws, void *data, size_t data_size)
 				ms_sleep(20);
 			}
 		} while ((ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) && counter > 0);
+	} else if (ws->pool != NULL) {
+		ret = pool_recv(ws->conn_fd, data, data_size);
 	} else {
 		do {
 			ret = recv(ws->conn_fd, data, data_size, 0);
@@ -307,10 +639,17 @@ int __attribute__ ((format(printf, 2, 3)))
 void cstp_close(worker_st *ws)
 {
 	if (ws->session) {
-		gnutls_bye(ws->session, GNUTLS_SHUT_WR);
+#ifdef ENABLE_KTLS
+		if (ws->ktls & KTLS_TX)
+			ktls_send_alert(ws, GNUTLS_AL_WARNING, GNUTLS_A_CLOSE_NOTIFY);
+		else
+#endif
+			gnutls_bye(ws->session, GNUTLS_SHUT_WR);
 		gnutls_deinit(ws->session);
+		ws->session = NULL;
 	} else {
 		close(ws->conn_fd);
+		ws->conn_fd = -1;
 	}
 }
 
@@ -318,10 +657,17 @@ void cstp_fatal_close(worker_st *ws,
 			    gnutls_alert_description_t a)
 {
 	if (ws->session) {
-		gnutls_alert_send(ws->session, GNUTLS_AL_FATAL, a);
+#ifdef ENABLE_KTLS
+		if (ws->ktls & KTLS_TX)
+			ktls_send_alert(ws, GNUTLS_AL_FATAL, a);
+		else
+#endif
+			gnutls_alert_send(ws->session, GNUTLS_AL_FATAL, a);
 		gnutls_deinit(ws->session);
+		ws->session = NULL;
 	} else {
 		close(ws->conn_fd);
+		ws->conn_fd = -1;
 	}
 }
 
@@ -379,6 +725,7 @@ void dtls_close(worker_st *ws)
 {
 	gnutls_bye(ws->dtls_session, GNUTLS_SHUT_WR);
 	gnutls_deinit(ws->dtls_session);
+	ws->dtls_session = NULL;
 }
 
 static size_t rehash(const void *_e, void *unused)
@@ -396,6 +743,7 @@ void tls_cache_init(void *pool, tls_sess_db_st* db)
 
 	htable_init(db->ht, rehash, NULL);
 	db->entries = 0;
+	timer_wheel_init(&db->expiry, time(0));
 }
 
 void tls_cache_deinit(tls_sess_db_st* db)
@@ -658,33 +1006,241 @@ struct key_cb_data {
 	const char *vhost;
 };
 
-static
-int key_cb_common_func (gnutls_privkey_t key, void* userdata, const gnutls_datum_t * raw_data,
-	gnutls_datum_t * output, unsigned sigalgo, unsigned type)
+/* The connection of this process to sec-mod for private key operations.
+ * It is kept open across handshakes, and the sessions of a pool worker
+ * may have several requests outstanding on it; the replies are matched
+ * to the requests by their id.
+ */
+struct key_op_st {
+	struct list_node list;
+	uint32_t id;
+	uint8_t cmd; /* of the request and its reply */
+	unsigned done;
+	const void *owner; /* the pool session which waits for it */
+	SecOpMsg *reply; /* NULL on failure */
+};
+
+static struct {
+	int fd;
+	uint32_t next_id;
+	struct key_op_st *poller; /* the request whose session waits on fd */
+	struct list_head pending; /* in the order they were sent */
+} key_chan = { .fd = -1, .pending = LIST_HEAD_INIT(key_chan.pending) };
+
+/* Closes the connection to sec-mod; any pending requests fail. */
+void tls_key_channel_close(void)
 {
-	struct key_cb_data* cdata = userdata;
-	int sd = -1, ret, e;
-	SecOpMsg msg = SEC_OP_MSG__INIT;
-	SecOpMsg *reply = NULL;
-	PROTOBUF_ALLOCATOR(pa, userdata);
+	struct key_op_st *op;
 
-	output->data = NULL;
+	if (key_chan.fd != -1) {
+		close(key_chan.fd);
+		key_chan.fd = -1;
+	}
+
+	list_for_each(&key_chan.pending, op, list) {
+		op->done = 1;
+	}
+}
+
+/* Forgets the requests of a pool session which is terminated while
+ * waiting for their replies; it never returns to key_chan_wait(). The
+ * replies which arrive later are discarded. */
+void tls_key_channel_abandon(const void *owner)
+{
+	struct key_op_st *op, *next;
+	PROTOBUF_ALLOCATOR(pa, NULL);
+
+	list_for_each_safe(&key_chan.pending, op, next, list) {
+		if (op->owner != owner)
+			continue;
+
+		if (key_chan.poller == op)
+			key_chan.poller = NULL;
+
+		list_del(&op->list);
+		if (op->reply != NULL)
+			sec_op_msg__free_unpacked(op->reply, &pa);
+		talloc_free(op);
+	}
+}
+
+static int key_chan_open(struct key_cb_data *cdata)
+{
+	int sd, ret, e;
 
 	sd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (sd == -1) {
 		e = errno;
 		syslog(LOG_ERR, "error opening socket: %s", strerror(e));
-		return GNUTLS_E_INTERNAL_ERROR;
+		return -1;
 	}
+	set_cloexec_flag(sd, 1);
 
 	ret = connect(sd, (struct sockaddr *)&cdata->sa, cdata->sa_len);
 	if (ret == -1) {
 		e = errno;
 		syslog(LOG_ERR, "error connecting to sec-mod socket '%s': %s",
 			cdata->sa.sun_path, strerror(e));
-		goto error;
+		close(sd);
+		return -1;
 	}
 
+	key_chan.fd = sd;
+	return 0;
+}
+
+/* Reads the replies which have fully arrived, without blocking, and
+ * hands them to their requests. Returns -1 if the connection failed.
+ */
+static int key_chan_read(struct key_cb_data *cdata)
+{
+	PROTOBUF_ALLOCATOR(pa, cdata);
+	struct key_op_st *op, *head;
+	SecOpMsg *reply;
+	uint8_t hdr[5], *buf;
+	uint32_t length;
+	ssize_t ret;
+
+	for (;;) {
+		ret = recv(key_chan.fd, hdr, sizeof(hdr), MSG_PEEK|MSG_DONTWAIT);
+		if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		if (ret <= 0)
+			return -1;
+		if (ret < (ssize_t)sizeof(hdr))
+			return 0;
+
+		memcpy(&length, &hdr[1], 4);
+		if (length > MAX_MSG_SIZE)
+			return -1;
+
+		buf = talloc_size(cdata, sizeof(hdr) + length);
+		if (buf == NULL)
+			return -1;
+
+		/* only consume complete messages; the incomplete ones
+		 * will be read on the next call */
+		ret = recv(key_chan.fd, buf, sizeof(hdr) + length, MSG_PEEK|MSG_DONTWAIT);
+		if (ret != (ssize_t)(sizeof(hdr) + length)) {
+			talloc_free(buf);
+			if (ret == -1 && errno != EAGAIN && errno != EINTR)
+				return -1;
+			return 0;
+		}
+
+		ret = recv(key_chan.fd, buf, sizeof(hdr) + length, MSG_DONTWAIT);
+		if (ret != (ssize_t)(sizeof(hdr) + length)) {
+			talloc_free(buf);
+			return -1;
+		}
+
+		reply = sec_op_msg__unpack(&pa, length, buf + sizeof(hdr));
+		talloc_free(buf);
+		if (reply == NULL || reply->has_id == 0) {
+			syslog(LOG_ERR, "error unpacking sec-mod reply");
+			if (reply != NULL)
+				sec_op_msg__free_unpacked(reply, &pa);
+			return -1;
+		}
+
+		/* sec-mod may serve the requests out of order, but never
+		 * replies to one before the oldest pending, or to one not
+		 * yet sent; such a reply belongs to an abandoned request
+		 * or the connection is out of sync. */
+		head = list_top(&key_chan.pending, struct key_op_st, list);
+		if (head == NULL || (int32_t)(reply->id - head->id) < 0) {
+			sec_op_msg__free_unpacked(reply, &pa);
+			continue;
+		}
+
+		if ((int32_t)(key_chan.next_id - reply->id) < 0) {
+			syslog(LOG_ERR, "received sec-mod reply %u to no request",
+			       (unsigned)reply->id);
+			sec_op_msg__free_unpacked(reply, &pa);
+			return -1;
+		}
+
+		list_for_each(&key_chan.pending, op, list) {
+			if (op->id != reply->id || op->done != 0)
+				continue;
+
+			if (op->cmd != hdr[0]) {
+				syslog(LOG_ERR, "received sec-mod reply %u of type %u to a request of type %u",
+				       (unsigned)reply->id, (unsigned)hdr[0], (unsigned)op->cmd);
+				sec_op_msg__free_unpacked(reply, &pa);
+				return -1;
+			}
+
+			op->reply = reply;
+			op->done = 1;
+			reply = NULL;
+			break;
+		}
+
+		/* the request was abandoned */
+		if (reply != NULL)
+			sec_op_msg__free_unpacked(reply, &pa);
+	}
+}
+
+/* Waits for the reply to @op. Only one session at a time polls the
+ * connection; the others check for their replies periodically.
+ */
+static void key_chan_wait(struct key_cb_data *cdata, struct key_op_st *op)
+{
+	time_t start = time(0);
+	struct pollfd pfd;
+	int ret;
+
+	while (op->done == 0) {
+		if (key_chan_read(cdata) < 0) {
+			syslog(LOG_ERR, "error receiving sec-mod reply");
+			tls_key_channel_close();
+			break;
+		}
+
+		if (op->done != 0)
+			break;
+
+		if (time(0) - start > DEFAULT_SOCKET_TIMEOUT) {
+			syslog(LOG_ERR, "timeout waiting for sec-mod reply");
+			tls_key_channel_close();
+			break;
+		}
+
+		if (key_chan.poller != NULL) {
+			oc_poll(NULL, 0, 1);
+			continue;
+		}
+
+		pfd.fd = key_chan.fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		key_chan.poller = op;
+		ret = oc_poll(&pfd, 1, 1000);
+		key_chan.poller = NULL;
+
+		if (ret < 0 && errno != EINTR) {
+			tls_key_channel_close();
+			break;
+		}
+	}
+}
+
+static
+int key_cb_common_func (gnutls_privkey_t key, void* userdata, const gnutls_datum_t * raw_data,
+	gnutls_datum_t * output, unsigned sigalgo, unsigned type)
+{
+	struct key_cb_data* cdata = userdata;
+	int ret;
+	unsigned retry = 0;
+	SecOpMsg msg = SEC_OP_MSG__INIT;
+	struct key_op_st *op = NULL;
+	PROTOBUF_ALLOCATOR(pa, userdata);
+
+	output->data = NULL;
+
 	msg.has_key_idx = 1;
 	msg.key_idx = cdata->idx;
 	msg.sig = sigalgo;
@@ -692,43 +1248,66 @@ int key_cb_common_func (gnutls_privkey_t key, void* userdata, const gnutls_datum
 	msg.data.len = raw_data->size;
 	msg.vhost = (char*)cdata->vhost;
 
-	ret = send_msg(userdata, sd, type, &msg,
-			(pack_size_func)sec_op_msg__get_packed_size,
-			(pack_func)sec_op_msg__pack);
-	if (ret < 0) {
-		goto error;
+	op = talloc_zero(cdata, struct key_op_st);
+	if (op == NULL) {
+		syslog(LOG_ERR, "error allocating memory");
+		return GNUTLS_E_INTERNAL_ERROR;
 	}
 
-	ret = recv_msg(userdata, sd, type, (void*)&reply,
-		       (unpack_func)sec_op_msg__unpack,
-		       DEFAULT_SOCKET_TIMEOUT);
-	if (ret < 0) {
-		e = errno;
-		syslog(LOG_ERR, "error receiving sec-mod reply: %s",
-				strerror(e));
+	for (;;) {
+		if (key_chan.fd == -1 && key_chan_open(cdata) < 0)
+			goto error;
+
+		op->id = ++key_chan.next_id;
+		op->cmd = type;
+		op->owner = worker_pool_current();
+		msg.has_id = 1;
+		msg.id = op->id;
+
+		ret = send_msg(userdata, key_chan.fd, type, &msg,
+				(pack_size_func)sec_op_msg__get_packed_size,
+				(pack_func)sec_op_msg__pack);
+		if (ret >= 0)
+			break;
+
+		/* the connection may have been closed since last used */
+		tls_key_channel_close();
+		if (retry++ > 0)
+			goto error;
+	}
+
+	list_add_tail(&key_chan.pending, &op->list);
+	key_chan_wait(cdata, op);
+	list_del(&op->list);
+
+	if (op->reply == NULL)
+		goto error;
+
+	/* the connection remains usable */
+	if (op->reply->has_failed && op->reply->failed) {
+		syslog(LOG_ERR, "sec-mod failed the private key operation");
 		goto error;
 	}
-	close(sd);
-	sd = -1;
 
-	output->size = reply->data.len;
-	output->data = gnutls_malloc(reply->data.len);
+	output->size = op->reply->data.len;
+	output->data = gnutls_malloc(op->reply->data.len);
 	if (output->data == NULL) {
 		syslog(LOG_ERR, "error allocating memory");
 		goto error;
 	}
 
-	memcpy(output->data, reply->data.data, reply->data.len);
+	memcpy(output->data, op->reply->data.data, op->reply->data.len);
 
-	sec_op_msg__free_unpacked(reply, &pa);
+	sec_op_msg__free_unpacked(op->reply, &pa);
+	talloc_free(op);
 	return 0;
 
 error:
-	if (sd != -1)
-		close(sd);
 	gnutls_free(output->data);
-	if (reply != NULL)
-		sec_op_msg__free_unpacked(reply, &pa);
+	output->data = NULL;
+	if (op->reply != NULL)
+		sec_op_msg__free_unpacked(op->reply, &pa);
+	talloc_free(op);
 	return GNUTLS_E_INTERNAL_ERROR;
 }
 
@@ -26,6 +26,7 @@
 #include <gnutls/pkcs11.h>
 #include <vpn.h>
 #include <ccan/htable/htable.h>
+#include <timer-wheel.h>
 #include <errno.h>
 
 # if GNUTLS_VERSION_NUMBER < 0x030200
@@ -45,6 +46,7 @@ typedef struct
 {
 	struct htable *ht;
 	unsigned int entries;
+	timer_wheel_st expiry;
 } tls_sess_db_st;
 
 typedef struct tls_st {
@@ -63,10 +65,13 @@ void tls_vhost_init(struct vhost_cfg_st *vhost);
 void tls_vhost_deinit(struct vhost_cfg_st *vhost);
 void tls_load_files(struct main_server_st* s, struct vhost_cfg_st *vhost);
 void tls_load_prio(struct main_server_st *s, struct vhost_cfg_st *vhost);
+void tls_key_channel_close(void);
+void tls_key_channel_abandon(const void *owner);
 
 size_t tls_get_overhead(gnutls_protocol_t, gnutls_cipher_algorithm_t, gnutls_mac_algorithm_t);
 
 #define GNUTLS_FATAL_ERR DTLS_FATAL_ERR
+#define GNUTLS_FATAL_ERR_CMD DTLS_FATAL_ERR_CMD
 
 #ifdef UNDER_TEST
 # define syslog_open 0
@@ -96,7 +101,7 @@ size_t tls_get_overhead(gnutls_protocol_t, gnutls_cipher_algorithm_t, gnutls_mac
 	        } \
 	}
 
-#define CSTP_FATAL_ERR(ws, x) CSTP_FATAL_ERR_CMD(ws, x, exit(1))
+#define CSTP_FATAL_ERR(ws, x) CSTP_FATAL_ERR_CMD(ws, x, exit_worker(ws))
 
 void tls_close(gnutls_session_t session);
 
@@ -119,6 +124,8 @@ typedef struct
   unsigned int session_data_size;
 
   char *vhostname;
+
+  timer_wheel_entry_st expiry;
 } tls_cache_st;
 
 #define TLS_SESSION_EXPIRATION_TIME(config) ((config)->cookie_timeout)
@@ -143,6 +150,13 @@ ssize_t cstp_send(struct worker_st *ws, const void *data,
 void cstp_cork(struct worker_st *ws);
 int cstp_uncork(struct worker_st *ws);
 
+/* the directions of the CSTP channel handled by kernel TLS */
+#define KTLS_TX 1
+#define KTLS_RX 2
+
+unsigned cstp_ktls_eligible(struct worker_st *ws);
+void cstp_ktls_enable(struct worker_st *ws);
+
 /* DTLS API */
 void dtls_close(struct worker_st *ws);
 ssize_t dtls_send(struct worker_st *ws, const void *data, size_t data_size);
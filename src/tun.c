@@ -707,16 +707,11 @@ static int os_open_tun(main_server_st * s, struct proc_st *proc)
 }
 #endif /* __linux__ */
 
+/* Opens the device for the leases obtained with get_ip_leases() */
 int open_tun(main_server_st * s, struct proc_st *proc)
 {
 	int tunfd, ret;
 
-	ret = get_ip_leases(s, proc);
-	if (ret < 0)
-		return ret;
-
-	/* No need to free the lease after this point.
-	 */
 	tunfd = os_open_tun(s, proc);
 	if (tunfd < 0) {
 		int e = errno;
@@ -726,6 +721,8 @@ int open_tun(main_server_st * s, struct proc_st *proc)
 	}
 
 	set_cloexec_flag(tunfd, 1);
+	/* the worker drains the device until EAGAIN */
+	set_non_block(tunfd);
 
 	if (proc->tun_lease.name[0] == 0) {
 		mslog(s, NULL, LOG_ERR, "tun device with no name!");
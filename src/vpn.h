@@ -75,6 +75,12 @@ typedef enum fw_proto_t {
 	PROTO_MAX
 } fw_proto_t;
 
+/* how restrict-user-to-routes and restrict-user-to-ports are applied */
+typedef enum fw_backend_t {
+	FW_BACKEND_SCRIPT,
+	FW_BACKEND_NFTABLES,
+} fw_backend_t;
+
 
 inline static const char *proto_to_str(fw_proto_t proto)
 {
@@ -101,6 +107,9 @@ inline static const char *proto_to_str(fw_proto_t proto)
 #define DEFAULT_KKDCP_POINTS 1
 #define DEFAULT_MAX_BAN_SCORE (MAX_PASSWORD_TRIES*DEFAULT_PASSWORD_POINTS)
 #define DEFAULT_BAN_RESET_TIME 300
+/* the prefixes the scores of addresses are aggregated at */
+#define DEFAULT_BAN_PREFIX_IPV4 24
+#define DEFAULT_BAN_PREFIX_IPV6 48
 
 #define MIN_NO_COMPRESS_LIMIT 64
 #define DEFAULT_NO_COMPRESS_LIMIT 256
@@ -115,6 +124,9 @@ inline static const char *proto_to_str(fw_proto_t proto)
 
 #define DEFAULT_DPD_TIME 600
 
+/* The connect and disconnect scripts which are run at once */
+#define DEFAULT_MAX_SCRIPTS 32
+
 #define AC_PKT_DATA             0	/* Uncompressed data */
 #define AC_PKT_DPD_OUT          3	/* Dead Peer Detection */
 #define AC_PKT_DPD_RESP         4	/* DPD response */
@@ -272,11 +284,20 @@ struct cfg_st {
 	unsigned ban_points_connect;
 	unsigned ban_points_kkdcp;
 
+	/* the score allowed to the addresses of a prefix before it is
+	 * banned; zero when prefixes are not banned */
+	unsigned max_ban_prefix_score;
+	unsigned ban_prefix_ipv4;
+	unsigned ban_prefix_ipv6;
+	/* drop the packets of banned clients in the kernel */
+	unsigned kernel_ban_filter;
+
 	/* when using the new PSK DTLS negotiation make sure that
 	 * the negotiated DTLS cipher/mac matches the TLS cipher/mac. */
 	unsigned match_dtls_and_tls;
 	unsigned dtls_psk; /* whether to enable DTLS-PSK */
 	unsigned dtls_legacy; /* whether to enable DTLS-LEGACY */
+	unsigned ktls; /* whether to hand the CSTP channel to kernel TLS */
 
 	unsigned isolate; /* whether seccomp should be enabled or not */
 
@@ -312,6 +333,7 @@ struct cfg_st {
 
 	char *route_add_cmd;
 	char *route_del_cmd;
+	unsigned fw_backend; /* FW_BACKEND_ */
 
 	char *connect_script;
 	char *host_update_script;
@@ -377,6 +399,11 @@ struct perm_cfg_st {
 #endif
 
 	unsigned int stats_reset_time;
+	unsigned worker_pool_size; /* if non zero, sessions are served by that many worker processes */
+	unsigned max_scripts; /* the connect/disconnect scripts run at once; zero for no limit */
+	unsigned acceptor_shards; /* if non zero, connections are accepted by that many processes */
+	unsigned udp_steering; /* DTLS datagrams are steered to the workers by the kernel */
+	unsigned metrics_port; /* if non zero, the metrics are served on that loopback port */
 	unsigned foreground;
 	unsigned no_chdir;
 	unsigned debug;
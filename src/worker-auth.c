@@ -629,6 +629,11 @@ static int recv_cookie_auth_reply(worker_st * ws)
 
 			ws->user_config = msg->config;
 
+			if (msg->has_stats_slot && msg->has_stats_gen && msg->stats_gen != 0) {
+				ws->stats_slot = session_stats_get(msg->stats_slot);
+				ws->stats_gen = msg->stats_gen;
+			}
+
 			if (msg->ipv4 != NULL) {
 				talloc_free(ws->vinfo.ipv4);
 				if (strcmp(msg->ipv4, "0.0.0.0") == 0)
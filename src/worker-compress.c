@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+#include <netinet/in.h>
+#include <worker-compress.h>
+
+/* Most of the traffic over a VPN is already encrypted, and trying to
+ * compress it only costs CPU time. We skip the packets of well-known
+ * encrypted protocols and the packets whose payload looks random, and
+ * back off exponentially on the flows and the sessions whose packets
+ * fail to compress.
+ */
+
+/* The number of consecutive packets that must raise the running ratio
+ * of the session above COMP_POOR_RATIO before it backs off */
+#define COMP_SESSION_FAILS 4
+
+/* A payload sample with more distinct bytes than that looks random;
+ * random data have about 57 distinct bytes in 64, text below 40. */
+#define COMP_SAMPLE 64
+#define COMP_RANDOM_BYTES 48
+
+/* TCP and UDP ports of protocols whose payload is encrypted: ssh,
+ * https and QUIC, DNS over TLS, IMAPS and POP3S */
+static const uint16_t encrypted_ports[] = { 22, 443, 853, 993, 995 };
+
+typedef struct pkt_info_st {
+	uint32_t key;
+	uint16_t sport;
+	uint16_t dport;
+	unsigned payload; /* offset of the transport payload, or zero */
+} pkt_info_st;
+
+static uint32_t hash_add(uint32_t h, const uint8_t *data, unsigned size)
+{
+	unsigned i;
+
+	for (i = 0; i < size; i++)
+		h = (h ^ data[i]) * 16777619;
+	return h;
+}
+
+/* Extracts the flow of an IPv4 or IPv6 packet. Returns zero if the
+ * packet cannot be parsed. */
+static unsigned parse_packet(const uint8_t *pkt, unsigned len, pkt_info_st *info)
+{
+	unsigned off, thlen;
+	uint8_t proto;
+	uint32_t h = 2166136261;
+
+	memset(info, 0, sizeof(*info));
+
+	if (len < 1)
+		return 0;
+
+	if ((pkt[0] >> 4) == 4) {
+		off = (pkt[0] & 0x0f) * 4;
+		if (len < 20 || off < 20 || off > len)
+			return 0;
+		proto = pkt[9];
+		h = hash_add(h, pkt + 12, 8);
+
+		/* only the first fragment has the transport header */
+		if (((pkt[6] & 0x1f) | pkt[7]) != 0)
+			proto = 0;
+	} else if ((pkt[0] >> 4) == 6) {
+		off = 40;
+		if (len < off)
+			return 0;
+		/* extension headers are not followed */
+		proto = pkt[6];
+		h = hash_add(h, pkt + 8, 32);
+	} else {
+		return 0;
+	}
+
+	h = hash_add(h, &proto, 1);
+
+	if (proto == IPPROTO_TCP && len >= off + 20) {
+		thlen = (pkt[off + 12] >> 4) * 4;
+	} else if (proto == IPPROTO_UDP && len >= off + 8) {
+		thlen = 8;
+	} else {
+		info->key = h;
+		return 1;
+	}
+
+	info->sport = (pkt[off] << 8) | pkt[off + 1];
+	info->dport = (pkt[off + 2] << 8) | pkt[off + 3];
+	info->key = hash_add(h, pkt + off, 4);
+	if (thlen >= 8 && off + thlen < len)
+		info->payload = off + thlen;
+
+	return 1;
+}
+
+static unsigned is_encrypted_port(uint16_t port)
+{
+	unsigned i;
+
+	for (i = 0; i < sizeof(encrypted_ports)/sizeof(encrypted_ports[0]); i++) {
+		if (encrypted_ports[i] == port)
+			return 1;
+	}
+	return 0;
+}
+
+static unsigned looks_random(const uint8_t *data, unsigned size)
+{
+	uint64_t seen[4] = { 0, 0, 0, 0 };
+	unsigned i, distinct = 0;
+
+	/* too short to tell */
+	if (size < COMP_SAMPLE)
+		return 0;
+
+	for (i = 0; i < COMP_SAMPLE; i++) {
+		if (!(seen[data[i] >> 6] & (1ULL << (data[i] & 63)))) {
+			seen[data[i] >> 6] |= 1ULL << (data[i] & 63);
+			distinct++;
+		}
+	}
+
+	return distinct > COMP_RANDOM_BYTES;
+}
+
+static void backoff_update(comp_backoff_st *b, unsigned success, unsigned limit)
+{
+	unsigned n;
+
+	if (success) {
+		b->fails = 0;
+		return;
+	}
+
+	if (b->fails < 255)
+		b->fails++;
+
+	if (b->fails >= limit) {
+		/* 2, 4, 8, ... packets */
+		n = b->fails - limit + 1;
+		b->skip = n >= 10 ? COMP_MAX_SKIP : (1 << n);
+	}
+}
+
+static unsigned backoff_skip(comp_backoff_st *b)
+{
+	if (b->skip == 0)
+		return 0;
+	b->skip--;
+	return 1;
+}
+
+/* Returns non-zero if the packet @pkt of size @len should be
+ * compressed. In that case the result must be passed to
+ * comp_policy_update(). */
+unsigned comp_policy_check(comp_policy_st *p, const uint8_t *pkt, unsigned len)
+{
+	pkt_info_st info;
+	comp_flow_st *flow;
+
+	p->flow = NULL;
+
+	if (backoff_skip(&p->b))
+		goto skip;
+
+	if (parse_packet(pkt, len, &info) == 0)
+		return 1;
+
+	if (is_encrypted_port(info.sport) || is_encrypted_port(info.dport))
+		goto skip;
+
+	if (info.payload != 0 && looks_random(pkt + info.payload, len - info.payload))
+		goto skip;
+
+	flow = &p->flows[info.key % COMP_FLOWS];
+	if (flow->key != info.key) {
+		/* a new flow, or a collision; either way start over */
+		memset(flow, 0, sizeof(*flow));
+		flow->key = info.key;
+	}
+
+	if (backoff_skip(&flow->b))
+		goto skip;
+
+	p->flow = flow;
+	return 1;
+
+ skip:
+	p->skipped++;
+	return 0;
+}
+
+/* Records the size @clen a packet of size @len was compressed to; a
+ * negative value indicates that compression failed. */
+void comp_policy_update(comp_policy_st *p, unsigned len, int clen)
+{
+	unsigned success = (clen > 0 && (unsigned)clen < len);
+	unsigned sample;
+
+	if (success) {
+		p->hits++;
+		sample = ((uint64_t)clen * COMP_RATIO_ONE) / len;
+	} else {
+		p->misses++;
+		sample = COMP_RATIO_ONE;
+	}
+
+	if (p->ratio == 0)
+		p->ratio = sample;
+	else
+		p->ratio = (p->ratio * 7 + sample) / 8;
+
+	if (p->flow)
+		backoff_update(&p->flow->b, success, COMP_FLOW_FAILS);
+	backoff_update(&p->b, p->ratio <= COMP_POOR_RATIO, COMP_SESSION_FAILS);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef WORKER_COMPRESS_H
+# define WORKER_COMPRESS_H
+
+#include <stdint.h>
+
+/* The number of flows whose compression results are tracked */
+#define COMP_FLOWS 64
+
+/* Compression is no longer tried on a flow after that many
+ * consecutive packets failed to compress, and on the session when
+ * its running ratio is above COMP_POOR_RATIO. */
+#define COMP_FLOW_FAILS 2
+#define COMP_RATIO_ONE 1024
+#define COMP_POOR_RATIO (COMP_RATIO_ONE - COMP_RATIO_ONE/32)
+
+/* The maximum number of packets skipped before trying again */
+#define COMP_MAX_SKIP (1 << 10)
+
+typedef struct comp_backoff_st {
+	uint16_t skip; /* packets to skip */
+	uint8_t fails; /* failed tries since the last success */
+} comp_backoff_st;
+
+typedef struct comp_flow_st {
+	uint32_t key;
+	comp_backoff_st b;
+} comp_flow_st;
+
+/* Decides which packets of a session are worth compressing */
+typedef struct comp_policy_st {
+	comp_flow_st flows[COMP_FLOWS];
+	comp_flow_st *flow; /* the flow of the packet being compressed */
+
+	comp_backoff_st b;
+	/* running ratio of the compressed to the plain size, in
+	 * COMP_RATIO_ONE units; zero before the first packet */
+	unsigned ratio;
+
+	uint64_t hits; /* packets sent compressed */
+	uint64_t misses; /* packets which did not compress */
+	uint64_t skipped; /* packets not tried */
+} comp_policy_st;
+
+unsigned comp_policy_check(comp_policy_st *p, const uint8_t *pkt, unsigned len);
+void comp_policy_update(comp_policy_st *p, unsigned len, int clen);
+
+#endif
@@ -144,7 +144,7 @@ int lz4_decompress(void *dst, int dstlen, const void *src, int srclen)
 }
 
 static
-int lz4_compress(void *dst, int dstlen, const void *src, int srclen)
+int lz4_compress(void *ctx, void *dst, int dstlen, const void *src, int srclen)
 {
 	/* we intentionally restrict output to srclen so that
 	 * compression fails early for packets that expand. */
@@ -153,6 +153,17 @@ int lz4_compress(void *dst, int dstlen, const void *src, int srclen)
 #endif
 
 #ifdef ENABLE_COMPRESSION
+/* The tables of the LZS compressor are shared by the sessions of the
+ * process; each packet is compressed on its own, and the sessions of
+ * a pool worker do not switch while compressing one. */
+static struct lzs_state_st lzs_scratch;
+
+static
+int lzs_compress_session(void *ctx, void *dst, int dstlen, const void *src, int srclen)
+{
+	return lzs_compress(&lzs_scratch, dst, dstlen, src, srclen);
+}
+
 struct compression_method_st comp_methods[] = {
 #ifdef HAVE_LZ4
 	{
@@ -167,7 +178,7 @@ struct compression_method_st comp_methods[] = {
 		.id = OC_COMP_LZS,
 		.name = "lzs",
 		.decompress = (decompress_fn)lzs_decompress,
-		.compress = (compress_fn)lzs_compress,
+		.compress = lzs_compress_session,
 		.server_prio = 80,
 	}
 };
@@ -53,6 +53,9 @@ static unsigned recv_from_new_fd(struct worker_st *ws, int fd, UdpFdMsg **tmsg)
 {
 	int saved_fd, ret;
 	UdpFdMsg *saved_tmsg;
+#ifdef ENABLE_DTLS_MMSG
+	dtls_mmsg_st *saved_rx;
+#endif
 
 	/* don't bother with anything if we are on uninitialized state */
 	if (ws->dtls_session == NULL || ws->udp_state != UP_ACTIVE)
@@ -60,6 +63,11 @@ static unsigned recv_from_new_fd(struct worker_st *ws, int fd, UdpFdMsg **tmsg)
 
 	saved_fd = ws->dtls_tptr.fd;
 	saved_tmsg = ws->dtls_tptr.msg;
+#ifdef ENABLE_DTLS_MMSG
+	/* read directly from the new fd */
+	saved_rx = ws->dtls_tptr.rx;
+	ws->dtls_tptr.rx = NULL;
+#endif
 
 	ws->dtls_tptr.msg = *tmsg;
 	ws->dtls_tptr.fd = fd;
@@ -76,6 +84,9 @@ static unsigned recv_from_new_fd(struct worker_st *ws, int fd, UdpFdMsg **tmsg)
  	*tmsg = ws->dtls_tptr.msg;
  	ws->dtls_tptr.fd = saved_fd;
  	ws->dtls_tptr.msg = saved_tmsg;
+#ifdef ENABLE_DTLS_MMSG
+	ws->dtls_tptr.rx = saved_rx;
+#endif
  	return ret;
 }
 
@@ -111,7 +122,8 @@ int handle_commands_from_main(struct worker_st *ws)
 		case CMD_TERMINATE:
 			exit_worker_reason(ws, REASON_SERVER_DISCONNECT);
 		case CMD_UDP_FD: {
-			unsigned has_hello = 1;
+			unsigned has_hello = 1, steered;
+			dtls_peer_st peer;
 
 			if (ws->udp_state != UP_WAIT_FD) {
 				oclog(ws, LOG_DEBUG, "received another a UDP fd!");
@@ -121,6 +133,7 @@ int handle_commands_from_main(struct worker_st *ws)
 			if (tmsg) {
 				has_hello = tmsg->hello;
 			}
+			steered = dtls_peer_init(&peer, tmsg);
 
 			if (fd == -1) {
 				oclog(ws, LOG_ERR, "received UDP fd message of wrong type");
@@ -149,11 +162,18 @@ int handle_commands_from_main(struct worker_st *ws)
 
 			ws->dtls_tptr.msg = tmsg;
 			ws->dtls_tptr.fd = fd;
+			ws->dtls_tptr.steered = steered;
+			ws->dtls_tptr.peer = peer;
+			ws->dtls_tptr.session_id = ws->session_id;
+			ws->dtls_tptr.from_len = 0;
 
 			if (WSCONFIG(ws)->try_mtu == 0)
 				set_mtu_disc(fd, ws->proto, 0);
 
-			oclog(ws, LOG_DEBUG, "received new UDP fd and connected to peer");
+			if (steered)
+				oclog(ws, LOG_DEBUG, "received new UDP fd steered to by the kernel");
+			else
+				oclog(ws, LOG_DEBUG, "received new UDP fd and connected to peer");
 			ws->udp_recv_time = time(0);
 
 			return 0;
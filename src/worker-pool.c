@@ -0,0 +1,799 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This file is part of ocserv.
+ *
+ * ocserv is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ocserv is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A pool worker is a worker process which serves many client sessions.
+ * Each session runs the unmodified worker code (vpn_server()) in its own
+ * coroutine; all the blocking points of that code go through oc_poll(),
+ * which this file replaces with a function that suspends the calling
+ * session and lets an epoll-based scheduler run the others.
+ */
+
+#include <config.h>
+
+#include <gnutls/gnutls.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <vpn.h>
+#include <worker.h>
+#include <common.h>
+#include <system.h>
+#include <ccan/list/list.h>
+#include <pcl.h>
+
+#ifdef __linux__
+# include <sys/epoll.h>
+
+/* The stack of each session; the LZS tables are kept on the heap.
+ * Only the pages touched are backed by memory. */
+#define POOL_STACK_SIZE (512*1024)
+
+#define POOL_MAX_EVENTS 64
+
+/* The number of consecutive waits a session may complete without
+ * being suspended before it has to give way to the other sessions */
+#define POOL_YIELD_BUDGET 32
+
+/* time given to sessions to disconnect on termination (as in handle_term()) */
+#define POOL_TERM_GRACE_MS 2000
+
+typedef struct pool_session_st {
+	struct list_node list;
+	struct list_node run_list;
+	struct worker_st *ws;
+	coroutine_t co;
+	uint32_t id;
+
+	/* the descriptors the session is suspended on */
+	struct pollfd *pfd;
+	nfds_t pfd_size;
+
+	int64_t wake_ms; /* poll timeout; zero if none */
+	int64_t alarm_ms; /* the equivalent of alarm(); zero if none */
+	unsigned heap_idx; /* position in the timer heap plus one; zero if not there */
+
+	unsigned runnable;
+	unsigned budget;
+	unsigned interrupted;
+	unsigned finished;
+} pool_session_st;
+
+static struct {
+	void *ctx;
+	struct worker_st *tmpl;
+	int epfd;
+	int ctl_fd;
+
+	struct list_head sessions;
+	struct list_head run_queue;
+	unsigned total;
+	unsigned terminating;
+
+	/* binary min-heap of the suspended sessions with a timeout */
+	pool_session_st **heap;
+	unsigned heap_size;
+	unsigned heap_max;
+
+	/* the running session, NULL in the scheduler */
+	pool_session_st *current;
+} pool;
+
+static volatile sig_atomic_t pool_terminate = 0;
+
+static void pool_handle_term(int signo)
+{
+	pool_terminate = 1;
+	alarm(5);		/* force exit by SIGALRM */
+}
+
+static void pool_handle_alarm(int signo)
+{
+	_exit(1);
+}
+
+static int64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / (1000 * 1000);
+}
+
+static int64_t timer_key(pool_session_st *sess)
+{
+	if (sess->wake_ms == 0)
+		return sess->alarm_ms;
+	if (sess->alarm_ms == 0)
+		return sess->wake_ms;
+	return (sess->wake_ms < sess->alarm_ms) ? sess->wake_ms : sess->alarm_ms;
+}
+
+static void heap_swap(unsigned a, unsigned b)
+{
+	pool_session_st *t = pool.heap[a];
+
+	pool.heap[a] = pool.heap[b];
+	pool.heap[b] = t;
+	pool.heap[a]->heap_idx = a + 1;
+	pool.heap[b]->heap_idx = b + 1;
+}
+
+static void heap_up(unsigned i)
+{
+	while (i > 0 && timer_key(pool.heap[(i - 1) / 2]) > timer_key(pool.heap[i])) {
+		heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_down(unsigned i)
+{
+	unsigned l, m;
+
+	for (;;) {
+		l = 2 * i + 1;
+		m = i;
+		if (l < pool.heap_size && timer_key(pool.heap[l]) < timer_key(pool.heap[m]))
+			m = l;
+		if (l + 1 < pool.heap_size && timer_key(pool.heap[l + 1]) < timer_key(pool.heap[m]))
+			m = l + 1;
+		if (m == i)
+			return;
+		heap_swap(i, m);
+		i = m;
+	}
+}
+
+static int heap_add(pool_session_st *sess)
+{
+	if (pool.heap_size == pool.heap_max) {
+		pool_session_st **h;
+		unsigned max = pool.heap_max ? pool.heap_max * 2 : 64;
+
+		h = talloc_realloc(pool.ctx, pool.heap, pool_session_st *, max);
+		if (h == NULL)
+			return -1;
+		pool.heap = h;
+		pool.heap_max = max;
+	}
+
+	pool.heap[pool.heap_size] = sess;
+	sess->heap_idx = ++pool.heap_size;
+	heap_up(pool.heap_size - 1);
+	return 0;
+}
+
+static void heap_del(pool_session_st *sess)
+{
+	unsigned i = sess->heap_idx - 1;
+
+	if (sess->heap_idx == 0)
+		return;
+
+	sess->heap_idx = 0;
+	pool.heap_size--;
+	if (i == pool.heap_size)
+		return;
+
+	pool.heap[i] = pool.heap[pool.heap_size];
+	pool.heap[i]->heap_idx = i + 1;
+	heap_up(i);
+	heap_down(pool.heap[i]->heap_idx - 1);
+}
+
+static void session_schedule(pool_session_st *sess)
+{
+	if (sess->runnable || sess->finished)
+		return;
+
+	sess->runnable = 1;
+	list_add_tail(&pool.run_queue, &sess->run_list);
+}
+
+/* Returns control to the scheduler until session_schedule()
+ * is called for this session. */
+static void session_suspend(pool_session_st *sess)
+{
+	co_resume();
+	sess->budget = POOL_YIELD_BUDGET;
+}
+
+static void session_terminate(pool_session_st *sess)
+{
+	int64_t grace = now_ms() + POOL_TERM_GRACE_MS;
+
+	sess->ws->terminate = 1;
+	sess->ws->terminate_reason = REASON_SERVER_DISCONNECT;
+	sess->interrupted = 1;
+	if (sess->alarm_ms == 0 || sess->alarm_ms > grace)
+		sess->alarm_ms = grace;
+	session_schedule(sess);
+}
+
+static uint32_t poll_to_epoll(short events)
+{
+	uint32_t e = 0;
+
+	if (events & POLLIN)
+		e |= EPOLLIN;
+	if (events & POLLOUT)
+		e |= EPOLLOUT;
+	if (events & POLLPRI)
+		e |= EPOLLPRI;
+	return e;
+}
+
+/* The oc_poll() of pool workers. When called by a session it has
+ * poll() semantics but suspends the session instead of blocking.
+ */
+static int pool_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	pool_session_st *sess = pool.current;
+	struct epoll_event ev;
+	nfds_t i;
+	int ret = 0;
+
+	if (sess == NULL)
+		return poll(fds, nfds, timeout);
+
+	if (nfds > 0) {
+		ret = poll(fds, nfds, 0);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (ret > 0 || timeout == 0) {
+		if (sess->budget > 0) {
+			sess->budget--;
+			return ret;
+		}
+
+		/* let the others run before continuing */
+		session_schedule(sess);
+		session_suspend(sess);
+	} else {
+		for (i = 0; i < nfds; i++) {
+			memset(&ev, 0, sizeof(ev));
+			ev.events = poll_to_epoll(fds[i].events);
+			ev.data.ptr = sess;
+			if (epoll_ctl(pool.epfd, EPOLL_CTL_ADD, fds[i].fd, &ev) < 0) {
+				/* cannot wait on it; let poll() below tell */
+				session_schedule(sess);
+			}
+		}
+		sess->pfd = fds;
+		sess->pfd_size = nfds;
+
+		if (timeout > 0)
+			sess->wake_ms = now_ms() + timeout;
+		else
+			sess->wake_ms = 0;
+
+		if (timer_key(sess) != 0 && heap_add(sess) < 0)
+			session_schedule(sess);
+
+		session_suspend(sess);
+
+		heap_del(sess);
+		for (i = 0; i < nfds; i++)
+			epoll_ctl(pool.epfd, EPOLL_CTL_DEL, fds[i].fd, &ev);
+		sess->pfd = NULL;
+		sess->pfd_size = 0;
+		sess->wake_ms = 0;
+	}
+
+	if (sess->alarm_ms != 0 && now_ms() >= sess->alarm_ms) {
+		/* as in handle_alarm() */
+		sess->alarm_ms = 0;
+		exit_worker(sess->ws);
+	}
+
+	if (sess->interrupted) {
+		sess->interrupted = 0;
+		errno = EINTR;
+		return -1;
+	}
+
+	if (nfds == 0)
+		return 0;
+
+	return poll(fds, nfds, 0);
+}
+
+/* Sets (or with zero secs, clears) the session timer which
+ * terminates the worker when it expires. */
+void worker_set_alarm(struct worker_st *ws, unsigned secs)
+{
+	if (ws->pool == NULL) {
+		alarm(secs);
+		return;
+	}
+
+	if (secs == 0)
+		ws->pool->alarm_ms = 0;
+	else
+		ws->pool->alarm_ms = now_ms() + (int64_t)secs * 1000;
+}
+
+/* Receives from a non-blocking socket as a blocking one would; the
+ * receive timeout of the socket (if any) is respected. */
+ssize_t pool_recv(int fd, void *data, size_t size)
+{
+	struct pollfd pfd;
+	struct timeval tv;
+	socklen_t len;
+	int timeout, ret;
+
+	for (;;) {
+		ret = recv(fd, data, size, 0);
+		if (ret >= 0 || errno != EAGAIN)
+			return ret;
+
+		len = sizeof(tv);
+		if (getsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, &len) < 0 ||
+		    (tv.tv_sec == 0 && tv.tv_usec == 0))
+			timeout = -1;
+		else
+			timeout = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		ret = oc_poll(&pfd, 1, timeout);
+		if (ret == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (ret < 0)
+			return ret;
+	}
+}
+
+static ssize_t pool_send(int fd, const void *data, size_t size)
+{
+	struct pollfd pfd;
+	int ret;
+
+	for (;;) {
+		ret = send(fd, data, size, 0);
+		if (ret >= 0 || errno != EAGAIN)
+			return ret;
+
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+
+		ret = oc_poll(&pfd, 1, -1);
+		if (ret < 0)
+			return ret;
+	}
+}
+
+static ssize_t pool_tls_pull(gnutls_transport_ptr_t ptr, void *data, size_t size)
+{
+	return pool_recv((long)ptr, data, size);
+}
+
+static ssize_t pool_tls_push(gnutls_transport_ptr_t ptr, const void *data, size_t size)
+{
+	return pool_send((long)ptr, data, size);
+}
+
+void worker_pool_set_transport(gnutls_session_t session)
+{
+	gnutls_transport_set_pull_function(session, pool_tls_pull);
+	gnutls_transport_set_push_function(session, pool_tls_push);
+}
+
+/* Gives the session a copy of its virtual host configuration,
+ * which the worker is free to modify. */
+int worker_pool_private_config(struct worker_st *ws)
+{
+	struct vhost_cfg_st *vhost;
+	struct cfg_st *config;
+
+	vhost = talloc_memdup(ws, ws->vhost, sizeof(*vhost));
+	if (vhost == NULL)
+		return -1;
+
+	config = talloc_memdup(vhost, ws->vhost->perm_config.config, sizeof(*config));
+	if (config == NULL) {
+		talloc_free(vhost);
+		return -1;
+	}
+
+	vhost->perm_config.config = config;
+	ws->vhost = vhost;
+	return 0;
+}
+
+/* Returns the session being run, or NULL outside the sessions. */
+const void *worker_pool_current(void)
+{
+	return pool.current;
+}
+
+/* Releases everything held by a pool session and switches
+ * back to the scheduler. This is the pool equivalent of exit().
+ */
+void worker_pool_session_exit(struct worker_st *ws)
+{
+	pool_session_st *sess = ws->pool;
+
+	if (ws->session)
+		gnutls_deinit(ws->session);
+	if (ws->dtls_session)
+		gnutls_deinit(ws->dtls_session);
+	if (ws->dtls_tptr.msg)
+		udp_fd_msg__free_unpacked(ws->dtls_tptr.msg, NULL);
+
+	if (ws->conn_fd != -1)
+		close(ws->conn_fd);
+	if (ws->cmd_fd != -1)
+		close(ws->cmd_fd);
+	if (ws->tun_fd != -1)
+		close(ws->tun_fd);
+	if (ws->dtls_tptr.fd != -1)
+		close(ws->dtls_tptr.fd);
+
+	/* the session may be terminated while waiting for sec-mod */
+	tls_key_channel_abandon(sess);
+
+	/* there is no process exit to get rid of any secrets */
+	safe_memset(ws, 0, sizeof(*ws));
+	talloc_free(ws);
+
+	sess->ws = NULL;
+	sess->finished = 1;
+	co_exit();
+}
+
+static void session_main(void *data)
+{
+	pool_session_st *sess = data;
+	struct worker_st *ws = sess->ws;
+	int fd = -1, ret;
+
+	ret = recv_socket_msg(ws, ws->cmd_fd, CMD_POOL_CONN_FD, &fd,
+			      NULL, NULL, DEFAULT_SOCKET_TIMEOUT);
+	if (ret < 0 || fd == -1) {
+		oclog(ws, LOG_ERR, "could not receive the connection of session %u", (unsigned)sess->id);
+		worker_pool_session_exit(ws);
+	}
+	ws->conn_fd = fd;
+
+	vpn_server(ws);
+	worker_pool_session_exit(ws);
+}
+
+static void session_new(const PoolSessionMsg *msg, int cmd_fd)
+{
+	pool_session_st *sess;
+	struct worker_st *ws;
+
+	if (msg->remote_addr.len > sizeof(ws->remote_addr) ||
+	    (msg->has_our_addr && msg->our_addr.len > sizeof(ws->our_addr))) {
+		oclog(pool.tmpl, LOG_ERR, "received invalid session %u", (unsigned)msg->id);
+		goto fail;
+	}
+
+	sess = talloc_zero(pool.ctx, pool_session_st);
+	if (sess == NULL)
+		goto fail;
+
+	ws = talloc_memdup(pool.ctx, pool.tmpl, sizeof(*ws));
+	if (ws == NULL) {
+		talloc_free(sess);
+		goto fail;
+	}
+	talloc_set_name_const(ws, "struct worker_st");
+
+	ws->pool = sess;
+	ws->cmd_fd = cmd_fd;
+	ws->conn_fd = -1;
+	ws->tun_fd = -1;
+	ws->dtls_tptr.fd = -1;
+	ws->conn_type = msg->conn_type;
+
+	memcpy(&ws->remote_addr, msg->remote_addr.data, msg->remote_addr.len);
+	ws->remote_addr_len = msg->remote_addr.len;
+	if (msg->has_our_addr) {
+		memcpy(&ws->our_addr, msg->our_addr.data, msg->our_addr.len);
+		ws->our_addr_len = msg->our_addr.len;
+	}
+
+	sess->ws = ws;
+	sess->id = msg->id;
+	sess->budget = POOL_YIELD_BUDGET;
+	sess->co = co_create(session_main, sess, NULL, POOL_STACK_SIZE);
+	if (sess->co == NULL) {
+		oclog(pool.tmpl, LOG_ERR, "could not allocate session %u", (unsigned)msg->id);
+		talloc_free(ws);
+		talloc_free(sess);
+		goto fail;
+	}
+
+	list_add_tail(&pool.sessions, &sess->list);
+	pool.total++;
+
+	if (pool.terminating)
+		session_terminate(sess);
+	else
+		session_schedule(sess);
+	return;
+
+ fail:
+	close(cmd_fd);
+}
+
+static void handle_ctl(void)
+{
+	uint8_t cmd;
+	uint8_t buf[1024];
+	int ret, fd = -1;
+	pool_session_st *sess;
+	PoolSessionMsg *smsg;
+	PoolTerminateMsg *tmsg;
+
+	ret = recv_msg_data(pool.ctl_fd, &cmd, buf, sizeof(buf), &fd);
+	if (ret < 0) {
+		if (ret != ERR_PEER_TERMINATED)
+			oclog(pool.tmpl, LOG_ERR, "error receiving command from main");
+		/* no more sessions are coming */
+		epoll_ctl(pool.epfd, EPOLL_CTL_DEL, pool.ctl_fd, NULL);
+		close(pool.ctl_fd);
+		pool.ctl_fd = -1;
+		return;
+	}
+
+	switch (cmd) {
+	case CMD_POOL_SESSION:
+		smsg = pool_session_msg__unpack(NULL, ret, buf);
+		if (smsg == NULL || fd == -1) {
+			oclog(pool.tmpl, LOG_ERR, "error unpacking pool session message");
+			if (smsg)
+				pool_session_msg__free_unpacked(smsg, NULL);
+			goto fail;
+		}
+		session_new(smsg, fd);
+		pool_session_msg__free_unpacked(smsg, NULL);
+		return;
+	case CMD_POOL_TERMINATE:
+		tmsg = pool_terminate_msg__unpack(NULL, ret, buf);
+		if (tmsg == NULL) {
+			oclog(pool.tmpl, LOG_ERR, "error unpacking pool terminate message");
+			goto fail;
+		}
+		list_for_each(&pool.sessions, sess, list) {
+			if (sess->id == tmsg->id && !sess->finished) {
+				session_terminate(sess);
+				break;
+			}
+		}
+		pool_terminate_msg__free_unpacked(tmsg, NULL);
+		break;
+	default:
+		oclog(pool.tmpl, LOG_ERR, "unknown CMD 0x%x", (unsigned)cmd);
+		break;
+	}
+
+ fail:
+	if (fd != -1)
+		close(fd);
+}
+
+static void run_sessions(void)
+{
+	pool_session_st *sess;
+	unsigned n = 0;
+
+	/* sessions which become runnable while running this
+	 * round are left for the next one, after epoll */
+	list_for_each(&pool.run_queue, sess, run_list)
+		n++;
+
+	while (n-- > 0) {
+		sess = list_top(&pool.run_queue, pool_session_st, run_list);
+		list_del(&sess->run_list);
+		sess->runnable = 0;
+
+		pool.current = sess;
+		co_call(sess->co);
+		pool.current = NULL;
+
+		if (sess->finished) {
+			if (sess->runnable)
+				list_del(&sess->run_list);
+			heap_del(sess);
+			list_del(&sess->list);
+			pool.total--;
+			talloc_free(sess);
+		}
+	}
+}
+
+static void expire_timers(void)
+{
+	int64_t now = now_ms();
+	pool_session_st *sess;
+
+	while (pool.heap_size > 0 && timer_key(pool.heap[0]) <= now) {
+		sess = pool.heap[0];
+		heap_del(sess);
+		session_schedule(sess);
+	}
+}
+
+/* worker_pool_server:
+ * @ws: a worker structure initialized as for vpn_server(); it is
+ *   used as the template of every session of the pool.
+ * @ctl_fd: the socket main sends new sessions to
+ *
+ * This is the main loop of a pool worker process. It is executed
+ * by the main server after fork and drop of privileges, and never
+ * returns.
+ */
+void worker_pool_server(struct worker_st *ws, int ctl_fd)
+{
+	struct epoll_event ev, events[POOL_MAX_EVENTS];
+	pool_session_st *sess;
+	int n, i, timeout, ret;
+
+	ocsigaltstack(ws);
+
+	ocsignal(SIGTERM, pool_handle_term);
+	ocsignal(SIGINT, pool_handle_term);
+	ocsignal(SIGHUP, SIG_IGN);
+	ocsignal(SIGALRM, pool_handle_alarm);
+
+	memset(&pool, 0, sizeof(pool));
+	pool.ctx = talloc_named(NULL, 0, "worker pool");
+	pool.tmpl = ws;
+	pool.ctl_fd = ctl_fd;
+	list_head_init(&pool.sessions);
+	list_head_init(&pool.run_queue);
+
+	/* the template is not a session */
+	ws->cmd_fd = -1;
+	ws->conn_fd = -1;
+	ws->tun_fd = -1;
+	ws->dtls_tptr.fd = -1;
+	ws->remote_addr_len = 0;
+	ws->our_addr_len = 0;
+	ws->remote_ip_str[0] = 0;
+
+	pool.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (pool.epfd == -1) {
+		int e = errno;
+		oclog(ws, LOG_ERR, "epoll_create1: %s", strerror(e));
+		exit(1);
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(pool.epfd, EPOLL_CTL_ADD, ctl_fd, &ev) < 0) {
+		int e = errno;
+		oclog(ws, LOG_ERR, "epoll_ctl: %s", strerror(e));
+		exit(1);
+	}
+
+	/* do not allow this process to be traced. That
+	 * prevents worker processes tracing each other. */
+	if (GETPCONFIG(ws)->debug == 0)
+		pr_set_undumpable("worker");
+	if (GETCONFIG(ws)->isolate != 0) {
+		ret = disable_system_calls(ws);
+		if (ret < 0) {
+			oclog(ws, LOG_INFO,
+			      "could not disable system calls, kernel might not support seccomp");
+		}
+	}
+
+	oc_poll = pool_poll;
+
+	for (;;) {
+		if (pool_terminate && !pool.terminating) {
+			pool.terminating = 1;
+			list_for_each(&pool.sessions, sess, list)
+				session_terminate(sess);
+		}
+
+		run_sessions();
+
+		if (pool.total == 0 && (pool.ctl_fd == -1 || pool.terminating))
+			break;
+
+		if (!list_empty(&pool.run_queue))
+			timeout = 0;
+		else if (pool.heap_size > 0) {
+			int64_t d = timer_key(pool.heap[0]) - now_ms();
+			timeout = (d < 0) ? 0 : (d > 60*1000 ? 60*1000 : (int)d);
+		} else
+			timeout = -1;
+
+		n = epoll_wait(pool.epfd, events, POOL_MAX_EVENTS, timeout);
+		if (n < 0) {
+			int e = errno;
+			if (e == EINTR)
+				continue;
+			oclog(ws, LOG_ERR, "epoll_wait: %s", strerror(e));
+			exit(1);
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL)
+				handle_ctl();
+			else
+				session_schedule(events[i].data.ptr);
+		}
+
+		expire_timers();
+	}
+
+	exit(0);
+}
+
+#else
+
+void worker_set_alarm(struct worker_st *ws, unsigned secs)
+{
+	alarm(secs);
+}
+
+ssize_t pool_recv(int fd, void *data, size_t size)
+{
+	return recv(fd, data, size, 0);
+}
+
+void worker_pool_set_transport(gnutls_session_t session)
+{
+}
+
+void worker_pool_session_exit(struct worker_st *ws)
+{
+	_exit(1);
+}
+
+const void *worker_pool_current(void)
+{
+	return NULL;
+}
+
+int worker_pool_private_config(struct worker_st *ws)
+{
+	return 0;
+}
+
+void worker_pool_server(struct worker_st *ws, int ctl_fd)
+{
+	oclog(ws, LOG_ERR, "worker pools are not supported on this system");
+	exit(1);
+}
+
+#endif
@@ -72,6 +72,10 @@ int disable_system_calls(struct worker_st *ws)
 #endif
 	ADD_SYSCALL(recvmsg, 0);
 	ADD_SYSCALL(sendmsg, 0);
+#ifdef ENABLE_DTLS_MMSG
+	ADD_SYSCALL(recvmmsg, 0);
+	ADD_SYSCALL(sendmmsg, 0);
+#endif
 
 	ADD_SYSCALL(read, 0);
 
@@ -107,6 +111,19 @@ int disable_system_calls(struct worker_st *ws)
 	ADD_SYSCALL(getsockopt, 0);
 	ADD_SYSCALL(setsockopt, 0);
 
+	/* a pool worker multiplexes its sessions with epoll and
+	 * allocates a stack for each new session */
+	if (GETPCONFIG(ws)->worker_pool_size > 0) {
+		ADD_SYSCALL(epoll_wait, 0);
+		ADD_SYSCALL(epoll_pwait, 0);
+		ADD_SYSCALL(epoll_ctl, 0);
+		ADD_SYSCALL(fcntl, 0);
+		ADD_SYSCALL(mmap, 0);
+		ADD_SYSCALL(munmap, 0);
+		ADD_SYSCALL(mremap, 0);
+		ADD_SYSCALL(madvise, 0);
+	}
+
 	/* we need to open files when we have an xml_config_file setup on any vhost */
 	list_for_each(ws->vconfig, vhost, list) {
 		if (vhost->perm_config.config->xml_config_file) {
@@ -36,6 +36,7 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <system.h>
 #include <time.h>
@@ -55,6 +56,7 @@
 #include <vpn.h>
 #include "ipc.pb-c.h"
 #include <worker.h>
+#include <lat-hist.h>
 #include <tlslib.h>
 
 #include <http_parser.h>
@@ -83,9 +85,6 @@
 
 struct worker_st *global_ws = NULL;
 
-static int terminate = 0;
-static int terminate_reason = REASON_SERVER_DISCONNECT;
-
 static int parse_cstp_data(struct worker_st *ws, uint8_t * buf, size_t buf_size,
 			   time_t);
 static int parse_dtls_data(struct worker_st *ws, uint8_t * buf, size_t buf_size,
@@ -107,8 +106,10 @@ static void handle_alarm(int signo)
 
 static void handle_term(int signo)
 {
-	terminate = 1;
-	terminate_reason = REASON_SERVER_DISCONNECT;
+	if (global_ws) {
+		global_ws->terminate = 1;
+		global_ws->terminate_reason = REASON_SERVER_DISCONNECT;
+	}
 	alarm(2);		/* force exit by SIGALRM */
 }
 
@@ -125,7 +126,7 @@ int tls_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms)
 	pfd.events = POLLIN;
 	pfd.revents = 0;
 
-	ret = poll(&pfd, 1, ms);
+	ret = oc_poll(&pfd, 1, ms);
 	if (ret <= 0)
 		return ret;
 
@@ -137,9 +138,150 @@ inline static ssize_t dtls_pull_buffer_non_empty(gnutls_transport_ptr_t ptr)
 	dtls_transport_ptr *p = ptr;
 	if (p->msg)
 		return 1;
+#ifdef ENABLE_DTLS_MMSG
+	if (p->rx && p->rx->pos < p->rx->count)
+		return 1;
+#endif
 	return 0;
 }
 
+/* A client hello is not sent to an established session, unless the
+ * client restarts it; one received this soon after the handshake is
+ * taken as a retransmission */
+#define DTLS_HELLO_RESTART_TIME 3
+
+#define DTLS_HELLO_SESSION_ID_POS 59
+#define DTLS_HELLO_SESSION_ID_SIZE 32
+
+/* A client hello of the session on a steered socket restarts it, as
+ * when main passes a socket with a hello; that is kept in msg. Returns
+ * non-zero if the datagram was consumed. */
+static unsigned dtls_steered_hello(dtls_transport_ptr *p, const uint8_t *data, size_t size)
+{
+	UdpFdMsg *msg;
+
+	if (p->established == 0 || size < DTLS_HELLO_SESSION_ID_POS + 1 + DTLS_HELLO_SESSION_ID_SIZE ||
+	    data[0] != 22 || data[3] != 0 || data[4] != 0 || data[13] != 1)
+		return 0;
+
+	/* one of another session, or a retransmission */
+	if (data[DTLS_HELLO_SESSION_ID_POS] != DTLS_HELLO_SESSION_ID_SIZE ||
+	    memcmp(&data[DTLS_HELLO_SESSION_ID_POS + 1], p->session_id, DTLS_HELLO_SESSION_ID_SIZE) != 0 ||
+	    time(0) - p->established < DTLS_HELLO_RESTART_TIME)
+		return 1;
+
+	msg = malloc(sizeof(*msg));
+	if (msg == NULL)
+		return 1;
+	udp_fd_msg__init(msg);
+
+	msg->data.data = malloc(size);
+	if (msg->data.data == NULL) {
+		free(msg);
+		return 1;
+	}
+	memcpy(msg->data.data, data, size);
+	msg->data.len = size;
+
+	if (p->msg)
+		udp_fd_msg__free_unpacked(p->msg, NULL);
+	p->msg = msg;
+	p->new_hello = 1;
+
+	memcpy(&p->peer.addr, &p->from, p->from_len);
+	p->peer.addr_len = p->from_len;
+	return 1;
+}
+
+/* Sends a datagram on a steered socket */
+static ssize_t dtls_sendto(dtls_transport_ptr *p, const void *data, size_t size)
+{
+	struct msghdr msg;
+	struct iovec iov;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *)data;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_name = &p->peer.addr;
+	msg.msg_namelen = p->peer.addr_len;
+	if (p->peer.src_len > 0) {
+		msg.msg_control = p->peer.src.buf;
+		msg.msg_controllen = p->peer.src_len;
+	}
+
+	return sendmsg(p->fd, &msg, 0);
+}
+
+/* Reads the client of a socket passed by main that is not connected;
+ * returns zero if the socket is connected */
+unsigned dtls_peer_init(dtls_peer_st *peer, const UdpFdMsg *msg)
+{
+	struct sockaddr_storage our;
+	struct cmsghdr *cmsg = (struct cmsghdr *)peer->src.buf;
+
+	memset(peer, 0, sizeof(*peer));
+	if (msg == NULL || !msg->has_peer_addr || msg->peer_addr.len > sizeof(peer->addr))
+		return 0;
+
+	memcpy(&peer->addr, msg->peer_addr.data, msg->peer_addr.len);
+	peer->addr_len = msg->peer_addr.len;
+
+	/* the socket may be bound to any address */
+	if (!msg->has_our_addr || msg->our_addr.len > sizeof(our))
+		return 1;
+
+	memset(&our, 0, sizeof(our));
+	memcpy(&our, msg->our_addr.data, msg->our_addr.len);
+
+#if defined(IP_PKTINFO)
+	if (our.ss_family == AF_INET) {
+		struct in_pktinfo pi;
+
+		memset(&pi, 0, sizeof(pi));
+		pi.ipi_spec_dst = ((struct sockaddr_in *)&our)->sin_addr;
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(pi));
+		memcpy(CMSG_DATA(cmsg), &pi, sizeof(pi));
+		peer->src_len = CMSG_SPACE(sizeof(pi));
+	}
+#endif
+#if defined(IPV6_PKTINFO)
+	if (our.ss_family == AF_INET6) {
+		struct in6_pktinfo pi;
+
+		memset(&pi, 0, sizeof(pi));
+		pi.ipi6_addr = ((struct sockaddr_in6 *)&our)->sin6_addr;
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(pi));
+		memcpy(CMSG_DATA(cmsg), &pi, sizeof(pi));
+		peer->src_len = CMSG_SPACE(sizeof(pi));
+	}
+#endif
+	return 1;
+}
+
+/* The peer of a steered socket moves to the source of a record that
+ * was decrypted, e.g., after a NAT rebinding */
+static void dtls_peer_update(worker_st *ws)
+{
+	dtls_transport_ptr *p = &ws->dtls_tptr;
+	char buf[64];
+
+	if (p->from_len == 0 || (p->from_len == p->peer.addr_len &&
+	    memcmp(&p->from, &p->peer.addr, p->from_len) == 0))
+		return;
+
+	memcpy(&p->peer.addr, &p->from, p->from_len);
+	p->peer.addr_len = p->from_len;
+
+	oclog(ws, LOG_DEBUG, "DTLS peer changed to %s",
+	      human_addr((struct sockaddr *)&p->peer.addr, p->peer.addr_len, buf, sizeof(buf)));
+}
+
 static
 ssize_t dtls_pull(gnutls_transport_ptr_t ptr, void *data, size_t size)
 {
@@ -156,6 +298,59 @@ ssize_t dtls_pull(gnutls_transport_ptr_t ptr, void *data, size_t size)
 		p->msg = NULL;
 		return need;
 	}
+#ifdef ENABLE_DTLS_MMSG
+	if (p->rx) {
+		dtls_mmsg_st *rx = p->rx;
+		ssize_t need;
+		int ret;
+
+		if (rx->pos == rx->count) {
+			unsigned i;
+
+			rx->pos = rx->count = 0;
+
+			for (i = 0; p->steered && i < MAX_DTLS_BATCH; i++) {
+				rx->msgs[i].msg_hdr.msg_name = &rx->addr[i];
+				rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->addr[i]);
+			}
+
+			ret = recvmmsg(p->fd, rx->msgs, MAX_DTLS_BATCH, MSG_WAITFORONE, NULL);
+			if (ret <= 0)
+				return ret;
+			rx->count = ret;
+		}
+
+		need = rx->msgs[rx->pos].msg_len;
+		if (need > size) {
+			need = size;
+		}
+		memcpy(data, rx->iov[rx->pos].iov_base, need);
+
+		if (p->steered) {
+			p->from_len = rx->msgs[rx->pos].msg_hdr.msg_namelen;
+			memcpy(&p->from, &rx->addr[rx->pos], p->from_len);
+			if (dtls_steered_hello(p, data, need)) {
+				rx->pos++;
+				errno = EAGAIN;
+				return -1;
+			}
+		}
+
+		rx->pos++;
+		return need;
+	}
+#endif
+	if (p->steered) {
+		ssize_t ret;
+
+		p->from_len = sizeof(p->from);
+		ret = recvfrom(p->fd, data, size, 0, (struct sockaddr *)&p->from, &p->from_len);
+		if (ret > 0 && dtls_steered_hello(p, data, ret)) {
+			errno = EAGAIN;
+			return -1;
+		}
+		return ret;
+	}
 	return recv(p->fd, data, size, 0);
 }
 
@@ -175,18 +370,224 @@ int dtls_pull_timeout(gnutls_transport_ptr_t ptr, unsigned int ms)
 	pfd.events = POLLIN;
 	pfd.revents = 0;
 
-	ret = poll(&pfd, 1, ms);
+	ret = oc_poll(&pfd, 1, ms);
 	if (ret <= 0)
 		return ret;
 
 	return ret;
 }
 
+#ifdef ENABLE_DTLS_MMSG
+static dtls_mmsg_st *dtls_mmsg_new(worker_st *ws, unsigned slot_size)
+{
+	dtls_mmsg_st *m;
+	unsigned i;
+
+	m = talloc_zero(ws, dtls_mmsg_st);
+	if (m == NULL)
+		return NULL;
+
+	m->data = talloc_size(m, MAX_DTLS_BATCH * slot_size);
+	if (m->data == NULL) {
+		talloc_free(m);
+		return NULL;
+	}
+	m->slot_size = slot_size;
+
+	for (i = 0; i < MAX_DTLS_BATCH; i++) {
+		m->iov[i].iov_base = m->data + i * slot_size;
+		m->iov[i].iov_len = slot_size;
+		m->msgs[i].msg_hdr.msg_iov = &m->iov[i];
+		m->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return m;
+}
+
+# ifdef UDP_SEGMENT
+/* Sends all the queued records as a single UDP GSO super-packet. That
+ * is only possible when all records but the last have the same size.
+ *
+ * Returns 1 if sent, 0 if the batch is not suitable and -1 on error.
+ */
+static int dtls_tx_send_gso(dtls_transport_ptr *p)
+{
+	dtls_mmsg_st *tx = p->tx;
+	size_t seg = tx->iov[0].iov_len;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(uint16_t)) + sizeof(p->peer.src.buf)];
+		struct cmsghdr align;
+	} u;
+	uint16_t gso_size;
+	unsigned i;
+
+	if (seg * tx->count > 65000)
+		return 0;
+
+	for (i = 1; i < tx->count; i++) {
+		if (tx->iov[i].iov_len > seg ||
+		    (tx->iov[i].iov_len < seg && i != tx->count - 1))
+			return 0;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&u, 0, sizeof(u));
+	msg.msg_iov = tx->iov;
+	msg.msg_iovlen = tx->count;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+	gso_size = seg;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = IPPROTO_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+	memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+
+	if (p->steered) {
+		msg.msg_name = &p->peer.addr;
+		msg.msg_namelen = p->peer.addr_len;
+		memcpy(u.buf + msg.msg_controllen, p->peer.src.buf, p->peer.src_len);
+		msg.msg_controllen += p->peer.src_len;
+	}
+
+	if (sendmsg(p->fd, &msg, 0) < 0)
+		return -1;
+
+	return 1;
+}
+# endif
+
+/* Sends the records queued in the tx batch, as a GSO super-packet
+ * if possible, or otherwise with sendmmsg(). As with any UDP socket,
+ * datagrams that do not fit in the socket buffer after a short wait are
+ * dropped.
+ */
+static int dtls_tx_flush(dtls_transport_ptr *p)
+{
+	dtls_mmsg_st *tx = p->tx;
+	unsigned start = 0, retries = 0;
+	struct pollfd pfd;
+	int ret, e;
+
+	if (tx == NULL || tx->count == 0)
+		return 0;
+
+	if (p->steered) {
+		unsigned i;
+
+		for (i = 0; i < tx->count; i++) {
+			tx->msgs[i].msg_hdr.msg_name = &p->peer.addr;
+			tx->msgs[i].msg_hdr.msg_namelen = p->peer.addr_len;
+			tx->msgs[i].msg_hdr.msg_control = p->peer.src_len ? p->peer.src.buf : NULL;
+			tx->msgs[i].msg_hdr.msg_controllen = p->peer.src_len;
+		}
+	}
+
+# ifdef UDP_SEGMENT
+	if (p->no_gso == 0 && tx->count > 1) {
+		ret = dtls_tx_send_gso(p);
+		if (ret > 0)
+			goto finish;
+
+		if (ret < 0) {
+			e = errno;
+			/* the kernel or the device cannot segment; the
+			 * other errors may be transient */
+			if (e == EINVAL || e == EOPNOTSUPP || e == EIO)
+				p->no_gso = 1;
+		}
+	}
+# endif
+
+	while (start < tx->count) {
+		ret = sendmmsg(p->fd, &tx->msgs[start], tx->count - start, 0);
+		if (ret < 0) {
+			e = errno;
+			if (e == EINTR)
+				continue;
+
+			if (e == EAGAIN || e == EWOULDBLOCK || e == ENOBUFS) {
+				if (retries++ >= 5)
+					break;
+
+				pfd.fd = p->fd;
+				pfd.events = POLLOUT;
+				pfd.revents = 0;
+				oc_poll(&pfd, 1, 20);
+				continue;
+			}
+
+			if (e == EMSGSIZE) {
+				start++;
+				continue;
+			}
+
+			tx->count = 0;
+			errno = e;
+			return -1;
+		}
+		start += ret;
+	}
+
+ finish:
+	tx->count = 0;
+	return 0;
+}
+
+/* While corked, the DTLS records produced by a tun burst are queued
+ * instead of being sent with a system call each.
+ */
+static void dtls_cork(worker_st *ws)
+{
+	if (ws->dtls_tptr.tx != NULL)
+		ws->dtls_tptr.corked = 1;
+}
+
+static int dtls_uncork(worker_st *ws)
+{
+	ws->dtls_tptr.corked = 0;
+	return dtls_tx_flush(&ws->dtls_tptr);
+}
+#else
+static void dtls_cork(worker_st *ws)
+{
+	return;
+}
+
+static int dtls_uncork(worker_st *ws)
+{
+	return 0;
+}
+#endif
+
 static
 ssize_t dtls_push(gnutls_transport_ptr_t ptr, const void *data, size_t size)
 {
 	dtls_transport_ptr *p = ptr;
 
+#ifdef ENABLE_DTLS_MMSG
+	if (p->corked) {
+		dtls_mmsg_st *tx = p->tx;
+
+		if (tx->count == MAX_DTLS_BATCH || size > tx->slot_size) {
+			/* keep the records in order */
+			if (dtls_tx_flush(p) < 0)
+				return -1;
+		}
+
+		if (size <= tx->slot_size) {
+			memcpy(tx->iov[tx->count].iov_base, data, size);
+			tx->iov[tx->count].iov_len = size;
+			tx->count++;
+			return size;
+		}
+	}
+#endif
+	if (p->steered)
+		return dtls_sendto(p, data, size);
 	return send(p->fd, data, size, 0);
 }
 
@@ -370,6 +771,8 @@ static int setup_dtls_connection(struct worker_st *ws)
 	gnutls_dtls_set_timeouts(session, 400, 60*1000);
 
 	ws->udp_state = UP_HANDSHAKE;
+	ws->dtls_tptr.established = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ws->dtls_hsk_start);
 
 	/* Setup the fd settings */
 	if (WSCONFIG(ws)->output_buffer > 0) {
@@ -387,6 +790,13 @@ static int setup_dtls_connection(struct worker_st *ws)
 	/* reset MTU */
 	link_mtu_set(ws, ws->adv_link_mtu);
 
+#ifdef ENABLE_DTLS_MMSG
+	if (ws->dtls_tptr.rx == NULL)
+		ws->dtls_tptr.rx = dtls_mmsg_new(ws, MAX(ws->adv_link_mtu, 1500));
+	if (ws->dtls_tptr.tx == NULL)
+		ws->dtls_tptr.tx = dtls_mmsg_new(ws, MAX(ws->adv_link_mtu, 1500));
+#endif
+
 	ws->dtls_session = session;
 
 	return 0;
@@ -435,6 +845,10 @@ void ws_add_score_to_ip(worker_st *ws, unsigned points, unsigned final)
 
 	if (final ==0 && reply->reply != AUTH__REP__OK) {
 		/* we have exceeded the maximum score */
+		if (ws->pool) {
+			ws->ban_points = 0;
+			exit_worker(ws);
+		}
 		exit(1);
 	}
 
@@ -443,6 +857,37 @@ void ws_add_score_to_ip(worker_st *ws, unsigned points, unsigned final)
 	return;
 }
 
+/* Publishes the counters of the session in its slot, where main and
+ * sec-mod read them. */
+static void publish_stats(worker_st * ws, time_t now)
+{
+	session_stats_st st;
+
+	if (ws->stats_slot == NULL)
+		return;
+
+	memset(&st, 0, sizeof(st));
+	st.bytes_in = ws->tun_bytes_in;
+	st.bytes_out = ws->tun_bytes_out;
+	st.packets_in = ws->tun_packets_in;
+	st.packets_out = ws->tun_packets_out;
+	st.drops = ws->tun_drops;
+	st.comp_hits = ws->comp_policy.hits;
+	st.comp_misses = ws->comp_policy.misses;
+	st.comp_skipped = ws->comp_policy.skipped;
+	st.comp_ratio = ws->comp_policy.ratio;
+	if (ws->link_mtu > 0)
+		st.mtu = DATA_MTU(ws, ws->link_mtu);
+	st.udp_state = ws->udp_state;
+	st.tcp_rtt_us = ws->tcp_rtt_us;
+	st.dtls_rtt_us = ws->dtls_rtt_us;
+	st.uptime = now - ws->session_start_time;
+
+	/* main has ended the session and reassigns the slot */
+	if (session_stats_write(ws->stats_slot, ws->stats_gen, &st) < 0)
+		ws->stats_slot = NULL;
+}
+
 void send_stats_to_secmod(worker_st * ws, time_t now, unsigned discon_reason)
 {
 	CliStatsMsg msg = CLI_STATS_MSG__INIT;
@@ -471,6 +916,15 @@ void send_stats_to_secmod(worker_st * ws, time_t now, unsigned discon_reason)
 		msg.ipv4 = ws->vinfo.ipv4;
 		msg.ipv6 = ws->vinfo.ipv6;
 
+		if (ws->dtls_selected_comp != NULL || ws->cstp_selected_comp != NULL) {
+			msg.comp_hits = ws->comp_policy.hits;
+			msg.has_comp_hits = 1;
+			msg.comp_misses = ws->comp_policy.misses;
+			msg.has_comp_misses = 1;
+			msg.comp_skipped = ws->comp_policy.skipped;
+			msg.has_comp_skipped = 1;
+		}
+
 		ret = send_msg_to_secmod(ws, sd, CMD_SEC_CLI_STATS, &msg,
 				 (pack_size_func)cli_stats_msg__get_packed_size,
 				 (pack_func) cli_stats_msg__pack);
@@ -502,12 +956,16 @@ void exit_worker_reason(worker_st * ws, unsigned reason)
 {
 	/* send statistics to parent */
 	if (ws->auth_state == S_AUTH_COMPLETE) {
+		publish_stats(ws, time(0));
 		send_stats_to_secmod(ws, time(0), reason);
 	}
 
 	if (ws->ban_points > 0)
 		ws_add_score_to_ip(ws, 0, 1);
 
+	if (ws->pool)
+		worker_pool_session_exit(ws);
+
 	talloc_free(ws->main_pool);
 	closelog();
 	_exit(1);
@@ -542,10 +1000,10 @@ void exit_worker_reason(worker_st * ws, unsigned reason)
 	ret = \
 	    gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, \
 				   WSCREDS(ws)->xcred); \
-	GNUTLS_FATAL_ERR(ret); \
+	GNUTLS_FATAL_ERR_CMD(ret, exit_worker(ws)); \
 	gnutls_certificate_server_set_request(session, WSCONFIG(ws)->cert_req); \
 	ret = gnutls_priority_set(session, WSCREDS(ws)->cprio); \
-	GNUTLS_FATAL_ERR(ret); \
+	GNUTLS_FATAL_ERR_CMD(ret, exit_worker(ws)); \
 	gnutls_db_set_cache_expiration(session, TLS_SESSION_EXPIRATION_TIME(WSCONFIG(ws)))
 
 /* Parse the TLS client hello to figure vhost */
@@ -714,28 +1172,33 @@ void vpn_server(struct worker_st *ws)
 	url_handler_fn fn;
 	int requests_left = MAX_HTTP_REQUESTS;
 
-	ocsigaltstack(ws);
+	/* a pool worker has set up the process in worker_pool_server() */
+	if (ws->pool == NULL) {
+		ocsigaltstack(ws);
 
-	ocsignal(SIGTERM, handle_term);
-	ocsignal(SIGINT, handle_term);
-	ocsignal(SIGHUP, SIG_IGN);
-	ocsignal(SIGALRM, handle_alarm);
+		ocsignal(SIGTERM, handle_term);
+		ocsignal(SIGINT, handle_term);
+		ocsignal(SIGHUP, SIG_IGN);
+		ocsignal(SIGALRM, handle_alarm);
 
-	global_ws = ws;
-	if (GETCONFIG(ws)->auth_timeout)
-		alarm(GETCONFIG(ws)->auth_timeout);
-
-	/* do not allow this process to be traced. That
-	 * prevents worker processes tracing each other. */
-	if (GETPCONFIG(ws)->debug == 0)
-		pr_set_undumpable("worker");
-	if (GETCONFIG(ws)->isolate != 0) {
-		ret = disable_system_calls(ws);
-		if (ret < 0) {
-			oclog(ws, LOG_INFO,
-			      "could not disable system calls, kernel might not support seccomp");
+		global_ws = ws;
+
+		/* do not allow this process to be traced. That
+		 * prevents worker processes tracing each other. */
+		if (GETPCONFIG(ws)->debug == 0)
+			pr_set_undumpable("worker");
+		if (GETCONFIG(ws)->isolate != 0) {
+			ret = disable_system_calls(ws);
+			if (ret < 0) {
+				oclog(ws, LOG_INFO,
+				      "could not disable system calls, kernel might not support seccomp");
+			}
 		}
 	}
+
+	if (GETCONFIG(ws)->auth_timeout)
+		worker_set_alarm(ws, GETCONFIG(ws)->auth_timeout);
+
 	ws->session_start_time = time(0);
 
 	if (ws->remote_addr_len == sizeof(struct sockaddr_in))
@@ -755,6 +1218,10 @@ void vpn_server(struct worker_st *ws)
 		oclog(ws, LOG_DEBUG, "accepted connection");
 	}
 
+	/* sessions of a pool worker must not block the process */
+	if (ws->pool)
+		set_non_block(ws->conn_fd);
+
 	if (ws->conn_type != SOCK_TYPE_UNIX) {
 		/* ws->vhost is being assigned in gnutls_handshake()
 		 * after client hello is received. We set temporarily a value
@@ -763,10 +1230,11 @@ void vpn_server(struct worker_st *ws)
 
 		/* initialize the session */
 		ret = gnutls_init(&session, GNUTLS_SERVER);
-		GNUTLS_FATAL_ERR(ret);
+		GNUTLS_FATAL_ERR_CMD(ret, exit_worker(ws));
+		ws->session = session;
 
 		ret = gnutls_priority_set(session, WSCREDS(ws)->cprio);
-		GNUTLS_FATAL_ERR(ret);
+		GNUTLS_FATAL_ERR_CMD(ret, exit_worker(ws));
 		gnutls_session_set_ptr(session, ws);
 
 		/* if we have a single vhost, avoid going through a callback to set credentials. */
@@ -783,16 +1251,24 @@ void vpn_server(struct worker_st *ws)
 
 		gnutls_transport_set_ptr(session,
 				 (gnutls_transport_ptr_t) (long)ws->conn_fd);
+		if (ws->pool)
+			worker_pool_set_transport(session);
 
 		set_resume_db_funcs(session);
 		gnutls_db_set_ptr(session, ws);
 
 		gnutls_handshake_set_timeout(session, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
 		gnutls_transport_set_pull_timeout_function(session, tls_pull_timeout);
+		clock_gettime(CLOCK_MONOTONIC, &ws->tls_hsk_start);
 		do {
 			ret = gnutls_handshake(session);
 		} while (ret < 0 && gnutls_error_is_fatal(ret) == 0);
-		GNUTLS_FATAL_ERR(ret);
+		GNUTLS_FATAL_ERR_CMD(ret, exit_worker(ws));
+		ws->tls_hsk_us = lat_hist_elapsed(&ws->tls_hsk_start);
+
+		/* a pool worker keeps it for the handshakes of its other sessions */
+		if (ws->pool == NULL)
+			tls_key_channel_close();
 
 		oclog(ws, LOG_DEBUG, "TLS handshake completed");
 	} else {
@@ -801,6 +1277,16 @@ void vpn_server(struct worker_st *ws)
 		oclog(ws, LOG_DEBUG, "Accepted unix connection");
 	}
 
+	if (ws->pool) {
+		/* the configuration is adjusted per client below; the
+		 * sessions of a pool worker must not share these changes */
+		ret = worker_pool_private_config(ws);
+		if (ret < 0) {
+			oclog(ws, LOG_ERR, "could not allocate memory");
+			exit_worker(ws);
+		}
+	}
+
 	session_info_send(ws);
 
 	memset(&settings, 0, sizeof(settings));
@@ -965,6 +1451,19 @@ void session_info_send(worker_st * ws)
 		msg.hostname = ws->req.hostname;
 	}
 
+	/* each handshake is reported once */
+	if (ws->tls_hsk_us > 0) {
+		msg.tls_handshake_us = ws->tls_hsk_us;
+		msg.has_tls_handshake_us = 1;
+		ws->tls_hsk_us = 0;
+	}
+
+	if (ws->dtls_hsk_us > 0) {
+		msg.dtls_handshake_us = ws->dtls_hsk_us;
+		msg.has_dtls_handshake_us = 1;
+		ws->dtls_hsk_us = 0;
+	}
+
 	if (WSCONFIG(ws)->listen_proxy_proto) {
 		msg.our_addr.data = (uint8_t*)&ws->our_addr;
 		msg.our_addr.len = ws->our_addr_len;
@@ -1154,6 +1653,7 @@ int get_pmtu_approx(worker_st *ws)
 		      strerror(e));
 		return -1;
 	} else {
+		ws->tcp_rtt_us = ti.tcpi_rtt;
 		return ti.tcpi_pmtu;
 	}
 #else
@@ -1192,15 +1692,15 @@ int periodic_check(worker_st * ws, struct timespec *tnow, unsigned dpd)
 	 * freezes in the worker due to an unexpected block (due to worker
 	 * bug or kernel bug). In that case the worker will be killed due
 	 * the the alarm instead of hanging. */
-	alarm(1800);
+	worker_set_alarm(ws, 1800);
 
 	if (WSCONFIG(ws)->idle_timeout > 0) {
 		if (now - ws->last_nc_msg > WSCONFIG(ws)->idle_timeout) {
 			oclog(ws, LOG_ERR,
 			      "idle timeout reached for process (%d secs)",
 			      (int)(now - ws->last_nc_msg));
-			terminate = 1;
-			terminate_reason = REASON_IDLE_TIMEOUT;
+			ws->terminate = 1;
+			ws->terminate_reason = REASON_IDLE_TIMEOUT;
 			goto cleanup;
 		}
 	}
@@ -1210,15 +1710,16 @@ int periodic_check(worker_st * ws, struct timespec *tnow, unsigned dpd)
 			oclog(ws, LOG_ERR,
 			      "session timeout reached for process (%d secs)",
 			      (int)(now - ws->session_start_time));
-			terminate = 1;
-			terminate_reason = REASON_SESSION_TIMEOUT;
+			ws->terminate = 1;
+			ws->terminate_reason = REASON_SESSION_TIMEOUT;
 			goto cleanup;
 		}
 	}
 
+	/* with a slot sec-mod reads the counters for the interim updates */
 	if (ws->user_config->interim_update_secs > 0 &&
 	    now - ws->last_stats_msg >= ws->user_config->interim_update_secs &&
-	    ws->sid_set) {
+	    ws->sid_set && ws->stats_slot == NULL) {
 		send_stats_to_secmod(ws, now, 0);
 	}
 
@@ -1236,6 +1737,10 @@ int periodic_check(worker_st * ws, struct timespec *tnow, unsigned dpd)
 		ret = dtls_send(ws, ws->buffer, data_mtu+1);
 		DTLS_FATAL_ERR_CMD(ret, exit_worker_reason(ws, REASON_ERROR));
 
+		/* the round-trip time is measured on its response */
+		if (ws->dtls_dpd_sent.tv_sec == 0)
+			clock_gettime(CLOCK_MONOTONIC, &ws->dtls_dpd_sent);
+
 		if (now - ws->last_msg_udp > DPD_MAX_TRIES * dpd) {
 			oclog(ws, LOG_ERR,
 			      "have not received UDP message or DPD for very long; disabling UDP port");
@@ -1265,9 +1770,10 @@ int periodic_check(worker_st * ws, struct timespec *tnow, unsigned dpd)
 		}
 	}
 
-	if (ws->conn_type != SOCK_TYPE_UNIX && ws->udp_state != UP_DISABLED) {
+	/* this also updates the TCP round-trip time */
+	if (ws->conn_type != SOCK_TYPE_UNIX) {
 		max = get_pmtu_approx(ws);
-		if (max > 0 && max < ws->link_mtu) {
+		if (ws->udp_state != UP_DISABLED && max > 0 && max < ws->link_mtu) {
 			oclog(ws, LOG_DEBUG, "reducing MTU due to TCP/PMTU to %u",
 			      max);
 			link_mtu_set(ws, max);
@@ -1329,6 +1835,14 @@ static int dtls_mainloop(worker_st * ws, struct timespec *tnow)
 
 		DTLS_FATAL_ERR_CMD(ret, exit_worker_reason(ws, REASON_ERROR));
 
+		if (ws->dtls_tptr.new_hello) {
+			ws->dtls_tptr.new_hello = 0;
+			oclog(ws, LOG_DEBUG, "received a new DTLS client hello");
+			ws->udp_state = UP_SETUP;
+			ws->udp_recv_time = tnow->tv_sec;
+			break;
+		}
+
 		if (ret == GNUTLS_E_REHANDSHAKE) {
 
 			if (ws->last_dtls_rehandshake > 0 &&
@@ -1360,6 +1874,9 @@ static int dtls_mainloop(worker_st * ws, struct timespec *tnow)
 			 * to active */
 			ws->udp_state = UP_ACTIVE;
 
+			if (ws->dtls_tptr.steered)
+				dtls_peer_update(ws);
+
 			if (bandwidth_update
 			    (&ws->b_rx, data.size - CSTP_DTLS_OVERHEAD, tnow) != 0) {
 				ret =
@@ -1419,6 +1936,8 @@ static int dtls_mainloop(worker_st * ws, struct timespec *tnow)
 			    CSTP_DTLS_OVERHEAD;
 
 			ws->udp_state = UP_ACTIVE;
+			ws->dtls_tptr.established = tnow->tv_sec;
+			ws->dtls_hsk_us = lat_hist_elapsed(&ws->dtls_hsk_start);
 			oclog(ws, LOG_DEBUG,
 			      "DTLS handshake completed (link MTU: %u, data MTU: %u)\n",
 			      ws->link_mtu, data_mtu);
@@ -1501,70 +2020,50 @@ static int tls_mainloop(struct worker_st *ws, struct timespec *tnow)
 	return ret;
 }
 
-static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
+/* Sends the packet of size l present at ws->buffer+8 over
+ * DTLS or CSTP.
+ */
+static int tun_send_packet(struct worker_st *ws, int l, struct timespec *tnow)
 {
-	int ret, l, e;
+	int ret;
 	unsigned tls_retry;
 	int dtls_type = AC_PKT_DATA;
 	int cstp_type = AC_PKT_DATA;
 	gnutls_datum_t dtls_to_send;
 	gnutls_datum_t cstp_to_send;
 
-	l = tun_read(ws->tun_fd, ws->buffer + 8, DATA_MTU(ws, ws->link_mtu));
-	if (l < 0) {
-		e = errno;
-
-		if (e != EAGAIN && e != EINTR) {
-			oclog(ws, LOG_ERR,
-			      "received corrupt data from tun (%d): %s",
-			      l, strerror(e));
-			return -1;
-		}
-
-		return 0;
-	}
-
-	if (l == 0) {
-		oclog(ws, LOG_INFO, "TUN device returned zero");
-		return 0;
-	}
-
-
 	dtls_to_send.data = ws->buffer;
 	dtls_to_send.size = l;
 
 	cstp_to_send.data = ws->buffer;
 	cstp_to_send.size = l;
 
-	if (WSCONFIG(ws)->switch_to_tcp_timeout &&
-	    ws->udp_state == UP_ACTIVE &&
-	    tnow->tv_sec > ws->udp_recv_time + WSCONFIG(ws)->switch_to_tcp_timeout) {
-		oclog(ws, LOG_DEBUG, "No UDP data received for %li seconds, using TCP instead\n",
-				tnow->tv_sec - ws->udp_recv_time);
-		ws->udp_state = UP_INACTIVE;
-	}
-
-	if (ws->udp_state == UP_ACTIVE && ws->dtls_selected_comp != NULL && l > WSCONFIG(ws)->no_compress_limit) {
-		/* otherwise don't compress */
-		ret = ws->dtls_selected_comp->compress(ws->decomp+8, sizeof(ws->decomp)-8, ws->buffer+8, l);
-		oclog(ws, LOG_TRANSFER_DEBUG, "compressed %d to %d\n", (int)l, ret);
-		if (ret > 0 && ret < l) {
-			dtls_to_send.data = ws->decomp;
-			dtls_to_send.size = ret;
-			dtls_type = AC_PKT_COMPRESSED;
-
-			if (ws->cstp_selected_comp) {
-				if (ws->cstp_selected_comp->id == ws->dtls_selected_comp->id) {
-					cstp_to_send.data = ws->decomp;
-					cstp_to_send.size = ret;
-					cstp_type = AC_PKT_COMPRESSED;
+	/* compress only the packets which may benefit from it */
+	if (ws->udp_state == UP_ACTIVE && ws->dtls_selected_comp != NULL) {
+		if (l > WSCONFIG(ws)->no_compress_limit &&
+		    comp_policy_check(&ws->comp_policy, ws->buffer+8, l) != 0) {
+			ret = ws->dtls_selected_comp->compress(ws, ws->decomp+8, sizeof(ws->decomp)-8, ws->buffer+8, l);
+			oclog(ws, LOG_TRANSFER_DEBUG, "compressed %d to %d\n", (int)l, ret);
+			comp_policy_update(&ws->comp_policy, l, ret);
+			if (ret > 0 && ret < l) {
+				dtls_to_send.data = ws->decomp;
+				dtls_to_send.size = ret;
+				dtls_type = AC_PKT_COMPRESSED;
+
+				if (ws->cstp_selected_comp) {
+					if (ws->cstp_selected_comp->id == ws->dtls_selected_comp->id) {
+						cstp_to_send.data = ws->decomp;
+						cstp_to_send.size = ret;
+						cstp_type = AC_PKT_COMPRESSED;
+					}
 				}
 			}
 		}
-	} else if (ws->cstp_selected_comp != NULL && l > WSCONFIG(ws)->no_compress_limit) {
-		/* otherwise don't compress */
-		ret = ws->cstp_selected_comp->compress(ws->decomp+8, sizeof(ws->decomp)-8, ws->buffer+8, l);
+	} else if (ws->cstp_selected_comp != NULL && l > WSCONFIG(ws)->no_compress_limit &&
+		   comp_policy_check(&ws->comp_policy, ws->buffer+8, l) != 0) {
+		ret = ws->cstp_selected_comp->compress(ws, ws->decomp+8, sizeof(ws->decomp)-8, ws->buffer+8, l);
 		oclog(ws, LOG_TRANSFER_DEBUG, "compressed %d to %d\n", (int)l, ret);
+		comp_policy_update(&ws->comp_policy, l, ret);
 		if (ret > 0 && ret < l) {
 			cstp_to_send.data = ws->decomp;
 			cstp_to_send.size = ret;
@@ -1579,6 +2078,8 @@ static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
 
 		oclog(ws, LOG_TRANSFER_DEBUG, "sending %d byte(s)\n", l);
 
+		ws->tun_packets_out++;
+
 		if (ws->udp_state == UP_ACTIVE) {
 
 			ws->tun_bytes_out += dtls_to_send.size;
@@ -1615,11 +2116,88 @@ static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
 			CSTP_FATAL_ERR_CMD(ws, ret, exit_worker_reason(ws, REASON_ERROR));
 		}
 		ws->last_nc_msg = tnow->tv_sec;
+	} else {
+		ws->tun_drops++;
 	}
 
 	return 0;
 }
 
+/* Drains up to MAX_TUN_BURST packets from the (non-blocking) tun
+ * device, so that a bulk transfer does not cost a poll() round-trip
+ * per packet. The burst is corked, so that over CSTP it is merged into
+ * as few TLS records as possible, and over DTLS it is sent with a single
+ * sendmmsg() or GSO send. When MTU discovery is enabled DTLS records
+ * are sent one by one, as the oversized ones must be detected.
+ */
+static int tun_mainloop(struct worker_st *ws, struct timespec *tnow)
+{
+	int ret, l, e;
+	unsigned i;
+	unsigned cstp_corked = 0;
+	unsigned dtls_corked = 0;
+
+	if (WSCONFIG(ws)->switch_to_tcp_timeout &&
+	    ws->udp_state == UP_ACTIVE &&
+	    tnow->tv_sec > ws->udp_recv_time + WSCONFIG(ws)->switch_to_tcp_timeout) {
+		oclog(ws, LOG_DEBUG, "No UDP data received for %li seconds, using TCP instead\n",
+				tnow->tv_sec - ws->udp_recv_time);
+		ws->udp_state = UP_INACTIVE;
+	}
+
+	for (i = 0; i < MAX_TUN_BURST; i++) {
+		l = tun_read(ws->tun_fd, ws->buffer + 8, DATA_MTU(ws, ws->link_mtu));
+		if (l < 0) {
+			e = errno;
+
+			if (e != EAGAIN && e != EINTR) {
+				oclog(ws, LOG_ERR,
+				      "received corrupt data from tun (%d): %s",
+				      l, strerror(e));
+				ret = -1;
+				goto cleanup;
+			}
+
+			break;
+		}
+
+		if (l == 0) {
+			oclog(ws, LOG_INFO, "TUN device returned zero");
+			break;
+		}
+
+		if (ws->udp_state == UP_ACTIVE) {
+			if (dtls_corked == 0 && WSCONFIG(ws)->try_mtu == 0) {
+				dtls_cork(ws);
+				dtls_corked = 1;
+			}
+		} else if (cstp_corked == 0) {
+			cstp_cork(ws);
+			cstp_corked = 1;
+		}
+
+		ret = tun_send_packet(ws, l, tnow);
+		if (ret < 0)
+			goto cleanup;
+	}
+
+	ret = 0;
+ cleanup:
+	if (dtls_corked) {
+		if (dtls_uncork(ws) < 0) {
+			e = errno;
+			oclog(ws, LOG_ERR, "could not send DTLS data: %s",
+			      strerror(e));
+			ret = -1;
+		}
+	}
+	if (cstp_corked) {
+		e = cstp_uncork(ws);
+		CSTP_FATAL_ERR_CMD(ws, e, exit_worker_reason(ws, REASON_ERROR));
+	}
+	return ret;
+}
+
 static
 char *replace_vals(worker_st *ws, const char *txt)
 {
@@ -1844,9 +2422,13 @@ static int connect_handler(worker_st * ws)
 
 	/* Connected. Turn of the alarm */
 	if (WSCONFIG(ws)->auth_timeout)
-		alarm(0);
+		worker_set_alarm(ws, 0);
 	http_req_deinit(ws);
 
+	/* the peer sends nothing until it receives the reply, which
+	 * tells it how to rekey depending on the outcome */
+	cstp_ktls_enable(ws);
+
 	cstp_cork(ws);
 	ret = cstp_puts(ws, "HTTP/1.1 200 CONNECTED\r\n");
 	SEND_ERR(ret);
@@ -2082,8 +2664,10 @@ static int connect_handler(worker_st * ws)
 		SEND_ERR(ret);
 
 		/* if the peer isn't patched for safe renegotiation, always
-		 * require him to open a new tunnel. */
-		if (ws->session != NULL && gnutls_safe_renegotiation_status(ws->session) != 0)
+		 * require him to open a new tunnel. The same when the session
+		 * was handed to kernel TLS, which cannot rehandshake. */
+		if (ws->session != NULL && gnutls_safe_renegotiation_status(ws->session) != 0 &&
+		    ws->ktls == 0)
 			method = WSCONFIG(ws)->rekey_method;
 		else
 			method = REKEY_METHOD_NEW_TUNNEL;
@@ -2273,11 +2857,12 @@ static int connect_handler(worker_st * ws)
 	bandwidth_init(&ws->b_rx, ws->user_config->rx_per_sec);
 	bandwidth_init(&ws->b_tx, ws->user_config->tx_per_sec);
 
-	sigprocmask(SIG_BLOCK, &blockset, NULL);
+	if (ws->pool == NULL)
+		sigprocmask(SIG_BLOCK, &blockset, NULL);
 
 	/* worker main loop  */
 	for (;;) {
-		if (terminate != 0) {
+		if (ws->terminate != 0) {
  terminate:
 			ws->buffer[0] = 'S';
 			ws->buffer[1] = 'T';
@@ -2291,7 +2876,7 @@ static int connect_handler(worker_st * ws)
 			oclog(ws, LOG_TRANSFER_DEBUG,
 			      "sending disconnect message in TLS channel");
 			cstp_send(ws, ws->buffer, 8);
-			exit_worker_reason(ws, terminate_reason);
+			exit_worker_reason(ws, ws->terminate_reason);
 		}
 
 		if (ws->session != NULL)
@@ -2331,32 +2916,37 @@ static int connect_handler(worker_st * ws)
 				pfd_size++;
 			}
 
+			if (ws->pool) {
+				/* suspends this session only */
+				ret = oc_poll(pfd, pfd_size, 10*1000);
+			} else {
 #ifdef HAVE_PPOLL
-			tv.tv_nsec = 0;
-			tv.tv_sec = 10;
-			ret = ppoll(pfd, pfd_size, &tv, &emptyset);
+				tv.tv_nsec = 0;
+				tv.tv_sec = 10;
+				ret = ppoll(pfd, pfd_size, &tv, &emptyset);
 #else
-			sigprocmask(SIG_UNBLOCK, &blockset, NULL);
-			ret = poll(pfd, pfd_size, 10*1000);
-			sigprocmask(SIG_BLOCK, &blockset, NULL);
+				sigprocmask(SIG_UNBLOCK, &blockset, NULL);
+				ret = poll(pfd, pfd_size, 10*1000);
+				sigprocmask(SIG_BLOCK, &blockset, NULL);
 #endif
+			}
 			if (ret == -1) {
 				if (errno == EINTR || errno == EAGAIN)
 					continue;
-				terminate_reason = REASON_ERROR;
+				ws->terminate_reason = REASON_ERROR;
 				goto exit;
 			}
 
 			if ((pfd[0].revents | pfd[1].revents |
 			     pfd[2].revents | pfd[3].revents) & POLLERR) {
-				terminate_reason = REASON_ERROR;
+				ws->terminate_reason = REASON_ERROR;
 				goto exit;
 			}
 		}
 		gettime(&tnow);
 
 		if (periodic_check(ws, &tnow, ws->user_config->dpd) < 0) {
-			terminate_reason = REASON_ERROR;
+			ws->terminate_reason = REASON_ERROR;
 			goto exit;
 		}
 
@@ -2364,7 +2954,7 @@ static int connect_handler(worker_st * ws)
 		if (pfd[2].revents & (POLLIN|POLLHUP)) {
 			ret = tun_mainloop(ws, &tnow);
 			if (ret < 0) {
-				terminate_reason = REASON_ERROR;
+				ws->terminate_reason = REASON_ERROR;
 				goto exit;
 			}
 		}
@@ -2373,7 +2963,7 @@ static int connect_handler(worker_st * ws)
 		if ((pfd[0].revents & (POLLIN|POLLHUP)) || tls_pending != 0) {
 			ret = tls_mainloop(ws, &tnow);
 			if (ret < 0) {
-				terminate_reason = REASON_ERROR;
+				ws->terminate_reason = REASON_ERROR;
 				goto exit;
 			}
 		}
@@ -2384,7 +2974,7 @@ static int connect_handler(worker_st * ws)
 
 			ret = dtls_mainloop(ws, &tnow);
 			if (ret < 0) {
-				terminate_reason = REASON_ERROR;
+				ws->terminate_reason = REASON_ERROR;
 				goto exit;
 			}
 		}
@@ -2393,15 +2983,17 @@ static int connect_handler(worker_st * ws)
 		if (pfd[1].revents & (POLLIN|POLLHUP)) {
 			ret = handle_commands_from_main(ws);
 			if (ret == ERR_NO_CMD_FD) {
-				terminate_reason = REASON_ERROR;
+				ws->terminate_reason = REASON_ERROR;
 				goto terminate;
 			}
 
 			if (ret < 0) {
-				terminate_reason = REASON_ERROR;
+				ws->terminate_reason = REASON_ERROR;
 				goto exit;
 			}
 		}
+
+		publish_stats(ws, tnow.tv_sec);
 	}
 
 	return 0;
@@ -2414,7 +3006,7 @@ static int connect_handler(worker_st * ws)
 		/*gnutls_deinit(ws->dtls_session); */
 	}
 
-	exit_worker_reason(ws, terminate_reason);
+	exit_worker_reason(ws, ws->terminate_reason);
 
  send_error:
 	oclog(ws, LOG_DEBUG, "error sending data\n");
@@ -2444,6 +3036,10 @@ static int parse_data(struct worker_st *ws, uint8_t *buf, size_t buf_size,
 	switch (head) {
 	case AC_PKT_DPD_RESP:
 		oclog(ws, LOG_TRANSFER_DEBUG, "received DPD response");
+		if (is_dtls && ws->dtls_dpd_sent.tv_sec != 0) {
+			ws->dtls_rtt_us = lat_hist_elapsed(&ws->dtls_dpd_sent);
+			ws->dtls_dpd_sent.tv_sec = 0;
+		}
 		break;
 	case AC_PKT_KEEPALIVE:
 		oclog(ws, LOG_TRANSFER_DEBUG, "received keepalive");
@@ -2531,6 +3127,7 @@ static int parse_data(struct worker_st *ws, uint8_t *buf, size_t buf_size,
 			return -1;
 		}
 		ws->tun_bytes_in += plain_size;
+		ws->tun_packets_in++;
 		ws->last_nc_msg = now;
 
 		break;
@@ -33,6 +33,8 @@
 #include <common.h>
 #include <str.h>
 #include <worker-bandwidth.h>
+#include <worker-compress.h>
+#include <session-stats.h>
 #include <stdbool.h>
 #include <sys/un.h>
 #include <sys/uio.h>
@@ -87,7 +89,8 @@ enum {
 };
 
 typedef int (*decompress_fn)(void* dst, int maxDstSize, const void* src, int src_size);
-typedef int (*compress_fn)(void* dst, int dst_size, const void* src, int src_size);
+/* @ctx is the worker_st of the session */
+typedef int (*compress_fn)(void *ctx, void* dst, int dst_size, const void* src, int src_size);
 
 typedef struct compression_method_st {
 	comp_type_t id;
@@ -152,16 +155,68 @@ struct http_req_st {
 	unsigned authorization_size;
 };
 
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+# define ENABLE_DTLS_MMSG
+#endif
+
+/* The maximum number of datagrams moved with a single sendmmsg()
+ * or recvmmsg() on the DTLS socket */
+#define MAX_DTLS_BATCH 32
+
+#ifdef ENABLE_DTLS_MMSG
+typedef struct dtls_mmsg_st {
+	uint8_t *data; /* MAX_DTLS_BATCH slots of slot_size bytes */
+	unsigned slot_size;
+	struct mmsghdr msgs[MAX_DTLS_BATCH];
+	struct iovec iov[MAX_DTLS_BATCH];
+	struct sockaddr_storage addr[MAX_DTLS_BATCH]; /* the sources, if steered */
+	unsigned count; /* datagrams received or queued */
+	unsigned pos; /* next received datagram to return */
+} dtls_mmsg_st;
+#endif
+
+/* The client of a UDP socket that main did not connect */
+typedef struct dtls_peer_st {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	union {
+		char buf[64];
+		struct cmsghdr align;
+	} src; /* the IP_PKTINFO or IPV6_PKTINFO of the address it sends to */
+	socklen_t src_len;
+} dtls_peer_st;
+
 typedef struct dtls_transport_ptr {
 	int fd;
 	UdpFdMsg *msg; /* holds the data of the first client hello */
 	int consumed;
+#ifdef ENABLE_DTLS_MMSG
+	struct dtls_mmsg_st *rx;
+	struct dtls_mmsg_st *tx;
+	unsigned corked; /* records are queued in tx until dtls_flush() */
+	unsigned no_gso; /* UDP_SEGMENT failed on this socket */
+#endif
+	/* With udp-steering the socket is not connected, and the records
+	 * are sent to peer. Its client hellos restart the session. */
+	unsigned steered;
+	struct dtls_peer_st peer;
+	struct sockaddr_storage from; /* the source of the last datagram */
+	socklen_t from_len;
+	const uint8_t *session_id;
+	time_t established; /* when the handshake completed, or zero */
+	unsigned new_hello; /* a client hello of the session is in msg */
 } dtls_transport_ptr;
 
+unsigned dtls_peer_init(struct dtls_peer_st *peer, const UdpFdMsg *msg);
+
 /* Given a base MTU, this macro provides the DTLS plaintext data we can send;
  * the output value does not include the DTLS header */
 #define DATA_MTU(ws,mtu) (mtu-ws->dtls_crypto_overhead-ws->dtls_proto_overhead)
 
+/* The maximum number of packets read from the tun device on
+ * a single poll() wakeup */
+#define MAX_TUN_BURST 32
+
 typedef struct worker_st {
 	gnutls_session_t session;
 	gnutls_session_t dtls_session;
@@ -179,6 +234,7 @@ typedef struct worker_st {
 	int cmd_fd;
 	int conn_fd;
 	sock_type_t conn_type; /* AF_UNIX or something else */
+	unsigned ktls; /* KTLS_TX | KTLS_RX */
 	
 	http_parser *parser;
 
@@ -204,6 +260,13 @@ typedef struct worker_st {
 	int proto; /* AF_INET or AF_INET6 */
 
 	time_t session_start_time;
+	/* when the TLS and DTLS handshakes started (CLOCK_MONOTONIC), and
+	 * the durations in microseconds of the completed ones which are not
+	 * yet reported to main */
+	struct timespec tls_hsk_start;
+	struct timespec dtls_hsk_start;
+	uint32_t tls_hsk_us;
+	uint32_t dtls_hsk_us;
 
 	/* for dead peer detection */
 	time_t last_msg_udp;
@@ -253,6 +316,8 @@ typedef struct worker_st {
 	uint8_t buffer[16*1024];
 	/* Buffer used for decompression */
 	uint8_t decomp[16*1024];
+	/* which packets are worth compressing */
+	comp_policy_st comp_policy;
 	unsigned buffer_size;
 
 	/* the following are set only if authentication is complete */
@@ -282,12 +347,31 @@ typedef struct worker_st {
 	/* tun device stats */
 	uint64_t tun_bytes_in;
 	uint64_t tun_bytes_out;
+	uint64_t tun_packets_in;
+	uint64_t tun_packets_out;
+	uint64_t tun_drops; /* not sent due to the bandwidth limit */
+
+	/* round-trip times, in microseconds; zero until measured */
+	uint32_t tcp_rtt_us;
+	uint32_t dtls_rtt_us;
+	struct timespec dtls_dpd_sent; /* of a DPD not yet answered */
+
+	/* the slot the counters above are published in, set by main;
+	 * without it they are sent to sec-mod periodically */
+	session_stats_slot_st *stats_slot;
+	uint32_t stats_gen;
 
 	/* information on the tun device addresses and network */
 	struct vpn_st vinfo;
 	unsigned default_route;
 	
 	void *main_pool; /* to be used only on deinitialization */
+
+	/* set when the session is served by a worker pool process */
+	struct pool_session_st *pool;
+	/* set when the session is asked to terminate */
+	unsigned terminate;
+	unsigned terminate_reason;
 } worker_st;
 
 void vpn_server(struct worker_st* ws);
@@ -358,6 +442,15 @@ void ocsigaltstack(struct worker_st *ws);
 void exit_worker(worker_st * ws);
 void exit_worker_reason(worker_st * ws, unsigned reason);
 
+/* worker-pool.c */
+void worker_pool_server(struct worker_st *ws, int ctl_fd);
+void worker_pool_session_exit(struct worker_st *ws);
+const void *worker_pool_current(void);
+void worker_pool_set_transport(gnutls_session_t session);
+void worker_set_alarm(struct worker_st *ws, unsigned secs);
+int worker_pool_private_config(struct worker_st *ws);
+ssize_t pool_recv(int fd, void *data, size_t size);
+
 int ws_switch_auth_to(struct worker_st *ws, unsigned auth);
 int ws_switch_auth_to_next(struct worker_st *ws);
 void ws_add_score_to_ip(worker_st *ws, unsigned points, unsigned final);
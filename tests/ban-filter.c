@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "../src/main.h"
+#include "../src/main-ban.h"
+#include "../src/ip-util.h"
+#include "../src/main-ban.c"
+#include "../src/timer-wheel.c"
+#include "../src/main-ban-bpf.c"
+
+/* Checks that the kernel ban filter drops the datagrams of banned
+ * addresses and prefixes on a listening socket, and that the entries
+ * are removed when unbanned. Requires root. */
+
+#define PORT 45261
+
+static int udp_socket(int family, int do_bind)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	struct timeval tv = { 0, 200000 };
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	if (family == AF_INET) {
+		SA_IN_PORT(&addr) = htons(PORT);
+		SA_IN_U8_P(&addr)[0] = 127;
+		SA_IN_U8_P(&addr)[3] = 1;
+		addr_len = sizeof(struct sockaddr_in);
+	} else {
+		SA_IN6_PORT(&addr) = htons(PORT);
+		SA_IN6_U8_P(&addr)[15] = 1;
+		addr_len = sizeof(struct sockaddr_in6);
+	}
+	addr.ss_family = family;
+
+	fd = socket(family, SOCK_DGRAM, 0);
+	if (fd < 0)
+		exit(77);
+
+	if (do_bind) {
+		if (bind(fd, (struct sockaddr *)&addr, addr_len) < 0)
+			exit(77);
+	} else if (connect(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+		exit(77);
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+/* Returns non-zero if a datagram from the client reaches the listener */
+static unsigned passes(int lfd, int cfd)
+{
+	char buf[8];
+
+	if (send(cfd, "x", 1, 0) != 1)
+		exit(1);
+	return recv(lfd, buf, sizeof(buf), 0) == 1;
+}
+
+static void check(int lfd, int cfd, unsigned expected, unsigned line)
+{
+	if (passes(lfd, cfd) != expected) {
+		fprintf(stderr, "error in %d\n", line);
+		exit(1);
+	}
+}
+
+int main()
+{
+	main_server_st *s = talloc(NULL, struct main_server_st);
+	vhost_cfg_st *vhost;
+	struct cfg_st *config;
+	struct listener_st *l4, *l6;
+	int c4, c6;
+
+	if (s == NULL)
+		exit(1);
+
+	memset(s, 0, sizeof(*s));
+
+	s->vconfig = talloc_zero(s, struct list_head);
+	if (s->vconfig == NULL)
+		exit(1);
+	list_head_init(s->vconfig);
+
+	vhost = talloc_zero(s, struct vhost_cfg_st);
+	if (vhost == NULL)
+		exit(1);
+	config = vhost->perm_config.config = talloc_zero(vhost, struct cfg_st);
+
+	list_add(s->vconfig, &vhost->list);
+
+	config->max_ban_score = 20;
+	config->max_ban_prefix_score = 40;
+	config->ban_prefix_ipv4 = 24;
+	config->ban_prefix_ipv6 = 48;
+	config->min_reauth_time = 30;
+	config->ban_reset_time = 300;
+
+	list_head_init(&s->listen_list.head);
+	l4 = talloc_zero(s, struct listener_st);
+	l6 = talloc_zero(s, struct listener_st);
+	if (l4 == NULL || l6 == NULL)
+		exit(1);
+
+	l4->fd = udp_socket(AF_INET, 1);
+	l4->sock_type = SOCK_TYPE_UDP;
+	l6->fd = udp_socket(AF_INET6, 1);
+	l6->sock_type = SOCK_TYPE_UDP;
+	list_add(&s->listen_list.head, &l4->list);
+	list_add(&s->listen_list.head, &l6->list);
+
+	c4 = udp_socket(AF_INET, 0);
+	c6 = udp_socket(AF_INET6, 0);
+
+	main_ban_db_init(s);
+
+	if (ban_filter_init(s) < 0) {
+		fprintf(stderr, "eBPF is not available; skipping\n");
+		exit(77);
+	}
+
+	check(l4->fd, c4, 1, __LINE__);
+	check(l6->fd, c6, 1, __LINE__);
+
+	/* a banned address */
+	add_str_ip_to_ban_list(s, "127.0.0.1", 20);
+	check(l4->fd, c4, 0, __LINE__);
+
+	remove_ip_from_ban_list(s, (uint8_t*)"\x7f\x00\x00\x01", 4);
+	check(l4->fd, c4, 1, __LINE__);
+
+	/* the /64 of ::1 is banned by its /48 */
+	add_str_ip_to_ban_list(s, "::2:0:0:0:1", 10);
+	add_str_ip_to_ban_list(s, "::3:0:0:0:1", 10);
+	add_str_ip_to_ban_list(s, "::4:0:0:0:1", 10);
+	check(l6->fd, c6, 1, __LINE__);
+
+	add_str_ip_to_ban_list(s, "::5:0:0:0:1", 10);
+	check(l6->fd, c6, 0, __LINE__);
+	check(l4->fd, c4, 1, __LINE__);
+
+	/* unbanning an address of the prefix removes it from the filter */
+	remove_ip_from_ban_list(s, (uint8_t*)"\x00\x00\x00\x00\x00\x00\x00\x05\x00\x00\x00\x00\x00\x00\x00\x01", 16);
+	check(l6->fd, c6, 1, __LINE__);
+
+	ban_filter_deinit();
+	main_ban_db_deinit(s);
+	close(c4);
+	close(c6);
+	talloc_free(s);
+	return 0;
+}
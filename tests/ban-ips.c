@@ -29,6 +29,8 @@
 #include "../src/main-ban.h"
 #include "../src/ip-util.h"
 #include "../src/main-ban.c"
+#include "../src/timer-wheel.c"
+#include "../src/main-ban-bpf.c"
 
 /* Test the IP banning functionality */
 static
@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <talloc.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "../src/main.h"
+#include "../src/main-ban.h"
+#include "../src/ip-util.h"
+#include "../src/main-ban.c"
+#include "../src/timer-wheel.c"
+#include "../src/main-ban-bpf.c"
+
+/* Checks that the scores of the addresses are aggregated at their
+ * prefix and that a banned prefix bans all its addresses, compares
+ * the trie lookups against a linear search as entries are added and
+ * removed, and checks the hosts banned among many entries. */
+
+#define ENTRIES 10000
+#define RANDOM_ENTRIES 2000
+
+static void to_addr(const char *ip, struct sockaddr_storage *addr, socklen_t *addr_size)
+{
+	int ret;
+
+	memset(addr, 0, sizeof(*addr));
+	if (strchr(ip, ':') != 0) {
+		ret = inet_pton(AF_INET6, ip, SA_IN6_P(addr));
+		addr->ss_family = AF_INET6;
+		*addr_size = sizeof(struct sockaddr_in6);
+	} else {
+		ret = inet_pton(AF_INET, ip, SA_IN_P(addr));
+		addr->ss_family = AF_INET;
+		*addr_size = sizeof(struct sockaddr_in);
+	}
+
+	if (ret != 1) {
+		fprintf(stderr, "cannot convert IP: %s\n", ip);
+		exit(1);
+	}
+}
+
+static
+unsigned check_if_banned_str(main_server_st *s, const char *ip)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_size;
+
+	to_addr(ip, &addr, &addr_size);
+	return check_if_banned(s, &addr, addr_size);
+}
+
+static void random_ip(uint8_t *ip, unsigned size)
+{
+	unsigned i;
+
+	for (i = 0; i < size; i++)
+		ip[i] = rand();
+}
+
+typedef struct test_entry_st {
+	uint8_t ip[16];
+	unsigned size;
+	unsigned bits;
+	ban_entry_st *e;
+} test_entry_st;
+
+static int count_entries(void *priv, ban_entry_st *e)
+{
+	(*(unsigned *)priv)++;
+	return 0;
+}
+
+/* Adds random prefixes, with some removed, and checks that the
+ * trie finds the same longest banned prefix as a linear search */
+static void check_random(main_server_st *s)
+{
+	test_entry_st *t;
+	ban_entry_st *e, *expected;
+	uint8_t ip[16];
+	unsigned i, j, k, size, n = 0;
+	time_t now = time(0);
+
+	t = calloc(RANDOM_ENTRIES, sizeof(*t));
+	if (t == NULL)
+		exit(1);
+
+	for (i = 0; i < RANDOM_ENTRIES; i++) {
+		t[i].size = (i % 3 == 0) ? 16 : 4;
+		/* few distinct top bits, so that prefixes nest */
+		random_ip(t[i].ip, t[i].size);
+		t[i].ip[0] &= 0x3;
+		t[i].bits = 1 + rand() % BAN_HOST_BITS(t[i].size);
+		mask_ip(t[i].ip, t[i].size, t[i].bits);
+
+		e = ban_db_get(s->ban_db, t[i].ip, t[i].size, t[i].bits);
+		if (e == NULL || e->bits != t[i].bits || memcmp(e->ip.ip, t[i].ip, t[i].size) != 0) {
+			fprintf(stderr, "error in %d\n", __LINE__);
+			exit(1);
+		}
+
+		if (!timer_wheel_pending(&e->expiry)) {
+			e->last_reset = now;
+			e->expires = now + 1000;
+			e->score = 1000;
+			timer_wheel_add(&s->ban_db->expiry, &e->expiry, now + 1000);
+		}
+		t[i].e = e;
+	}
+
+	for (i = 0; i < RANDOM_ENTRIES; i += 3) {
+		if (t[i].e != NULL && timer_wheel_pending(&t[i].e->expiry)) {
+			e = t[i].e;
+			for (j = 0; j < RANDOM_ENTRIES; j++) {
+				if (t[j].e == e)
+					t[j].e = NULL;
+			}
+			ban_db_remove(s->ban_db, e);
+		}
+	}
+
+	main_ban_db_iterate(s, count_entries, &n);
+	if (n != main_ban_db_elems(s)) {
+		fprintf(stderr, "error in %d: %u/%u\n", __LINE__, n, main_ban_db_elems(s));
+		exit(1);
+	}
+
+	for (i = 0; i < RANDOM_ENTRIES * 5; i++) {
+		size = (i % 3 == 0) ? 16 : 4;
+		if (i % 2) {
+			/* an address within an entry */
+			j = rand() % RANDOM_ENTRIES;
+			if (t[j].size != size)
+				continue;
+			random_ip(ip, size);
+			for (k = 0; k < t[j].bits; k++)
+				if (get_bit(t[j].ip, k) != get_bit(ip, k))
+					ip[k / 8] ^= 1 << (7 - k % 8);
+		} else {
+			random_ip(ip, size);
+			ip[0] &= 0x3;
+		}
+		mask_ip(ip, size, BAN_HOST_BITS(size));
+
+		expected = NULL;
+		for (j = 0; j < RANDOM_ENTRIES; j++) {
+			if (t[j].e == NULL || t[j].size != size)
+				continue;
+			if (common_bits(t[j].ip, ip, t[j].bits) == t[j].bits &&
+			    (expected == NULL || t[j].bits > expected->bits))
+				expected = t[j].e;
+		}
+
+		e = ban_db_lookup(s, ip, size, now);
+		if (e != expected) {
+			fprintf(stderr, "error in %d\n", __LINE__);
+			exit(1);
+		}
+	}
+
+	free(t);
+}
+
+int main()
+{
+	main_server_st *s = talloc(NULL, struct main_server_st);
+	vhost_cfg_st *vhost;
+	struct cfg_st *config;
+	struct sockaddr_storage *addrs;
+	socklen_t addr_size = sizeof(struct sockaddr_in);
+	unsigned i, banned;
+
+	if (s == NULL)
+		exit(1);
+
+	memset(s, 0, sizeof(*s));
+
+	s->vconfig = talloc_zero(s, struct list_head);
+	if (s->vconfig == NULL)
+		exit(1);
+	list_head_init(s->vconfig);
+
+	vhost = talloc_zero(s, struct vhost_cfg_st);
+	if (vhost == NULL)
+		exit(1);
+	config = vhost->perm_config.config = talloc_zero(vhost, struct cfg_st);
+
+	list_add(s->vconfig, &vhost->list);
+
+	config->max_ban_score = 20;
+	config->max_ban_prefix_score = 40;
+	config->ban_prefix_ipv4 = 24;
+	config->ban_prefix_ipv6 = 48;
+	config->min_reauth_time = 30;
+	config->ban_reset_time = 300;
+
+	main_ban_db_init(s);
+
+	/* addresses of a /24 below their own limit, which ban the /24 */
+	add_str_ip_to_ban_list(s, "10.1.2.1", 10);
+	add_str_ip_to_ban_list(s, "10.1.2.2", 10);
+	add_str_ip_to_ban_list(s, "10.1.2.3", 10);
+
+	if (check_if_banned_str(s, "10.1.2.1") != 0 ||
+	    check_if_banned_str(s, "10.1.2.200") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (add_str_ip_to_ban_list(s, "10.1.2.4", 10) == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* an address which was not seen before */
+	if (check_if_banned_str(s, "10.1.2.200") == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "10.1.3.1") != 0 ||
+	    check_if_banned_str(s, "10.1.1.255") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* unbanning an address resets its prefix */
+	if (remove_ip_from_ban_list(s, (uint8_t*)"\x0a\x01\x02\x04", 4) == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "10.1.2.200") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* IPv6 at /48, with the addresses of a /64 counted together */
+	add_str_ip_to_ban_list(s, "2001:db8:1:1::1", 10);
+	add_str_ip_to_ban_list(s, "2001:db8:1:1::2", 10);
+
+	if (check_if_banned_str(s, "2001:db8:1:1::3") == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "2001:db8:1:3::1") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	add_str_ip_to_ban_list(s, "2001:db8:1:4::1", 10);
+	add_str_ip_to_ban_list(s, "2001:db8:1:5::1", 10);
+
+	if (check_if_banned_str(s, "2001:db8:1:ffff::1") == 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	if (check_if_banned_str(s, "2001:db8:2::1") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	main_ban_db_deinit(s);
+
+	/* the trie against a linear search */
+	main_ban_db_init(s);
+	srand(5);
+	check_random(s);
+	main_ban_db_deinit(s);
+
+	/* every 100th of many hosts is banned */
+	main_ban_db_init(s);
+	config->max_ban_prefix_score = 0;
+	config->ban_points_connect = 0;
+
+	addrs = calloc(ENTRIES, sizeof(*addrs));
+	if (addrs == NULL)
+		exit(1);
+
+	for (i = 0; i < ENTRIES; i++) {
+		addrs[i].ss_family = AF_INET;
+		random_ip((uint8_t *)SA_IN_P(&addrs[i]), 4);
+		add_ip_to_ban_list(s, SA_IN_P(&addrs[i]), 4, i % 100 == 0 ? 20 : 1);
+	}
+
+	for (i = banned = 0; i < ENTRIES; i++)
+		banned += check_if_banned(s, &addrs[i], addr_size);
+
+	if (banned < ENTRIES / 100) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	free(addrs);
+	main_ban_db_deinit(s);
+	talloc_free(s);
+	return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/worker-compress.c"
+#include "../src/lzs.c"
+
+/* Checks which packets the compression policy of a session skips, and
+ * that skipping them over mostly encrypted traffic costs little in the
+ * size of the output. */
+
+#define PACKETS 2000
+
+static const char *text =
+    "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0\r\nAccept: text/html\r\n\r\n";
+
+/* Writes an IPv4 TCP or UDP packet of @size bytes to @pkt */
+static void make_packet(uint8_t *pkt, unsigned size, unsigned proto,
+			unsigned sport, unsigned dport, unsigned random)
+{
+	unsigned i, off = 20 + (proto == IPPROTO_TCP ? 20 : 8);
+
+	memset(pkt, 0, off);
+	pkt[0] = 0x45;
+	pkt[2] = size >> 8;
+	pkt[3] = size & 0xff;
+	pkt[9] = proto;
+	memcpy(pkt + 12, "\xc0\xa8\x01\x02\x0a\x00\x00\x01", 8);
+	pkt[20] = sport >> 8;
+	pkt[21] = sport & 0xff;
+	pkt[22] = dport >> 8;
+	pkt[23] = dport & 0xff;
+	if (proto == IPPROTO_TCP)
+		pkt[32] = 5 << 4;
+
+	for (i = off; i < size; i++)
+		pkt[i] = random ? rand() : text[(i - off) % strlen(text)];
+}
+
+static void check(comp_policy_st *p, uint8_t *pkt, unsigned size,
+		  unsigned expected, unsigned line)
+{
+	if (comp_policy_check(p, pkt, size) != expected) {
+		fprintf(stderr, "error in %u\n", line);
+		exit(1);
+	}
+}
+
+static void run(uint8_t (*pkts)[1400], unsigned use_policy, uint64_t *out)
+{
+	static struct lzs_state_st state;
+	comp_policy_st p;
+	unsigned char dst[2048];
+	unsigned i;
+	int ret;
+
+	memset(&p, 0, sizeof(p));
+	*out = 0;
+
+	for (i = 0; i < PACKETS; i++) {
+		if (use_policy && comp_policy_check(&p, pkts[i], 1400) == 0) {
+			*out += 1400;
+			continue;
+		}
+
+		ret = lzs_compress(&state, dst, sizeof(dst), pkts[i], 1400);
+		if (use_policy)
+			comp_policy_update(&p, 1400, ret);
+		*out += (ret > 0 && ret < 1400) ? ret : 1400;
+	}
+}
+
+int main()
+{
+	comp_policy_st p;
+	uint8_t pkt[1400];
+	uint8_t (*pkts)[1400];
+	uint64_t out, out_policy;
+	unsigned i;
+
+	memset(&p, 0, sizeof(p));
+
+	/* https and QUIC are skipped */
+	make_packet(pkt, sizeof(pkt), IPPROTO_TCP, 51000, 443, 0);
+	check(&p, pkt, sizeof(pkt), 0, __LINE__);
+	make_packet(pkt, sizeof(pkt), IPPROTO_UDP, 443, 51000, 0);
+	check(&p, pkt, sizeof(pkt), 0, __LINE__);
+
+	/* so is random data on other ports */
+	make_packet(pkt, sizeof(pkt), IPPROTO_TCP, 51000, 80, 1);
+	check(&p, pkt, sizeof(pkt), 0, __LINE__);
+
+	/* text is compressed for as long as it compresses */
+	make_packet(pkt, sizeof(pkt), IPPROTO_TCP, 51000, 80, 0);
+	for (i = 0; i < 100; i++) {
+		check(&p, pkt, sizeof(pkt), 1, __LINE__);
+		comp_policy_update(&p, sizeof(pkt), 200);
+	}
+
+	if (p.hits != 100 || p.misses != 0 || p.skipped != 3) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* a flow that fails is skipped for 2, then 4 packets */
+	make_packet(pkt, sizeof(pkt), IPPROTO_UDP, 51000, 5000, 0);
+	for (i = 0; i < COMP_FLOW_FAILS; i++) {
+		check(&p, pkt, sizeof(pkt), 1, __LINE__);
+		comp_policy_update(&p, sizeof(pkt), sizeof(pkt) + 10);
+	}
+	check(&p, pkt, sizeof(pkt), 0, __LINE__);
+	check(&p, pkt, sizeof(pkt), 0, __LINE__);
+	check(&p, pkt, sizeof(pkt), 1, __LINE__);
+	comp_policy_update(&p, sizeof(pkt), -1);
+	for (i = 0; i < 4; i++)
+		check(&p, pkt, sizeof(pkt), 0, __LINE__);
+	check(&p, pkt, sizeof(pkt), 1, __LINE__);
+
+	/* it is tried again as soon as it compresses */
+	comp_policy_update(&p, sizeof(pkt), 100);
+	check(&p, pkt, sizeof(pkt), 1, __LINE__);
+	comp_policy_update(&p, sizeof(pkt), 100);
+
+	/* while the other flows are not affected */
+	make_packet(pkt, sizeof(pkt), IPPROTO_TCP, 51000, 80, 0);
+	check(&p, pkt, sizeof(pkt), 1, __LINE__);
+	comp_policy_update(&p, sizeof(pkt), 200);
+
+	/* a session whose flows keep failing backs off as a whole */
+	memset(&p, 0, sizeof(p));
+	for (i = 0; i < 64; i++) {
+		make_packet(pkt, sizeof(pkt), IPPROTO_UDP, 51000 + i, 5000, 0);
+		if (comp_policy_check(&p, pkt, sizeof(pkt)) != 0)
+			comp_policy_update(&p, sizeof(pkt), -1);
+	}
+
+	if (p.skipped == 0 || p.misses >= 64) {
+		fprintf(stderr, "error in %d: %u\n", __LINE__, (unsigned)p.misses);
+		exit(1);
+	}
+
+	/* a mix of 90% encrypted traffic */
+	pkts = malloc(PACKETS * sizeof(*pkts));
+	if (pkts == NULL)
+		exit(1);
+
+	for (i = 0; i < PACKETS; i++) {
+		if (i % 10 == 0)
+			make_packet(pkts[i], 1400, IPPROTO_TCP, 51000, 80, 0);
+		else if (i % 10 < 5)
+			make_packet(pkts[i], 1400, IPPROTO_TCP, 51001, 443, 1);
+		else
+			make_packet(pkts[i], 1400, IPPROTO_UDP, 51002 + i % 3, 8801, 1);
+	}
+
+	run(pkts, 0, &out);
+	run(pkts, 1, &out_policy);
+
+	if (out_policy > out + out / 100) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	free(pkts);
+	return 0;
+}
@@ -35,12 +35,25 @@ static unsigned verbose = 0;
 #define force_write write
 
 #include "../src/tlslib.c"
+#include "../src/timer-wheel.c"
 
 int get_cert_names(worker_st * ws, const gnutls_datum_t * raw)
 {
 	return 0;
 }
 
+int (*oc_poll)(struct pollfd *fds, nfds_t nfds, int timeout) = poll;
+
+void exit_worker(worker_st * ws)
+{
+	exit(1);
+}
+
+ssize_t pool_recv(int fd, void *data, size_t size)
+{
+	return recv(fd, data, size, 0);
+}
+
 #define MAX_SIZE 256
 #define ITERATIONS 1024
 
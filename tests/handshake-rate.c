@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netdb.h>
+
+#include <gnutls/gnutls.h>
+
+/* Measures the rate of full TLS handshakes the server completes.
+ * Every handshake requires a private key operation from sec-mod.
+ *
+ * usage: handshake-rate host port handshakes clients
+ */
+
+static struct addrinfo *addr;
+
+static int handshake(gnutls_certificate_credentials_t xcred)
+{
+	gnutls_session_t session;
+	int sd, ret;
+
+	sd = socket(addr->ai_family, SOCK_STREAM, 0);
+	if (sd == -1)
+		return -1;
+
+	if (connect(sd, addr->ai_addr, addr->ai_addrlen) == -1) {
+		close(sd);
+		return -1;
+	}
+
+	gnutls_init(&session, GNUTLS_CLIENT);
+	gnutls_set_default_priority(session);
+	gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, xcred);
+	gnutls_transport_set_int(session, sd);
+	gnutls_handshake_set_timeout(session, 30 * 1000);
+
+	do {
+		ret = gnutls_handshake(session);
+	} while (ret < 0 && gnutls_error_is_fatal(ret) == 0);
+
+	if (ret < 0)
+		fprintf(stderr, "handshake failed: %s\n", gnutls_strerror(ret));
+
+	gnutls_deinit(session);
+	close(sd);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static int client(unsigned handshakes)
+{
+	gnutls_certificate_credentials_t xcred;
+	unsigned i, failed = 0;
+
+	gnutls_certificate_allocate_credentials(&xcred);
+
+	for (i = 0; i < handshakes; i++) {
+		if (handshake(xcred) < 0)
+			failed++;
+	}
+
+	gnutls_certificate_free_credentials(xcred);
+	return failed != 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct addrinfo hints;
+	struct timespec start, end;
+	unsigned handshakes, clients, i, failed = 0;
+	int status;
+	double secs;
+	pid_t pid;
+
+	if (argc < 5) {
+		fprintf(stderr, "usage: %s host port handshakes clients\n", argv[0]);
+		exit(77);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(argv[1], argv[2], &hints, &addr) != 0) {
+		fprintf(stderr, "could not resolve %s\n", argv[1]);
+		exit(1);
+	}
+
+	handshakes = atoi(argv[3]);
+	clients = atoi(argv[4]);
+	if (clients == 0 || handshakes < clients) {
+		fprintf(stderr, "there must be at least one handshake per client\n");
+		exit(1);
+	}
+
+	gnutls_global_init();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < clients; i++) {
+		pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			exit(1);
+		}
+
+		if (pid == 0)
+			exit(client(handshakes / clients));
+	}
+
+	for (i = 0; i < clients; i++) {
+		if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	handshakes = (handshakes / clients) * clients;
+	printf("%u handshakes in %.2f secs: %.1f handshakes/sec\n",
+	       handshakes, secs, handshakes / secs);
+
+	freeaddrinfo(addr);
+	gnutls_global_deinit();
+
+	if (failed != 0) {
+		fprintf(stderr, "%u clients had failed handshakes\n", failed);
+		exit(1);
+	}
+
+	return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "../src/main.h"
+#include "../src/ip-util.h"
+#include "../src/ip-util.c"
+#include "../src/ip-lease.c"
+
+/* Fills networks up to their last address, and checks that every
+ * address is handed out once, that a released address is re-used, that
+ * the pool of a network is released with its last lease, and that a
+ * session keeps the address derived from its seed. */
+
+unsigned icmp_ping_in_use(const struct sockaddr_storage *addr)
+{
+	return 0;
+}
+
+int icmp_ping_start(main_server_st *s, void *ctx, const struct sockaddr_storage *addr,
+		    icmp_ping_func func, void *priv)
+{
+	return 0;
+}
+
+int handle_lease_probe_res(main_server_st *s, struct proc_st *proc, int result)
+{
+	return 0;
+}
+
+void reset_tun(struct proc_st *proc)
+{
+}
+
+static vhost_cfg_st vhost;
+static struct cfg_st vhost_config;
+
+static struct proc_st *test_proc(void *pool, GroupCfgSt *config, uint32_t seed)
+{
+	struct proc_st *proc;
+
+	proc = talloc_zero(pool, struct proc_st);
+	if (proc == NULL)
+		exit(1);
+
+	/* the addresses are taken from @config, the vhost has none */
+	proc->vhost = &vhost;
+	proc->config = config;
+	memcpy(proc->ipv4_seed, &seed, sizeof(proc->ipv4_seed));
+	return proc;
+}
+
+static void fill(main_server_st *s, GroupCfgSt *config, unsigned family,
+		 unsigned expected)
+{
+	void *pool = talloc_new(s);
+	struct proc_st **procs;
+	struct proc_st *proc;
+	struct ip_lease_st *lease;
+	struct sockaddr_storage addr;
+	unsigned i, j;
+	int ret;
+
+	procs = talloc_zero_array(pool, struct proc_st *, expected);
+	if (procs == NULL)
+		exit(1);
+
+	for (i = 0; i < expected; i++) {
+		procs[i] = test_proc(pool, config, i);
+		ret = get_ip_leases(s, procs[i]);
+		if (ret < 0) {
+			fprintf(stderr, "error in %d: lease %u: %d\n", __LINE__, i, ret);
+			exit(1);
+		}
+	}
+
+	/* every address is handed out once */
+	if (s->ip_leases.ht.elems != expected) {
+		fprintf(stderr, "error in %d: %u leases\n", __LINE__,
+			(unsigned)s->ip_leases.ht.elems);
+		exit(1);
+	}
+
+	/* the network is full */
+	proc = test_proc(pool, config, expected);
+	ret = get_ip_leases(s, proc);
+	if (ret != ERR_NO_IP) {
+		fprintf(stderr, "error in %d: %d\n", __LINE__, ret);
+		exit(1);
+	}
+
+	/* a released address is handed out again */
+	for (i = 0; i < 3; i++) {
+		j = (i * 7919) % expected;
+		lease = family == AF_INET ? procs[j]->ipv4 : procs[j]->ipv6;
+		memcpy(&addr, &lease->sig, sizeof(addr));
+		remove_ip_leases(s, procs[j]);
+
+		ret = get_ip_leases(s, procs[j]);
+		if (ret < 0) {
+			fprintf(stderr, "error in %d: %d\n", __LINE__, ret);
+			exit(1);
+		}
+
+		lease = family == AF_INET ? procs[j]->ipv4 : procs[j]->ipv6;
+		if (ip_cmp(&addr, &lease->sig) != 0) {
+			fprintf(stderr, "error in %d: a different address was assigned\n", __LINE__);
+			exit(1);
+		}
+	}
+
+	talloc_free(pool);
+	if (s->ip_leases.ht.elems != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* the pool is released with its last lease */
+	if (!list_empty(&s->ip_leases.pools)) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+}
+
+static void check_seed(main_server_st *s, GroupCfgSt *config)
+{
+	void *pool = talloc_new(s);
+	struct proc_st *proc, *other;
+	struct sockaddr_storage addr;
+	unsigned i;
+
+	/* a session gets the same address when it is free */
+	proc = test_proc(pool, config, 0x12345678);
+	if (get_ip_leases(s, proc) < 0)
+		exit(1);
+	memcpy(&addr, &proc->ipv4->sig, sizeof(addr));
+	remove_ip_leases(s, proc);
+
+	for (i = 0; i < 100; i++) {
+		other = test_proc(pool, config, 1000 + i);
+		if (get_ip_leases(s, other) < 0)
+			exit(1);
+		if (ip_cmp(&addr, &other->ipv4->sig) == 0)
+			remove_ip_leases(s, other);
+	}
+
+	if (get_ip_leases(s, proc) < 0)
+		exit(1);
+
+	if (ip_cmp(&addr, &proc->ipv4->sig) != 0) {
+		fprintf(stderr, "error in %d: the seed address was not re-used\n", __LINE__);
+		exit(1);
+	}
+
+	talloc_free(pool);
+}
+
+int main()
+{
+	main_server_st *s;
+	GroupCfgSt config4, config6;
+
+	s = talloc_zero(NULL, struct main_server_st);
+	if (s == NULL)
+		exit(1);
+
+	ip_lease_init(&s->ip_leases);
+	vhost.perm_config.config = &vhost_config;
+
+	memset(&config4, 0, sizeof(config4));
+	config4.ipv4_net = "10.10.0.0";
+	config4.ipv4_netmask = "255.255.240.0";
+
+	memset(&config6, 0, sizeof(config6));
+	config6.ipv6_net = "fd91:6d87:7341:db6a::";
+	config6.has_ipv6_prefix = 1;
+	config6.ipv6_prefix = 116;
+	config6.has_ipv6_subnet_prefix = 1;
+	config6.ipv6_subnet_prefix = 128;
+
+	/* a /20 less the network, ours and the broadcast address */
+	fill(s, &config4, AF_INET, 4096 - 3);
+	check_seed(s, &config4);
+
+	/* a /116 of single addresses, less the network */
+	fill(s, &config6, AF_INET6, 4096 - 1);
+
+	ip_lease_deinit(&s->ip_leases);
+	talloc_free(s);
+	return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/lat-hist.c"
+#include "unit-test.h"
+
+/* Checks that every duration is counted in the bucket whose limits
+ * enclose it, that the buckets are at most 25% wider than their lower
+ * limit, that the quantiles and merged histograms are as expected, and
+ * that many scattered samples are all counted. */
+
+#define SAMPLES 100000
+
+int main()
+{
+	static lat_hist_st h, h2;
+	uint64_t us, low, limit;
+	unsigned b, i;
+
+	/* the buckets follow each other */
+	low = 0;
+	for (b = 0; b < LAT_HIST_BUCKETS - 1; b++) {
+		limit = lat_hist_bucket_limit(b);
+		CHECK(limit > low);
+		CHECK(b < LAT_HIST_SUB || (limit - low) * 4 <= low);
+		CHECK(lat_hist_bucket(low) == b);
+		CHECK(lat_hist_bucket(limit - 1) == b);
+		low = limit;
+	}
+	CHECK(low == (uint64_t)1 << LAT_HIST_MAX_BITS);
+	CHECK(lat_hist_bucket(low) == LAT_HIST_BUCKETS - 1);
+	CHECK(lat_hist_bucket((uint64_t)-1) == LAT_HIST_BUCKETS - 1);
+
+	/* every duration of the first seconds is in its bucket */
+	for (us = 1; us < 4000000; us++) {
+		b = lat_hist_bucket(us);
+		CHECK(us < lat_hist_bucket_limit(b));
+		CHECK(b == 0 || us >= lat_hist_bucket_limit(b - 1));
+	}
+
+	/* quantiles */
+	CHECK(lat_hist_quantile(&h, 500) == 0);
+	for (i = 1; i <= 1000; i++)
+		lat_hist_add(&h, i * 1000);
+	CHECK(lat_hist_total(&h) == 1000);
+	CHECK(h.sum == 1000 * 1001 / 2 * 1000);
+
+	/* within the width of a bucket */
+	us = lat_hist_quantile(&h, 500);
+	CHECK(us > 500000 && us <= 500000 * 5 / 4);
+	us = lat_hist_quantile(&h, 990);
+	CHECK(us > 990000 && us <= 990000 * 5 / 4);
+	CHECK(lat_hist_quantile(&h, 1000) > 1000000);
+
+	/* merging, as of the histograms of sec-mod */
+	lat_hist_add(&h2, 7);
+	lat_hist_add(&h2, 100000000);
+	lat_hist_merge(&h, h2.count, LAT_HIST_BUCKETS, h2.sum);
+	CHECK(lat_hist_total(&h) == 1002);
+	CHECK(h.count[7] == 1);
+	CHECK(h.count[LAT_HIST_BUCKETS - 1] == 1);
+	CHECK(lat_hist_quantile(&h, 1000) == (uint64_t)1 << LAT_HIST_MAX_BITS);
+
+	/* the empty last buckets are not sent */
+	memset(&h2, 0, sizeof(h2));
+	lat_hist_add(&h2, 3);
+	lat_hist_merge(&h, h2.count, 4, h2.sum);
+	CHECK(h.count[3] == 1);
+
+	memset(&h, 0, sizeof(h));
+	for (i = 0; i < SAMPLES; i++)
+		lat_hist_add(&h, (i * 2654435761U) >> 8);
+	CHECK(lat_hist_total(&h) == SAMPLES);
+
+	return 0;
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/lzs.c"
+
+/* Checks that the LZS compressor produces the same output as the
+ * version that cleared its tables for every packet, and that the output
+ * decompresses to the input, over a mix of packets. */
+
+#define PACKETS 2000
+
+/* The compressor before the tables were kept across packets */
+static int lzs_compress_ref(unsigned char *dst, int dstlen, const unsigned char *src, int srclen)
+{
+	int length, offset;
+	int inpos = 0, outpos = 0;
+	uint16_t longest_match_len;
+	uint16_t hofs, longest_match_ofs;
+	uint16_t hash;
+	uint32_t outbits = 0;
+	int nr_outbits = 0;
+	uint16_t hash_table[HASH_TABLE_SIZE];
+	uint16_t hash_chain[MAX_HISTORY];
+
+	if (srclen > INVALID_OFS + 1)
+		return -EFBIG;
+
+	memset(hash_table, 0xff, sizeof(hash_table));
+
+	while (inpos < srclen - 2) {
+		hash = HASH(src + inpos);
+		hofs = hash_table[hash];
+
+		hash_chain[inpos & (MAX_HISTORY - 1)] = hofs;
+		hash_table[hash] = inpos;
+
+		if (hofs == INVALID_OFS || hofs + MAX_HISTORY <= inpos) {
+			PUT_BITS(9, src[inpos]);
+			inpos++;
+			continue;
+		}
+
+		longest_match_len = 2;
+		longest_match_ofs = hofs;
+
+		for (; hofs != INVALID_OFS && hofs + MAX_HISTORY > inpos;
+		     hofs = hash_chain[hofs & (MAX_HISTORY - 1)]) {
+			if (!memcmp(src + hofs + 2, src + inpos + 2, longest_match_len - 1)) {
+				longest_match_ofs = hofs;
+
+				do {
+					longest_match_len++;
+					if (longest_match_len + inpos == srclen)
+						goto got_match;
+				} while (src[longest_match_len + inpos] == src[longest_match_len + hofs]);
+			}
+		}
+ got_match:
+		offset = inpos - longest_match_ofs;
+		length = longest_match_len;
+
+		if (offset < 0x80)
+			PUT_BITS(9, 0x180 | offset);
+		else
+			PUT_BITS(13, 0x1000 | offset);
+
+		if (length < 5)
+			PUT_BITS(2, length - 2);
+		else if (length < 8)
+			PUT_BITS(4, length + 7);
+		else {
+			length += 7;
+			while (length >= 30) {
+				PUT_BITS(8, 0xff);
+				length -= 30;
+			}
+			if (length >= 15)
+				PUT_BITS(8, 0xf0 + length - 15);
+			else
+				PUT_BITS(4, length);
+		}
+
+		if (inpos + longest_match_len >= srclen - 2) {
+			inpos += longest_match_len;
+			break;
+		}
+
+		inpos++;
+		while (--longest_match_len) {
+			hash = HASH(src + inpos);
+			hash_chain[inpos & (MAX_HISTORY - 1)] = hash_table[hash];
+			hash_table[hash] = inpos++;
+		}
+	}
+
+	if (inpos == srclen - 2) {
+		hash = HASH(src + inpos);
+		hofs = hash_table[hash];
+
+		if (hofs != INVALID_OFS && hofs + MAX_HISTORY > inpos) {
+			offset = inpos - hofs;
+
+			if (offset < 0x80)
+				PUT_BITS(9, 0x180 | offset);
+			else
+				PUT_BITS(13, 0x1000 | offset);
+			PUT_BITS(2, 0);
+		} else {
+			PUT_BITS(9, src[inpos]);
+			PUT_BITS(9, src[inpos + 1]);
+		}
+	} else if (inpos == srclen - 1) {
+		PUT_BITS(9, src[inpos]);
+	}
+
+	PUT_BITS(16, 0xc000);
+
+	return outpos;
+}
+
+typedef struct packet_st {
+	unsigned char *data;
+	int size;
+} packet_st;
+
+static const char *http_text =
+    "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\n"
+    "Cache-Control: no-cache\r\nServer: nginx\r\n\r\n"
+    "<html><head><title>Index</title></head><body><table>"
+    "<tr><td class=\"name\"><a href=\"/files/\">files</a></td></tr>"
+    "<tr><td class=\"name\"><a href=\"/docs/\">docs</a></td></tr>"
+    "<tr><td class=\"name\"><a href=\"/src/\">src</a></td></tr>";
+
+/* Fills @p with a packet of an IPv4 header, a TCP header and a payload
+ * that is text, random or zeros, as seen on a VPN link. */
+static void make_packet(packet_st *p, unsigned i)
+{
+	unsigned hlen = 40, size, j, kind = rand() % 4;
+
+	if (kind == 0)		/* a TCP ACK */
+		size = hlen;
+	else if (kind == 3)	/* a full packet */
+		size = 1400;
+	else
+		size = hlen + 1 + rand() % 1360;
+
+	p->data = malloc(size);
+	if (p->data == NULL)
+		exit(1);
+	p->size = size;
+
+	/* headers that differ in the addresses, ports and counters */
+	memset(p->data, 0, hlen);
+	p->data[0] = 0x45;
+	p->data[2] = size >> 8;
+	p->data[3] = size & 0xff;
+	p->data[4] = i >> 8;
+	p->data[5] = i & 0xff;
+	p->data[8] = 64;
+	p->data[9] = 6;
+	p->data[12] = 192; p->data[13] = 168; p->data[14] = 1; p->data[15] = i % 7;
+	p->data[16] = 10; p->data[17] = 0; p->data[18] = 0; p->data[19] = 2;
+	for (j = 20; j < hlen; j++)
+		p->data[j] = rand();
+
+	for (j = hlen; j < size; j++) {
+		if (kind == 1)
+			p->data[j] = http_text[(j - hlen) % strlen(http_text)];
+		else if (kind == 2)
+			p->data[j] = rand();
+		else
+			p->data[j] = (j / 64) % 3 ? 0 : rand();
+	}
+}
+
+int main()
+{
+	static struct lzs_state_st state;
+	unsigned char out[2048], ref[2048], dec[2048];
+	packet_st *packets;
+	unsigned i;
+	int ret, ret_ref;
+
+	srand(1);
+	packets = calloc(PACKETS, sizeof(packet_st));
+	if (packets == NULL)
+		exit(1);
+
+	for (i = 0; i < PACKETS; i++)
+		make_packet(&packets[i], i);
+
+	for (i = 0; i < PACKETS; i++) {
+		ret = lzs_compress(&state, out, sizeof(out), packets[i].data, packets[i].size);
+		ret_ref = lzs_compress_ref(ref, sizeof(ref), packets[i].data, packets[i].size);
+		if (ret != ret_ref || (ret > 0 && memcmp(out, ref, ret) != 0)) {
+			fprintf(stderr, "error in %d: packet %u: %d, %d\n", __LINE__, i, ret, ret_ref);
+			exit(1);
+		}
+
+		if (ret < 0)
+			continue;
+
+		ret = lzs_decompress(dec, sizeof(dec), out, ret);
+		if (ret != packets[i].size || memcmp(dec, packets[i].data, ret) != 0) {
+			fprintf(stderr, "error in %d: packet %u: %d\n", __LINE__, i, ret);
+			exit(1);
+		}
+	}
+
+	/* the tables are cleared when the positions wrap */
+	state.base = UINT32_MAX - 100;
+	for (i = 0; i < 10; i++) {
+		ret = lzs_compress(&state, out, sizeof(out), packets[i].data, packets[i].size);
+		ret_ref = lzs_compress_ref(ref, sizeof(ref), packets[i].data, packets[i].size);
+		if (ret != ret_ref || (ret > 0 && memcmp(out, ref, ret) != 0)) {
+			fprintf(stderr, "error in %d: packet %u\n", __LINE__, i);
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < PACKETS; i++)
+		free(packets[i].data);
+	free(packets);
+	return 0;
+}
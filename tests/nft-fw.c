@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <talloc.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "../src/main.h"
+#include "../src/ip-util.h"
+#include "../src/ip-util.c"
+#include "../src/main-fw.c"
+
+/* Checks that the nftables firewall backend programs and removes the
+ * rules of sessions, also while others are connected. Runs in a
+ * network namespace of its own, and requires root. */
+
+#define SESSIONS 50
+
+#if defined(__linux__) && defined(HAVE_LINUX_NETFILTER_NF_TABLES_H)
+static char *routes[] = { "10.0.0.0/8", "10.1.0.0/16", "192.168.5.0/255.255.255.0",
+			  "172.16.0.0/12", "fd00::/16", "10.1.0.0/16" };
+static char *no_routes[] = { "10.10.0.0/16", "fd00:1::/32" };
+static char *dns[] = { "10.0.0.1", "fd00::1" };
+
+static FwPortSt port_st[4];
+static FwPortSt *ports[4] = { &port_st[0], &port_st[1], &port_st[2], &port_st[3] };
+
+static GroupCfgSt *test_config(void *pool, unsigned negate)
+{
+	GroupCfgSt *config = talloc_zero(pool, GroupCfgSt);
+
+	if (config == NULL)
+		exit(1);
+
+	config->restrict_user_to_routes = 1;
+	config->routes = routes;
+	config->n_routes = sizeof(routes)/sizeof(routes[0]);
+	config->no_routes = no_routes;
+	config->n_no_routes = sizeof(no_routes)/sizeof(no_routes[0]);
+	config->dns = dns;
+	config->n_dns = sizeof(dns)/sizeof(dns[0]);
+
+	port_st[0].proto = PROTO_TCP;
+	port_st[0].port = 443;
+	port_st[1].proto = PROTO_UDP;
+	port_st[1].port = 53;
+	port_st[2].proto = PROTO_ICMP;
+	port_st[3].proto = PROTO_TCP;
+	port_st[3].port = 443;
+	port_st[0].negate = negate;
+	config->fw_ports = ports;
+	config->n_fw_ports = 4;
+
+	return config;
+}
+
+static struct proc_st *test_proc(void *pool, GroupCfgSt *config, unsigned i)
+{
+	struct proc_st *proc;
+
+	proc = talloc_zero(pool, struct proc_st);
+	if (proc == NULL)
+		exit(1);
+	proc->config = config;
+	snprintf(proc->tun_lease.name, sizeof(proc->tun_lease.name), "vpns%u", i);
+
+	return proc;
+}
+
+static void update(main_server_st *s, struct proc_st *proc, unsigned type,
+		   int expected, unsigned line)
+{
+	int ret = fw_update(s, proc, type);
+
+	if ((expected == 0 && ret != 0) || (expected != 0 && ret == 0)) {
+		fprintf(stderr, "error in %u: %d\n", line, ret);
+		exit(1);
+	}
+}
+
+int main()
+{
+	main_server_st *s;
+	struct proc_st **procs, *proc;
+	GroupCfgSt *config, *bad;
+	nl_buf_st b;
+	unsigned i;
+
+	if (unshare(CLONE_NEWNET) == -1) {
+		fprintf(stderr, "cannot create a network namespace; skipping\n");
+		exit(77);
+	}
+
+	s = talloc_zero(NULL, main_server_st);
+	if (s == NULL)
+		exit(1);
+
+	/* a transaction of the kernel's nf_tables */
+	memset(&b, 0, sizeof(b));
+	b.pool = s;
+	nl_msg_start(&b, NFNL_MSG_BATCH_BEGIN, 0);
+	nl_msg_end(&b);
+	table_msg(&b, NFT_MSG_NEWTABLE);
+	table_msg(&b, NFT_MSG_DELTABLE);
+	nl_msg_start(&b, NFNL_MSG_BATCH_END, 0);
+	nl_msg_end(&b);
+	if (fw_commit(s, &b) != 0) {
+		fprintf(stderr, "nf_tables is not available; skipping\n");
+		exit(77);
+	}
+	talloc_free(b.data);
+
+	if (fw_setup(s, "vpns") != 0 || fw_setup(s, "vpns") != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* the elements of a session are added and deleted */
+	config = test_config(s, 0);
+	proc = test_proc(s, config, 0);
+	update(s, proc, NFT_MSG_NEWSETELEM, 0, __LINE__);
+	update(s, proc, NFT_MSG_DELSETELEM, 0, __LINE__);
+	update(s, proc, NFT_MSG_DELSETELEM, -1, __LINE__);
+
+	/* as are the ones of a session with denied ports */
+	proc->config = test_config(s, 1);
+	update(s, proc, NFT_MSG_NEWSETELEM, 0, __LINE__);
+	update(s, proc, NFT_MSG_DELSETELEM, 0, __LINE__);
+
+	/* an invalid route fails the session */
+	bad = test_config(s, 0);
+	bad->routes = (char *[]){ "10.0.0.1/255.0.255.0" };
+	bad->n_routes = 1;
+	proc->config = bad;
+	update(s, proc, NFT_MSG_NEWSETELEM, -1, __LINE__);
+	proc->config = config;
+
+	/* a session is added and deleted while others are connected */
+	procs = talloc_array(s, struct proc_st *, SESSIONS);
+	if (procs == NULL)
+		exit(1);
+
+	for (i = 0; i < SESSIONS; i++) {
+		procs[i] = test_proc(procs, config, i + 1);
+		update(s, procs[i], NFT_MSG_NEWSETELEM, 0, __LINE__);
+	}
+
+	update(s, proc, NFT_MSG_NEWSETELEM, 0, __LINE__);
+	update(s, proc, NFT_MSG_DELSETELEM, 0, __LINE__);
+	update(s, proc, NFT_MSG_DELSETELEM, -1, __LINE__);
+
+	for (i = 0; i < SESSIONS; i++)
+		update(s, procs[i], NFT_MSG_DELSETELEM, 0, __LINE__);
+
+	fw_deinit();
+	talloc_free(s);
+	return 0;
+}
+#else
+int main()
+{
+	exit(77);
+}
+#endif
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <talloc.h>
+
+#include "../src/auth/common.c"
+#include "../src/auth/plain.c"
+
+/* Checks the index of the password file of the plain backend: that
+ * every user is found, the first of duplicate entries is used, and a
+ * modified or removed file is noticed. */
+
+#define USERS 2000
+
+static void write_passwd(const char *file, unsigned users, const char *extra)
+{
+	char tmp[256];
+	FILE *fp;
+	unsigned i;
+
+	/* replace the file, as ocpasswd does */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	fprintf(fp, "dup:first:$5$first\n");
+	for (i = 0; i < users; i++)
+		fprintf(fp, "user%u:group%u,all:$5$salt$hash%u\n", i, i % 10, i);
+	fprintf(fp, "dup:second:$5$second\r\n");
+	fprintf(fp, "nogroups::$5$nogroups\n");
+	fprintf(fp, "%s", extra);
+	fclose(fp);
+
+	if (rename(tmp, file) != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+}
+
+static struct plain_ctx_st *lookup(void *vctx, const char *username)
+{
+	struct plain_ctx_st *pctx;
+	common_auth_init_st info;
+	int ret;
+
+	memset(&info, 0, sizeof(info));
+	info.username = username;
+
+	ret = plain_auth_init((void**)&pctx, NULL, vctx, &info);
+	if (ret != ERR_AUTH_CONTINUE) {
+		fprintf(stderr, "error in %d: %s: %d\n", __LINE__, username, ret);
+		exit(1);
+	}
+	return pctx;
+}
+
+static void check_user(void *vctx, const char *username, const char *cpass, const char *group)
+{
+	struct plain_ctx_st *pctx = lookup(vctx, username);
+
+	if (cpass == NULL) {
+		if (pctx->failed == 0) {
+			fprintf(stderr, "error in %d: %s was found\n", __LINE__, username);
+			exit(1);
+		}
+	} else if (pctx->failed != 0 || strcmp(pctx->cpass, cpass) != 0) {
+		fprintf(stderr, "error in %d: %s: %s\n", __LINE__, username, pctx->cpass);
+		exit(1);
+	}
+
+	if (group != NULL && (pctx->groupnames_size == 0 ||
+	    strcmp(pctx->groupnames[0], group) != 0)) {
+		fprintf(stderr, "error in %d: %s\n", __LINE__, username);
+		exit(1);
+	}
+
+	plain_auth_deinit(pctx);
+}
+
+int main()
+{
+	char file[] = "./plain-passwd.XXXXXX";
+	plain_cfg_st config;
+	struct plain_ctx_st *pctx;
+	char username[32];
+	void *vctx;
+	unsigned i;
+	int fd;
+
+	fd = mkstemp(file);
+	if (fd == -1)
+		exit(1);
+	close(fd);
+
+	write_passwd(file, USERS, "");
+
+	memset(&config, 0, sizeof(config));
+	config.passwd = file;
+	plain_vhost_init(&vctx, NULL, &config);
+
+	check_user(vctx, "user0", "$5$salt$hash0", "group0");
+	check_user(vctx, "user13", "$5$salt$hash13", "group3");
+	check_user(vctx, "user1", "$5$salt$hash1", "group1");
+	check_user(vctx, "user", NULL, NULL);
+	check_user(vctx, "user00", NULL, NULL);
+	check_user(vctx, "dup", "$5$first", "first");
+	check_user(vctx, "nogroups", "$5$nogroups", NULL);
+
+	for (i = 0; i < USERS; i++) {
+		snprintf(username, sizeof(username), "user%u", i);
+		pctx = lookup(vctx, username);
+		if (pctx->failed) {
+			fprintf(stderr, "error in %d: %s\n", __LINE__, username);
+			exit(1);
+		}
+		plain_auth_deinit(pctx);
+	}
+
+	/* a modified file is read again */
+	write_passwd(file, 10, "added:new:$5$added");
+	check_user(vctx, "added", "$5$added", "new");
+	check_user(vctx, "user13", NULL, NULL);
+
+	/* a removed file fails the authentication */
+	remove(file);
+	if (plain_auth_init((void**)&pctx, NULL, vctx, &(common_auth_init_st){.username = "added"}) != ERR_AUTH_FAIL) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	plain_vhost_deinit(vctx);
+	return 0;
+}
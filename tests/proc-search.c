@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "../src/main.h"
+#include "../src/ip-lease.h"
+#include "../src/ip-util.h"
+#include "../src/ip-util.c"
+#include "../src/proc-search.c"
+#include "unit-test.h"
+
+/* Checks that the sessions are found by username, group and VPN
+ * address, that the indexes follow the sessions as they are removed or
+ * hand their leases over. */
+
+#define SESSIONS 4000
+#define USERS (SESSIONS/2)
+#define GROUPS 4
+
+static struct proc_st *test_proc(main_server_st *s, unsigned i)
+{
+	struct proc_st *proc;
+	struct sockaddr_in *sa;
+
+	proc = talloc_zero(s, struct proc_st);
+	CHECK(proc != NULL);
+
+	sa = (void*)&proc->remote_addr;
+	sa->sin_family = AF_INET;
+	sa->sin_addr.s_addr = htonl(0xc0a80000 + i);
+	proc->remote_addr_len = sizeof(*sa);
+
+	memcpy(proc->sid, &i, sizeof(i));
+	memcpy(proc->dtls_session_id, &i, sizeof(i));
+	proc->dtls_session_id_size = sizeof(proc->dtls_session_id);
+
+	/* two sessions per user */
+	snprintf(proc->username, sizeof(proc->username), "user%u", i % USERS);
+	snprintf(proc->groupname, sizeof(proc->groupname), "group%u", i % GROUPS);
+
+	CHECK(proc_table_add(s, proc) == 0);
+
+	proc->ipv4 = talloc_zero(proc, struct ip_lease_st);
+	CHECK(proc->ipv4 != NULL);
+	sa = (void*)&proc->ipv4->rip;
+	sa->sin_family = AF_INET;
+	sa->sin_addr.s_addr = htonl(0x0a000000 + i);
+	proc->ipv4->rip_len = sizeof(*sa);
+
+	CHECK(proc_table_add_vpn_ip(s, proc) == 0);
+
+	return proc;
+}
+
+static unsigned count(struct list_head *head, unsigned group)
+{
+	struct proc_st *ctmp;
+	unsigned n = 0;
+
+	if (head == NULL)
+		return 0;
+
+	if (group) {
+		list_for_each(head, ctmp, group_list)
+			n++;
+	} else {
+		list_for_each(head, ctmp, user_list)
+			n++;
+	}
+
+	return n;
+}
+
+int main()
+{
+	main_server_st *s;
+	struct proc_st **procs, *ctmp;
+	char name[64];
+	uint32_t ip;
+	unsigned i, n;
+
+	s = talloc_zero(NULL, main_server_st);
+	CHECK(s != NULL);
+	proc_table_init(s);
+
+	procs = talloc_array(s, struct proc_st *, SESSIONS);
+	CHECK(procs != NULL);
+
+	for (i = 0; i < SESSIONS; i++)
+		procs[i] = test_proc(s, i);
+
+	/* the sessions of a user */
+	CHECK(count(proc_search_username(s, "user7"), 0) == 2);
+	list_for_each(proc_search_username(s, "user7"), ctmp, user_list)
+		CHECK(ctmp == procs[7] || ctmp == procs[7 + USERS]);
+	CHECK(proc_search_username(s, "nobody") == NULL);
+
+	/* the sessions of a group */
+	CHECK(count(proc_search_groupname(s, "group1"), 1) == SESSIONS / GROUPS);
+
+	/* the session of a VPN address */
+	ip = htonl(0x0a000000 + 1234);
+	CHECK(proc_search_vpn_ip(s, (void*)&ip, sizeof(ip)) == procs[1234]);
+
+	/* a removed session is no longer found */
+	proc_table_del(s, procs[1234]);
+	CHECK(proc_search_vpn_ip(s, (void*)&ip, sizeof(ip)) == NULL);
+	CHECK(count(proc_search_username(s, "user1234"), 0) == 1);
+	CHECK(count(proc_search_groupname(s, "group2"), 1) == SESSIONS / GROUPS - 1);
+
+	/* the leases handed to another session are found with it */
+	proc_table_del_vpn_ip(s, procs[6]);
+	talloc_free(procs[6]->ipv4);
+
+	ip = htonl(0x0a000000 + 5);
+	proc_table_del_vpn_ip(s, procs[5]);
+	procs[6]->ipv4 = talloc_move(procs[6], &procs[5]->ipv4);
+	CHECK(proc_search_vpn_ip(s, (void*)&ip, sizeof(ip)) == NULL);
+	CHECK(proc_table_add_vpn_ip(s, procs[6]) == 0);
+	CHECK(proc_search_vpn_ip(s, (void*)&ip, sizeof(ip)) == procs[6]);
+	proc_table_del(s, procs[5]);
+
+	/* the last session of a user removes its entry */
+	proc_table_del(s, procs[1234 + USERS]);
+	CHECK(proc_search_username(s, "user1234") == NULL);
+
+	/* the remaining sessions are found by their username */
+	for (i = n = 0; i < USERS; i++) {
+		snprintf(name, sizeof(name), "user%u", i);
+		n += count(proc_search_username(s, name), 0);
+	}
+	CHECK(n == SESSIONS - 3);
+
+	for (i = 0; i < SESSIONS; i++)
+		proc_table_del(s, procs[i]);
+	CHECK(proc_search_groupname(s, "group1") == NULL);
+	CHECK(s->proc_table.db_username->elems == 0);
+
+	proc_table_deinit(s);
+	talloc_free(s);
+	return 0;
+}
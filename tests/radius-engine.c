@@ -0,0 +1,444 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+
+/* Unit test for the asynchronous radius client, against a stand-in
+ * responder running in a thread.
+ */
+#include "../src/radius-engine.c"
+
+#define SECRET "testing123"
+
+#define ATTR_FRAMED_IP_ADDRESS 8
+#define ATTR_ACCT_STATUS_TYPE 40
+#define ATTR_ACCT_INPUT_OCTETS 42
+#define STATUS_STOP 2
+#define STATUS_INTERIM 3
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned interims;
+static unsigned interim_octets;
+static unsigned silent_requests;
+static unsigned done_ok, done_superseded, done_failed;
+
+static void fail(const char *msg)
+{
+	fprintf(stderr, "%s\n", msg);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int udp_socket(unsigned *port)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+		fail("socket");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+		fail("bind");
+
+	if (getsockname(fd, (struct sockaddr *)&sa, &len) == -1)
+		fail("getsockname");
+	*port = ntohs(sa.sin_port);
+
+	return fd;
+}
+
+static void md5(uint8_t out[16], const void *d1, size_t s1, const void *d2, size_t s2,
+		const void *d3, size_t s3, const void *d4, size_t s4)
+{
+	gnutls_hash_hd_t h;
+
+	gnutls_hash_init(&h, GNUTLS_DIG_MD5);
+	gnutls_hash(h, d1, s1);
+	gnutls_hash(h, d2, s2);
+	if (s3 > 0)
+		gnutls_hash(h, d3, s3);
+	if (s4 > 0)
+		gnutls_hash(h, d4, s4);
+	gnutls_hash_deinit(h, out);
+}
+
+static const uint8_t *find(const uint8_t *p, size_t size, uint8_t type, size_t *len)
+{
+	const uint8_t *end = p + size;
+
+	for (; p + 2 <= end && p[1] >= 2 && p + p[1] <= end; p += p[1]) {
+		if (p[0] == type) {
+			*len = p[1] - 2;
+			return p + 2;
+		}
+	}
+	return NULL;
+}
+
+/* Verifies the request's authenticators, and returns the password */
+static int check_request(uint8_t *p, size_t size, char *pass)
+{
+	uint8_t zero[16], auth[16], mac[16], b[16];
+	const uint8_t *a;
+	uint8_t *ma;
+	size_t len, i, j;
+
+	memset(zero, 0, sizeof(zero));
+	pass[0] = 0;
+
+	if (p[0] == RAD_ACCOUNTING_REQUEST) {
+		md5(auth, p, 4, zero, 16, p + 20, size - 20, SECRET, strlen(SECRET));
+		return memcmp(auth, p + 4, 16) == 0 ? 0 : -1;
+	}
+
+	a = find(p + 20, size - 20, RAD_ATTR_MESSAGE_AUTHENTICATOR, &len);
+	if (a == NULL || len != 16)
+		return -1;
+	ma = (uint8_t *)a;
+	memcpy(auth, ma, 16);
+	memset(ma, 0, 16);
+	gnutls_hmac_fast(GNUTLS_MAC_MD5, SECRET, strlen(SECRET), p, size, mac);
+	if (memcmp(auth, mac, 16) != 0)
+		return -1;
+
+	a = find(p + 20, size - 20, RAD_ATTR_USER_PASSWORD, &len);
+	if (a == NULL || len % 16 != 0 || len > RAD_MAX_PASSWORD)
+		return -1;
+
+	for (i = 0; i < len; i += 16) {
+		md5(b, SECRET, strlen(SECRET), i == 0 ? p + 4 : a + i - 16, 16, NULL, 0, NULL, 0);
+		for (j = 0; j < 16; j++)
+			pass[i + j] = a[i + j] ^ b[j];
+	}
+	pass[len] = 0;
+
+	return 0;
+}
+
+static void reply(int fd, struct sockaddr *sa, socklen_t salen, const uint8_t *req,
+		  uint8_t code, const uint8_t *attrs, size_t attrs_size)
+{
+	uint8_t p[RAD_MAX_PACKET];
+	size_t size = 20 + attrs_size;
+
+	p[0] = code;
+	p[1] = req[1];
+	p[2] = size >> 8;
+	p[3] = size & 0xff;
+	memcpy(p + 20, attrs, attrs_size);
+	md5(p + 4, p, 4, req + 4, 16, attrs, attrs_size, SECRET, strlen(SECRET));
+
+	sendto(fd, p, size, 0, sa, salen);
+}
+
+/* A radius server which accepts test/test and 'long' with a password
+ * spanning several blocks, and drops the first request of 'drop-once' */
+static void *responder(void *arg)
+{
+	int *fds = arg;
+	struct pollfd pfd[2];
+	struct sockaddr_storage sa;
+	socklen_t salen;
+	uint8_t p[RAD_MAX_PACKET];
+	uint8_t attrs[64];
+	char user[256], pass[RAD_MAX_PASSWORD + 1];
+	const uint8_t *a;
+	size_t len;
+	ssize_t ret;
+	unsigned dropped = 0;
+	uint32_t v;
+
+	pfd[0].fd = fds[0];
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fds[1];
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) <= 0)
+			continue;
+
+		if (pfd[1].revents & POLLIN) {
+			/* the dead server */
+			if (recv(fds[1], p, sizeof(p), 0) > 0) {
+				pthread_mutex_lock(&lock);
+				silent_requests++;
+				pthread_mutex_unlock(&lock);
+			}
+		}
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		salen = sizeof(sa);
+		ret = recvfrom(fds[0], p, sizeof(p), 0, (struct sockaddr *)&sa, &salen);
+		if (ret < 20 || (size_t)ret != (size_t)((p[2] << 8) | p[3]))
+			fail("responder: received malformed packet");
+
+		if (check_request(p, ret, pass) < 0)
+			fail("responder: request authenticator mismatch");
+
+		if (p[0] == RAD_ACCOUNTING_REQUEST) {
+			a = find(p + 20, ret - 20, ATTR_ACCT_STATUS_TYPE, &len);
+			if (a != NULL && len == 4 && a[3] == STATUS_INTERIM) {
+				a = find(p + 20, ret - 20, ATTR_ACCT_INPUT_OCTETS, &len);
+				if (a == NULL || len != 4)
+					fail("responder: no input octets");
+				memcpy(&v, a, 4);
+
+				pthread_mutex_lock(&lock);
+				interims++;
+				interim_octets += ntohl(v);
+				pthread_mutex_unlock(&lock);
+			}
+			reply(fds[0], (struct sockaddr *)&sa, salen, p, RAD_ACCOUNTING_RESPONSE, NULL, 0);
+			continue;
+		}
+
+		a = find(p + 20, ret - 20, RAD_ATTR_USER_NAME, &len);
+		if (a == NULL)
+			fail("responder: no username");
+		memcpy(user, a, len);
+		user[len] = 0;
+
+		if (strcmp(user, "drop-once") == 0 && dropped++ == 0)
+			continue;
+
+		if ((strcmp(user, "test") == 0 && strcmp(pass, "test") == 0) ||
+		    (strcmp(user, "long") == 0 && strcmp(pass, "0123456789abcdefghijklmnop") == 0) ||
+		    strcmp(user, "drop-once") == 0) {
+			attrs[0] = ATTR_FRAMED_IP_ADDRESS;
+			attrs[1] = 6;
+			inet_pton(AF_INET, "192.168.1.1", attrs + 2);
+			reply(fds[0], (struct sockaddr *)&sa, salen, p, RAD_ACCESS_ACCEPT, attrs, 6);
+		} else {
+			attrs[0] = RAD_ATTR_REPLY_MESSAGE;
+			attrs[1] = 2 + strlen("wrong password");
+			memcpy(attrs + 2, "wrong password", strlen("wrong password"));
+			reply(fds[0], (struct sockaddr *)&sa, salen, p, RAD_ACCESS_REJECT, attrs, attrs[1]);
+		}
+	}
+
+	return NULL;
+}
+
+static int auth(rad_engine_st *eng, const char *user, const char *pass, rad_reply_st *rep)
+{
+	rad_request_st *req;
+
+	req = rad_request_new(RAD_ACCESS_REQUEST);
+	if (req == NULL)
+		fail("rad_request_new");
+
+	if (rad_add_str(req, RAD_ATTR_USER_NAME, user) < 0 ||
+	    rad_set_password(req, pass, strlen(pass)) < 0)
+		fail("error in constructing request");
+
+	return rad_send_wait(eng, req, rep);
+}
+
+static void done(void *priv, int code)
+{
+	pthread_mutex_lock(&lock);
+	if (code == RAD_ACCOUNTING_RESPONSE)
+		done_ok++;
+	else if (code == 0)
+		done_superseded++;
+	else
+		done_failed++;
+	pthread_mutex_unlock(&lock);
+}
+
+static void send_acct(rad_engine_st *eng, unsigned status, unsigned octets, const char *key)
+{
+	rad_request_st *req;
+
+	req = rad_request_new(RAD_ACCOUNTING_REQUEST);
+	if (req == NULL)
+		fail("rad_request_new");
+
+	if (rad_add_int(req, ATTR_ACCT_STATUS_TYPE, status) < 0 ||
+	    rad_add_int(req, ATTR_ACCT_INPUT_OCTETS, octets) < 0)
+		fail("error in constructing request");
+
+	if (key && rad_set_key(req, key) < 0)
+		fail("rad_set_key");
+
+	if (rad_send(eng, req, done, NULL) < 0)
+		fail("rad_send");
+}
+
+static void wait_completed(unsigned total)
+{
+	double start = now();
+	unsigned n;
+
+	do {
+		usleep(10000);
+		pthread_mutex_lock(&lock);
+		n = done_ok + done_superseded + done_failed;
+		pthread_mutex_unlock(&lock);
+		if (now() - start > 10)
+			fail("requests were not completed");
+	} while (n < total);
+}
+
+int main(void)
+{
+	rad_engine_st *eng;
+	rad_request_st *req;
+	rad_reply_st rep;
+	pthread_t thread;
+	const uint8_t *a;
+	size_t len;
+	int fds[2];
+	unsigned port, silent_port, i;
+	double start;
+	int ret;
+
+	fds[0] = udp_socket(&port);
+	fds[1] = udp_socket(&silent_port);
+	if (pthread_create(&thread, NULL, responder, fds) != 0)
+		fail("pthread_create");
+
+	eng = rad_engine_new(0.2, 2, 0);
+	if (eng == NULL || rad_engine_add_server(eng, "127.0.0.1", port, SECRET) < 0 ||
+	    rad_engine_start(eng) < 0)
+		fail("error in engine initialization");
+
+	/* authentication */
+	ret = auth(eng, "test", "test", &rep);
+	if (ret != RAD_ACCESS_ACCEPT)
+		fail("test/test was not accepted");
+	a = rad_find_attr(&rep, ATTR_FRAMED_IP_ADDRESS, &len);
+	if (a == NULL || len != 4 || memcmp(a, "\xc0\xa8\x01\x01", 4) != 0)
+		fail("the reply attributes were not received");
+
+	if (auth(eng, "long", "0123456789abcdefghijklmnop", &rep) != RAD_ACCESS_ACCEPT)
+		fail("multi-block password was not accepted");
+
+	ret = auth(eng, "test", "nottest", &rep);
+	if (ret != RAD_ACCESS_REJECT)
+		fail("wrong password was not rejected");
+	a = rad_find_attr(&rep, RAD_ATTR_REPLY_MESSAGE, &len);
+	if (a == NULL || len != strlen("wrong password"))
+		fail("no reply message with reject");
+
+	/* retransmission */
+	if (auth(eng, "drop-once", "x", &rep) != RAD_ACCESS_ACCEPT)
+		fail("request was not retransmitted");
+
+	/* more requests than identifiers outstanding */
+	for (i = 0; i < 1000; i++)
+		send_acct(eng, 1, i, NULL);
+	wait_completed(1000);
+	if (done_ok != 1000)
+		fail("not all accounting requests were replied");
+
+	/* batched interim updates for a single session */
+	for (i = 0; i < 10; i++)
+		send_acct(eng, STATUS_INTERIM, i, "session-1");
+	send_acct(eng, STATUS_INTERIM, 100, "session-2");
+	wait_completed(1011);
+
+	pthread_mutex_lock(&lock);
+	if (interims != 2 || interim_octets != 9 + 100 || done_superseded != 9 || done_ok != 1002 || done_failed != 0) {
+		fprintf(stderr, "interims: %u, superseded: %u, ok: %u, failed: %u\n",
+			interims, done_superseded, done_ok, done_failed);
+		fail("interim updates were not coalesced");
+	}
+	pthread_mutex_unlock(&lock);
+
+	/* a stop replaces the pending interim update of the session */
+	send_acct(eng, STATUS_INTERIM, 1000, "session-3");
+	req = rad_request_new(RAD_ACCOUNTING_REQUEST);
+	if (req == NULL || rad_add_int(req, ATTR_ACCT_STATUS_TYPE, STATUS_STOP) < 0 ||
+	    rad_set_key(req, "session-3") < 0)
+		fail("error in constructing request");
+	if (rad_send_wait(eng, req, &rep) != RAD_ACCOUNTING_RESPONSE)
+		fail("stop was not replied");
+	wait_completed(1012);
+
+	pthread_mutex_lock(&lock);
+	if (interims != 2 || done_superseded != 10)
+		fail("interim update was sent after stop");
+	pthread_mutex_unlock(&lock);
+
+	rad_engine_free(eng);
+
+	/* failover; the first server never replies */
+	eng = rad_engine_new(0.1, 1, 30);
+	if (eng == NULL || rad_engine_add_server(eng, "127.0.0.1", silent_port, SECRET) < 0 ||
+	    rad_engine_add_server(eng, "127.0.0.1", port, SECRET) < 0 ||
+	    rad_engine_start(eng) < 0)
+		fail("error in engine initialization");
+
+	if (auth(eng, "test", "test", &rep) != RAD_ACCESS_ACCEPT)
+		fail("request was not sent to the second server");
+
+	pthread_mutex_lock(&lock);
+	if (silent_requests != 2)
+		fail("request was not retransmitted to the first server");
+	pthread_mutex_unlock(&lock);
+
+	/* the dead server is skipped */
+	start = now();
+	if (auth(eng, "test", "test", &rep) != RAD_ACCESS_ACCEPT)
+		fail("request was not accepted");
+	if (now() - start > 0.19)
+		fail("the dead server was not skipped");
+
+	rad_engine_free(eng);
+
+	/* no server replies */
+	eng = rad_engine_new(0.05, 0, 0);
+	if (eng == NULL || rad_engine_add_server(eng, "127.0.0.1", silent_port, SECRET) < 0 ||
+	    rad_engine_start(eng) < 0)
+		fail("error in engine initialization");
+
+	if (auth(eng, "test", "test", &rep) != -1)
+		fail("request to dead server did not fail");
+
+	rad_engine_free(eng);
+
+	return 0;
+}
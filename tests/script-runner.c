@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <talloc.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../src/main.h"
+#include "../src/script-runner.c"
+
+/* Runs scripts through the script runner, and checks their exit
+ * status, their environment, that no more than the configured number
+ * run at once, and that they can be cancelled before they start. */
+
+#define MAX_SCRIPTS 4
+#define JOBS 20
+
+sigset_t sig_default_set;
+
+static char dir[] = "/tmp/ocserv-script-XXXXXX";
+static char exit_script[64];
+static char count_script[64];
+static char sleep_script[64];
+
+static void write_script(char *path, size_t size, const char *name, const char *text)
+{
+	FILE *fp;
+
+	snprintf(path, size, "%s/%s", dir, name);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "cannot create %s\n", path);
+		exit(1);
+	}
+	fprintf(fp, "#!/bin/sh\n%s", text);
+	fclose(fp);
+	chmod(path, 0700);
+}
+
+static uint32_t next_id = 0;
+
+static uint32_t run(void *pool, int fd, const char *script, const char *code)
+{
+	ScriptRunMsg msg = SCRIPT_RUN_MSG__INIT;
+	char env[64];
+	char *envp[1] = { env };
+
+	msg.id = ++next_id;
+	msg.script = (char *)script;
+	snprintf(env, sizeof(env), "CODE=%s", code);
+	msg.env = envp;
+	msg.n_env = 1;
+
+	if (send_msg(pool, fd, CMD_SCRIPT_RUN, &msg,
+		     (pack_size_func) script_run_msg__get_packed_size,
+		     (pack_func) script_run_msg__pack) < 0) {
+		fprintf(stderr, "error sending script\n");
+		exit(1);
+	}
+	return msg.id;
+}
+
+static void cancel(void *pool, int fd, uint32_t id)
+{
+	ScriptCancelMsg msg = SCRIPT_CANCEL_MSG__INIT;
+
+	msg.id = id;
+	if (send_msg(pool, fd, CMD_SCRIPT_CANCEL, &msg,
+		     (pack_size_func) script_cancel_msg__get_packed_size,
+		     (pack_func) script_cancel_msg__pack) < 0) {
+		fprintf(stderr, "error sending cancel\n");
+		exit(1);
+	}
+}
+
+/* Returns the exit status and sets the id of the next script to exit */
+static unsigned wait_exit(void *pool, int fd, uint32_t *id)
+{
+	ScriptExitMsg *msg = NULL;
+	PROTOBUF_ALLOCATOR(pa, pool);
+	unsigned status;
+
+	if (recv_msg(pool, fd, CMD_SCRIPT_EXIT, (void *)&msg,
+		     (unpack_func) script_exit_msg__unpack, 20) < 0) {
+		fprintf(stderr, "error receiving exit status\n");
+		exit(1);
+	}
+
+	*id = msg->id;
+	status = msg->status;
+	script_exit_msg__free_unpacked(msg, &pa);
+	return status;
+}
+
+int main()
+{
+	main_server_st *s;
+	unsigned status[JOBS + 1];
+	char code[16];
+	uint32_t id, sleepers[MAX_SCRIPTS], queued;
+	unsigned i;
+	int fd[2], wstatus;
+	pid_t pid;
+
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "cannot create a temporary directory\n");
+		exit(1);
+	}
+
+	write_script(exit_script, sizeof(exit_script), "exit.sh", "exit $CODE\n");
+	write_script(count_script, sizeof(count_script), "count.sh",
+		     "touch $0.$$\n"
+		     "n=$(ls $0.* 2>/dev/null | wc -l)\n"
+		     "sleep 0.05\n"
+		     "rm -f $0.$$\n"
+		     "test $n -le $CODE\n");
+	write_script(sleep_script, sizeof(sleep_script), "sleep.sh", "exec sleep $CODE\n");
+
+	s = talloc_zero(NULL, main_server_st);
+	if (s == NULL)
+		exit(1);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+		exit(1);
+
+	pid = fork();
+	if (pid == 0) {
+		close(fd[0]);
+		script_runner_server(s, fd[1], MAX_SCRIPTS);
+		exit(1);
+	}
+	close(fd[1]);
+
+	/* exit status and environment */
+	for (i = 1; i <= JOBS; i++) {
+		snprintf(code, sizeof(code), "%u", i % 3);
+		run(s, fd[0], exit_script, code);
+	}
+
+	memset(status, 0xff, sizeof(status));
+	for (i = 0; i < JOBS; i++) {
+		unsigned st = wait_exit(s, fd[0], &id);
+
+		if (id == 0 || id > JOBS || status[id] != (unsigned)-1) {
+			fprintf(stderr, "unexpected id %u\n", (unsigned)id);
+			exit(1);
+		}
+		status[id] = st;
+	}
+
+	for (i = 1; i <= JOBS; i++) {
+		if (status[i] != i % 3) {
+			fprintf(stderr, "script %u exited with %u\n", i, status[i]);
+			exit(1);
+		}
+	}
+
+	/* a script which cannot be run */
+	run(s, fd[0], "/nonexistent/script", "0");
+	if (wait_exit(s, fd[0], &id) != 1 || id != next_id) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* no more than MAX_SCRIPTS are run at once */
+	snprintf(code, sizeof(code), "%u", MAX_SCRIPTS);
+	for (i = 0; i < 4 * MAX_SCRIPTS; i++)
+		run(s, fd[0], count_script, code);
+
+	for (i = 0; i < 4 * MAX_SCRIPTS; i++) {
+		if (wait_exit(s, fd[0], &id) != 0) {
+			fprintf(stderr, "more than %u scripts were run at once\n", MAX_SCRIPTS);
+			exit(1);
+		}
+	}
+
+	/* a queued script is cancelled, while the running ones finish */
+	for (i = 0; i < MAX_SCRIPTS; i++)
+		sleepers[i] = run(s, fd[0], sleep_script, "0.2");
+	queued = run(s, fd[0], exit_script, "0");
+
+	cancel(s, fd[0], queued);
+	if (wait_exit(s, fd[0], &id) != 1 || id != queued) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	for (i = 0; i < MAX_SCRIPTS; i++)
+		cancel(s, fd[0], sleepers[i]);
+
+	for (i = 0; i < MAX_SCRIPTS; i++) {
+		if (wait_exit(s, fd[0], &id) != 0) {
+			fprintf(stderr, "a running script was stopped\n");
+			exit(1);
+		}
+	}
+
+	/* the runner exits once main closes its socket */
+	close(fd[0]);
+	if (waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+		fprintf(stderr, "the script runner did not exit\n");
+		exit(1);
+	}
+
+	unlink(exit_script);
+	unlink(count_script);
+	unlink(sleep_script);
+	rmdir(dir);
+	talloc_free(s);
+
+	return 0;
+}
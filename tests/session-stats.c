@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "../src/session-stats.c"
+#include "unit-test.h"
+
+/* Checks that the slots are reused in the order they were freed, that
+ * the readers and writers of a freed or reassigned slot fail, and that a reader
+ * never sees a partially written slot while a child process writes it,
+ * as a worker does. */
+
+#define SLOTS 16
+#define READS 100000
+
+static void fill(session_stats_st *st, uint64_t v)
+{
+	st->bytes_in = v;
+	st->bytes_out = v;
+	st->packets_in = v;
+	st->packets_out = v;
+	st->drops = v;
+	st->comp_hits = v;
+	st->comp_misses = v;
+	st->comp_skipped = v;
+	st->comp_ratio = v;
+	st->mtu = v;
+	st->udp_state = v;
+	st->tcp_rtt_us = v;
+	st->dtls_rtt_us = v;
+	st->uptime = v;
+}
+
+static unsigned consistent(const session_stats_st *st)
+{
+	session_stats_st exp;
+
+	fill(&exp, st->bytes_in);
+	return memcmp(&exp, st, sizeof(exp)) == 0;
+}
+
+int main()
+{
+	session_stats_st st;
+	session_stats_slot_st *s;
+	unsigned slot[SLOTS], i, reads = 0;
+	uint32_t gen[SLOTS], g;
+	uint64_t last = 0;
+	pid_t pid;
+	int status;
+
+	CHECK(sizeof(session_stats_slot_st) % 64 == 0);
+
+	CHECK(session_stats_init(SLOTS) == 0);
+
+	for (i = 0; i < SLOTS; i++) {
+		CHECK(session_stats_alloc(&slot[i], &gen[i]) == 0);
+		CHECK(gen[i] != 0);
+		CHECK(session_stats_read(slot[i], gen[i], &st) == 0);
+		CHECK(st.bytes_in == 0);
+	}
+	CHECK(session_stats_alloc(&slot[0], &g) < 0);
+
+	/* the writes are visible with their generation only */
+	s = session_stats_get(slot[3]);
+	CHECK(s != NULL);
+	fill(&st, 42);
+	CHECK(session_stats_write(s, gen[3], &st) == 0);
+	memset(&st, 0, sizeof(st));
+	CHECK(session_stats_read(slot[3], gen[3], &st) == 0);
+	CHECK(st.bytes_in == 42 && consistent(&st));
+	CHECK(session_stats_read(slot[3], gen[3] + 1, &st) < 0);
+	CHECK(session_stats_read(SLOTS, gen[3], &st) < 0);
+
+	/* a freed slot is not readable, and is reused last */
+	session_stats_free(slot[3], gen[3]);
+	session_stats_free(slot[5], gen[5]);
+	CHECK(session_stats_read(slot[3], gen[3], &st) < 0);
+
+	/* the worker of the session cannot write into it any more */
+	fill(&st, 43);
+	CHECK(session_stats_write(s, gen[3], &st) < 0);
+	CHECK(session_stats_read(slot[3], gen[3], &st) < 0);
+
+	CHECK(session_stats_alloc(&i, &g) == 0);
+	CHECK(i == slot[3] && g != gen[3]);
+	CHECK(session_stats_read(i, g, &st) == 0 && st.bytes_in == 0);
+	CHECK(session_stats_read(i, gen[3], &st) < 0);
+	fill(&st, 44);
+	CHECK(session_stats_write(s, gen[3], &st) < 0);
+	CHECK(session_stats_read(i, g, &st) == 0 && st.bytes_in == 0);
+	gen[3] = g;
+
+	/* a writer killed during a write does not block the slot */
+	s = session_stats_get(slot[4]);
+	s->ver |= 1;
+	CHECK(session_stats_read(slot[4], gen[4], &st) < 0);
+	fill(&st, 7);
+	CHECK(session_stats_write(s, gen[4], &st) == 0);
+	CHECK(session_stats_read(slot[4], gen[4], &st) == 0 && st.bytes_in == 7);
+
+	/* a process writes continuously while we read */
+	pid = fork();
+	CHECK(pid >= 0);
+	if (pid == 0) {
+		uint64_t v;
+
+		s = session_stats_get(slot[0]);
+		for (v = 1;; v++) {
+			fill(&st, v);
+			session_stats_write(s, gen[0], &st);
+		}
+	}
+
+	for (i = 0; i < READS; i++) {
+		if (session_stats_read(slot[0], gen[0], &st) < 0)
+			continue;
+		reads++;
+		CHECK(consistent(&st));
+		CHECK(st.bytes_in >= last);
+		last = st.bytes_in;
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+
+	CHECK(reads > 0);
+
+	session_stats_deinit();
+
+	return 0;
+}
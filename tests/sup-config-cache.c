@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <talloc.h>
+
+#include "../src/inih/ini.c"
+#include "../src/ip-util.c"
+#include "../src/config-ports.c"
+#include "../src/sup-config/file.c"
+#include "unit-test.h"
+
+/* Checks that the cached per-group and per-user files, with a group
+ * of many routes, give the same settings as parsing them, and that
+ * changed files are read again. */
+
+#define ROUTES 40
+
+/* from config.c */
+unsigned extract_prefix(char *network)
+{
+	char *p;
+
+	if (network == NULL)
+		return 0;
+
+	p = strchr(network, '/');
+	if (p == NULL)
+		return 0;
+
+	*p = 0;
+	return atoi(p+1);
+}
+
+char *sanitize_config_value(void *pool, const char *value)
+{
+	ssize_t len = strlen(value);
+	unsigned i = 0;
+
+	while(c_isspace(value[len-1]) || value[len-1] == '"')
+		len--;
+
+	while(c_isspace(value[i]) || value[i] == '"') {
+		i++;
+		len--;
+	}
+
+	if (len < 0)
+		return NULL;
+
+	return talloc_strndup(pool, &value[i], len);
+}
+
+int _add_multi_line_val(void *pool, char ***varname, size_t *num,
+		        const char *value)
+{
+	if (*varname == NULL) {
+		*num = 0;
+		*varname = talloc_array(pool, char*, DEFAULT_CONFIG_ENTRIES);
+		if (*varname == NULL)
+			return -1;
+	}
+
+	if (*num >= DEFAULT_CONFIG_ENTRIES-1) {
+		void *tmp = talloc_realloc(pool, *varname, char*, (*num)+2);
+		if (tmp == NULL)
+			return -1;
+		*varname = tmp;
+	}
+
+	(*varname)[*num] = talloc_strdup(*varname, value);
+	(*num)++;
+
+	(*varname)[*num] = NULL;
+	return 0;
+}
+
+static char dir[] = "/tmp/ocserv-sup-config-XXXXXX";
+
+/* replaces the file, as an editor would */
+static void write_file(const char *name, const char *text, unsigned routes)
+{
+	char file[128], tmp[128];
+	FILE *fp;
+	unsigned i;
+
+	snprintf(file, sizeof(file), "%s/%s", dir, name);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	for (i = 0; i < routes; i++)
+		fprintf(fp, "route = 10.%u.%u.0/24\n", i / 256, i % 256);
+	fprintf(fp, "%s", text);
+	fclose(fp);
+
+	if (rename(tmp, file) != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	/* as the event loop of sec-mod would */
+	file_sup_config_changed();
+}
+
+static void *open_session(struct cfg_st *cfg, const char *user, const char *group,
+			  GroupCfgSt *config)
+{
+	SecmSessionReplyMsg rep = SECM_SESSION_REPLY_MSG__INIT;
+	GroupCfgSt init = GROUP_CFG_ST__INIT;
+	client_entry_st e;
+	void *pool;
+
+	memset(&e, 0, sizeof(e));
+	snprintf(e.acct_info.username, sizeof(e.acct_info.username), "%s", user);
+	snprintf(e.acct_info.groupname, sizeof(e.acct_info.groupname), "%s", group);
+
+	*config = init;
+	rep.config = config;
+
+	pool = talloc_new(NULL);
+	if (file_sup_config.get_sup_config(cfg, &e, &rep, pool) < 0) {
+		fprintf(stderr, "error in %d: %s\n", __LINE__, user);
+		exit(1);
+	}
+
+	return pool;
+}
+
+int main()
+{
+	char group_dir[64], user_dir[64], default_user[64];
+	struct list_head vconfig;
+	vhost_cfg_st vhost;
+	struct cfg_st cfg;
+	sec_mod_st sec;
+	GroupCfgSt config;
+	void *pool, *old;
+	unsigned i;
+
+	if (mkdtemp(dir) == NULL)
+		exit(1);
+
+	snprintf(group_dir, sizeof(group_dir), "%s/group", dir);
+	snprintf(user_dir, sizeof(user_dir), "%s/user", dir);
+	snprintf(default_user, sizeof(default_user), "%s/user.default", dir);
+	if (mkdir(group_dir, 0700) != 0 || mkdir(user_dir, 0700) != 0)
+		exit(1);
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.per_group_dir = group_dir;
+	cfg.per_user_dir = user_dir;
+	cfg.default_user_conf = default_user;
+
+	memset(&vhost, 0, sizeof(vhost));
+	vhost.perm_config.config = &cfg;
+	vhost.config_module = &file_sup_config;
+	list_head_init(&vconfig);
+	list_add(&vconfig, &vhost.list);
+
+	memset(&sec, 0, sizeof(sec));
+	sec.vconfig = &vconfig;
+	file_sup_config_reset(&sec);
+
+	write_file("group/admins", "dns = 192.168.1.1\nmtu = 1400\nipv4-network = 192.168.5.0/24\n", ROUTES);
+	write_file("user/alice", "route = 172.16.0.0/16\nmtu = 1300\ndns = 192.168.1.2\n", 0);
+	write_file("user.default", "idle-timeout = 60\n", 0);
+
+	/* the user's settings follow the group's */
+	pool = open_session(&cfg, "alice", "admins", &config);
+	CHECK(config.n_routes == ROUTES + 1);
+	CHECK(strcmp(config.routes[0], "10.0.0.0/255.255.255.0") == 0);
+	CHECK(strcmp(config.routes[ROUTES], "172.16.0.0/255.255.0.0") == 0);
+	CHECK(config.n_dns == 2 && strcmp(config.dns[1], "192.168.1.2") == 0);
+	CHECK(config.has_mtu && config.mtu == 1300);
+	CHECK(strcmp(config.ipv4_netmask, "255.255.255.0") == 0);
+	CHECK(!config.has_idle_timeout);
+	old = pool;
+
+	/* a user without a file gets the default one */
+	pool = open_session(&cfg, "bob", "admins", &config);
+	CHECK(config.n_routes == ROUTES);
+	CHECK(config.has_mtu && config.mtu == 1400);
+	CHECK(config.has_idle_timeout && config.idle_timeout == 60);
+	talloc_free(pool);
+
+	/* the cached files give the same settings again */
+	for (i = 0; i < 10; i++) {
+		pool = open_session(&cfg, "alice", "admins", &config);
+		CHECK(config.n_routes == ROUTES + 1);
+		talloc_free(pool);
+	}
+
+	/* a modified file is read again, while the previous settings
+	 * remain valid for the sessions using them */
+	write_file("user/alice", "mtu = 1200\n", 0);
+	pool = open_session(&cfg, "alice", "admins", &config);
+	CHECK(config.n_routes == ROUTES);
+	CHECK(config.has_mtu && config.mtu == 1200);
+	talloc_free(pool);
+	talloc_free(old);
+
+	/* a removed file is no longer used */
+	snprintf(group_dir, sizeof(group_dir), "%s/group/admins", dir);
+	remove(group_dir);
+	file_sup_config_changed();
+	pool = open_session(&cfg, "alice", "admins", &config);
+	CHECK(config.n_routes == 0 && config.n_dns == 0);
+	CHECK(config.has_mtu && config.mtu == 1200);
+	talloc_free(pool);
+
+	/* the settings are read again after a reload */
+	file_sup_config_reset(&sec);
+	pool = open_session(&cfg, "bob", "users", &config);
+	CHECK(config.has_idle_timeout && config.idle_timeout == 60);
+	talloc_free(pool);
+
+	snprintf(group_dir, sizeof(group_dir), "%s/user/alice", dir);
+	remove(group_dir);
+	remove(default_user);
+	snprintf(group_dir, sizeof(group_dir), "%s/group", dir);
+	rmdir(group_dir);
+	rmdir(user_dir);
+	rmdir(dir);
+	return 0;
+}
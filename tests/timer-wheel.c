@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ccan/container_of/container_of.h>
+
+#include "../src/timer-wheel.c"
+
+/* Checks that the timer wheel returns every entry once its time has
+ * come and not before, as the time advances in steps of various sizes. */
+
+#define ENTRIES 20000
+#define START ((time_t)1500000003)
+
+typedef struct test_entry_st {
+	timer_wheel_entry_st expiry;
+	time_t expires; /* the real time; the wheel's may be shorter */
+	unsigned deleted;
+	unsigned done;
+} test_entry_st;
+
+static int cmp_time(const void *_a, const void *_b)
+{
+	const time_t *a = _a, *b = _b;
+
+	return *a < *b ? -1 : (*a > *b);
+}
+
+/* Returns the due entries, and checks that none is early */
+static unsigned tick(timer_wheel_st *w, time_t now)
+{
+	timer_wheel_entry_st *we;
+	test_entry_st *t;
+	unsigned done = 0;
+
+	while ((we = timer_wheel_expired(w, now)) != NULL) {
+		t = container_of(we, test_entry_st, expiry);
+		if (t->deleted || t->done) {
+			fprintf(stderr, "error in %d\n", __LINE__);
+			exit(1);
+		}
+
+		if (t->expires > now) {
+			/* only entries beyond the wheel are returned early */
+			if (t->expires < START + TW_SPAN) {
+				fprintf(stderr, "error in %d: %ld early\n", __LINE__,
+					(long)(t->expires - now));
+				exit(1);
+			}
+			timer_wheel_add(w, &t->expiry, t->expires);
+			continue;
+		}
+		t->done = 1;
+		done++;
+	}
+
+	return done;
+}
+
+int main()
+{
+	timer_wheel_st w;
+	test_entry_st *entries, *t;
+	time_t *sorted, now = START;
+	unsigned i, n, done = 0, deleted = 0, due = 0;
+
+	entries = calloc(ENTRIES, sizeof(*entries));
+	sorted = calloc(ENTRIES, sizeof(*sorted));
+	if (entries == NULL || sorted == NULL)
+		exit(1);
+
+	srand(7);
+	timer_wheel_init(&w, now);
+
+	for (i = 0; i < ENTRIES; i++) {
+		t = &entries[i];
+
+		switch (i % 8) {
+		case 0: /* already expired */
+			t->expires = now - (rand() % 100);
+			break;
+		case 1: /* beyond the wheel */
+			t->expires = now + TW_SPAN + (rand() % 1000000);
+			break;
+		case 2:
+			t->expires = now + (rand() % 64);
+			break;
+		default:
+			t->expires = now + (((time_t)rand() << 8 | (rand() & 0xff)) % (1 << 22));
+			break;
+		}
+		timer_wheel_add(&w, &t->expiry, t->expires);
+	}
+
+	/* removed entries are not returned */
+	for (i = 5; i < ENTRIES; i += 97) {
+		timer_wheel_del(&w, &entries[i].expiry);
+		entries[i].deleted = 1;
+		deleted++;
+	}
+
+	if (w.entries != ENTRIES - deleted) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	for (i = n = 0; i < ENTRIES; i++) {
+		if (!entries[i].deleted)
+			sorted[n++] = entries[i].expires;
+	}
+	qsort(sorted, n, sizeof(sorted[0]), cmp_time);
+
+	/* the first tick returns the entries already expired */
+	now++;
+	while (due < n && sorted[due] <= now)
+		due++;
+	done = tick(&w, now);
+	if (done != due) {
+		fprintf(stderr, "error in %d: %u/%u\n", __LINE__, done, due);
+		exit(1);
+	}
+
+	/* advance in steps from one second to a few hours */
+	while (done < n) {
+		switch (rand() % 4) {
+		case 0:
+			now += 1;
+			break;
+		case 1:
+			now += rand() % 64;
+			break;
+		default:
+			now += rand() % 20000;
+			break;
+		}
+
+		done += tick(&w, now);
+
+		/* everything due was returned */
+		while (due < n && sorted[due] <= now)
+			due++;
+		if (done != due) {
+			fprintf(stderr, "error in %d: %u/%u\n", __LINE__, done, due);
+			exit(1);
+		}
+	}
+
+	if (w.entries != 0) {
+		fprintf(stderr, "error in %d\n", __LINE__);
+		exit(1);
+	}
+
+	free(entries);
+	free(sorted);
+	return 0;
+}
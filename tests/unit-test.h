@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2018 Nikos Mavrogiannopoulos
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef UNIT_TEST_H
+# define UNIT_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Fails the test, with the line and the condition, unless x holds */
+#define CHECK(x) \
+	if (!(x)) { \
+		fprintf(stderr, "error in %d: %s\n", __LINE__, #x); \
+		exit(1); \
+	}
+
+#endif